@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+static int64_t now_us(void) {
+  LARGE_INTEGER f, c;
+  QueryPerformanceFrequency(&f);
+  QueryPerformanceCounter(&c);
+  return (int64_t)((c.QuadPart * 1000000LL) / f.QuadPart);
+}
+
+#define DEFINE_MATRIX_RUN(T, NAME)                                                                      \
+  static int NAME(int64_t seed, int64_t n, int64_t reps, int64_t *checksum, int64_t *elapsed) {         \
+    const size_t nn = (size_t)n * (size_t)n;                                                            \
+    T *a = (T *)malloc(nn * sizeof(T));                                                                 \
+    T *b = (T *)malloc(nn * sizeof(T));                                                                 \
+    T *c = (T *)malloc(nn * sizeof(T));                                                                 \
+    T *ct = (T *)malloc(nn * sizeof(T));                                                                \
+    T *sums = (T *)malloc((size_t)n * sizeof(T));                                                       \
+    if (!a || !b || !c || !ct || !sums) {                                                               \
+      free(a);                                                                                          \
+      free(b);                                                                                          \
+      free(c);                                                                                          \
+      free(ct);                                                                                         \
+      free(sums);                                                                                       \
+      return 0;                                                                                         \
+    }                                                                                                   \
+    for (int64_t i = 0; i < n; ++i) {                                                                   \
+      for (int64_t j = 0; j < n; ++j) {                                                                 \
+        a[i * n + j] = (T)((i * 31 + j * 17 + seed) % 13 - 6);                                          \
+        b[i * n + j] = (T)((i * 7 + j * 29 + seed) % 11 - 5);                                           \
+      }                                                                                                 \
+    }                                                                                                   \
+    *checksum = 0;                                                                                      \
+    int64_t t0 = now_us();                                                                              \
+    for (int64_t r = 0; r < reps; ++r) {                                                                \
+      memset(c, 0, nn * sizeof(T));                                                                     \
+      for (int64_t i = 0; i < n; ++i) {                                                                 \
+        for (int64_t k = 0; k < n; ++k) {                                                               \
+          const T s = a[i * n + k];                                                                     \
+          for (int64_t j = 0; j < n; ++j) c[i * n + j] += s * b[k * n + j];                             \
+        }                                                                                               \
+      }                                                                                                 \
+      for (int64_t i = 0; i < n; ++i) {                                                                 \
+        for (int64_t j = 0; j < n; ++j) ct[j * n + i] = c[i * n + j];                                   \
+      }                                                                                                 \
+      for (int64_t i = 0; i < n; ++i) {                                                                 \
+        double sum = 0.0;                                                                               \
+        for (int64_t j = 0; j < n; ++j) sum += (double)ct[i * n + j];                                   \
+        sums[i] = (T)sum;                                                                               \
+      }                                                                                                 \
+      double total = 0.0;                                                                               \
+      for (int64_t i = 0; i < n; ++i) total += (double)sums[i];                                         \
+      *checksum += (int64_t)total + (int64_t)ct[(r % n) * n + (r * 7) % n];                             \
+      const int64_t at = (r * 13) % (n * n);                                                            \
+      a[at] += (T)1;                                                                                    \
+    }                                                                                                   \
+    *elapsed = now_us() - t0;                                                                           \
+    free(a);                                                                                            \
+    free(b);                                                                                            \
+    free(c);                                                                                            \
+    free(ct);                                                                                           \
+    free(sums);                                                                                         \
+    return 1;                                                                                           \
+  }
+
+DEFINE_MATRIX_RUN(double, run_f64)
+DEFINE_MATRIX_RUN(float, run_f32)
+
+int main(void) {
+  int64_t seed = 0, mode = 0, n = 1, reps = 1;
+  scanf("%lld", &seed);
+  scanf("%lld", &mode);
+  scanf("%lld", &n);
+  scanf("%lld", &reps);
+  if (n < 1) n = 1;
+  if (reps < 1) reps = 1;
+
+  int64_t checksum = 0, elapsed = 0;
+  const int ok = mode == 1 ? run_f32(seed, n, reps, &checksum, &elapsed) : run_f64(seed, n, reps, &checksum, &elapsed);
+  if (!ok) {
+    printf("-1\n0\n");
+    return 0;
+  }
+  printf("%lld\n", (long long)checksum);
+  printf("%lld\n", (long long)elapsed);
+  return 0;
+}
@@ -0,0 +1,105 @@
+const std = @import("std");
+
+fn readVals(out: []i64) void {
+    var stdin_file = std.fs.File.stdin();
+    var input_buf: [512]u8 = undefined;
+    const n = stdin_file.readAll(&input_buf) catch 0;
+    var it = std.mem.tokenizeAny(u8, input_buf[0..n], " \r\n\t");
+    var i: usize = 0;
+    while (i < out.len) : (i += 1) {
+        if (it.next()) |tok| {
+            out[i] = std.fmt.parseInt(i64, tok, 10) catch 0;
+        } else {
+            out[i] = 0;
+        }
+    }
+}
+
+fn run(comptime T: type, seed: i64, n: i64, reps: i64, elapsed_us: *u64) ?i64 {
+    const allocator = std.heap.page_allocator;
+    const nu: usize = @intCast(n);
+    const nn = nu * nu;
+    const a = allocator.alloc(T, nn) catch return null;
+    defer allocator.free(a);
+    const b = allocator.alloc(T, nn) catch return null;
+    defer allocator.free(b);
+    const c = allocator.alloc(T, nn) catch return null;
+    defer allocator.free(c);
+    const ct = allocator.alloc(T, nn) catch return null;
+    defer allocator.free(ct);
+    const sums = allocator.alloc(T, nu) catch return null;
+    defer allocator.free(sums);
+
+    var i: usize = 0;
+    while (i < nu) : (i += 1) {
+        var j: usize = 0;
+        while (j < nu) : (j += 1) {
+            const ii: i64 = @intCast(i);
+            const jj: i64 = @intCast(j);
+            a[i * nu + j] = @floatFromInt(@mod(ii * 31 + jj * 17 + seed, 13) - 6);
+            b[i * nu + j] = @floatFromInt(@mod(ii * 7 + jj * 29 + seed, 11) - 5);
+        }
+    }
+
+    var checksum: i64 = 0;
+    var timer = std.time.Timer.start() catch unreachable;
+    const reps_u: usize = @intCast(reps);
+    var r: usize = 0;
+    while (r < reps_u) : (r += 1) {
+        @memset(c, 0);
+        i = 0;
+        while (i < nu) : (i += 1) {
+            var k: usize = 0;
+            while (k < nu) : (k += 1) {
+                const s = a[i * nu + k];
+                var j: usize = 0;
+                while (j < nu) : (j += 1) c[i * nu + j] += s * b[k * nu + j];
+            }
+        }
+        i = 0;
+        while (i < nu) : (i += 1) {
+            var j: usize = 0;
+            while (j < nu) : (j += 1) ct[j * nu + i] = c[i * nu + j];
+        }
+        i = 0;
+        while (i < nu) : (i += 1) {
+            var sum: f64 = 0.0;
+            var j: usize = 0;
+            while (j < nu) : (j += 1) {
+                const x: f64 = ct[i * nu + j];
+                sum += x;
+            }
+            sums[i] = @floatCast(sum);
+        }
+        var total: f64 = 0.0;
+        for (sums) |x| {
+            const w: f64 = x;
+            total += w;
+        }
+        const pick: f64 = ct[(r % nu) * nu + (r * 7) % nu];
+        checksum += @as(i64, @intFromFloat(total)) + @as(i64, @intFromFloat(pick));
+        a[(r * 13) % nn] += 1;
+    }
+    elapsed_us.* = @divFloor(timer.read(), 1000);
+    return checksum;
+}
+
+pub fn main() void {
+    var vals: [4]i64 = undefined;
+    readVals(vals[0..]);
+    const seed = vals[0];
+    const mode = vals[1];
+    var n = vals[2];
+    var reps = vals[3];
+    if (n < 1) n = 1;
+    if (reps < 1) reps = 1;
+
+    var elapsed_us: u64 = 0;
+    const result = if (mode == 1) run(f32, seed, n, reps, &elapsed_us) else run(f64, seed, n, reps, &elapsed_us);
+    const out = std.fs.File.stdout().deprecatedWriter();
+    if (result) |checksum| {
+        out.print("{d}\n{d}\n", .{ checksum, elapsed_us }) catch unreachable;
+    } else {
+        out.print("-1\n0\n", .{}) catch unreachable;
+    }
+}
@@ -1,9 +1,14 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
 #include <cmath>
 #include <cctype>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
@@ -11,22 +16,32 @@
 #include <iterator>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 #if defined(_WIN32)
 #include <windows.h>
+#include <psapi.h>
 #ifdef max
 #undef max
 #endif
 #ifdef min
 #undef min
 #endif
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 #if defined(_MSC_VER) && !defined(__clang__)
@@ -200,10 +215,35 @@ static const char *tokenKindName(TokenKind k) {
   return "Unknown";
 }
 
+// Every token spelling is interned once per thread, so a token is a kind, a
+// pointer and a span; equal spellings share one string and compare by address.
+class Interner {
+public:
+  const std::string &intern(std::string_view sv) {
+    auto it = index_.find(sv);
+    if (it != index_.end()) return *it->second;
+    const std::string &owned = store_.emplace_back(sv);
+    index_.emplace(std::string_view(owned), &owned);
+    return owned;
+  }
+  std::size_t size() const { return store_.size(); }
+
+private:
+  std::deque<std::string> store_;
+  std::unordered_map<std::string_view, const std::string *> index_;
+};
+
+static Interner &spellings() {
+  static thread_local Interner in;
+  return in;
+}
+
 struct Token {
   TokenKind kind = TokenKind::End;
-  std::string text;
+  const std::string *spelling = &spellings().intern("");
   Span span;
+  const std::string &text() const { return *spelling; }
+  bool sameSpelling(const Token &o) const { return spelling == o.spelling; }
 };
 
 class Lexer {
@@ -212,17 +252,18 @@ public:
 
   std::vector<Token> run() {
     std::vector<Token> out;
+    out.reserve(src_.size() / 3 + 16);
     while (true) {
       skipTrivia();
       if (eof()) {
-        out.push_back({TokenKind::End, "", {line_, col_}});
+        out.push_back(tok(TokenKind::End, "", {line_, col_}));
         break;
       }
       Span s{line_, col_};
       char c = peek();
       if (c == '\n') {
         adv();
-        out.push_back({TokenKind::Newline, "\\n", s});
+        out.push_back(tok(TokenKind::Newline, "\\n", s));
         continue;
       }
       if (std::isalpha(static_cast<unsigned char>(c)) || c == '_') {
@@ -240,49 +281,49 @@ public:
       if (c == '-' && peek(1) == '>') {
         adv();
         adv();
-        out.push_back({TokenKind::Arrow, "->", s});
+        out.push_back(tok(TokenKind::Arrow, "->", s));
         continue;
       }
       if (c == '=' && peek(1) == '=') {
         adv();
         adv();
-        out.push_back({TokenKind::Eq, "==", s});
+        out.push_back(tok(TokenKind::Eq, "==", s));
         continue;
       }
       if (c == '&' && peek(1) == '&') {
         adv();
         adv();
-        out.push_back({TokenKind::AndAnd, "&&", s});
+        out.push_back(tok(TokenKind::AndAnd, "&&", s));
         continue;
       }
       if (c == '|' && peek(1) == '|') {
         adv();
         adv();
-        out.push_back({TokenKind::OrOr, "||", s});
+        out.push_back(tok(TokenKind::OrOr, "||", s));
         continue;
       }
       if (c == '!' && peek(1) == '=') {
         adv();
         adv();
-        out.push_back({TokenKind::Neq, "!=", s});
+        out.push_back(tok(TokenKind::Neq, "!=", s));
         continue;
       }
       if (c == '<' && peek(1) == '=') {
         adv();
         adv();
-        out.push_back({TokenKind::Lte, "<=", s});
+        out.push_back(tok(TokenKind::Lte, "<=", s));
         continue;
       }
       if (c == '>' && peek(1) == '=') {
         adv();
         adv();
-        out.push_back({TokenKind::Gte, ">=", s});
+        out.push_back(tok(TokenKind::Gte, ">=", s));
         continue;
       }
       if (c == '.' && peek(1) == '.') {
         adv();
         adv();
-        out.push_back({TokenKind::DotDot, "..", s});
+        out.push_back(tok(TokenKind::DotDot, "..", s));
         continue;
       }
       if (c == '*' && peek(1) == '*') {
@@ -290,84 +331,84 @@ public:
           adv();
           adv();
           adv();
-          out.push_back({TokenKind::PowAssign, "**=", s});
+          out.push_back(tok(TokenKind::PowAssign, "**=", s));
           continue;
         }
         adv();
         adv();
-        out.push_back({TokenKind::Pow, "**", s});
+        out.push_back(tok(TokenKind::Pow, "**", s));
         continue;
       }
       if (c == '+' && peek(1) == '=') {
         adv();
         adv();
-        out.push_back({TokenKind::PlusAssign, "+=", s});
+        out.push_back(tok(TokenKind::PlusAssign, "+=", s));
         continue;
       }
       if (c == '+' && peek(1) == '+') {
         adv();
         adv();
-        out.push_back({TokenKind::PlusPlus, "++", s});
+        out.push_back(tok(TokenKind::PlusPlus, "++", s));
         continue;
       }
       if (c == '-' && peek(1) == '=') {
         adv();
         adv();
-        out.push_back({TokenKind::MinusAssign, "-=", s});
+        out.push_back(tok(TokenKind::MinusAssign, "-=", s));
         continue;
       }
       if (c == '-' && peek(1) == '-') {
         adv();
         adv();
-        out.push_back({TokenKind::MinusMinus, "--", s});
+        out.push_back(tok(TokenKind::MinusMinus, "--", s));
         continue;
       }
       if (c == '*' && peek(1) == '=') {
         adv();
         adv();
-        out.push_back({TokenKind::StarAssign, "*=", s});
+        out.push_back(tok(TokenKind::StarAssign, "*=", s));
         continue;
       }
       if (c == '/' && peek(1) == '=') {
         adv();
         adv();
-        out.push_back({TokenKind::SlashAssign, "/=", s});
+        out.push_back(tok(TokenKind::SlashAssign, "/=", s));
         continue;
       }
       if (c == '%' && peek(1) == '=') {
         adv();
         adv();
-        out.push_back({TokenKind::PercentAssign, "%=", s});
+        out.push_back(tok(TokenKind::PercentAssign, "%=", s));
         continue;
       }
       if (c == '^' && peek(1) == '=') {
         adv();
         adv();
-        out.push_back({TokenKind::PowAssign, "^=", s});
+        out.push_back(tok(TokenKind::PowAssign, "^=", s));
         continue;
       }
       adv();
       switch (c) {
-      case ':': out.push_back({TokenKind::Colon, ":", s}); break;
-      case ';': out.push_back({TokenKind::Semi, ";", s}); break;
-      case ',': out.push_back({TokenKind::Comma, ",", s}); break;
-      case '.': out.push_back({TokenKind::Dot, ".", s}); break;
-      case '(': out.push_back({TokenKind::LPar, "(", s}); break;
-      case ')': out.push_back({TokenKind::RPar, ")", s}); break;
-      case '{': out.push_back({TokenKind::LBra, "{", s}); break;
-      case '}': out.push_back({TokenKind::RBra, "}", s}); break;
-      case '[': out.push_back({TokenKind::LBra, "[", s}); break;
-      case ']': out.push_back({TokenKind::RBra, "]", s}); break;
-      case '+': out.push_back({TokenKind::Plus, "+", s}); break;
-      case '-': out.push_back({TokenKind::Minus, "-", s}); break;
-      case '*': out.push_back({TokenKind::Star, "*", s}); break;
-      case '^': out.push_back({TokenKind::Pow, "^", s}); break;
-      case '/': out.push_back({TokenKind::Slash, "/", s}); break;
-      case '%': out.push_back({TokenKind::Percent, "%", s}); break;
-      case '=': out.push_back({TokenKind::Assign, "=", s}); break;
-      case '!': out.push_back({TokenKind::Bang, "!", s}); break;
-      case '<': out.push_back({TokenKind::Lt, "<", s}); break;
-      case '>': out.push_back({TokenKind::Gt, ">", s}); break;
+      case ':': out.push_back(tok(TokenKind::Colon, ":", s)); break;
+      case ';': out.push_back(tok(TokenKind::Semi, ";", s)); break;
+      case ',': out.push_back(tok(TokenKind::Comma, ",", s)); break;
+      case '.': out.push_back(tok(TokenKind::Dot, ".", s)); break;
+      case '(': out.push_back(tok(TokenKind::LPar, "(", s)); break;
+      case ')': out.push_back(tok(TokenKind::RPar, ")", s)); break;
+      case '{': out.push_back(tok(TokenKind::LBra, "{", s)); break;
+      case '}': out.push_back(tok(TokenKind::RBra, "}", s)); break;
+      case '[': out.push_back(tok(TokenKind::LBra, "[", s)); break;
+      case ']': out.push_back(tok(TokenKind::RBra, "]", s)); break;
+      case '+': out.push_back(tok(TokenKind::Plus, "+", s)); break;
+      case '-': out.push_back(tok(TokenKind::Minus, "-", s)); break;
+      case '*': out.push_back(tok(TokenKind::Star, "*", s)); break;
+      case '^': out.push_back(tok(TokenKind::Pow, "^", s)); break;
+      case '/': out.push_back(tok(TokenKind::Slash, "/", s)); break;
+      case '%': out.push_back(tok(TokenKind::Percent, "%", s)); break;
+      case '=': out.push_back(tok(TokenKind::Assign, "=", s)); break;
+      case '!': out.push_back(tok(TokenKind::Bang, "!", s)); break;
+      case '<': out.push_back(tok(TokenKind::Lt, "<", s)); break;
+      case '>': out.push_back(tok(TokenKind::Gt, ">", s)); break;
       default: throw CompileError(s, std::string("unexpected char '") + c + "'");
       }
     }
@@ -376,8 +417,12 @@ public:
 
 private:
   std::string src_;
+  std::string lit_;
   std::size_t pos_ = 0, line_ = 1, col_ = 1;
 
+  static Token tok(TokenKind k, std::string_view spelling, Span s) { return {k, &spellings().intern(spelling), s}; }
+  std::string_view slice(std::size_t from) const { return std::string_view(src_).substr(from, pos_ - from); }
+
   bool eof() const { return pos_ >= src_.size(); }
   char peek(std::size_t off = 0) const { return pos_ + off < src_.size() ? src_[pos_ + off] : '\0'; }
   char adv() {
@@ -411,72 +456,78 @@ private:
 
   Token readIdent() {
     Span s{line_, col_};
-    std::string t;
+    const std::size_t from = pos_;
     while (!eof()) {
       char c = peek();
       if (std::isalnum(static_cast<unsigned char>(c)) || c == '_')
-        t.push_back(adv());
+        adv();
       else
         break;
     }
-    if (t == "fn" || t == "func") return {TokenKind::KwFn, t, s};
-    if (t == "inline") return {TokenKind::KwInline, t, s};
-    if (t == "extern") return {TokenKind::KwExtern, t, s};
-    if (t == "let") return {TokenKind::KwLet, t, s};
-    if (t == "var") return {TokenKind::KwVar, t, s};
-    if (t == "const") return {TokenKind::KwConst, t, s};
-    if (t == "declare") return {TokenKind::KwDeclare, t, s};
-    if (t == "owned") return {TokenKind::KwOwned, t, s};
-    if (t == "return") return {TokenKind::KwReturn, t, s};
-    if (t == "if") return {TokenKind::KwIf, t, s};
-    if (t == "unless") return {TokenKind::KwUnless, t, s};
-    if (t == "elif") return {TokenKind::KwElif, t, s};
-    if (t == "else") return {TokenKind::KwElse, t, s};
-    if (t == "while") return {TokenKind::KwWhile, t, s};
-    if (t == "for") return {TokenKind::KwFor, t, s};
-    if (t == "parallel") return {TokenKind::KwParallel, t, s};
-    if (t == "macro") return {TokenKind::KwMacro, t, s};
-    if (t == "class") return {TokenKind::KwClass, t, s};
-    if (t == "in") return {TokenKind::KwIn, t, s};
-    if (t == "step") return {TokenKind::KwStep, t, s};
-    if (t == "do") return {TokenKind::KwDo, t, s};
-    if (t == "end") return {TokenKind::KwEnd, t, s};
-    if (t == "throws") return {TokenKind::KwThrows, t, s};
-    if (t == "break") return {TokenKind::KwBreak, t, s};
-    if (t == "continue") return {TokenKind::KwContinue, t, s};
-    if (t == "and") return {TokenKind::AndAnd, t, s};
-    if (t == "or") return {TokenKind::OrOr, t, s};
-    if (t == "not") return {TokenKind::Bang, t, s};
-    if (t == "true") return {TokenKind::KwTrue, t, s};
-    if (t == "false") return {TokenKind::KwFalse, t, s};
-    return {TokenKind::Id, t, s};
+    const std::string_view t = slice(from);
+    static const std::unordered_map<std::string_view, TokenKind> kKeywords = {
+        {"fn", TokenKind::KwFn},
+        {"func", TokenKind::KwFn},
+        {"inline", TokenKind::KwInline},
+        {"extern", TokenKind::KwExtern},
+        {"let", TokenKind::KwLet},
+        {"var", TokenKind::KwVar},
+        {"const", TokenKind::KwConst},
+        {"declare", TokenKind::KwDeclare},
+        {"owned", TokenKind::KwOwned},
+        {"return", TokenKind::KwReturn},
+        {"if", TokenKind::KwIf},
+        {"unless", TokenKind::KwUnless},
+        {"elif", TokenKind::KwElif},
+        {"else", TokenKind::KwElse},
+        {"while", TokenKind::KwWhile},
+        {"for", TokenKind::KwFor},
+        {"parallel", TokenKind::KwParallel},
+        {"macro", TokenKind::KwMacro},
+        {"class", TokenKind::KwClass},
+        {"in", TokenKind::KwIn},
+        {"step", TokenKind::KwStep},
+        {"do", TokenKind::KwDo},
+        {"end", TokenKind::KwEnd},
+        {"throws", TokenKind::KwThrows},
+        {"break", TokenKind::KwBreak},
+        {"continue", TokenKind::KwContinue},
+        {"and", TokenKind::AndAnd},
+        {"or", TokenKind::OrOr},
+        {"not", TokenKind::Bang},
+        {"true", TokenKind::KwTrue},
+        {"false", TokenKind::KwFalse},
+    };
+    auto kw = kKeywords.find(t);
+    return tok(kw != kKeywords.end() ? kw->second : TokenKind::Id, t, s);
   }
 
   Token readNumber() {
     Span s{line_, col_};
-    std::string t;
+    const std::size_t from = pos_;
     bool dot = false;
     while (!eof()) {
       char c = peek();
       if (std::isdigit(static_cast<unsigned char>(c))) {
-        t.push_back(adv());
+        adv();
       } else if (c == '.' && !dot && std::isdigit(static_cast<unsigned char>(peek(1)))) {
         dot = true;
-        t.push_back(adv());
+        adv();
       } else {
         break;
       }
     }
-    return {dot ? TokenKind::Float : TokenKind::Int, t, s};
+    return tok(dot ? TokenKind::Float : TokenKind::Int, slice(from), s);
   }
 
   Token readString() {
     Span s{line_, col_};
     adv(); // opening quote
-    std::string out;
+    std::string &out = lit_;
+    out.clear();
     while (!eof()) {
       char c = adv();
-      if (c == '"') return {TokenKind::Str, out, s};
+      if (c == '"') return tok(TokenKind::Str, out, s);
       if (c == '\\') {
         if (eof()) throw CompileError(s, "unterminated escape sequence in string literal");
         const char esc = adv();
@@ -497,10 +548,22 @@ private:
   }
 };
 
-enum class Type { I32, I64, F32, F64, Bool, Str, Void };
+enum class Type { I32, I64, F32, F64, Bool, Str, Void, F32x4, F32x8, F64x4, I64x4 };
 static bool isInt(Type t) { return t == Type::I32 || t == Type::I64; }
 static bool isFloat(Type t) { return t == Type::F32 || t == Type::F64; }
 static bool isNum(Type t) { return isInt(t) || isFloat(t); }
+// Fixed-width SIMD values: lane-wise arithmetic only, never mixed with other vector types.
+static bool isVec(Type t) { return t == Type::F32x4 || t == Type::F32x8 || t == Type::F64x4 || t == Type::I64x4; }
+static int vecLanes(Type t) { return t == Type::F32x8 ? 8 : (isVec(t) ? 4 : 1); }
+static Type vecLaneType(Type t) {
+  switch (t) {
+  case Type::F32x4:
+  case Type::F32x8: return Type::F32;
+  case Type::F64x4: return Type::F64;
+  case Type::I64x4: return Type::I64;
+  default: return t;
+  }
+}
 static std::string typeName(Type t) {
   switch (t) {
   case Type::I32: return "i32";
@@ -510,6 +573,10 @@ static std::string typeName(Type t) {
   case Type::Bool: return "bool";
   case Type::Str: return "str";
   case Type::Void: return "void";
+  case Type::F32x4: return "f32x4";
+  case Type::F32x8: return "f32x8";
+  case Type::F64x4: return "f64x4";
+  case Type::I64x4: return "i64x4";
   }
   return "<?>"; // unreachable
 }
@@ -518,6 +585,66 @@ enum class EK { Int, Float, Bool, Str, Var, Unary, Binary, Call };
 enum class UK { Neg, Not };
 enum class BK { Add, Sub, Mul, Div, Mod, Pow, Eq, Neq, Lt, Lte, Gt, Gte, And, Or };
 
+// AST nodes are carved from per-thread 64KB blocks in 16-byte size classes.
+// Freed nodes go back on their class list, so rebuilding a tree (macro
+// expansion, optimizer rewrites, watch-mode recompiles) reuses the same memory.
+// Blocks are chained and never returned; the slab is trivially destructible so
+// a node may safely outlive the thread that allocated it.
+class NodePool {
+public:
+  static void *take(std::size_t n) {
+    if (n > kMaxNode) return ::operator new(n);
+    Slab &sl = slab();
+    const std::size_t c = (n + kGrain - 1) / kGrain;
+    if (Free *f = sl.free[c]) {
+      sl.free[c] = f->next;
+      return f;
+    }
+    const std::size_t bytes = c * kGrain;
+    if (sl.left < bytes) {
+      auto *block = static_cast<unsigned char *>(::operator new(kBlock));
+      *reinterpret_cast<unsigned char **>(block) = sl.chain;
+      sl.chain = block;
+      sl.bump = block + kGrain;
+      sl.left = kBlock - kGrain;
+    }
+    void *p = sl.bump;
+    sl.bump += bytes;
+    sl.left -= bytes;
+    return p;
+  }
+  static void give(void *p, std::size_t n) {
+    if (!p) return;
+    if (n > kMaxNode) {
+      ::operator delete(p);
+      return;
+    }
+    Slab &sl = slab();
+    const std::size_t c = (n + kGrain - 1) / kGrain;
+    Free *f = static_cast<Free *>(p);
+    f->next = sl.free[c];
+    sl.free[c] = f;
+  }
+
+private:
+  static constexpr std::size_t kGrain = 16;
+  static constexpr std::size_t kMaxNode = 256;
+  static constexpr std::size_t kBlock = 64 * 1024;
+  struct Free {
+    Free *next;
+  };
+  struct Slab {
+    unsigned char *chain = nullptr;
+    unsigned char *bump = nullptr;
+    std::size_t left = 0;
+    Free *free[kMaxNode / kGrain + 1] = {};
+  };
+  static Slab &slab() {
+    static thread_local Slab sl;
+    return sl;
+  }
+};
+
 struct Expr {
   EK k;
   Span s;
@@ -525,6 +652,8 @@ struct Expr {
   bool typed = false;
   Expr(EK kIn, Span sIn) : k(kIn), s(sIn) {}
   virtual ~Expr() = default;
+  static void *operator new(std::size_t n) { return NodePool::take(n); }
+  static void operator delete(void *p, std::size_t n) { NodePool::give(p, n); }
 };
 using EP = std::unique_ptr<Expr>;
 
@@ -574,6 +703,8 @@ struct Stmt {
   Span s;
   Stmt(SK kIn, Span sIn) : k(kIn), s(sIn) {}
   virtual ~Stmt() = default;
+  static void *operator new(std::size_t n) { return NodePool::take(n); }
+  static void operator delete(void *p, std::size_t n) { NodePool::give(p, n); }
 };
 using SP = std::unique_ptr<Stmt>;
 
@@ -613,12 +744,21 @@ struct SWhile : Stmt {
   std::vector<SP> b;
   SWhile(EP cIn, std::vector<SP> bIn, Span s) : Stmt(SK::While, s), c(std::move(cIn)), b(std::move(bIn)) {}
 };
+struct ParReduction {
+  std::string op; // "+", "*", "min", "max", "and", "or"
+  std::string var;
+};
 struct SFor : Stmt {
   std::string n;
   EP start;
   EP stop;
   EP step;
   bool parallel = false;
+  // parallel-only clauses: reduce(op: var, ...), schedule(kind), grain(N), threshold(N)
+  std::vector<ParReduction> reductions;
+  std::string schedule;     // empty = static
+  int64_t grain = 0;        // schedule chunk size; 0 = runtime default
+  int64_t minIters = -1;    // trip count needed to run in parallel; -1 = LS_PAR_MIN_ITERS
   std::vector<SP> b;
   SFor(std::string nIn, EP startIn, EP stopIn, EP stepIn, bool parallelIn, std::vector<SP> bIn, Span s)
       : Stmt(SK::For, s), n(std::move(nIn)), start(std::move(startIn)), stop(std::move(stopIn)),
@@ -858,6 +998,8 @@ private:
   std::unordered_map<std::string, std::vector<OverloadDecl>> topFnOverloads_;
   std::unordered_map<std::string, MacroDecl> macros_;
   std::size_t topFnOverloadId_ = 0;
+  std::size_t benchSerial_ = 0;
+  int benchDepth_ = 0;
   std::string currentClass_;
 
   const Token &cur() const { return t_[i_]; }
@@ -982,7 +1124,7 @@ private:
       ++j;
       j = skipNlFrom(j);
     }
-    if (j < t_.size() && t_[j].kind == TokenKind::Id && t_[j].text == "flag") {
+    if (j < t_.size() && t_[j].kind == TokenKind::Id && t_[j].text() == "flag") {
       ++j;
       j = skipNlFrom(j);
       if (j >= t_.size() || t_[j].kind != TokenKind::Id) return false;
@@ -998,10 +1140,10 @@ private:
       return j < t_.size() && t_[j].kind == TokenKind::LPar;
     }
     if (j >= t_.size() || t_[j].kind != TokenKind::Id) return false;
-    if (t_[j].text == "operator") {
+    if (t_[j].text() == "operator") {
       ++j;
       j = skipNlFrom(j);
-      if (j < t_.size() && t_[j].kind == TokenKind::Id && t_[j].text == "unary") {
+      if (j < t_.size() && t_[j].kind == TokenKind::Id && t_[j].text() == "unary") {
         ++j;
         j = skipNlFrom(j);
       }
@@ -1093,22 +1235,22 @@ private:
     throw CompileError(cur().span, msg);
   }
   MacroArgKind parseMacroArgKindToken(const Token &tok) {
-    if (tok.text == "expr") return MacroArgKind::Expr;
-    if (tok.text == "stmt") return MacroArgKind::Stmt;
-    if (tok.text == "item") return MacroArgKind::Item;
-    throw CompileError(tok.span, "unknown macro kind '" + tok.text + "' (expected expr|stmt|item)");
+    if (tok.text() == "expr") return MacroArgKind::Expr;
+    if (tok.text() == "stmt") return MacroArgKind::Stmt;
+    if (tok.text() == "item") return MacroArgKind::Item;
+    throw CompileError(tok.span, "unknown macro kind '" + tok.text() + "' (expected expr|stmt|item)");
   }
   void parseMacroDecl() {
     Token nameTok = need(TokenKind::Id, "expected macro name");
-    if (macros_.count(nameTok.text)) {
-      throw CompileError(nameTok.span, "duplicate macro '" + nameTok.text + "'");
+    if (macros_.count(nameTok.text())) {
+      throw CompileError(nameTok.span, "duplicate macro '" + nameTok.text() + "'");
     }
     std::vector<MacroParam> params;
     need(TokenKind::LPar, "expected '(' after macro name");
     if (!is(TokenKind::RPar)) {
       while (true) {
         MacroParam p;
-        p.name = need(TokenKind::Id, "expected macro parameter name").text;
+        p.name = need(TokenKind::Id, "expected macro parameter name").text();
         need(TokenKind::Colon, "expected ':' in macro parameter");
         Token kindTok = need(TokenKind::Id, "expected macro parameter kind");
         p.kind = parseMacroArgKindToken(kindTok);
@@ -1136,7 +1278,7 @@ private:
     if (braceStyle) need(TokenKind::RBra, "expected '}' to close macro");
     else if (endStyle) need(TokenKind::KwEnd, "expected 'end' to close macro");
     MacroDecl decl;
-    decl.name = nameTok.text;
+    decl.name = nameTok.text();
     decl.params = std::move(params);
     decl.retKind = retKind;
     decl.bodyExpr = std::move(bodyExpr);
@@ -1151,6 +1293,14 @@ private:
     case Type::F64: return std::make_unique<EFloat>(0.0, s);
     case Type::Bool: return std::make_unique<EBool>(false, s);
     case Type::Str: return std::make_unique<EString>("", s);
+    case Type::F32x4:
+    case Type::F32x8:
+    case Type::F64x4:
+    case Type::I64x4: {
+      std::vector<EP> args;
+      args.push_back(std::make_unique<EInt>(0, s));
+      return std::make_unique<ECall>(typeName(t) + "_splat", std::move(args), s);
+    }
     case Type::Void: break;
     }
     throw CompileError(s, "cannot declare variable with type void");
@@ -1220,32 +1370,36 @@ private:
     auto parseGenericInner = [&](const char *kindName) -> Type {
       need(TokenKind::Lt, std::string("expected '<' in ") + kindName + " type");
       Token innerTok = need(TokenKind::Id, std::string("expected primitive type in ") + kindName + " type");
-      const bool knownPrim = innerTok.text == "i32" || innerTok.text == "i64" || innerTok.text == "f32" ||
-                             innerTok.text == "f64" || innerTok.text == "bool" || innerTok.text == "byte" ||
-                             innerTok.text == "str";
-      const bool knownClass = classes_.count(innerTok.text) != 0;
+      const bool knownPrim = innerTok.text() == "i32" || innerTok.text() == "i64" || innerTok.text() == "f32" ||
+                             innerTok.text() == "f64" || innerTok.text() == "bool" || innerTok.text() == "byte" ||
+                             innerTok.text() == "str";
+      const bool knownClass = classes_.count(innerTok.text()) != 0;
       if (!knownPrim && !knownClass) {
-        throw CompileError(innerTok.span, std::string("unsupported ") + kindName + " inner type '" + innerTok.text + "'");
+        throw CompileError(innerTok.span, std::string("unsupported ") + kindName + " inner type '" + innerTok.text() + "'");
       }
       need(TokenKind::Gt, std::string("expected '>' in ") + kindName + " type");
       return Type::I64;
     };
-    if (tok.text == "i32") return Type::I32;
-    if (tok.text == "i64") return Type::I64;
-    if (tok.text == "f32") return Type::F32;
-    if (tok.text == "f64") return Type::F64;
-    if (tok.text == "bool") return Type::Bool;
-    if (tok.text == "byte") return Type::I32;
-    if (tok.text == "str") return Type::Str;
-    if (tok.text == "void") return Type::Void;
-    if (tok.text == "ptr") return parseGenericInner("ptr");
-    if (tok.text == "slice") return parseGenericInner("slice");
-    if (tok.text == "array") return parseGenericInner("array");
-    if (classes_.count(tok.text)) {
-      if (className) *className = tok.text;
+    if (tok.text() == "i32") return Type::I32;
+    if (tok.text() == "i64") return Type::I64;
+    if (tok.text() == "f32") return Type::F32;
+    if (tok.text() == "f64") return Type::F64;
+    if (tok.text() == "bool") return Type::Bool;
+    if (tok.text() == "byte") return Type::I32;
+    if (tok.text() == "str") return Type::Str;
+    if (tok.text() == "void") return Type::Void;
+    if (tok.text() == "f32x4") return Type::F32x4;
+    if (tok.text() == "f32x8") return Type::F32x8;
+    if (tok.text() == "f64x4") return Type::F64x4;
+    if (tok.text() == "i64x4") return Type::I64x4;
+    if (tok.text() == "ptr") return parseGenericInner("ptr");
+    if (tok.text() == "slice") return parseGenericInner("slice");
+    if (tok.text() == "array") return parseGenericInner("array");
+    if (classes_.count(tok.text())) {
+      if (className) *className = tok.text();
       return Type::I64;
     }
-    throw CompileError(tok.span, "unknown type '" + tok.text + "'");
+    throw CompileError(tok.span, "unknown type '" + tok.text() + "'");
   }
 
   std::vector<Param> parseParams(std::unordered_map<std::string, std::string> &paramClasses) {
@@ -1254,7 +1408,7 @@ private:
     if (!is(TokenKind::RPar)) {
       while (true) {
         Param p;
-        p.n = need(TokenKind::Id, "expected parameter name").text;
+        p.n = need(TokenKind::Id, "expected parameter name").text();
         need(TokenKind::Colon, "expected ':'");
         std::string classType;
         p.t = parseType(&classType);
@@ -1484,13 +1638,13 @@ private:
     if (e.k != EK::Call) return "";
     const auto &c = static_cast<const ECall &>(e);
     if (classes_.count(c.f)) return "object_free";
-    if (c.f == "array_new") return "array_free";
-    if (c.f == "dict_new") return "dict_free";
+    if (c.f == "array_new" || c.f == "array_new_i64" || c.f == "array_new_f64") return "array_free";
+    if (c.f == "dict_new" || c.f == "dict_new_i64" || c.f == "dict_new_f64") return "dict_free";
     if (c.f == "map_new") return "map_free";
     if (c.f == "object_new") return "object_free";
     if (c.f == "option_some" || c.f == "option_none") return "option_free";
     if (c.f == "result_ok" || c.f == "result_err") return "result_free";
-    if (c.f == "np_new") return "np_free";
+    if (c.f == "np_new" || c.f == "np_new_f32" || c.f == "np_mat_new" || c.f == "np_mat_new_f32") return "np_free";
     if (c.f == "gfx_new") return "gfx_free";
     if (c.f == "bitmap_new" || c.f == "bitmap_load") return "bitmap_free";
     if (c.f == "game_new") return "game_free";
@@ -1498,13 +1652,18 @@ private:
     if (c.f == "phys_new") return "phys_free";
     if (c.f == "http_server_listen") return "http_server_close";
     if (c.f == "http_client_connect") return "http_client_close";
+    if (c.f == "file_map") return "file_unmap";
+    if (c.f == "file_cursor" || c.f == "file_cursor_delim") return "file_cursor_free";
+    if (c.f == "file_writer_open") return "file_writer_close";
+    if (c.f == "chan_new") return "chan_free";
+    if (c.f == "atomic_new") return "atomic_free";
     return "";
   }
 
   void parseClass(Program &p, const Span &classSpan) {
     (void)classSpan;
     Token classNameTok = need(TokenKind::Id, "expected class name");
-    const std::string className = classNameTok.text;
+    const std::string className = classNameTok.text();
     if (classes_.count(className)) {
       throw CompileError(classNameTok.span, "duplicate class '" + className + "'");
     }
@@ -1512,13 +1671,13 @@ private:
     classInfo.name = className;
     classInfo.s = classNameTok.span;
     skipNl();
-    if (is(TokenKind::Id) && cur().text == "extends") {
+    if (is(TokenKind::Id) && cur().text() == "extends") {
       ++i_;
       Token baseTok = need(TokenKind::Id, "expected base class name after 'extends'");
-      if (!classes_.count(baseTok.text)) {
-        throw CompileError(baseTok.span, "unknown base class '" + baseTok.text + "'");
+      if (!classes_.count(baseTok.text())) {
+        throw CompileError(baseTok.span, "unknown base class '" + baseTok.text() + "'");
       }
-      classInfo.base = baseTok.text;
+      classInfo.base = baseTok.text();
       skipNl();
     }
     classes_[className] = std::move(classInfo);
@@ -1546,7 +1705,7 @@ private:
       bool methodOverride = false;
       bool methodFinal = false;
       while (is(TokenKind::Id)) {
-        const std::string mod = cur().text;
+        const std::string mod = cur().text();
         if (mod == "public" || mod == "protected" || mod == "private") {
           if (accessSet) throw CompileError(cur().span, "duplicate access modifier");
           accessSet = true;
@@ -1598,12 +1757,13 @@ private:
         ParsedClassField field;
         field.s = t_[i_ - 1].span;
         field.access = memberAccess;
-        field.n = need(TokenKind::Id, "expected class field name").text;
+        field.n = need(TokenKind::Id, "expected class field name").text();
         if (classRef.fields.count(field.n)) {
           throw CompileError(field.s, "duplicate class field '" + field.n + "'");
         }
         need(TokenKind::Colon, "class field requires explicit type");
         field.t = parseType();
+        if (isVec(field.t)) throw CompileError(field.s, "class field '" + field.n + "' cannot have a SIMD vector type");
         if (eat(TokenKind::Assign)) {
           field.init = expr();
         } else {
@@ -1648,11 +1808,11 @@ private:
       std::string methodKey;
       std::string methodDisplay;
       const bool hasFnKeyword = eat(TokenKind::KwFn);
-      if (is(TokenKind::Id) && cur().text == "operator") {
+      if (is(TokenKind::Id) && cur().text() == "operator") {
         Token opTok = cur();
         ++i_;
         skipNl();
-        if (is(TokenKind::Id) && cur().text == "unary") {
+        if (is(TokenKind::Id) && cur().text() == "unary") {
           methodIsUnaryOperator = true;
           ++i_;
           skipNl();
@@ -1684,13 +1844,13 @@ private:
         }
       } else if (is(TokenKind::Id) && (hasFnKeyword || lookNonNl(1).kind == TokenKind::LPar)) {
         nameTok = need(TokenKind::Id, "expected method name");
-        methodKey = nameTok.text;
-        methodDisplay = nameTok.text;
+        methodKey = nameTok.text();
+        methodDisplay = nameTok.text();
       } else {
         throw CompileError(cur().span, "expected class method or constructor");
       }
 
-      const bool isCtor = (!methodIsOperator && (nameTok.text == "constructor" || nameTok.text == className));
+      const bool isCtor = (!methodIsOperator && (nameTok.text() == "constructor" || nameTok.text() == className));
       f.s = nameTok.span;
       std::unordered_map<std::string, std::string> paramClasses;
       f.p = parseParams(paramClasses);
@@ -1700,7 +1860,7 @@ private:
       std::vector<EP> ctorBaseArgs;
       if (isCtor && eat(TokenKind::Colon)) {
         Token baseTok = need(TokenKind::Id, "expected base constructor name after ':'");
-        ctorBaseClass = baseTok.text;
+        ctorBaseClass = baseTok.text();
         need(TokenKind::LPar, "expected '(' after base constructor name");
         if (!is(TokenKind::RPar)) {
           while (true) {
@@ -1728,7 +1888,7 @@ private:
       if (eat(TokenKind::KwThrows)) {
         while (true) {
           Token errTok = need(TokenKind::Id, "expected error type after 'throws'");
-          f.throws.push_back(errTok.text);
+          f.throws.push_back(errTok.text());
           if (!eat(TokenKind::Comma)) break;
         }
       }
@@ -1889,14 +2049,14 @@ private:
   Fn fn() {
     Fn f;
     skipNl();
-    if (is(TokenKind::Id) && cur().text == "flag") {
+    if (is(TokenKind::Id) && cur().text() == "flag") {
       ++i_;
       Token firstSeg = need(TokenKind::Id, "expected flag name after 'flag'");
-      std::string cliName = firstSeg.text;
+      std::string cliName = firstSeg.text();
       while (eat(TokenKind::Minus)) {
         Token seg = need(TokenKind::Id, "expected flag name segment after '-'");
         cliName += "-";
-        cliName += seg.text;
+        cliName += seg.text();
       }
       if (!isValidCliFlagName(cliName)) {
         throw CompileError(firstSeg.span, "invalid flag name '" + cliName + "'");
@@ -1946,13 +2106,13 @@ private:
     }
     Token nameTok;
     const bool hasFnKeyword = eat(TokenKind::KwFn);
-    if (is(TokenKind::Id) && cur().text == "operator") {
+    if (is(TokenKind::Id) && cur().text() == "operator") {
       Token opTok = cur();
       ++i_;
       skipNl();
       f.s = opTok.span;
       bool unaryOp = false;
-      if (is(TokenKind::Id) && cur().text == "unary") {
+      if (is(TokenKind::Id) && cur().text() == "unary") {
         unaryOp = true;
         ++i_;
         skipNl();
@@ -1982,7 +2142,7 @@ private:
     } else if (is(TokenKind::Id) && (hasFnKeyword || lookNonNl(1).kind == TokenKind::LPar)) {
       nameTok = need(TokenKind::Id, "expected function name");
       f.s = nameTok.span;
-      f.n = nameTok.text;
+      f.n = nameTok.text();
       f.sourceName = f.n;
     } else {
       throw CompileError(cur().span, "expected function declaration");
@@ -1993,7 +2153,7 @@ private:
     if (eat(TokenKind::KwThrows)) {
       while (true) {
         Token errTok = need(TokenKind::Id, "expected error type after 'throws'");
-        f.throws.push_back(errTok.text);
+        f.throws.push_back(errTok.text());
         if (!eat(TokenKind::Comma)) break;
       }
     }
@@ -2126,12 +2286,17 @@ private:
 
   SP stmt() {
     skipNl();
-    if (is(TokenKind::Id) && cur().text == "delete") return sDelete();
+    if (is(TokenKind::Id) && cur().text() == "delete") return sDelete();
     if (eat(TokenKind::KwDeclare)) return sDeclare();
     if (eat(TokenKind::KwLet) || eat(TokenKind::KwVar) || eat(TokenKind::KwConst)) {
       throw CompileError(cur().span, "use 'declare <name>' for variable declarations");
     }
-    if (eat(TokenKind::KwReturn)) return sRet(t_[i_ - 1].span);
+    if (eat(TokenKind::KwReturn)) {
+      if (benchDepth_ > 0) {
+        throw CompileError(t_[i_ - 1].span, "'return' inside a bench block; use 'break' to leave it early");
+      }
+      return sRet(t_[i_ - 1].span);
+    }
     if (eat(TokenKind::KwIf)) return sIf(t_[i_ - 1].span);
     if (eat(TokenKind::KwUnless)) return sUnless(t_[i_ - 1].span);
     if (eat(TokenKind::KwWhile)) return sWhile(t_[i_ - 1].span);
@@ -2142,7 +2307,7 @@ private:
       need(TokenKind::KwFor, "expected 'for' after 'parallel'");
       return sFor(s, true);
     }
-    if (is(TokenKind::Id) && (cur().text == "formatOutput" || cur().text == "FormatOutput")) {
+    if (is(TokenKind::Id) && (cur().text() == "formatOutput" || cur().text() == "FormatOutput")) {
       const std::size_t save = i_;
       const Token nameTok = need(TokenKind::Id, "expected format block keyword");
       skipNl();
@@ -2157,6 +2322,7 @@ private:
       }
       i_ = save;
     }
+    if (is(TokenKind::Id) && cur().text() == "bench" && look(1).kind == TokenKind::Str) return sBench();
     if (eat(TokenKind::KwBreak)) {
       needStmtEnd("expected statement terminator after 'break'");
       return std::make_unique<SBreak>(t_[i_ - 1].span);
@@ -2210,19 +2376,19 @@ private:
     const std::string ctorClass = constructorClassFromExpr(*v);
     const std::string ctorFreeFn = constructorFreeFnFromExpr(*v);
     if (!declaredClass.empty()) {
-      varClass_[n.text] = declaredClass;
+      varClass_[n.text()] = declaredClass;
     } else if (!ctorClass.empty()) {
-      varClass_[n.text] = ctorClass;
+      varClass_[n.text()] = ctorClass;
     } else {
-      varClass_.erase(n.text);
+      varClass_.erase(n.text());
     }
     if (!ctorFreeFn.empty()) {
-      varFreeFn_[n.text] = ctorFreeFn;
+      varFreeFn_[n.text()] = ctorFreeFn;
     } else {
-      varFreeFn_.erase(n.text);
+      varFreeFn_.erase(n.text());
     }
     needStmtEnd("expected statement terminator after variable declaration");
-    return std::make_unique<SLet>(n.text, d, isConst, isOwned, std::move(v), n.span);
+    return std::make_unique<SLet>(n.text(), d, isConst, isOwned, std::move(v), n.span);
   }
 
   SP sAssign() {
@@ -2236,7 +2402,7 @@ private:
     if (op == TokenKind::Assign) {
       v = expr();
     } else {
-      EP l = std::make_unique<EVar>(n.text, n.span);
+      EP l = std::make_unique<EVar>(n.text(), n.span);
       EP r = expr();
       v = makeBinaryExpr(assignOpToBinary(op, n.span), std::move(l), std::move(r), n.span);
     }
@@ -2251,16 +2417,16 @@ private:
         if (itFree != varFreeFn_.end()) assignedFreeFn = itFree->second;
       }
       if (!assignedClass.empty())
-        varClass_[n.text] = assignedClass;
+        varClass_[n.text()] = assignedClass;
       else
-        varClass_.erase(n.text);
+        varClass_.erase(n.text());
       if (!assignedFreeFn.empty())
-        varFreeFn_[n.text] = assignedFreeFn;
+        varFreeFn_[n.text()] = assignedFreeFn;
       else
-        varFreeFn_.erase(n.text);
+        varFreeFn_.erase(n.text());
     }
     needStmtEnd("expected statement terminator after assignment");
-    return std::make_unique<SAssign>(n.text, std::move(v), n.span);
+    return std::make_unique<SAssign>(n.text(), std::move(v), n.span);
   }
 
   SP sAssignMember() {
@@ -2271,16 +2437,16 @@ private:
     if (!isAssignOp(op)) throw CompileError(cur().span, "expected assignment operator");
     ++i_;
 
-    const std::string className = resolveReceiverClass(receiverTok.text);
+    const std::string className = resolveReceiverClass(receiverTok.text());
     if (className.empty()) {
       throw CompileError(receiverTok.span, "member assignment requires a class-typed receiver");
     }
-    const FieldInfo *fieldInfo = findFieldRecursive(className, fieldTok.text);
+    const FieldInfo *fieldInfo = findFieldRecursive(className, fieldTok.text());
     if (!fieldInfo) {
-      throw CompileError(fieldTok.span, "class '" + className + "' has no field '" + fieldTok.text + "'");
+      throw CompileError(fieldTok.span, "class '" + className + "' has no field '" + fieldTok.text() + "'");
     }
     if (!canAccessField(*fieldInfo, currentClass_)) {
-      throw CompileError(fieldTok.span, "field '" + fieldTok.text + "' is not accessible in this context");
+      throw CompileError(fieldTok.span, "field '" + fieldTok.text() + "' is not accessible in this context");
     }
 
     Type fieldType = fieldInfo->t;
@@ -2288,11 +2454,11 @@ private:
     if (op == TokenKind::Assign) {
       rhs = expr();
     } else {
-      EP lhs = makeFieldLoadExpr(receiverTok.text, fieldTok.text, fieldType, fieldTok.span);
+      EP lhs = makeFieldLoadExpr(receiverTok.text(), fieldTok.text(), fieldType, fieldTok.span);
       EP r = expr();
       rhs = makeBinaryExpr(assignOpToBinary(op, fieldTok.span), std::move(lhs), std::move(r), fieldTok.span);
     }
-    SP out = makeFieldStoreStmt(receiverTok.text, fieldTok.text, fieldType, std::move(rhs), fieldTok.span);
+    SP out = makeFieldStoreStmt(receiverTok.text(), fieldTok.text(), fieldType, std::move(rhs), fieldTok.span);
     needStmtEnd("expected statement terminator after member assignment");
     return out;
   }
@@ -2303,11 +2469,11 @@ private:
       need(TokenKind::PlusPlus, "expected '++'");
     else
       need(TokenKind::MinusMinus, "expected '--'");
-    EP l = std::make_unique<EVar>(n.text, n.span);
+    EP l = std::make_unique<EVar>(n.text(), n.span);
     EP r = std::make_unique<EInt>(1, n.span);
     EP v = makeBinaryExpr(isInc ? BK::Add : BK::Sub, std::move(l), std::move(r), n.span);
     needStmtEnd("expected statement terminator after increment/decrement");
-    return std::make_unique<SAssign>(n.text, std::move(v), n.span);
+    return std::make_unique<SAssign>(n.text(), std::move(v), n.span);
   }
 
   SP sRet(const Span &s) {
@@ -2374,10 +2540,62 @@ private:
     EP stop = expr();
     EP step = std::make_unique<EInt>(1, n.span);
     if (eat(TokenKind::KwStep)) step = expr();
+    std::vector<ParReduction> reductions;
+    std::string schedule;
+    int64_t grain = 0;
+    int64_t minIters = -1;
+    while (is(TokenKind::Id) && look(1).kind == TokenKind::LPar &&
+           (cur().text() == "reduce" || cur().text() == "schedule" || cur().text() == "grain" ||
+            cur().text() == "threshold")) {
+      const Token clause = need(TokenKind::Id, "expected loop clause");
+      if (!isParallel) throw CompileError(clause.span, "'" + clause.text() + "(...)' requires 'parallel for'");
+      need(TokenKind::LPar, "expected '(' after '" + clause.text() + "'");
+      if (clause.text() == "reduce") {
+        std::string op;
+        do {
+          skipNl();
+          if (op.empty() || look(1).kind == TokenKind::Colon) {
+            if (eat(TokenKind::Plus)) op = "+";
+            else if (eat(TokenKind::Star)) op = "*";
+            else if (eat(TokenKind::AndAnd)) op = "and";
+            else if (eat(TokenKind::OrOr)) op = "or";
+            else if (is(TokenKind::Id) && (cur().text() == "min" || cur().text() == "max")) op = need(TokenKind::Id, "").text();
+            else throw CompileError(cur().span, "expected reduction operator (+, *, min, max, and, or)");
+            need(TokenKind::Colon, "expected ':' after reduction operator");
+          }
+          const Token v = need(TokenKind::Id, "expected variable name in reduce(...)");
+          for (const ParReduction &r : reductions) {
+            if (r.var == v.text()) throw CompileError(v.span, "variable '" + v.text() + "' appears twice in reduce(...)");
+          }
+          reductions.push_back({op, v.text()});
+        } while (eat(TokenKind::Comma));
+      } else if (clause.text() == "schedule") {
+        const Token kind = need(TokenKind::Id, "expected schedule kind (static, dynamic, guided)");
+        if (kind.text() != "static" && kind.text() != "dynamic" && kind.text() != "guided") {
+          throw CompileError(kind.span, "unknown schedule '" + kind.text() + "' (expected static, dynamic, guided)");
+        }
+        schedule = kind.text();
+      } else {
+        const Token v = need(TokenKind::Int, "expected integer literal in " + clause.text() + "(...)");
+        const int64_t value = std::stoll(v.text());
+        if (clause.text() == "grain") {
+          if (value <= 0) throw CompileError(v.span, "grain(...) must be positive");
+          grain = value;
+        } else {
+          minIters = value;
+        }
+      }
+      need(TokenKind::RPar, "expected ')' to close '" + clause.text() + "(...)'");
+    }
     skipNl();
     auto b = block();
-    return std::make_unique<SFor>(n.text, std::move(start), std::move(stop), std::move(step), isParallel,
-                                  std::move(b), s);
+    auto out = std::make_unique<SFor>(n.text(), std::move(start), std::move(stop), std::move(step), isParallel,
+                                      std::move(b), s);
+    out->reductions = std::move(reductions);
+    out->schedule = std::move(schedule);
+    out->grain = grain;
+    out->minIters = minIters;
+    return out;
   }
 
   SP sFormatBlock(const Span &s, EP endArg) {
@@ -2385,6 +2603,35 @@ private:
     return std::make_unique<SFormatBlock>(std::move(endArg), std::move(b), s);
   }
 
+  // bench "name" do body end
+  //   => if true do
+  //        declare const __ls_bench_N = __ls_bench_begin("name")
+  //        while __ls_bench_next(__ls_bench_N) do body end
+  //        __ls_bench_end(__ls_bench_N)
+  //      end
+  // The runtime decides how often the loop runs (warmup, then calibrated batches) and reports the samples.
+  SP sBench() {
+    const Span s = need(TokenKind::Id, "expected 'bench'").span;
+    const Token nameTok = need(TokenKind::Str, "expected bench name string");
+    skipNl();
+    ++benchDepth_;
+    auto body = block();
+    --benchDepth_;
+    const std::string id = "__ls_bench_" + std::to_string(benchSerial_++);
+    auto call = [&](const char *fn, EP arg) -> EP {
+      std::vector<EP> args;
+      args.push_back(std::move(arg));
+      return std::make_unique<ECall>(fn, std::move(args), s);
+    };
+    std::vector<SP> seq;
+    seq.push_back(std::make_unique<SLet>(id, std::nullopt, true, false,
+                                         call("__ls_bench_begin", std::make_unique<EString>(nameTok.text(), s)), s));
+    seq.push_back(
+        std::make_unique<SWhile>(call("__ls_bench_next", std::make_unique<EVar>(id, s)), std::move(body), s));
+    seq.push_back(std::make_unique<SExpr>(call("__ls_bench_end", std::make_unique<EVar>(id, s)), s));
+    return std::make_unique<SIf>(std::make_unique<EBool>(true, s), std::move(seq), std::vector<SP>{}, s);
+  }
+
   SP sDelete() {
     Token deleteTok = need(TokenKind::Id, "expected 'delete'");
     bool arrayDelete = false;
@@ -2394,13 +2641,13 @@ private:
     }
     Token nameTok = need(TokenKind::Id, "expected variable name after delete/delete[]");
     std::string freeFn;
-    auto itFree = varFreeFn_.find(nameTok.text);
+    auto itFree = varFreeFn_.find(nameTok.text());
     if (itFree != varFreeFn_.end()) freeFn = itFree->second;
     if (freeFn.empty()) {
-      freeFn = varClass_.count(nameTok.text) ? "object_free" : "mem_free";
+      freeFn = varClass_.count(nameTok.text()) ? "object_free" : "mem_free";
     }
     std::vector<EP> args;
-    args.push_back(std::make_unique<EVar>(nameTok.text, nameTok.span));
+    args.push_back(std::make_unique<EVar>(nameTok.text(), nameTok.span));
     EP call = std::make_unique<ECall>(freeFn, std::move(args), deleteTok.span);
     needStmtEnd("expected statement terminator after delete/delete[]");
     (void)arrayDelete;
@@ -2615,23 +2862,23 @@ private:
             if (!isSuperuserNamespaceReceiver(receiver)) {
               throw CompileError(memberTok.span, "method call requires a class-typed receiver");
             }
-            e = std::make_unique<ECall>(canonicalSuperuserNamespaceSymbol(receiver) + "." + memberTok.text,
+            e = std::make_unique<ECall>(canonicalSuperuserNamespaceSymbol(receiver) + "." + memberTok.text(),
                                         std::move(args), memberTok.span);
           } else {
-            const MethodInfo *method = findMethodRecursive(className, memberTok.text, args.size());
+            const MethodInfo *method = findMethodRecursive(className, memberTok.text(), args.size());
             if (!method) {
               throw CompileError(memberTok.span,
-                                 "class '" + className + "' has no matching method '" + memberTok.text + "'");
+                                 "class '" + className + "' has no matching method '" + memberTok.text() + "'");
             }
             if (!canAccessMethod(*method, currentClass_)) {
-              throw CompileError(memberTok.span, "method '" + memberTok.text + "' is not accessible in this context");
+              throw CompileError(memberTok.span, "method '" + memberTok.text() + "' is not accessible in this context");
             }
             if (classQualifier && !method->isStatic) {
-              throw CompileError(memberTok.span, "instance method '" + memberTok.text + "' requires an object receiver");
+              throw CompileError(memberTok.span, "instance method '" + memberTok.text() + "' requires an object receiver");
             }
             if (!classQualifier && method->isStatic) {
               throw CompileError(memberTok.span,
-                                 "static method '" + memberTok.text + "' must be called via class name");
+                                 "static method '" + memberTok.text() + "' must be called via class name");
             }
             std::vector<EP> callArgs;
             callArgs.reserve(args.size() + (classQualifier ? 0 : 1));
@@ -2651,17 +2898,17 @@ private:
             if (!isSuperuserNamespaceReceiver(receiver)) {
               throw CompileError(memberTok.span, "field access requires a class-typed receiver");
             }
-            e = std::make_unique<EVar>(canonicalSuperuserNamespaceSymbol(receiver) + "." + memberTok.text,
+            e = std::make_unique<EVar>(canonicalSuperuserNamespaceSymbol(receiver) + "." + memberTok.text(),
                                        memberTok.span);
           } else {
-            const FieldInfo *fieldInfo = findFieldRecursive(className, memberTok.text);
+            const FieldInfo *fieldInfo = findFieldRecursive(className, memberTok.text());
             if (!fieldInfo) {
-              throw CompileError(memberTok.span, "class '" + className + "' has no field '" + memberTok.text + "'");
+              throw CompileError(memberTok.span, "class '" + className + "' has no field '" + memberTok.text() + "'");
             }
             if (!canAccessField(*fieldInfo, currentClass_)) {
-              throw CompileError(memberTok.span, "field '" + memberTok.text + "' is not accessible in this context");
+              throw CompileError(memberTok.span, "field '" + memberTok.text() + "' is not accessible in this context");
             }
-            e = makeFieldLoadExpr(receiver, memberTok.text, fieldInfo->t, memberTok.span);
+            e = makeFieldLoadExpr(receiver, memberTok.text(), fieldInfo->t, memberTok.span);
           }
         }
         continue;
@@ -2674,15 +2921,15 @@ private:
   EP primary() {
     if (eat(TokenKind::Str)) {
       Token tok = t_[i_ - 1];
-      return std::make_unique<EString>(tok.text, tok.span);
+      return std::make_unique<EString>(tok.text(), tok.span);
     }
     if (eat(TokenKind::Int)) {
       Token tok = t_[i_ - 1];
-      return std::make_unique<EInt>(std::stoll(tok.text), tok.span);
+      return std::make_unique<EInt>(std::stoll(tok.text()), tok.span);
     }
     if (eat(TokenKind::Float)) {
       Token tok = t_[i_ - 1];
-      return std::make_unique<EFloat>(std::stod(tok.text), tok.span);
+      return std::make_unique<EFloat>(std::stod(tok.text()), tok.span);
     }
     if (eat(TokenKind::KwTrue)) {
       Token tok = t_[i_ - 1];
@@ -2694,17 +2941,17 @@ private:
     }
     if (eat(TokenKind::Id)) {
       Token tok = t_[i_ - 1];
-      if (tok.text == "quote") {
+      if (tok.text() == "quote") {
         need(TokenKind::LBra, "expected '{' after quote");
         EP quoted = expr();
         need(TokenKind::RBra, "expected '}' after quote expression");
         return quoted;
       }
-      return std::make_unique<EVar>(tok.text, tok.span);
+      return std::make_unique<EVar>(tok.text(), tok.span);
     }
     if (eat(TokenKind::Dot)) {
       Token memberTok = need(TokenKind::Id, "expected identifier after '.'");
-      return std::make_unique<EVar>("." + memberTok.text, memberTok.span);
+      return std::make_unique<EVar>("." + memberTok.text(), memberTok.span);
     }
     if (eat(TokenKind::LPar)) {
       EP e = expr();
@@ -2726,6 +2973,27 @@ struct OverloadCandidate {
   Sig sig;
 };
 
+static bool exprHasVarName(const Expr &e, const std::string &name) {
+  switch (e.k) {
+  case EK::Var:
+    return static_cast<const EVar &>(e).n == name;
+  case EK::Unary:
+    return exprHasVarName(*static_cast<const EUnary &>(e).x, name);
+  case EK::Binary: {
+    const auto &n = static_cast<const EBinary &>(e);
+    return exprHasVarName(*n.l, name) || exprHasVarName(*n.r, name);
+  }
+  case EK::Call: {
+    const auto &n = static_cast<const ECall &>(e);
+    for (const auto &arg : n.a)
+      if (exprHasVarName(*arg, name)) return true;
+    return false;
+  }
+  default:
+    return false;
+  }
+}
+
 class TypeCheck {
 public:
   explicit TypeCheck(Program &p, bool superuserMode = false) : p_(p), superuserMode_(superuserMode) {}
@@ -2735,13 +3003,20 @@ public:
       if (!f.ex) fn(f);
     }
   }
+  // run() in two steps, for callers (lsc --serve) that skip bodies whose result they already know.
+  void collectSignatures() { collect(); }
+  void checkFunction(Fn &f) { fn(f); }
   const std::unordered_map<std::string, Sig> &sigs() const { return sig_; }
   const std::vector<std::string> &warnings() const { return warnings_; }
   bool superuserMode() const { return superuserMode_; }
+  // Re-checking optimized code skips the rules on the source form of a body, which rewrites need not keep:
+  // `p = 1.0 * p` is a valid reduce(*: p) update that folds to `p = p`.
+  void setOptimizedInput() { optimizedInput_ = true; }
 
 private:
   Program &p_;
   bool superuserMode_ = false;
+  bool optimizedInput_ = false;
   std::unordered_map<std::string, Sig> sig_;
   std::unordered_map<std::string, std::vector<OverloadCandidate>> overloads_;
   std::vector<std::string> warnings_;
@@ -2750,7 +3025,74 @@ private:
     bool isConst = false;
     bool isOwned = false;
     std::string ownedFreeFn;
+    Type taskT = Type::Void;
+    char container = 0;
+    Type elemT = Type::Void;
   };
+  static constexpr std::size_t kSpawnMaxArgs = 8;
+
+  static char spawnTypeCode(Type t) {
+    switch (t) {
+    case Type::I32: return 'n';
+    case Type::I64: return 'i';
+    case Type::F32: return 'g';
+    case Type::F64: return 'f';
+    case Type::Bool: return 'b';
+    case Type::Str: return 's';
+    case Type::Void: return 'v';
+    default: break; // vectors are rejected as spawn arguments and results
+    }
+    return 'i';
+  }
+  // Result type of the task started by `v` when it is a `spawn(...)` call; void otherwise.
+  static Type spawnResultType(const Expr &v) {
+    if (v.k != EK::Call) return Type::Void;
+    const auto &c = static_cast<const ECall &>(v);
+    if (c.f != "spawn" || c.a.empty() || !c.a[0]->typed) return Type::Void;
+    return c.a[0]->inf;
+  }
+
+  // Arrays and dicts remember the element type they were constructed with so generic
+  // accessors can be retargeted to the unboxed i64/f64 storage.
+  static Type containerElemType(const Expr &v, char &container) {
+    container = 0;
+    if (v.k != EK::Call) return Type::Void;
+    const std::string &f = static_cast<const ECall &>(v).f;
+    if (f == "array_new" || f == "array_new_i64" || f == "array_new_f64") {
+      container = 'a';
+    } else if (f == "dict_new" || f == "map_new" || f == "dict_new_i64" || f == "dict_new_f64") {
+      container = 'd';
+    } else {
+      return Type::Void;
+    }
+    if (f.size() > 4 && f.compare(f.size() - 4, 4, "_i64") == 0) return Type::I64;
+    if (f.size() > 4 && f.compare(f.size() - 4, 4, "_f64") == 0) return Type::F64;
+    return Type::Str;
+  }
+  static std::string typedContainerCall(const std::string &fn, char container, Type elemT, bool &mismatch) {
+    static const std::unordered_set<std::string> arrayOps = {"push", "get", "set", "pop", "sum"};
+    static const std::unordered_set<std::string> dictOps = {"set", "get", "add"};
+    mismatch = false;
+    const std::string prefix = container == 'a' ? "array_" : "dict_";
+    std::string op = container == 'd' && fn.rfind("map_", 0) == 0 ? "dict_" + fn.substr(4) : fn;
+    if (op.rfind(prefix, 0) != 0) return fn;
+    op = op.substr(prefix.size());
+    Type want = Type::Str;
+    if (op.size() > 4 && (op.compare(op.size() - 4, 4, "_i64") == 0 || op.compare(op.size() - 4, 4, "_f64") == 0)) {
+      want = op[op.size() - 3] == 'i' ? Type::I64 : Type::F64;
+      op.resize(op.size() - 4);
+    }
+    if (!(container == 'a' ? arrayOps : dictOps).count(op)) {
+      mismatch = container == 'a' && elemT != Type::Str && (op == "join" || op == "includes");
+      return fn;
+    }
+    if (want != Type::Str) {
+      mismatch = want != elemT;
+      return fn;
+    }
+    if (elemT == Type::Str) return fn;
+    return prefix + op + (elemT == Type::I64 ? "_i64" : "_f64");
+  }
 
   static bool can(Type a, Type b) {
     if (a == b) return true;
@@ -2856,6 +3198,153 @@ private:
     return false;
   }
 
+  static bool sameExpr(const Expr &a, const Expr &b) {
+    if (a.k != b.k) return false;
+    switch (a.k) {
+    case EK::Int: return static_cast<const EInt &>(a).v == static_cast<const EInt &>(b).v;
+    case EK::Float: return static_cast<const EFloat &>(a).v == static_cast<const EFloat &>(b).v;
+    case EK::Bool: return static_cast<const EBool &>(a).v == static_cast<const EBool &>(b).v;
+    case EK::Str: return static_cast<const EString &>(a).v == static_cast<const EString &>(b).v;
+    case EK::Var: return static_cast<const EVar &>(a).n == static_cast<const EVar &>(b).n;
+    case EK::Unary: {
+      const auto &x = static_cast<const EUnary &>(a);
+      const auto &y = static_cast<const EUnary &>(b);
+      return x.op == y.op && sameExpr(*x.x, *y.x);
+    }
+    case EK::Binary: {
+      const auto &x = static_cast<const EBinary &>(a);
+      const auto &y = static_cast<const EBinary &>(b);
+      return x.op == y.op && sameExpr(*x.l, *y.l) && sameExpr(*x.r, *y.r);
+    }
+    case EK::Call: {
+      const auto &x = static_cast<const ECall &>(a);
+      const auto &y = static_cast<const ECall &>(b);
+      if (x.f != y.f || x.a.size() != y.a.size()) return false;
+      for (std::size_t i = 0; i < x.a.size(); ++i)
+        if (!sameExpr(*x.a[i], *y.a[i])) return false;
+      return true;
+    }
+    }
+    return false;
+  }
+  static bool isVarNamed(const Expr &e, const std::string &name) {
+    return e.k == EK::Var && static_cast<const EVar &>(e).n == name;
+  }
+  // Counts the operands of a chain of `op` that are exactly `name`; false if any other operand reads it.
+  static bool reduceChainOperands(const Expr &e, BK op, const std::string &name, int &hits) {
+    if (isVarNamed(e, name)) {
+      ++hits;
+      return true;
+    }
+    if (e.k == EK::Binary && static_cast<const EBinary &>(e).op == op) {
+      const auto &n = static_cast<const EBinary &>(e);
+      return reduceChainOperands(*n.l, op, name, hits) && reduceChainOperands(*n.r, op, name, hits);
+    }
+    return !exprHasVarName(e, name);
+  }
+  // `v = v op e` (any order of a chain of op), or `v = min(v, e)` / `v = max(v, e)`, with `e` not reading v.
+  static bool isReduceUpdate(const Expr &v, const ParReduction &r) {
+    if (r.op == "min" || r.op == "max") {
+      if (v.k != EK::Call) return false;
+      const auto &c = static_cast<const ECall &>(v);
+      if (c.f != r.op || c.a.size() != 2) return false;
+      const bool first = isVarNamed(*c.a[0], r.var);
+      return (first || isVarNamed(*c.a[1], r.var)) && !exprHasVarName(*c.a[first ? 1 : 0], r.var);
+    }
+    const BK op = r.op == "+" ? BK::Add : r.op == "*" ? BK::Mul : r.op == "and" ? BK::And : BK::Or;
+    if (v.k != EK::Binary || static_cast<const EBinary &>(v).op != op) return false;
+    int hits = 0;
+    return reduceChainOperands(v, op, r.var, hits) && hits == 1;
+  }
+  // `if e > v do v = e end` for max (or `>=`, or the comparison flipped) and the mirror image for min.
+  static bool isGuardedReduceUpdate(const SIf &n, const ParReduction &r) {
+    if ((r.op != "min" && r.op != "max") || !n.e.empty() || n.t.size() != 1 || n.t[0]->k != SK::Assign) return false;
+    const auto &a = static_cast<const SAssign &>(*n.t[0]);
+    if (a.n != r.var || exprHasVarName(*a.v, r.var) || n.c->k != EK::Binary) return false;
+    const auto &c = static_cast<const EBinary &>(*n.c);
+    const bool want = r.op == "max";
+    if (isVarNamed(*c.r, r.var) && sameExpr(*c.l, *a.v))
+      return want ? (c.op == BK::Gt || c.op == BK::Gte) : (c.op == BK::Lt || c.op == BK::Lte);
+    if (isVarNamed(*c.l, r.var) && sameExpr(*c.r, *a.v))
+      return want ? (c.op == BK::Lt || c.op == BK::Lte) : (c.op == BK::Gt || c.op == BK::Gte);
+    return false;
+  }
+  // Each thread folds its iterations into a private copy of a reduce(...) target, so the body may only update it
+  // in the declared operator's form and never read it otherwise: any other use sees one thread's partial value.
+  static const ParReduction *misusedReduction(const std::vector<SP> &b, const std::vector<ParReduction> &rs) {
+    auto readsAny = [&](const Expr *e) -> const ParReduction * {
+      for (const ParReduction &r : rs)
+        if (e && exprHasVarName(*e, r.var)) return &r;
+      return nullptr;
+    };
+    for (const SP &stmt : b) {
+      switch (stmt->k) {
+      case SK::Let: {
+        const auto &n = static_cast<const SLet &>(*stmt);
+        for (const ParReduction &r : rs)
+          if (n.n == r.var) return &r;
+        if (const ParReduction *r = readsAny(n.v.get())) return r;
+        break;
+      }
+      case SK::Assign: {
+        const auto &n = static_cast<const SAssign &>(*stmt);
+        for (const ParReduction &r : rs)
+          if (n.n == r.var && !isReduceUpdate(*n.v, r)) return &r;
+        for (const ParReduction &r : rs)
+          if (n.n != r.var && exprHasVarName(*n.v, r.var)) return &r;
+        break;
+      }
+      case SK::Expr:
+        if (const ParReduction *r = readsAny(static_cast<const SExpr &>(*stmt).e.get())) return r;
+        break;
+      case SK::Ret:
+        if (const ParReduction *r = readsAny(static_cast<const SRet &>(*stmt).v.get())) return r;
+        break;
+      case SK::If: {
+        const auto &n = static_cast<const SIf &>(*stmt);
+        bool guarded = false;
+        for (const ParReduction &r : rs) {
+          if (!isGuardedReduceUpdate(n, r)) continue;
+          guarded = true;
+          const Expr &value = *static_cast<const SAssign &>(*n.t[0]).v;
+          for (const ParReduction &other : rs)
+            if (&other != &r && (exprHasVarName(*n.c, other.var) || exprHasVarName(value, other.var))) return &other;
+        }
+        if (guarded) break;
+        if (const ParReduction *r = readsAny(n.c.get())) return r;
+        if (const ParReduction *r = misusedReduction(n.t, rs)) return r;
+        if (const ParReduction *r = misusedReduction(n.e, rs)) return r;
+        break;
+      }
+      case SK::While: {
+        const auto &n = static_cast<const SWhile &>(*stmt);
+        if (const ParReduction *r = readsAny(n.c.get())) return r;
+        if (const ParReduction *r = misusedReduction(n.b, rs)) return r;
+        break;
+      }
+      case SK::For: {
+        const auto &n = static_cast<const SFor &>(*stmt);
+        for (const ParReduction &r : rs)
+          if (n.n == r.var) return &r;
+        for (const Expr *e : {n.start.get(), n.stop.get(), n.step.get()})
+          if (const ParReduction *r = readsAny(e)) return r;
+        if (const ParReduction *r = misusedReduction(n.b, rs)) return r;
+        break;
+      }
+      case SK::FormatBlock: {
+        const auto &n = static_cast<const SFormatBlock &>(*stmt);
+        if (const ParReduction *r = readsAny(n.endArg.get())) return r;
+        if (const ParReduction *r = misusedReduction(n.b, rs)) return r;
+        break;
+      }
+      case SK::Break:
+      case SK::Continue:
+        break;
+      }
+    }
+    return nullptr;
+  }
+
   void req(bool ok, const Span &s, const std::string &m) {
     if (ok) return;
     if (superuserMode_) {
@@ -2888,6 +3377,52 @@ private:
     overloads_[group].push_back(OverloadCandidate{name, sig_[name]});
   }
 
+  // One builtin per vector type, grouped under a generic `simd_*` name so overload resolution picks the right
+  // one from the vector argument. Scalars for f32 lanes are taken as f64 and narrowed in C, which lets f64
+  // literals pass without a to_f32() around each one.
+  void addSimdBuiltins(const Span &s) {
+    for (Type v : {Type::F32x4, Type::F32x8, Type::F64x4, Type::I64x4}) {
+      const std::string n = typeName(v);
+      const Type lane = vecLaneType(v);
+      const Type arg = lane == Type::F32 ? Type::F64 : lane;
+      addSig(n, std::vector<Type>(static_cast<std::size_t>(vecLanes(v)), arg), v, s);
+      addSig(n + "_splat", {arg}, v, s);
+      addSig(n + "_load_mem", {Type::I64}, v, s);
+      addSig(n + "_store_mem", {Type::I64, v}, Type::Void, s, {}, "simd_store_mem");
+      if (lane != Type::I64) {
+        addSig(n + "_load_np", {Type::I64, Type::I64}, v, s);
+        addSig(n + "_store_np", {Type::I64, Type::I64, v}, Type::Void, s, {}, "simd_store_np");
+      }
+      addSig(n + "_lane", {v, Type::I64}, lane, s, {}, "simd_lane");
+      addSig(n + "_with_lane", {v, Type::I64, arg}, v, s, {}, "simd_with_lane");
+      addSig(n + "_sum", {v}, lane, s, {}, "simd_sum");
+      addSig(n + "_hmin", {v}, lane, s, {}, "simd_hmin");
+      addSig(n + "_hmax", {v}, lane, s, {}, "simd_hmax");
+      addSig(n + "_min", {v, v}, v, s, {}, "simd_min");
+      addSig(n + "_max", {v, v}, v, s, {}, "simd_max");
+      addSig(n + "_abs", {v}, v, s, {}, "simd_abs");
+      if (lane != Type::I64) {
+        addSig(n + "_sqrt", {v}, v, s, {}, "simd_sqrt");
+        addSig(n + "_fma", {v, v, v}, v, s, {}, "simd_fma");
+      }
+      for (const char *cmp : {"lt", "le", "gt", "ge", "eq", "ne"}) {
+        addSig(n + "_" + cmp, {v, v}, Type::I64, s, {}, std::string("simd_") + cmp);
+      }
+      addSig(n + "_select", {Type::I64, v, v}, v, s, {}, "simd_select");
+      std::vector<Type> shuffle(static_cast<std::size_t>(vecLanes(v)) + 1, Type::I64);
+      shuffle[0] = v;
+      addSig(n + "_shuffle", shuffle, v, s, {}, "simd_shuffle");
+      addSig("print_" + n, {v}, Type::Void, s);
+      addSig("println_" + n, {v}, Type::Void, s);
+    }
+    const std::pair<Type, Type> conversions[] = {{Type::I64x4, Type::F64x4}, {Type::F32x4, Type::F64x4},
+                                                 {Type::F64x4, Type::I64x4}, {Type::F32x4, Type::I64x4},
+                                                 {Type::F64x4, Type::F32x4}, {Type::I64x4, Type::F32x4}};
+    for (const auto &[from, to] : conversions) {
+      addSig(typeName(to) + "_from_" + typeName(from), {from}, to, s, {}, "to_" + typeName(to));
+    }
+  }
+
   void addBuiltins() {
     const Span s{};
     addSig("print_i64", {Type::I64}, Type::Void, s);
@@ -2899,15 +3434,41 @@ private:
     addSig("println_bool", {Type::Bool}, Type::Void, s);
     addSig("println_str", {Type::Str}, Type::Void, s);
     addSig("await", {Type::I64}, Type::Void, s);
+    addSig("await_i64", {Type::I64}, Type::I64, s);
+    addSig("await_f64", {Type::I64}, Type::F64, s);
+    addSig("await_str", {Type::I64}, Type::Str, s);
     addSig("await_all", {}, Type::Void, s);
+    addSimdBuiltins(s);
+    addSig("chan_new", {Type::I64}, Type::I64, s);
+    addSig("chan_send", {Type::I64, Type::I64}, Type::Bool, s);
+    addSig("chan_try_send", {Type::I64, Type::I64}, Type::Bool, s);
+    addSig("chan_recv", {Type::I64}, Type::I64, s);
+    addSig("chan_try_recv", {Type::I64}, Type::Bool, s);
+    addSig("chan_next", {Type::I64}, Type::Bool, s);
+    addSig("chan_value", {}, Type::I64, s);
+    addSig("chan_close", {Type::I64}, Type::Void, s);
+    addSig("chan_closed", {Type::I64}, Type::Bool, s);
+    addSig("chan_len", {Type::I64}, Type::I64, s);
+    addSig("chan_free", {Type::I64}, Type::Void, s);
+    addSig("atomic_new", {Type::I64}, Type::I64, s);
+    addSig("atomic_get", {Type::I64}, Type::I64, s);
+    addSig("atomic_set", {Type::I64, Type::I64}, Type::Void, s);
+    addSig("atomic_add", {Type::I64, Type::I64}, Type::I64, s);
+    addSig("atomic_exchange", {Type::I64, Type::I64}, Type::I64, s);
+    addSig("atomic_cas", {Type::I64, Type::I64, Type::I64}, Type::Bool, s);
+    addSig("atomic_free", {Type::I64}, Type::Void, s);
     addSig("task_hardware_threads", {}, Type::I64, s);
     addSig("task_set_worker_count", {Type::I64}, Type::Void, s);
     addSig("task_worker_count", {}, Type::I64, s);
     addSig("task_set_hyperthreading", {Type::Bool}, Type::Void, s);
     addSig("task_hyperthreading_enabled", {}, Type::Bool, s);
+    addSig("flush", {}, Type::Void, s);
     addSig("clock_ms", {}, Type::I64, s);
     addSig("clock_us", {}, Type::I64, s);
     addSig("stateSpeed", {}, Type::Void, s);
+    addSig("__ls_bench_begin", {Type::Str}, Type::I64, s);
+    addSig("__ls_bench_next", {Type::I64}, Type::Bool, s);
+    addSig("__ls_bench_end", {Type::I64}, Type::Void, s);
     addSig(".stateSpeed", {}, Type::Void, s);
     addSig("superuser", {}, Type::Void, s);
     addSig(".format", {}, Type::Void, s);
@@ -2922,14 +3483,43 @@ private:
     addSig("su.ir.dump", {}, Type::Void, s);
     addSig("su.debug.hook", {Type::Str}, Type::Void, s);
     addSig("http_server_listen", {Type::I64}, Type::I64, s);
+    addSig("http_server_listen_multi", {Type::I64, Type::I64}, Type::I64, s);
+    addSig("http_server_workers", {Type::I64}, Type::I64, s);
     addSig("http_server_accept", {Type::I64}, Type::I64, s);
+    addSig("http_server_poll", {Type::I64, Type::I64}, Type::I64, s);
     addSig("http_server_read", {Type::I64}, Type::Str, s);
     addSig("http_server_respond_text", {Type::I64, Type::I64, Type::Str}, Type::Void, s);
+    addSig("http_server_respond_file", {Type::I64, Type::I64, Type::Str}, Type::Bool, s);
+    addSig("http_request_method", {Type::I64}, Type::Str, s);
+    addSig("http_request_path", {Type::I64}, Type::Str, s);
+    addSig("http_request_query", {Type::I64}, Type::Str, s);
+    addSig("http_request_header", {Type::I64, Type::Str}, Type::Str, s);
+    addSig("http_request_body", {Type::I64}, Type::Str, s);
     addSig("http_server_close", {Type::I64}, Type::Void, s);
     addSig("http_client_connect", {Type::Str, Type::I64}, Type::I64, s);
     addSig("http_client_send", {Type::I64, Type::Str}, Type::Void, s);
     addSig("http_client_read", {Type::I64}, Type::Str, s);
     addSig("http_client_close", {Type::I64}, Type::Void, s);
+    addSig("file_map", {Type::Str}, Type::I64, s);
+    addSig("file_unmap", {Type::I64}, Type::Void, s);
+    addSig("file_map_size", {Type::I64}, Type::I64, s);
+    addSig("file_map_chunk", {Type::I64, Type::I64, Type::I64}, Type::I64, s);
+    addSig("file_map_find", {Type::I64, Type::Str, Type::I64}, Type::I64, s);
+    addSig("file_map_count", {Type::I64, Type::Str, Type::I64, Type::I64}, Type::I64, s);
+    addSig("file_map_text", {Type::I64, Type::I64, Type::I64}, Type::Str, s);
+    addSig("file_cursor", {Type::I64, Type::I64, Type::I64}, Type::I64, s);
+    addSig("file_cursor_delim", {Type::I64, Type::I64, Type::I64, Type::Str}, Type::I64, s);
+    addSig("file_cursor_next", {Type::I64}, Type::Bool, s);
+    addSig("file_cursor_text", {Type::I64}, Type::Str, s);
+    addSig("file_cursor_offset", {Type::I64}, Type::I64, s);
+    addSig("file_cursor_len", {Type::I64}, Type::I64, s);
+    addSig("file_cursor_contains", {Type::I64, Type::Str}, Type::Bool, s);
+    addSig("file_cursor_free", {Type::I64}, Type::Void, s);
+    addSig("file_writer_open", {Type::Str, Type::Bool}, Type::I64, s);
+    addSig("file_write", {Type::I64, Type::Str}, Type::Void, s);
+    addSig("file_write_line", {Type::I64, Type::Str}, Type::Void, s);
+    addSig("file_writer_flush", {Type::I64}, Type::Bool, s);
+    addSig("file_writer_close", {Type::I64}, Type::Bool, s);
     addSig("input_i64", {Type::Str}, Type::I64, s);
     addSig("input_f64", {Type::Str}, Type::F64, s);
     addSig("cli_token_count", {}, Type::I64, s);
@@ -2972,6 +3562,23 @@ private:
     addSig("array_pop", {Type::I64}, Type::Str, s);
     addSig("array_join", {Type::I64, Type::Str}, Type::Str, s);
     addSig("array_includes", {Type::I64, Type::Str}, Type::Bool, s);
+    addSig("array_new_i64", {}, Type::I64, s);
+    addSig("array_push_i64", {Type::I64, Type::I64}, Type::Void, s);
+    addSig("array_get_i64", {Type::I64, Type::I64}, Type::I64, s);
+    addSig("array_set_i64", {Type::I64, Type::I64, Type::I64}, Type::Void, s);
+    addSig("array_pop_i64", {Type::I64}, Type::I64, s);
+    addSig("array_sum_i64", {Type::I64}, Type::I64, s);
+    addSig("array_new_f64", {}, Type::I64, s);
+    addSig("array_push_f64", {Type::I64, Type::F64}, Type::Void, s);
+    addSig("array_get_f64", {Type::I64, Type::I64}, Type::F64, s);
+    addSig("array_set_f64", {Type::I64, Type::I64, Type::F64}, Type::Void, s);
+    addSig("array_pop_f64", {Type::I64}, Type::F64, s);
+    addSig("array_sum_f64", {Type::I64}, Type::F64, s);
+    // Emitted only by the optimizer's bounds-check hoisting, behind a range check on the whole loop.
+    addSig("__ls_array_len_i64", {Type::I64}, Type::I64, s);
+    addSig("__ls_array_len_f64", {Type::I64}, Type::I64, s);
+    addSig("__ls_array_get_i64_unchecked", {Type::I64, Type::I64}, Type::I64, s);
+    addSig("__ls_array_get_f64_unchecked", {Type::I64, Type::I64}, Type::F64, s);
     addSig("dict_new", {}, Type::I64, s);
     addSig("dict_len", {Type::I64}, Type::I64, s);
     addSig("dict_free", {Type::I64}, Type::Void, s);
@@ -2979,6 +3586,14 @@ private:
     addSig("dict_get", {Type::I64, Type::Str}, Type::Str, s);
     addSig("dict_has", {Type::I64, Type::Str}, Type::Bool, s);
     addSig("dict_remove", {Type::I64, Type::Str}, Type::Void, s);
+    addSig("dict_new_i64", {}, Type::I64, s);
+    addSig("dict_set_i64", {Type::I64, Type::Str, Type::I64}, Type::Void, s);
+    addSig("dict_get_i64", {Type::I64, Type::Str}, Type::I64, s);
+    addSig("dict_add_i64", {Type::I64, Type::Str, Type::I64}, Type::I64, s);
+    addSig("dict_new_f64", {}, Type::I64, s);
+    addSig("dict_set_f64", {Type::I64, Type::Str, Type::F64}, Type::Void, s);
+    addSig("dict_get_f64", {Type::I64, Type::Str}, Type::F64, s);
+    addSig("dict_add_f64", {Type::I64, Type::Str, Type::F64}, Type::F64, s);
     addSig("map_new", {}, Type::I64, s);
     addSig("map_len", {Type::I64}, Type::I64, s);
     addSig("map_free", {Type::I64}, Type::Void, s);
@@ -3025,6 +3640,9 @@ private:
     addSig("gfx_draw_bitmap", {Type::I64, Type::I64, Type::I64, Type::I64}, Type::Void, s);
     addSig("gfx_text", {Type::I64, Type::I64, Type::I64, Type::Str, Type::I64, Type::I64, Type::I64}, Type::Void, s);
     addSig("gfx_text_width", {Type::Str}, Type::I64, s);
+    addSig("gfx_set_batching", {Type::I64, Type::Bool}, Type::Void, s);
+    addSig("gfx_batching_enabled", {Type::I64}, Type::Bool, s);
+    addSig("gfx_flush", {Type::I64}, Type::Void, s);
     addSig("bitmap_new", {Type::I64, Type::I64}, Type::I64, s);
     addSig("bitmap_load", {Type::Str}, Type::I64, s);
     addSig("bitmap_free", {Type::I64}, Type::Void, s);
@@ -3087,6 +3705,12 @@ private:
     addSig("game_text_width", {Type::Str}, Type::I64, s);
     addSig("game_save_ppm", {Type::I64, Type::Str}, Type::Bool, s);
     addSig("game_checksum", {Type::I64}, Type::I64, s);
+    addSig("game_set_batching", {Type::I64, Type::Bool}, Type::Void, s);
+    addSig("game_batching_enabled", {Type::I64}, Type::Bool, s);
+    addSig("game_flush", {Type::I64}, Type::Void, s);
+    addSig("game_dirty_pixels", {Type::I64}, Type::I64, s);
+    addSig("game_dirty_rect_count", {Type::I64}, Type::I64, s);
+    addSig("game_invalidate", {Type::I64}, Type::Void, s);
     addSig("pg_init", {Type::I64, Type::I64, Type::Str, Type::Bool}, Type::I64, s);
     addSig("pg_quit", {Type::I64}, Type::Void, s);
     addSig("pg_should_quit", {Type::I64}, Type::Bool, s);
@@ -3151,6 +3775,7 @@ private:
     addSig("np_len", {Type::I64}, Type::I64, s);
     addSig("np_get", {Type::I64, Type::I64}, Type::F64, s);
     addSig("np_set", {Type::I64, Type::I64, Type::F64}, Type::Void, s);
+    addSig("__ls_np_get_unchecked", {Type::I64, Type::I64}, Type::F64, s);
     addSig("np_copy", {Type::I64}, Type::I64, s);
     addSig("np_fill", {Type::I64, Type::F64}, Type::Void, s);
     addSig("np_from_range", {Type::F64, Type::F64, Type::F64}, Type::I64, s);
@@ -3168,6 +3793,24 @@ private:
     addSig("np_mul_scalar", {Type::I64, Type::F64}, Type::Void, s);
     addSig("np_clip", {Type::I64, Type::F64, Type::F64}, Type::Void, s);
     addSig("np_abs", {Type::I64}, Type::Void, s);
+    addSig("np_new_f32", {Type::I64}, Type::I64, s);
+    addSig("np_mat_new", {Type::I64, Type::I64}, Type::I64, s);
+    addSig("np_mat_new_f32", {Type::I64, Type::I64}, Type::I64, s);
+    addSig("np_rows", {Type::I64}, Type::I64, s);
+    addSig("np_cols", {Type::I64}, Type::I64, s);
+    addSig("np_reshape", {Type::I64, Type::I64, Type::I64}, Type::Bool, s);
+    addSig("np_mat_get", {Type::I64, Type::I64, Type::I64}, Type::F64, s);
+    addSig("np_mat_set", {Type::I64, Type::I64, Type::I64, Type::F64}, Type::Void, s);
+    addSig("np_add_into", {Type::I64, Type::I64, Type::I64}, Type::Bool, s);
+    addSig("np_sub_into", {Type::I64, Type::I64, Type::I64}, Type::Bool, s);
+    addSig("np_mul_into", {Type::I64, Type::I64, Type::I64}, Type::Bool, s);
+    addSig("np_div_into", {Type::I64, Type::I64, Type::I64}, Type::Bool, s);
+    addSig("np_matmul", {Type::I64, Type::I64}, Type::I64, s);
+    addSig("np_matmul_into", {Type::I64, Type::I64, Type::I64}, Type::Bool, s);
+    addSig("np_transpose", {Type::I64}, Type::I64, s);
+    addSig("np_transpose_into", {Type::I64, Type::I64}, Type::Bool, s);
+    addSig("np_sum_axis", {Type::I64, Type::I64}, Type::I64, s);
+    addSig("np_sum_axis_into", {Type::I64, Type::I64, Type::I64}, Type::Bool, s);
     addSig("phys_new", {Type::F64, Type::F64, Type::F64, Type::F64, Type::Bool}, Type::I64, s);
     addSig("phys_free", {Type::I64}, Type::Void, s);
     addSig("phys_set_position", {Type::I64, Type::F64, Type::F64, Type::F64}, Type::Void, s);
@@ -3182,6 +3825,10 @@ private:
     addSig("phys_get_vy", {Type::I64}, Type::F64, s);
     addSig("phys_get_vz", {Type::I64}, Type::F64, s);
     addSig("phys_is_soft", {Type::I64}, Type::Bool, s);
+    addSig("phys_set_radius", {Type::I64, Type::F64}, Type::Void, s);
+    addSig("phys_get_radius", {Type::I64}, Type::F64, s);
+    addSig("phys_count", {}, Type::I64, s);
+    addSig("phys_contact_count", {}, Type::I64, s);
     addSig("camera_bind", {Type::I64}, Type::Void, s);
     addSig("camera_target", {}, Type::I64, s);
     addSig("camera_set_offset", {Type::F64, Type::F64, Type::F64}, Type::Void, s);
@@ -3305,16 +3952,24 @@ private:
   static std::string ownedFreeFnForCtor(const Expr &initExpr) {
     if (initExpr.k != EK::Call) return "";
     const auto &c = static_cast<const ECall &>(initExpr);
-    if (c.f == "array_new") return "array_free";
-    if (c.f == "dict_new") return "dict_free";
+    if (c.f == "array_new" || c.f == "array_new_i64" || c.f == "array_new_f64") return "array_free";
+    if (c.f == "dict_new" || c.f == "dict_new_i64" || c.f == "dict_new_f64") return "dict_free";
     if (c.f == "map_new") return "map_free";
     if (c.f == "object_new") return "object_free";
-    if (c.f == "np_new" || c.f == "np_copy" || c.f == "np_from_range" || c.f == "np_linspace") return "np_free";
+    if (c.f == "np_new" || c.f == "np_copy" || c.f == "np_from_range" || c.f == "np_linspace" ||
+        c.f == "np_new_f32" || c.f == "np_mat_new" || c.f == "np_mat_new_f32" || c.f == "np_matmul" ||
+        c.f == "np_transpose" || c.f == "np_sum_axis")
+      return "np_free";
     if (c.f == "gfx_new" || c.f == "pg_surface_new" || c.f == "bitmap_new" || c.f == "bitmap_load") return "gfx_free";
     if (c.f == "game_new" || c.f == "pg_init") return "game_free";
     if (c.f == "phys_new") return "phys_free";
     if (c.f == "http_server_listen") return "http_server_close";
     if (c.f == "http_client_connect") return "http_client_close";
+    if (c.f == "file_map") return "file_unmap";
+    if (c.f == "file_cursor" || c.f == "file_cursor_delim") return "file_cursor_free";
+    if (c.f == "file_writer_open") return "file_writer_close";
+    if (c.f == "chan_new") return "chan_free";
+    if (c.f == "atomic_new") return "atomic_free";
     if (c.f == "result_ok" || c.f == "result_err") return "result_free";
     if (c.f == "option_some" || c.f == "option_none") return "option_free";
     return "";
@@ -3337,7 +3992,8 @@ private:
       }
       n.inf = ft;
       n.typed = true;
-      l[n.n] = Local{ft, n.isConst, n.isOwned, n.ownedFreeFn};
+      l[n.n] = Local{ft, n.isConst, n.isOwned, n.ownedFreeFn, spawnResultType(*n.v)};
+      l[n.n].elemT = containerElemType(*n.v, l[n.n].container);
       return;
     }
     case SK::Assign: {
@@ -3348,6 +4004,8 @@ private:
       req(!l[n.n].isOwned, s.s,
           "cannot assign to owned handle '" + n.n + "'; release explicitly and declare a new owned handle");
       req(can(vt, l[n.n].t), s.s, "cannot assign '" + typeName(vt) + "' to '" + typeName(l[n.n].t) + "'");
+      l[n.n].taskT = spawnResultType(*n.v);
+      l[n.n].elemT = containerElemType(*n.v, l[n.n].container);
       return;
     }
     case SK::Expr: {
@@ -3411,11 +4069,40 @@ private:
         forbidden.reserve(l.size() + 1);
         for (const auto &[name, _] : l) forbidden.insert(name);
         forbidden.insert(n.n);
+        for (const ParReduction &r : n.reductions) {
+          auto it = l.find(r.var);
+          req(r.var != n.n, s.s, "loop variable '" + r.var + "' cannot be a reduce(...) target");
+          req(it != l.end(), s.s, "unknown reduce(...) variable '" + r.var + "'");
+          req(!it->second.isConst, s.s, "cannot reduce into const variable '" + r.var + "'");
+          const Type rt = it->second.t;
+          if (r.op == "and" || r.op == "or") {
+            req(rt == Type::Bool, s.s, "reduce(" + r.op + ": " + r.var + ") requires bool, got '" + typeName(rt) + "'");
+          } else {
+            req(rt == Type::I64 || rt == Type::I32 || rt == Type::F64 || rt == Type::F32, s.s,
+                "reduce(" + r.op + ": " + r.var + ") requires a numeric variable, got '" + typeName(rt) + "'");
+          }
+          forbidden.erase(r.var);
+        }
+        const ParReduction *r = optimizedInput_ ? nullptr : misusedReduction(n.b, n.reductions);
+        if (r) {
+          const std::string &v = r->var;
+          std::string form = v + " = " + v + " " + r->op + " e";
+          if (r->op == "min" || r->op == "max") form = v + " = " + r->op + "(" + v + ", e)";
+          if (r->op == "and") form = v + " = " + v + " && e";
+          if (r->op == "or") form = v + " = " + v + " || e";
+          const std::string msg = "reduce(" + r->op + ": " + v + ") target can only be updated as '" + form +
+                                  "' and not otherwise read inside the parallel for";
+          if (superuserMode_) {
+            warn(s.s, "superuser mode: " + msg);
+          } else {
+            throw CompileError(s.s, msg);
+          }
+        }
         if (hasForbiddenAssign(n.b, forbidden)) {
           if (superuserMode_) {
             warn(s.s, "superuser mode: allowing outer-variable writes in parallel for");
           } else {
-            throw CompileError(s.s, "parallel for cannot assign to outer variables");
+            throw CompileError(s.s, "parallel for cannot assign to outer variables; use reduce(...) or an atomic_new() cell");
           }
         }
       }
@@ -3510,7 +4197,7 @@ private:
         return mark(*freeRt);
       }
       if (n.op == UK::Neg) {
-        if (!isNum(t)) return failType(e.s, "unary '-' requires numeric", Type::I64);
+        if (!isNum(t) && !isVec(t)) return failType(e.s, "unary '-' requires numeric", Type::I64);
         return mark(t);
       }
       if (t != Type::Bool) return failType(e.s, "unary '!' requires bool", Type::Bool);
@@ -3551,6 +4238,22 @@ private:
           return mark(*freeRt);
         }
       }
+      if (isVec(a) || isVec(b)) {
+        const Type vt = isVec(a) ? a : b;
+        const bool arith = n.op == BK::Add || n.op == BK::Sub || n.op == BK::Mul || n.op == BK::Div;
+        if (!arith) {
+          return failType(e.s, "operator '" + operatorSymbolText(n.op) + "' is not defined on '" + typeName(vt) +
+                                   "'; use simd_lt/simd_eq/... for lane-wise compares",
+                          vt);
+        }
+        // A scalar operand is broadcast to every lane.
+        const Type other = isVec(a) ? b : a;
+        const bool broadcast = isNum(other) && (vecLaneType(vt) != Type::I64 || isInt(other));
+        if (a != b && !broadcast) {
+          return failType(e.s, "cannot mix '" + typeName(a) + "' and '" + typeName(b) + "' in vector arithmetic", vt);
+        }
+        return mark(vt);
+      }
       switch (n.op) {
       case BK::Add:
       case BK::Sub:
@@ -3598,7 +4301,7 @@ private:
     }
     case EK::Call: {
       auto &n = static_cast<ECall &>(e);
-      const std::string fnName = canonicalSuperuserCallName(n.f);
+      std::string fnName = canonicalSuperuserCallName(n.f);
       if (isRawMemFunction(fnName)) {
         warn(e.s, "raw memory API '" + fnName +
                       "' used directly; prefer typed ptr/slice wrappers and isolate raw access to audited blocks");
@@ -3652,6 +4355,10 @@ private:
           return mark(Type::Void);
         }
         Type at = expr(*n.a[0], l, throwsAllowed);
+        if (isVec(at)) {
+          n.f = fnName + "_" + typeName(at);
+          return mark(Type::Void);
+        }
         if (!isPrintable(at)) {
           failVoid(n.a[0]->s, "arg 1 cannot print type '" + typeName(at) + "'");
         }
@@ -3681,6 +4388,18 @@ private:
         }
         return mark(promote(a0, a1));
       }
+      if (fnName == "black_box") {
+        if (n.a.size() != 1) {
+          failVoid(e.s, "function 'black_box' expects 1 arg");
+          return mark(Type::I64);
+        }
+        Type a0 = expr(*n.a[0], l, throwsAllowed);
+        if (a0 == Type::Void || isVec(a0)) {
+          failVoid(n.a[0]->s, a0 == Type::Void ? "black_box requires a value" : "black_box takes a scalar value");
+          return mark(Type::I64);
+        }
+        return mark(a0);
+      }
       if (fnName == "abs") {
         if (n.a.size() != 1) {
           failVoid(e.s, "function '" + n.f + "' expects 1 arg");
@@ -3712,6 +4431,7 @@ private:
         return mark(Type::Void);
       }
       if (fnName == "spawn") {
+        if (n.a.size() == 2 && n.a[1]->k == EK::Str) n.a.pop_back();
         if (n.a.size() != 1) {
           failVoid(e.s, "function 'spawn' expects 1 arg");
           return mark(Type::I64);
@@ -3722,33 +4442,80 @@ private:
         }
         auto &target = static_cast<ECall &>(*n.a[0]);
         const std::string targetFnName = canonicalSuperuserCallName(target.f);
-        if (!target.a.empty()) {
-          failVoid(target.s, "spawn target must not take arguments");
-        }
-        std::optional<OverloadCandidate> targetCand = resolveOverload(targetFnName, {}, target.s);
-        if (!targetCand.has_value()) {
-          auto itTarget = sig_.find(targetFnName);
-          if (itTarget == sig_.end()) {
-            failVoid(target.s, "unknown function '" + target.f + "'");
-            return mark(Type::I64);
-          }
-          targetCand = OverloadCandidate{targetFnName, itTarget->second};
+        if (target.a.size() > kSpawnMaxArgs) {
+          failVoid(target.s, "spawn target supports at most " + std::to_string(kSpawnMaxArgs) + " arguments");
+          return mark(Type::I64);
         }
-        target.f = targetCand->symbol;
-        if (!targetCand->sig.p.empty()) {
-          failVoid(target.s, "spawn target must have zero parameters");
+        if (!overloads_.count(targetFnName) && !sig_.count(targetFnName)) {
+          failVoid(target.s, "unknown function '" + target.f + "'");
+          return mark(Type::I64);
         }
-        if (targetCand->sig.r != Type::Void) {
-          failVoid(target.s, "spawn target must return void");
+        const Type rt = expr(target, l, throwsAllowed);
+        bool vecArg = isVec(rt);
+        for (const EP &arg : target.a) vecArg = vecArg || (arg->typed && isVec(arg->inf));
+        if (vecArg) {
+          failVoid(target.s, "spawn cannot pass or return SIMD vector values");
+          return mark(Type::I64);
         }
+        // The task layout rides along as a literal so it survives optimizer clones of the call.
+        std::string layout(1, spawnTypeCode(rt));
+        layout.push_back(':');
+        for (const EP &arg : target.a) layout.push_back(spawnTypeCode(arg->typed ? arg->inf : Type::I64));
+        n.a.push_back(std::make_unique<EString>(layout, e.s));
         return mark(Type::I64);
       }
+      const bool awaitFamily = fnName == "await" || fnName == "await_i64" || fnName == "await_f64" || fnName == "await_str";
+      if (awaitFamily && n.a.size() == 1 &&
+          (n.a[0]->k == EK::Var || (n.a[0]->k == EK::Call && static_cast<const ECall &>(*n.a[0]).f == "spawn"))) {
+        Type rt = Type::Void;
+        if (n.a[0]->k == EK::Var) {
+          auto it = l.find(static_cast<const EVar &>(*n.a[0]).n);
+          if (it != l.end()) rt = it->second.taskT;
+          (void)expr(*n.a[0], l, throwsAllowed);
+        } else {
+          (void)expr(*n.a[0], l, throwsAllowed);
+          rt = spawnResultType(*n.a[0]);
+        }
+        if (rt == Type::Void) {
+          if (fnName == "await") return mark(Type::Void);
+          return mark(sig_.at(fnName).r);
+        }
+        const std::string accessor = rt == Type::Str ? "await_str" : (isFloat(rt) ? "await_f64" : "await_i64");
+        if (fnName != "await" && fnName != accessor) {
+          return failType(e.s, "'" + fnName + "' used on a task returning '" + typeName(rt) + "'; use await()", rt);
+        }
+        n.f = accessor;
+        return mark(rt);
+      }
+      if (!n.a.empty() && n.a[0]->k == EK::Var) {
+        auto it = l.find(static_cast<const EVar &>(*n.a[0]).n);
+        if (it != l.end() && it->second.container != 0) {
+          bool mismatch = false;
+          const std::string typedFn = typedContainerCall(fnName, it->second.container, it->second.elemT, mismatch);
+          if (mismatch) {
+            const bool isArray = it->second.container == 'a';
+            std::string msg = "'" + fnName + "' used on " + (isArray ? "an array" : "a dict") + " of '" +
+                              typeName(it->second.elemT) + "'";
+            const std::size_t cut = fnName.size() - 4;
+            if (fnName.size() > 4 && (fnName.compare(cut, 4, "_i64") == 0 || fnName.compare(cut, 4, "_f64") == 0) &&
+                sig_.count(fnName.substr(0, cut)))
+              msg += "; use " + fnName.substr(0, cut) + "()";
+            return failType(e.s, msg, sig_.count(fnName) ? sig_.at(fnName).r : Type::I64);
+          }
+          fnName = typedFn;
+        }
+      }
       std::vector<Type> argTypes;
       argTypes.reserve(n.a.size());
       for (auto &arg : n.a) argTypes.push_back(expr(*arg, l, throwsAllowed));
       std::optional<OverloadCandidate> cand = resolveOverload(fnName, argTypes, e.s);
       if (!cand.has_value()) {
         auto it = sig_.find(fnName);
+        if (it == sig_.end() && overloads_.count(fnName)) {
+          std::string shown;
+          for (std::size_t i = 0; i < argTypes.size(); ++i) shown += (i ? ", " : "") + typeName(argTypes[i]);
+          return failType(e.s, "no overload of '" + n.f + "' takes (" + shown + ")", Type::I64);
+        }
         if (it == sig_.end()) return failType(e.s, "unknown function '" + n.f + "'", Type::I64);
         cand = OverloadCandidate{fnName, it->second};
       }
@@ -3871,86 +4638,16 @@ static bool hasCallPrefix(const Expr &e, const std::string &prefix) {
   return false;
 }
 
-static bool hasFormatMarkerExpr(const Expr &e) { return hasCall(e, ".format"); }
-static bool hasFormatMarkerStmt(const Stmt &s);
-static bool hasParallelForStmt(const Stmt &s);
-static bool hasWinGraphicsDepStmt(const Stmt &s);
 static bool isMinimalRuntimeCallName(const std::string &name) {
   return name == "print" || name == "println" || name == "print_i64" || name == "print_f64" ||
          name == "print_bool" || name == "print_str" || name == "println_i64" || name == "println_f64" ||
          name == "println_bool" || name == "println_str" || name == "formatOutput" || name == "FormatOutput" ||
-         name == "stateSpeed" || name == ".stateSpeed";
+         name == "stateSpeed" || name == ".stateSpeed" || name == "flush";
 }
 static bool isUltraMinimalRuntimeCallName(const std::string &name) {
   return name == "print" || name == "println" || name == "print_i64" || name == "print_bool" ||
          name == "print_str" || name == "println_i64" || name == "println_bool" || name == "println_str";
 }
-static bool hasOnlyMinimalRuntimeCallsExpr(const Expr &e) {
-  switch (e.k) {
-  case EK::Call: {
-    const auto &n = static_cast<const ECall &>(e);
-    if (!isMinimalRuntimeCallName(n.f)) return false;
-    for (const auto &arg : n.a) {
-      if (!hasOnlyMinimalRuntimeCallsExpr(*arg)) return false;
-    }
-    return true;
-  }
-  case EK::Unary:
-    return hasOnlyMinimalRuntimeCallsExpr(*static_cast<const EUnary &>(e).x);
-  case EK::Binary: {
-    const auto &n = static_cast<const EBinary &>(e);
-    return hasOnlyMinimalRuntimeCallsExpr(*n.l) && hasOnlyMinimalRuntimeCallsExpr(*n.r);
-  }
-  default:
-    return true;
-  }
-}
-static bool hasOnlyMinimalRuntimeCallsStmt(const Stmt &s);
-static bool hasOnlyMinimalRuntimeCallsBlock(const std::vector<SP> &b) {
-  for (const auto &stmt : b) {
-    if (!hasOnlyMinimalRuntimeCallsStmt(*stmt)) return false;
-  }
-  return true;
-}
-static bool hasOnlyMinimalRuntimeCallsStmt(const Stmt &s) {
-  switch (s.k) {
-  case SK::Let: return hasOnlyMinimalRuntimeCallsExpr(*static_cast<const SLet &>(s).v);
-  case SK::Assign: return hasOnlyMinimalRuntimeCallsExpr(*static_cast<const SAssign &>(s).v);
-  case SK::Expr: return hasOnlyMinimalRuntimeCallsExpr(*static_cast<const SExpr &>(s).e);
-  case SK::Ret: {
-    const auto &n = static_cast<const SRet &>(s);
-    return !n.has || !n.v || hasOnlyMinimalRuntimeCallsExpr(*n.v);
-  }
-  case SK::If: {
-    const auto &n = static_cast<const SIf &>(s);
-    return hasOnlyMinimalRuntimeCallsExpr(*n.c) && hasOnlyMinimalRuntimeCallsBlock(n.t) &&
-           hasOnlyMinimalRuntimeCallsBlock(n.e);
-  }
-  case SK::While: {
-    const auto &n = static_cast<const SWhile &>(s);
-    return hasOnlyMinimalRuntimeCallsExpr(*n.c) && hasOnlyMinimalRuntimeCallsBlock(n.b);
-  }
-  case SK::For: {
-    const auto &n = static_cast<const SFor &>(s);
-    return hasOnlyMinimalRuntimeCallsExpr(*n.start) && hasOnlyMinimalRuntimeCallsExpr(*n.stop) &&
-           hasOnlyMinimalRuntimeCallsExpr(*n.step) && hasOnlyMinimalRuntimeCallsBlock(n.b);
-  }
-  case SK::FormatBlock: {
-    return false;
-  }
-  case SK::Break:
-  case SK::Continue:
-    return true;
-  }
-  return true;
-}
-static bool hasOnlyMinimalRuntimeCallsProgram(const Program &p) {
-  for (const auto &f : p.f) {
-    if (f.ex) continue;
-    if (!hasOnlyMinimalRuntimeCallsBlock(f.b)) return false;
-  }
-  return true;
-}
 static bool hasOnlyUltraMinimalRuntimeCallsExpr(const Expr &e) {
   switch (e.k) {
   case EK::Call: {
@@ -4092,58 +4789,57 @@ static bool usesStringRuntimeProgram(const Program &p) {
   }
   return false;
 }
-static bool exprUsesF64(const Expr &e) {
-  if (e.inf == Type::F64 || e.inf == Type::F32) return true;
+static bool exprAllocatesStr(const Expr &e) {
   switch (e.k) {
   case EK::Unary:
-    return exprUsesF64(*static_cast<const EUnary &>(e).x);
+    return exprAllocatesStr(*static_cast<const EUnary &>(e).x);
   case EK::Binary: {
     const auto &n = static_cast<const EBinary &>(e);
-    return exprUsesF64(*n.l) || exprUsesF64(*n.r);
+    return exprAllocatesStr(*n.l) || exprAllocatesStr(*n.r);
   }
   case EK::Call: {
     const auto &n = static_cast<const ECall &>(e);
-    for (const auto &a : n.a) if (exprUsesF64(*a)) return true;
+    if (n.typed && n.inf == Type::Str) return true;
+    for (const auto &a : n.a) if (exprAllocatesStr(*a)) return true;
     return false;
   }
   default:
     return false;
   }
 }
-static bool stmtUsesF64(const Stmt &s);
-static bool blockUsesF64(const std::vector<SP> &b) {
-  for (const auto &stmt : b) if (stmtUsesF64(*stmt)) return true;
+static bool stmtAllocatesStr(const Stmt &s);
+static bool blockAllocatesStr(const std::vector<SP> &b) {
+  for (const auto &stmt : b) if (stmtAllocatesStr(*stmt)) return true;
   return false;
 }
-static bool stmtUsesF64(const Stmt &s) {
+static bool stmtAllocatesStr(const Stmt &s) {
   switch (s.k) {
-  case SK::Let: {
-    const auto &n = static_cast<const SLet &>(s);
-    return (n.inf == Type::F64 || n.inf == Type::F32) || exprUsesF64(*n.v);
-  }
+  case SK::Let:
+    return exprAllocatesStr(*static_cast<const SLet &>(s).v);
   case SK::Assign:
-    return exprUsesF64(*static_cast<const SAssign &>(s).v);
+    return exprAllocatesStr(*static_cast<const SAssign &>(s).v);
   case SK::Expr:
-    return exprUsesF64(*static_cast<const SExpr &>(s).e);
+    return exprAllocatesStr(*static_cast<const SExpr &>(s).e);
   case SK::Ret: {
     const auto &n = static_cast<const SRet &>(s);
-    return n.has && n.v && exprUsesF64(*n.v);
+    return n.has && n.v && exprAllocatesStr(*n.v);
   }
   case SK::If: {
     const auto &n = static_cast<const SIf &>(s);
-    return exprUsesF64(*n.c) || blockUsesF64(n.t) || blockUsesF64(n.e);
+    return exprAllocatesStr(*n.c) || blockAllocatesStr(n.t) || blockAllocatesStr(n.e);
   }
   case SK::While: {
     const auto &n = static_cast<const SWhile &>(s);
-    return exprUsesF64(*n.c) || blockUsesF64(n.b);
+    return exprAllocatesStr(*n.c) || blockAllocatesStr(n.b);
   }
   case SK::For: {
     const auto &n = static_cast<const SFor &>(s);
-    return exprUsesF64(*n.start) || exprUsesF64(*n.stop) || exprUsesF64(*n.step) || blockUsesF64(n.b);
+    return exprAllocatesStr(*n.start) || exprAllocatesStr(*n.stop) || exprAllocatesStr(*n.step) ||
+           blockAllocatesStr(n.b);
   }
   case SK::FormatBlock: {
     const auto &n = static_cast<const SFormatBlock &>(s);
-    return (n.endArg && exprUsesF64(*n.endArg)) || blockUsesF64(n.b);
+    return (n.endArg && exprAllocatesStr(*n.endArg)) || blockAllocatesStr(n.b);
   }
   case SK::Break:
   case SK::Continue:
@@ -4151,46 +4847,58 @@ static bool stmtUsesF64(const Stmt &s) {
   }
   return false;
 }
-static bool usesF64Program(const Program &p) {
-  for (const auto &f : p.f) {
-    if (f.ex) continue;
-    if (f.ret == Type::F64 || f.ret == Type::F32) return true;
-    for (const auto &param : f.p) if (param.t == Type::F64 || param.t == Type::F32) return true;
-    if (blockUsesF64(f.b)) return true;
+static bool exprUsesF64(const Expr &e) {
+  if (e.inf == Type::F64 || e.inf == Type::F32) return true;
+  switch (e.k) {
+  case EK::Unary:
+    return exprUsesF64(*static_cast<const EUnary &>(e).x);
+  case EK::Binary: {
+    const auto &n = static_cast<const EBinary &>(e);
+    return exprUsesF64(*n.l) || exprUsesF64(*n.r);
+  }
+  case EK::Call: {
+    const auto &n = static_cast<const ECall &>(e);
+    for (const auto &a : n.a) if (exprUsesF64(*a)) return true;
+    return false;
+  }
+  default:
+    return false;
   }
-  return false;
 }
-static bool hasCallNamedStmt(const Stmt &s, const std::string &name);
-static bool hasCallNamedBlock(const std::vector<SP> &b, const std::string &name) {
-  for (const SP &stmt : b)
-    if (hasCallNamedStmt(*stmt, name)) return true;
+static bool stmtUsesF64(const Stmt &s);
+static bool blockUsesF64(const std::vector<SP> &b) {
+  for (const auto &stmt : b) if (stmtUsesF64(*stmt)) return true;
   return false;
 }
-static bool hasCallNamedStmt(const Stmt &s, const std::string &name) {
+static bool stmtUsesF64(const Stmt &s) {
   switch (s.k) {
-  case SK::Let: return hasCall(*static_cast<const SLet &>(s).v, name);
-  case SK::Assign: return hasCall(*static_cast<const SAssign &>(s).v, name);
-  case SK::Expr: return hasCall(*static_cast<const SExpr &>(s).e, name);
+  case SK::Let: {
+    const auto &n = static_cast<const SLet &>(s);
+    return (n.inf == Type::F64 || n.inf == Type::F32) || exprUsesF64(*n.v);
+  }
+  case SK::Assign:
+    return exprUsesF64(*static_cast<const SAssign &>(s).v);
+  case SK::Expr:
+    return exprUsesF64(*static_cast<const SExpr &>(s).e);
   case SK::Ret: {
     const auto &n = static_cast<const SRet &>(s);
-    return n.has && n.v && hasCall(*n.v, name);
+    return n.has && n.v && exprUsesF64(*n.v);
   }
   case SK::If: {
     const auto &n = static_cast<const SIf &>(s);
-    return hasCall(*n.c, name) || hasCallNamedBlock(n.t, name) || hasCallNamedBlock(n.e, name);
+    return exprUsesF64(*n.c) || blockUsesF64(n.t) || blockUsesF64(n.e);
   }
   case SK::While: {
     const auto &n = static_cast<const SWhile &>(s);
-    return hasCall(*n.c, name) || hasCallNamedBlock(n.b, name);
+    return exprUsesF64(*n.c) || blockUsesF64(n.b);
   }
   case SK::For: {
     const auto &n = static_cast<const SFor &>(s);
-    return hasCall(*n.start, name) || hasCall(*n.stop, name) || hasCall(*n.step, name) ||
-           hasCallNamedBlock(n.b, name);
+    return exprUsesF64(*n.start) || exprUsesF64(*n.stop) || exprUsesF64(*n.step) || blockUsesF64(n.b);
   }
   case SK::FormatBlock: {
     const auto &n = static_cast<const SFormatBlock &>(s);
-    return (n.endArg && hasCall(*n.endArg, name)) || hasCallNamedBlock(n.b, name);
+    return (n.endArg && exprUsesF64(*n.endArg)) || blockUsesF64(n.b);
   }
   case SK::Break:
   case SK::Continue:
@@ -4198,46 +4906,46 @@ static bool hasCallNamedStmt(const Stmt &s, const std::string &name) {
   }
   return false;
 }
-static bool hasFormatMarkerBlock(const std::vector<SP> &b) {
-  for (const SP &stmt : b)
-    if (hasFormatMarkerStmt(*stmt)) return true;
-  return false;
-}
-static bool hasWinGraphicsDepBlock(const std::vector<SP> &b) {
-  for (const SP &stmt : b)
-    if (hasWinGraphicsDepStmt(*stmt)) return true;
+static bool usesF64Program(const Program &p) {
+  for (const auto &f : p.f) {
+    if (f.ex) continue;
+    if (f.ret == Type::F64 || f.ret == Type::F32) return true;
+    for (const auto &param : f.p) if (param.t == Type::F64 || param.t == Type::F32) return true;
+    if (blockUsesF64(f.b)) return true;
+  }
   return false;
 }
-static bool hasParallelForBlock(const std::vector<SP> &b) {
+static bool hasCallNamedStmt(const Stmt &s, const std::string &name);
+static bool hasCallNamedBlock(const std::vector<SP> &b, const std::string &name) {
   for (const SP &stmt : b)
-    if (hasParallelForStmt(*stmt)) return true;
+    if (hasCallNamedStmt(*stmt, name)) return true;
   return false;
 }
-static bool hasFormatMarkerStmt(const Stmt &s) {
+static bool hasCallNamedStmt(const Stmt &s, const std::string &name) {
   switch (s.k) {
-  case SK::Let: return hasFormatMarkerExpr(*static_cast<const SLet &>(s).v);
-  case SK::Assign: return hasFormatMarkerExpr(*static_cast<const SAssign &>(s).v);
-  case SK::Expr: return hasFormatMarkerExpr(*static_cast<const SExpr &>(s).e);
+  case SK::Let: return hasCall(*static_cast<const SLet &>(s).v, name);
+  case SK::Assign: return hasCall(*static_cast<const SAssign &>(s).v, name);
+  case SK::Expr: return hasCall(*static_cast<const SExpr &>(s).e, name);
   case SK::Ret: {
     const auto &n = static_cast<const SRet &>(s);
-    return n.has && n.v && hasFormatMarkerExpr(*n.v);
+    return n.has && n.v && hasCall(*n.v, name);
   }
   case SK::If: {
     const auto &n = static_cast<const SIf &>(s);
-    return hasFormatMarkerExpr(*n.c) || hasFormatMarkerBlock(n.t) || hasFormatMarkerBlock(n.e);
+    return hasCall(*n.c, name) || hasCallNamedBlock(n.t, name) || hasCallNamedBlock(n.e, name);
   }
   case SK::While: {
     const auto &n = static_cast<const SWhile &>(s);
-    return hasFormatMarkerExpr(*n.c) || hasFormatMarkerBlock(n.b);
+    return hasCall(*n.c, name) || hasCallNamedBlock(n.b, name);
   }
   case SK::For: {
     const auto &n = static_cast<const SFor &>(s);
-    return hasFormatMarkerExpr(*n.start) || hasFormatMarkerExpr(*n.stop) || hasFormatMarkerExpr(*n.step) ||
-           hasFormatMarkerBlock(n.b);
+    return hasCall(*n.start, name) || hasCall(*n.stop, name) || hasCall(*n.step, name) ||
+           hasCallNamedBlock(n.b, name);
   }
   case SK::FormatBlock: {
     const auto &n = static_cast<const SFormatBlock &>(s);
-    return (n.endArg && hasFormatMarkerExpr(*n.endArg)) || hasFormatMarkerBlock(n.b);
+    return (n.endArg && hasCall(*n.endArg, name)) || hasCallNamedBlock(n.b, name);
   }
   case SK::Break:
   case SK::Continue:
@@ -4245,204 +4953,360 @@ static bool hasFormatMarkerStmt(const Stmt &s) {
   }
   return false;
 }
-static bool hasWinGraphicsDepExpr(const Expr &e) {
-  return hasCallPrefix(e, "game_") || hasCallPrefix(e, "pg_") || hasCall(e, "key_down") || hasCall(e, "key_down_name");
-}
-static bool hasWinGraphicsDepStmt(const Stmt &s) {
-  switch (s.k) {
-  case SK::Let: return hasWinGraphicsDepExpr(*static_cast<const SLet &>(s).v);
-  case SK::Assign: return hasWinGraphicsDepExpr(*static_cast<const SAssign &>(s).v);
-  case SK::Expr: return hasWinGraphicsDepExpr(*static_cast<const SExpr &>(s).e);
-  case SK::Ret: {
-    const auto &n = static_cast<const SRet &>(s);
-    return n.has && n.v && hasWinGraphicsDepExpr(*n.v);
+
+// Everything the emitter needs to know about which builtins and constructs a program uses, gathered in
+// one walk instead of one walk per builtin name.
+struct ProgramUsage {
+  std::unordered_set<std::string> calls;
+  bool hasFor = false;
+  bool hasParallelFor = false;
+  bool hasPow = false;
+  bool hasFormatBlock = false;
+  bool called(const std::string &name) const { return calls.count(canonicalSuperuserCallName(name)) != 0; }
+  bool calledAny(std::initializer_list<const char *> names) const {
+    for (const char *name : names) {
+      if (called(name)) return true;
+    }
+    return false;
   }
-  case SK::If: {
-    const auto &n = static_cast<const SIf &>(s);
-    return hasWinGraphicsDepExpr(*n.c) || hasWinGraphicsDepBlock(n.t) || hasWinGraphicsDepBlock(n.e);
+  bool calledPrefix(const std::string &prefix) const {
+    for (const std::string &c : calls) {
+      if (c.rfind(prefix, 0) == 0) return true;
+    }
+    return false;
   }
-  case SK::While: {
-    const auto &n = static_cast<const SWhile &>(s);
-    return hasWinGraphicsDepExpr(*n.c) || hasWinGraphicsDepBlock(n.b);
+  bool callsOnly(bool (*allowed)(const std::string &)) const {
+    for (const std::string &c : calls) {
+      if (!allowed(c)) return false;
+    }
+    return true;
   }
-  case SK::For: {
-    const auto &n = static_cast<const SFor &>(s);
-    return hasWinGraphicsDepExpr(*n.start) || hasWinGraphicsDepExpr(*n.stop) || hasWinGraphicsDepExpr(*n.step) ||
-           hasWinGraphicsDepBlock(n.b);
+};
+static void collectUsageExpr(const Expr &e, ProgramUsage &u) {
+  switch (e.k) {
+  case EK::Call: {
+    const auto &n = static_cast<const ECall &>(e);
+    u.calls.insert(n.f);
+    u.calls.insert(canonicalSuperuserCallName(n.f));
+    for (const EP &a : n.a) collectUsageExpr(*a, u);
+    break;
   }
-  case SK::FormatBlock: {
-    const auto &n = static_cast<const SFormatBlock &>(s);
-    return (n.endArg && hasWinGraphicsDepExpr(*n.endArg)) || hasWinGraphicsDepBlock(n.b);
+  case EK::Unary:
+    collectUsageExpr(*static_cast<const EUnary &>(e).x, u);
+    break;
+  case EK::Binary: {
+    const auto &n = static_cast<const EBinary &>(e);
+    if (n.op == BK::Pow) u.hasPow = true;
+    collectUsageExpr(*n.l, u);
+    collectUsageExpr(*n.r, u);
+    break;
   }
-  case SK::Break:
-  case SK::Continue:
-    return false;
+  default:
+    break;
   }
-  return false;
 }
-static bool hasParallelForStmt(const Stmt &s) {
+static void collectUsageBlock(const std::vector<SP> &b, ProgramUsage &u);
+static void collectUsageStmt(const Stmt &s, ProgramUsage &u) {
   switch (s.k) {
-  case SK::Let:
-  case SK::Assign:
-  case SK::Expr:
-  case SK::Ret:
-  case SK::Break:
-  case SK::Continue:
-    return false;
+  case SK::Let: collectUsageExpr(*static_cast<const SLet &>(s).v, u); break;
+  case SK::Assign: collectUsageExpr(*static_cast<const SAssign &>(s).v, u); break;
+  case SK::Expr: collectUsageExpr(*static_cast<const SExpr &>(s).e, u); break;
+  case SK::Ret: {
+    const auto &n = static_cast<const SRet &>(s);
+    if (n.has && n.v) collectUsageExpr(*n.v, u);
+    break;
+  }
   case SK::If: {
     const auto &n = static_cast<const SIf &>(s);
-    return hasParallelForBlock(n.t) || hasParallelForBlock(n.e);
+    collectUsageExpr(*n.c, u);
+    collectUsageBlock(n.t, u);
+    collectUsageBlock(n.e, u);
+    break;
   }
   case SK::While: {
     const auto &n = static_cast<const SWhile &>(s);
-    return hasParallelForBlock(n.b);
+    collectUsageExpr(*n.c, u);
+    collectUsageBlock(n.b, u);
+    break;
   }
   case SK::For: {
     const auto &n = static_cast<const SFor &>(s);
-    return n.parallel || hasParallelForBlock(n.b);
+    u.hasFor = true;
+    if (n.parallel) u.hasParallelFor = true;
+    collectUsageExpr(*n.start, u);
+    collectUsageExpr(*n.stop, u);
+    collectUsageExpr(*n.step, u);
+    collectUsageBlock(n.b, u);
+    break;
   }
   case SK::FormatBlock: {
     const auto &n = static_cast<const SFormatBlock &>(s);
-    return hasParallelForBlock(n.b);
+    u.hasFormatBlock = true;
+    if (n.endArg) collectUsageExpr(*n.endArg, u);
+    collectUsageBlock(n.b, u);
+    break;
   }
+  case SK::Break:
+  case SK::Continue:
+    break;
   }
-  return false;
 }
-static bool hasFormatMarkerProgram(const Program &p) {
-  for (const Fn &f : p.f) {
-    if (f.ex) continue;
-    if (hasFormatMarkerBlock(f.b)) return true;
-  }
-  return false;
+static void collectUsageBlock(const std::vector<SP> &b, ProgramUsage &u) {
+  for (const SP &stmt : b) collectUsageStmt(*stmt, u);
 }
-static bool hasWinGraphicsDepProgram(const Program &p) {
+static ProgramUsage collectProgramUsage(const Program &p) {
+  ProgramUsage u;
   for (const Fn &f : p.f) {
     if (f.ex) continue;
-    if (hasWinGraphicsDepBlock(f.b)) return true;
+    collectUsageBlock(f.b, u);
   }
-  return false;
+  return u;
 }
-static bool hasParallelForProgram(const Program &p) {
+// Functions that can wait on other tasks: they block on a channel, await, or call a function that does. Only
+// computed for programs that block on channels; a thread waiting in await never runs spawns of these inline, since
+// such a task could end up waiting for something only the suspended waiter beneath it would provide.
+static std::unordered_set<std::string> collectWaitingFunctions(const Program &p, const ProgramUsage &u) {
+  std::unordered_set<std::string> waiting;
+  if (!u.calledAny({"chan_send", "chan_recv", "chan_next"})) return waiting;
+  static const char *const kWaits[] = {"chan_send", "chan_recv", "chan_next", "await",
+                                       "await_i64", "await_f64", "await_str", "await_all"};
+  std::unordered_map<std::string, std::unordered_set<std::string>> calls;
   for (const Fn &f : p.f) {
     if (f.ex) continue;
-    if (hasParallelForBlock(f.b)) return true;
+    ProgramUsage fu;
+    collectUsageBlock(f.b, fu);
+    calls[canonicalSuperuserCallName(f.n)] = std::move(fu.calls);
   }
-  return false;
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (const auto &kv : calls) {
+      if (waiting.count(kv.first)) continue;
+      for (const std::string &c : kv.second) {
+        const bool waits = waiting.count(c) != 0 ||
+                           std::any_of(std::begin(kWaits), std::end(kWaits), [&](const char *w) { return c == w; });
+        if (!waits) continue;
+        waiting.insert(kv.first);
+        changed = true;
+        break;
+      }
+    }
+  }
+  return waiting;
 }
-static bool hasForStmt(const Stmt &s);
-static bool hasForBlock(const std::vector<SP> &b) {
-  for (const SP &stmt : b)
-    if (hasForStmt(*stmt)) return true;
+static bool usesHttpRuntime(const ProgramUsage &u) {
+  static const char *const kHttpBuiltins[] = {
+      "http_server_listen", "http_server_listen_multi", "http_server_workers", "http_server_accept",
+      "http_server_poll", "http_server_read", "http_server_respond_text", "http_server_respond_file",
+      "http_request_method", "http_request_path", "http_request_query", "http_request_header",
+      "http_request_body", "http_server_close", "http_client_connect", "http_client_send",
+      "http_client_read", "http_client_close",
+  };
+  for (const char *name : kHttpBuiltins) {
+    if (u.called(name)) return true;
+  }
   return false;
 }
-static bool hasForStmt(const Stmt &s) {
-  switch (s.k) {
-  case SK::If: {
-    const auto &n = static_cast<const SIf &>(s);
-    return hasForBlock(n.t) || hasForBlock(n.e);
-  }
-  case SK::While: {
-    const auto &n = static_cast<const SWhile &>(s);
-    return hasForBlock(n.b);
-  }
-  case SK::For: {
-    const auto &n = static_cast<const SFor &>(s);
-    (void)n;
-    return true;
-  }
-  case SK::FormatBlock: {
-    const auto &n = static_cast<const SFormatBlock &>(s);
-    return hasForBlock(n.b);
-  }
-  default:
-    return false;
+// Vector values only come from vector builtins, but a function may take or return one without calling any.
+static bool usesSimdRuntime(const Program &p, const ProgramUsage &u) {
+  for (const char *prefix : {"f32x4", "f32x8", "f64x4", "i64x4", "print_f32x", "print_f64x", "print_i64x",
+                             "println_f32x", "println_f64x", "println_i64x"}) {
+    if (u.calledPrefix(prefix)) return true;
   }
-}
-static bool hasForProgram(const Program &p) {
   for (const Fn &f : p.f) {
-    if (f.ex) continue;
-    if (hasForBlock(f.b)) return true;
+    if (isVec(f.ret)) return true;
+    for (const Param &param : f.p) {
+      if (isVec(param.t)) return true;
+    }
   }
   return false;
 }
-static bool exprHasPow(const Expr &e) {
+static bool usesWinGraphicsRuntime(const ProgramUsage &u) {
+  return u.calledPrefix("game_") || u.calledPrefix("pg_") || u.calledAny({"key_down", "key_down_name"});
+}
+
+// np_add/np_sub/np_mul/np_div trees are fused into one kernel per tree shape. The shape is the
+// preorder op string with 'x' for each leaf, e.g. np_add(np_mul(a, b), c) -> "amxxx".
+static char npFuseOp(const Expr &e) {
+  if (e.k != EK::Call) return 0;
+  const auto &c = static_cast<const ECall &>(e);
+  if (c.a.size() != 2) return 0;
+  if (c.f == "np_add") return 'a';
+  if (c.f == "np_sub") return 's';
+  if (c.f == "np_mul") return 'm';
+  if (c.f == "np_div") return 'd';
+  return 0;
+}
+static void npFuseShape(const Expr &e, std::string &shape, std::vector<const Expr *> &leaves) {
+  const char op = npFuseOp(e);
+  if (!op) {
+    shape.push_back('x');
+    leaves.push_back(&e);
+    return;
+  }
+  shape.push_back(op);
+  for (const EP &a : static_cast<const ECall &>(e).a) npFuseShape(*a, shape, leaves);
+}
+// Kernel flavour for a fusion root: 'v' materializes the tree once, 's'/'m' reduce it without
+// materializing, 'g' evaluates a single element. 0 when the call is not a fusion root.
+static char npFuseKind(const ECall &c) {
+  if (npFuseOp(c)) return (npFuseOp(*c.a[0]) || npFuseOp(*c.a[1])) ? 'v' : 0;
+  if (c.f == "np_sum" && c.a.size() == 1 && npFuseOp(*c.a[0])) return 's';
+  if (c.f == "np_mean" && c.a.size() == 1 && npFuseOp(*c.a[0])) return 'm';
+  if (c.f == "np_get" && c.a.size() == 2 && npFuseOp(*c.a[0])) return 'g';
+  return 0;
+}
+static void collectNpFusionsExpr(const Expr &e, std::vector<const ECall *> &out) {
   switch (e.k) {
-  case EK::Unary:
-    return exprHasPow(*static_cast<const EUnary &>(e).x);
+  case EK::Unary: collectNpFusionsExpr(*static_cast<const EUnary &>(e).x, out); return;
   case EK::Binary: {
     const auto &n = static_cast<const EBinary &>(e);
-    return n.op == BK::Pow || exprHasPow(*n.l) || exprHasPow(*n.r);
+    collectNpFusionsExpr(*n.l, out);
+    collectNpFusionsExpr(*n.r, out);
+    return;
   }
   case EK::Call: {
     const auto &n = static_cast<const ECall &>(e);
-    for (const auto &arg : n.a)
-      if (exprHasPow(*arg)) return true;
-    return false;
+    const char kind = npFuseKind(n);
+    if (!kind) {
+      for (const EP &a : n.a) collectNpFusionsExpr(*a, out);
+      return;
+    }
+    out.push_back(&n);
+    std::string shape;
+    std::vector<const Expr *> leaves;
+    npFuseShape(kind == 'v' ? static_cast<const Expr &>(n) : *n.a[0], shape, leaves);
+    for (const Expr *leaf : leaves) collectNpFusionsExpr(*leaf, out);
+    if (kind == 'g') collectNpFusionsExpr(*n.a[1], out);
+    return;
   }
-  default:
-    return false;
+  default: return;
   }
 }
-static bool stmtHasPow(const Stmt &s);
-static bool blockHasPow(const std::vector<SP> &b) {
-  for (const auto &stmt : b)
-    if (stmtHasPow(*stmt)) return true;
-  return false;
-}
-static bool stmtHasPow(const Stmt &s) {
-  switch (s.k) {
-  case SK::Let: return exprHasPow(*static_cast<const SLet &>(s).v);
-  case SK::Assign: return exprHasPow(*static_cast<const SAssign &>(s).v);
-  case SK::Expr: return exprHasPow(*static_cast<const SExpr &>(s).e);
-  case SK::Ret: {
-    const auto &n = static_cast<const SRet &>(s);
-    return n.has && n.v && exprHasPow(*n.v);
-  }
-  case SK::If: {
-    const auto &n = static_cast<const SIf &>(s);
-    return exprHasPow(*n.c) || blockHasPow(n.t) || blockHasPow(n.e);
-  }
-  case SK::While: {
-    const auto &n = static_cast<const SWhile &>(s);
-    return exprHasPow(*n.c) || blockHasPow(n.b);
+static void collectNpFusionsBlock(const std::vector<SP> &b, std::vector<const ECall *> &out) {
+  for (const SP &stmt : b) {
+    const Stmt &s = *stmt;
+    switch (s.k) {
+    case SK::Let: collectNpFusionsExpr(*static_cast<const SLet &>(s).v, out); break;
+    case SK::Assign: collectNpFusionsExpr(*static_cast<const SAssign &>(s).v, out); break;
+    case SK::Expr: collectNpFusionsExpr(*static_cast<const SExpr &>(s).e, out); break;
+    case SK::Ret: {
+      const auto &n = static_cast<const SRet &>(s);
+      if (n.has && n.v) collectNpFusionsExpr(*n.v, out);
+      break;
+    }
+    case SK::If: {
+      const auto &n = static_cast<const SIf &>(s);
+      collectNpFusionsExpr(*n.c, out);
+      collectNpFusionsBlock(n.t, out);
+      collectNpFusionsBlock(n.e, out);
+      break;
+    }
+    case SK::While: {
+      const auto &n = static_cast<const SWhile &>(s);
+      collectNpFusionsExpr(*n.c, out);
+      collectNpFusionsBlock(n.b, out);
+      break;
+    }
+    case SK::For: {
+      const auto &n = static_cast<const SFor &>(s);
+      collectNpFusionsExpr(*n.start, out);
+      collectNpFusionsExpr(*n.stop, out);
+      collectNpFusionsExpr(*n.step, out);
+      collectNpFusionsBlock(n.b, out);
+      break;
+    }
+    case SK::FormatBlock: {
+      const auto &n = static_cast<const SFormatBlock &>(s);
+      if (n.endArg) collectNpFusionsExpr(*n.endArg, out);
+      collectNpFusionsBlock(n.b, out);
+      break;
+    }
+    case SK::Break:
+    case SK::Continue:
+      break;
+    }
   }
-  case SK::For: {
-    const auto &n = static_cast<const SFor &>(s);
-    return exprHasPow(*n.start) || exprHasPow(*n.stop) || exprHasPow(*n.step) || blockHasPow(n.b);
+}
+
+static void collectSpawnCallsExpr(const Expr &e, std::vector<const ECall *> &out) {
+  switch (e.k) {
+  case EK::Unary: collectSpawnCallsExpr(*static_cast<const EUnary &>(e).x, out); return;
+  case EK::Binary: {
+    const auto &n = static_cast<const EBinary &>(e);
+    collectSpawnCallsExpr(*n.l, out);
+    collectSpawnCallsExpr(*n.r, out);
+    return;
   }
-  case SK::FormatBlock: {
-    const auto &n = static_cast<const SFormatBlock &>(s);
-    return (n.endArg && exprHasPow(*n.endArg)) || blockHasPow(n.b);
+  case EK::Call: {
+    const auto &n = static_cast<const ECall &>(e);
+    if (n.f == "spawn") out.push_back(&n);
+    for (const EP &a : n.a) collectSpawnCallsExpr(*a, out);
+    return;
   }
-  case SK::Break:
-  case SK::Continue:
-    return false;
+  default: return;
   }
-  return false;
 }
-static bool hasPowProgram(const Program &p) {
-  for (const auto &f : p.f) {
-    if (f.ex) continue;
-    if (blockHasPow(f.b)) return true;
+static void collectSpawnCallsBlock(const std::vector<SP> &b, std::vector<const ECall *> &out) {
+  for (const SP &stmt : b) {
+    const Stmt &s = *stmt;
+    switch (s.k) {
+    case SK::Let: collectSpawnCallsExpr(*static_cast<const SLet &>(s).v, out); break;
+    case SK::Assign: collectSpawnCallsExpr(*static_cast<const SAssign &>(s).v, out); break;
+    case SK::Expr: collectSpawnCallsExpr(*static_cast<const SExpr &>(s).e, out); break;
+    case SK::Ret: {
+      const auto &n = static_cast<const SRet &>(s);
+      if (n.has && n.v) collectSpawnCallsExpr(*n.v, out);
+      break;
+    }
+    case SK::If: {
+      const auto &n = static_cast<const SIf &>(s);
+      collectSpawnCallsExpr(*n.c, out);
+      collectSpawnCallsBlock(n.t, out);
+      collectSpawnCallsBlock(n.e, out);
+      break;
+    }
+    case SK::While: {
+      const auto &n = static_cast<const SWhile &>(s);
+      collectSpawnCallsExpr(*n.c, out);
+      collectSpawnCallsBlock(n.b, out);
+      break;
+    }
+    case SK::For: {
+      const auto &n = static_cast<const SFor &>(s);
+      collectSpawnCallsExpr(*n.start, out);
+      collectSpawnCallsExpr(*n.stop, out);
+      collectSpawnCallsExpr(*n.step, out);
+      collectSpawnCallsBlock(n.b, out);
+      break;
+    }
+    case SK::FormatBlock: {
+      const auto &n = static_cast<const SFormatBlock &>(s);
+      if (n.endArg) collectSpawnCallsExpr(*n.endArg, out);
+      collectSpawnCallsBlock(n.b, out);
+      break;
+    }
+    case SK::Break:
+    case SK::Continue:
+      break;
+    }
   }
-  return false;
 }
-static bool hasCallNamedProgram(const Program &p, const std::string &name) {
+static void collectSpawnCallsProgram(const Program &p, std::vector<const ECall *> &out) {
   for (const Fn &f : p.f) {
-    if (f.ex) continue;
-    if (hasCallNamedBlock(f.b, name)) return true;
+    if (!f.ex) collectSpawnCallsBlock(f.b, out);
   }
-  return false;
 }
 
+static bool isInlineCand(const Fn &f) {
+  if (f.ex || f.p.size() > 8 || f.b.size() != 1) return false;
+  auto *r = dynamic_cast<const SRet *>(f.b[0].get());
+  if (r == nullptr || !r->has || !r->v) return false;
+  return !hasCall(*r->v, f.n);
+}
 static std::unordered_map<std::string, const Fn *> inlineCands(const Program &p) {
   std::unordered_map<std::string, const Fn *> m;
   for (const Fn &f : p.f) {
-    if (f.ex || f.p.size() > 8 || f.b.size() != 1) continue;
-    auto *r = dynamic_cast<const SRet *>(f.b[0].get());
-    if (r == nullptr || !r->has || !r->v) continue;
-    if (hasCall(*r->v, f.n)) continue;
-    m[f.n] = &f;
+    if (isInlineCand(f)) m[f.n] = &f;
   }
   return m;
 }
@@ -4572,39 +5436,168 @@ static bool hasLoopControlStmt(const std::vector<SP> &b) {
   return false;
 }
 
-static bool exprHasVarName(const Expr &e, const std::string &name) {
-  switch (e.k) {
-  case EK::Var:
-    return static_cast<const EVar &>(e).n == name;
-  case EK::Unary:
-    return exprHasVarName(*static_cast<const EUnary &>(e).x, name);
-  case EK::Binary: {
-    const auto &n = static_cast<const EBinary &>(e);
-    return exprHasVarName(*n.l, name) || exprHasVarName(*n.r, name);
-  }
-  case EK::Call: {
-    const auto &n = static_cast<const ECall &>(e);
-    for (const auto &arg : n.a)
-      if (exprHasVarName(*arg, name)) return true;
-    return false;
-  }
-  default:
-    return false;
-  }
-}
-
 static std::optional<int64_t> checkedI128ToI64(__int128 v) {
   if (v < static_cast<__int128>(std::numeric_limits<int64_t>::min())) return std::nullopt;
   if (v > static_cast<__int128>(std::numeric_limits<int64_t>::max())) return std::nullopt;
   return static_cast<int64_t>(v);
 }
 
-static bool gOptHasUnaryNegOverride = false;
-
-static std::optional<int64_t> evalConstI64Expr(const Expr &expr) {
-  switch (expr.k) {
-  case EK::Int:
-    return static_cast<const EInt &>(expr).v;
+// Compile statistics for --time-passes: wall time and peak RSS per compile phase, time and rewrite count per
+// optimizer pass, how often each loop transform fired, and time spent in child processes. Transform counters
+// are always kept (one increment per rewrite); clock and RSS reads only happen when the report was requested.
+enum class OptTransform : std::size_t {
+  Inline,
+  ConstIf,
+  DeadWhile,
+  ZeroTripFor,
+  NestedSumFold,
+  CoupledSumFold,
+  AffineSumFold,
+  InductionSumFold,
+  Unroll,
+  DeadTail,
+  DeadStore,
+  ConstProp,
+  StrengthReduce,
+  ValueNumber,
+  Licm,
+  BoundsHoist,
+  Count
+};
+static const char *optTransformName(OptTransform t) {
+  switch (t) {
+  case OptTransform::Inline: return "inline-call";
+  case OptTransform::ConstIf: return "const-if";
+  case OptTransform::DeadWhile: return "dead-while";
+  case OptTransform::ZeroTripFor: return "zero-trip-for";
+  case OptTransform::NestedSumFold: return "nested-sum-fold";
+  case OptTransform::CoupledSumFold: return "coupled-sum-fold";
+  case OptTransform::AffineSumFold: return "affine-sum-fold";
+  case OptTransform::InductionSumFold: return "induction-sum-fold";
+  case OptTransform::Unroll: return "small-loop-unroll";
+  case OptTransform::DeadTail: return "dead-tail";
+  case OptTransform::DeadStore: return "dead-store";
+  case OptTransform::ConstProp: return "const-prop";
+  case OptTransform::StrengthReduce: return "strength-reduce";
+  case OptTransform::ValueNumber: return "gvn-cse";
+  case OptTransform::Licm: return "licm-hoist";
+  case OptTransform::BoundsHoist: return "bounds-check-hoist";
+  case OptTransform::Count: break;
+  }
+  return "?";
+}
+struct PhaseStat {
+  std::string name;
+  double ms = 0.0;
+  uint64_t calls = 0;
+  uint64_t peakRssKb = 0;
+  uint64_t rssGrowthKb = 0;
+};
+struct OptPassStat {
+  int pass = 0;
+  double ms = 0.0;
+  bool changed = false;
+  uint64_t rewrites = 0;
+  std::size_t functions = 0;
+};
+struct OptPipelineStat {
+  const char *name = "";
+  double ms = 0.0;
+  uint64_t runs = 0;
+  uint64_t changed = 0;
+};
+struct ChildProcessStat {
+  std::string kind;
+  double ms = 0.0;
+  int rc = 0;
+};
+struct CompileStats {
+  bool enabled = false;
+  std::chrono::steady_clock::time_point start;
+  std::vector<PhaseStat> phases;
+  std::vector<OptPassStat> optPasses;
+  std::vector<OptPipelineStat> optPipeline;
+  std::array<uint64_t, static_cast<std::size_t>(OptTransform::Count)> transforms{};
+  std::mutex childMu;
+  std::vector<ChildProcessStat> children;
+};
+static CompileStats gCompileStats;
+static void noteOptTransform(OptTransform t) { ++gCompileStats.transforms[static_cast<std::size_t>(t)]; }
+static uint64_t optTransformTotal() {
+  uint64_t n = 0;
+  for (uint64_t c : gCompileStats.transforms) n += c;
+  return n;
+}
+static double msSince(std::chrono::steady_clock::time_point t0) {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+// Peak resident set size of this process so far, in KiB (0 when the platform does not report it).
+static uint64_t processPeakRssKb() {
+#if defined(_WIN32)
+  PROCESS_MEMORY_COUNTERS pmc{};
+  if (!K32GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return 0;
+  return static_cast<uint64_t>(pmc.PeakWorkingSetSize / 1024);
+#else
+  struct rusage ru {};
+  if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+#if defined(__APPLE__)
+  return static_cast<uint64_t>(ru.ru_maxrss) / 1024;
+#else
+  return static_cast<uint64_t>(ru.ru_maxrss);
+#endif
+#endif
+}
+// Adds the scope's wall time to the named phase; repeated scopes (one per module) accumulate.
+class PhaseTimer {
+public:
+  explicit PhaseTimer(const char *name) : name_(name), active_(gCompileStats.enabled) {
+    if (!active_) return;
+    rssBefore_ = processPeakRssKb();
+    t0_ = std::chrono::steady_clock::now();
+  }
+  ~PhaseTimer() { stop(); }
+  PhaseTimer(const PhaseTimer &) = delete;
+  PhaseTimer &operator=(const PhaseTimer &) = delete;
+  void stop() {
+    if (!active_) return;
+    active_ = false;
+    const double ms = msSince(t0_);
+    const uint64_t rss = processPeakRssKb();
+    auto it = std::find_if(gCompileStats.phases.begin(), gCompileStats.phases.end(),
+                           [&](const PhaseStat &ph) { return ph.name == name_; });
+    if (it == gCompileStats.phases.end()) {
+      gCompileStats.phases.push_back(PhaseStat{name_, 0.0, 0, 0, 0});
+      it = gCompileStats.phases.end() - 1;
+    }
+    it->ms += ms;
+    ++it->calls;
+    it->peakRssKb = std::max(it->peakRssKb, rss);
+    it->rssGrowthKb += rss > rssBefore_ ? rss - rssBefore_ : 0;
+  }
+
+private:
+  const char *name_;
+  bool active_;
+  uint64_t rssBefore_ = 0;
+  std::chrono::steady_clock::time_point t0_;
+};
+// std::system with its wall time recorded under `kind`; safe to call from the concurrent toolchain probes.
+static int timedSystem(const std::string &cmd, const char *kind) {
+  if (!gCompileStats.enabled) return std::system(cmd.c_str());
+  const auto t0 = std::chrono::steady_clock::now();
+  const int rc = std::system(cmd.c_str());
+  const double ms = msSince(t0);
+  std::lock_guard<std::mutex> lock(gCompileStats.childMu);
+  gCompileStats.children.push_back(ChildProcessStat{kind, ms, rc});
+  return rc;
+}
+
+static bool gOptHasUnaryNegOverride = false;
+
+static std::optional<int64_t> evalConstI64Expr(const Expr &expr) {
+  switch (expr.k) {
+  case EK::Int:
+    return static_cast<const EInt &>(expr).v;
   case EK::Unary: {
     const auto &u = static_cast<const EUnary &>(expr);
     if (!u.overrideFn.empty()) return std::nullopt;
@@ -4969,6 +5962,135 @@ static std::optional<int64_t> modLinearSeriesSumI64(
   return checkedI128ToI64(static_cast<__int128>(full) * cycle + tail);
 }
 
+// Sums of i and i*i over the trip i = S, S + D, ..., S + (N - 1) * D.
+static std::optional<std::pair<int64_t, int64_t>> inductionPowerSumsI64(int64_t N, int64_t S, int64_t D) {
+  auto nMinus1 = checkedAddI64(N, -1);
+  auto twoN = nMinus1 ? checkedMulI64(2, N) : std::nullopt;
+  auto twoNMinus1 = twoN ? checkedAddI64(*twoN, -1) : std::nullopt;
+  auto sumK = nMinus1 ? mul2Div2ExactI64(N, *nMinus1) : std::nullopt;
+  auto sumK2 = (nMinus1 && twoNMinus1) ? mul3Div6ExactI64(N, *nMinus1, *twoNMinus1) : std::nullopt;
+  auto nMulS = checkedMulI64(N, S);
+  auto dMulSumK = sumK ? checkedMulI64(D, *sumK) : std::nullopt;
+  auto sumI = (nMulS && dMulSumK) ? checkedAddI64(*nMulS, *dMulSumK) : std::nullopt;
+  auto sSq = checkedMulI64(S, S);
+  auto dSq = checkedMulI64(D, D);
+  auto term1 = sSq ? checkedMulI64(N, *sSq) : std::nullopt;
+  auto sMulD = checkedMulI64(S, D);
+  auto twoSMulD = sMulD ? checkedMulI64(2, *sMulD) : std::nullopt;
+  auto term2 = (twoSMulD && sumK) ? checkedMulI64(*twoSMulD, *sumK) : std::nullopt;
+  auto term3 = (dSq && sumK2) ? checkedMulI64(*dSq, *sumK2) : std::nullopt;
+  auto sumI2a = (term1 && term2) ? checkedAddI64(*term1, *term2) : std::nullopt;
+  auto sumI2 = (sumI2a && term3) ? checkedAddI64(*sumI2a, *term3) : std::nullopt;
+  if (!sumI || !sumI2) return std::nullopt;
+  return std::make_pair(*sumI, *sumI2);
+}
+
+// Induction-variable view of a loop body for closed-form folding. Each value the body computes is
+// `entry(self) + P(i)`: what `self` held when the iteration began (no self for a pure induction
+// expression) plus a polynomial of degree <= 2 in the loop variable. Temporaries declared in the body
+// carry their value forward, so the shape of the source (one statement per update, temps, operand
+// order) does not matter.
+struct IndVarValue {
+  std::string self;
+  Poly2I64Const p;
+};
+static std::optional<IndVarValue> indVarValue(const Expr &e, const std::string &loopVar,
+                                              const std::unordered_map<std::string, IndVarValue> &env,
+                                              const std::unordered_set<std::string> &carried) {
+  if (e.typed && e.inf != Type::I64) return std::nullopt;
+  switch (e.k) {
+  case EK::Int:
+    return IndVarValue{{}, Poly2I64Const{0, 0, static_cast<const EInt &>(e).v}};
+  case EK::Var: {
+    const std::string &name = static_cast<const EVar &>(e).n;
+    if (name == loopVar) return IndVarValue{{}, Poly2I64Const{0, 1, 0}};
+    auto it = env.find(name);
+    if (it != env.end()) return it->second;
+    if (carried.count(name)) return IndVarValue{name, Poly2I64Const{}};
+    return std::nullopt;
+  }
+  case EK::Unary: {
+    const auto &u = static_cast<const EUnary &>(e);
+    if (!u.overrideFn.empty() || u.op != UK::Neg || gOptHasUnaryNegOverride) return std::nullopt;
+    auto x = indVarValue(*u.x, loopVar, env, carried);
+    if (!x || !x->self.empty()) return std::nullopt;
+    auto neg = poly2Add(Poly2I64Const{}, x->p, -1);
+    if (!neg) return std::nullopt;
+    return IndVarValue{{}, *neg};
+  }
+  case EK::Binary: {
+    const auto &b = static_cast<const EBinary &>(e);
+    if (!b.overrideFn.empty()) return std::nullopt;
+    if (b.op != BK::Add && b.op != BK::Sub && b.op != BK::Mul) return std::nullopt;
+    auto l = indVarValue(*b.l, loopVar, env, carried);
+    auto r = indVarValue(*b.r, loopVar, env, carried);
+    if (!l || !r) return std::nullopt;
+    if (b.op == BK::Mul) {
+      if (!l->self.empty() || !r->self.empty()) return std::nullopt;
+      if (poly2Degree(l->p) + poly2Degree(r->p) > 2) return std::nullopt;
+      auto p = poly2Mul(l->p, r->p);
+      if (!p) return std::nullopt;
+      return IndVarValue{{}, *p};
+    }
+    if (!r->self.empty() && (b.op == BK::Sub || !l->self.empty())) return std::nullopt;
+    auto p = poly2Add(l->p, r->p, b.op == BK::Add ? 1 : -1);
+    if (!p) return std::nullopt;
+    return IndVarValue{l->self.empty() ? r->self : l->self, *p};
+  }
+  default:
+    return std::nullopt;
+  }
+}
+
+// Replacement for a counted loop whose body only declares temporaries and advances variables by
+// polynomials of the loop variable: one `v = v + delta` per variable, in first-assignment order.
+static std::optional<std::vector<SP>> indVarSumFold(const SFor &n, int64_t N, int64_t S, int64_t D) {
+  if (n.b.empty()) return std::nullopt;
+  std::unordered_set<std::string> temps;
+  std::unordered_set<std::string> carried;
+  std::vector<const SAssign *> order;
+  for (const SP &stmt : n.b) {
+    if (stmt->k == SK::Let) {
+      const auto &let = static_cast<const SLet &>(*stmt);
+      if (let.n == n.n || carried.count(let.n) || !temps.insert(let.n).second) return std::nullopt;
+    } else if (stmt->k == SK::Assign) {
+      const auto &as = static_cast<const SAssign &>(*stmt);
+      if (as.n == n.n) return std::nullopt;
+      if (!temps.count(as.n) && carried.insert(as.n).second) order.push_back(&as);
+    } else {
+      return std::nullopt;
+    }
+  }
+  if (order.empty()) return std::nullopt;
+  std::unordered_map<std::string, IndVarValue> env;
+  for (const SP &stmt : n.b) {
+    const bool isLet = stmt->k == SK::Let;
+    const std::string &name = isLet ? static_cast<const SLet &>(*stmt).n : static_cast<const SAssign &>(*stmt).n;
+    const Expr &v = isLet ? *static_cast<const SLet &>(*stmt).v : *static_cast<const SAssign &>(*stmt).v;
+    auto val = indVarValue(v, n.n, env, carried);
+    if (!val) return std::nullopt;
+    env[name] = *val;
+  }
+  auto sums = inductionPowerSumsI64(N, S, D);
+  if (!sums) return std::nullopt;
+  std::vector<SP> rep;
+  rep.reserve(order.size());
+  for (const SAssign *as : order) {
+    const IndVarValue &val = env[as->n];
+    if (val.self != as->n) return std::nullopt;
+    const __int128 delta = static_cast<__int128>(val.p.c2) * static_cast<__int128>(sums->second) +
+                           static_cast<__int128>(val.p.c1) * static_cast<__int128>(sums->first) +
+                           static_cast<__int128>(val.p.c0) * static_cast<__int128>(N);
+    auto deltaI = checkedI128ToI64(delta);
+    if (!deltaI) return std::nullopt;
+    EP lhs = std::make_unique<EVar>(as->n, as->s);
+    EP rhs = std::make_unique<EInt>(*deltaI, as->s);
+    EP add = std::make_unique<EBinary>(BK::Add, std::move(lhs), std::move(rhs), as->s);
+    rep.push_back(std::make_unique<SAssign>(as->n, std::move(add), as->s));
+  }
+  return rep;
+}
+
 static EP substVarWithI64(const Expr &e, const std::string &name, int64_t value, const Span &s) {
   auto lit = std::make_unique<EInt>(value, s);
   std::unordered_map<std::string, const Expr *> subs;
@@ -5018,9 +6140,15 @@ static SP substStmtVar(const Stmt &s, const std::string &var, int64_t value) {
   }
   case SK::For: {
     const auto &n = static_cast<const SFor &>(s);
-    return std::make_unique<SFor>(n.n, substVarWithI64(*n.start, var, value, s.s),
+    SP out = std::make_unique<SFor>(n.n, substVarWithI64(*n.start, var, value, s.s),
                                   substVarWithI64(*n.stop, var, value, s.s), substVarWithI64(*n.step, var, value, s.s),
                                   n.parallel, substBlockVar(n.b, var, value), s.s);
+    auto &f = static_cast<SFor &>(*out);
+    f.reductions = n.reductions;
+    f.schedule = n.schedule;
+    f.grain = n.grain;
+    f.minIters = n.minIters;
+    return out;
   }
   case SK::FormatBlock: {
     const auto &n = static_cast<const SFormatBlock &>(s);
@@ -5165,7 +6293,16 @@ static bool stmtReadsNamed(const Stmt &s, const std::string &name) {
   return false;
 }
 
-static bool pruneDeadLocalStores(std::vector<SP> &b) {
+static bool blockDeclaresNamed(const std::vector<SP> &b, std::size_t upto, const std::string &name) {
+  for (std::size_t i = 0; i < upto; ++i) {
+    if (b[i]->k == SK::Let && static_cast<const SLet &>(*b[i]).n == name) return true;
+  }
+  return false;
+}
+
+// Inside an if branch only variables declared in that branch are known dead: an outer variable may still
+// be read after the if.
+static bool pruneDeadLocalStores(std::vector<SP> &b, bool branch = false) {
   bool changed = false;
   for (std::size_t i = 0; i < b.size();) {
     Stmt &s = *b[i];
@@ -5182,7 +6319,7 @@ static bool pruneDeadLocalStores(std::vector<SP> &b) {
     }
     case SK::Assign: {
       auto &n = static_cast<SAssign &>(s);
-      if (exprTrivialNoSideEffects(*n.v) && !blockReadsNamed(b, i + 1, n.n)) {
+      if (exprTrivialNoSideEffects(*n.v) && !blockReadsNamed(b, i + 1, n.n) && (!branch || blockDeclaresNamed(b, i, n.n))) {
         b.erase(b.begin() + static_cast<std::ptrdiff_t>(i));
         changed = true;
         erased = true;
@@ -5200,8 +6337,8 @@ static bool pruneDeadLocalStores(std::vector<SP> &b) {
     }
     case SK::If: {
       auto &n = static_cast<SIf &>(s);
-      changed |= pruneDeadLocalStores(n.t);
-      changed |= pruneDeadLocalStores(n.e);
+      changed |= pruneDeadLocalStores(n.t, true);
+      changed |= pruneDeadLocalStores(n.e, true);
       break;
     }
     case SK::While:
@@ -5453,15 +6590,21 @@ static bool optE(EP &e, const std::unordered_map<std::string, const Fn *> &cand)
   }
   case EK::Call: {
     auto &n = static_cast<ECall &>(*e);
+    if (n.f == "spawn" && !n.a.empty() && n.a[0]->k == EK::Call) {
+      // The task target must stay a call; only its captured arguments are optimized.
+      for (EP &a : static_cast<ECall &>(*n.a[0]).a) ch |= optE(a, cand);
+      return ch;
+    }
     for (EP &a : n.a) ch |= optE(a, cand);
     auto it = cand.find(n.f);
-    if (it == cand.end()) return ch;
+    if (it == cand.end() || !isInlineCand(*it->second)) return ch;
     const Fn &f = *it->second;
     auto *r = dynamic_cast<const SRet *>(f.b[0].get());
     std::unordered_map<std::string, const Expr *> m;
     for (std::size_t i = 0; i < f.p.size(); ++i) m[f.p[i].n] = n.a[i].get();
     e = substE(*r->v, m);
     ch = true;
+    noteOptTransform(OptTransform::Inline);
     ch |= optE(e, cand);
     return ch;
   }
@@ -5492,6 +6635,7 @@ static bool optBlock(std::vector<SP> &b, const std::unordered_map<std::string, c
         b.erase(b.begin() + static_cast<std::ptrdiff_t>(i));
         b.insert(b.begin() + static_cast<std::ptrdiff_t>(i), std::make_move_iterator(rep.begin()), std::make_move_iterator(rep.end()));
         ch = true;
+        noteOptTransform(OptTransform::ConstIf);
         if (i > 0) --i;
       }
       break;
@@ -5503,6 +6647,7 @@ static bool optBlock(std::vector<SP> &b, const std::unordered_map<std::string, c
       if (auto bv = litB(*n.c); bv && !*bv) {
         b.erase(b.begin() + static_cast<std::ptrdiff_t>(i));
         ch = true;
+        noteOptTransform(OptTransform::DeadWhile);
         if (i > 0) --i;
       }
       break;
@@ -5546,6 +6691,7 @@ static bool optBlock(std::vector<SP> &b, const std::unordered_map<std::string, c
         if (tc && *tc == 0) {
           b.erase(b.begin() + static_cast<std::ptrdiff_t>(i));
           ch = true;
+          noteOptTransform(OptTransform::ZeroTripFor);
           if (i > 0) --i;
           break;
         }
@@ -5609,6 +6755,7 @@ static bool optBlock(std::vector<SP> &b, const std::unordered_map<std::string, c
                   auto replacement = std::make_unique<SAssign>(asPtr->n, std::move(add), n.s);
                   b[i] = std::move(replacement);
                   ch = true;
+                  noteOptTransform(OptTransform::NestedSumFold);
                   if (i > 0) --i;
                   break;
                 }
@@ -5684,6 +6831,7 @@ static bool optBlock(std::vector<SP> &b, const std::unordered_map<std::string, c
             b.insert(b.begin() + static_cast<std::ptrdiff_t>(i),
                      std::make_move_iterator(rep.begin()), std::make_move_iterator(rep.end()));
             ch = true;
+            noteOptTransform(OptTransform::CoupledSumFold);
             if (i > 0) --i;
             return true;
           };
@@ -5754,217 +6902,28 @@ static bool optBlock(std::vector<SP> &b, const std::unordered_map<std::string, c
               auto replacement = std::make_unique<SAssign>(asPtr->n, std::move(add), n.s);
               b[i] = std::move(replacement);
               ch = true;
+              noteOptTransform(OptTransform::AffineSumFold);
               if (i > 0) --i;
               break;
             }
           }
         }
-        if (tc && *tc > 0 && !n.parallel && n.b.size() >= 1 && n.b.size() <= 4) {
-          bool ok = true;
-          std::vector<const SAssign *> assigns;
-          assigns.reserve(n.b.size());
-          std::unordered_set<std::string> assignedVars;
-          for (const auto &stmt : n.b) {
-            if (stmt->k != SK::Assign) {
-              ok = false;
-              break;
-            }
-            const auto &as = static_cast<const SAssign &>(*stmt);
-            assigns.push_back(&as);
-            if (!assignedVars.insert(as.n).second) {
-              ok = false;
-              break;
-            }
-          }
-          if (ok) {
-            struct PolyTerm {
-              std::string var;
-              Poly2I64Const poly;
-              Span s;
-            };
-            std::vector<PolyTerm> terms;
-            terms.reserve(assigns.size());
-            for (const SAssign *asPtr : assigns) {
-              const auto &as = *asPtr;
-              if (as.v->k != EK::Binary) {
-                ok = false;
-                break;
-              }
-              const auto &bin = static_cast<const EBinary &>(*as.v);
-              if (bin.op != BK::Add) {
-                ok = false;
-                break;
-              }
-              const bool leftSelf = (bin.l->k == EK::Var && static_cast<const EVar &>(*bin.l).n == as.n);
-              const bool rightSelf = (bin.r->k == EK::Var && static_cast<const EVar &>(*bin.r).n == as.n);
-              if (!leftSelf && !rightSelf) {
-                ok = false;
-                break;
-              }
-              const Expr &other = leftSelf ? *bin.r : *bin.l;
-              if (exprHasVarName(other, as.n)) {
-                ok = false;
-                break;
-              }
-              for (const std::string &v : assignedVars) {
-                if (v != as.n && exprHasVarName(other, v)) {
-                  ok = false;
-                  break;
-                }
-              }
-              if (!ok) break;
-              auto poly = poly2ConstI64Expr(other, n.n);
-              if (!poly) {
-                ok = false;
-                break;
-              }
-              terms.push_back(PolyTerm{as.n, *poly, as.s});
-            }
-            if (ok) {
-              const int64_t N = *tc;
-              const int64_t S = *st;
-              const int64_t D = *sp;
-              auto nMinus1 = checkedAddI64(N, -1);
-              if (!nMinus1) ok = false;
-              auto twoN = nMinus1 ? checkedMulI64(2, N) : std::nullopt;
-              auto twoNMinus1 = twoN ? checkedAddI64(*twoN, -1) : std::nullopt;
-              auto sumK = nMinus1 ? mul2Div2ExactI64(N, *nMinus1) : std::nullopt;
-              auto sumK2 = (nMinus1 && twoNMinus1) ? mul3Div6ExactI64(N, *nMinus1, *twoNMinus1) : std::nullopt;
-              auto nMulS = checkedMulI64(N, S);
-              auto dMulSumK = sumK ? checkedMulI64(D, *sumK) : std::nullopt;
-              auto sumI = (nMulS && dMulSumK) ? checkedAddI64(*nMulS, *dMulSumK) : std::nullopt;
-              auto sSq = checkedMulI64(S, S);
-              auto dSq = checkedMulI64(D, D);
-              auto term1 = (sSq ? checkedMulI64(N, *sSq) : std::nullopt);
-              auto sMulD = checkedMulI64(S, D);
-              auto twoSMulD = (sMulD ? checkedMulI64(2, *sMulD) : std::nullopt);
-              auto term2 = (twoSMulD && sumK) ? checkedMulI64(*twoSMulD, *sumK) : std::nullopt;
-              auto term3 = (dSq && sumK2) ? checkedMulI64(*dSq, *sumK2) : std::nullopt;
-              auto sumI2a = (term1 && term2) ? checkedAddI64(*term1, *term2) : std::nullopt;
-              auto sumI2 = (sumI2a && term3) ? checkedAddI64(*sumI2a, *term3) : std::nullopt;
-              if (!nMinus1 || !twoNMinus1 || !sumK || !sumK2 || !sumI || !sumI2) ok = false;
-              std::vector<SP> rep;
-              rep.reserve(terms.size());
-              if (ok) {
-                for (const auto &t : terms) {
-                  const __int128 delta = static_cast<__int128>(t.poly.c2) * static_cast<__int128>(*sumI2) +
-                                         static_cast<__int128>(t.poly.c1) * static_cast<__int128>(*sumI) +
-                                         static_cast<__int128>(t.poly.c0) * static_cast<__int128>(N);
-                  auto deltaI = checkedI128ToI64(delta);
-                  if (!deltaI) {
-                    ok = false;
-                    break;
-                  }
-                  EP lhs = std::make_unique<EVar>(t.var, t.s);
-                  EP rhs = std::make_unique<EInt>(*deltaI, t.s);
-                  EP add = std::make_unique<EBinary>(BK::Add, std::move(lhs), std::move(rhs), t.s);
-                  rep.push_back(std::make_unique<SAssign>(t.var, std::move(add), t.s));
-                }
-              }
-              if (ok) {
-                b.erase(b.begin() + static_cast<std::ptrdiff_t>(i));
-                b.insert(b.begin() + static_cast<std::ptrdiff_t>(i), std::make_move_iterator(rep.begin()),
-                         std::make_move_iterator(rep.end()));
-                ch = true;
-                if (i > 0) --i;
-                break;
-              }
-            }
-          }
-        }
-        if (tc && *tc > 0 && !n.parallel && n.b.size() >= 2 && n.b.size() <= 4) {
-          bool ok = true;
-          std::vector<const SAssign *> assigns;
-          assigns.reserve(n.b.size());
-          std::unordered_set<std::string> assignedVars;
-          for (const auto &stmt : n.b) {
-            if (stmt->k != SK::Assign) {
-              ok = false;
-              break;
-            }
-            const auto &as = static_cast<const SAssign &>(*stmt);
-            assigns.push_back(&as);
-            if (!assignedVars.insert(as.n).second) {
-              ok = false;
-              break;
-            }
-          }
-          if (ok) {
-            struct RedTerm {
-              std::string var;
-              AffineI64Const aff;
-              Span s;
-            };
-            std::vector<RedTerm> terms;
-            terms.reserve(assigns.size());
-            for (const SAssign *asPtr : assigns) {
-              const auto &as = *asPtr;
-              if (as.v->k != EK::Binary) {
-                ok = false;
-                break;
-              }
-              const auto &bin = static_cast<const EBinary &>(*as.v);
-              if (bin.op != BK::Add) {
-                ok = false;
-                break;
-              }
-              const bool leftSelf = (bin.l->k == EK::Var && static_cast<const EVar &>(*bin.l).n == as.n);
-              const bool rightSelf = (bin.r->k == EK::Var && static_cast<const EVar &>(*bin.r).n == as.n);
-              if (!leftSelf && !rightSelf) {
-                ok = false;
-                break;
-              }
-              const Expr &other = leftSelf ? *bin.r : *bin.l;
-              if (exprHasVarName(other, as.n)) {
-                ok = false;
-                break;
-              }
-              for (const std::string &v : assignedVars) {
-                if (v != as.n && exprHasVarName(other, v)) {
-                  ok = false;
-                  break;
-                }
-              }
-              if (!ok) break;
-              auto aff = affineI64ConstExpr(other, n.n);
-              if (!aff) {
-                ok = false;
-                break;
-              }
-              terms.push_back(RedTerm{as.n, *aff, as.s});
-            }
-            if (ok) {
-              const __int128 iters = static_cast<__int128>(*tc);
-              const __int128 start128 = static_cast<__int128>(*st);
-              const __int128 step128 = static_cast<__int128>(*sp);
-              const __int128 sumIdx = (iters * ((2 * start128) + ((iters - 1) * step128))) / 2;
-              std::vector<SP> rep;
-              rep.reserve(terms.size());
-              for (const auto &t : terms) {
-                const __int128 delta =
-                    static_cast<__int128>(t.aff.a) * sumIdx + static_cast<__int128>(t.aff.b) * iters;
-                auto deltaI = checkedI128ToI64(delta);
-                if (!deltaI) {
-                  ok = false;
-                  break;
-                }
-                EP lhs = std::make_unique<EVar>(t.var, t.s);
-                EP rhs = std::make_unique<EInt>(*deltaI, t.s);
-                EP add = std::make_unique<EBinary>(BK::Add, std::move(lhs), std::move(rhs), t.s);
-                rep.push_back(std::make_unique<SAssign>(t.var, std::move(add), t.s));
-              }
-              if (ok) {
-                b.erase(b.begin() + static_cast<std::ptrdiff_t>(i));
-                b.insert(b.begin() + static_cast<std::ptrdiff_t>(i), std::make_move_iterator(rep.begin()),
-                         std::make_move_iterator(rep.end()));
-                ch = true;
-                if (i > 0) --i;
-                break;
-              }
-            }
+        if (tc && *tc > 0 && !n.parallel) {
+          if (auto rep = indVarSumFold(n, *tc, *st, *sp)) {
+            b.erase(b.begin() + static_cast<std::ptrdiff_t>(i));
+            b.insert(b.begin() + static_cast<std::ptrdiff_t>(i), std::make_move_iterator(rep->begin()),
+                     std::make_move_iterator(rep->end()));
+            ch = true;
+            noteOptTransform(OptTransform::InductionSumFold);
+            if (i > 0) --i;
+            break;
           }
         }
-        if (tc && *tc > 0 && *tc <= 8 && !n.parallel && !hasLoopControlStmt(n.b) && !hasDeclNamed(n.b, n.n)) {
+        // Copies of a body that declares locals at its top level would redeclare them in one scope.
+        const bool bodyDeclares =
+            std::any_of(n.b.begin(), n.b.end(), [](const SP &stmt) { return stmt->k == SK::Let; });
+        if (tc && *tc > 0 && *tc <= 8 && !n.parallel && !bodyDeclares && !hasLoopControlStmt(n.b) &&
+            !hasDeclNamed(n.b, n.n)) {
           std::vector<SP> rep;
           rep.reserve(static_cast<std::size_t>(*tc) * n.b.size());
           int64_t cur = *st;
@@ -5977,6 +6936,7 @@ static bool optBlock(std::vector<SP> &b, const std::unordered_map<std::string, c
           b.insert(b.begin() + static_cast<std::ptrdiff_t>(i), std::make_move_iterator(rep.begin()),
                    std::make_move_iterator(rep.end()));
           ch = true;
+          noteOptTransform(OptTransform::Unroll);
           if (i > 0) --i;
         }
       }
@@ -5999,129 +6959,1470 @@ static bool optBlock(std::vector<SP> &b, const std::unordered_map<std::string, c
         if (i + 1 < b.size()) {
           b.erase(b.begin() + static_cast<std::ptrdiff_t>(i + 1), b.end());
           ch = true;
+          noteOptTransform(OptTransform::DeadTail);
         }
         break;
       }
     }
   }
-  if (!inLoopBody) ch |= pruneDeadLocalStores(b);
-  ch |= propagateLocalI64Consts(b);
+  if (propagateLocalI64Consts(b)) {
+    ch = true;
+    noteOptTransform(OptTransform::ConstProp);
+  }
   return ch;
 }
 
-static void optimize(Program &p, int passes) {
-#if LS_HOST_NO_INT128
-  (void)p;
-  (void)passes;
-  return;
-#else
-  gOptHasUnaryNegOverride = false;
-  for (const Fn &f : p.f) {
-    if (f.n == unaryOperatorOverrideSymbol(UK::Neg)) {
-      gOptHasUnaryNegOverride = true;
+// Mid-level passes over the typed AST. optimize() drives kOptPipeline one function at a time from a
+// worklist. Values are numbered SSA-style: each declaration or assignment gives its target a new version,
+// so two pure expressions with the same key (operator tree plus operand versions) hold the same value
+// wherever they appear in a block.
+struct OptContext {
+  const std::unordered_map<std::string, const Fn *> &cand;
+  const std::unordered_set<std::string> &userFns;
+  int tempSerial = 0;
+};
+static constexpr const char *kOptTempPrefix = "__ls_opt_";
+static void maxOptTempSerial(const std::vector<SP> &b, int &serial) {
+  const std::size_t prefixLen = std::strlen(kOptTempPrefix);
+  for (const SP &stmt : b) {
+    switch (stmt->k) {
+    case SK::Let: {
+      const std::string &name = static_cast<const SLet &>(*stmt).n;
+      if (name.compare(0, prefixLen, kOptTempPrefix) == 0) {
+        serial = std::max(serial, std::atoi(name.c_str() + prefixLen) + 1);
+      }
       break;
     }
+    case SK::If:
+      maxOptTempSerial(static_cast<const SIf &>(*stmt).t, serial);
+      maxOptTempSerial(static_cast<const SIf &>(*stmt).e, serial);
+      break;
+    case SK::While: maxOptTempSerial(static_cast<const SWhile &>(*stmt).b, serial); break;
+    case SK::For: maxOptTempSerial(static_cast<const SFor &>(*stmt).b, serial); break;
+    case SK::FormatBlock: maxOptTempSerial(static_cast<const SFormatBlock &>(*stmt).b, serial); break;
+    default: break;
+    }
+  }
+}
+
+// Builtins that read nothing but their arguments and cannot fault, so a pass may evaluate them once for
+// several uses, or ahead of a loop that might not run.
+static bool isPureBuiltinCall(const std::string &name, const OptContext &ctx) {
+  static const std::unordered_set<std::string> kPure = {
+      "pi",      "tau",     "deg_to_rad", "rad_to_deg", "sqrt",    "sin",     "cos",     "tan",
+      "asin",    "acos",    "atan",       "atan2",      "exp",     "log",     "log10",   "floor",
+      "ceil",    "round",   "pow",        "max_i64",    "min_i64", "abs_i64", "clamp_i64", "max_f64",
+      "min_f64", "abs_f64", "clamp_f64",  "max",        "min",     "abs",     "clamp",   "len",
+  };
+  return kPure.count(name) != 0 && ctx.userFns.count(name) == 0;
+}
+
+// Expressions a statement evaluates itself (nested blocks excluded). `onceOnly` leaves out the ones that
+// run again on every iteration or after the body: a while condition and a format block's end argument.
+static void stmtExprSlots(Stmt &s, std::vector<EP *> &out, bool onceOnly) {
+  switch (s.k) {
+  case SK::Let: out.push_back(&static_cast<SLet &>(s).v); break;
+  case SK::Assign: out.push_back(&static_cast<SAssign &>(s).v); break;
+  case SK::Expr: out.push_back(&static_cast<SExpr &>(s).e); break;
+  case SK::Ret: {
+    auto &n = static_cast<SRet &>(s);
+    if (n.has && n.v) out.push_back(&n.v);
+    break;
+  }
+  case SK::If: out.push_back(&static_cast<SIf &>(s).c); break;
+  case SK::While:
+    if (!onceOnly) out.push_back(&static_cast<SWhile &>(s).c);
+    break;
+  case SK::For: {
+    auto &n = static_cast<SFor &>(s);
+    out.push_back(&n.start);
+    out.push_back(&n.stop);
+    out.push_back(&n.step);
+    break;
   }
-  for (int k = 0; k < passes; ++k) {
-    auto c = inlineCands(p);
-    bool ch = false;
-    for (Fn &f : p.f)
-      if (!f.ex) ch |= optBlock(f.b, c, false);
-    if (!ch) break;
+  case SK::FormatBlock: {
+    auto &n = static_cast<SFormatBlock &>(s);
+    if (!onceOnly && n.endArg) out.push_back(&n.endArg);
+    break;
   }
-  gOptHasUnaryNegOverride = false;
-#endif
+  case SK::Break:
+  case SK::Continue:
+    break;
+  }
+}
+static void stmtNestedBlocks(Stmt &s, std::vector<std::vector<SP> *> &out) {
+  switch (s.k) {
+  case SK::If:
+    out.push_back(&static_cast<SIf &>(s).t);
+    out.push_back(&static_cast<SIf &>(s).e);
+    break;
+  case SK::While: out.push_back(&static_cast<SWhile &>(s).b); break;
+  case SK::For: out.push_back(&static_cast<SFor &>(s).b); break;
+  case SK::FormatBlock: out.push_back(&static_cast<SFormatBlock &>(s).b); break;
+  default: break;
+  }
+}
+// Names a statement declares or assigns, at any depth, including loop variables.
+static void collectWrittenNames(const Stmt &s, std::unordered_set<std::string> &out) {
+  switch (s.k) {
+  case SK::Let: out.insert(static_cast<const SLet &>(s).n); break;
+  case SK::Assign: out.insert(static_cast<const SAssign &>(s).n); break;
+  case SK::If:
+    for (const SP &x : static_cast<const SIf &>(s).t) collectWrittenNames(*x, out);
+    for (const SP &x : static_cast<const SIf &>(s).e) collectWrittenNames(*x, out);
+    break;
+  case SK::While:
+    for (const SP &x : static_cast<const SWhile &>(s).b) collectWrittenNames(*x, out);
+    break;
+  case SK::For:
+    out.insert(static_cast<const SFor &>(s).n);
+    for (const SP &x : static_cast<const SFor &>(s).b) collectWrittenNames(*x, out);
+    break;
+  case SK::FormatBlock:
+    for (const SP &x : static_cast<const SFormatBlock &>(s).b) collectWrittenNames(*x, out);
+    break;
+  default:
+    break;
+  }
+}
+static bool rewriteBlockExprs(std::vector<SP> &b, bool (*fn)(EP &)) {
+  bool ch = false;
+  for (SP &stmt : b) {
+    std::vector<EP *> slots;
+    stmtExprSlots(*stmt, slots, false);
+    for (EP *slot : slots) ch |= fn(*slot);
+    std::vector<std::vector<SP> *> inner;
+    stmtNestedBlocks(*stmt, inner);
+    for (std::vector<SP> *blk : inner) ch |= rewriteBlockExprs(*blk, fn);
+  }
+  return ch;
 }
 
-class EmitC {
-public:
-  EmitC(const Program &p, std::unordered_set<std::string> inl, bool superuserMode = false,
-        bool superuserStartEnabled = false,
-        std::vector<std::string> activeCliFlags = {},
-        std::vector<std::string> cliCustomTokens = {})
-      : p_(p), inl_(std::move(inl)), superuserMode_(superuserMode), superuserStartEnabled_(superuserStartEnabled),
-        cliCustomTokens_(std::move(cliCustomTokens)) {
-    std::unordered_map<std::string, std::string> flagSymbols;
-    for (const Fn &f : p_.f) {
-      if (!f.isCliFlag) continue;
-      flagSymbols[f.cliFlagName] = f.n;
-    }
-    std::unordered_set<std::string> seenFlags;
-    for (const std::string &flagName : activeCliFlags) {
-      auto it = flagSymbols.find(flagName);
-      if (it == flagSymbols.end()) continue;
-      if (!seenFlags.insert(flagName).second) continue;
-      activeCliFlagCalls_.push_back(it->second);
-    }
-    minimalRuntime_ = hasOnlyMinimalRuntimeCallsProgram(p_) && !usesStringRuntimeProgram(p_);
-    ultraMinimalRuntime_ =
-#if defined(_WIN32)
-        minimalRuntime_ && hasOnlyUltraMinimalRuntimeCallsProgram(p_) && !usesStringRuntimeProgram(p_) &&
-        !usesF64Program(p_) && !hasCallNamedProgram(p_, "stateSpeed") && !hasCallNamedProgram(p_, ".stateSpeed");
-#else
-        false;
-#endif
-    needsForRuntime_ = hasForProgram(p_);
-    needsPowRuntime_ = hasPowProgram(p_);
-    needsStateSpeedRuntime_ = hasCallNamedProgram(p_, "stateSpeed") || hasCallNamedProgram(p_, ".stateSpeed");
-    needsFormatOutputRuntime_ = hasCallNamedProgram(p_, "formatOutput") || hasCallNamedProgram(p_, "FormatOutput");
-    needsHttpRuntime_ = hasCallNamedProgram(p_, "http_server_listen") || hasCallNamedProgram(p_, "http_server_accept") ||
-                        hasCallNamedProgram(p_, "http_server_read") ||
-                        hasCallNamedProgram(p_, "http_server_respond_text") ||
-                        hasCallNamedProgram(p_, "http_server_close") ||
-                        hasCallNamedProgram(p_, "http_client_connect") ||
-                        hasCallNamedProgram(p_, "http_client_send") ||
-                        hasCallNamedProgram(p_, "http_client_read") ||
-                        hasCallNamedProgram(p_, "http_client_close");
-    superuserDebugToStderr_ = superuserMode_ && hasFormatMarkerProgram(p_);
-    superuserIrDumpRequested_ = superuserMode_ && hasCallNamedProgram(p_, "su.ir.dump");
-    const Fn *mainEntry = nullptr;
-    const Fn *scriptEntry = nullptr;
-    const Fn *singleZeroArg = nullptr;
-    int zeroArgCount = 0;
-    for (const Fn &f : p_.f) {
-      if (f.ex || f.isCliFlag) continue;
-      if (f.n == "main") mainEntry = &f;
-      if (f.n == kScriptEntryName) scriptEntry = &f;
-      if (f.p.empty()) {
-        ++zeroArgCount;
-        if (!singleZeroArg) singleZeroArg = &f;
+// Pure builtin calls and `**` are the only nodes the value passes move into temporaries; most blocks have
+// too few for keying them to pay off.
+static std::size_t costlyNodeCount(const Expr &e, const OptContext &ctx) {
+  switch (e.k) {
+  case EK::Unary: return costlyNodeCount(*static_cast<const EUnary &>(e).x, ctx);
+  case EK::Binary: {
+    const auto &n = static_cast<const EBinary &>(e);
+    return (n.op == BK::Pow ? 1u : 0u) + costlyNodeCount(*n.l, ctx) + costlyNodeCount(*n.r, ctx);
+  }
+  case EK::Call: {
+    const auto &n = static_cast<const ECall &>(e);
+    std::size_t out = isPureBuiltinCall(n.f, ctx) ? 1 : 0;
+    for (const EP &a : n.a) out += costlyNodeCount(*a, ctx);
+    return out;
+  }
+  default:
+    return 0;
+  }
+}
+static std::size_t costlyNodeCountBlock(std::vector<SP> &b, const OptContext &ctx, bool onceOnly, bool nested) {
+  std::size_t out = 0;
+  for (SP &stmt : b) {
+    std::vector<EP *> slots;
+    stmtExprSlots(*stmt, slots, onceOnly);
+    for (EP *slot : slots) out += costlyNodeCount(**slot, ctx);
+    if (!nested) continue;
+    std::vector<std::vector<SP> *> inner;
+    stmtNestedBlocks(*stmt, inner);
+    for (std::vector<SP> *blk : inner) out += costlyNodeCountBlock(*blk, ctx, onceOnly, true);
+  }
+  return out;
+}
+
+struct OptValueInfo {
+  bool pure = true;       // no side effects, cannot fault, allocates nothing
+  bool costly = false;    // contains a call or `**`, so worth a temporary
+  bool invariant = true;  // reads nothing in OptValueScope::written
+  std::optional<Type> type;
+  std::string key;
+};
+struct OptValueScope {
+  const OptContext &ctx;
+  const std::unordered_map<std::string, unsigned> *versions = nullptr;
+  const std::unordered_map<std::string, std::string> *temps = nullptr; // temporary -> key of its value
+  const std::unordered_set<std::string> *written = nullptr;
+};
+static OptValueInfo optValueNode(const Expr &e, const std::vector<OptValueInfo> &kids, const OptValueScope &sc) {
+  OptValueInfo out;
+  for (const OptValueInfo &k : kids) {
+    out.pure = out.pure && k.pure;
+    out.costly = out.costly || k.costly;
+    out.invariant = out.invariant && k.invariant;
+  }
+  switch (e.k) {
+  case EK::Int:
+    out.type = Type::I64;
+    out.key = "i" + std::to_string(static_cast<const EInt &>(e).v);
+    break;
+  case EK::Float: {
+    const double v = static_cast<const EFloat &>(e).v;
+    uint64_t bits = 0;
+    std::memcpy(&bits, &v, sizeof bits);
+    out.type = Type::F64;
+    out.key = "f" + std::to_string(bits);
+    break;
+  }
+  case EK::Bool:
+    out.type = Type::Bool;
+    out.key = static_cast<const EBool &>(e).v ? "b1" : "b0";
+    break;
+  case EK::Str: {
+    const std::string &v = static_cast<const EString &>(e).v;
+    out.type = Type::Str;
+    out.key = "s" + std::to_string(v.size()) + ":" + v;
+    break;
+  }
+  case EK::Var: {
+    const std::string &name = static_cast<const EVar &>(e).n;
+    if (e.typed) out.type = e.inf;
+    if (sc.written && sc.written->count(name)) out.invariant = false;
+    if (sc.temps) {
+      auto it = sc.temps->find(name);
+      if (it != sc.temps->end()) {
+        out.key = it->second;
+        break;
       }
     }
-    if (scriptEntry) {
-      entry_ = scriptEntry;
-    } else if (mainEntry) {
-      entry_ = mainEntry;
-    } else if (zeroArgCount == 1) {
-      entry_ = singleZeroArg;
-    } else if (zeroArgCount == 0) {
-      entryError_ = "no runnable entry point found; add top-level statements, define main(), or define one zero-argument function";
-    } else {
-      entryError_ =
-          "ambiguous entry point: multiple zero-argument functions found; define main(), add top-level statements, or keep only one zero-argument function";
+    unsigned version = 0;
+    if (sc.versions) {
+      auto it = sc.versions->find(name);
+      if (it != sc.versions->end()) version = it->second;
     }
+    out.key = "v" + name + "@" + std::to_string(version);
+    break;
   }
-  bool ultraMinimalRuntime() const { return ultraMinimalRuntime_; }
-  bool hasEntry() const { return entry_ != nullptr; }
-  const std::string &entryError() const { return entryError_; }
-  bool superuserMode() const { return superuserMode_; }
-  bool superuserDebugToStderr() const { return superuserDebugToStderr_; }
-  bool superuserIrDumpRequested() const { return superuserIrDumpRequested_; }
-  std::string run() {
-    o_ << "#include <stdint.h>\n";
-    o_ << "#include <stddef.h>\n\n";
-    o_ << "#include <stdio.h>\n";
-    o_ << "#include <stdlib.h>\n";
-    o_ << "#include <time.h>\n\n";
-    o_ << "#include <math.h>\n\n";
-    o_ << "#include <string.h>\n\n";
-    o_ << "#include <ctype.h>\n\n";
-#if defined(_WIN32)
-    if (needsHttpRuntime_) {
+  case EK::Unary: {
+    const auto &u = static_cast<const EUnary &>(e);
+    if (!u.overrideFn.empty() || (u.op == UK::Neg && gOptHasUnaryNegOverride)) out.pure = false;
+    out.type = u.op == UK::Not ? std::optional<Type>(Type::Bool) : kids[0].type;
+    out.key = std::string(u.op == UK::Neg ? "-(" : "!(") + kids[0].key + ")";
+    break;
+  }
+  case EK::Binary: {
+    const auto &b = static_cast<const EBinary &>(e);
+    const OptValueInfo &l = kids[0];
+    const OptValueInfo &r = kids[1];
+    if (e.typed) {
+      out.type = e.inf;
+    } else if (b.op == BK::Eq || b.op == BK::Neq || b.op == BK::Lt || b.op == BK::Lte || b.op == BK::Gt ||
+               b.op == BK::Gte || b.op == BK::And || b.op == BK::Or) {
+      out.type = Type::Bool;
+    } else if (l.type && r.type && isNum(*l.type) && isNum(*r.type)) {
+      out.type = (isFloat(*l.type) || isFloat(*r.type)) ? Type::F64 : Type::I64;
+    }
+    // String concatenation allocates, and an operand type that is not known could be a string.
+    if (!b.overrideFn.empty() || !out.type || *out.type == Type::Str) out.pure = false;
+    if ((b.op == BK::Div || b.op == BK::Mod) && !(out.type && isFloat(*out.type))) {
+      auto d = litI(*b.r);
+      if (!d || *d == 0 || *d == -1) out.pure = false;
+    }
+    if (b.op == BK::Pow) out.costly = true;
+    out.key = "(" + l.key + " " + std::to_string(static_cast<int>(b.op)) + " " + r.key + ")";
+    break;
+  }
+  case EK::Call: {
+    const auto &c = static_cast<const ECall &>(e);
+    if (e.typed) out.type = e.inf;
+    if (!isPureBuiltinCall(c.f, sc.ctx)) out.pure = false;
+    out.costly = true;
+    out.key = "c" + c.f + "(";
+    for (std::size_t i = 0; i < kids.size(); ++i) out.key += (i ? "," : "") + kids[i].key;
+    out.key += ")";
+    break;
+  }
+  }
+  return out;
+}
+static OptValueInfo optValueInfo(const Expr &e, const OptValueScope &sc) {
+  std::vector<OptValueInfo> kids;
+  switch (e.k) {
+  case EK::Unary: kids.push_back(optValueInfo(*static_cast<const EUnary &>(e).x, sc)); break;
+  case EK::Binary:
+    kids.push_back(optValueInfo(*static_cast<const EBinary &>(e).l, sc));
+    kids.push_back(optValueInfo(*static_cast<const EBinary &>(e).r, sc));
+    break;
+  case EK::Call:
+    for (const EP &a : static_cast<const ECall &>(e).a) kids.push_back(optValueInfo(*a, sc));
+    break;
+  default:
+    break;
+  }
+  return optValueNode(e, kids, sc);
+}
+static bool optTemporaryCandidate(const OptValueInfo &info) {
+  return info.pure && info.costly && !(info.type && *info.type == Type::Str);
+}
+// `const name = value`, typed like the value when its type is already known.
+static SP makeOptTemp(OptContext &ctx, EP value, const std::optional<Type> &type, std::string &name) {
+  name = kOptTempPrefix + std::to_string(ctx.tempSerial++);
+  const Span s = value->s;
+  auto let = std::make_unique<SLet>(name, std::nullopt, true, false, std::move(value), s);
+  if (type) {
+    let->inf = *type;
+    let->typed = true;
+  }
+  return let;
+}
+static EP makeOptTempRef(const std::string &name, const std::optional<Type> &type, Span s) {
+  auto v = std::make_unique<EVar>(name, s);
+  if (type) {
+    v->inf = *type;
+    v->typed = true;
+  }
+  return v;
+}
+
+// Redundancy elimination within a block: a pure expression that is computed more than once with the same
+// operand versions is computed once into a temporary declared just before its first use.
+struct GvnState {
+  OptContext &ctx;
+  std::unordered_map<std::string, unsigned> versions;
+  std::unordered_map<std::string, std::string> temps;
+  std::unordered_map<std::string, int> uses;
+  std::unordered_map<std::string, std::string> avail;
+  std::vector<SP> *lets = nullptr;
+  bool rewriting = false;
+  bool changed = false;
+};
+static OptValueInfo gvnExpr(EP &e, GvnState &st) {
+  std::vector<OptValueInfo> kids;
+  switch (e->k) {
+  case EK::Unary: kids.push_back(gvnExpr(static_cast<EUnary &>(*e).x, st)); break;
+  case EK::Binary: {
+    auto &n = static_cast<EBinary &>(*e);
+    kids.push_back(gvnExpr(n.l, st));
+    kids.push_back(gvnExpr(n.r, st));
+    break;
+  }
+  case EK::Call:
+    for (EP &a : static_cast<ECall &>(*e).a) kids.push_back(gvnExpr(a, st));
+    break;
+  default:
+    break;
+  }
+  const OptValueScope sc{st.ctx, &st.versions, &st.temps, nullptr};
+  OptValueInfo info = optValueNode(*e, kids, sc);
+  if (!optTemporaryCandidate(info)) return info;
+  if (!st.rewriting) {
+    ++st.uses[info.key];
+    return info;
+  }
+  if (st.uses[info.key] < 2) return info;
+  const Span s = e->s;
+  auto it = st.avail.find(info.key);
+  if (it == st.avail.end()) {
+    std::string name;
+    st.lets->push_back(makeOptTemp(st.ctx, std::move(e), info.type, name));
+    st.temps[name] = info.key;
+    it = st.avail.emplace(info.key, name).first;
+  } else {
+    noteOptTransform(OptTransform::ValueNumber);
+    st.changed = true;
+  }
+  e = makeOptTempRef(it->second, info.type, s);
+  return info;
+}
+static void bumpWrittenVersions(const Stmt &s, std::unordered_map<std::string, unsigned> &versions) {
+  std::unordered_set<std::string> written;
+  collectWrittenNames(s, written);
+  for (const std::string &name : written) ++versions[name];
+}
+static bool gvnBlock(std::vector<SP> &b, OptContext &ctx) {
+  bool ch = false;
+  for (SP &stmt : b) {
+    std::vector<std::vector<SP> *> inner;
+    stmtNestedBlocks(*stmt, inner);
+    for (std::vector<SP> *blk : inner) ch |= gvnBlock(*blk, ctx);
+  }
+  if (costlyNodeCountBlock(b, ctx, true, false) < 2) return ch;
+  GvnState st{ctx, {}, {}, {}, {}, nullptr, false, false};
+  for (int round = 0; round < 2; ++round) {
+    st.rewriting = round == 1;
+    st.versions.clear();
+    for (std::size_t i = 0; i < b.size(); ++i) {
+      std::vector<SP> lets;
+      st.lets = &lets;
+      std::vector<EP *> slots;
+      stmtExprSlots(*b[i], slots, true);
+      for (EP *slot : slots) gvnExpr(*slot, st);
+      bumpWrittenVersions(*b[i], st.versions);
+      if (!lets.empty()) {
+        b.insert(b.begin() + static_cast<std::ptrdiff_t>(i), std::make_move_iterator(lets.begin()),
+                 std::make_move_iterator(lets.end()));
+        i += lets.size();
+      }
+    }
+    if (!st.rewriting) {
+      bool repeated = false;
+      for (const auto &entry : st.uses) repeated = repeated || entry.second >= 2;
+      if (!repeated) break;
+    }
+  }
+  return ch || st.changed;
+}
+
+// Loop-invariant code motion: pure expressions inside a loop that read nothing the loop writes are
+// computed once into a temporary before it. Pure builtins cannot fault, so evaluating them ahead of a
+// loop that never runs is safe.
+static bool licmExpr(EP &e, const OptValueScope &sc, std::unordered_map<std::string, std::string> &hoisted,
+                     std::vector<SP> &lets, OptContext &ctx) {
+  const OptValueInfo info = optValueInfo(*e, sc);
+  if (optTemporaryCandidate(info) && info.invariant) {
+    const Span s = e->s;
+    auto it = hoisted.find(info.key);
+    if (it == hoisted.end()) {
+      std::string name;
+      lets.push_back(makeOptTemp(ctx, std::move(e), info.type, name));
+      it = hoisted.emplace(info.key, name).first;
+    }
+    e = makeOptTempRef(it->second, info.type, s);
+    noteOptTransform(OptTransform::Licm);
+    return true;
+  }
+  bool ch = false;
+  switch (e->k) {
+  case EK::Unary: ch |= licmExpr(static_cast<EUnary &>(*e).x, sc, hoisted, lets, ctx); break;
+  case EK::Binary: {
+    auto &n = static_cast<EBinary &>(*e);
+    ch |= licmExpr(n.l, sc, hoisted, lets, ctx);
+    ch |= licmExpr(n.r, sc, hoisted, lets, ctx);
+    break;
+  }
+  case EK::Call:
+    for (EP &a : static_cast<ECall &>(*e).a) ch |= licmExpr(a, sc, hoisted, lets, ctx);
+    break;
+  default:
+    break;
+  }
+  return ch;
+}
+static bool licmLoopBody(std::vector<SP> &b, const OptValueScope &sc,
+                         std::unordered_map<std::string, std::string> &hoisted, std::vector<SP> &lets,
+                         OptContext &ctx) {
+  bool ch = false;
+  for (SP &stmt : b) {
+    std::vector<EP *> slots;
+    stmtExprSlots(*stmt, slots, false);
+    for (EP *slot : slots) ch |= licmExpr(*slot, sc, hoisted, lets, ctx);
+    std::vector<std::vector<SP> *> inner;
+    stmtNestedBlocks(*stmt, inner);
+    for (std::vector<SP> *blk : inner) ch |= licmLoopBody(*blk, sc, hoisted, lets, ctx);
+  }
+  return ch;
+}
+static bool licmBlock(std::vector<SP> &b, OptContext &ctx) {
+  bool ch = false;
+  for (std::size_t i = 0; i < b.size(); ++i) {
+    Stmt &s = *b[i];
+    std::vector<std::vector<SP> *> inner;
+    stmtNestedBlocks(s, inner);
+    for (std::vector<SP> *blk : inner) ch |= licmBlock(*blk, ctx);
+    const bool isLoop = s.k == SK::While || (s.k == SK::For && !static_cast<SFor &>(s).parallel);
+    if (!isLoop) continue;
+    std::vector<SP> &body = s.k == SK::While ? static_cast<SWhile &>(s).b : static_cast<SFor &>(s).b;
+    if (costlyNodeCountBlock(body, ctx, false, true) == 0 &&
+        (s.k != SK::While || costlyNodeCount(*static_cast<SWhile &>(s).c, ctx) == 0)) {
+      continue;
+    }
+    std::unordered_set<std::string> written;
+    collectWrittenNames(s, written);
+    const OptValueScope sc{ctx, nullptr, nullptr, &written};
+    std::unordered_map<std::string, std::string> hoisted;
+    std::vector<SP> lets;
+    if (s.k == SK::While) licmExpr(static_cast<SWhile &>(s).c, sc, hoisted, lets, ctx);
+    licmLoopBody(body, sc, hoisted, lets, ctx);
+    if (lets.empty()) continue;
+    b.insert(b.begin() + static_cast<std::ptrdiff_t>(i), std::make_move_iterator(lets.begin()),
+             std::make_move_iterator(lets.end()));
+    i += lets.size();
+    ch = true;
+  }
+  return ch;
+}
+
+// x ** 2..4 on an i64 variable becomes multiplications, as does x ** 2 on an f64; dividing an f64 by a
+// power of two becomes multiplying by its exact reciprocal.
+static bool strengthReduceExpr(EP &e) {
+  bool ch = false;
+  switch (e->k) {
+  case EK::Unary: ch |= strengthReduceExpr(static_cast<EUnary &>(*e).x); break;
+  case EK::Binary: {
+    auto &n = static_cast<EBinary &>(*e);
+    ch |= strengthReduceExpr(n.l);
+    ch |= strengthReduceExpr(n.r);
+    break;
+  }
+  case EK::Call:
+    for (EP &a : static_cast<ECall &>(*e).a) ch |= strengthReduceExpr(a);
+    return ch;
+  default:
+    return ch;
+  }
+  if (e->k != EK::Binary) return ch;
+  auto &n = static_cast<EBinary &>(*e);
+  if (!n.overrideFn.empty()) return ch;
+  if (n.op == BK::Pow && n.l->k == EK::Var && n.l->typed && (n.l->inf == Type::I64 || n.l->inf == Type::F64)) {
+    const Type t = n.l->inf;
+    const auto ki = litI(*n.r);
+    const auto kf = litF(*n.r);
+    const int64_t k = ki ? *ki : (kf && *kf == 2.0 ? 2 : 0);
+    if ((t == Type::I64 && ki && k >= 2 && k <= 4) || (t == Type::F64 && k == 2)) {
+      const std::string &name = static_cast<const EVar &>(*n.l).n;
+      const Span s = n.s;
+      auto var = [&]() -> EP {
+        auto v = std::make_unique<EVar>(name, s);
+        v->inf = t;
+        v->typed = true;
+        return v;
+      };
+      auto mul = [&](EP l, EP r) -> EP {
+        auto m = std::make_unique<EBinary>(BK::Mul, std::move(l), std::move(r), s);
+        m->inf = t;
+        m->typed = true;
+        return m;
+      };
+      EP out = mul(var(), var());
+      if (k == 3) out = mul(std::move(out), var());
+      if (k == 4) out = mul(std::move(out), mul(var(), var()));
+      e = std::move(out);
+      noteOptTransform(OptTransform::StrengthReduce);
+      return true;
+    }
+  }
+  if (n.op == BK::Div && e->typed && e->inf == Type::F64) {
+    const auto di = litI(*n.r);
+    const auto df = litF(*n.r);
+    const double d = df ? *df : (di ? static_cast<double>(*di) : 0.0);
+    int exp = 0;
+    if (d != 0.0 && std::isfinite(d) && std::fabs(std::frexp(d, &exp)) == 0.5) {
+      const double recip = 1.0 / d;
+      if (std::isnormal(recip) && recip * d == 1.0) {
+        const Span s = n.s;
+        auto r = std::make_unique<EFloat>(recip, s);
+        r->inf = Type::F64;
+        r->typed = true;
+        auto m = std::make_unique<EBinary>(BK::Mul, std::move(n.l), std::move(r), s);
+        m->inf = Type::F64;
+        m->typed = true;
+        e = std::move(m);
+        noteOptTransform(OptTransform::StrengthReduce);
+        return true;
+      }
+    }
+  }
+  return ch;
+}
+
+// Loop versioning for element reads. An innermost counted loop whose np_get/array_get_i64/array_get_f64
+// indices are `i + c` is duplicated behind one range check per container, and the copy that runs when
+// every such index is in range reads elements without per-access checks. The loop may only call builtins
+// that cannot free or shrink a container, so the check made on entry holds for the whole loop.
+static bool isBoundsSafeCall(const std::string &name, const OptContext &ctx) {
+  static const std::unordered_set<std::string> kSafe = {
+      "np_get",      "np_set",      "np_len",       "np_rows",     "np_cols",     "array_get_i64",
+      "array_get_f64", "array_set_i64", "array_set_f64", "array_len", "print",       "println",
+      "print_i64",   "print_f64",   "print_bool",   "print_str",   "println_i64", "println_f64",
+      "println_bool", "println_str",
+  };
+  if (isPureBuiltinCall(name, ctx)) return true;
+  return kSafe.count(name) != 0 && ctx.userFns.count(name) == 0;
+}
+static bool boundsSafeExpr(const Expr &e, const OptContext &ctx) {
+  switch (e.k) {
+  case EK::Unary: {
+    const auto &n = static_cast<const EUnary &>(e);
+    return n.overrideFn.empty() && boundsSafeExpr(*n.x, ctx);
+  }
+  case EK::Binary: {
+    const auto &n = static_cast<const EBinary &>(e);
+    return n.overrideFn.empty() && boundsSafeExpr(*n.l, ctx) && boundsSafeExpr(*n.r, ctx);
+  }
+  case EK::Call: {
+    const auto &n = static_cast<const ECall &>(e);
+    if (!isBoundsSafeCall(n.f, ctx)) return false;
+    for (const EP &a : n.a)
+      if (!boundsSafeExpr(*a, ctx)) return false;
+    return true;
+  }
+  default:
+    return true;
+  }
+}
+static bool boundsSafeBody(std::vector<SP> &b, const OptContext &ctx) {
+  for (SP &stmt : b) {
+    switch (stmt->k) {
+    case SK::Let:
+    case SK::Assign:
+    case SK::Expr:
+    case SK::Ret:
+    case SK::If:
+    case SK::Break:
+    case SK::Continue:
+      break;
+    default:
+      return false;
+    }
+    std::vector<EP *> slots;
+    stmtExprSlots(*stmt, slots, false);
+    for (EP *slot : slots)
+      if (!boundsSafeExpr(**slot, ctx)) return false;
+    std::vector<std::vector<SP> *> inner;
+    stmtNestedBlocks(*stmt, inner);
+    for (std::vector<SP> *blk : inner)
+      if (!boundsSafeBody(*blk, ctx)) return false;
+  }
+  return true;
+}
+static std::optional<int64_t> loopIndexOffset(const Expr &e, const std::string &iv) {
+  if (e.k == EK::Var) return static_cast<const EVar &>(e).n == iv ? std::optional<int64_t>(0) : std::nullopt;
+  if (e.k != EK::Binary) return std::nullopt;
+  const auto &b = static_cast<const EBinary &>(e);
+  if (!b.overrideFn.empty() || (b.op != BK::Add && b.op != BK::Sub)) return std::nullopt;
+  const bool lIv = b.l->k == EK::Var && static_cast<const EVar &>(*b.l).n == iv;
+  const bool rIv = b.r->k == EK::Var && static_cast<const EVar &>(*b.r).n == iv;
+  std::optional<int64_t> c;
+  if (lIv) c = litI(*b.r);
+  else if (rIv && b.op == BK::Add) c = litI(*b.l);
+  if (!c || *c < -(int64_t{1} << 30) || *c > (int64_t{1} << 30)) return std::nullopt;
+  return b.op == BK::Sub ? -*c : *c;
+}
+struct BoundsRange {
+  const char *checked;
+  const char *unchecked;
+  const char *length;
+  std::string handle;
+  int64_t lo = 0;
+  int64_t hi = 0;
+};
+static const char *const kBoundsAccessors[][3] = {
+    {"np_get", "__ls_np_get_unchecked", "np_len"},
+    {"array_get_i64", "__ls_array_get_i64_unchecked", "__ls_array_len_i64"},
+    {"array_get_f64", "__ls_array_get_f64_unchecked", "__ls_array_len_f64"},
+};
+// Finds (collect) or rewrites to unchecked form (rename) the element reads of `iv`-relative indices
+// into containers in `ranges`.
+static void boundsAccesses(Expr &e, const std::string &iv, const std::unordered_set<std::string> &written,
+                           std::vector<BoundsRange> &ranges, bool rename) {
+  switch (e.k) {
+  case EK::Unary: boundsAccesses(*static_cast<EUnary &>(e).x, iv, written, ranges, rename); return;
+  case EK::Binary:
+    boundsAccesses(*static_cast<EBinary &>(e).l, iv, written, ranges, rename);
+    boundsAccesses(*static_cast<EBinary &>(e).r, iv, written, ranges, rename);
+    return;
+  case EK::Call: break;
+  default: return;
+  }
+  auto &c = static_cast<ECall &>(e);
+  for (EP &a : c.a) boundsAccesses(*a, iv, written, ranges, rename);
+  if (c.a.size() != 2 || c.a[0]->k != EK::Var) return;
+  const std::string &handle = static_cast<const EVar &>(*c.a[0]).n;
+  if (written.count(handle)) return;
+  const auto off = loopIndexOffset(*c.a[1], iv);
+  if (!off) return;
+  for (const auto &acc : kBoundsAccessors) {
+    if (c.f != acc[0]) continue;
+    auto it = std::find_if(ranges.begin(), ranges.end(), [&](const BoundsRange &r) {
+      return r.checked == acc[0] && r.handle == handle;
+    });
+    if (rename) {
+      if (it != ranges.end()) c.f = acc[1];
+    } else if (it == ranges.end()) {
+      ranges.push_back(BoundsRange{acc[0], acc[1], acc[2], handle, *off, *off});
+    } else {
+      it->lo = std::min(it->lo, *off);
+      it->hi = std::max(it->hi, *off);
+    }
+    return;
+  }
+}
+static void boundsAccessesBlock(std::vector<SP> &b, const std::string &iv,
+                                const std::unordered_set<std::string> &written, std::vector<BoundsRange> &ranges,
+                                bool rename) {
+  for (SP &stmt : b) {
+    std::vector<EP *> slots;
+    stmtExprSlots(*stmt, slots, false);
+    for (EP *slot : slots) boundsAccesses(**slot, iv, written, ranges, rename);
+    std::vector<std::vector<SP> *> inner;
+    stmtNestedBlocks(*stmt, inner);
+    for (std::vector<SP> *blk : inner) boundsAccessesBlock(*blk, iv, written, ranges, rename);
+  }
+}
+static bool blockHasCallPrefix(const std::vector<SP> &b, const std::string &prefix);
+static SP cloneS(const Stmt &s);
+static std::vector<SP> cloneBlock(const std::vector<SP> &b) {
+  std::vector<SP> out;
+  out.reserve(b.size());
+  for (const SP &stmt : b) out.push_back(cloneS(*stmt));
+  return out;
+}
+static SP cloneS(const Stmt &s) {
+  switch (s.k) {
+  case SK::Let: {
+    const auto &n = static_cast<const SLet &>(s);
+    auto out = std::make_unique<SLet>(n.n, n.decl, n.isConst, n.isOwned, cloneE(*n.v), s.s);
+    out->ownedFreeFn = n.ownedFreeFn;
+    out->inf = n.inf;
+    out->typed = n.typed;
+    return out;
+  }
+  case SK::Assign: {
+    const auto &n = static_cast<const SAssign &>(s);
+    return std::make_unique<SAssign>(n.n, cloneE(*n.v), s.s);
+  }
+  case SK::Expr: return std::make_unique<SExpr>(cloneE(*static_cast<const SExpr &>(s).e), s.s);
+  case SK::Ret: {
+    const auto &n = static_cast<const SRet &>(s);
+    if (!n.has || !n.v) return std::make_unique<SRet>(false, nullptr, s.s);
+    return std::make_unique<SRet>(true, cloneE(*n.v), s.s);
+  }
+  case SK::If: {
+    const auto &n = static_cast<const SIf &>(s);
+    return std::make_unique<SIf>(cloneE(*n.c), cloneBlock(n.t), cloneBlock(n.e), s.s);
+  }
+  case SK::While: {
+    const auto &n = static_cast<const SWhile &>(s);
+    return std::make_unique<SWhile>(cloneE(*n.c), cloneBlock(n.b), s.s);
+  }
+  case SK::For: {
+    const auto &n = static_cast<const SFor &>(s);
+    auto out = std::make_unique<SFor>(n.n, cloneE(*n.start), cloneE(*n.stop), cloneE(*n.step), n.parallel,
+                                      cloneBlock(n.b), s.s);
+    out->reductions = n.reductions;
+    out->schedule = n.schedule;
+    out->grain = n.grain;
+    out->minIters = n.minIters;
+    return out;
+  }
+  case SK::FormatBlock: {
+    const auto &n = static_cast<const SFormatBlock &>(s);
+    return std::make_unique<SFormatBlock>(n.endArg ? cloneE(*n.endArg) : nullptr, cloneBlock(n.b), s.s);
+  }
+  case SK::Break: return std::make_unique<SBreak>(s.s);
+  case SK::Continue: return std::make_unique<SContinue>(s.s);
+  }
+  throw CompileError(s.s, "internal statement clone error");
+}
+static bool blockHasCallPrefix(const std::vector<SP> &b, const std::string &prefix) {
+  for (const SP &stmt : b) {
+    std::vector<EP *> slots;
+    stmtExprSlots(*stmt, slots, false);
+    for (EP *slot : slots)
+      if (hasCallPrefix(**slot, prefix)) return true;
+    std::vector<std::vector<SP> *> inner;
+    stmtNestedBlocks(*stmt, inner);
+    for (std::vector<SP> *blk : inner)
+      if (blockHasCallPrefix(*blk, prefix)) return true;
+  }
+  return false;
+}
+static EP boundsGuard(const SFor &n, const std::vector<BoundsRange> &ranges) {
+  const Span s = n.s;
+  auto offset = [&](const Expr &base, int64_t c) -> EP {
+    if (c == 0) return cloneE(base);
+    if (auto v = litI(base)) return std::make_unique<EInt>(*v + c, s);
+    return std::make_unique<EBinary>(BK::Add, cloneE(base), std::make_unique<EInt>(c, s), s);
+  };
+  auto both = [&](EP l, EP r) -> EP {
+    if (!l) return r;
+    return std::make_unique<EBinary>(BK::And, std::move(l), std::move(r), s);
+  };
+  EP guard;
+  const auto startLit = litI(*n.start);
+  for (const BoundsRange &r : ranges) {
+    if (!startLit || *startLit + r.lo < 0) {
+      guard = both(std::move(guard),
+                   std::make_unique<EBinary>(BK::Gte, offset(*n.start, r.lo), std::make_unique<EInt>(0, s), s));
+    }
+    std::vector<EP> lenArgs;
+    lenArgs.push_back(std::make_unique<EVar>(r.handle, s));
+    guard = both(std::move(guard), std::make_unique<EBinary>(BK::Lte, offset(*n.stop, r.hi),
+                                                             std::make_unique<ECall>(r.length, std::move(lenArgs), s),
+                                                             s));
+  }
+  return guard;
+}
+static bool boundsHoistBlock(std::vector<SP> &b, OptContext &ctx) {
+  bool ch = false;
+  for (std::size_t i = 0; i < b.size(); ++i) {
+    Stmt &s = *b[i];
+    if (s.k == SK::If) {
+      // Skip loops this pass already versioned: `if <guard> do <unchecked loop> else <loop> end`.
+      const auto &n = static_cast<const SIf &>(s);
+      if (n.t.size() == 1 && n.e.size() == 1 && n.t[0]->k == SK::For && n.e[0]->k == SK::For &&
+          blockHasCallPrefix(n.t, "__ls_")) {
+        continue;
+      }
+    }
+    if (s.k != SK::For) {
+      std::vector<std::vector<SP> *> inner;
+      stmtNestedBlocks(s, inner);
+      for (std::vector<SP> *blk : inner) ch |= boundsHoistBlock(*blk, ctx);
+      continue;
+    }
+    auto &n = static_cast<SFor &>(s);
+    const auto step = litI(*n.step);
+    if (n.parallel || !step || *step <= 0) {
+      ch |= boundsHoistBlock(n.b, ctx);
+      continue;
+    }
+    if (!boundsSafeBody(n.b, ctx) || !boundsSafeExpr(*n.start, ctx) || !boundsSafeExpr(*n.stop, ctx)) continue;
+    std::unordered_set<std::string> written;
+    collectWrittenNames(n, written);
+    std::vector<BoundsRange> ranges;
+    boundsAccessesBlock(n.b, n.n, written, ranges, false);
+    // A read before index 0 on the first iteration is known out of range; leave that container checked.
+    const auto startLit = litI(*n.start);
+    ranges.erase(std::remove_if(ranges.begin(), ranges.end(),
+                                [&](const BoundsRange &r) { return startLit && *startLit + r.lo < 0; }),
+                 ranges.end());
+    if (ranges.empty()) continue;
+    EP guard = boundsGuard(n, ranges);
+    SP fast = cloneS(n);
+    boundsAccessesBlock(static_cast<SFor &>(*fast).b, n.n, written, ranges, true);
+    std::vector<SP> thenBlock;
+    thenBlock.push_back(std::move(fast));
+    std::vector<SP> elseBlock;
+    elseBlock.push_back(std::move(b[i]));
+    const Span span = elseBlock.front()->s;
+    b[i] = std::make_unique<SIf>(std::move(guard), std::move(thenBlock), std::move(elseBlock), span);
+    noteOptTransform(OptTransform::BoundsHoist);
+    ch = true;
+  }
+  return ch;
+}
+
+static bool runSimplifyPass(Fn &f, OptContext &ctx) { return optBlock(f.b, ctx.cand, false); }
+static bool runStrengthReducePass(Fn &f, OptContext &) { return rewriteBlockExprs(f.b, strengthReduceExpr); }
+// A single-return body stays as it is so callers can still inline it.
+static bool runValueNumberPass(Fn &f, OptContext &ctx) { return !isInlineCand(f) && gvnBlock(f.b, ctx); }
+static bool runLicmPass(Fn &f, OptContext &ctx) { return licmBlock(f.b, ctx); }
+static bool runBoundsHoistPass(Fn &f, OptContext &ctx) { return boundsHoistBlock(f.b, ctx); }
+static bool runDeadStorePass(Fn &f, OptContext &) {
+  if (!pruneDeadLocalStores(f.b)) return false;
+  noteOptTransform(OptTransform::DeadStore);
+  return true;
+}
+// Hot and cold functions from a `--profile` run (`--profile-use`): hot ones take most of the samples, cold
+// ones were never entered.
+struct ProfileHints {
+  std::unordered_set<std::string> hot;
+  std::unordered_set<std::string> cold;
+};
+
+struct OptPassDef {
+  const char *name;
+  bool (*run)(Fn &, OptContext &);
+  bool growsCode;
+};
+static const OptPassDef kOptPipeline[] = {
+    {"simplify", runSimplifyPass, false}, {"strength-reduce", runStrengthReducePass, false},
+    {"gvn", runValueNumberPass, false},   {"licm", runLicmPass, false},
+    {"bounds-hoist", runBoundsHoistPass, true}, {"dead-store", runDeadStorePass, false},
+};
+static constexpr std::size_t kOptPipelineSize = sizeof(kOptPipeline) / sizeof(kOptPipeline[0]);
+
+static bool runOptPipeline(Fn &f, const std::unordered_map<std::string, const Fn *> &cand,
+                           const std::unordered_set<std::string> &userFns, bool cold) {
+  OptContext ctx{cand, userFns, 0};
+  maxOptTempSerial(f.b, ctx.tempSerial);
+  bool ch = false;
+  for (std::size_t i = 0; i < kOptPipelineSize; ++i) {
+    if (cold && kOptPipeline[i].growsCode) continue;
+    if (!gCompileStats.enabled) {
+      ch |= kOptPipeline[i].run(f, ctx);
+      continue;
+    }
+    const auto t0 = std::chrono::steady_clock::now();
+    const bool passChanged = kOptPipeline[i].run(f, ctx);
+    OptPipelineStat &st = gCompileStats.optPipeline[i];
+    st.ms += msSince(t0);
+    ++st.runs;
+    if (passChanged) ++st.changed;
+    ch |= passChanged;
+  }
+  return ch;
+}
+
+// Worklist pass manager. Every function runs the pipeline in the first round; afterwards only functions
+// that changed run again, plus the callers of a changed function that is (or was) inlinable, since they
+// inline its body. `passes` bounds the number of rounds. With profile hints, functions that never ran get
+// one round and no code-duplicating passes.
+static void optimize(Program &p, int passes, const ProfileHints *profile = nullptr) {
+#if LS_HOST_NO_INT128
+  (void)p;
+  (void)passes;
+  (void)profile;
+  return;
+#else
+  gOptHasUnaryNegOverride = false;
+  for (const Fn &f : p.f) {
+    if (f.n == unaryOperatorOverrideSymbol(UK::Neg)) {
+      gOptHasUnaryNegOverride = true;
+      break;
+    }
+  }
+  std::unordered_set<std::string> userFns;
+  for (const Fn &f : p.f) userFns.insert(f.n);
+  std::vector<std::unordered_set<std::string>> callees(p.f.size());
+  std::unordered_map<std::string, std::unordered_set<std::size_t>> callers;
+  auto refreshCallees = [&](std::size_t idx) {
+    for (const std::string &g : callees[idx]) callers[g].erase(idx);
+    ProgramUsage u;
+    collectUsageBlock(p.f[idx].b, u);
+    callees[idx] = std::move(u.calls);
+    for (const std::string &g : callees[idx]) callers[g].insert(idx);
+  };
+  std::vector<std::size_t> work;
+  for (std::size_t idx = 0; idx < p.f.size(); ++idx) {
+    if (p.f[idx].ex) continue;
+    refreshCallees(idx);
+    work.push_back(idx);
+  }
+  if (gCompileStats.enabled && gCompileStats.optPipeline.empty()) {
+    for (const OptPassDef &def : kOptPipeline) gCompileStats.optPipeline.push_back(OptPipelineStat{def.name});
+  }
+  for (int k = 0; k < passes && !work.empty(); ++k) {
+    const auto t0 = std::chrono::steady_clock::now();
+    const uint64_t rewritesBefore = optTransformTotal();
+    const auto cand = inlineCands(p);
+    std::vector<char> queued(p.f.size(), 0);
+    std::vector<std::size_t> next;
+    auto requeue = [&](std::size_t idx) {
+      if (queued[idx]) return;
+      queued[idx] = 1;
+      next.push_back(idx);
+    };
+    for (std::size_t idx : work) {
+      Fn &f = p.f[idx];
+      const bool wasCand = cand.count(f.n) != 0;
+      const bool cold = profile != nullptr && profile->cold.count(f.n) != 0;
+      if (!runOptPipeline(f, cand, userFns, cold)) continue;
+      if (!cold) requeue(idx);
+      refreshCallees(idx);
+      if (wasCand || isInlineCand(f)) {
+        for (std::size_t caller : callers[f.n]) requeue(caller);
+      }
+    }
+    std::sort(next.begin(), next.end());
+    if (gCompileStats.enabled) {
+      gCompileStats.optPasses.push_back(
+          OptPassStat{k + 1, msSince(t0), !next.empty(), optTransformTotal() - rewritesBefore, work.size()});
+    }
+    work = std::move(next);
+  }
+  gOptHasUnaryNegOverride = false;
+#endif
+}
+
+// Dead-runtime elimination over the emitted C runtime. The runtime is split into top-level chunks (function
+// definitions, prototypes, static data, typedefs, preprocessor lines); every `static` function or variable
+// chunk names what it defines and which identifiers it references, which gives the helper-to-helper edges.
+// Everything else is pinned. Chunks reachable from the pinned text and the program's own C are kept; the
+// rest are dropped. Input the splitter does not understand (unbalanced braces) is returned unchanged.
+static bool isCIdentStart(char c) { return std::isalpha(static_cast<unsigned char>(c)) || c == '_'; }
+static bool isCIdentChar(char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; }
+// Appends the identifiers of C text to `out`, skipping comments and string/char literals.
+static void collectCIdentifiers(const std::string &src, std::size_t b, std::size_t e, std::vector<std::string> &out) {
+  std::size_t i = b;
+  while (i < e) {
+    const char c = src[i];
+    if (c == '/' && i + 1 < e && src[i + 1] == '/') {
+      while (i < e && src[i] != '\n') ++i;
+    } else if (c == '/' && i + 1 < e && src[i + 1] == '*') {
+      i += 2;
+      while (i + 1 < e && !(src[i] == '*' && src[i + 1] == '/')) ++i;
+      i += 2;
+    } else if (c == '"' || c == '\'') {
+      ++i;
+      while (i < e && src[i] != c) i += (src[i] == '\\') ? 2 : 1;
+      ++i;
+    } else if (isCIdentStart(c)) {
+      const std::size_t s = i;
+      while (i < e && isCIdentChar(src[i])) ++i;
+      out.emplace_back(src, s, i - s);
+    } else if (std::isdigit(static_cast<unsigned char>(c))) {
+      while (i < e && (isCIdentChar(src[i]) || src[i] == '.')) ++i;
+    } else {
+      ++i;
+    }
+  }
+}
+static std::string pruneUnusedRuntime(const std::string &rt, const std::string &rootText, std::size_t *keptOut = nullptr,
+                                      std::size_t *totalOut = nullptr) {
+  struct Chunk {
+    std::size_t b = 0;
+    std::size_t e = 0;
+    bool pinned = true;
+    std::vector<std::string> defs;
+  };
+  std::vector<Chunk> chunks;
+  const std::size_t n = rt.size();
+  std::size_t i = 0;
+  auto atLineStart = [&](std::size_t at) {
+    while (at > 0 && (rt[at - 1] == ' ' || rt[at - 1] == '\t')) --at;
+    return at == 0 || rt[at - 1] == '\n';
+  };
+  auto skipDirective = [&](std::size_t at) {
+    while (at < n && rt[at] != '\n') {
+      if (rt[at] == '\\' && at + 1 < n && rt[at + 1] == '\n') ++at;
+      ++at;
+    }
+    return at < n ? at + 1 : n;
+  };
+  while (i < n) {
+    while (i < n && std::isspace(static_cast<unsigned char>(rt[i]))) ++i;
+    if (i >= n) break;
+    Chunk ch;
+    ch.b = i;
+    // Leading comments belong to the definition they describe.
+    std::size_t body = i;
+    while (body + 1 < n && rt[body] == '/' && (rt[body + 1] == '*' || rt[body + 1] == '/')) {
+      if (rt[body + 1] == '/') {
+        while (body < n && rt[body] != '\n') ++body;
+      } else {
+        const std::size_t close = rt.find("*/", body + 2);
+        body = close == std::string::npos ? n : close + 2;
+      }
+      while (body < n && std::isspace(static_cast<unsigned char>(rt[body]))) ++body;
+    }
+    if (body != i && (body >= n || rt[body] == '#')) {
+      i = body;
+      ch.e = body;
+      chunks.push_back(std::move(ch));
+      continue;
+    }
+    if (rt[i] == '#') {
+      i = skipDirective(i);
+      ch.e = i;
+      chunks.push_back(std::move(ch));
+      continue;
+    }
+    int depth = 0;
+    int parens = 0;
+    bool fnBody = false;
+    bool directiveInside = false;
+    bool done = false;
+    char lastSig = 0;
+    while (i < n && !done) {
+      const char c = rt[i];
+      if (c == '#' && atLineStart(i)) {
+        if (depth == 0) directiveInside = true;
+        i = skipDirective(i);
+        continue;
+      }
+      if (c == '/' && i + 1 < n && (rt[i + 1] == '/' || rt[i + 1] == '*')) {
+        if (rt[i + 1] == '/') {
+          while (i < n && rt[i] != '\n') ++i;
+        } else {
+          i += 2;
+          while (i + 1 < n && !(rt[i] == '*' && rt[i + 1] == '/')) ++i;
+          i += 2;
+        }
+        continue;
+      }
+      if (c == '"' || c == '\'') {
+        ++i;
+        while (i < n && rt[i] != c) i += (rt[i] == '\\') ? 2 : 1;
+        ++i;
+        lastSig = c;
+        continue;
+      }
+      ++i;
+      if (std::isspace(static_cast<unsigned char>(c))) continue;
+      if (c == '(') ++parens;
+      if (c == ')') --parens;
+      if (c == '{') {
+        if (depth == 0 && lastSig == ')') fnBody = true;
+        ++depth;
+      } else if (c == '}') {
+        if (--depth < 0) return rt;
+        if (depth == 0 && fnBody) done = true;
+      } else if (c == ';' && depth == 0 && parens == 0) {
+        done = true;
+      }
+      lastSig = c;
+    }
+    if (!done) return rt;
+    ch.e = i;
+    // Only `static` definitions are candidates; anything with external linkage may be needed by the linker.
+    const bool isStatic = rt.compare(body, 7, "static ") == 0;
+    if (isStatic && !directiveInside) {
+      std::size_t headEnd = ch.e;
+      if (fnBody) {
+        headEnd = rt.find('{', body);
+      } else {
+        int d = 0;
+        for (std::size_t k = body; k < ch.e; ++k) {
+          const char c = rt[k];
+          if (c == '(' || c == '[' || c == '{') ++d;
+          if (c == ')' || c == ']' || c == '}') --d;
+          if (d == 0 && (c == '=' || c == ';')) {
+            headEnd = k;
+            break;
+          }
+        }
+      }
+      const std::size_t paren = rt.find('(', body);
+      if (paren != std::string::npos && paren < headEnd) {
+        // Function definition or prototype: the name is the identifier right before the parameter list.
+        std::vector<std::string> beforeParen;
+        collectCIdentifiers(rt, body, paren, beforeParen);
+        if (!beforeParen.empty()) ch.defs.push_back(beforeParen.back());
+      } else {
+        // Variable: the last identifier outside array bounds, e.g. `bufs` in `static char *bufs[LS_SLOTS];`.
+        int brackets = 0;
+        std::size_t k = body;
+        while (k < headEnd) {
+          const char c = rt[k];
+          if (c == '[') ++brackets;
+          if (c == ']') --brackets;
+          if (brackets == 0 && isCIdentStart(c)) {
+            const std::size_t s = k;
+            while (k < headEnd && isCIdentChar(rt[k])) ++k;
+            if (ch.defs.empty()) ch.defs.emplace_back();
+            ch.defs.back().assign(rt, s, k - s);
+            continue;
+          }
+          ++k;
+        }
+      }
+      static const std::unordered_set<std::string> kNotNames = {"void", "int", "char", "const", "inline", "static",
+                                                                "__attribute__", "__declspec"};
+      if (!ch.defs.empty() && !kNotNames.count(ch.defs.front())) ch.pinned = false;
+    }
+    chunks.push_back(std::move(ch));
+  }
+
+  std::unordered_map<std::string, std::vector<std::size_t>> definers;
+  for (std::size_t k = 0; k < chunks.size(); ++k) {
+    for (const std::string &d : chunks[k].defs) {
+      if (!chunks[k].pinned) definers[d].push_back(k);
+    }
+  }
+  std::vector<char> keep(chunks.size(), 0);
+  std::vector<std::string> work;
+  collectCIdentifiers(rootText, 0, rootText.size(), work);
+  for (std::size_t k = 0; k < chunks.size(); ++k) {
+    if (!chunks[k].pinned) continue;
+    keep[k] = 1;
+    collectCIdentifiers(rt, chunks[k].b, chunks[k].e, work);
+  }
+  std::unordered_set<std::string> seen;
+  while (!work.empty()) {
+    std::string id = std::move(work.back());
+    work.pop_back();
+    if (!seen.insert(id).second) continue;
+    auto it = definers.find(id);
+    if (it == definers.end()) continue;
+    for (std::size_t k : it->second) {
+      if (keep[k]) continue;
+      keep[k] = 1;
+      collectCIdentifiers(rt, chunks[k].b, chunks[k].e, work);
+    }
+  }
+  std::string out;
+  out.reserve(rt.size());
+  std::size_t kept = 0;
+  std::size_t total = 0;
+  std::size_t prev = 0;
+  for (std::size_t k = 0; k < chunks.size(); ++k) {
+    if (!chunks[k].pinned) ++total;
+    if (!keep[k]) {
+      out.append(rt, prev, chunks[k].b - prev);
+      prev = chunks[k].e;
+      while (prev < n && rt[prev] == '\n') ++prev;
+      continue;
+    }
+    if (!chunks[k].pinned) ++kept;
+  }
+  out.append(rt, prev, std::string::npos);
+  if (keptOut) *keptOut = kept;
+  if (totalOut) *totalOut = total;
+  return out;
+}
+
+// Shortest round-trip float formatting (Grisu2) shared by the emitted runtime and the REPL evaluator. The
+// cached powers are 10^k for k = -348, -340, ..., 340 as normalized 64-bit significands and binary exponents.
+static constexpr int kGrisuPowCount = 87;
+static const uint64_t kGrisuPowF[kGrisuPowCount] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL, 0xcf42894a5dce35eaULL,
+    0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL, 0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL,
+    0xbe5691ef416bd60cULL, 0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL, 0xc21094364dfb5637ULL,
+    0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL, 0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL,
+    0xb23867fb2a35b28eULL, 0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL, 0xb5b5ada8aaff80b8ULL,
+    0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL, 0x964e858c91ba2655ULL, 0xdff9772470297ebdULL,
+    0xa6dfbd9fb8e5b88fULL, 0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL, 0xaa242499697392d3ULL,
+    0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL, 0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL,
+    0x9c40000000000000ULL, 0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL, 0x9f4f2726179a2245ULL,
+    0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL, 0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL,
+    0x924d692ca61be758ULL, 0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL, 0x952ab45cfa97a0b3ULL,
+    0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL, 0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL,
+    0x88fcf317f22241e2ULL, 0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL, 0x8bab8eefb6409c1aULL,
+    0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL, 0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL,
+    0x80444b5e7aa7cf85ULL, 0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL};
+static const int16_t kGrisuPowE[kGrisuPowCount] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927, -901, -874, -847, -821,
+    -794, -768, -741, -715, -688, -661, -635, -608, -582, -555, -529, -502, -475, -449, -422, -396,
+    -369, -343, -316, -289, -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+    56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348, 375, 402, 428, 455,
+    481, 508, 534, 561, 588, 614, 641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066};
+static const uint64_t kPow10U64[20] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL,
+    10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+    1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL};
+struct DiyFp {
+  uint64_t f;
+  int e;
+};
+static DiyFp diyMul(DiyFp x, DiyFp y) {
+  const uint64_t a = x.f >> 32, b = x.f & 0xFFFFFFFFu, c = y.f >> 32, d = y.f & 0xFFFFFFFFu;
+  const uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  const uint64_t mid = (bd >> 32) + (ad & 0xFFFFFFFFu) + (bc & 0xFFFFFFFFu) + (1u << 31);
+  return DiyFp{ac + (ad >> 32) + (bc >> 32) + (mid >> 32), x.e + y.e + 64};
+}
+static DiyFp diyNorm(DiyFp v) {
+  while (!(v.f & 0x8000000000000000ULL)) {
+    v.f <<= 1;
+    --v.e;
+  }
+  return v;
+}
+static int grisu2(double v, char *buf, int *k) {
+  uint64_t bits;
+  std::memcpy(&bits, &v, sizeof(bits));
+  const int be = static_cast<int>((bits >> 52) & 0x7FF);
+  const uint64_t frac = bits & 0x000FFFFFFFFFFFFFULL;
+  const DiyFp w = be ? DiyFp{frac + 0x0010000000000000ULL, be - 1075} : DiyFp{frac, -1074};
+  const DiyFp mp = diyNorm(DiyFp{(w.f << 1) + 1, w.e - 1});
+  DiyFp mm = w.f == 0x0010000000000000ULL ? DiyFp{(w.f << 2) - 1, w.e - 2} : DiyFp{(w.f << 1) - 1, w.e - 1};
+  mm.f <<= mm.e - mp.e;
+  mm.e = mp.e;
+  const double dk = (-61 - mp.e) * 0.30102999566398114 + 347;
+  int ki = static_cast<int>(dk);
+  if (dk - ki > 0.0) ++ki;
+  const int idx = (ki >> 3) + 1;
+  *k = 348 - idx * 8;
+  const DiyFp c{kGrisuPowF[idx], kGrisuPowE[idx]};
+  const DiyFp W = diyMul(diyNorm(w), c);
+  DiyFp Wp = diyMul(mp, c);
+  DiyFp Wm = diyMul(mm, c);
+  ++Wm.f;
+  --Wp.f;
+  uint64_t delta = Wp.f - Wm.f;
+  const int sh = -Wp.e;
+  const uint64_t one = 1ULL << sh;
+  const uint64_t wpW = Wp.f - W.f;
+  auto round = [&](int len, uint64_t rest, uint64_t tenKappa, uint64_t distance) {
+    while (rest < distance && delta - rest >= tenKappa &&
+           (rest + tenKappa < distance || distance - rest > rest + tenKappa - distance)) {
+      buf[len - 1]--;
+      rest += tenKappa;
+    }
+  };
+  uint32_t p1 = static_cast<uint32_t>(Wp.f >> sh);
+  uint64_t p2 = Wp.f & (one - 1);
+  char hi[10];
+  int kappa = 0;
+  for (uint32_t t = p1; t != 0; t /= 10) hi[kappa++] = static_cast<char>(t % 10);
+  int len = 0;
+  while (kappa > 0) {
+    const uint32_t d = static_cast<uint32_t>(hi[kappa - 1]);
+    p1 -= d * static_cast<uint32_t>(kPow10U64[kappa - 1]);
+    if (d || len) buf[len++] = static_cast<char>('0' + d);
+    --kappa;
+    const uint64_t rest = (static_cast<uint64_t>(p1) << sh) + p2;
+    if (rest <= delta) {
+      *k += kappa;
+      round(len, rest, kPow10U64[kappa] << sh, wpW);
+      return len;
+    }
+  }
+  for (;;) {
+    p2 *= 10;
+    delta *= 10;
+    const char d = static_cast<char>(p2 >> sh);
+    if (d || len) buf[len++] = static_cast<char>('0' + d);
+    p2 &= one - 1;
+    --kappa;
+    if (p2 < delta) {
+      *k += kappa;
+      round(len, p2, one, -kappa < 20 ? wpW * kPow10U64[-kappa] : 0);
+      return len;
+    }
+  }
+}
+// Same text as the runtime's ls_f64_to_dec: the shortest digits that read back as v, laid out like "%.17g".
+static std::string formatShortestF64(double v) {
+  uint64_t bits;
+  std::memcpy(&bits, &v, sizeof(bits));
+  std::string out;
+  if (bits >> 63) out.push_back('-');
+  if (((bits >> 52) & 0x7FF) == 0x7FF) return out + ((bits & 0x000FFFFFFFFFFFFFULL) ? "nan" : "inf");
+  if ((bits << 1) == 0) return out + "0";
+  char d[20];
+  int k = 0;
+  const int len = grisu2(v < 0 ? -v : v, d, &k);
+  const int x = len + k - 1;
+  if (x < -4 || x >= 17) {
+    out.push_back(d[0]);
+    if (len > 1) {
+      out.push_back('.');
+      out.append(d + 1, static_cast<std::size_t>(len - 1));
+    }
+    const int ax = x < 0 ? -x : x;
+    out.push_back('e');
+    out.push_back(x < 0 ? '-' : '+');
+    if (ax < 10) out.push_back('0');
+    out += std::to_string(ax);
+  } else if (k >= 0) {
+    out.append(d, static_cast<std::size_t>(len));
+    out.append(static_cast<std::size_t>(k), '0');
+  } else if (x >= 0) {
+    out.append(d, static_cast<std::size_t>(x + 1));
+    out.push_back('.');
+    out.append(d + x + 1, static_cast<std::size_t>(len - x - 1));
+  } else {
+    out += "0.";
+    out.append(static_cast<std::size_t>(-x - 1), '0');
+    out.append(d, static_cast<std::size_t>(len));
+  }
+  return out;
+}
+
+class EmitC {
+public:
+  EmitC(const Program &p, std::unordered_set<std::string> inl, bool superuserMode = false,
+        bool superuserStartEnabled = false,
+        std::vector<std::string> activeCliFlags = {},
+        std::vector<std::string> cliCustomTokens = {})
+      : p_(p), inl_(std::move(inl)), superuserMode_(superuserMode), superuserStartEnabled_(superuserStartEnabled),
+        cliCustomTokens_(std::move(cliCustomTokens)) {
+    std::unordered_map<std::string, std::string> flagSymbols;
+    for (const Fn &f : p_.f) {
+      if (!f.isCliFlag) continue;
+      flagSymbols[f.cliFlagName] = f.n;
+    }
+    std::unordered_set<std::string> seenFlags;
+    for (const std::string &flagName : activeCliFlags) {
+      auto it = flagSymbols.find(flagName);
+      if (it == flagSymbols.end()) continue;
+      if (!seenFlags.insert(flagName).second) continue;
+      activeCliFlagCalls_.push_back(it->second);
+    }
+    usage_ = collectProgramUsage(p_);
+    needsSimdRuntime_ = usesSimdRuntime(p_, usage_);
+    minimalRuntime_ = usage_.callsOnly(isMinimalRuntimeCallName) && !usage_.hasFormatBlock &&
+                      !usesStringRuntimeProgram(p_) && !needsSimdRuntime_;
+    ultraMinimalRuntime_ =
+#if defined(_WIN32)
+        minimalRuntime_ && hasOnlyUltraMinimalRuntimeCallsProgram(p_) && !usesF64Program(p_) &&
+        !usage_.calledAny({"stateSpeed", ".stateSpeed"});
+#else
+        false;
+#endif
+    needsForRuntime_ = usage_.hasFor;
+    needsPowRuntime_ = usage_.hasPow;
+    needsStateSpeedRuntime_ = usage_.calledAny({"stateSpeed", ".stateSpeed"});
+    needsFormatOutputRuntime_ = usage_.calledAny({"formatOutput", "FormatOutput"});
+    needsHttpRuntime_ = usesHttpRuntime(usage_);
+    needsBenchRuntime_ = usage_.calledAny({"__ls_bench_begin", "black_box"});
+    needsFileRuntime_ = usage_.calledPrefix("file_");
+    waitingFns_ = collectWaitingFunctions(p_, usage_);
+    stringRegions_ = !minimalRuntime_ && !ultraMinimalRuntime_;
+    superuserDebugToStderr_ = superuserMode_ && usage_.called(".format");
+    superuserIrDumpRequested_ = superuserMode_ && usage_.called("su.ir.dump");
+    const Fn *mainEntry = nullptr;
+    const Fn *scriptEntry = nullptr;
+    const Fn *singleZeroArg = nullptr;
+    int zeroArgCount = 0;
+    for (const Fn &f : p_.f) {
+      if (f.ex || f.isCliFlag) continue;
+      if (f.n == "main") mainEntry = &f;
+      if (f.n == kScriptEntryName) scriptEntry = &f;
+      if (f.p.empty()) {
+        ++zeroArgCount;
+        if (!singleZeroArg) singleZeroArg = &f;
+      }
+    }
+    if (scriptEntry) {
+      entry_ = scriptEntry;
+    } else if (mainEntry) {
+      entry_ = mainEntry;
+    } else if (zeroArgCount == 1) {
+      entry_ = singleZeroArg;
+    } else if (zeroArgCount == 0) {
+      entryError_ = "no runnable entry point found; add top-level statements, define main(), or define one zero-argument function";
+    } else {
+      entryError_ =
+          "ambiguous entry point: multiple zero-argument functions found; define main(), add top-level statements, or keep only one zero-argument function";
+    }
+  }
+  bool ultraMinimalRuntime() const { return ultraMinimalRuntime_; }
+  const ProgramUsage &usage() const { return usage_; }
+  std::size_t runtimeDefinitionsKept() const { return runtimeKept_; }
+  std::size_t runtimeDefinitionsTotal() const { return runtimeTotal_; }
+  // Program-wide emitter settings that change how a function body is lowered; part of its cache key.
+  std::string emitModeKey() const {
+    std::string key;
+    for (bool b : {minimalRuntime_, ultraMinimalRuntime_, needsForRuntime_, needsPowRuntime_, needsStateSpeedRuntime_,
+                   needsFormatOutputRuntime_, needsHttpRuntime_, superuserMode_, superuserStartEnabled_,
+                   superuserDebugToStderr_, superuserIrDumpRequested_, stringRegions_, profile_}) {
+      key.push_back(b ? '1' : '0');
+    }
+    return key;
+  }
+  // Turns on per-function capture: run() copies the given definitions (by function name) instead of emitting
+  // them, and functionC() afterwards holds the text of every definition, reused or fresh.
+  void reuseFunctionC(std::unordered_map<std::string, std::string> cached) {
+    captureFnC_ = true;
+    reuseFnC_ = std::move(cached);
+  }
+  const std::unordered_map<std::string, std::string> &functionC() const { return fnC_; }
+  // Instruments every function that is not inlined for the sampling profiler; the no-CRT runtime cannot host
+  // it, so profiling builds always use a CRT-backed runtime.
+  void enableProfiling(std::string defaultOut) {
+    profile_ = true;
+    profileOut_ = std::move(defaultOut);
+    ultraMinimalRuntime_ = false;
+  }
+  void setProfileHints(const ProfileHints &hints) { hints_ = hints; }
+  std::size_t functionsReused() const { return fnReused_; }
+  bool hasEntry() const { return entry_ != nullptr; }
+  const std::string &entryError() const { return entryError_; }
+  bool superuserMode() const { return superuserMode_; }
+  bool superuserDebugToStderr() const { return superuserDebugToStderr_; }
+  bool superuserIrDumpRequested() const { return superuserIrDumpRequested_; }
+  std::string run() {
+    o_ << "#include <stdint.h>\n";
+    o_ << "#include <stddef.h>\n\n";
+    o_ << "#include <stdio.h>\n";
+    o_ << "#include <stdlib.h>\n";
+    o_ << "#include <time.h>\n\n";
+    o_ << "#include <math.h>\n\n";
+    o_ << "#include <string.h>\n\n";
+    o_ << "#include <ctype.h>\n\n";
+#if defined(_WIN32)
+    if (needsHttpRuntime_) {
+      o_ << "#if !defined(_WIN32_WINNT) || _WIN32_WINNT < 0x0600\n";
+      o_ << "#undef _WIN32_WINNT\n";
+      o_ << "#define _WIN32_WINNT 0x0600\n";
+      o_ << "#endif\n";
       o_ << "#include <winsock2.h>\n";
       o_ << "#include <ws2tcpip.h>\n\n";
     }
-    o_ << "#include <windows.h>\n\n";
+    o_ << "#include <windows.h>\n";
+    o_ << "#include <io.h>\n\n";
     o_ << "#ifdef max\n";
     o_ << "#undef max\n";
     o_ << "#endif\n";
@@ -6132,13 +8433,38 @@ public:
     if (needsHttpRuntime_) {
       o_ << "#include <sys/types.h>\n";
       o_ << "#include <sys/socket.h>\n";
+      o_ << "#include <sys/stat.h>\n";
+      o_ << "#include <sys/uio.h>\n";
       o_ << "#include <netinet/in.h>\n";
       o_ << "#include <netinet/tcp.h>\n";
       o_ << "#include <arpa/inet.h>\n";
+      o_ << "#include <fcntl.h>\n";
+      o_ << "#include <errno.h>\n";
       o_ << "#include <unistd.h>\n\n";
     }
+    o_ << "#include <errno.h>\n";
     o_ << "#include <unistd.h>\n";
+    o_ << "#include <sched.h>\n";
     o_ << "#include <pthread.h>\n\n";
+    if (needsFileRuntime_) {
+      o_ << "#include <fcntl.h>\n";
+      o_ << "#include <sys/mman.h>\n";
+      o_ << "#include <sys/stat.h>\n\n";
+    }
+    if (profile_) {
+      o_ << "#include <signal.h>\n";
+      o_ << "#include <sys/time.h>\n\n";
+    }
+    if (needsBenchRuntime_) {
+      o_ << "#if defined(__linux__) && defined(__has_include)\n";
+      o_ << "#if __has_include(<linux/perf_event.h>)\n";
+      o_ << "#include <linux/perf_event.h>\n";
+      o_ << "#include <sys/ioctl.h>\n";
+      o_ << "#include <sys/syscall.h>\n";
+      o_ << "#define LS_BENCH_PERF 1\n";
+      o_ << "#endif\n";
+      o_ << "#endif\n\n";
+    }
 #endif
     o_ << "typedef uint8_t ls_bool;\n\n";
     o_ << "static ls_bool ls_su_enabled = " << (superuserStartEnabled_ ? "1" : "0") << ";\n";
@@ -6164,7 +8490,10 @@ public:
     o_ << "#if defined(_OPENMP)\n";
     o_ << "#define LS_PAR_FOR _Pragma(\"omp parallel for simd schedule(static)\")\n";
     o_ << "#define LS_PAR_FOR_IF(c) LS_DO_PRAGMA(omp parallel for simd schedule(static) if(c))\n";
+    o_ << "#define LS_PAR_FOR_CLAUSES(...) LS_DO_PRAGMA(omp parallel for simd __VA_ARGS__)\n";
+    o_ << "#ifndef LS_PAR_MIN_ITERS\n";
     o_ << "#define LS_PAR_MIN_ITERS 8000000LL\n";
+    o_ << "#endif\n";
     o_ << "#define LS_OMP_SIMD LS_DO_PRAGMA(omp simd)\n";
     o_ << "#define LS_OMP_SIMD_REDUCTION_PLUS(v) LS_DO_PRAGMA(omp simd reduction(+:v))\n";
     o_ << "#define LS_OMP_SIMD_REDUCTION_PLUS2(a,b) LS_DO_PRAGMA(omp simd reduction(+:a,b))\n";
@@ -6173,7 +8502,10 @@ public:
     o_ << "#else\n";
     o_ << "#define LS_PAR_FOR\n";
     o_ << "#define LS_PAR_FOR_IF(c)\n";
+    o_ << "#define LS_PAR_FOR_CLAUSES(...)\n";
+    o_ << "#ifndef LS_PAR_MIN_ITERS\n";
     o_ << "#define LS_PAR_MIN_ITERS 8000000LL\n";
+    o_ << "#endif\n";
     o_ << "#define LS_OMP_SIMD\n";
     o_ << "#define LS_OMP_SIMD_REDUCTION_PLUS(v)\n";
     o_ << "#define LS_OMP_SIMD_REDUCTION_PLUS2(a,b)\n";
@@ -6194,23 +8526,80 @@ public:
     o_ << "#else\n";
     o_ << "#define LS_ALWAYS_INLINE inline\n";
     o_ << "#endif\n\n";
+    if (!hints_.hot.empty() || !hints_.cold.empty()) {
+      o_ << "#if defined(__clang__) || defined(__GNUC__)\n";
+      o_ << "#define LS_HOT __attribute__((hot))\n";
+      o_ << "#define LS_COLD __attribute__((cold))\n";
+      o_ << "#else\n";
+      o_ << "#define LS_HOT\n";
+      o_ << "#define LS_COLD\n";
+      o_ << "#endif\n\n";
+    }
+    if (!ultraMinimalRuntime_) {
+      o_ << "#if defined(_MSC_VER)\n";
+      o_ << "#define LS_THREAD_LOCAL __declspec(thread)\n";
+      o_ << "#else\n";
+      o_ << "#define LS_THREAD_LOCAL _Thread_local\n";
+      o_ << "#endif\n\n";
+      // Shared by the sampling profiler and benchmark blocks.
+      if (profile_ || needsBenchRuntime_) {
+        o_ << "static inline int64_t ls_monotonic_ns(void) {\n";
+        o_ << "#if defined(_WIN32)\n";
+        o_ << "  static LARGE_INTEGER freq;\n";
+        o_ << "  LARGE_INTEGER now;\n";
+        o_ << "  if (!freq.QuadPart) QueryPerformanceFrequency(&freq);\n";
+        o_ << "  QueryPerformanceCounter(&now);\n";
+        o_ << "  return (int64_t)(now.QuadPart / freq.QuadPart) * 1000000000LL +\n";
+        o_ << "         (int64_t)((now.QuadPart % freq.QuadPart) * 1000000000LL / freq.QuadPart);\n";
+        o_ << "#elif defined(CLOCK_MONOTONIC)\n";
+        o_ << "  struct timespec ts;\n";
+        o_ << "  clock_gettime(CLOCK_MONOTONIC, &ts);\n";
+        o_ << "  return (int64_t)ts.tv_sec * 1000000000LL + (int64_t)ts.tv_nsec;\n";
+        o_ << "#else\n";
+        o_ << "  struct timespec ts;\n";
+        o_ << "  timespec_get(&ts, TIME_UTC);\n";
+        o_ << "  return (int64_t)ts.tv_sec * 1000000000LL + (int64_t)ts.tv_nsec;\n";
+        o_ << "#endif\n";
+        o_ << "}\n";
+        o_ << "\n";
+      }
+    }
+    const std::size_t runtimeBegin = static_cast<std::size_t>(o_.tellp());
     if (ultraMinimalRuntime_)
       emitBuiltinsUltraMinimal();
     else if (minimalRuntime_)
       emitBuiltinsMinimal();
     else
       emitBuiltins();
+    const std::size_t runtimeEnd = static_cast<std::size_t>(o_.tellp());
     for (const Fn &f : p_.f) proto(f);
     o_ << '\n';
+    if (profile_) emitProfileRuntime();
+    emitTaskThunks();
+    emitNpKernels();
     for (const Fn &f : p_.f)
-      if (!f.ex) fn(f);
+      if (!f.ex) cachedFn(f);
     if (entry_) emitEntryWrapper();
-    return o_.str();
+    std::string out = o_.str();
+    // The no-CRT runtime is already minimal and must keep its CRT replacements, so it is left as emitted.
+    if (ultraMinimalRuntime_) return out;
+    const std::string rootText = out.substr(0, runtimeBegin) + out.substr(runtimeEnd);
+    return out.substr(0, runtimeBegin) +
+           pruneUnusedRuntime(out.substr(runtimeBegin, runtimeEnd - runtimeBegin), rootText, &runtimeKept_,
+                              &runtimeTotal_) +
+           out.substr(runtimeEnd);
   }
 
 private:
   const Program &p_;
   std::unordered_set<std::string> inl_;
+  ProgramUsage usage_;
+  std::size_t runtimeKept_ = 0;
+  std::size_t runtimeTotal_ = 0;
+  bool captureFnC_ = false;
+  std::unordered_map<std::string, std::string> reuseFnC_;
+  std::unordered_map<std::string, std::string> fnC_;
+  std::size_t fnReused_ = 0;
   bool minimalRuntime_ = false;
   bool ultraMinimalRuntime_ = false;
   bool needsForRuntime_ = false;
@@ -6218,6 +8607,10 @@ private:
   bool needsStateSpeedRuntime_ = false;
   bool needsFormatOutputRuntime_ = false;
   bool needsHttpRuntime_ = false;
+  bool needsBenchRuntime_ = false;
+  bool needsFileRuntime_ = false;
+  bool needsSimdRuntime_ = false;
+  std::unordered_set<std::string> waitingFns_;
   bool superuserMode_ = false;
   bool superuserStartEnabled_ = false;
   bool superuserDebugToStderr_ = false;
@@ -6238,11 +8631,19 @@ private:
   struct CleanupScope {
     std::vector<CleanupItem> items;
     bool loopBoundary = false;
+    std::string region;
+    std::vector<std::string> strVars;
   };
   std::vector<CleanupScope> cleanupScopes_;
+  bool stringRegions_ = false;
+  bool profile_ = false;
+  std::string profileOut_;
+  ProfileHints hints_;
+  bool profFrame_ = false;
+  int parallelBodyDepth_ = 0;
   static constexpr const char *kEntryName = "__linescript_main";
 
-  void pushCleanupScope(bool loopBoundary = false) { cleanupScopes_.push_back(CleanupScope{{}, loopBoundary}); }
+  void pushCleanupScope(bool loopBoundary = false) { cleanupScopes_.push_back(CleanupScope{{}, loopBoundary, {}, {}}); }
 
   void popCleanupScope() {
     if (!cleanupScopes_.empty()) cleanupScopes_.pop_back();
@@ -6278,10 +8679,70 @@ private:
     }
   }
 
+  bool hasPendingCleanup() const {
+    for (const auto &scope : cleanupScopes_) if (!scope.items.empty()) return true;
+    return false;
+  }
+
+  // String temporaries made inside a region live until the scope that opened it exits; the region is registered as
+  // the scope's first cleanup item so it is released after every owned value and on every return/break/continue.
+  void openStringRegion(int indentLevel) {
+    if (!stringRegions_ || cleanupScopes_.empty()) return;
+    const std::string name = "__ls_region_" + std::to_string(loopSerial_++);
+    ind(o_, indentLevel);
+    o_ << "ls_region " << name << ";\n";
+    ind(o_, indentLevel);
+    o_ << "ls_region_enter(&" << name << ");\n";
+    cleanupScopes_.back().region = name;
+    registerOwned("&" + name, "ls_region_leave");
+  }
+
+  std::string innermostRegion(std::size_t scopeEnd) const {
+    for (std::size_t i = scopeEnd; i-- > 0;) {
+      if (!cleanupScopes_[i].region.empty()) return cleanupScopes_[i].region;
+    }
+    return "";
+  }
+
+  std::optional<std::string> strVarRegion(const std::string &var) const {
+    for (std::size_t i = cleanupScopes_.size(); i-- > 0;) {
+      const auto &vars = cleanupScopes_[i].strVars;
+      if (std::find(vars.begin(), vars.end(), var) != vars.end()) return innermostRegion(i + 1);
+    }
+    return std::nullopt;
+  }
+
+  void emitLoopBody(const std::vector<SP> &body, int indentLevel) {
+    pushCleanupScope(true);
+    if (blockAllocatesStr(body)) openStringRegion(indentLevel);
+    for (const SP &x : body) stmt(*x, indentLevel);
+    emitCurrentScopeCleanup(indentLevel);
+    popCleanupScope();
+  }
+
   std::string cFnName(const std::string &n) const {
     if (entry_ && n == entry_->n) return kEntryName;
     return n;
   }
+  // Functions the C compiler is asked to inline keep no frame of their own, as a PC-sampling profiler would
+  // see them after inlining; their samples land on the caller.
+  bool profiledFn(const Fn &f) const { return profile_ && !f.ex && !f.inl && !inl_.count(f.n); }
+  std::string profFnVar(const Fn &f) const { return "ls_prof_fn_" + cFnName(f.n); }
+  // Statements that refresh the frame's line: ones that call something (so caller frames carry call sites) and
+  // loops. Call-free straight-line code inherits the previous line, which keeps simple loop bodies vectorizable.
+  static bool profLineMarker(const Stmt &s) {
+    auto calls = [](const Expr *x) { return x != nullptr && hasCallPrefix(*x, ""); };
+    switch (s.k) {
+    case SK::While:
+    case SK::For: return true;
+    case SK::Let: return calls(static_cast<const SLet &>(s).v.get());
+    case SK::Assign: return calls(static_cast<const SAssign &>(s).v.get());
+    case SK::Expr: return calls(static_cast<const SExpr &>(s).e.get());
+    case SK::Ret: return calls(static_cast<const SRet &>(s).v.get());
+    case SK::If: return calls(static_cast<const SIf &>(s).c.get());
+    default: return false;
+    }
+  }
 
   static std::string cType(Type t) {
     switch (t) {
@@ -6292,9 +8753,23 @@ private:
     case Type::Bool: return "ls_bool";
     case Type::Str: return "const char *";
     case Type::Void: return "void";
+    case Type::F32x4: return "ls_f32x4";
+    case Type::F32x8: return "ls_f32x8";
+    case Type::F64x4: return "ls_f64x4";
+    case Type::I64x4: return "ls_i64x4";
     }
     return "void";
   }
+  static const char *blackBoxSuffix(Type t) {
+    switch (t) {
+    case Type::I32: return "i32";
+    case Type::F32: return "f32";
+    case Type::F64: return "f64";
+    case Type::Bool: return "bool";
+    case Type::Str: return "str";
+    default: return "i64";
+    }
+  }
   static std::string uop(UK o) { return o == UK::Neg ? "-" : "!"; }
   static std::string bop(BK o) {
     switch (o) {
@@ -6839,31 +9314,302 @@ private:
       o_ << "#define FormatOutput(x) __ls_format_dispatch(x)\n\n";
     }
   }
-  void emitBuiltinsMinimal() {
-    o_ << "static inline void ls_emit_text(const char *s) { fputs(s ? s : \"\", stdout); }\n";
-    o_ << "static inline void ls_emit_newline(void) { fputc('\\n', stdout); }\n";
+  // Stdout buffering and number formatting shared by the full and minimal runtimes. With `formatCapture`, text
+  // printed inside a format block goes to the ls_fmt capture buffer instead of stdout.
+  void emitOutputRuntime(bool formatCapture) {
+    o_ << "#ifndef LS_OUT_BUF_SIZE\n";
+    o_ << "#define LS_OUT_BUF_SIZE 65536\n";
+    o_ << "#endif\n";
+    o_ << "/* Buffered stdout. The thread running main() collects output and writes it out when the buffer fills, on\n";
+    o_ << "   flush(), before input() reads, before work is handed to other threads, and at exit. Other threads, and a\n";
+    o_ << "   terminal stdout, write each print through as one call. */\n";
+    o_ << "typedef struct {\n";
+    o_ << "  char *buf;\n";
+    o_ << "  size_t len;\n";
+    o_ << "  ls_bool held;\n";
+    o_ << "} ls_out_state;\n";
+    o_ << "static LS_THREAD_LOCAL ls_out_state ls_out = {NULL, 0, 0};\n";
+    o_ << "static ls_out_state *ls_out_main = NULL;\n";
+    o_ << "static inline void ls_out_write(const char *s, size_t n) {\n";
+    o_ << "  while (n > 0) {\n";
+    o_ << "#if defined(_WIN32)\n";
+    o_ << "    const int wrote = _write(1, s, n > 0x40000000u ? 0x40000000u : (unsigned)n);\n";
+    o_ << "#else\n";
+    o_ << "    const ssize_t wrote = write(1, s, n);\n";
+    o_ << "    if (wrote < 0 && errno == EINTR) continue;\n";
+    o_ << "#endif\n";
+    o_ << "    if (wrote <= 0) return;\n";
+    o_ << "    s += wrote;\n";
+    o_ << "    n -= (size_t)wrote;\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_out_flush(void) {\n";
+    o_ << "  if (ls_out.len == 0) return;\n";
+    o_ << "  ls_out_write(ls_out.buf, ls_out.len);\n";
+    o_ << "  ls_out.len = 0;\n";
+    o_ << "}\n";
+    o_ << "static void ls_out_flush_main(void) {\n";
+    o_ << "  if (!ls_out_main || ls_out_main->len == 0) return;\n";
+    o_ << "  ls_out_write(ls_out_main->buf, ls_out_main->len);\n";
+    o_ << "  ls_out_main->len = 0;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_out_init(void) {\n";
+    o_ << "#if defined(_WIN32)\n";
+    o_ << "  ls_out.held = _isatty(1) ? 0 : 1;\n";
+    o_ << "#else\n";
+    o_ << "  ls_out.held = isatty(1) ? 0 : 1;\n";
+    o_ << "#endif\n";
+    o_ << "  ls_out_main = &ls_out;\n";
+    o_ << "  (void)atexit(ls_out_flush_main);\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_out_append(const char *s, size_t n) {\n";
+    o_ << "  if (!ls_out.buf) {\n";
+    o_ << "    ls_out.buf = (char *)malloc(LS_OUT_BUF_SIZE);\n";
+    o_ << "    if (!ls_out.buf) {\n";
+    o_ << "      ls_out_write(s, n);\n";
+    o_ << "      return;\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "  if (n > LS_OUT_BUF_SIZE - ls_out.len) {\n";
+    o_ << "    ls_out_flush();\n";
+    o_ << "    if (n > LS_OUT_BUF_SIZE) {\n";
+    o_ << "      ls_out_write(s, n);\n";
+    o_ << "      return;\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "  memcpy(ls_out.buf + ls_out.len, s, n);\n";
+    o_ << "  ls_out.len += n;\n";
+    o_ << "}\n";
+    for (bool line : {false, true}) {
+      o_ << "static inline void " << (line ? "ls_emit_line" : "ls_emit_bytes") << "(const char *s, size_t n) {\n";
+      if (formatCapture) {
+        o_ << "  if (ls_fmt.active) {\n";
+        o_ << "    ls_fmt_append(s, n);\n";
+        if (line) o_ << "    ls_fmt_append(\"\\n\", 1);\n";
+        o_ << "    return;\n";
+        o_ << "  }\n";
+      }
+      o_ << "  ls_out_append(s, n);\n";
+      if (line) o_ << "  ls_out_append(\"\\n\", 1);\n";
+      o_ << "  if (!ls_out.held) ls_out_flush();\n";
+      o_ << "}\n";
+    }
+    o_ << "static inline void ls_emit_text(const char *s) {\n";
+    o_ << "  if (s) ls_emit_bytes(s, strlen(s));\n";
+    o_ << "}\n";
+    o_ << "static inline void flush(void) { ls_out_flush(); }\n";
+    o_ << "static const char ls_digit_pairs[201] = \"";
+    for (int i = 0; i < 100; ++i) o_ << static_cast<char>('0' + i / 10) << static_cast<char>('0' + i % 10);
+    o_ << "\";\n";
+    o_ << "static inline size_t ls_u64_to_dec(uint64_t x, char *out) {\n";
+    o_ << "  char tmp[20];\n";
+    o_ << "  char *p = tmp + sizeof(tmp);\n";
+    o_ << "  while (x >= 100u) {\n";
+    o_ << "    const unsigned r = (unsigned)(x % 100u) * 2u;\n";
+    o_ << "    x /= 100u;\n";
+    o_ << "    *--p = ls_digit_pairs[r + 1];\n";
+    o_ << "    *--p = ls_digit_pairs[r];\n";
+    o_ << "  }\n";
+    o_ << "  if (x >= 10u) {\n";
+    o_ << "    *--p = ls_digit_pairs[x * 2u + 1];\n";
+    o_ << "    *--p = ls_digit_pairs[x * 2u];\n";
+    o_ << "  } else {\n";
+    o_ << "    *--p = (char)('0' + (char)x);\n";
+    o_ << "  }\n";
+    o_ << "  const size_t n = (size_t)(tmp + sizeof(tmp) - p);\n";
+    o_ << "  memcpy(out, p, n);\n";
+    o_ << "  return n;\n";
+    o_ << "}\n";
+    o_ << "static inline size_t ls_i64_to_dec(int64_t v, char *out) {\n";
+    o_ << "  if (v >= 0) return ls_u64_to_dec((uint64_t)v, out);\n";
+    o_ << "  out[0] = '-';\n";
+    o_ << "  return 1 + ls_u64_to_dec((uint64_t)0 - (uint64_t)v, out + 1);\n";
+    o_ << "}\n";
     o_ << "static inline const char *ls_i64_to_cstr(int64_t v, char *buf) {\n";
-    o_ << "  uint64_t x;\n";
-    o_ << "  int neg = 0;\n";
-    o_ << "  if (v < 0) { neg = 1; x = (uint64_t)(-(v + 1LL)) + 1ULL; }\n";
-    o_ << "  else { x = (uint64_t)v; }\n";
-    o_ << "  char tmp[32];\n";
-    o_ << "  int n = 0;\n";
-    o_ << "  do { tmp[n++] = (char)('0' + (x % 10ULL)); x /= 10ULL; } while (x != 0ULL);\n";
-    o_ << "  if (neg) tmp[n++] = '-';\n";
-    o_ << "  int j = 0;\n";
-    o_ << "  while (n > 0) buf[j++] = tmp[--n];\n";
-    o_ << "  buf[j] = '\\0';\n";
+    o_ << "  buf[ls_i64_to_dec(v, buf)] = '\\0';\n";
     o_ << "  return buf;\n";
     o_ << "}\n";
-    o_ << "static inline void print_i64(int64_t v) { char b[32]; ls_i64_to_cstr(v, b); ls_emit_text(b); }\n";
-    o_ << "static inline void print_f64(double v) { char b[64]; (void)snprintf(b, sizeof(b), \"%.17g\", v); ls_emit_text(b); }\n";
-    o_ << "static inline void print_bool(ls_bool v) { ls_emit_text(v ? \"true\" : \"false\"); }\n";
-    o_ << "static inline void print_str(const char *v) { ls_emit_text(v ? v : \"\"); }\n";
-    o_ << "static inline void println_i64(int64_t v) { print_i64(v); ls_emit_newline(); }\n";
-    o_ << "static inline void println_f64(double v) { print_f64(v); ls_emit_newline(); }\n";
-    o_ << "static inline void println_bool(ls_bool v) { print_bool(v); ls_emit_newline(); }\n";
-    o_ << "static inline void println_str(const char *v) { puts(v ? v : \"\"); }\n";
+    o_ << "static const uint64_t ls_pow10_u64[20] = {";
+    for (int i = 0; i < 20; ++i) o_ << (i ? ", " : "") << kPow10U64[i] << "ULL";
+    o_ << "};\n";
+    o_ << "static const uint64_t ls_grisu_pow_f[" << kGrisuPowCount << "] = {";
+    for (int i = 0; i < kGrisuPowCount; ++i) {
+      o_ << (i ? "," : "") << (i % 4 == 0 ? "\n  " : " ") << "0x" << std::hex << std::setw(16) << std::setfill('0')
+         << kGrisuPowF[i] << std::dec << std::setfill(' ') << "ULL";
+    }
+    o_ << "\n};\n";
+    o_ << "static const int16_t ls_grisu_pow_e[" << kGrisuPowCount << "] = {";
+    for (int i = 0; i < kGrisuPowCount; ++i) o_ << (i ? "," : "") << (i % 16 == 0 ? "\n  " : " ") << kGrisuPowE[i];
+    o_ << "\n};\n";
+    o_ << "typedef struct {\n";
+    o_ << "  uint64_t f;\n";
+    o_ << "  int e;\n";
+    o_ << "} ls_diyfp;\n";
+    o_ << "static inline ls_diyfp ls_diyfp_make(uint64_t f, int e) {\n";
+    o_ << "  ls_diyfp r;\n";
+    o_ << "  r.f = f;\n";
+    o_ << "  r.e = e;\n";
+    o_ << "  return r;\n";
+    o_ << "}\n";
+    o_ << "static inline ls_diyfp ls_diyfp_mul(ls_diyfp x, ls_diyfp y) {\n";
+    o_ << "  const uint64_t a = x.f >> 32, b = x.f & 0xFFFFFFFFu, c = y.f >> 32, d = y.f & 0xFFFFFFFFu;\n";
+    o_ << "  const uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;\n";
+    o_ << "  const uint64_t mid = (bd >> 32) + (ad & 0xFFFFFFFFu) + (bc & 0xFFFFFFFFu) + (1u << 31);\n";
+    o_ << "  return ls_diyfp_make(ac + (ad >> 32) + (bc >> 32) + (mid >> 32), x.e + y.e + 64);\n";
+    o_ << "}\n";
+    o_ << "static inline ls_diyfp ls_diyfp_norm(ls_diyfp v) {\n";
+    o_ << "#if defined(__GNUC__) || defined(__clang__)\n";
+    o_ << "  const int s = __builtin_clzll(v.f);\n";
+    o_ << "  v.f <<= s;\n";
+    o_ << "  v.e -= s;\n";
+    o_ << "#else\n";
+    o_ << "  while (!(v.f & 0x8000000000000000ULL)) {\n";
+    o_ << "    v.f <<= 1;\n";
+    o_ << "    --v.e;\n";
+    o_ << "  }\n";
+    o_ << "#endif\n";
+    o_ << "  return v;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_grisu_round(char *buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {\n";
+    o_ << "  while (rest < wp_w && delta - rest >= ten_kappa &&\n";
+    o_ << "         (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {\n";
+    o_ << "    buf[len - 1]--;\n";
+    o_ << "    rest += ten_kappa;\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "/* Grisu2 (Loitsch 2010): digits of a positive finite v into buf, value = digits * 10^*k. The digits always read\n";
+    o_ << "   back as v and are the shortest such string for all but a fraction of a percent of inputs. */\n";
+    o_ << "static inline int ls_grisu2(double v, char *buf, int *k) {\n";
+    o_ << "  uint64_t bits;\n";
+    o_ << "  memcpy(&bits, &v, sizeof(bits));\n";
+    o_ << "  const int be = (int)((bits >> 52) & 0x7FF);\n";
+    o_ << "  const uint64_t frac = bits & 0x000FFFFFFFFFFFFFULL;\n";
+    o_ << "  const ls_diyfp w = be ? ls_diyfp_make(frac + 0x0010000000000000ULL, be - 1075) : ls_diyfp_make(frac, -1074);\n";
+    o_ << "  const ls_diyfp mp = ls_diyfp_norm(ls_diyfp_make((w.f << 1) + 1, w.e - 1));\n";
+    o_ << "  ls_diyfp mm = w.f == 0x0010000000000000ULL ? ls_diyfp_make((w.f << 2) - 1, w.e - 2) : ls_diyfp_make((w.f << 1) - 1, w.e - 1);\n";
+    o_ << "  mm.f <<= mm.e - mp.e;\n";
+    o_ << "  mm.e = mp.e;\n";
+    o_ << "  const double dk = (-61 - mp.e) * 0.30102999566398114 + 347;\n";
+    o_ << "  int ki = (int)dk;\n";
+    o_ << "  if (dk - ki > 0.0) ++ki;\n";
+    o_ << "  const int idx = (ki >> 3) + 1;\n";
+    o_ << "  *k = 348 - idx * 8;\n";
+    o_ << "  const ls_diyfp c = ls_diyfp_make(ls_grisu_pow_f[idx], ls_grisu_pow_e[idx]);\n";
+    o_ << "  const ls_diyfp W = ls_diyfp_mul(ls_diyfp_norm(w), c);\n";
+    o_ << "  ls_diyfp Wp = ls_diyfp_mul(mp, c);\n";
+    o_ << "  ls_diyfp Wm = ls_diyfp_mul(mm, c);\n";
+    o_ << "  ++Wm.f;\n";
+    o_ << "  --Wp.f;\n";
+    o_ << "  uint64_t delta = Wp.f - Wm.f;\n";
+    o_ << "  const int sh = -Wp.e;\n";
+    o_ << "  const uint64_t one = 1ULL << sh;\n";
+    o_ << "  const uint64_t wp_w = Wp.f - W.f;\n";
+    o_ << "  uint32_t p1 = (uint32_t)(Wp.f >> sh);\n";
+    o_ << "  uint64_t p2 = Wp.f & (one - 1);\n";
+    o_ << "  char hi[10];\n";
+    o_ << "  int kappa = 0;\n";
+    o_ << "  for (uint32_t t = p1; t != 0; t /= 10) hi[kappa++] = (char)(t % 10);\n";
+    o_ << "  int len = 0;\n";
+    o_ << "  while (kappa > 0) {\n";
+    o_ << "    const uint32_t d = (uint32_t)hi[kappa - 1];\n";
+    o_ << "    p1 -= d * (uint32_t)ls_pow10_u64[kappa - 1];\n";
+    o_ << "    if (d || len) buf[len++] = (char)('0' + d);\n";
+    o_ << "    --kappa;\n";
+    o_ << "    const uint64_t rest = ((uint64_t)p1 << sh) + p2;\n";
+    o_ << "    if (rest <= delta) {\n";
+    o_ << "      *k += kappa;\n";
+    o_ << "      ls_grisu_round(buf, len, delta, rest, ls_pow10_u64[kappa] << sh, wp_w);\n";
+    o_ << "      return len;\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "  for (;;) {\n";
+    o_ << "    p2 *= 10;\n";
+    o_ << "    delta *= 10;\n";
+    o_ << "    const char d = (char)(p2 >> sh);\n";
+    o_ << "    if (d || len) buf[len++] = (char)('0' + d);\n";
+    o_ << "    p2 &= one - 1;\n";
+    o_ << "    --kappa;\n";
+    o_ << "    if (p2 < delta) {\n";
+    o_ << "      *k += kappa;\n";
+    o_ << "      ls_grisu_round(buf, len, delta, p2, one, -kappa < 20 ? wp_w * ls_pow10_u64[-kappa] : 0);\n";
+    o_ << "      return len;\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "/* Shortest round-trip text of v, laid out like printf(\"%.17g\"): plain notation for decimal exponents in\n";
+    o_ << "   [-4, 17), d.ddde+XX otherwise. Writes at most 25 bytes without a terminator and returns the length. */\n";
+    o_ << "static inline size_t ls_f64_to_dec(double v, char *out) {\n";
+    o_ << "  uint64_t bits;\n";
+    o_ << "  memcpy(&bits, &v, sizeof(bits));\n";
+    o_ << "  size_t n = 0;\n";
+    o_ << "  if (bits >> 63) out[n++] = '-';\n";
+    o_ << "  if (((bits >> 52) & 0x7FF) == 0x7FF) {\n";
+    o_ << "    memcpy(out + n, (bits & 0x000FFFFFFFFFFFFFULL) ? \"nan\" : \"inf\", 3);\n";
+    o_ << "    return n + 3;\n";
+    o_ << "  }\n";
+    o_ << "  if ((bits << 1) == 0) {\n";
+    o_ << "    out[n++] = '0';\n";
+    o_ << "    return n;\n";
+    o_ << "  }\n";
+    o_ << "  char d[20];\n";
+    o_ << "  int k = 0;\n";
+    o_ << "  const int len = ls_grisu2(v < 0 ? -v : v, d, &k);\n";
+    o_ << "  const int x = len + k - 1;\n";
+    o_ << "  if (x < -4 || x >= 17) {\n";
+    o_ << "    out[n++] = d[0];\n";
+    o_ << "    if (len > 1) {\n";
+    o_ << "      out[n++] = '.';\n";
+    o_ << "      memcpy(out + n, d + 1, (size_t)(len - 1));\n";
+    o_ << "      n += (size_t)(len - 1);\n";
+    o_ << "    }\n";
+    o_ << "    out[n++] = 'e';\n";
+    o_ << "    out[n++] = x < 0 ? '-' : '+';\n";
+    o_ << "    const int ax = x < 0 ? -x : x;\n";
+    o_ << "    if (ax >= 100) out[n++] = (char)('0' + ax / 100);\n";
+    o_ << "    out[n++] = (char)('0' + (ax / 10) % 10);\n";
+    o_ << "    out[n++] = (char)('0' + ax % 10);\n";
+    o_ << "  } else if (k >= 0) {\n";
+    o_ << "    memcpy(out + n, d, (size_t)len);\n";
+    o_ << "    n += (size_t)len;\n";
+    o_ << "    for (int i = 0; i < k; ++i) out[n++] = '0';\n";
+    o_ << "  } else if (x >= 0) {\n";
+    o_ << "    memcpy(out + n, d, (size_t)(x + 1));\n";
+    o_ << "    n += (size_t)(x + 1);\n";
+    o_ << "    out[n++] = '.';\n";
+    o_ << "    memcpy(out + n, d + x + 1, (size_t)(len - x - 1));\n";
+    o_ << "    n += (size_t)(len - x - 1);\n";
+    o_ << "  } else {\n";
+    o_ << "    out[n++] = '0';\n";
+    o_ << "    out[n++] = '.';\n";
+    o_ << "    for (int i = 0; i < -x - 1; ++i) out[n++] = '0';\n";
+    o_ << "    memcpy(out + n, d, (size_t)len);\n";
+    o_ << "    n += (size_t)len;\n";
+    o_ << "  }\n";
+    o_ << "  return n;\n";
+    o_ << "}\n";
+    o_ << "static inline void print_i64(int64_t v) {\n";
+    o_ << "  char b[24];\n";
+    o_ << "  ls_emit_bytes(b, ls_i64_to_dec(v, b));\n";
+    o_ << "}\n";
+    o_ << "static inline void print_f64(double v) {\n";
+    o_ << "  char b[32];\n";
+    o_ << "  ls_emit_bytes(b, ls_f64_to_dec(v, b));\n";
+    o_ << "}\n";
+    o_ << "static inline void print_bool(ls_bool v) { ls_emit_bytes(v ? \"true\" : \"false\", v ? 4u : 5u); }\n";
+    o_ << "static inline void print_str(const char *v) { ls_emit_text(v); }\n";
+    o_ << "static inline void println_i64(int64_t v) {\n";
+    o_ << "  char b[24];\n";
+    o_ << "  ls_emit_line(b, ls_i64_to_dec(v, b));\n";
+    o_ << "}\n";
+    o_ << "static inline void println_f64(double v) {\n";
+    o_ << "  char b[32];\n";
+    o_ << "  ls_emit_line(b, ls_f64_to_dec(v, b));\n";
+    o_ << "}\n";
+    o_ << "static inline void println_bool(ls_bool v) { ls_emit_line(v ? \"true\" : \"false\", v ? 4u : 5u); }\n";
+    o_ << "static inline void println_str(const char *v) { ls_emit_line(v ? v : \"\", v ? strlen(v) : 0u); }\n";
+  }
+  void emitBuiltinsMinimal() {
+    emitOutputRuntime(false);
     if (needsStateSpeedRuntime_) {
       o_ << "static inline int64_t clock_us(void) { struct timespec ts; timespec_get(&ts, TIME_UTC); return (int64_t)ts.tv_sec * 1000000LL + (int64_t)(ts.tv_nsec / 1000LL); }\n";
       o_ << "static inline void ls_state_speed(int64_t start_us) { const int64_t now_us = clock_us(); const int64_t elapsed_us = now_us >= start_us ? (now_us - start_us) : 0; print_str(\"speed_us=\"); println_i64(elapsed_us); }\n";
@@ -6947,7 +9693,7 @@ private:
     }
     if (needsFormatOutputRuntime_) {
       o_ << "static inline const char *formatOutput_i64(int64_t v) { static char b[32]; ls_i64_to_cstr(v, b); return b; }\n";
-      o_ << "static inline const char *formatOutput_f64(double v) { static char b[64]; (void)snprintf(b, sizeof(b), \"%.17g\", v); return b; }\n";
+      o_ << "static inline const char *formatOutput_f64(double v) { static char b[32]; b[ls_f64_to_dec(v, b)] = '\\0'; return b; }\n";
       o_ << "static inline const char *formatOutput_bool(ls_bool v) { return v ? \"true\" : \"false\"; }\n";
       o_ << "static inline const char *formatOutput_str(const char *v) { return v ? v : \"\"; }\n";
     }
@@ -6961,12 +9707,1248 @@ private:
       o_ << "#define FormatOutput(x) __ls_format_dispatch(x)\n\n";
     }
   }
-  void emitBuiltins() {
-    o_ << "#if defined(_MSC_VER)\n";
-    o_ << "#define LS_THREAD_LOCAL __declspec(thread)\n";
+  // --profile: a shadow stack of LineScript frames (pushed by instrumented functions, with the current line updated
+  // at calls and loops) sampled by a SIGPROF CPU timer on POSIX or a suspend-and-read sampler thread on
+  // Windows, plus per-thread call counters. The descriptor table is the symbol/line table samples map to.
+  void emitProfileRuntime() {
+    o_ << "#ifndef LS_PROF_MAX_DEPTH\n";
+    o_ << "#define LS_PROF_MAX_DEPTH 32\n";
+    o_ << "#endif\n";
+    o_ << "#ifndef LS_PROF_MAX_STACKS\n";
+    o_ << "#define LS_PROF_MAX_STACKS 4096\n";
+    o_ << "#endif\n";
+    o_ << "#ifndef LS_PROF_MAX_THREADS\n";
+    o_ << "#define LS_PROF_MAX_THREADS 256\n";
+    o_ << "#endif\n";
+    o_ << "#if defined(_MSC_VER) && !defined(__clang__)\n";
+    o_ << "#define LS_PROF_ADD(p, v) ((int64_t)InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(v)))\n";
+    o_ << "#define LS_PROF_CAS32(p, expect, desired) (InterlockedCompareExchange((volatile LONG *)(p), (LONG)(desired), (LONG)(expect)) == (LONG)(expect))\n";
+    o_ << "#define LS_PROF_FENCE() _ReadWriteBarrier()\n";
+    o_ << "#else\n";
+    o_ << "#define LS_PROF_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)\n";
+    o_ << "#define LS_PROF_CAS32(p, expect, desired) __extension__({ uint32_t ls_prof_e = (expect); __atomic_compare_exchange_n((p), &ls_prof_e, (desired), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); })\n";
+    o_ << "#define LS_PROF_FENCE() __atomic_signal_fence(__ATOMIC_SEQ_CST)\n";
+    o_ << "#endif\n";
+    o_ << "typedef struct {\n";
+    o_ << "  const char *name;\n";
+    o_ << "  int32_t id;\n";
+    o_ << "  int32_t line;\n";
+    o_ << "} ls_prof_fn;\n";
+    o_ << "typedef struct ls_prof_thread ls_prof_thread;\n";
+    o_ << "typedef struct ls_prof_frame {\n";
+    o_ << "  const ls_prof_fn *fn;\n";
+    o_ << "  struct ls_prof_frame *parent;\n";
+    o_ << "  ls_prof_thread *thread;\n";
+    o_ << "  int64_t start_ns;\n";
+    o_ << "  volatile int32_t line;\n";
+    o_ << "  int32_t outer;\n";
+    o_ << "} ls_prof_frame;\n";
+    o_ << "// Per-thread shadow stack plus call counters. Samples read `top` from a signal handler on the same thread\n";
+    o_ << "// (POSIX) or from the sampler thread while this one is suspended (Windows); counters are summed at exit.\n";
+    o_ << "struct ls_prof_thread {\n";
+    o_ << "  ls_prof_frame *volatile top;\n";
+    o_ << "  uint32_t *active;\n";
+    o_ << "  int64_t *calls;\n";
+    o_ << "  int64_t *inclusive_ns;\n";
+    o_ << "#if defined(_WIN32)\n";
+    o_ << "  HANDLE handle;\n";
+    o_ << "  uint64_t cpu_time;\n";
+    o_ << "#endif\n";
+    o_ << "};\n";
+    int32_t id = 0;
+    for (const Fn &f : p_.f) {
+      if (!profiledFn(f)) continue;
+      o_ << "static const ls_prof_fn " << profFnVar(f) << " = {" << cStrLit(f.n) << ", " << id++ << ", "
+         << static_cast<unsigned long long>(f.s.line) << "};\n";
+    }
+    o_ << "#define LS_PROF_FN_COUNT " << id << "\n";
+    o_ << "static const ls_prof_fn *const ls_prof_fns[LS_PROF_FN_COUNT] = {";
+    bool first = true;
+    for (const Fn &f : p_.f) {
+      if (!profiledFn(f)) continue;
+      o_ << (first ? "" : ", ") << "&" << profFnVar(f);
+      first = false;
+    }
+    o_ << "};\n";
+    o_ << "#ifndef LS_PROFILE_DEFAULT_OUT\n";
+    o_ << "#define LS_PROFILE_DEFAULT_OUT " << cStrLit(profileOut_) << "\n";
+    o_ << "#endif\n";
+    o_ << "typedef struct {\n";
+    o_ << "  volatile uint32_t state;\n";
+    o_ << "  uint32_t depth;\n";
+    o_ << "  uint64_t hash;\n";
+    o_ << "  int64_t count;\n";
+    o_ << "  uint64_t frames[LS_PROF_MAX_DEPTH];\n";
+    o_ << "} ls_prof_stack;\n";
+    o_ << "static ls_prof_stack ls_prof_stacks[LS_PROF_MAX_STACKS];\n";
+    o_ << "static ls_prof_thread *volatile ls_prof_threads[LS_PROF_MAX_THREADS];\n";
+    o_ << "static int64_t ls_prof_thread_count = 0;\n";
+    o_ << "static int64_t ls_prof_samples = 0;\n";
+    o_ << "static int64_t ls_prof_dropped = 0;\n";
+    o_ << "static int64_t ls_prof_unattributed = 0;\n";
+    o_ << "static int64_t ls_prof_interval_us = 1000;\n";
+    o_ << "static volatile int ls_prof_running = 0;\n";
+    o_ << "static int ls_prof_timing = 0;\n";
+    o_ << "static LS_THREAD_LOCAL ls_prof_thread *ls_prof_tls;\n";
+    o_ << "static ls_prof_thread *ls_prof_thread_init(void) {\n";
+    o_ << "  ls_prof_thread *t = (ls_prof_thread *)calloc(1, sizeof(ls_prof_thread));\n";
+    o_ << "  if (!t) return NULL;\n";
+    o_ << "  t->active = (uint32_t *)calloc(LS_PROF_FN_COUNT, sizeof(uint32_t));\n";
+    o_ << "  t->calls = (int64_t *)calloc(LS_PROF_FN_COUNT, sizeof(int64_t));\n";
+    o_ << "  t->inclusive_ns = (int64_t *)calloc(LS_PROF_FN_COUNT, sizeof(int64_t));\n";
+    o_ << "  if (!t->active || !t->calls || !t->inclusive_ns) {\n";
+    o_ << "    free(t->active);\n";
+    o_ << "    free(t->calls);\n";
+    o_ << "    free(t->inclusive_ns);\n";
+    o_ << "    free(t);\n";
+    o_ << "    return NULL;\n";
+    o_ << "  }\n";
+    o_ << "#if defined(_WIN32)\n";
+    o_ << "  if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &t->handle,\n";
+    o_ << "                       THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION, FALSE, 0)) {\n";
+    o_ << "    t->handle = NULL;\n";
+    o_ << "  }\n";
+    o_ << "#endif\n";
+    o_ << "  // Thread records are never freed: the exit report and the Windows sampler may still read them.\n";
+    o_ << "  const int64_t slot = LS_PROF_ADD(&ls_prof_thread_count, 1);\n";
+    o_ << "  if (slot < LS_PROF_MAX_THREADS) ls_prof_threads[slot] = t;\n";
+    o_ << "  ls_prof_tls = t;\n";
+    o_ << "  return t;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_prof_enter(ls_prof_frame *f, const ls_prof_fn *fn) {\n";
+    o_ << "  ls_prof_thread *t = ls_prof_tls;\n";
+    o_ << "  if (!t) t = ls_prof_thread_init();\n";
+    o_ << "  f->fn = fn;\n";
+    o_ << "  f->line = fn->line;\n";
+    o_ << "  f->thread = t;\n";
+    o_ << "  if (!t) return;\n";
+    o_ << "  f->parent = t->top;\n";
+    o_ << "  ++t->calls[fn->id];\n";
+    o_ << "  f->outer = ++t->active[fn->id] == 1u;\n";
+    o_ << "  if (f->outer && ls_prof_timing) f->start_ns = ls_monotonic_ns();\n";
+    o_ << "  LS_PROF_FENCE();\n";
+    o_ << "  t->top = f;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_prof_leave(ls_prof_frame *f) {\n";
+    o_ << "  ls_prof_thread *t = f->thread;\n";
+    o_ << "  if (!t) return;\n";
+    o_ << "  // Only the outermost activation of a function adds time, so recursion is not counted twice.\n";
+    o_ << "  if (f->outer && ls_prof_timing) t->inclusive_ns[f->fn->id] += ls_monotonic_ns() - f->start_ns;\n";
+    o_ << "  --t->active[f->fn->id];\n";
+    o_ << "  t->top = f->parent;\n";
+    o_ << "}\n";
+    o_ << "// Adds one sample of the thread's current stack. Runs inside a signal handler, so it only touches\n";
+    o_ << "// preallocated memory; two threads racing for the same new stack may both insert it, which is harmless\n";
+    o_ << "// because collapsed-stack consumers merge identical lines.\n";
+    o_ << "static void ls_prof_sample(ls_prof_thread *t) {\n";
+    o_ << "  uint64_t key[LS_PROF_MAX_DEPTH];\n";
+    o_ << "  uint32_t depth = 0;\n";
+    o_ << "  uint32_t truncated = 0;\n";
+    o_ << "  uint64_t h = 1469598103934665603ULL;\n";
+    o_ << "  for (const ls_prof_frame *f = t ? t->top : NULL; f; f = f->parent) {\n";
+    o_ << "    if (depth == LS_PROF_MAX_DEPTH) {\n";
+    o_ << "      truncated = 0x80000000u;\n";
+    o_ << "      break;\n";
+    o_ << "    }\n";
+    o_ << "    key[depth] = ((uint64_t)(uint32_t)f->fn->id << 32) | (uint64_t)(uint32_t)f->line;\n";
+    o_ << "    h = (h ^ key[depth]) * 1099511628211ULL;\n";
+    o_ << "    ++depth;\n";
+    o_ << "  }\n";
+    o_ << "  LS_PROF_ADD(&ls_prof_samples, 1);\n";
+    o_ << "  if (depth == 0) {\n";
+    o_ << "    LS_PROF_ADD(&ls_prof_unattributed, 1);\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
+    o_ << "  depth |= truncated;\n";
+    o_ << "  h ^= depth;\n";
+    o_ << "  for (uint32_t probe = 0; probe < 64u; ++probe) {\n";
+    o_ << "    ls_prof_stack *s = &ls_prof_stacks[(h + probe) % LS_PROF_MAX_STACKS];\n";
+    o_ << "    uint32_t state = s->state;\n";
+    o_ << "    if (state == 0u && LS_PROF_CAS32(&s->state, 0u, 1u)) {\n";
+    o_ << "      s->hash = h;\n";
+    o_ << "      s->depth = depth;\n";
+    o_ << "      memcpy(s->frames, key, (size_t)(depth & 0x7fffffffu) * sizeof(uint64_t));\n";
+    o_ << "      s->count = 1;\n";
+    o_ << "      LS_PROF_FENCE();\n";
+    o_ << "      s->state = 2u;\n";
+    o_ << "      return;\n";
+    o_ << "    }\n";
+    o_ << "    state = s->state;\n";
+    o_ << "    if (state == 2u && s->hash == h && s->depth == depth &&\n";
+    o_ << "        memcmp(s->frames, key, (size_t)(depth & 0x7fffffffu) * sizeof(uint64_t)) == 0) {\n";
+    o_ << "      LS_PROF_ADD(&s->count, 1);\n";
+    o_ << "      return;\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "  LS_PROF_ADD(&ls_prof_dropped, 1);\n";
+    o_ << "}\n";
+    o_ << "static int64_t ls_prof_env_i64(const char *name, int64_t fallback) {\n";
+    o_ << "  const char *v = getenv(name);\n";
+    o_ << "  if (!v || !*v) return fallback;\n";
+    o_ << "  char *end = NULL;\n";
+    o_ << "  const long long x = strtoll(v, &end, 10);\n";
+    o_ << "  return (end && *end == '\\0' && x >= 0) ? (int64_t)x : fallback;\n";
+    o_ << "}\n";
+    o_ << "#if defined(_WIN32)\n";
+    o_ << "static HANDLE ls_prof_sampler;\n";
+    o_ << "// Windows has no per-thread CPU timer signal, so a sampler thread suspends each thread that used CPU\n";
+    o_ << "// since the last tick and reads its shadow stack.\n";
+    o_ << "static DWORD WINAPI ls_prof_sampler_main(LPVOID arg) {\n";
+    o_ << "  (void)arg;\n";
+    o_ << "#if defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0600\n";
+    o_ << "  // High-resolution waitable timers (Windows 10 1803+) tick below the 15.6 ms scheduler quantum.\n";
+    o_ << "  HANDLE timer = CreateWaitableTimerExW(NULL, NULL, 0x00000002, TIMER_ALL_ACCESS);\n";
+    o_ << "  if (!timer) timer = CreateWaitableTimerW(NULL, FALSE, NULL);\n";
+    o_ << "#else\n";
+    o_ << "  HANDLE timer = CreateWaitableTimerW(NULL, FALSE, NULL);\n";
+    o_ << "#endif\n";
+    o_ << "  LARGE_INTEGER due;\n";
+    o_ << "  due.QuadPart = -(LONGLONG)ls_prof_interval_us * 10;\n";
+    o_ << "  while (ls_prof_running) {\n";
+    o_ << "    if (timer && SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE)) {\n";
+    o_ << "      WaitForSingleObject(timer, INFINITE);\n";
+    o_ << "    } else {\n";
+    o_ << "      Sleep((DWORD)(ls_prof_interval_us / 1000 > 0 ? ls_prof_interval_us / 1000 : 1));\n";
+    o_ << "    }\n";
+    o_ << "    int64_t n = ls_prof_thread_count;\n";
+    o_ << "    if (n > LS_PROF_MAX_THREADS) n = LS_PROF_MAX_THREADS;\n";
+    o_ << "    for (int64_t i = 0; i < n && ls_prof_running; ++i) {\n";
+    o_ << "      ls_prof_thread *t = ls_prof_threads[i];\n";
+    o_ << "      if (!t || !t->handle) continue;\n";
+    o_ << "      FILETIME created, exited, kernel, user;\n";
+    o_ << "      if (!GetThreadTimes(t->handle, &created, &exited, &kernel, &user)) continue;\n";
+    o_ << "      const uint64_t cpu = (((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +\n";
+    o_ << "                           (((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime);\n";
+    o_ << "      if (cpu == t->cpu_time) continue;\n";
+    o_ << "      t->cpu_time = cpu;\n";
+    o_ << "      if (SuspendThread(t->handle) == (DWORD)-1) continue;\n";
+    o_ << "      CONTEXT ctx;\n";
+    o_ << "      ctx.ContextFlags = CONTEXT_CONTROL;\n";
+    o_ << "      (void)GetThreadContext(t->handle, &ctx);\n";
+    o_ << "      ls_prof_sample(t);\n";
+    o_ << "      ResumeThread(t->handle);\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "  if (timer) CloseHandle(timer);\n";
+    o_ << "  return 0;\n";
+    o_ << "}\n";
+    o_ << "#else\n";
+    o_ << "static void ls_prof_on_signal(int sig) {\n";
+    o_ << "  (void)sig;\n";
+    o_ << "  const int saved = errno;\n";
+    o_ << "  if (ls_prof_running) ls_prof_sample(ls_prof_tls);\n";
+    o_ << "  errno = saved;\n";
+    o_ << "}\n";
+    o_ << "#endif\n";
+    o_ << "static void ls_prof_write_frames(FILE *f, const ls_prof_stack *s) {\n";
+    o_ << "  const uint32_t depth = s->depth & 0x7fffffffu;\n";
+    o_ << "  if (s->depth & 0x80000000u) fputs(\"[truncated];\", f);\n";
+    o_ << "  for (uint32_t i = depth; i-- > 0;) {\n";
+    o_ << "    const uint32_t id = (uint32_t)(s->frames[i] >> 32);\n";
+    o_ << "    const uint32_t line = (uint32_t)s->frames[i];\n";
+    o_ << "    fprintf(f, \"%s:%u%s\", id < LS_PROF_FN_COUNT ? ls_prof_fns[id]->name : \"?\", line, i ? \";\" : \"\");\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "// Writes the collapsed stacks (one `outer:line;...;inner:line count` line per distinct stack, for\n";
+    o_ << "// flamegraph.pl/inferno/speedscope) to $LS_PROFILE_OUT, and per-function totals next to it with a\n";
+    o_ << "// `.functions` suffix; `lsc --profile-use` reads the latter.\n";
+    o_ << "static void ls_prof_finish(void) {\n";
+    o_ << "  if (!ls_prof_running) return;\n";
+    o_ << "  ls_prof_running = 0;\n";
+    o_ << "#if defined(_WIN32)\n";
+    o_ << "  if (ls_prof_sampler) {\n";
+    o_ << "    WaitForSingleObject(ls_prof_sampler, 1000);\n";
+    o_ << "    CloseHandle(ls_prof_sampler);\n";
+    o_ << "    ls_prof_sampler = NULL;\n";
+    o_ << "  }\n";
+    o_ << "#else\n";
+    o_ << "  struct itimerval off;\n";
+    o_ << "  memset(&off, 0, sizeof off);\n";
+    o_ << "  setitimer(ITIMER_PROF, &off, NULL);\n";
+    o_ << "  signal(SIGPROF, SIG_IGN);\n";
+    o_ << "#endif\n";
+    o_ << "  ls_out_flush();\n";
+    o_ << "  const char *path = getenv(\"LS_PROFILE_OUT\");\n";
+    o_ << "  if (!path || !*path) path = LS_PROFILE_DEFAULT_OUT;\n";
+    o_ << "  FILE *f = fopen(path, \"w\");\n";
+    o_ << "  if (!f) {\n";
+    o_ << "    fprintf(stderr, \"profile: cannot write %s\\n\", path);\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
+    o_ << "  int64_t *self = (int64_t *)calloc(LS_PROF_FN_COUNT, sizeof(int64_t));\n";
+    o_ << "  int64_t *total = (int64_t *)calloc(LS_PROF_FN_COUNT, sizeof(int64_t));\n";
+    o_ << "  int64_t *seen = (int64_t *)calloc(LS_PROF_FN_COUNT, sizeof(int64_t));\n";
+    o_ << "  for (int64_t i = 0; i < LS_PROF_MAX_STACKS; ++i) {\n";
+    o_ << "    const ls_prof_stack *s = &ls_prof_stacks[i];\n";
+    o_ << "    if (s->state != 2u) continue;\n";
+    o_ << "    ls_prof_write_frames(f, s);\n";
+    o_ << "    fprintf(f, \" %lld\\n\", (long long)s->count);\n";
+    o_ << "    if (!self || !total || !seen) continue;\n";
+    o_ << "    const uint32_t depth = s->depth & 0x7fffffffu;\n";
+    o_ << "    for (uint32_t d = 0; d < depth; ++d) {\n";
+    o_ << "      const uint32_t id = (uint32_t)(s->frames[d] >> 32);\n";
+    o_ << "      if (id >= LS_PROF_FN_COUNT) continue;\n";
+    o_ << "      if (d == 0) self[id] += s->count;\n";
+    o_ << "      // A recursive stack counts once per function toward its total.\n";
+    o_ << "      if (seen[id] != i + 1) {\n";
+    o_ << "        seen[id] = i + 1;\n";
+    o_ << "        total[id] += s->count;\n";
+    o_ << "      }\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "  if (ls_prof_unattributed > 0) fprintf(f, \"[unattributed] %lld\\n\", (long long)ls_prof_unattributed);\n";
+    o_ << "  fclose(f);\n";
+    o_ << "  const size_t n = strlen(path);\n";
+    o_ << "  char *fnPath = (char *)malloc(n + sizeof(\".functions\"));\n";
+    o_ << "  if (fnPath) {\n";
+    o_ << "    memcpy(fnPath, path, n);\n";
+    o_ << "    memcpy(fnPath + n, \".functions\", sizeof(\".functions\"));\n";
+    o_ << "    f = fopen(fnPath, \"w\");\n";
+    o_ << "    if (f) {\n";
+    o_ << "      fprintf(f, \"# linescript-profile-v1 samples=%lld interval_us=%lld dropped=%lld unattributed=%lld\\n\",\n";
+    o_ << "              (long long)ls_prof_samples, (long long)ls_prof_interval_us, (long long)ls_prof_dropped,\n";
+    o_ << "              (long long)ls_prof_unattributed);\n";
+    o_ << "      fputs(\"function\\tline\\tcalls\\tinclusive_ns\\tself_samples\\ttotal_samples\\n\", f);\n";
+    o_ << "      int64_t threads = ls_prof_thread_count;\n";
+    o_ << "      if (threads > LS_PROF_MAX_THREADS) threads = LS_PROF_MAX_THREADS;\n";
+    o_ << "      for (int64_t id = 0; id < LS_PROF_FN_COUNT; ++id) {\n";
+    o_ << "        int64_t calls = 0, ns = 0;\n";
+    o_ << "        for (int64_t k = 0; k < threads; ++k) {\n";
+    o_ << "          const ls_prof_thread *t = ls_prof_threads[k];\n";
+    o_ << "          if (!t) continue;\n";
+    o_ << "          calls += t->calls[id];\n";
+    o_ << "          ns += t->inclusive_ns[id];\n";
+    o_ << "        }\n";
+    o_ << "        fprintf(f, \"%s\\t%d\\t%lld\\t%lld\\t%lld\\t%lld\\n\", ls_prof_fns[id]->name, (int)ls_prof_fns[id]->line,\n";
+    o_ << "                (long long)calls, (long long)(ls_prof_timing ? ns : -1), (long long)(self ? self[id] : 0),\n";
+    o_ << "                (long long)(total ? total[id] : 0));\n";
+    o_ << "      }\n";
+    o_ << "      fclose(f);\n";
+    o_ << "    }\n";
+    o_ << "    free(fnPath);\n";
+    o_ << "  }\n";
+    o_ << "  free(self);\n";
+    o_ << "  free(total);\n";
+    o_ << "  free(seen);\n";
+    o_ << "}\n";
+    o_ << "// LS_PROFILE_HZ sets the sampling rate (default 997, so sampling does not line up with periodic work);\n";
+    o_ << "// LS_PROFILE_TIMING=1 adds inclusive time per function, at the cost of two clock reads per outermost call.\n";
+    o_ << "static void ls_prof_start(void) {\n";
+    o_ << "  const int64_t hz = ls_prof_env_i64(\"LS_PROFILE_HZ\", 997);\n";
+    o_ << "  ls_prof_interval_us = hz > 0 ? (1000000 / hz > 0 ? 1000000 / hz : 1) : 1000;\n";
+    o_ << "  ls_prof_timing = ls_prof_env_i64(\"LS_PROFILE_TIMING\", 0) != 0;\n";
+    o_ << "  (void)ls_prof_thread_init();\n";
+    o_ << "  ls_prof_running = 1;\n";
+    o_ << "  atexit(ls_prof_finish);\n";
+    o_ << "#if defined(_WIN32)\n";
+    o_ << "  ls_prof_sampler = CreateThread(NULL, 0, ls_prof_sampler_main, NULL, 0, NULL);\n";
+    o_ << "#else\n";
+    o_ << "  struct sigaction sa;\n";
+    o_ << "  memset(&sa, 0, sizeof sa);\n";
+    o_ << "  sa.sa_handler = ls_prof_on_signal;\n";
+    o_ << "  sa.sa_flags = SA_RESTART;\n";
+    o_ << "  sigemptyset(&sa.sa_mask);\n";
+    o_ << "  sigaction(SIGPROF, &sa, NULL);\n";
+    o_ << "  struct itimerval every;\n";
+    o_ << "  every.it_interval.tv_sec = (time_t)(ls_prof_interval_us / 1000000);\n";
+    o_ << "  every.it_interval.tv_usec = (suseconds_t)(ls_prof_interval_us % 1000000);\n";
+    o_ << "  every.it_value = every.it_interval;\n";
+    o_ << "  setitimer(ITIMER_PROF, &every, NULL);\n";
+    o_ << "#endif\n";
+    o_ << "}\n";
+    o_ << "\n";
+  }
+  // bench blocks and black_box(). Iteration counts, sample counts and the JSON sink come from the
+  // environment (LS_BENCH_TIME_MS, LS_BENCH_WARMUP_MS, LS_BENCH_SAMPLES, LS_BENCH_COUNTERS, LS_BENCH_JSON),
+  // which `lsc --bench` sets for the program it runs.
+  void emitBenchRuntime() {
+    o_ << "#ifndef LS_BENCH_MAX_SAMPLES\n";
+    o_ << "#define LS_BENCH_MAX_SAMPLES 1000\n";
+    o_ << "#endif\n";
+    o_ << "#ifndef LS_BENCH_MAX_DEPTH\n";
+    o_ << "#define LS_BENCH_MAX_DEPTH 16\n";
+    o_ << "#endif\n";
+    o_ << "#if defined(__GNUC__) || defined(__clang__)\n";
+    o_ << "#define LS_BLACK_BOX_ESCAPE(p) __asm__ __volatile__(\"\" : : \"r\"(p) : \"memory\")\n";
+    o_ << "#else\n";
+    o_ << "static void *volatile ls_black_box_sink;\n";
+    o_ << "#define LS_BLACK_BOX_ESCAPE(p) (ls_black_box_sink = (void *)(p))\n";
+    o_ << "#endif\n";
+    o_ << "static inline int64_t ls_black_box_i64(int64_t v) { LS_BLACK_BOX_ESCAPE(&v); return v; }\n";
+    o_ << "static inline int32_t ls_black_box_i32(int32_t v) { LS_BLACK_BOX_ESCAPE(&v); return v; }\n";
+    o_ << "static inline double ls_black_box_f64(double v) { LS_BLACK_BOX_ESCAPE(&v); return v; }\n";
+    o_ << "static inline float ls_black_box_f32(float v) { LS_BLACK_BOX_ESCAPE(&v); return v; }\n";
+    o_ << "static inline ls_bool ls_black_box_bool(ls_bool v) { LS_BLACK_BOX_ESCAPE(&v); return v; }\n";
+    o_ << "static inline const char *ls_black_box_str(const char *v) { LS_BLACK_BOX_ESCAPE(&v); return v; }\n";
+    o_ << "typedef struct {\n";
+    o_ << "  char *name;\n";
+    o_ << "  int64_t batch;\n";
+    o_ << "  int64_t left;\n";
+    o_ << "  int64_t start_ns;\n";
+    o_ << "  int64_t warmup_ns;\n";
+    o_ << "  int64_t time_ns;\n";
+    o_ << "  int64_t warm_ns;\n";
+    o_ << "  int64_t warm_iters;\n";
+    o_ << "  int64_t spent_ns;\n";
+    o_ << "  int64_t samples;\n";
+    o_ << "  int64_t target_samples;\n";
+    o_ << "  int64_t iterations;\n";
+    o_ << "  ls_bool warming;\n";
+    o_ << "  ls_bool running;\n";
+    o_ << "  ls_bool done;\n";
+    o_ << "  int perf_fd;\n";
+    o_ << "  int perf_member_fd;\n";
+    o_ << "  int64_t perf_samples;\n";
+    o_ << "  uint64_t perf_start[2];\n";
+    o_ << "  double ns[LS_BENCH_MAX_SAMPLES];\n";
+    o_ << "  double cycles[LS_BENCH_MAX_SAMPLES];\n";
+    o_ << "  double instructions[LS_BENCH_MAX_SAMPLES];\n";
+    o_ << "} ls_bench;\n";
+    o_ << "static LS_THREAD_LOCAL ls_bench *ls_bench_stack[LS_BENCH_MAX_DEPTH];\n";
+    o_ << "static LS_THREAD_LOCAL int64_t ls_bench_depth = 0;\n";
+    o_ << "static int64_t ls_bench_env_i64(const char *name, int64_t fallback) {\n";
+    o_ << "  const char *v = getenv(name);\n";
+    o_ << "  if (!v || !*v) return fallback;\n";
+    o_ << "  char *end = NULL;\n";
+    o_ << "  const long long x = strtoll(v, &end, 10);\n";
+    o_ << "  return (end && *end == '\\0' && x >= 0) ? (int64_t)x : fallback;\n";
+    o_ << "}\n";
+    o_ << "#if defined(LS_BENCH_PERF)\n";
+    o_ << "static int ls_bench_perf_event(uint64_t config, int group) {\n";
+    o_ << "  struct perf_event_attr attr;\n";
+    o_ << "  memset(&attr, 0, sizeof attr);\n";
+    o_ << "  attr.type = PERF_TYPE_HARDWARE;\n";
+    o_ << "  attr.size = sizeof attr;\n";
+    o_ << "  attr.config = config;\n";
+    o_ << "  attr.disabled = group < 0 ? 1 : 0;\n";
+    o_ << "  attr.exclude_kernel = 1;\n";
+    o_ << "  attr.exclude_hv = 1;\n";
+    o_ << "  attr.read_format = PERF_FORMAT_GROUP;\n";
+    o_ << "  return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);\n";
+    o_ << "}\n";
+    o_ << "#endif\n";
+    o_ << "// Cycles and instructions for the calling thread, as one counter group; -1 when the kernel refuses.\n";
+    o_ << "static int ls_bench_perf_open(int *member) {\n";
+    o_ << "#if defined(LS_BENCH_PERF)\n";
+    o_ << "  *member = -1;\n";
+    o_ << "  if (ls_bench_env_i64(\"LS_BENCH_COUNTERS\", 1) == 0) return -1;\n";
+    o_ << "  const int leader = ls_bench_perf_event(PERF_COUNT_HW_CPU_CYCLES, -1);\n";
+    o_ << "  if (leader < 0) return -1;\n";
+    o_ << "  const int ins = ls_bench_perf_event(PERF_COUNT_HW_INSTRUCTIONS, leader);\n";
+    o_ << "  if (ins < 0) {\n";
+    o_ << "    close(leader);\n";
+    o_ << "    return -1;\n";
+    o_ << "  }\n";
+    o_ << "  *member = ins;\n";
+    o_ << "  ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);\n";
+    o_ << "  ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);\n";
+    o_ << "  return leader;\n";
+    o_ << "#else\n";
+    o_ << "  *member = -1;\n";
+    o_ << "  return -1;\n";
+    o_ << "#endif\n";
+    o_ << "}\n";
+    o_ << "static ls_bool ls_bench_perf_read(int fd, uint64_t out[2]) {\n";
+    o_ << "#if defined(LS_BENCH_PERF)\n";
+    o_ << "  uint64_t buf[3];\n";
+    o_ << "  if (fd < 0 || read(fd, buf, sizeof buf) != (ssize_t)sizeof buf || buf[0] != 2) return 0;\n";
+    o_ << "  out[0] = buf[1];\n";
+    o_ << "  out[1] = buf[2];\n";
+    o_ << "  return 1;\n";
+    o_ << "#else\n";
+    o_ << "  (void)fd;\n";
+    o_ << "  (void)out;\n";
+    o_ << "  return 0;\n";
+    o_ << "#endif\n";
+    o_ << "}\n";
+    o_ << "static void ls_bench_perf_close(int fd, int member) {\n";
+    o_ << "#if defined(LS_BENCH_PERF)\n";
+    o_ << "  if (member >= 0) close(member);\n";
+    o_ << "  if (fd >= 0) close(fd);\n";
+    o_ << "#else\n";
+    o_ << "  (void)fd;\n";
+    o_ << "  (void)member;\n";
+    o_ << "#endif\n";
+    o_ << "}\n";
+    o_ << "static int64_t __ls_bench_begin(const char *name) {\n";
+    o_ << "  if (ls_bench_depth >= LS_BENCH_MAX_DEPTH) return -1;\n";
+    o_ << "  ls_bench *b = (ls_bench *)calloc(1, sizeof(ls_bench));\n";
+    o_ << "  if (!b) return -1;\n";
+    o_ << "  const size_t n = name ? strlen(name) : 0u;\n";
+    o_ << "  b->name = (char *)malloc(n + 1u);\n";
+    o_ << "  if (!b->name) {\n";
+    o_ << "    free(b);\n";
+    o_ << "    return -1;\n";
+    o_ << "  }\n";
+    o_ << "  if (n) memcpy(b->name, name, n);\n";
+    o_ << "  b->name[n] = '\\0';\n";
+    o_ << "  b->warmup_ns = ls_bench_env_i64(\"LS_BENCH_WARMUP_MS\", 100) * 1000000LL;\n";
+    o_ << "  b->time_ns = ls_bench_env_i64(\"LS_BENCH_TIME_MS\", 1000) * 1000000LL;\n";
+    o_ << "  b->target_samples = ls_bench_env_i64(\"LS_BENCH_SAMPLES\", 50);\n";
+    o_ << "  if (b->target_samples < 1) b->target_samples = 1;\n";
+    o_ << "  if (b->target_samples > LS_BENCH_MAX_SAMPLES) b->target_samples = LS_BENCH_MAX_SAMPLES;\n";
+    o_ << "  b->batch = 1;\n";
+    o_ << "  b->warming = 1;\n";
+    o_ << "  b->perf_fd = ls_bench_perf_open(&b->perf_member_fd);\n";
+    o_ << "  ls_bench_stack[ls_bench_depth] = b;\n";
+    o_ << "  return ls_bench_depth++;\n";
+    o_ << "}\n";
+    o_ << "static void ls_bench_record(ls_bench *b, int64_t elapsed, int64_t iters) {\n";
+    o_ << "  if (b->warming) {\n";
+    o_ << "    // Warmup doubles the batch until the warmup time is spent, then sizes batches so that the samples\n";
+    o_ << "    // together take about LS_BENCH_TIME_MS.\n";
+    o_ << "    b->warm_ns += elapsed;\n";
+    o_ << "    b->warm_iters += iters;\n";
+    o_ << "    if (b->warm_ns < b->warmup_ns) {\n";
+    o_ << "      if (b->batch < ((int64_t)1 << 40)) b->batch *= 2;\n";
+    o_ << "      return;\n";
+    o_ << "    }\n";
+    o_ << "    const double perIter = elapsed > 0 ? (double)elapsed / (double)iters : 1.0;\n";
+    o_ << "    const double want = (double)b->time_ns / (double)b->target_samples / perIter;\n";
+    o_ << "    b->batch = want < 1.0 ? 1 : (want > (double)((int64_t)1 << 40) ? ((int64_t)1 << 40) : (int64_t)want);\n";
+    o_ << "    b->warming = 0;\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
+    o_ << "  uint64_t now[2];\n";
+    o_ << "  if (ls_bench_perf_read(b->perf_fd, now)) {\n";
+    o_ << "    b->cycles[b->samples] = (double)(now[0] - b->perf_start[0]) / (double)iters;\n";
+    o_ << "    b->instructions[b->samples] = (double)(now[1] - b->perf_start[1]) / (double)iters;\n";
+    o_ << "    ++b->perf_samples;\n";
+    o_ << "  }\n";
+    o_ << "  b->ns[b->samples++] = (double)elapsed / (double)iters;\n";
+    o_ << "  b->iterations += iters;\n";
+    o_ << "  b->spent_ns += elapsed;\n";
+    o_ << "  if (b->samples >= b->target_samples || (b->time_ns > 0 && b->spent_ns >= 2 * b->time_ns)) b->done = 1;\n";
+    o_ << "}\n";
+    o_ << "static ls_bool ls_bench_batch(ls_bench *b) {\n";
+    o_ << "  if (b->done) return 0;\n";
+    o_ << "  if (b->running) {\n";
+    o_ << "    ls_bench_record(b, ls_monotonic_ns() - b->start_ns, b->batch);\n";
+    o_ << "    if (b->done) return 0;\n";
+    o_ << "  }\n";
+    o_ << "  b->running = 1;\n";
+    o_ << "  b->left = b->batch - 1;\n";
+    o_ << "  if (!b->warming) (void)ls_bench_perf_read(b->perf_fd, b->perf_start);\n";
+    o_ << "  b->start_ns = ls_monotonic_ns();\n";
+    o_ << "  return 1;\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool __ls_bench_next(int64_t id) {\n";
+    o_ << "  if (id < 0 || id >= ls_bench_depth) return 0;\n";
+    o_ << "  ls_bench *b = ls_bench_stack[id];\n";
+    o_ << "  if (b->left > 0) {\n";
+    o_ << "    --b->left;\n";
+    o_ << "    return 1;\n";
+    o_ << "  }\n";
+    o_ << "  return ls_bench_batch(b);\n";
+    o_ << "}\n";
+    o_ << "static int ls_bench_cmp_f64(const void *a, const void *b) {\n";
+    o_ << "  const double x = *(const double *)a;\n";
+    o_ << "  const double y = *(const double *)b;\n";
+    o_ << "  return x < y ? -1 : (x > y ? 1 : 0);\n";
+    o_ << "}\n";
+    o_ << "static double ls_bench_median(double *v, int64_t n) {\n";
+    o_ << "  if (n <= 0) return 0.0;\n";
+    o_ << "  qsort(v, (size_t)n, sizeof(double), ls_bench_cmp_f64);\n";
+    o_ << "  return (n & 1) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) * 0.5;\n";
+    o_ << "}\n";
+    o_ << "static void ls_bench_fmt_ns(char *out, size_t cap, double ns) {\n";
+    o_ << "  if (ns < 1e3) snprintf(out, cap, \"%.2f ns\", ns);\n";
+    o_ << "  else if (ns < 1e6) snprintf(out, cap, \"%.2f us\", ns / 1e3);\n";
+    o_ << "  else if (ns < 1e9) snprintf(out, cap, \"%.2f ms\", ns / 1e6);\n";
+    o_ << "  else snprintf(out, cap, \"%.2f s\", ns / 1e9);\n";
+    o_ << "}\n";
+    o_ << "static void ls_bench_json_str(FILE *f, const char *s) {\n";
+    o_ << "  fputc('\"', f);\n";
+    o_ << "  for (; *s; ++s) {\n";
+    o_ << "    const unsigned char c = (unsigned char)*s;\n";
+    o_ << "    if (c == '\"' || c == '\\\\') fprintf(f, \"\\\\%c\", c);\n";
+    o_ << "    else if (c < 0x20) fprintf(f, \"\\\\u%04x\", c);\n";
+    o_ << "    else fputc(c, f);\n";
+    o_ << "  }\n";
+    o_ << "  fputc('\"', f);\n";
+    o_ << "}\n";
+    o_ << "// One result per bench: a JSON line appended to $LS_BENCH_JSON when set, otherwise a summary on stderr.\n";
+    o_ << "static void ls_bench_report(ls_bench *b) {\n";
+    o_ << "  const int64_t n = b->samples;\n";
+    o_ << "  double mean = 0.0, var = 0.0, lo = 0.0, hi = 0.0;\n";
+    o_ << "  for (int64_t i = 0; i < n; ++i) mean += b->ns[i];\n";
+    o_ << "  if (n > 0) mean /= (double)n;\n";
+    o_ << "  for (int64_t i = 0; i < n; ++i) var += (b->ns[i] - mean) * (b->ns[i] - mean);\n";
+    o_ << "  const double stddev = n > 1 ? sqrt(var / (double)(n - 1)) : 0.0;\n";
+    o_ << "  const double median = ls_bench_median(b->ns, n);\n";
+    o_ << "  if (n > 0) {\n";
+    o_ << "    lo = b->ns[0];\n";
+    o_ << "    hi = b->ns[n - 1];\n";
+    o_ << "  }\n";
+    o_ << "  const double p99 = n > 0 ? b->ns[(99 * n + 99) / 100 - 1] : 0.0;\n";
+    o_ << "  const ls_bool counters = n > 0 && b->perf_samples == n;\n";
+    o_ << "  const double cycles = counters ? ls_bench_median(b->cycles, n) : 0.0;\n";
+    o_ << "  const double instructions = counters ? ls_bench_median(b->instructions, n) : 0.0;\n";
+    o_ << "  const char *path = getenv(\"LS_BENCH_JSON\");\n";
+    o_ << "  if (path && *path) {\n";
+    o_ << "    FILE *f = fopen(path, \"a\");\n";
+    o_ << "    if (!f) return;\n";
+    o_ << "    fputs(\"{\\\"name\\\":\", f);\n";
+    o_ << "    ls_bench_json_str(f, b->name);\n";
+    o_ << "    fprintf(f, \",\\\"samples\\\":%lld,\\\"iterations_per_sample\\\":%lld,\\\"iterations\\\":%lld,\\\"warmup_iterations\\\":%lld\",\n";
+    o_ << "            (long long)n, (long long)b->batch, (long long)b->iterations, (long long)b->warm_iters);\n";
+    o_ << "    fprintf(f, \",\\\"median_ns\\\":%.3f,\\\"p99_ns\\\":%.3f,\\\"mean_ns\\\":%.3f,\\\"stddev_ns\\\":%.3f,\\\"min_ns\\\":%.3f,\\\"max_ns\\\":%.3f\",\n";
+    o_ << "            median, p99, mean, stddev, lo, hi);\n";
+    o_ << "    if (counters) fprintf(f, \",\\\"cycles\\\":%.3f,\\\"instructions\\\":%.3f}\\n\", cycles, instructions);\n";
+    o_ << "    else fputs(\",\\\"cycles\\\":null,\\\"instructions\\\":null}\\n\", f);\n";
+    o_ << "    fclose(f);\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
+    o_ << "  char m[32], p[32], sd[32];\n";
+    o_ << "  ls_bench_fmt_ns(m, sizeof m, median);\n";
+    o_ << "  ls_bench_fmt_ns(p, sizeof p, p99);\n";
+    o_ << "  ls_bench_fmt_ns(sd, sizeof sd, stddev);\n";
+    o_ << "  ls_out_flush();\n";
+    o_ << "  fprintf(stderr, \"bench %s: median %s, p99 %s, stddev %s (%lld samples x %lld iterations)\", b->name, m, p, sd,\n";
+    o_ << "          (long long)n, (long long)b->batch);\n";
+    o_ << "  if (counters) fprintf(stderr, \", %.1f cycles, %.1f instructions\", cycles, instructions);\n";
+    o_ << "  fputc('\\n', stderr);\n";
+    o_ << "}\n";
+    o_ << "static void __ls_bench_end(int64_t id) {\n";
+    o_ << "  if (id < 0 || id >= ls_bench_depth) return;\n";
+    o_ << "  ls_bench *b = ls_bench_stack[id];\n";
+    o_ << "  // A `break` leaves mid-batch; keep the iterations that ran (the breaking one included) as a final\n";
+    o_ << "  // sample, even when it came during warmup, so an early exit still reports a time.\n";
+    o_ << "  if (b->running && !b->done && b->batch - b->left > 0) {\n";
+    o_ << "    const int64_t elapsed = ls_monotonic_ns() - b->start_ns;\n";
+    o_ << "    const int64_t iters = b->batch - b->left;\n";
+    o_ << "    if (!b->warming) {\n";
+    o_ << "      ls_bench_record(b, elapsed, iters);\n";
+    o_ << "    } else if (b->samples == 0) {\n";
+    o_ << "      b->ns[b->samples++] = (double)elapsed / (double)iters;\n";
+    o_ << "      b->iterations += iters;\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "  ls_bench_report(b);\n";
+    o_ << "  ls_bench_perf_close(b->perf_fd, b->perf_member_fd);\n";
+    o_ << "  free(b->name);\n";
+    o_ << "  free(b);\n";
+    o_ << "  ls_bench_depth = id;\n";
+    o_ << "}\n";
+    o_ << "\n";
+  }
+  // 64-bit atomics and the yielding spin lock. Emitted ahead of the file, HTTP and task runtimes, which all
+  // guard their shared tables with ls_task_spin_lock.
+  void emitAtomicRuntime() {
+    o_ << "#if defined(_MSC_VER) && !defined(__clang__)\n";
+    o_ << "#define LS_ATOMIC_LOAD(p) InterlockedCompareExchange64((volatile LONG64 *)(p), 0, 0)\n";
+    o_ << "#define LS_ATOMIC_STORE(p, v) ((void)InterlockedExchange64((volatile LONG64 *)(p), (LONG64)(v)))\n";
+    o_ << "#define LS_ATOMIC_CAS(p, expect, desired) (InterlockedCompareExchange64((volatile LONG64 *)(p), (LONG64)(desired), (LONG64)(expect)) == (LONG64)(expect))\n";
+    o_ << "#define LS_ATOMIC_ADD(p, v) ((int64_t)InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(v)))\n";
+    o_ << "#define LS_ATOMIC_FENCE() MemoryBarrier()\n";
+    o_ << "#else\n";
+    o_ << "#define LS_ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)\n";
+    o_ << "#define LS_ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)\n";
+    o_ << "#define LS_ATOMIC_CAS(p, expect, desired) __extension__({ int64_t ls_cas_e = (expect); __atomic_compare_exchange_n((p), &ls_cas_e, (desired), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); })\n";
+    o_ << "#define LS_ATOMIC_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)\n";
+    o_ << "#define LS_ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)\n";
+    o_ << "#endif\n";
+    o_ << "static inline void ls_task_cpu_yield(void) {\n";
+    o_ << "#if defined(_WIN32)\n";
+    o_ << "  (void)SwitchToThread();\n";
+    o_ << "#else\n";
+    o_ << "  (void)sched_yield();\n";
+    o_ << "#endif\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_task_spin_lock(volatile int64_t *lock) {\n";
+    o_ << "  while (!LS_ATOMIC_CAS(lock, 0, 1)) ls_task_cpu_yield();\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_task_spin_unlock(volatile int64_t *lock) { LS_ATOMIC_STORE(lock, 0); }\n";
+  }
+
+  // f32x4 / f32x8 / f64x4 / i64x4 values. GCC and Clang get native vector-extension types, which lower to
+  // whatever SSE/AVX/NEON the target enables; other compilers get a struct of lanes. Each helper is written
+  // once over the LS_V* macros so both forms share every definition. Horizontal reductions and lane
+  // compares walk lanes in index order in both forms, so results do not depend on the compiler.
+  void emitSimdRuntime() {
+    o_ << "#if (defined(__GNUC__) || defined(__clang__)) && !defined(LS_SIMD_SCALAR)\n";
+    o_ << "#define LS_SIMD_NATIVE 1\n";
+    o_ << "#if defined(__GNUC__) && !defined(__clang__)\n";
+    o_ << "#pragma GCC diagnostic ignored \"-Wpsabi\"\n";
+    o_ << "#endif\n";
+    o_ << "typedef float ls_f32x4 __attribute__((vector_size(16)));\n";
+    o_ << "typedef float ls_f32x8 __attribute__((vector_size(32)));\n";
+    o_ << "typedef double ls_f64x4 __attribute__((vector_size(32)));\n";
+    o_ << "typedef int64_t ls_i64x4 __attribute__((vector_size(32)));\n";
+    o_ << "typedef int32_t ls_b_f32x4 __attribute__((vector_size(16)));\n";
+    o_ << "typedef int32_t ls_b_f32x8 __attribute__((vector_size(32)));\n";
+    o_ << "typedef int64_t ls_b_f64x4 __attribute__((vector_size(32)));\n";
+    o_ << "typedef int64_t ls_b_i64x4 __attribute__((vector_size(32)));\n";
+    o_ << "#define LS_LANE(x, i) ((x)[i])\n";
+    o_ << "#define LS_VOP(r, a, op, b, n) ((r) = (a) op (b))\n";
+    o_ << "#define LS_VNEG(r, a, n) ((r) = -(a))\n";
+    o_ << "// Lane mask from a bitmask: lane k is all ones when bit k is set.\n";
+    o_ << "#define LS_VBLEND(T, B, r, m, a, b, ...) do { const B ls_bit_ = {__VA_ARGS__}; "
+          "const B ls_sel_ = (((B){0} + (int)((m) & 255)) & ls_bit_) != 0; "
+          "(r) = (T)(((B)(a) & ls_sel_) | ((B)(b) & ~ls_sel_)); } while (0)\n";
+    o_ << "#define LS_VCMP(B, out, a, op, b, n) do { const B ls_m_ = (B)((a) op (b)); "
+          "for (int ls_k = 0; ls_k < (n); ++ls_k) (out) |= (int64_t)(ls_m_[ls_k] & 1) << ls_k; } while (0)\n";
+    o_ << "#else\n";
+    o_ << "#define LS_SIMD_NATIVE 0\n";
+    o_ << "typedef struct { float v[4]; } ls_f32x4;\n";
+    o_ << "typedef struct { float v[8]; } ls_f32x8;\n";
+    o_ << "typedef struct { double v[4]; } ls_f64x4;\n";
+    o_ << "typedef struct { int64_t v[4]; } ls_i64x4;\n";
+    o_ << "#define LS_LANE(x, i) ((x).v[i])\n";
+    o_ << "#define LS_VOP(r, a, op, b, n) do { for (int ls_k = 0; ls_k < (n); ++ls_k) "
+          "(r).v[ls_k] = (a).v[ls_k] op (b).v[ls_k]; } while (0)\n";
+    o_ << "#define LS_VNEG(r, a, n) do { for (int ls_k = 0; ls_k < (n); ++ls_k) (r).v[ls_k] = -(a).v[ls_k]; } while (0)\n";
+    o_ << "#define LS_VBLEND(T, B, r, m, a, b, ...) do { for (int ls_k = 0; ls_k < (int)(sizeof((r).v) / sizeof((r).v[0])); ++ls_k) "
+          "(r).v[ls_k] = (((m) >> ls_k) & 1) ? (a).v[ls_k] : (b).v[ls_k]; } while (0)\n";
+    o_ << "#define LS_VCMP(B, out, a, op, b, n) do { for (int ls_k = 0; ls_k < (n); ++ls_k) "
+          "(out) |= (int64_t)((a).v[ls_k] op (b).v[ls_k]) << ls_k; } while (0)\n";
+    o_ << "#endif\n";
+    struct VecKind {
+      const char *n;
+      const char *elem;
+      const char *arg;
+      int lanes;
+      bool real;
+      const char *bits;
+    };
+    static const VecKind kinds[] = {
+        {"f32x4", "float", "double", 4, true, "1, 2, 4, 8"},
+        {"f32x8", "float", "double", 8, true, "1, 2, 4, 8, 16, 32, 64, 128"},
+        {"f64x4", "double", "double", 4, true, "1, 2, 4, 8"},
+        {"i64x4", "int64_t", "int64_t", 4, false, "1, 2, 4, 8"},
+    };
+    for (const VecKind &k : kinds) {
+      const std::string n = k.n;
+      const std::string T = "ls_" + n;
+      const std::string E = k.elem;
+      const std::string A = k.arg;
+      const std::string N = std::to_string(k.lanes);
+      const std::string each = "  for (int i = 0; i < " + N + "; ++i) ";
+      o_ << "static inline " << T << " " << n << "_splat(" << A << " x) {\n";
+      o_ << "  " << T << " r;\n";
+      o_ << each << "LS_LANE(r, i) = (" << E << ")x;\n";
+      o_ << "  return r;\n";
+      o_ << "}\n";
+      o_ << "static inline " << T << " " << n << "(";
+      for (int i = 0; i < k.lanes; ++i) o_ << (i ? ", " : "") << A << " l" << i;
+      o_ << ") {\n";
+      o_ << "  " << T << " r;\n";
+      for (int i = 0; i < k.lanes; ++i) o_ << "  LS_LANE(r, " << i << ") = (" << E << ")l" << i << ";\n";
+      o_ << "  return r;\n";
+      o_ << "}\n";
+      for (const char *op : {"add", "sub", "mul", "div"}) {
+        const char *sym = op[0] == 'a' ? "+" : op[0] == 's' ? "-" : op[0] == 'm' ? "*" : "/";
+        o_ << "static inline " << T << " ls_" << n << "_" << op << "(" << T << " a, " << T << " b) { " << T
+           << " r; LS_VOP(r, a, " << sym << ", b, " << N << "); return r; }\n";
+      }
+      o_ << "static inline " << T << " ls_" << n << "_neg(" << T << " a) { " << T << " r; LS_VNEG(r, a, " << N
+         << "); return r; }\n";
+      o_ << "static inline " << E << " " << n << "_lane(" << T << " v, int64_t i) {\n";
+      o_ << "  return i >= 0 && i < " << N << " ? LS_LANE(v, i) : (" << E << ")0;\n";
+      o_ << "}\n";
+      o_ << "static inline " << T << " " << n << "_with_lane(" << T << " v, int64_t i, " << A << " x) {\n";
+      o_ << "  if (i >= 0 && i < " << N << ") LS_LANE(v, i) = (" << E << ")x;\n";
+      o_ << "  return v;\n";
+      o_ << "}\n";
+      o_ << "static inline " << E << " " << n << "_sum(" << T << " v) {\n";
+      o_ << "  " << E << " s = LS_LANE(v, 0);\n";
+      o_ << "  for (int i = 1; i < " << N << "; ++i) s += LS_LANE(v, i);\n";
+      o_ << "  return s;\n";
+      o_ << "}\n";
+      for (const char *h : {"hmin", "hmax"}) {
+        o_ << "static inline " << E << " " << n << "_" << h << "(" << T << " v) {\n";
+        o_ << "  " << E << " s = LS_LANE(v, 0);\n";
+        o_ << "  for (int i = 1; i < " << N << "; ++i) if (LS_LANE(v, i) " << (h[1] == 'm' && h[2] == 'i' ? "<" : ">")
+           << " s) s = LS_LANE(v, i);\n";
+        o_ << "  return s;\n";
+        o_ << "}\n";
+      }
+      for (const char *cmp : {"lt", "le", "gt", "ge", "eq", "ne"}) {
+        const std::string c = cmp;
+        const char *sym = c == "lt" ? "<" : c == "le" ? "<=" : c == "gt" ? ">" : c == "ge" ? ">=" : c == "eq" ? "==" : "!=";
+        o_ << "static inline int64_t " << n << "_" << c << "(" << T << " a, " << T << " b) { int64_t m = 0; "
+           << "LS_VCMP(ls_b_" << n << ", m, a, " << sym << ", b, " << N << "); return m; }\n";
+      }
+      o_ << "static inline " << T << " " << n << "_select(int64_t m, " << T << " a, " << T << " b) {\n";
+      o_ << "  " << T << " r;\n";
+      o_ << "  LS_VBLEND(" << T << ", ls_b_" << n << ", r, m, a, b, " << k.bits << ");\n";
+      o_ << "  return r;\n";
+      o_ << "}\n";
+      o_ << "static inline " << T << " " << n << "_min(" << T << " a, " << T << " b) { return " << n << "_select("
+         << n << "_lt(b, a), b, a); }\n";
+      o_ << "static inline " << T << " " << n << "_max(" << T << " a, " << T << " b) { return " << n << "_select("
+         << n << "_gt(b, a), b, a); }\n";
+      o_ << "static inline " << T << " " << n << "_abs(" << T << " a) {\n";
+      o_ << "  " << T << " r;\n";
+      o_ << each << "LS_LANE(r, i) = LS_LANE(a, i) < 0 ? -LS_LANE(a, i) : LS_LANE(a, i);\n";
+      o_ << "  return r;\n";
+      o_ << "}\n";
+      if (k.real) {
+        o_ << "static inline " << T << " " << n << "_sqrt(" << T << " a) {\n";
+        o_ << "  " << T << " r;\n";
+        o_ << each << "LS_LANE(r, i) = " << (E == "float" ? "sqrtf" : "sqrt") << "(LS_LANE(a, i));\n";
+        o_ << "  return r;\n";
+        o_ << "}\n";
+        o_ << "/* a * b + c; fused when the C compiler contracts it for the target. */\n";
+        o_ << "static inline " << T << " " << n << "_fma(" << T << " a, " << T << " b, " << T << " c) { return ls_"
+           << n << "_add(ls_" << n << "_mul(a, b), c); }\n";
+      }
+      o_ << "/* Lane indices are taken modulo the lane count. */\n";
+      o_ << "static inline " << T << " " << n << "_shuffle(" << T << " v";
+      for (int i = 0; i < k.lanes; ++i) o_ << ", int64_t i" << i;
+      o_ << ") {\n";
+      o_ << "  " << T << " r;\n";
+      for (int i = 0; i < k.lanes; ++i) {
+        o_ << "  LS_LANE(r, " << i << ") = LS_LANE(v, i" << i << " & " << (k.lanes - 1) << ");\n";
+      }
+      o_ << "  return r;\n";
+      o_ << "}\n";
+      o_ << "static inline " << T << " " << n << "_load_mem(int64_t ptr) {\n";
+      o_ << "  " << T << " r = " << n << "_splat(0);\n";
+      o_ << "  if (ptr != 0) memcpy(&r, (const void *)(intptr_t)ptr, sizeof(r));\n";
+      o_ << "  return r;\n";
+      o_ << "}\n";
+      o_ << "static inline void " << n << "_store_mem(int64_t ptr, " << T << " v) {\n";
+      o_ << "  if (ptr != 0) memcpy((void *)(intptr_t)ptr, &v, sizeof(v));\n";
+      o_ << "}\n";
+      if (k.real) {
+        const bool f32 = E == "float";
+        const char *same = f32 ? "data32" : "data";
+        const char *other = f32 ? "data" : "data32";
+        o_ << "/* Lanes past the end of the array read as 0, as np_get does. */\n";
+        o_ << "static inline " << T << " " << n << "_load_np(int64_t id, int64_t idx) {\n";
+        o_ << "  " << T << " r = " << n << "_splat(0);\n";
+        o_ << "  ls_np *a = ls_get_np(id);\n";
+        o_ << "  if (!a || idx < 0 || idx >= a->len) return r;\n";
+        o_ << "  if (a->" << same << " && a->len - idx >= " << N << ") {\n";
+        o_ << "    memcpy(&r, a->" << same << " + idx, sizeof(r));\n";
+        o_ << "    return r;\n";
+        o_ << "  }\n";
+        o_ << "  for (int i = 0; i < " << N << " && idx + i < a->len; ++i)\n";
+        o_ << "    LS_LANE(r, i) = a->" << same << " ? a->" << same << "[idx + i] : (" << E << ")a->" << other
+           << "[idx + i];\n";
+        o_ << "  return r;\n";
+        o_ << "}\n";
+        o_ << "static inline void " << n << "_store_np(int64_t id, int64_t idx, " << T << " v) {\n";
+        o_ << "  ls_np *a = ls_get_np(id);\n";
+        o_ << "  if (!a || idx < 0 || idx >= a->len) return;\n";
+        o_ << "  if (a->" << same << " && a->len - idx >= " << N << ") {\n";
+        o_ << "    memcpy(a->" << same << " + idx, &v, sizeof(v));\n";
+        o_ << "    return;\n";
+        o_ << "  }\n";
+        o_ << "  for (int i = 0; i < " << N << " && idx + i < a->len; ++i) {\n";
+        o_ << "    if (a->" << same << ") a->" << same << "[idx + i] = LS_LANE(v, i);\n";
+        o_ << "    else a->" << other << "[idx + i] = (" << (f32 ? "double" : "float") << ")LS_LANE(v, i);\n";
+        o_ << "  }\n";
+        o_ << "}\n";
+      }
+      for (const char *pr : {"print", "println"}) {
+        const bool nl = pr[5] == 'l';
+        o_ << "static inline void " << pr << "_" << n << "(" << T << " v) {\n";
+        o_ << "  print_str(\"[\");\n";
+        o_ << "  for (int i = 0; i < " << N << "; ++i) {\n";
+        o_ << "    if (i) print_str(\", \");\n";
+        o_ << "    " << (k.real ? "print_f64((double)LS_LANE(v, i))" : "print_i64(LS_LANE(v, i))") << ";\n";
+        o_ << "  }\n";
+        o_ << "  " << (nl ? "println_str" : "print_str") << "(\"]\");\n";
+        o_ << "}\n";
+      }
+    }
+    struct VecCast {
+      const char *from;
+      const char *to;
+      const char *elem;
+    };
+    static const VecCast casts[] = {{"i64x4", "f64x4", "double"}, {"f32x4", "f64x4", "double"},
+                                    {"f64x4", "i64x4", "int64_t"}, {"f32x4", "i64x4", "int64_t"},
+                                    {"f64x4", "f32x4", "float"},   {"i64x4", "f32x4", "float"}};
+    for (const VecCast &c : casts) {
+      o_ << "static inline ls_" << c.to << " " << c.to << "_from_" << c.from << "(ls_" << c.from << " v) {\n";
+      o_ << "  ls_" << c.to << " r;\n";
+      o_ << "  for (int i = 0; i < 4; ++i) LS_LANE(r, i) = (" << c.elem << ")LS_LANE(v, i);\n";
+      o_ << "  return r;\n";
+      o_ << "}\n";
+    }
+  }
+  // file_map / file_cursor / file_writer: read-only memory-mapped input walked as zero-copy records, and a
+  // buffered writer. Handles are slot indices; slot claims are locked because cursors are made per chunk.
+  void emitFileRuntime() {
+    o_ << "#ifndef LS_MAX_FILE_MAP\n";
+    o_ << "#define LS_MAX_FILE_MAP 256\n";
+    o_ << "#endif\n";
+    o_ << "#ifndef LS_MAX_FILE_CURSOR\n";
+    o_ << "#define LS_MAX_FILE_CURSOR 4096\n";
+    o_ << "#endif\n";
+    o_ << "#ifndef LS_MAX_FILE_WRITER\n";
+    o_ << "#define LS_MAX_FILE_WRITER 256\n";
+    o_ << "#endif\n";
+    o_ << "#ifndef LS_FILE_WRITER_BUF\n";
+    o_ << "#define LS_FILE_WRITER_BUF 65536\n";
+    o_ << "#endif\n";
+    o_ << "typedef struct {\n";
+    o_ << "  const char *data;\n";
+    o_ << "  size_t size;\n";
+    o_ << "  ls_bool active;\n";
+    o_ << "#if defined(_WIN32)\n";
+    o_ << "  HANDLE file;\n";
+    o_ << "  HANDLE mapping;\n";
+    o_ << "#endif\n";
+    o_ << "} ls_file_map_slot;\n";
+    o_ << "typedef struct {\n";
+    o_ << "  int64_t map;\n";
+    o_ << "  size_t pos;\n";
+    o_ << "  size_t end;\n";
+    o_ << "  size_t rec;\n";
+    o_ << "  size_t rec_len;\n";
+    o_ << "  char delim;\n";
+    o_ << "  ls_bool has;\n";
+    o_ << "  ls_bool active;\n";
+    o_ << "} ls_file_cursor_slot;\n";
+    o_ << "typedef struct {\n";
+    o_ << "  FILE *f;\n";
+    o_ << "  char *buf;\n";
+    o_ << "  size_t len;\n";
+    o_ << "  ls_bool failed;\n";
+    o_ << "  ls_bool active;\n";
+    o_ << "} ls_file_writer_slot;\n";
+    o_ << "static ls_file_map_slot ls_file_maps[LS_MAX_FILE_MAP];\n";
+    o_ << "static ls_file_cursor_slot ls_file_cursors[LS_MAX_FILE_CURSOR];\n";
+    o_ << "static ls_file_writer_slot ls_file_writers[LS_MAX_FILE_WRITER];\n";
+    o_ << "static volatile int64_t ls_file_lock = 0;\n";
+    o_ << "// One free-slot scan for all three tables; cursors are created per chunk inside `parallel for`, so it is locked.\n";
+    o_ << "static int64_t ls_file_claim(ls_bool *active, size_t stride, int64_t cap) {\n";
+    o_ << "  int64_t id = -1;\n";
+    o_ << "  ls_task_spin_lock(&ls_file_lock);\n";
+    o_ << "  for (int64_t i = 0; i < cap; ++i) {\n";
+    o_ << "    ls_bool *a = (ls_bool *)((char *)active + (size_t)i * stride);\n";
+    o_ << "    if (!*a) {\n";
+    o_ << "      *a = 1;\n";
+    o_ << "      id = i;\n";
+    o_ << "      break;\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "  ls_task_spin_unlock(&ls_file_lock);\n";
+    o_ << "  return id;\n";
+    o_ << "}\n";
+    o_ << "static inline ls_file_map_slot *ls_get_file_map(int64_t id) {\n";
+    o_ << "  if (id < 0 || id >= LS_MAX_FILE_MAP || !ls_file_maps[id].active) return NULL;\n";
+    o_ << "  return &ls_file_maps[id];\n";
+    o_ << "}\n";
+    o_ << "static inline ls_file_cursor_slot *ls_get_file_cursor(int64_t id) {\n";
+    o_ << "  if (id < 0 || id >= LS_MAX_FILE_CURSOR || !ls_file_cursors[id].active) return NULL;\n";
+    o_ << "  return &ls_file_cursors[id];\n";
+    o_ << "}\n";
+    o_ << "static inline ls_file_writer_slot *ls_get_file_writer(int64_t id) {\n";
+    o_ << "  if (id < 0 || id >= LS_MAX_FILE_WRITER || !ls_file_writers[id].active) return NULL;\n";
+    o_ << "  return &ls_file_writers[id];\n";
+    o_ << "}\n";
+    o_ << "// Maps the whole file read-only (MAP_SHARED/PROT_READ, or a FILE_MAP_READ view); nothing is copied until a\n";
+    o_ << "// record's text is asked for. An empty file maps to a zero-length view.\n";
+    o_ << "static inline int64_t file_map(const char *path) {\n";
+    o_ << "  if (!path || !*path) return -1;\n";
+    o_ << "  const int64_t id = ls_file_claim(&ls_file_maps[0].active, sizeof(ls_file_map_slot), LS_MAX_FILE_MAP);\n";
+    o_ << "  if (id < 0) return -1;\n";
+    o_ << "  ls_file_map_slot *m = &ls_file_maps[id];\n";
+    o_ << "  m->data = NULL;\n";
+    o_ << "  m->size = 0;\n";
+    o_ << "#if defined(_WIN32)\n";
+    o_ << "  m->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,\n";
+    o_ << "                        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);\n";
+    o_ << "  m->mapping = NULL;\n";
+    o_ << "  LARGE_INTEGER size;\n";
+    o_ << "  if (m->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m->file, &size) ||\n";
+    o_ << "      (uint64_t)size.QuadPart > (uint64_t)(size_t)-1) {\n";
+    o_ << "    if (m->file != INVALID_HANDLE_VALUE) CloseHandle(m->file);\n";
+    o_ << "    m->active = 0;\n";
+    o_ << "    return -1;\n";
+    o_ << "  }\n";
+    o_ << "  m->size = (size_t)size.QuadPart;\n";
+    o_ << "  if (m->size > 0) {\n";
+    o_ << "    m->mapping = CreateFileMappingA(m->file, NULL, PAGE_READONLY, 0, 0, NULL);\n";
+    o_ << "    m->data = m->mapping ? (const char *)MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;\n";
+    o_ << "    if (!m->data) {\n";
+    o_ << "      if (m->mapping) CloseHandle(m->mapping);\n";
+    o_ << "      CloseHandle(m->file);\n";
+    o_ << "      m->active = 0;\n";
+    o_ << "      return -1;\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "#else\n";
+    o_ << "  const int fd = open(path, O_RDONLY);\n";
+    o_ << "  struct stat st;\n";
+    o_ << "  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size > (uint64_t)(size_t)-1) {\n";
+    o_ << "    if (fd >= 0) close(fd);\n";
+    o_ << "    m->active = 0;\n";
+    o_ << "    return -1;\n";
+    o_ << "  }\n";
+    o_ << "  m->size = (size_t)st.st_size;\n";
+    o_ << "  if (m->size > 0) {\n";
+    o_ << "    void *p = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);\n";
+    o_ << "    if (p == MAP_FAILED) {\n";
+    o_ << "      close(fd);\n";
+    o_ << "      m->active = 0;\n";
+    o_ << "      return -1;\n";
+    o_ << "    }\n";
+    o_ << "#if defined(MADV_SEQUENTIAL)\n";
+    o_ << "    (void)madvise(p, m->size, MADV_SEQUENTIAL);\n";
+    o_ << "#endif\n";
+    o_ << "    m->data = (const char *)p;\n";
+    o_ << "  }\n";
+    o_ << "  close(fd);\n";
+    o_ << "#endif\n";
+    o_ << "  return id;\n";
+    o_ << "}\n";
+    o_ << "static inline void file_unmap(int64_t id) {\n";
+    o_ << "  ls_file_map_slot *m = ls_get_file_map(id);\n";
+    o_ << "  if (!m) return;\n";
+    o_ << "#if defined(_WIN32)\n";
+    o_ << "  if (m->data) UnmapViewOfFile((LPCVOID)m->data);\n";
+    o_ << "  if (m->mapping) CloseHandle(m->mapping);\n";
+    o_ << "  CloseHandle(m->file);\n";
     o_ << "#else\n";
-    o_ << "#define LS_THREAD_LOCAL _Thread_local\n";
+    o_ << "  if (m->data) munmap((void *)m->data, m->size);\n";
+    o_ << "#endif\n";
+    o_ << "  m->data = NULL;\n";
+    o_ << "  m->size = 0;\n";
+    o_ << "  ls_task_spin_lock(&ls_file_lock);\n";
+    o_ << "  m->active = 0;\n";
+    o_ << "  ls_task_spin_unlock(&ls_file_lock);\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t file_map_size(int64_t id) {\n";
+    o_ << "  ls_file_map_slot *m = ls_get_file_map(id);\n";
+    o_ << "  return m ? (int64_t)m->size : -1;\n";
+    o_ << "}\n";
+    o_ << "static inline size_t ls_file_clamp(const ls_file_map_slot *m, int64_t off) {\n";
+    o_ << "  if (off <= 0) return 0;\n";
+    o_ << "  return (uint64_t)off >= (uint64_t)m->size ? m->size : (size_t)off;\n";
+    o_ << "}\n";
+    o_ << "// Start of chunk `index` out of `count` equal byte ranges, moved forward past the next newline so chunks split\n";
+    o_ << "// on line boundaries; chunk `count` is the file size. Chunk i covers [file_map_chunk(m, i, n),\n";
+    o_ << "// file_map_chunk(m, i + 1, n)).\n";
+    o_ << "static inline int64_t file_map_chunk(int64_t id, int64_t index, int64_t count) {\n";
+    o_ << "  ls_file_map_slot *m = ls_get_file_map(id);\n";
+    o_ << "  if (!m || count <= 0 || index <= 0) return 0;\n";
+    o_ << "  if (index >= count) return (int64_t)m->size;\n";
+    o_ << "  const size_t approx = (size_t)((double)m->size * ((double)index / (double)count));\n";
+    o_ << "  if (approx == 0) return 0;\n";
+    o_ << "  const char *nl = (const char *)memchr(m->data + approx - 1, '\\n', m->size - (approx - 1));\n";
+    o_ << "  return nl ? (int64_t)(nl - m->data) + 1 : (int64_t)m->size;\n";
+    o_ << "}\n";
+    o_ << "#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)\n";
+    o_ << "#define LS_FILE_SSE2 1\n";
+    o_ << "#endif\n";
+    o_ << "// Substring search over raw bytes. Single bytes go to memchr; longer needles compare the first and last needle\n";
+    o_ << "// byte against 16 positions at a time and verify only the candidates.\n";
+    o_ << "static const char *ls_file_find(const char *hay, size_t n, const char *needle, size_t k) {\n";
+    o_ << "  if (k == 0) return hay;\n";
+    o_ << "  if (k > n) return NULL;\n";
+    o_ << "  if (k == 1) return (const char *)memchr(hay, needle[0], n);\n";
+    o_ << "  size_t i = 0;\n";
+    o_ << "#if defined(LS_FILE_SSE2)\n";
+    o_ << "  const __m128i first = _mm_set1_epi8(needle[0]);\n";
+    o_ << "  const __m128i last = _mm_set1_epi8(needle[k - 1]);\n";
+    o_ << "  for (; i + k + 15 <= n; i += 16) {\n";
+    o_ << "    const __m128i a = _mm_loadu_si128((const __m128i *)(const void *)(hay + i));\n";
+    o_ << "    const __m128i b = _mm_loadu_si128((const __m128i *)(const void *)(hay + i + k - 1));\n";
+    o_ << "    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));\n";
+    o_ << "    while (mask) {\n";
+    o_ << "      unsigned bit = 0;\n";
+    o_ << "      while (!(mask & (1u << bit))) ++bit;\n";
+    o_ << "      if (memcmp(hay + i + bit + 1, needle + 1, k - 2) == 0) return hay + i + bit;\n";
+    o_ << "      mask &= mask - 1u;\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "#endif\n";
+    o_ << "  while (i + k <= n) {\n";
+    o_ << "    const char *p = (const char *)memchr(hay + i, needle[0], n - k + 1 - i);\n";
+    o_ << "    if (!p) return NULL;\n";
+    o_ << "    if (memcmp(p + 1, needle + 1, k - 1) == 0) return p;\n";
+    o_ << "    i = (size_t)(p - hay) + 1;\n";
+    o_ << "  }\n";
+    o_ << "  return NULL;\n";
+    o_ << "}\n";
+    o_ << "// Non-overlapping occurrences; a one-byte needle (such as \"\\n\" for line counts) is counted 16 bytes at a time.\n";
+    o_ << "static int64_t ls_file_count(const char *hay, size_t n, const char *needle, size_t k) {\n";
+    o_ << "  if (k == 0 || k > n) return 0;\n";
+    o_ << "  int64_t count = 0;\n";
+    o_ << "  size_t i = 0;\n";
+    o_ << "  if (k == 1) {\n";
+    o_ << "#if defined(LS_FILE_SSE2)\n";
+    o_ << "    const __m128i want = _mm_set1_epi8(needle[0]);\n";
+    o_ << "    for (; i + 16 <= n; i += 16) {\n";
+    o_ << "      unsigned mask = (unsigned)_mm_movemask_epi8(\n";
+    o_ << "          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(const void *)(hay + i)), want));\n";
+    o_ << "      while (mask) {\n";
+    o_ << "        ++count;\n";
+    o_ << "        mask &= mask - 1u;\n";
+    o_ << "      }\n";
+    o_ << "    }\n";
     o_ << "#endif\n";
+    o_ << "    for (; i < n; ++i) count += hay[i] == needle[0];\n";
+    o_ << "    return count;\n";
+    o_ << "  }\n";
+    o_ << "  for (const char *p; (p = ls_file_find(hay + i, n - i, needle, k)) != NULL; i = (size_t)(p - hay) + k) ++count;\n";
+    o_ << "  return count;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t file_map_find(int64_t id, const char *needle, int64_t from) {\n";
+    o_ << "  ls_file_map_slot *m = ls_get_file_map(id);\n";
+    o_ << "  if (!m || !needle) return -1;\n";
+    o_ << "  const size_t start = ls_file_clamp(m, from);\n";
+    o_ << "  const char *p = ls_file_find(m->data + start, m->size - start, needle, strlen(needle));\n";
+    o_ << "  return p ? (int64_t)(p - m->data) : -1;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t file_map_count(int64_t id, const char *needle, int64_t start, int64_t end) {\n";
+    o_ << "  ls_file_map_slot *m = ls_get_file_map(id);\n";
+    o_ << "  if (!m || !needle) return 0;\n";
+    o_ << "  const size_t b = ls_file_clamp(m, start);\n";
+    o_ << "  const size_t e = ls_file_clamp(m, end);\n";
+    o_ << "  return e > b ? ls_file_count(m->data + b, e - b, needle, strlen(needle)) : 0;\n";
+    o_ << "}\n";
+    o_ << "static inline const char *ls_file_text(const char *p, size_t n) {\n";
+    o_ << "  char *out = ls_str_take(n);\n";
+    o_ << "  if (!out) return \"\";\n";
+    o_ << "  if (n) memcpy(out, p, n);\n";
+    o_ << "  return ls_str_seal(out, n);\n";
+    o_ << "}\n";
+    o_ << "static inline const char *file_map_text(int64_t id, int64_t start, int64_t len) {\n";
+    o_ << "  ls_file_map_slot *m = ls_get_file_map(id);\n";
+    o_ << "  if (!m || len <= 0) return \"\";\n";
+    o_ << "  const size_t b = ls_file_clamp(m, start);\n";
+    o_ << "  const size_t n = (uint64_t)len > (uint64_t)(m->size - b) ? m->size - b : (size_t)len;\n";
+    o_ << "  return ls_file_text(m->data + b, n);\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t file_cursor_delim(int64_t map, int64_t start, int64_t end, const char *delim) {\n";
+    o_ << "  ls_file_map_slot *m = ls_get_file_map(map);\n";
+    o_ << "  if (!m) return -1;\n";
+    o_ << "  const int64_t id = ls_file_claim(&ls_file_cursors[0].active, sizeof(ls_file_cursor_slot), LS_MAX_FILE_CURSOR);\n";
+    o_ << "  if (id < 0) return -1;\n";
+    o_ << "  ls_file_cursor_slot *c = &ls_file_cursors[id];\n";
+    o_ << "  c->map = map;\n";
+    o_ << "  c->pos = ls_file_clamp(m, start);\n";
+    o_ << "  c->end = end < 0 ? m->size : ls_file_clamp(m, end);\n";
+    o_ << "  if (c->end < c->pos) c->end = c->pos;\n";
+    o_ << "  c->rec = c->pos;\n";
+    o_ << "  c->rec_len = 0;\n";
+    o_ << "  c->delim = (delim && *delim) ? delim[0] : '\\n';\n";
+    o_ << "  c->has = 0;\n";
+    o_ << "  return id;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t file_cursor(int64_t map, int64_t start, int64_t end) {\n";
+    o_ << "  return file_cursor_delim(map, start, end, \"\\n\");\n";
+    o_ << "}\n";
+    o_ << "// Advances to the next record without copying: memchr finds the delimiter and the record is kept as an offset\n";
+    o_ << "// and length into the mapping. Line cursors drop a trailing '\\r'.\n";
+    o_ << "static inline ls_bool file_cursor_next(int64_t id) {\n";
+    o_ << "  ls_file_cursor_slot *c = ls_get_file_cursor(id);\n";
+    o_ << "  if (!c) return 0;\n";
+    o_ << "  ls_file_map_slot *m = ls_get_file_map(c->map);\n";
+    o_ << "  if (!m || c->pos >= c->end) {\n";
+    o_ << "    c->has = 0;\n";
+    o_ << "    return 0;\n";
+    o_ << "  }\n";
+    o_ << "  const char *base = m->data + c->pos;\n";
+    o_ << "  const char *hit = (const char *)memchr(base, c->delim, c->end - c->pos);\n";
+    o_ << "  const size_t len = hit ? (size_t)(hit - base) : c->end - c->pos;\n";
+    o_ << "  c->rec = c->pos;\n";
+    o_ << "  c->rec_len = (c->delim == '\\n' && len > 0 && base[len - 1] == '\\r') ? len - 1 : len;\n";
+    o_ << "  c->pos += hit ? len + 1 : len;\n";
+    o_ << "  c->has = 1;\n";
+    o_ << "  return 1;\n";
+    o_ << "}\n";
+    o_ << "static inline const char *file_cursor_text(int64_t id) {\n";
+    o_ << "  ls_file_cursor_slot *c = ls_get_file_cursor(id);\n";
+    o_ << "  ls_file_map_slot *m = c ? ls_get_file_map(c->map) : NULL;\n";
+    o_ << "  if (!m || !c->has) return \"\";\n";
+    o_ << "  return ls_file_text(m->data + c->rec, c->rec_len);\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t file_cursor_offset(int64_t id) {\n";
+    o_ << "  ls_file_cursor_slot *c = ls_get_file_cursor(id);\n";
+    o_ << "  return (c && c->has) ? (int64_t)c->rec : -1;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t file_cursor_len(int64_t id) {\n";
+    o_ << "  ls_file_cursor_slot *c = ls_get_file_cursor(id);\n";
+    o_ << "  return (c && c->has) ? (int64_t)c->rec_len : 0;\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool file_cursor_contains(int64_t id, const char *needle) {\n";
+    o_ << "  ls_file_cursor_slot *c = ls_get_file_cursor(id);\n";
+    o_ << "  ls_file_map_slot *m = c ? ls_get_file_map(c->map) : NULL;\n";
+    o_ << "  if (!m || !c->has || !needle) return 0;\n";
+    o_ << "  return ls_file_find(m->data + c->rec, c->rec_len, needle, strlen(needle)) != NULL;\n";
+    o_ << "}\n";
+    o_ << "static inline void file_cursor_free(int64_t id) {\n";
+    o_ << "  ls_file_cursor_slot *c = ls_get_file_cursor(id);\n";
+    o_ << "  if (!c) return;\n";
+    o_ << "  ls_task_spin_lock(&ls_file_lock);\n";
+    o_ << "  c->active = 0;\n";
+    o_ << "  ls_task_spin_unlock(&ls_file_lock);\n";
+    o_ << "}\n";
+    o_ << "// Buffered writer: text collects in a 64 KB buffer and leaves in one fwrite per fill (stdio buffering is off),\n";
+    o_ << "// and writes larger than the buffer go straight through.\n";
+    o_ << "static inline int64_t file_writer_open(const char *path, ls_bool append) {\n";
+    o_ << "  if (!path || !*path) return -1;\n";
+    o_ << "  const int64_t id = ls_file_claim(&ls_file_writers[0].active, sizeof(ls_file_writer_slot), LS_MAX_FILE_WRITER);\n";
+    o_ << "  if (id < 0) return -1;\n";
+    o_ << "  ls_file_writer_slot *w = &ls_file_writers[id];\n";
+    o_ << "  w->f = fopen(path, append ? \"ab\" : \"wb\");\n";
+    o_ << "  w->buf = w->f ? (char *)malloc(LS_FILE_WRITER_BUF) : NULL;\n";
+    o_ << "  if (!w->buf) {\n";
+    o_ << "    if (w->f) fclose(w->f);\n";
+    o_ << "    w->active = 0;\n";
+    o_ << "    return -1;\n";
+    o_ << "  }\n";
+    o_ << "  setvbuf(w->f, NULL, _IONBF, 0);\n";
+    o_ << "  w->len = 0;\n";
+    o_ << "  w->failed = 0;\n";
+    o_ << "  return id;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_file_writer_drain(ls_file_writer_slot *w) {\n";
+    o_ << "  if (w->len > 0 && fwrite(w->buf, 1, w->len, w->f) != w->len) w->failed = 1;\n";
+    o_ << "  w->len = 0;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_file_writer_put(ls_file_writer_slot *w, const char *s, size_t n) {\n";
+    o_ << "  if (w->len + n > LS_FILE_WRITER_BUF) {\n";
+    o_ << "    ls_file_writer_drain(w);\n";
+    o_ << "    if (n > LS_FILE_WRITER_BUF) {\n";
+    o_ << "      if (fwrite(s, 1, n, w->f) != n) w->failed = 1;\n";
+    o_ << "      return;\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "  memcpy(w->buf + w->len, s, n);\n";
+    o_ << "  w->len += n;\n";
+    o_ << "}\n";
+    o_ << "static inline void file_write(int64_t id, const char *s) {\n";
+    o_ << "  ls_file_writer_slot *w = ls_get_file_writer(id);\n";
+    o_ << "  if (w && s) ls_file_writer_put(w, s, strlen(s));\n";
+    o_ << "}\n";
+    o_ << "static inline void file_write_line(int64_t id, const char *s) {\n";
+    o_ << "  ls_file_writer_slot *w = ls_get_file_writer(id);\n";
+    o_ << "  if (!w) return;\n";
+    o_ << "  if (s) ls_file_writer_put(w, s, strlen(s));\n";
+    o_ << "  ls_file_writer_put(w, \"\\n\", 1);\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool file_writer_flush(int64_t id) {\n";
+    o_ << "  ls_file_writer_slot *w = ls_get_file_writer(id);\n";
+    o_ << "  if (!w) return 0;\n";
+    o_ << "  ls_file_writer_drain(w);\n";
+    o_ << "  if (fflush(w->f) != 0) w->failed = 1;\n";
+    o_ << "  return w->failed ? 0 : 1;\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool file_writer_close(int64_t id) {\n";
+    o_ << "  ls_file_writer_slot *w = ls_get_file_writer(id);\n";
+    o_ << "  if (!w) return 0;\n";
+    o_ << "  ls_file_writer_drain(w);\n";
+    o_ << "  if (fclose(w->f) != 0) w->failed = 1;\n";
+    o_ << "  const ls_bool ok = w->failed ? 0 : 1;\n";
+    o_ << "  free(w->buf);\n";
+    o_ << "  w->buf = NULL;\n";
+    o_ << "  w->f = NULL;\n";
+    o_ << "  ls_task_spin_lock(&ls_file_lock);\n";
+    o_ << "  w->active = 0;\n";
+    o_ << "  ls_task_spin_unlock(&ls_file_lock);\n";
+    o_ << "  return ok;\n";
+    o_ << "}\n";
+  }
+  void emitBuiltins() {
     o_ << "typedef struct {\n";
     o_ << "  char *buf;\n";
     o_ << "  size_t len;\n";
@@ -6974,13 +10956,7 @@ private:
     o_ << "  ls_bool active;\n";
     o_ << "} ls_format_state;\n";
     o_ << "static LS_THREAD_LOCAL ls_format_state ls_fmt = {NULL, 0, 0, 0};\n";
-    o_ << "static inline void ls_emit_text(const char *s) {\n";
-    o_ << "  const char *txt = s ? s : \"\";\n";
-    o_ << "  if (!ls_fmt.active) {\n";
-    o_ << "    fputs(txt, stdout);\n";
-    o_ << "    return;\n";
-    o_ << "  }\n";
-    o_ << "  const size_t n = strlen(txt);\n";
+    o_ << "static inline void ls_fmt_append(const char *s, size_t n) {\n";
     o_ << "  if (n == 0) return;\n";
     o_ << "  const size_t need = ls_fmt.len + n + 1;\n";
     o_ << "  if (need > ls_fmt.cap) {\n";
@@ -6991,54 +10967,11 @@ private:
     o_ << "    ls_fmt.buf = next;\n";
     o_ << "    ls_fmt.cap = nextCap;\n";
     o_ << "  }\n";
-    o_ << "  memcpy(ls_fmt.buf + ls_fmt.len, txt, n);\n";
+    o_ << "  memcpy(ls_fmt.buf + ls_fmt.len, s, n);\n";
     o_ << "  ls_fmt.len += n;\n";
     o_ << "  ls_fmt.buf[ls_fmt.len] = '\\0';\n";
     o_ << "}\n";
-    o_ << "static inline void ls_emit_newline(void) {\n";
-    o_ << "  if (!ls_fmt.active) {\n";
-    o_ << "    fputc('\\n', stdout);\n";
-    o_ << "    return;\n";
-    o_ << "  }\n";
-    o_ << "  ls_emit_text(\"\\n\");\n";
-    o_ << "}\n";
-    o_ << "static inline const char *ls_i64_to_cstr(int64_t v, char *buf) {\n";
-    o_ << "  uint64_t x;\n";
-    o_ << "  int neg = 0;\n";
-    o_ << "  if (v < 0) {\n";
-    o_ << "    neg = 1;\n";
-    o_ << "    x = (uint64_t)(-(v + 1LL)) + 1ULL;\n";
-    o_ << "  } else {\n";
-    o_ << "    x = (uint64_t)v;\n";
-    o_ << "  }\n";
-    o_ << "  char tmp[32];\n";
-    o_ << "  int n = 0;\n";
-    o_ << "  do {\n";
-    o_ << "    tmp[n++] = (char)('0' + (x % 10ULL));\n";
-    o_ << "    x /= 10ULL;\n";
-    o_ << "  } while (x != 0ULL);\n";
-    o_ << "  if (neg) tmp[n++] = '-';\n";
-    o_ << "  int j = 0;\n";
-    o_ << "  while (n > 0) buf[j++] = tmp[--n];\n";
-    o_ << "  buf[j] = '\\0';\n";
-    o_ << "  return buf;\n";
-    o_ << "}\n";
-    o_ << "static inline void print_i64(int64_t v) {\n";
-    o_ << "  char b[32];\n";
-    o_ << "  ls_i64_to_cstr(v, b);\n";
-    o_ << "  ls_emit_text(b);\n";
-    o_ << "}\n";
-    o_ << "static inline void print_f64(double v) {\n";
-    o_ << "  char b[64];\n";
-    o_ << "  (void)snprintf(b, sizeof(b), \"%.17g\", v);\n";
-    o_ << "  ls_emit_text(b);\n";
-    o_ << "}\n";
-    o_ << "static inline void print_bool(ls_bool v) { ls_emit_text(v ? \"true\" : \"false\"); }\n";
-    o_ << "static inline void print_str(const char *v) { ls_emit_text(v ? v : \"\"); }\n";
-    o_ << "static inline void println_i64(int64_t v) { print_i64(v); ls_emit_newline(); }\n";
-    o_ << "static inline void println_f64(double v) { print_f64(v); ls_emit_newline(); }\n";
-    o_ << "static inline void println_bool(ls_bool v) { print_bool(v); ls_emit_newline(); }\n";
-    o_ << "static inline void println_str(const char *v) { print_str(v); ls_emit_newline(); }\n";
+    emitOutputRuntime(true);
     o_ << "static inline int64_t clock_ms(void) { return (int64_t)((clock() * 1000LL) / CLOCKS_PER_SEC); }\n";
     o_ << "static inline int64_t clock_us(void) {\n";
     o_ << "  struct timespec ts;\n";
@@ -7154,6 +11087,7 @@ private:
     o_ << "  print_str(\"speed_us=\");\n";
     o_ << "  println_i64(elapsed_us);\n";
     o_ << "}\n";
+    if (needsBenchRuntime_) emitBenchRuntime();
     o_ << "static LS_THREAD_LOCAL ls_bool ls_format_cli_marker = 0;\n";
     o_ << "static inline void ls_mark_format_mode(void) { ls_format_cli_marker = 1; }\n";
     if (cliCustomTokens_.empty()) {
@@ -7198,13 +11132,198 @@ private:
     o_ << "  return \"\";\n";
     o_ << "}\n";
     o_ << "#define LS_SCRATCH_SLOTS 16\n";
+    o_ << "#define LS_ARENA_BLOCK_SHIFT 12\n";
+    o_ << "#define LS_ARENA_BLOCK ((size_t)1 << LS_ARENA_BLOCK_SHIFT)\n";
+    o_ << "#define LS_ARENA_CLASSES 9\n";
+    o_ << "#define LS_ARENA_MAX_POOLED (LS_ARENA_BLOCK << (LS_ARENA_CLASSES - 1))\n";
+    o_ << "#define LS_ARENA_POOL_DEPTH 16\n";
+    o_ << "typedef struct ls_arena_chunk {\n";
+    o_ << "  struct ls_arena_chunk *next;\n";
+    o_ << "  void *raw;\n";
+    o_ << "  size_t size;\n";
+    o_ << "  size_t used;\n";
+    o_ << "  int64_t depth;\n";
+    o_ << "  int cls;\n";
+    o_ << "} ls_arena_chunk;\n";
+    o_ << "typedef struct ls_region {\n";
+    o_ << "  struct ls_region *prev;\n";
+    o_ << "  ls_arena_chunk *chunks;\n";
+    o_ << "  int64_t depth;\n";
+    o_ << "} ls_region;\n";
+    o_ << "typedef struct {\n";
+    o_ << "  uintptr_t block;\n";
+    o_ << "  ls_arena_chunk *chunk;\n";
+    o_ << "} ls_arena_slot;\n";
+    o_ << "static LS_THREAD_LOCAL ls_region *ls_region_top = NULL;\n";
+    o_ << "static LS_THREAD_LOCAL ls_arena_slot *ls_arena_index = NULL;\n";
+    o_ << "static LS_THREAD_LOCAL size_t ls_arena_index_cap = 0;\n";
+    o_ << "static LS_THREAD_LOCAL size_t ls_arena_index_len = 0;\n";
+    o_ << "static LS_THREAD_LOCAL ls_arena_chunk *ls_arena_pool[LS_ARENA_CLASSES];\n";
+    o_ << "static LS_THREAD_LOCAL int ls_arena_pool_len[LS_ARENA_CLASSES];\n";
+    o_ << "static LS_THREAD_LOCAL ls_arena_chunk *ls_arena_last = NULL;\n";
+    o_ << "static inline size_t ls_arena_hash(uintptr_t block, size_t mask) {\n";
+    o_ << "  return (size_t)(((uint64_t)block * 0x9E3779B97F4A7C15ULL) >> 32) & mask;\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool ls_arena_index_put(uintptr_t block, ls_arena_chunk *chunk) {\n";
+    o_ << "  if ((ls_arena_index_len + 1) * 2 > ls_arena_index_cap) {\n";
+    o_ << "    const size_t nextCap = ls_arena_index_cap ? ls_arena_index_cap * 2 : 1024;\n";
+    o_ << "    ls_arena_slot *next = (ls_arena_slot *)calloc(nextCap, sizeof(ls_arena_slot));\n";
+    o_ << "    if (!next) return 0;\n";
+    o_ << "    for (size_t i = 0; i < ls_arena_index_cap; ++i) {\n";
+    o_ << "      if (!ls_arena_index[i].chunk) continue;\n";
+    o_ << "      size_t at = ls_arena_hash(ls_arena_index[i].block, nextCap - 1);\n";
+    o_ << "      while (next[at].chunk) at = (at + 1) & (nextCap - 1);\n";
+    o_ << "      next[at] = ls_arena_index[i];\n";
+    o_ << "    }\n";
+    o_ << "    free(ls_arena_index);\n";
+    o_ << "    ls_arena_index = next;\n";
+    o_ << "    ls_arena_index_cap = nextCap;\n";
+    o_ << "  }\n";
+    o_ << "  const size_t mask = ls_arena_index_cap - 1;\n";
+    o_ << "  size_t at = ls_arena_hash(block, mask);\n";
+    o_ << "  while (ls_arena_index[at].chunk) at = (at + 1) & mask;\n";
+    o_ << "  ls_arena_index[at].block = block;\n";
+    o_ << "  ls_arena_index[at].chunk = chunk;\n";
+    o_ << "  ++ls_arena_index_len;\n";
+    o_ << "  return 1;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_arena_index_drop(uintptr_t block) {\n";
+    o_ << "  if (!ls_arena_index_cap) return;\n";
+    o_ << "  const size_t mask = ls_arena_index_cap - 1;\n";
+    o_ << "  size_t at = ls_arena_hash(block, mask);\n";
+    o_ << "  while (ls_arena_index[at].chunk && ls_arena_index[at].block != block) at = (at + 1) & mask;\n";
+    o_ << "  if (!ls_arena_index[at].chunk) return;\n";
+    o_ << "  size_t hole = at;\n";
+    o_ << "  for (size_t i = (hole + 1) & mask; ls_arena_index[i].chunk; i = (i + 1) & mask) {\n";
+    o_ << "    const size_t home = ls_arena_hash(ls_arena_index[i].block, mask);\n";
+    o_ << "    if (((i - home) & mask) >= ((i - hole) & mask)) {\n";
+    o_ << "      ls_arena_index[hole] = ls_arena_index[i];\n";
+    o_ << "      hole = i;\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "  ls_arena_index[hole].chunk = NULL;\n";
+    o_ << "  --ls_arena_index_len;\n";
+    o_ << "}\n";
+    o_ << "static inline ls_arena_chunk *ls_arena_owner(const void *p) {\n";
+    o_ << "  if (!p || !ls_arena_index_len) return NULL;\n";
+    o_ << "  ls_arena_chunk *last = ls_arena_last;\n";
+    o_ << "  if (last && (uintptr_t)p - (uintptr_t)(void *)last < last->size) return last->depth > 0 ? last : NULL;\n";
+    o_ << "  const uintptr_t block = (uintptr_t)p >> LS_ARENA_BLOCK_SHIFT;\n";
+    o_ << "  const size_t mask = ls_arena_index_cap - 1;\n";
+    o_ << "  for (size_t at = ls_arena_hash(block, mask); ls_arena_index[at].chunk; at = (at + 1) & mask) {\n";
+    o_ << "    if (ls_arena_index[at].block != block) continue;\n";
+    o_ << "    ls_arena_chunk *c = ls_arena_index[at].chunk;\n";
+    o_ << "    ls_arena_last = c;\n";
+    o_ << "    return c->depth > 0 ? c : NULL;\n";
+    o_ << "  }\n";
+    o_ << "  return NULL;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_arena_chunk_free(ls_arena_chunk *c) {\n";
+    o_ << "  if (ls_arena_last == c) ls_arena_last = NULL;\n";
+    o_ << "  const uintptr_t first = (uintptr_t)(void *)c >> LS_ARENA_BLOCK_SHIFT;\n";
+    o_ << "  for (size_t i = 0; i < c->size / LS_ARENA_BLOCK; ++i) ls_arena_index_drop(first + (uintptr_t)i);\n";
+    o_ << "  free(c->raw);\n";
+    o_ << "}\n";
+    o_ << "static inline ls_arena_chunk *ls_arena_chunk_new(size_t size, int cls) {\n";
+    o_ << "  if (cls >= 0 && ls_arena_pool[cls]) {\n";
+    o_ << "    ls_arena_chunk *c = ls_arena_pool[cls];\n";
+    o_ << "    ls_arena_pool[cls] = c->next;\n";
+    o_ << "    --ls_arena_pool_len[cls];\n";
+    o_ << "    c->next = NULL;\n";
+    o_ << "    c->used = sizeof(ls_arena_chunk);\n";
+    o_ << "    return c;\n";
+    o_ << "  }\n";
+    o_ << "  if (size > SIZE_MAX - LS_ARENA_BLOCK) return NULL;\n";
+    o_ << "  void *raw = malloc(size + LS_ARENA_BLOCK);\n";
+    o_ << "  if (!raw) return NULL;\n";
+    o_ << "  const uintptr_t at = ((uintptr_t)raw + LS_ARENA_BLOCK - 1) & ~(uintptr_t)(LS_ARENA_BLOCK - 1);\n";
+    o_ << "  ls_arena_chunk *c = (ls_arena_chunk *)(void *)at;\n";
+    o_ << "  c->next = NULL;\n";
+    o_ << "  c->raw = raw;\n";
+    o_ << "  c->size = size;\n";
+    o_ << "  c->used = sizeof(ls_arena_chunk);\n";
+    o_ << "  c->depth = 0;\n";
+    o_ << "  c->cls = cls;\n";
+    o_ << "  const uintptr_t first = at >> LS_ARENA_BLOCK_SHIFT;\n";
+    o_ << "  for (size_t i = 0; i < size / LS_ARENA_BLOCK; ++i) {\n";
+    o_ << "    if (!ls_arena_index_put(first + (uintptr_t)i, c)) {\n";
+    o_ << "      c->size = i * LS_ARENA_BLOCK;\n";
+    o_ << "      ls_arena_chunk_free(c);\n";
+    o_ << "      return NULL;\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "  return c;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_arena_chunk_release(ls_arena_chunk *c) {\n";
+    o_ << "  c->depth = 0;\n";
+    o_ << "  if (c->cls >= 0 && ls_arena_pool_len[c->cls] < LS_ARENA_POOL_DEPTH) {\n";
+    o_ << "    c->next = ls_arena_pool[c->cls];\n";
+    o_ << "    ls_arena_pool[c->cls] = c;\n";
+    o_ << "    ++ls_arena_pool_len[c->cls];\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
+    o_ << "  ls_arena_chunk_free(c);\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_region_enter(ls_region *r) {\n";
+    o_ << "  r->prev = ls_region_top;\n";
+    o_ << "  r->chunks = NULL;\n";
+    o_ << "  r->depth = r->prev ? r->prev->depth + 1 : 1;\n";
+    o_ << "  ls_region_top = r;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_region_leave(ls_region *r) {\n";
+    o_ << "  ls_arena_chunk *c = r->chunks;\n";
+    o_ << "  while (c) {\n";
+    o_ << "    ls_arena_chunk *next = c->next;\n";
+    o_ << "    ls_arena_chunk_release(c);\n";
+    o_ << "    c = next;\n";
+    o_ << "  }\n";
+    o_ << "  r->chunks = NULL;\n";
+    o_ << "  ls_region_top = r->prev;\n";
+    o_ << "}\n";
+    o_ << "static inline char *ls_region_alloc(ls_region *r, size_t need) {\n";
+    o_ << "  if (need > SIZE_MAX / 2) return NULL;\n";
+    o_ << "  need = (need + 7u) & ~(size_t)7u;\n";
+    o_ << "  ls_arena_chunk *c = r->chunks;\n";
+    o_ << "  if (c && c->size - c->used >= need) {\n";
+    o_ << "    char *out = (char *)(void *)c + c->used;\n";
+    o_ << "    c->used += need;\n";
+    o_ << "    return out;\n";
+    o_ << "  }\n";
+    o_ << "  int cls = c ? (c->cls < 0 ? LS_ARENA_CLASSES - 1 : c->cls + 1) : 0;\n";
+    o_ << "  if (cls >= LS_ARENA_CLASSES) cls = LS_ARENA_CLASSES - 1;\n";
+    o_ << "  while (cls < LS_ARENA_CLASSES && (LS_ARENA_BLOCK << cls) - sizeof(ls_arena_chunk) < need) ++cls;\n";
+    o_ << "  size_t size = 0;\n";
+    o_ << "  if (cls < LS_ARENA_CLASSES) {\n";
+    o_ << "    size = LS_ARENA_BLOCK << cls;\n";
+    o_ << "  } else {\n";
+    o_ << "    if (need > SIZE_MAX - sizeof(ls_arena_chunk) - LS_ARENA_BLOCK) return NULL;\n";
+    o_ << "    size = (need + sizeof(ls_arena_chunk) + LS_ARENA_BLOCK - 1) & ~(LS_ARENA_BLOCK - 1);\n";
+    o_ << "    cls = -1;\n";
+    o_ << "  }\n";
+    o_ << "  ls_arena_chunk *fresh = ls_arena_chunk_new(size, cls);\n";
+    o_ << "  if (!fresh) return NULL;\n";
+    o_ << "  fresh->depth = r->depth;\n";
+    o_ << "  if (c && cls < 0) {\n";
+    o_ << "    fresh->next = c->next;\n";
+    o_ << "    c->next = fresh;\n";
+    o_ << "  } else {\n";
+    o_ << "    fresh->next = c;\n";
+    o_ << "    r->chunks = fresh;\n";
+    o_ << "  }\n";
+    o_ << "  char *out = (char *)(void *)fresh + fresh->used;\n";
+    o_ << "  fresh->used += need;\n";
+    o_ << "  return out;\n";
+    o_ << "}\n";
     o_ << "static LS_THREAD_LOCAL char *ls_scratch_bufs[LS_SCRATCH_SLOTS];\n";
     o_ << "static LS_THREAD_LOCAL size_t ls_scratch_caps[LS_SCRATCH_SLOTS];\n";
     o_ << "static LS_THREAD_LOCAL int ls_scratch_pos = 0;\n";
+    o_ << "static LS_THREAD_LOCAL ls_bool ls_scratch_ring_used = 0;\n";
     o_ << "static inline char *ls_scratch_take(size_t need) {\n";
     o_ << "  if (need < 1) need = 1;\n";
+    o_ << "  if (ls_region_top) return ls_region_alloc(ls_region_top, need);\n";
     o_ << "  const int idx = ls_scratch_pos;\n";
     o_ << "  ls_scratch_pos = (ls_scratch_pos + 1) % LS_SCRATCH_SLOTS;\n";
+    o_ << "  ls_scratch_ring_used = 1;\n";
     o_ << "  if (ls_scratch_caps[idx] < need) {\n";
     o_ << "    char *next = (char *)realloc(ls_scratch_bufs[idx], need);\n";
     o_ << "    if (!next) return NULL;\n";
@@ -7213,9 +11332,49 @@ private:
     o_ << "  }\n";
     o_ << "  return ls_scratch_bufs[idx];\n";
     o_ << "}\n";
+    o_ << "// Strings built by the runtime inside a region carry a header with their length and a lazily cached hash. The tag\n";
+    o_ << "// mixes in the string's own address, so a pointer into the middle of another string never matches by accident.\n";
+    o_ << "typedef struct {\n";
+    o_ << "  uint64_t tag;\n";
+    o_ << "  uint64_t hash;\n";
+    o_ << "  size_t len;\n";
+    o_ << "} ls_str_hdr;\n";
+    o_ << "#define LS_STR_TAG 0x6C735F7374725F68ULL\n";
+    o_ << "static inline char *ls_str_take_in(ls_region *r, size_t n) {\n";
+    o_ << "  if (!r) return ls_scratch_take(n + 1);\n";
+    o_ << "  if (n > SIZE_MAX / 2) return NULL;\n";
+    o_ << "  char *raw = ls_region_alloc(r, sizeof(ls_str_hdr) + n + 1);\n";
+    o_ << "  if (!raw) return NULL;\n";
+    o_ << "  ((ls_str_hdr *)(void *)raw)->tag = 0;\n";
+    o_ << "  return raw + sizeof(ls_str_hdr);\n";
+    o_ << "}\n";
+    o_ << "static inline char *ls_str_take(size_t n) { return ls_str_take_in(ls_region_top, n); }\n";
+    o_ << "static inline const char *ls_str_seal_in(ls_region *r, char *out, size_t n) {\n";
+    o_ << "  out[n] = '\\0';\n";
+    o_ << "  if (r) {\n";
+    o_ << "    ls_str_hdr *h = (ls_str_hdr *)(void *)(out - sizeof(ls_str_hdr));\n";
+    o_ << "    h->tag = LS_STR_TAG ^ (uint64_t)(uintptr_t)out;\n";
+    o_ << "    h->hash = 0;\n";
+    o_ << "    h->len = n;\n";
+    o_ << "  }\n";
+    o_ << "  return out;\n";
+    o_ << "}\n";
+    o_ << "static inline const char *ls_str_seal(char *out, size_t n) { return ls_str_seal_in(ls_region_top, out, n); }\n";
+    o_ << "static inline ls_str_hdr *ls_str_header(const char *s) {\n";
+    o_ << "  if (((uintptr_t)s & 7u) != 0) return NULL;\n";
+    o_ << "  const ls_arena_chunk *c = ls_arena_owner(s);\n";
+    o_ << "  if (!c || (uintptr_t)s - (uintptr_t)(const void *)c < sizeof(ls_arena_chunk) + sizeof(ls_str_hdr)) return NULL;\n";
+    o_ << "  ls_str_hdr *h = (ls_str_hdr *)(void *)(uintptr_t)(s - sizeof(ls_str_hdr));\n";
+    o_ << "  return h->tag == (LS_STR_TAG ^ (uint64_t)(uintptr_t)s) ? h : NULL;\n";
+    o_ << "}\n";
+    o_ << "static inline size_t ls_str_len(const char *s) {\n";
+    o_ << "  if (!s || s[0] == '\\0') return 0;\n";
+    o_ << "  const ls_str_hdr *h = ls_str_header(s);\n";
+    o_ << "  return h ? h->len : strlen(s);\n";
+    o_ << "}\n";
     o_ << "static inline char *ls_heap_dup(const char *s) {\n";
     o_ << "  const char *src = s ? s : \"\";\n";
-    o_ << "  const size_t n = strlen(src);\n";
+    o_ << "  const size_t n = ls_str_len(src);\n";
     o_ << "  char *out = (char *)malloc(n + 1);\n";
     o_ << "  if (!out) return NULL;\n";
     o_ << "  memcpy(out, src, n);\n";
@@ -7224,12 +11383,11 @@ private:
     o_ << "}\n";
     o_ << "static inline const char *ls_scratch_dup(const char *s) {\n";
     o_ << "  const char *src = s ? s : \"\";\n";
-    o_ << "  const size_t n = strlen(src);\n";
-    o_ << "  char *out = ls_scratch_take(n + 1);\n";
+    o_ << "  const size_t n = ls_str_len(src);\n";
+    o_ << "  char *out = ls_str_take(n);\n";
     o_ << "  if (!out) return \"\";\n";
     o_ << "  memcpy(out, src, n);\n";
-    o_ << "  out[n] = '\\0';\n";
-    o_ << "  return out;\n";
+    o_ << "  return ls_str_seal(out, n);\n";
     o_ << "}\n";
     o_ << "static inline ls_bool ls_ptr_in_buf(const char *p, const char *buf, size_t cap) {\n";
     o_ << "  if (!p || !buf || cap == 0) return 0;\n";
@@ -7237,24 +11395,42 @@ private:
     o_ << "  const uintptr_t bv = (uintptr_t)(const void *)buf;\n";
     o_ << "  return (pv >= bv && pv < bv + cap) ? 1 : 0;\n";
     o_ << "}\n";
-    o_ << "static inline ls_bool ls_str_needs_hold(const char *s) {\n";
-    o_ << "  const char *src = s ? s : \"\";\n";
-    o_ << "  if (src[0] == '\\0') return 0;\n";
-    o_ << "  if (ls_ptr_in_buf(src, ls_fmt.buf, ls_fmt.cap)) return 1;\n";
+    o_ << "static inline ls_bool ls_str_volatile(const char *s) {\n";
+    o_ << "  if (ls_ptr_in_buf(s, ls_fmt.buf, ls_fmt.cap)) return 1;\n";
+    o_ << "  if (!ls_scratch_ring_used) return 0;\n";
     o_ << "  for (int i = 0; i < LS_SCRATCH_SLOTS; ++i) {\n";
-    o_ << "    if (ls_ptr_in_buf(src, ls_scratch_bufs[i], ls_scratch_caps[i])) return 1;\n";
+    o_ << "    if (ls_ptr_in_buf(s, ls_scratch_bufs[i], ls_scratch_caps[i])) return 1;\n";
     o_ << "  }\n";
     o_ << "  return 0;\n";
     o_ << "}\n";
+    o_ << "static inline const char *ls_str_copy_into(ls_region *r, const char *src) {\n";
+    o_ << "  const size_t n = ls_str_len(src);\n";
+    o_ << "  char *out = r ? ls_str_take_in(r, n) : (char *)malloc(n + 1);\n";
+    o_ << "  if (!out) return \"\";\n";
+    o_ << "  memcpy(out, src, n);\n";
+    o_ << "  return ls_str_seal_in(r, out, n);\n";
+    o_ << "}\n";
     o_ << "static inline const char *ls_str_hold(const char *s) {\n";
     o_ << "  const char *src = s ? s : \"\";\n";
-    o_ << "  if (!ls_str_needs_hold(src)) return src;\n";
-    o_ << "  char *dup = ls_heap_dup(src);\n";
-    o_ << "  return dup ? dup : \"\";\n";
+    o_ << "  if (src[0] == '\\0' || !ls_str_volatile(src)) return src;\n";
+    o_ << "  return ls_str_copy_into(ls_region_top, src);\n";
+    o_ << "}\n";
+    o_ << "static inline const char *ls_str_hold_in(ls_region *r, const char *s) {\n";
+    o_ << "  const char *src = s ? s : \"\";\n";
+    o_ << "  if (src[0] == '\\0') return src;\n";
+    o_ << "  if (!ls_str_volatile(src)) {\n";
+    o_ << "    const ls_arena_chunk *owner = ls_arena_owner(src);\n";
+    o_ << "    if (!owner || (r && owner->depth <= r->depth)) return src;\n";
+    o_ << "  }\n";
+    o_ << "  return ls_str_copy_into(r, src);\n";
+    o_ << "}\n";
+    o_ << "static inline const char *ls_str_return(ls_region *fn_region, const char *s) {\n";
+    o_ << "  return ls_str_hold_in(fn_region->prev, s);\n";
     o_ << "}\n";
     o_ << "static LS_THREAD_LOCAL char *ls_input_buf = NULL;\n";
     o_ << "static LS_THREAD_LOCAL size_t ls_input_cap = 0;\n";
     o_ << "static inline const char *input(void) {\n";
+    o_ << "  ls_out_flush();\n";
     o_ << "  if (ls_input_cap < 256) {\n";
     o_ << "    char *next = (char *)realloc(ls_input_buf, 256);\n";
     o_ << "    if (!next) return \"\";\n";
@@ -7291,8 +11467,8 @@ private:
     o_ << "  if (prompt) print_str(prompt);\n";
     o_ << "  return input();\n";
     o_ << "}\n";
-    o_ << "static inline int64_t bytes_len(const char *s) { return (int64_t)strlen(s ? s : \"\"); }\n";
-    o_ << "static inline int64_t len(const char *s) { return (int64_t)strlen(s ? s : \"\"); }\n";
+    o_ << "static inline int64_t bytes_len(const char *s) { return (int64_t)ls_str_len(s); }\n";
+    o_ << "static inline int64_t len(const char *s) { return (int64_t)ls_str_len(s); }\n";
     o_ << "static inline ls_bool includes(const char *s, const char *part) {\n";
     o_ << "  if (!s || !part) return 0;\n";
     o_ << "  return strstr(s, part) != NULL;\n";
@@ -7304,15 +11480,15 @@ private:
     o_ << "}\n";
     o_ << "static inline ls_bool starts_with(const char *s, const char *prefix) {\n";
     o_ << "  if (!s || !prefix) return 0;\n";
-    o_ << "  size_t n = strlen(prefix);\n";
+    o_ << "  size_t n = ls_str_len(prefix);\n";
     o_ << "  return strncmp(s, prefix, n) == 0;\n";
     o_ << "}\n";
     o_ << "static inline ls_bool ends_with(const char *s, const char *suffix) {\n";
     o_ << "  if (!s || !suffix) return 0;\n";
-    o_ << "  size_t ls = strlen(s);\n";
-    o_ << "  size_t ss = strlen(suffix);\n";
+    o_ << "  size_t ls = ls_str_len(s);\n";
+    o_ << "  size_t ss = ls_str_len(suffix);\n";
     o_ << "  if (ss > ls) return 0;\n";
-    o_ << "  return strncmp(s + ls - ss, suffix, ss) == 0;\n";
+    o_ << "  return memcmp(s + ls - ss, suffix, ss) == 0;\n";
     o_ << "}\n";
     o_ << "static inline int64_t find(const char *s, const char *part) {\n";
     o_ << "  if (!s || !part) return -1;\n";
@@ -7321,80 +11497,80 @@ private:
     o_ << "}\n";
     o_ << "static inline const char *lower(const char *s) {\n";
     o_ << "  const char *src = s ? s : \"\";\n";
-    o_ << "  const size_t n = strlen(src);\n";
-    o_ << "  char *out = ls_scratch_take(n + 1);\n";
+    o_ << "  const size_t n = ls_str_len(src);\n";
+    o_ << "  char *out = ls_str_take(n);\n";
     o_ << "  if (!out) return \"\";\n";
     o_ << "  for (size_t i = 0; i < n; ++i) out[i] = (char)tolower((unsigned char)src[i]);\n";
-    o_ << "  out[n] = '\\0';\n";
-    o_ << "  return out;\n";
+    o_ << "  return ls_str_seal(out, n);\n";
     o_ << "}\n";
     o_ << "static inline const char *upper(const char *s) {\n";
     o_ << "  const char *src = s ? s : \"\";\n";
-    o_ << "  const size_t n = strlen(src);\n";
-    o_ << "  char *out = ls_scratch_take(n + 1);\n";
+    o_ << "  const size_t n = ls_str_len(src);\n";
+    o_ << "  char *out = ls_str_take(n);\n";
     o_ << "  if (!out) return \"\";\n";
     o_ << "  for (size_t i = 0; i < n; ++i) out[i] = (char)toupper((unsigned char)src[i]);\n";
-    o_ << "  out[n] = '\\0';\n";
-    o_ << "  return out;\n";
+    o_ << "  return ls_str_seal(out, n);\n";
     o_ << "}\n";
+    o_ << "// A suffix of a region string (trim without trailing space, substring running to the end) is returned as a view:\n";
+    o_ << "// it shares the source's chunk, so ls_str_hold_in/ls_str_return see the source's lifetime and copy only when needed.\n";
+    o_ << "static inline ls_bool ls_str_can_view(const char *s) { return ls_str_header(s) != NULL; }\n";
     o_ << "static inline const char *trim(const char *s) {\n";
     o_ << "  const char *src = s ? s : \"\";\n";
     o_ << "  size_t start = 0;\n";
-    o_ << "  size_t end = strlen(src);\n";
+    o_ << "  const size_t len = ls_str_len(src);\n";
+    o_ << "  size_t end = len;\n";
     o_ << "  while (start < end && isspace((unsigned char)src[start])) ++start;\n";
     o_ << "  while (end > start && isspace((unsigned char)src[end - 1])) --end;\n";
     o_ << "  const size_t n = end - start;\n";
-    o_ << "  char *out = ls_scratch_take(n + 1);\n";
+    o_ << "  if (end == len && ls_str_can_view(src)) return src + start;\n";
+    o_ << "  char *out = ls_str_take(n);\n";
     o_ << "  if (!out) return \"\";\n";
     o_ << "  memcpy(out, src + start, n);\n";
-    o_ << "  out[n] = '\\0';\n";
-    o_ << "  return out;\n";
+    o_ << "  return ls_str_seal(out, n);\n";
     o_ << "}\n";
     o_ << "static inline const char *substring(const char *s, int64_t start, int64_t count) {\n";
     o_ << "  const char *src = s ? s : \"\";\n";
-    o_ << "  const int64_t n = (int64_t)strlen(src);\n";
+    o_ << "  const int64_t n = (int64_t)ls_str_len(src);\n";
     o_ << "  if (start < 0) start = 0;\n";
     o_ << "  if (start > n) start = n;\n";
     o_ << "  if (count < 0) count = 0;\n";
     o_ << "  if (count > n - start) count = n - start;\n";
-    o_ << "  char *out = ls_scratch_take((size_t)count + 1);\n";
+    o_ << "  if (start + count == n && ls_str_can_view(src)) return src + start;\n";
+    o_ << "  char *out = ls_str_take((size_t)count);\n";
     o_ << "  if (!out) return \"\";\n";
     o_ << "  memcpy(out, src + start, (size_t)count);\n";
-    o_ << "  out[count] = '\\0';\n";
-    o_ << "  return out;\n";
+    o_ << "  return ls_str_seal(out, (size_t)count);\n";
     o_ << "}\n";
     o_ << "static inline const char *repeat(const char *s, int64_t n) {\n";
     o_ << "  const char *src = s ? s : \"\";\n";
-    o_ << "  const size_t slen = strlen(src);\n";
+    o_ << "  const size_t slen = ls_str_len(src);\n";
     o_ << "  if (n <= 0 || slen == 0) return \"\";\n";
     o_ << "  if ((size_t)n > (SIZE_MAX - 1) / slen) return \"\";\n";
     o_ << "  const size_t outLen = (size_t)n * slen;\n";
-    o_ << "  char *out = ls_scratch_take(outLen + 1);\n";
+    o_ << "  char *out = ls_str_take(outLen);\n";
     o_ << "  if (!out) return \"\";\n";
     o_ << "  size_t pos = 0;\n";
     o_ << "  for (int64_t i = 0; i < n; ++i) {\n";
     o_ << "    memcpy(out + pos, src, slen);\n";
     o_ << "    pos += slen;\n";
     o_ << "  }\n";
-    o_ << "  out[outLen] = '\\0';\n";
-    o_ << "  return out;\n";
+    o_ << "  return ls_str_seal(out, outLen);\n";
     o_ << "}\n";
     o_ << "static inline const char *reverse(const char *s) {\n";
     o_ << "  const char *src = s ? s : \"\";\n";
-    o_ << "  const size_t n = strlen(src);\n";
-    o_ << "  char *out = ls_scratch_take(n + 1);\n";
+    o_ << "  const size_t n = ls_str_len(src);\n";
+    o_ << "  char *out = ls_str_take(n);\n";
     o_ << "  if (!out) return \"\";\n";
     o_ << "  for (size_t i = 0; i < n; ++i) out[i] = src[n - 1 - i];\n";
-    o_ << "  out[n] = '\\0';\n";
-    o_ << "  return out;\n";
+    o_ << "  return ls_str_seal(out, n);\n";
     o_ << "}\n";
     o_ << "static inline const char *replace(const char *s, const char *from, const char *to) {\n";
     o_ << "  const char *src = s ? s : \"\";\n";
     o_ << "  const char *needle = from ? from : \"\";\n";
     o_ << "  const char *rep = to ? to : \"\";\n";
-    o_ << "  const size_t srcLen = strlen(src);\n";
-    o_ << "  const size_t nLen = strlen(needle);\n";
-    o_ << "  const size_t rLen = strlen(rep);\n";
+    o_ << "  const size_t srcLen = ls_str_len(src);\n";
+    o_ << "  const size_t nLen = ls_str_len(needle);\n";
+    o_ << "  const size_t rLen = ls_str_len(rep);\n";
     o_ << "  if (nLen == 0) return ls_scratch_dup(src);\n";
     o_ << "  size_t count = 0;\n";
     o_ << "  const char *cur = src;\n";
@@ -7415,7 +11591,7 @@ private:
     o_ << "    if (shrink > 0 && count > srcLen / shrink) return \"\";\n";
     o_ << "    outLen = srcLen - count * shrink;\n";
     o_ << "  }\n";
-    o_ << "  char *out = ls_scratch_take(outLen + 1);\n";
+    o_ << "  char *out = ls_str_take(outLen);\n";
     o_ << "  if (!out) return \"\";\n";
     o_ << "  size_t pos = 0;\n";
     o_ << "  cur = src;\n";
@@ -7429,15 +11605,14 @@ private:
     o_ << "    pos += rLen;\n";
     o_ << "    cur = p + nLen;\n";
     o_ << "  }\n";
-    o_ << "  const size_t tail = strlen(cur);\n";
+    o_ << "  const size_t tail = srcLen - (size_t)(cur - src);\n";
     o_ << "  memcpy(out + pos, cur, tail);\n";
     o_ << "  pos += tail;\n";
-    o_ << "  out[pos] = '\\0';\n";
-    o_ << "  return out;\n";
+    o_ << "  return ls_str_seal(out, pos);\n";
     o_ << "}\n";
     o_ << "static inline int64_t byte_at(const char *s, int64_t idx) {\n";
     o_ << "  const char *src = s ? s : \"\";\n";
-    o_ << "  const int64_t n = (int64_t)strlen(src);\n";
+    o_ << "  const int64_t n = (int64_t)ls_str_len(src);\n";
     o_ << "  if (idx < 0 || idx >= n) return -1;\n";
     o_ << "  return (int64_t)(unsigned char)src[idx];\n";
     o_ << "}\n";
@@ -7448,11 +11623,10 @@ private:
     o_ << "}\n";
     o_ << "static inline const char *chr(int64_t code) {\n";
     o_ << "  if (code < 0 || code > 255) return \"\";\n";
-    o_ << "  char *out = ls_scratch_take(2);\n";
+    o_ << "  char *out = ls_str_take(1);\n";
     o_ << "  if (!out) return \"\";\n";
     o_ << "  out[0] = (char)code;\n";
-    o_ << "  out[1] = '\\0';\n";
-    o_ << "  return out;\n";
+    o_ << "  return ls_str_seal(out, 1);\n";
     o_ << "}\n";
     o_ << "static inline int64_t mem_alloc(int64_t bytes) {\n";
     o_ << "  if (bytes <= 0) return 0;\n";
@@ -7521,50 +11695,121 @@ private:
     o_ << "  if (ptr == 0) return;\n";
     o_ << "  memcpy((void *)(intptr_t)ptr, &v, sizeof(v));\n";
     o_ << "}\n";
-    o_ << "#define LS_MAX_ARRAYS 2048\n";
+    o_ << "// Handle tables grow in fixed pages, so slot addresses stay stable while new handles are allocated.\n";
+    o_ << "#define LS_HANDLE_PAGE_SHIFT 8\n";
+    o_ << "#define LS_HANDLE_PAGE ((int64_t)1 << LS_HANDLE_PAGE_SHIFT)\n";
+    o_ << "typedef struct {\n";
+    o_ << "  char **pages;\n";
+    o_ << "  int64_t page_cap;\n";
+    o_ << "  int64_t count;\n";
+    o_ << "  int64_t *free_ids;\n";
+    o_ << "  int64_t free_top;\n";
+    o_ << "  int64_t free_cap;\n";
+    o_ << "  size_t elem;\n";
+    o_ << "  int64_t max;\n";
+    o_ << "} ls_handle_table;\n";
+    o_ << "static inline int64_t ls_handle_alloc(ls_handle_table *t) {\n";
+    o_ << "  if (t->free_top > 0) return t->free_ids[--t->free_top];\n";
+    o_ << "  if (t->count >= t->max) return -1;\n";
+    o_ << "  const int64_t page = t->count >> LS_HANDLE_PAGE_SHIFT;\n";
+    o_ << "  if (page >= t->page_cap) {\n";
+    o_ << "    const int64_t nextCap = t->page_cap > 0 ? t->page_cap * 2 : 16;\n";
+    o_ << "    char **next = (char **)realloc(t->pages, (size_t)nextCap * sizeof(char *));\n";
+    o_ << "    if (!next) return -1;\n";
+    o_ << "    for (int64_t i = t->page_cap; i < nextCap; ++i) next[i] = NULL;\n";
+    o_ << "    t->pages = next;\n";
+    o_ << "    t->page_cap = nextCap;\n";
+    o_ << "  }\n";
+    o_ << "  if (!t->pages[page]) {\n";
+    o_ << "    t->pages[page] = (char *)calloc((size_t)LS_HANDLE_PAGE, t->elem);\n";
+    o_ << "    if (!t->pages[page]) return -1;\n";
+    o_ << "  }\n";
+    o_ << "  return t->count++;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_handle_release(ls_handle_table *t, int64_t id) {\n";
+    o_ << "  if (id < 0 || id >= t->count) return;\n";
+    o_ << "  if (t->free_top >= t->free_cap) {\n";
+    o_ << "    const int64_t nextCap = t->free_cap > 0 ? t->free_cap * 2 : 64;\n";
+    o_ << "    int64_t *next = (int64_t *)realloc(t->free_ids, (size_t)nextCap * sizeof(int64_t));\n";
+    o_ << "    if (!next) return;\n";
+    o_ << "    t->free_ids = next;\n";
+    o_ << "    t->free_cap = nextCap;\n";
+    o_ << "  }\n";
+    o_ << "  t->free_ids[t->free_top++] = id;\n";
+    o_ << "}\n";
+    o_ << "static inline void *ls_handle_at(const ls_handle_table *t, int64_t id) {\n";
+    o_ << "  if (id < 0 || id >= t->count) return NULL;\n";
+    o_ << "  return t->pages[id >> LS_HANDLE_PAGE_SHIFT] + (size_t)(id & (LS_HANDLE_PAGE - 1)) * t->elem;\n";
+    o_ << "}\n";
+    o_ << "#define LS_ELEM_STR 0\n";
+    o_ << "#define LS_ELEM_I64 1\n";
+    o_ << "#define LS_ELEM_F64 2\n";
+    o_ << "#define LS_ELEM_ALIGN 64\n";
+    o_ << "static inline void *ls_elem_realloc(void *old, size_t oldBytes, size_t bytes) {\n";
+    o_ << "  void *raw = malloc(bytes + LS_ELEM_ALIGN);\n";
+    o_ << "  if (!raw) return NULL;\n";
+    o_ << "  char *at = (char *)(((uintptr_t)raw + LS_ELEM_ALIGN) & ~(uintptr_t)(LS_ELEM_ALIGN - 1));\n";
+    o_ << "  ((void **)(void *)at)[-1] = raw;\n";
+    o_ << "  if (old) {\n";
+    o_ << "    memcpy(at, old, oldBytes);\n";
+    o_ << "    free(((void **)old)[-1]);\n";
+    o_ << "  }\n";
+    o_ << "  memset(at + oldBytes, 0, bytes - oldBytes);\n";
+    o_ << "  return at;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_elem_free(void *p) {\n";
+    o_ << "  if (p) free(((void **)p)[-1]);\n";
+    o_ << "}\n";
+    o_ << "#ifndef LS_MAX_ARRAYS\n";
+    o_ << "#define LS_MAX_ARRAYS ((int64_t)1 << 24)\n";
+    o_ << "#endif\n";
     o_ << "typedef struct {\n";
     o_ << "  char **items;\n";
+    o_ << "  void *data;\n";
     o_ << "  int64_t len;\n";
     o_ << "  int64_t cap;\n";
     o_ << "  ls_bool active;\n";
+    o_ << "  int kind;\n";
     o_ << "} ls_array;\n";
-    o_ << "static ls_array ls_arrays[LS_MAX_ARRAYS];\n";
-    o_ << "static int64_t ls_array_count = 0;\n";
-    o_ << "static int64_t ls_array_free_ids[LS_MAX_ARRAYS];\n";
-    o_ << "static int64_t ls_array_free_top = 0;\n";
-    o_ << "static inline int64_t ls_array_alloc_id(void) {\n";
-    o_ << "  if (ls_array_free_top > 0) return ls_array_free_ids[--ls_array_free_top];\n";
-    o_ << "  if (ls_array_count >= LS_MAX_ARRAYS) return -1;\n";
-    o_ << "  return ls_array_count++;\n";
-    o_ << "}\n";
-    o_ << "static inline void ls_array_release_id(int64_t id) {\n";
-    o_ << "  if (id < 0 || id >= LS_MAX_ARRAYS) return;\n";
-    o_ << "  if (ls_array_free_top < LS_MAX_ARRAYS) ls_array_free_ids[ls_array_free_top++] = id;\n";
-    o_ << "}\n";
+    o_ << "static ls_handle_table ls_array_table = {NULL, 0, 0, NULL, 0, 0, sizeof(ls_array), LS_MAX_ARRAYS};\n";
     o_ << "static inline ls_array *ls_get_array(int64_t id) {\n";
-    o_ << "  if (id < 0 || id >= ls_array_count) return NULL;\n";
-    o_ << "  if (!ls_arrays[id].active) return NULL;\n";
-    o_ << "  return &ls_arrays[id];\n";
+    o_ << "  ls_array *a = (ls_array *)ls_handle_at(&ls_array_table, id);\n";
+    o_ << "  return a && a->active ? a : NULL;\n";
+    o_ << "}\n";
+    o_ << "static inline ls_array *ls_get_array_kind(int64_t id, int kind) {\n";
+    o_ << "  ls_array *a = ls_get_array(id);\n";
+    o_ << "  return a && a->kind == kind ? a : NULL;\n";
     o_ << "}\n";
     o_ << "static inline void ls_array_reserve(ls_array *a, int64_t need) {\n";
     o_ << "  if (!a || need <= a->cap) return;\n";
     o_ << "  int64_t nextCap = a->cap > 0 ? a->cap : 8;\n";
     o_ << "  while (nextCap < need) nextCap <<= 1;\n";
+    o_ << "  if (a->kind != LS_ELEM_STR) {\n";
+    o_ << "    void *next = ls_elem_realloc(a->data, (size_t)a->cap * 8u, (size_t)nextCap * 8u);\n";
+    o_ << "    if (!next) return;\n";
+    o_ << "    a->data = next;\n";
+    o_ << "    a->cap = nextCap;\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
     o_ << "  char **next = (char **)realloc(a->items, (size_t)nextCap * sizeof(char *));\n";
     o_ << "  if (!next) return;\n";
     o_ << "  for (int64_t i = a->cap; i < nextCap; ++i) next[i] = NULL;\n";
     o_ << "  a->items = next;\n";
     o_ << "  a->cap = nextCap;\n";
     o_ << "}\n";
-    o_ << "static inline int64_t array_new(void) {\n";
-    o_ << "  const int64_t id = ls_array_alloc_id();\n";
+    o_ << "static inline int64_t ls_array_new_kind(int kind) {\n";
+    o_ << "  const int64_t id = ls_handle_alloc(&ls_array_table);\n";
     o_ << "  if (id < 0) return -1;\n";
-    o_ << "  ls_arrays[id].items = NULL;\n";
-    o_ << "  ls_arrays[id].len = 0;\n";
-    o_ << "  ls_arrays[id].cap = 0;\n";
-    o_ << "  ls_arrays[id].active = 1;\n";
+    o_ << "  ls_array *a = (ls_array *)ls_handle_at(&ls_array_table, id);\n";
+    o_ << "  a->items = NULL;\n";
+    o_ << "  a->data = NULL;\n";
+    o_ << "  a->len = 0;\n";
+    o_ << "  a->cap = 0;\n";
+    o_ << "  a->kind = kind;\n";
+    o_ << "  a->active = 1;\n";
     o_ << "  return id;\n";
     o_ << "}\n";
+    o_ << "static inline int64_t array_new(void) { return ls_array_new_kind(LS_ELEM_STR); }\n";
     o_ << "static inline int64_t array_len(int64_t id) {\n";
     o_ << "  ls_array *a = ls_get_array(id);\n";
     o_ << "  return a ? a->len : 0;\n";
@@ -7572,21 +11817,43 @@ private:
     o_ << "static inline void array_free(int64_t id) {\n";
     o_ << "  ls_array *a = ls_get_array(id);\n";
     o_ << "  if (!a) return;\n";
-    o_ << "  for (int64_t i = 0; i < a->len; ++i) {\n";
+    o_ << "  for (int64_t i = 0; a->items && i < a->len; ++i) {\n";
     o_ << "    if (a->items[i]) free(a->items[i]);\n";
     o_ << "  }\n";
     o_ << "  if (a->items) free(a->items);\n";
+    o_ << "  ls_elem_free(a->data);\n";
     o_ << "  a->items = NULL;\n";
+    o_ << "  a->data = NULL;\n";
     o_ << "  a->len = 0;\n";
     o_ << "  a->cap = 0;\n";
     o_ << "  a->active = 0;\n";
-    o_ << "  ls_array_release_id(id);\n";
+    o_ << "  ls_handle_release(&ls_array_table, id);\n";
+    o_ << "}\n";
+    o_ << "/* The string accessors also work on i64/f64 arrays, for handles the compiler cannot see were built typed (returned\n";
+    o_ << "   from a function or passed in as a parameter): elements read as their decimal text and writes parse the text. */\n";
+    o_ << "static inline size_t ls_array_elem_dec(const ls_array *a, int64_t idx, char *out) {\n";
+    o_ << "  if (a->kind == LS_ELEM_I64) return ls_i64_to_dec(((const int64_t *)a->data)[idx], out);\n";
+    o_ << "  return ls_f64_to_dec(((const double *)a->data)[idx], out);\n";
+    o_ << "}\n";
+    o_ << "static inline const char *ls_array_elem_text(const ls_array *a, int64_t idx) {\n";
+    o_ << "  char b[32];\n";
+    o_ << "  b[ls_array_elem_dec(a, idx, b)] = '\\0';\n";
+    o_ << "  return ls_scratch_dup(b);\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_array_elem_parse(ls_array *a, int64_t idx, const char *value) {\n";
+    o_ << "  const char *v = value ? value : \"\";\n";
+    o_ << "  if (a->kind == LS_ELEM_I64) ((int64_t *)a->data)[idx] = (int64_t)strtoll(v, NULL, 10);\n";
+    o_ << "  else ((double *)a->data)[idx] = strtod(v, NULL);\n";
     o_ << "}\n";
     o_ << "static inline void array_push(int64_t id, const char *value) {\n";
     o_ << "  ls_array *a = ls_get_array(id);\n";
     o_ << "  if (!a) return;\n";
     o_ << "  ls_array_reserve(a, a->len + 1);\n";
     o_ << "  if (a->len >= a->cap) return;\n";
+    o_ << "  if (a->kind != LS_ELEM_STR) {\n";
+    o_ << "    ls_array_elem_parse(a, a->len++, value);\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
     o_ << "  a->items[a->len] = ls_heap_dup(value);\n";
     o_ << "  if (!a->items[a->len]) a->items[a->len] = ls_heap_dup(\"\");\n";
     o_ << "  if (!a->items[a->len]) return;\n";
@@ -7595,6 +11862,7 @@ private:
     o_ << "static inline const char *array_get(int64_t id, int64_t idx) {\n";
     o_ << "  ls_array *a = ls_get_array(id);\n";
     o_ << "  if (!a || idx < 0 || idx >= a->len) return \"\";\n";
+    o_ << "  if (a->kind != LS_ELEM_STR) return ls_array_elem_text(a, idx);\n";
     o_ << "  return a->items[idx] ? a->items[idx] : \"\";\n";
     o_ << "}\n";
     o_ << "static inline void array_set(int64_t id, int64_t idx, const char *value) {\n";
@@ -7602,6 +11870,11 @@ private:
     o_ << "  if (!a || idx < 0) return;\n";
     o_ << "  ls_array_reserve(a, idx + 1);\n";
     o_ << "  if (idx >= a->cap) return;\n";
+    o_ << "  if (a->kind != LS_ELEM_STR) {\n";
+    o_ << "    if (a->len <= idx) a->len = idx + 1;\n";
+    o_ << "    ls_array_elem_parse(a, idx, value);\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
     o_ << "  while (a->len <= idx) {\n";
     o_ << "    a->items[a->len] = ls_heap_dup(\"\");\n";
     o_ << "    if (!a->items[a->len]) return;\n";
@@ -7615,6 +11888,11 @@ private:
     o_ << "  ls_array *a = ls_get_array(id);\n";
     o_ << "  if (!a || a->len <= 0) return \"\";\n";
     o_ << "  --a->len;\n";
+    o_ << "  if (a->kind != LS_ELEM_STR) {\n";
+    o_ << "    const char *out = ls_array_elem_text(a, a->len);\n";
+    o_ << "    memset((char *)a->data + (size_t)a->len * 8u, 0, 8u);\n";
+    o_ << "    return out;\n";
+    o_ << "  }\n";
     o_ << "  const char *v = a->items[a->len] ? a->items[a->len] : \"\";\n";
     o_ << "  const char *out = ls_scratch_dup(v);\n";
     o_ << "  if (a->items[a->len]) free(a->items[a->len]);\n";
@@ -7625,8 +11903,13 @@ private:
     o_ << "  ls_array *a = ls_get_array(id);\n";
     o_ << "  if (!a) return 0;\n";
     o_ << "  const char *needle = value ? value : \"\";\n";
+    o_ << "  char b[32];\n";
     o_ << "  for (int64_t i = 0; i < a->len; ++i) {\n";
-    o_ << "    const char *x = a->items[i] ? a->items[i] : \"\";\n";
+    o_ << "    const char *x = a->items && a->items[i] ? a->items[i] : \"\";\n";
+    o_ << "    if (a->kind != LS_ELEM_STR) {\n";
+    o_ << "      b[ls_array_elem_dec(a, i, b)] = '\\0';\n";
+    o_ << "      x = b;\n";
+    o_ << "    }\n";
     o_ << "    if (strcmp(x, needle) == 0) return 1;\n";
     o_ << "  }\n";
     o_ << "  return 0;\n";
@@ -7635,18 +11918,20 @@ private:
     o_ << "  ls_array *a = ls_get_array(id);\n";
     o_ << "  if (!a || a->len == 0) return \"\";\n";
     o_ << "  const char *glue = sep ? sep : \"\";\n";
-    o_ << "  const size_t glueLen = strlen(glue);\n";
+    o_ << "  const size_t glueLen = ls_str_len(glue);\n";
+    o_ << "  const ls_bool numeric = a->kind != LS_ELEM_STR;\n";
+    o_ << "  char b[32];\n";
     o_ << "  size_t outLen = 0;\n";
     o_ << "  for (int64_t i = 0; i < a->len; ++i) {\n";
-    o_ << "    outLen += strlen(a->items[i] ? a->items[i] : \"\");\n";
+    o_ << "    outLen += numeric ? ls_array_elem_dec(a, i, b) : strlen(a->items[i] ? a->items[i] : \"\");\n";
     o_ << "    if (i + 1 < a->len) outLen += glueLen;\n";
     o_ << "  }\n";
-    o_ << "  char *out = ls_scratch_take(outLen + 1);\n";
+    o_ << "  char *out = ls_str_take(outLen);\n";
     o_ << "  if (!out) return \"\";\n";
     o_ << "  size_t pos = 0;\n";
     o_ << "  for (int64_t i = 0; i < a->len; ++i) {\n";
-    o_ << "    const char *x = a->items[i] ? a->items[i] : \"\";\n";
-    o_ << "    const size_t n = strlen(x);\n";
+    o_ << "    const char *x = numeric ? b : a->items[i] ? a->items[i] : \"\";\n";
+    o_ << "    const size_t n = numeric ? ls_array_elem_dec(a, i, b) : strlen(x);\n";
     o_ << "    memcpy(out + pos, x, n);\n";
     o_ << "    pos += n;\n";
     o_ << "    if (i + 1 < a->len && glueLen > 0) {\n";
@@ -7654,109 +11939,334 @@ private:
     o_ << "      pos += glueLen;\n";
     o_ << "    }\n";
     o_ << "  }\n";
-    o_ << "  out[pos] = '\\0';\n";
+    o_ << "  return ls_str_seal(out, pos);\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t array_new_i64(void) { return ls_array_new_kind(LS_ELEM_I64); }\n";
+    o_ << "static inline void array_push_i64(int64_t id, int64_t value) {\n";
+    o_ << "  ls_array *a = ls_get_array_kind(id, LS_ELEM_I64);\n";
+    o_ << "  if (!a) return;\n";
+    o_ << "  ls_array_reserve(a, a->len + 1);\n";
+    o_ << "  if (a->len >= a->cap) return;\n";
+    o_ << "  ((int64_t *)a->data)[a->len++] = value;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t array_get_i64(int64_t id, int64_t idx) {\n";
+    o_ << "  ls_array *a = ls_get_array_kind(id, LS_ELEM_I64);\n";
+    o_ << "  if (!a || idx < 0 || idx >= a->len) return 0;\n";
+    o_ << "  return ((int64_t *)a->data)[idx];\n";
+    o_ << "}\n";
+    o_ << "static inline void array_set_i64(int64_t id, int64_t idx, int64_t value) {\n";
+    o_ << "  ls_array *a = ls_get_array_kind(id, LS_ELEM_I64);\n";
+    o_ << "  if (!a || idx < 0) return;\n";
+    o_ << "  ls_array_reserve(a, idx + 1);\n";
+    o_ << "  if (idx >= a->cap) return;\n";
+    o_ << "  if (a->len <= idx) a->len = idx + 1;\n";
+    o_ << "  ((int64_t *)a->data)[idx] = value;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t array_pop_i64(int64_t id) {\n";
+    o_ << "  ls_array *a = ls_get_array_kind(id, LS_ELEM_I64);\n";
+    o_ << "  if (!a || a->len <= 0) return 0;\n";
+    o_ << "  --a->len;\n";
+    o_ << "  const int64_t out = ((int64_t *)a->data)[a->len];\n";
+    o_ << "  ((int64_t *)a->data)[a->len] = 0;\n";
+    o_ << "  return out;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t array_sum_i64(int64_t id) {\n";
+    o_ << "  ls_array *a = ls_get_array_kind(id, LS_ELEM_I64);\n";
+    o_ << "  if (!a) return 0;\n";
+    o_ << "  const int64_t *v = (const int64_t *)a->data;\n";
+    o_ << "  int64_t total = 0;\n";
+    o_ << "  LS_OMP_SIMD_REDUCTION_PLUS(total)\n";
+    o_ << "  for (int64_t i = 0; i < a->len; ++i) total += v[i];\n";
+    o_ << "  return total;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t array_new_f64(void) { return ls_array_new_kind(LS_ELEM_F64); }\n";
+    o_ << "static inline void array_push_f64(int64_t id, double value) {\n";
+    o_ << "  ls_array *a = ls_get_array_kind(id, LS_ELEM_F64);\n";
+    o_ << "  if (!a) return;\n";
+    o_ << "  ls_array_reserve(a, a->len + 1);\n";
+    o_ << "  if (a->len >= a->cap) return;\n";
+    o_ << "  ((double *)a->data)[a->len++] = value;\n";
+    o_ << "}\n";
+    o_ << "static inline double array_get_f64(int64_t id, int64_t idx) {\n";
+    o_ << "  ls_array *a = ls_get_array_kind(id, LS_ELEM_F64);\n";
+    o_ << "  if (!a || idx < 0 || idx >= a->len) return 0.0;\n";
+    o_ << "  return ((double *)a->data)[idx];\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t __ls_array_len_i64(int64_t id) {\n";
+    o_ << "  ls_array *a = ls_get_array_kind(id, LS_ELEM_I64);\n";
+    o_ << "  return a ? a->len : 0;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t __ls_array_len_f64(int64_t id) {\n";
+    o_ << "  ls_array *a = ls_get_array_kind(id, LS_ELEM_F64);\n";
+    o_ << "  return a ? a->len : 0;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t __ls_array_get_i64_unchecked(int64_t id, int64_t idx) {\n";
+    o_ << "  return ((int64_t *)ls_get_array(id)->data)[idx];\n";
+    o_ << "}\n";
+    o_ << "static inline double __ls_array_get_f64_unchecked(int64_t id, int64_t idx) {\n";
+    o_ << "  return ((double *)ls_get_array(id)->data)[idx];\n";
+    o_ << "}\n";
+    o_ << "static inline void array_set_f64(int64_t id, int64_t idx, double value) {\n";
+    o_ << "  ls_array *a = ls_get_array_kind(id, LS_ELEM_F64);\n";
+    o_ << "  if (!a || idx < 0) return;\n";
+    o_ << "  ls_array_reserve(a, idx + 1);\n";
+    o_ << "  if (idx >= a->cap) return;\n";
+    o_ << "  if (a->len <= idx) a->len = idx + 1;\n";
+    o_ << "  ((double *)a->data)[idx] = value;\n";
+    o_ << "}\n";
+    o_ << "static inline double array_pop_f64(int64_t id) {\n";
+    o_ << "  ls_array *a = ls_get_array_kind(id, LS_ELEM_F64);\n";
+    o_ << "  if (!a || a->len <= 0) return 0.0;\n";
+    o_ << "  --a->len;\n";
+    o_ << "  const double out = ((double *)a->data)[a->len];\n";
+    o_ << "  ((double *)a->data)[a->len] = 0.0;\n";
     o_ << "  return out;\n";
     o_ << "}\n";
-    o_ << "#define LS_MAX_DICTS 2048\n";
+    o_ << "static inline double array_sum_f64(int64_t id) {\n";
+    o_ << "  ls_array *a = ls_get_array_kind(id, LS_ELEM_F64);\n";
+    o_ << "  if (!a) return 0.0;\n";
+    o_ << "  const double *v = (const double *)a->data;\n";
+    o_ << "  double total = 0.0;\n";
+    o_ << "  LS_OMP_SIMD_REDUCTION_PLUS(total)\n";
+    o_ << "  for (int64_t i = 0; i < a->len; ++i) total += v[i];\n";
+    o_ << "  return total;\n";
+    o_ << "}\n";
+    o_ << "#ifndef LS_MAX_DICTS\n";
+    o_ << "#define LS_MAX_DICTS ((int64_t)1 << 24)\n";
+    o_ << "#endif\n";
+    o_ << "// Keys up to LS_DICT_INLINE_KEY bytes live entirely in the entry; longer keys keep their first\n";
+    o_ << "// bytes inline and the full copy on the heap, so a probe only leaves the table on a likely match.\n";
+    o_ << "#define LS_DICT_INLINE_KEY 12\n";
     o_ << "typedef struct {\n";
     o_ << "  char *key;\n";
-    o_ << "  char *value;\n";
+    o_ << "  union {\n";
+    o_ << "    char *value;\n";
+    o_ << "    int64_t ival;\n";
+    o_ << "    double fval;\n";
+    o_ << "  };\n";
     o_ << "  uint32_t key_len;\n";
-    o_ << "  uint64_t hash;\n";
-    o_ << "  ls_bool used;\n";
-    o_ << "  ls_bool tomb;\n";
+    o_ << "  char head[LS_DICT_INLINE_KEY];\n";
     o_ << "} ls_dict_entry;\n";
+    o_ << "// Swiss-table layout: one control byte per slot, kept apart from the entries and probed a\n";
+    o_ << "// 16-slot group at a time. Live slots store the low 7 hash bits; free slots have the high bit set.\n";
+    o_ << "#define LS_DICT_GROUP 16\n";
+    o_ << "#define LS_CTRL_EMPTY ((uint8_t)0x80)\n";
+    o_ << "#define LS_CTRL_DELETED ((uint8_t)0xFE)\n";
     o_ << "typedef struct {\n";
+    o_ << "  uint8_t *ctrl;\n";
     o_ << "  ls_dict_entry *items;\n";
     o_ << "  int64_t len;\n";
     o_ << "  int64_t cap;\n";
+    o_ << "  int64_t tombs;\n";
     o_ << "  ls_bool active;\n";
+    o_ << "  int kind;\n";
     o_ << "} ls_dict;\n";
-    o_ << "static ls_dict ls_dicts[LS_MAX_DICTS];\n";
-    o_ << "static int64_t ls_dict_count = 0;\n";
-    o_ << "static int64_t ls_dict_free_ids[LS_MAX_DICTS];\n";
-    o_ << "static int64_t ls_dict_free_top = 0;\n";
-    o_ << "static inline int64_t ls_dict_alloc_id(void) {\n";
-    o_ << "  if (ls_dict_free_top > 0) return ls_dict_free_ids[--ls_dict_free_top];\n";
-    o_ << "  if (ls_dict_count >= LS_MAX_DICTS) return -1;\n";
-    o_ << "  return ls_dict_count++;\n";
-    o_ << "}\n";
-    o_ << "static inline void ls_dict_release_id(int64_t id) {\n";
-    o_ << "  if (id < 0 || id >= LS_MAX_DICTS) return;\n";
-    o_ << "  if (ls_dict_free_top < LS_MAX_DICTS) ls_dict_free_ids[ls_dict_free_top++] = id;\n";
+    o_ << "static ls_handle_table ls_dict_table = {NULL, 0, 0, NULL, 0, 0, sizeof(ls_dict), LS_MAX_DICTS};\n";
+    o_ << "#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)\n";
+    o_ << "#include <emmintrin.h>\n";
+    o_ << "#define LS_DICT_SSE2 1\n";
+    o_ << "#elif defined(__aarch64__) || defined(_M_ARM64)\n";
+    o_ << "#include <arm_neon.h>\n";
+    o_ << "#define LS_DICT_NEON 1\n";
+    o_ << "#endif\n";
+    o_ << "#if defined(LS_DICT_NEON)\n";
+    o_ << "static inline uint32_t ls_group_bits(uint8x16_t lanes) {\n";
+    o_ << "  static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};\n";
+    o_ << "  const uint8x16_t masked = vandq_u8(lanes, vld1q_u8(weights));\n";
+    o_ << "  return (uint32_t)vaddv_u8(vget_low_u8(masked)) | ((uint32_t)vaddv_u8(vget_high_u8(masked)) << 8);\n";
     o_ << "}\n";
-    o_ << "static inline uint64_t ls_hash_str(const char *s) {\n";
-    o_ << "  const unsigned char *p = (const unsigned char *)(s ? s : \"\");\n";
-    o_ << "  uint64_t h = 1469598103934665603ULL;\n";
-    o_ << "  while (*p) {\n";
-    o_ << "    h ^= (uint64_t)(*p++);\n";
-    o_ << "    h *= 1099511628211ULL;\n";
+    o_ << "#endif\n";
+    o_ << "static inline uint32_t ls_group_match(const uint8_t *g, uint8_t b) {\n";
+    o_ << "#if defined(LS_DICT_SSE2)\n";
+    o_ << "  const __m128i lanes = _mm_loadu_si128((const __m128i *)(const void *)g);\n";
+    o_ << "  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lanes, _mm_set1_epi8((char)b)));\n";
+    o_ << "#elif defined(LS_DICT_NEON)\n";
+    o_ << "  return ls_group_bits(vceqq_u8(vld1q_u8(g), vdupq_n_u8(b)));\n";
+    o_ << "#else\n";
+    o_ << "  uint32_t m = 0;\n";
+    o_ << "  for (int i = 0; i < LS_DICT_GROUP; ++i) m |= (uint32_t)(g[i] == b) << i;\n";
+    o_ << "  return m;\n";
+    o_ << "#endif\n";
+    o_ << "}\n";
+    o_ << "static inline uint32_t ls_group_free(const uint8_t *g) {\n";
+    o_ << "#if defined(LS_DICT_SSE2)\n";
+    o_ << "  return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(const void *)g));\n";
+    o_ << "#elif defined(LS_DICT_NEON)\n";
+    o_ << "  return ls_group_bits(vcltq_s8(vreinterpretq_s8_u8(vld1q_u8(g)), vdupq_n_s8(0)));\n";
+    o_ << "#else\n";
+    o_ << "  uint32_t m = 0;\n";
+    o_ << "  for (int i = 0; i < LS_DICT_GROUP; ++i) m |= (uint32_t)(g[i] >> 7) << i;\n";
+    o_ << "  return m;\n";
+    o_ << "#endif\n";
+    o_ << "}\n";
+    o_ << "static inline int ls_ctz_u32(uint32_t x) {\n";
+    o_ << "#if defined(__clang__) || defined(__GNUC__)\n";
+    o_ << "  return __builtin_ctz(x);\n";
+    o_ << "#else\n";
+    o_ << "  int n = 0;\n";
+    o_ << "  while ((x & 1u) == 0u) {\n";
+    o_ << "    x >>= 1u;\n";
+    o_ << "    ++n;\n";
     o_ << "  }\n";
-    o_ << "  return h;\n";
+    o_ << "  return n;\n";
+    o_ << "#endif\n";
+    o_ << "}\n";
+    o_ << "static inline uint64_t ls_hash_mix(uint64_t a, uint64_t b) {\n";
+    o_ << "#if defined(__SIZEOF_INT128__)\n";
+    o_ << "  const unsigned __int128 r = (unsigned __int128)a * b;\n";
+    o_ << "  return (uint64_t)r ^ (uint64_t)(r >> 64);\n";
+    o_ << "#else\n";
+    o_ << "  const uint64_t alo = a & 0xFFFFFFFFULL, ahi = a >> 32, blo = b & 0xFFFFFFFFULL, bhi = b >> 32;\n";
+    o_ << "  const uint64_t ll = alo * blo, lh = alo * bhi, hl = ahi * blo, hh = ahi * bhi;\n";
+    o_ << "  const uint64_t mid = (ll >> 32) + (lh & 0xFFFFFFFFULL) + (hl & 0xFFFFFFFFULL);\n";
+    o_ << "  const uint64_t lo = (ll & 0xFFFFFFFFULL) | (mid << 32);\n";
+    o_ << "  const uint64_t hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);\n";
+    o_ << "  return lo ^ hi;\n";
+    o_ << "#endif\n";
+    o_ << "}\n";
+    o_ << "static inline uint64_t ls_hash_read64(const unsigned char *p) {\n";
+    o_ << "  uint64_t v;\n";
+    o_ << "  memcpy(&v, p, 8);\n";
+    o_ << "  return v;\n";
+    o_ << "}\n";
+    o_ << "static inline uint64_t ls_hash_read32(const unsigned char *p) {\n";
+    o_ << "  uint32_t v;\n";
+    o_ << "  memcpy(&v, p, 4);\n";
+    o_ << "  return v;\n";
+    o_ << "}\n";
+    o_ << "// wyhash-style: 16 bytes per multiply-fold round, overlapping reads for the tail.\n";
+    o_ << "static inline uint64_t ls_hash_bytes(const char *s, size_t n) {\n";
+    o_ << "  const uint64_t k0 = 0xa0761d6478bd642fULL, k1 = 0xe7037ed1a0b428dbULL, k2 = 0x8ebc6af09c88c6e3ULL;\n";
+    o_ << "  const unsigned char *p = (const unsigned char *)s;\n";
+    o_ << "  uint64_t seed = k0 ^ (uint64_t)n;\n";
+    o_ << "  size_t left = n;\n";
+    o_ << "  while (left > 16) {\n";
+    o_ << "    seed = ls_hash_mix(ls_hash_read64(p) ^ k1, ls_hash_read64(p + 8) ^ seed);\n";
+    o_ << "    p += 16;\n";
+    o_ << "    left -= 16;\n";
+    o_ << "  }\n";
+    o_ << "  uint64_t a = 0, b = 0;\n";
+    o_ << "  if (left >= 8) {\n";
+    o_ << "    a = ls_hash_read64(p);\n";
+    o_ << "    b = ls_hash_read64(p + left - 8);\n";
+    o_ << "  } else if (left >= 4) {\n";
+    o_ << "    a = ls_hash_read32(p);\n";
+    o_ << "    b = ls_hash_read32(p + left - 4);\n";
+    o_ << "  } else if (left > 0) {\n";
+    o_ << "    a = ((uint64_t)p[0] << 16) | ((uint64_t)p[left >> 1] << 8) | (uint64_t)p[left - 1];\n";
+    o_ << "  }\n";
+    o_ << "  return ls_hash_mix(ls_hash_mix(a ^ k1, b ^ seed) ^ k2, (uint64_t)n ^ k1);\n";
+    o_ << "}\n";
+    o_ << "static inline uint64_t ls_hash_str(const char *s) {\n";
+    o_ << "  const char *src = s ? s : \"\";\n";
+    o_ << "  return ls_hash_bytes(src, strlen(src));\n";
+    o_ << "}\n";
+    o_ << "static inline uint64_t ls_str_hash_n(const char *s, size_t n) {\n";
+    o_ << "  ls_str_hdr *hdr = ls_str_header(s);\n";
+    o_ << "  if (!hdr) return ls_hash_bytes(s, n);\n";
+    o_ << "  if (hdr->hash == 0) hdr->hash = ls_hash_bytes(s, n);\n";
+    o_ << "  return hdr->hash;\n";
+    o_ << "}\n";
+    o_ << "static inline uint64_t ls_str_hash(const char *s) {\n";
+    o_ << "  const char *src = s ? s : \"\";\n";
+    o_ << "  return ls_str_hash_n(src, ls_str_len(src));\n";
     o_ << "}\n";
     o_ << "static inline ls_dict *ls_get_dict(int64_t id) {\n";
-    o_ << "  if (id < 0 || id >= ls_dict_count) return NULL;\n";
-    o_ << "  if (!ls_dicts[id].active) return NULL;\n";
-    o_ << "  return &ls_dicts[id];\n";
+    o_ << "  ls_dict *d = (ls_dict *)ls_handle_at(&ls_dict_table, id);\n";
+    o_ << "  return d && d->active ? d : NULL;\n";
+    o_ << "}\n";
+    o_ << "static inline ls_dict *ls_get_dict_kind(int64_t id, int kind) {\n";
+    o_ << "  ls_dict *d = ls_get_dict(id);\n";
+    o_ << "  return d && d->kind == kind ? d : NULL;\n";
     o_ << "}\n";
     o_ << "static inline int64_t ls_next_pow2_i64(int64_t x) {\n";
     o_ << "  int64_t out = 1;\n";
     o_ << "  while (out < x) out <<= 1;\n";
     o_ << "  return out;\n";
     o_ << "}\n";
-    o_ << "static inline int64_t ls_dict_find_slot(const ls_dict *d, const char *key, uint32_t key_len, uint64_t hash, ls_bool for_insert) {\n";
-    o_ << "  if (!d || d->cap <= 0 || !d->items) return -1;\n";
-    o_ << "  const char *k = key ? key : \"\";\n";
-    o_ << "  int64_t idx = (int64_t)(hash & (uint64_t)(d->cap - 1));\n";
-    o_ << "  int64_t first_tomb = -1;\n";
-    o_ << "  for (int64_t probe = 0; probe < d->cap; ++probe) {\n";
-    o_ << "    const ls_dict_entry *e = &d->items[idx];\n";
-    o_ << "    if (e->used) {\n";
-    o_ << "      if (e->hash == hash && e->key_len == key_len && e->key && memcmp(e->key, k, key_len) == 0 && e->key[key_len] == '\\0') return idx;\n";
-    o_ << "    } else {\n";
-    o_ << "      if (e->tomb) {\n";
-    o_ << "        if (for_insert && first_tomb < 0) first_tomb = idx;\n";
-    o_ << "      } else {\n";
-    o_ << "        return for_insert ? (first_tomb >= 0 ? first_tomb : idx) : -1;\n";
-    o_ << "      }\n";
+    o_ << "static inline void ls_dict_key_head(char *head, const char *k, uint32_t key_len) {\n";
+    o_ << "  memset(head, 0, LS_DICT_INLINE_KEY);\n";
+    o_ << "  memcpy(head, k, key_len < LS_DICT_INLINE_KEY ? key_len : LS_DICT_INLINE_KEY);\n";
+    o_ << "}\n";
+    o_ << "static inline uint64_t ls_dict_entry_hash(const ls_dict_entry *e) {\n";
+    o_ << "  return ls_hash_bytes(e->key ? e->key : e->head, e->key_len);\n";
+    o_ << "}\n";
+    o_ << "// Groups are probed triangularly, which visits every group of a power-of-two table.\n";
+    o_ << "static inline int64_t ls_dict_find_slot(const ls_dict *d, const char *k, uint32_t key_len, uint64_t hash) {\n";
+    o_ << "  if (!d || d->cap <= 0) return -1;\n";
+    o_ << "  char head[LS_DICT_INLINE_KEY];\n";
+    o_ << "  ls_dict_key_head(head, k, key_len);\n";
+    o_ << "  const uint8_t h2 = (uint8_t)(hash & 0x7F);\n";
+    o_ << "  const int64_t mask = d->cap / LS_DICT_GROUP - 1;\n";
+    o_ << "  int64_t g = (int64_t)(hash >> 7) & mask;\n";
+    o_ << "  for (int64_t probe = 1; probe <= mask + 1; ++probe) {\n";
+    o_ << "    const uint8_t *ctrl = d->ctrl + g * LS_DICT_GROUP;\n";
+    o_ << "    for (uint32_t m = ls_group_match(ctrl, h2); m; m &= m - 1) {\n";
+    o_ << "      const int64_t slot = g * LS_DICT_GROUP + ls_ctz_u32(m);\n";
+    o_ << "      const ls_dict_entry *e = &d->items[slot];\n";
+    o_ << "      if (e->key_len != key_len || memcmp(e->head, head, LS_DICT_INLINE_KEY) != 0) continue;\n";
+    o_ << "      if (key_len <= LS_DICT_INLINE_KEY || memcmp(e->key + LS_DICT_INLINE_KEY, k + LS_DICT_INLINE_KEY, key_len - LS_DICT_INLINE_KEY) == 0) return slot;\n";
     o_ << "    }\n";
-    o_ << "    idx = (idx + 1) & (d->cap - 1);\n";
+    o_ << "    if (ls_group_match(ctrl, LS_CTRL_EMPTY)) return -1;\n";
+    o_ << "    g = (g + probe) & mask;\n";
+    o_ << "  }\n";
+    o_ << "  return -1;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t ls_dict_free_slot(const ls_dict *d, uint64_t hash) {\n";
+    o_ << "  const int64_t mask = d->cap / LS_DICT_GROUP - 1;\n";
+    o_ << "  int64_t g = (int64_t)(hash >> 7) & mask;\n";
+    o_ << "  for (int64_t probe = 1; probe <= mask + 1; ++probe) {\n";
+    o_ << "    const uint32_t m = ls_group_free(d->ctrl + g * LS_DICT_GROUP);\n";
+    o_ << "    if (m) return g * LS_DICT_GROUP + ls_ctz_u32(m);\n";
+    o_ << "    g = (g + probe) & mask;\n";
     o_ << "  }\n";
-    o_ << "  return for_insert ? first_tomb : -1;\n";
+    o_ << "  return -1;\n";
     o_ << "}\n";
     o_ << "static inline ls_bool ls_dict_rehash(ls_dict *d, int64_t want_cap) {\n";
     o_ << "  if (!d) return 0;\n";
-    o_ << "  if (want_cap < 16) want_cap = 16;\n";
+    o_ << "  if (want_cap < LS_DICT_GROUP) want_cap = LS_DICT_GROUP;\n";
     o_ << "  const int64_t new_cap = ls_next_pow2_i64(want_cap);\n";
-    o_ << "  ls_dict_entry *next = (ls_dict_entry *)calloc((size_t)new_cap, sizeof(ls_dict_entry));\n";
-    o_ << "  if (!next) return 0;\n";
+    o_ << "  uint8_t *ctrl = (uint8_t *)malloc((size_t)new_cap);\n";
+    o_ << "  ls_dict_entry *items = (ls_dict_entry *)malloc((size_t)new_cap * sizeof(ls_dict_entry));\n";
+    o_ << "  if (!ctrl || !items) {\n";
+    o_ << "    free(ctrl);\n";
+    o_ << "    free(items);\n";
+    o_ << "    return 0;\n";
+    o_ << "  }\n";
+    o_ << "  memset(ctrl, LS_CTRL_EMPTY, (size_t)new_cap);\n";
+    o_ << "  uint8_t *old_ctrl = d->ctrl;\n";
     o_ << "  ls_dict_entry *old_items = d->items;\n";
     o_ << "  const int64_t old_cap = d->cap;\n";
-    o_ << "  d->items = next;\n";
+    o_ << "  d->ctrl = ctrl;\n";
+    o_ << "  d->items = items;\n";
     o_ << "  d->cap = new_cap;\n";
-    o_ << "  d->len = 0;\n";
+    o_ << "  d->tombs = 0;\n";
     o_ << "  for (int64_t i = 0; i < old_cap; ++i) {\n";
-    o_ << "    if (!old_items || !old_items[i].used) continue;\n";
-    o_ << "    const int64_t slot = ls_dict_find_slot(d, old_items[i].key, old_items[i].key_len, old_items[i].hash, 1);\n";
-    o_ << "    if (slot >= 0) {\n";
-    o_ << "      d->items[slot] = old_items[i];\n";
-    o_ << "      d->items[slot].used = 1;\n";
-    o_ << "      d->items[slot].tomb = 0;\n";
-    o_ << "      ++d->len;\n";
-    o_ << "    }\n";
+    o_ << "    if (old_ctrl[i] & 0x80) continue;\n";
+    o_ << "    const int64_t slot = ls_dict_free_slot(d, ls_dict_entry_hash(&old_items[i]));\n";
+    o_ << "    d->ctrl[slot] = old_ctrl[i];\n";
+    o_ << "    d->items[slot] = old_items[i];\n";
     o_ << "  }\n";
-    o_ << "  if (old_items) free(old_items);\n";
+    o_ << "  free(old_ctrl);\n";
+    o_ << "  free(old_items);\n";
     o_ << "  return 1;\n";
     o_ << "}\n";
-    o_ << "static inline int64_t dict_new(void) {\n";
-    o_ << "  const int64_t id = ls_dict_alloc_id();\n";
+    o_ << "static inline int64_t ls_dict_new_kind(int kind) {\n";
+    o_ << "  const int64_t id = ls_handle_alloc(&ls_dict_table);\n";
     o_ << "  if (id < 0) return -1;\n";
-    o_ << "  ls_dicts[id].items = NULL;\n";
-    o_ << "  ls_dicts[id].len = 0;\n";
-    o_ << "  ls_dicts[id].cap = 0;\n";
-    o_ << "  ls_dicts[id].active = 1;\n";
+    o_ << "  ls_dict *d = (ls_dict *)ls_handle_at(&ls_dict_table, id);\n";
+    o_ << "  d->ctrl = NULL;\n";
+    o_ << "  d->items = NULL;\n";
+    o_ << "  d->len = 0;\n";
+    o_ << "  d->cap = 0;\n";
+    o_ << "  d->tombs = 0;\n";
+    o_ << "  d->kind = kind;\n";
+    o_ << "  d->active = 1;\n";
     o_ << "  return id;\n";
     o_ << "}\n";
+    o_ << "static inline int64_t dict_new(void) { return ls_dict_new_kind(LS_ELEM_STR); }\n";
+    o_ << "static inline int64_t dict_new_i64(void) { return ls_dict_new_kind(LS_ELEM_I64); }\n";
+    o_ << "static inline int64_t dict_new_f64(void) { return ls_dict_new_kind(LS_ELEM_F64); }\n";
     o_ << "static inline int64_t dict_len(int64_t id) {\n";
     o_ << "  ls_dict *d = ls_get_dict(id);\n";
     o_ << "  return d ? d->len : 0;\n";
@@ -7764,99 +12274,158 @@ private:
     o_ << "static inline void dict_free(int64_t id) {\n";
     o_ << "  ls_dict *d = ls_get_dict(id);\n";
     o_ << "  if (!d) return;\n";
-    o_ << "  if (d->items) {\n";
-    o_ << "    for (int64_t i = 0; i < d->cap; ++i) {\n";
-    o_ << "      if (d->items[i].used) {\n";
-    o_ << "        if (d->items[i].key) free(d->items[i].key);\n";
-    o_ << "        if (d->items[i].value) free(d->items[i].value);\n";
-    o_ << "      }\n";
-    o_ << "    }\n";
-    o_ << "    free(d->items);\n";
+    o_ << "  for (int64_t i = 0; i < d->cap; ++i) {\n";
+    o_ << "    if (d->ctrl[i] & 0x80) continue;\n";
+    o_ << "    free(d->items[i].key);\n";
+    o_ << "    if (d->kind == LS_ELEM_STR) free(d->items[i].value);\n";
     o_ << "  }\n";
+    o_ << "  free(d->ctrl);\n";
+    o_ << "  free(d->items);\n";
+    o_ << "  d->ctrl = NULL;\n";
     o_ << "  d->items = NULL;\n";
     o_ << "  d->len = 0;\n";
     o_ << "  d->cap = 0;\n";
+    o_ << "  d->tombs = 0;\n";
     o_ << "  d->active = 0;\n";
-    o_ << "  ls_dict_release_id(id);\n";
+    o_ << "  ls_handle_release(&ls_dict_table, id);\n";
     o_ << "}\n";
-    o_ << "static inline void dict_set(int64_t id, const char *key, const char *value) {\n";
-    o_ << "  ls_dict *d = ls_get_dict(id);\n";
-    o_ << "  if (!d) return;\n";
-    o_ << "  if (d->cap == 0) {\n";
-    o_ << "    if (!ls_dict_rehash(d, 16)) return;\n";
+    o_ << "// Finds or inserts the entry for key; a fresh entry owns a copy of the key and a zeroed value.\n";
+    o_ << "static inline ls_dict_entry *ls_dict_upsert(ls_dict *d, const char *key, ls_bool *fresh) {\n";
+    o_ << "  *fresh = 0;\n";
+    o_ << "  const char *k = key ? key : \"\";\n";
+    o_ << "  const uint32_t key_len = (uint32_t)ls_str_len(k);\n";
+    o_ << "  const uint64_t h = ls_str_hash_n(k, key_len);\n";
+    o_ << "  int64_t slot = ls_dict_find_slot(d, k, key_len, h);\n";
+    o_ << "  if (slot >= 0) return &d->items[slot];\n";
+    o_ << "  if ((d->len + d->tombs + 1) * 8 > d->cap * 7) {\n";
+    o_ << "    // Mostly tombstones: rebuild at the same size instead of doubling.\n";
+    o_ << "    const int64_t want = (d->len + 1) * 16 > d->cap * 7 ? d->cap * 2 : d->cap;\n";
+    o_ << "    if (!ls_dict_rehash(d, want)) return NULL;\n";
     o_ << "  }\n";
-    o_ << "  if ((d->len + 1) * 10 >= d->cap * 7) {\n";
-    o_ << "    if (!ls_dict_rehash(d, d->cap << 1)) return;\n";
+    o_ << "  char *copy = NULL;\n";
+    o_ << "  if (key_len > LS_DICT_INLINE_KEY) {\n";
+    o_ << "    copy = (char *)malloc((size_t)key_len + 1);\n";
+    o_ << "    if (!copy) return NULL;\n";
+    o_ << "    memcpy(copy, k, key_len);\n";
+    o_ << "    copy[key_len] = '\\0';\n";
     o_ << "  }\n";
-    o_ << "  const char *k = key ? key : \"\";\n";
-    o_ << "  const char *v = value ? value : \"\";\n";
-    o_ << "  const uint32_t key_len = (uint32_t)strlen(k);\n";
-    o_ << "  const uint64_t h = ls_hash_str(k);\n";
-    o_ << "  const int64_t slot = ls_dict_find_slot(d, k, key_len, h, 1);\n";
-    o_ << "  if (slot < 0) return;\n";
+    o_ << "  slot = ls_dict_free_slot(d, h);\n";
+    o_ << "  if (d->ctrl[slot] == LS_CTRL_DELETED) --d->tombs;\n";
+    o_ << "  d->ctrl[slot] = (uint8_t)(h & 0x7F);\n";
     o_ << "  ls_dict_entry *e = &d->items[slot];\n";
-    o_ << "  if (e->used) {\n";
-    o_ << "    char *nextv = ls_heap_dup(v);\n";
-    o_ << "    if (!nextv) nextv = ls_heap_dup(\"\");\n";
-    o_ << "    if (!nextv) return;\n";
-    o_ << "    if (e->value) free(e->value);\n";
-    o_ << "    e->value = nextv;\n";
+    o_ << "  e->key = copy;\n";
+    o_ << "  e->ival = 0;\n";
+    o_ << "  e->key_len = key_len;\n";
+    o_ << "  ls_dict_key_head(e->head, k, key_len);\n";
+    o_ << "  ++d->len;\n";
+    o_ << "  *fresh = 1;\n";
+    o_ << "  return e;\n";
+    o_ << "}\n";
+    o_ << "static inline ls_dict_entry *ls_dict_lookup(ls_dict *d, const char *key) {\n";
+    o_ << "  if (!d || d->cap == 0) return NULL;\n";
+    o_ << "  const char *k = key ? key : \"\";\n";
+    o_ << "  const uint32_t key_len = (uint32_t)ls_str_len(k);\n";
+    o_ << "  const int64_t slot = ls_dict_find_slot(d, k, key_len, ls_str_hash_n(k, key_len));\n";
+    o_ << "  return slot < 0 ? NULL : &d->items[slot];\n";
+    o_ << "}\n";
+    o_ << "/* As with arrays, dict_set/dict_get also work on i64/f64 dicts whose handle was not tracked at compile time: values\n";
+    o_ << "   are parsed from and read as decimal text. */\n";
+    o_ << "static inline void dict_set(int64_t id, const char *key, const char *value) {\n";
+    o_ << "  ls_dict *d = ls_get_dict(id);\n";
+    o_ << "  if (!d) return;\n";
+    o_ << "  if (d->kind != LS_ELEM_STR) {\n";
+    o_ << "    const char *v = value ? value : \"\";\n";
+    o_ << "    ls_bool fresh = 0;\n";
+    o_ << "    ls_dict_entry *e = ls_dict_upsert(d, key, &fresh);\n";
+    o_ << "    if (e && d->kind == LS_ELEM_I64) e->ival = (int64_t)strtoll(v, NULL, 10);\n";
+    o_ << "    if (e && d->kind == LS_ELEM_F64) e->fval = strtod(v, NULL);\n";
     o_ << "    return;\n";
     o_ << "  }\n";
-    o_ << "  e->key = ls_heap_dup(k);\n";
-    o_ << "  e->value = ls_heap_dup(v);\n";
-    o_ << "  if (!e->key) e->key = ls_heap_dup(\"\");\n";
-    o_ << "  if (!e->value) e->value = ls_heap_dup(\"\");\n";
-    o_ << "  if (!e->key || !e->value) {\n";
-    o_ << "    if (e->key) free(e->key);\n";
-    o_ << "    if (e->value) free(e->value);\n";
-    o_ << "    e->key = NULL;\n";
-    o_ << "    e->value = NULL;\n";
-    o_ << "    e->used = 0;\n";
-    o_ << "    e->tomb = 1;\n";
+    o_ << "  char *nextv = ls_heap_dup(value ? value : \"\");\n";
+    o_ << "  if (!nextv) return;\n";
+    o_ << "  ls_bool fresh = 0;\n";
+    o_ << "  ls_dict_entry *e = ls_dict_upsert(d, key, &fresh);\n";
+    o_ << "  if (!e) {\n";
+    o_ << "    free(nextv);\n";
     o_ << "    return;\n";
     o_ << "  }\n";
-    o_ << "  e->hash = h;\n";
-    o_ << "  e->key_len = key_len;\n";
-    o_ << "  e->used = 1;\n";
-    o_ << "  e->tomb = 0;\n";
-    o_ << "  ++d->len;\n";
+    o_ << "  if (!fresh) free(e->value);\n";
+    o_ << "  e->value = nextv;\n";
     o_ << "}\n";
     o_ << "static inline const char *dict_get(int64_t id, const char *key) {\n";
     o_ << "  ls_dict *d = ls_get_dict(id);\n";
-    o_ << "  if (!d || d->cap == 0) return \"\";\n";
-    o_ << "  const char *k = key ? key : \"\";\n";
-    o_ << "  const uint32_t key_len = (uint32_t)strlen(k);\n";
-    o_ << "  const int64_t slot = ls_dict_find_slot(d, k, key_len, ls_hash_str(k), 0);\n";
-    o_ << "  if (slot < 0) return \"\";\n";
-    o_ << "  const ls_dict_entry *e = &d->items[slot];\n";
-    o_ << "  return e->value ? e->value : \"\";\n";
+    o_ << "  const ls_dict_entry *e = ls_dict_lookup(d, key);\n";
+    o_ << "  if (e && d->kind != LS_ELEM_STR) {\n";
+    o_ << "    char b[32];\n";
+    o_ << "    b[d->kind == LS_ELEM_I64 ? ls_i64_to_dec(e->ival, b) : ls_f64_to_dec(e->fval, b)] = '\\0';\n";
+    o_ << "    return ls_scratch_dup(b);\n";
+    o_ << "  }\n";
+    o_ << "  return e && e->value ? e->value : \"\";\n";
     o_ << "}\n";
     o_ << "static inline ls_bool dict_has(int64_t id, const char *key) {\n";
-    o_ << "  ls_dict *d = ls_get_dict(id);\n";
-    o_ << "  if (!d || d->cap == 0) return 0;\n";
-    o_ << "  const char *k = key ? key : \"\";\n";
-    o_ << "  const uint32_t key_len = (uint32_t)strlen(k);\n";
-    o_ << "  return ls_dict_find_slot(d, k, key_len, ls_hash_str(k), 0) >= 0 ? 1 : 0;\n";
+    o_ << "  return ls_dict_lookup(ls_get_dict(id), key) ? 1 : 0;\n";
     o_ << "}\n";
     o_ << "static inline void dict_remove(int64_t id, const char *key) {\n";
     o_ << "  ls_dict *d = ls_get_dict(id);\n";
-    o_ << "  if (!d || d->cap == 0) return;\n";
-    o_ << "  const char *k = key ? key : \"\";\n";
-    o_ << "  const uint32_t key_len = (uint32_t)strlen(k);\n";
-    o_ << "  const int64_t slot = ls_dict_find_slot(d, k, key_len, ls_hash_str(k), 0);\n";
-    o_ << "  if (slot < 0) return;\n";
-    o_ << "  ls_dict_entry *e = &d->items[slot];\n";
-    o_ << "  if (e->key) free(e->key);\n";
-    o_ << "  if (e->value) free(e->value);\n";
+    o_ << "  ls_dict_entry *e = ls_dict_lookup(d, key);\n";
+    o_ << "  if (!e) return;\n";
+    o_ << "  const int64_t slot = (int64_t)(e - d->items);\n";
+    o_ << "  free(e->key);\n";
+    o_ << "  if (d->kind == LS_ELEM_STR) free(e->value);\n";
     o_ << "  e->key = NULL;\n";
     o_ << "  e->value = NULL;\n";
-    o_ << "  e->used = 0;\n";
-    o_ << "  e->tomb = 1;\n";
-    o_ << "  if (d->len > 0) --d->len;\n";
-    o_ << "  if (d->cap > 16 && d->len * 4 < d->cap) {\n";
-    o_ << "    (void)ls_dict_rehash(d, d->cap >> 1);\n";
+    o_ << "  // A group that still has an empty slot never overflowed, so no probe continues past it.\n";
+    o_ << "  if (ls_group_match(d->ctrl + (slot & ~(int64_t)(LS_DICT_GROUP - 1)), LS_CTRL_EMPTY)) {\n";
+    o_ << "    d->ctrl[slot] = LS_CTRL_EMPTY;\n";
+    o_ << "  } else {\n";
+    o_ << "    d->ctrl[slot] = LS_CTRL_DELETED;\n";
+    o_ << "    ++d->tombs;\n";
     o_ << "  }\n";
+    o_ << "  --d->len;\n";
+    o_ << "  // Shrink below 1/8 load to half load, so alternating insert/remove cannot bounce between sizes.\n";
+    o_ << "  if (d->cap > 4 * LS_DICT_GROUP && d->len * 8 < d->cap) {\n";
+    o_ << "    (void)ls_dict_rehash(d, d->len * 2);\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "static inline void dict_set_i64(int64_t id, const char *key, int64_t value) {\n";
+    o_ << "  ls_dict *d = ls_get_dict_kind(id, LS_ELEM_I64);\n";
+    o_ << "  if (!d) return;\n";
+    o_ << "  ls_bool fresh = 0;\n";
+    o_ << "  ls_dict_entry *e = ls_dict_upsert(d, key, &fresh);\n";
+    o_ << "  if (e) e->ival = value;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t dict_get_i64(int64_t id, const char *key) {\n";
+    o_ << "  const ls_dict_entry *e = ls_dict_lookup(ls_get_dict_kind(id, LS_ELEM_I64), key);\n";
+    o_ << "  return e ? e->ival : 0;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t dict_add_i64(int64_t id, const char *key, int64_t delta) {\n";
+    o_ << "  ls_dict *d = ls_get_dict_kind(id, LS_ELEM_I64);\n";
+    o_ << "  if (!d) return 0;\n";
+    o_ << "  ls_bool fresh = 0;\n";
+    o_ << "  ls_dict_entry *e = ls_dict_upsert(d, key, &fresh);\n";
+    o_ << "  if (!e) return 0;\n";
+    o_ << "  e->ival += delta;\n";
+    o_ << "  return e->ival;\n";
+    o_ << "}\n";
+    o_ << "static inline void dict_set_f64(int64_t id, const char *key, double value) {\n";
+    o_ << "  ls_dict *d = ls_get_dict_kind(id, LS_ELEM_F64);\n";
+    o_ << "  if (!d) return;\n";
+    o_ << "  ls_bool fresh = 0;\n";
+    o_ << "  ls_dict_entry *e = ls_dict_upsert(d, key, &fresh);\n";
+    o_ << "  if (e) e->fval = value;\n";
+    o_ << "}\n";
+    o_ << "static inline double dict_get_f64(int64_t id, const char *key) {\n";
+    o_ << "  const ls_dict_entry *e = ls_dict_lookup(ls_get_dict_kind(id, LS_ELEM_F64), key);\n";
+    o_ << "  return e ? e->fval : 0.0;\n";
+    o_ << "}\n";
+    o_ << "static inline double dict_add_f64(int64_t id, const char *key, double delta) {\n";
+    o_ << "  ls_dict *d = ls_get_dict_kind(id, LS_ELEM_F64);\n";
+    o_ << "  if (!d) return 0.0;\n";
+    o_ << "  ls_bool fresh = 0;\n";
+    o_ << "  ls_dict_entry *e = ls_dict_upsert(d, key, &fresh);\n";
+    o_ << "  if (!e) return 0.0;\n";
+    o_ << "  e->fval += delta;\n";
+    o_ << "  return e->fval;\n";
     o_ << "}\n";
     o_ << "static inline int64_t map_new(void) { return dict_new(); }\n";
     o_ << "static inline int64_t map_len(int64_t id) { return dict_len(id); }\n";
@@ -8030,86 +12599,136 @@ private:
     o_ << "  r->active = 0;\n";
     o_ << "  ls_result_release_id(id);\n";
     o_ << "}\n";
-    o_ << "#define LS_MAX_NP 1024\n";
-    o_ << "#define LS_MAX_NP_ELEMS 10000000\n";
+    o_ << "#ifndef LS_MAX_NP\n";
+    o_ << "#define LS_MAX_NP ((int64_t)1 << 24)\n";
+    o_ << "#endif\n";
+    o_ << "#ifndef LS_MAX_NP_ELEMS\n";
+    o_ << "#define LS_MAX_NP_ELEMS ((int64_t)1 << 28)\n";
+    o_ << "#endif\n";
+    o_ << "#define LS_ELEM_F32 3\n";
+    o_ << "// Storage is contiguous row-major; a 1-D vector is a single row, so rows * cols == len always holds.\n";
     o_ << "typedef struct {\n";
     o_ << "  double *data;\n";
+    o_ << "  float *data32;\n";
     o_ << "  int64_t len;\n";
     o_ << "  int64_t cap;\n";
+    o_ << "  int64_t rows;\n";
+    o_ << "  int64_t cols;\n";
     o_ << "  ls_bool active;\n";
+    o_ << "  int kind;\n";
     o_ << "} ls_np;\n";
-    o_ << "static ls_np ls_np_slots[LS_MAX_NP];\n";
-    o_ << "static int64_t ls_np_count = 0;\n";
-    o_ << "static int64_t ls_np_free_ids[LS_MAX_NP];\n";
-    o_ << "static int64_t ls_np_free_top = 0;\n";
-    o_ << "static inline int64_t ls_np_alloc_id(void) {\n";
-    o_ << "  if (ls_np_free_top > 0) return ls_np_free_ids[--ls_np_free_top];\n";
-    o_ << "  if (ls_np_count >= LS_MAX_NP) return -1;\n";
-    o_ << "  return ls_np_count++;\n";
-    o_ << "}\n";
-    o_ << "static inline void ls_np_release_id(int64_t id) {\n";
-    o_ << "  if (id < 0 || id >= LS_MAX_NP) return;\n";
-    o_ << "  if (ls_np_free_top < LS_MAX_NP) ls_np_free_ids[ls_np_free_top++] = id;\n";
-    o_ << "}\n";
+    o_ << "static ls_handle_table ls_np_table = {NULL, 0, 0, NULL, 0, 0, sizeof(ls_np), LS_MAX_NP};\n";
     o_ << "static inline ls_np *ls_get_np(int64_t id) {\n";
-    o_ << "  if (id < 0 || id >= ls_np_count) return NULL;\n";
-    o_ << "  if (!ls_np_slots[id].active) return NULL;\n";
-    o_ << "  return &ls_np_slots[id];\n";
-    o_ << "}\n";
-    o_ << "static inline int64_t np_new(int64_t n) {\n";
-    o_ << "  if (n < 0 || n > LS_MAX_NP_ELEMS) return -1;\n";
-    o_ << "  const int64_t id = ls_np_alloc_id();\n";
-    o_ << "  if (id < 0) return -1;\n";
-    o_ << "  double *p = NULL;\n";
+    o_ << "  ls_np *v = (ls_np *)ls_handle_at(&ls_np_table, id);\n";
+    o_ << "  return v && v->active ? v : NULL;\n";
+    o_ << "}\n";
+    o_ << "static inline size_t ls_np_elem_size(int kind) { return kind == LS_ELEM_F32 ? sizeof(float) : sizeof(double); }\n";
+    o_ << "static inline void *ls_np_raw(const ls_np *v) { return v->kind == LS_ELEM_F32 ? (void *)v->data32 : (void *)v->data; }\n";
+    o_ << "static inline int64_t ls_np_new_shaped(int64_t rows, int64_t cols, int kind) {\n";
+    o_ << "  if (rows < 0 || cols < 0 || (cols > 0 && rows > LS_MAX_NP_ELEMS / cols)) return -1;\n";
+    o_ << "  const int64_t n = rows * cols;\n";
+    o_ << "  void *p = NULL;\n";
     o_ << "  if (n > 0) {\n";
-    o_ << "    p = (double *)calloc((size_t)n, sizeof(double));\n";
-    o_ << "    if (!p) {\n";
-    o_ << "      ls_np_release_id(id);\n";
-    o_ << "      return -1;\n";
-    o_ << "    }\n";
+    o_ << "    p = ls_elem_realloc(NULL, 0, (size_t)n * ls_np_elem_size(kind));\n";
+    o_ << "    if (!p) return -1;\n";
     o_ << "  }\n";
-    o_ << "  ls_np_slots[id].data = p;\n";
-    o_ << "  ls_np_slots[id].len = n;\n";
-    o_ << "  ls_np_slots[id].cap = n;\n";
-    o_ << "  ls_np_slots[id].active = 1;\n";
+    o_ << "  const int64_t id = ls_handle_alloc(&ls_np_table);\n";
+    o_ << "  if (id < 0) {\n";
+    o_ << "    ls_elem_free(p);\n";
+    o_ << "    return -1;\n";
+    o_ << "  }\n";
+    o_ << "  ls_np *v = (ls_np *)ls_handle_at(&ls_np_table, id);\n";
+    o_ << "  v->data = kind == LS_ELEM_F32 ? NULL : (double *)p;\n";
+    o_ << "  v->data32 = kind == LS_ELEM_F32 ? (float *)p : NULL;\n";
+    o_ << "  v->len = n;\n";
+    o_ << "  v->cap = n;\n";
+    o_ << "  v->rows = rows;\n";
+    o_ << "  v->cols = cols;\n";
+    o_ << "  v->kind = kind;\n";
+    o_ << "  v->active = 1;\n";
     o_ << "  return id;\n";
     o_ << "}\n";
+    o_ << "static inline int64_t np_new(int64_t n) { return n < 0 ? -1 : ls_np_new_shaped(1, n, LS_ELEM_F64); }\n";
+    o_ << "static inline int64_t np_new_f32(int64_t n) { return n < 0 ? -1 : ls_np_new_shaped(1, n, LS_ELEM_F32); }\n";
+    o_ << "static inline int64_t np_mat_new(int64_t rows, int64_t cols) { return ls_np_new_shaped(rows, cols, LS_ELEM_F64); }\n";
+    o_ << "static inline int64_t np_mat_new_f32(int64_t rows, int64_t cols) { return ls_np_new_shaped(rows, cols, LS_ELEM_F32); }\n";
     o_ << "static inline void np_free(int64_t id) {\n";
     o_ << "  ls_np *v = ls_get_np(id);\n";
     o_ << "  if (!v) return;\n";
-    o_ << "  if (v->data) free(v->data);\n";
+    o_ << "  ls_elem_free(ls_np_raw(v));\n";
     o_ << "  v->data = NULL;\n";
+    o_ << "  v->data32 = NULL;\n";
     o_ << "  v->len = 0;\n";
     o_ << "  v->cap = 0;\n";
+    o_ << "  v->rows = 0;\n";
+    o_ << "  v->cols = 0;\n";
     o_ << "  v->active = 0;\n";
-    o_ << "  ls_np_release_id(id);\n";
+    o_ << "  ls_handle_release(&ls_np_table, id);\n";
     o_ << "}\n";
     o_ << "static inline int64_t np_len(int64_t id) {\n";
     o_ << "  ls_np *v = ls_get_np(id);\n";
     o_ << "  return v ? v->len : 0;\n";
     o_ << "}\n";
+    o_ << "static inline int64_t np_rows(int64_t id) {\n";
+    o_ << "  ls_np *v = ls_get_np(id);\n";
+    o_ << "  return v ? v->rows : 0;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t np_cols(int64_t id) {\n";
+    o_ << "  ls_np *v = ls_get_np(id);\n";
+    o_ << "  return v ? v->cols : 0;\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool np_reshape(int64_t id, int64_t rows, int64_t cols) {\n";
+    o_ << "  ls_np *v = ls_get_np(id);\n";
+    o_ << "  if (!v || rows < 0 || cols < 0 || (cols > 0 && rows > v->len / cols) || rows * cols != v->len) return 0;\n";
+    o_ << "  v->rows = rows;\n";
+    o_ << "  v->cols = cols;\n";
+    o_ << "  return 1;\n";
+    o_ << "}\n";
     o_ << "static inline double np_get(int64_t id, int64_t idx) {\n";
     o_ << "  ls_np *v = ls_get_np(id);\n";
-    o_ << "  if (!v || !v->data || idx < 0 || idx >= v->len) return 0.0;\n";
-    o_ << "  return v->data[idx];\n";
+    o_ << "  if (!v || idx < 0 || idx >= v->len) return 0.0;\n";
+    o_ << "  return v->data32 ? (double)v->data32[idx] : v->data[idx];\n";
+    o_ << "}\n";
+    o_ << "static inline double __ls_np_get_unchecked(int64_t id, int64_t idx) {\n";
+    o_ << "  ls_np *v = ls_get_np(id);\n";
+    o_ << "  return v->data32 ? (double)v->data32[idx] : v->data[idx];\n";
     o_ << "}\n";
     o_ << "static inline void np_set(int64_t id, int64_t idx, double val) {\n";
     o_ << "  ls_np *v = ls_get_np(id);\n";
-    o_ << "  if (!v || !v->data || idx < 0 || idx >= v->len) return;\n";
-    o_ << "  v->data[idx] = val;\n";
+    o_ << "  if (!v || idx < 0 || idx >= v->len) return;\n";
+    o_ << "  if (v->data32) v->data32[idx] = (float)val;\n";
+    o_ << "  else v->data[idx] = val;\n";
+    o_ << "}\n";
+    o_ << "static inline double np_mat_get(int64_t id, int64_t row, int64_t col) {\n";
+    o_ << "  ls_np *v = ls_get_np(id);\n";
+    o_ << "  if (!v || row < 0 || row >= v->rows || col < 0 || col >= v->cols) return 0.0;\n";
+    o_ << "  return np_get(id, row * v->cols + col);\n";
+    o_ << "}\n";
+    o_ << "static inline void np_mat_set(int64_t id, int64_t row, int64_t col, double val) {\n";
+    o_ << "  ls_np *v = ls_get_np(id);\n";
+    o_ << "  if (!v || row < 0 || row >= v->rows || col < 0 || col >= v->cols) return;\n";
+    o_ << "  np_set(id, row * v->cols + col, val);\n";
     o_ << "}\n";
     o_ << "static inline int64_t np_copy(int64_t id) {\n";
     o_ << "  ls_np *v = ls_get_np(id);\n";
     o_ << "  if (!v) return -1;\n";
-    o_ << "  const int64_t out = np_new(v->len);\n";
+    o_ << "  const int64_t out = ls_np_new_shaped(v->rows, v->cols, v->kind);\n";
     o_ << "  ls_np *dst = ls_get_np(out);\n";
     o_ << "  if (out < 0 || !dst) return -1;\n";
-    o_ << "  if (v->len > 0 && v->data && dst->data) memcpy(dst->data, v->data, (size_t)v->len * sizeof(double));\n";
+    o_ << "  if (v->len > 0) memcpy(ls_np_raw(dst), ls_np_raw(v), (size_t)v->len * ls_np_elem_size(v->kind));\n";
     o_ << "  return out;\n";
     o_ << "}\n";
     o_ << "static inline void np_fill(int64_t id, double val) {\n";
     o_ << "  ls_np *v = ls_get_np(id);\n";
-    o_ << "  if (!v || !v->data) return;\n";
+    o_ << "  if (!v) return;\n";
+    o_ << "  if (v->data32) {\n";
+    o_ << "    const float x = (float)val;\n";
+    o_ << "    LS_OMP_SIMD\n";
+    o_ << "    LS_VEC_HINT\n";
+    o_ << "    for (int64_t i = 0; i < v->len; ++i) v->data32[i] = x;\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
+    o_ << "  if (!v->data) return;\n";
     o_ << "  LS_OMP_SIMD\n";
     o_ << "  LS_VEC_HINT\n";
     o_ << "  for (int64_t i = 0; i < v->len; ++i) v->data[i] = val;\n";
@@ -8152,8 +12771,15 @@ private:
     o_ << "}\n";
     o_ << "static inline double np_sum(int64_t id) {\n";
     o_ << "  ls_np *v = ls_get_np(id);\n";
-    o_ << "  if (!v || !v->data || v->len <= 0) return 0.0;\n";
+    o_ << "  if (!v || v->len <= 0) return 0.0;\n";
     o_ << "  double sum = 0.0;\n";
+    o_ << "  if (v->data32) {\n";
+    o_ << "    LS_OMP_SIMD_REDUCTION_PLUS(sum)\n";
+    o_ << "    LS_VEC_HINT\n";
+    o_ << "    for (int64_t i = 0; i < v->len; ++i) sum += (double)v->data32[i];\n";
+    o_ << "    return sum;\n";
+    o_ << "  }\n";
+    o_ << "  if (!v->data) return 0.0;\n";
     o_ << "  LS_OMP_SIMD_REDUCTION_PLUS(sum)\n";
     o_ << "  LS_VEC_HINT\n";
     o_ << "  for (int64_t i = 0; i < v->len; ++i) sum += v->data[i];\n";
@@ -8190,70 +12816,705 @@ private:
     o_ << "  for (int64_t i = 0; i < n; ++i) sum += a->data[i] * b->data[i];\n";
     o_ << "  return sum;\n";
     o_ << "}\n";
+    o_ << "static inline double ls_np_div_safe(double x, double y) { return (y != 0.0) ? (x / y) : 0.0; }\n";
+    o_ << "static inline float ls_np_div_safe_f32(float x, float y) { return (y != 0.0f) ? (x / y) : 0.0f; }\n";
+    o_ << "// Binds one operand of a fused np kernel; n tracks the shortest operand, as ls_np_binary does.\n";
+    o_ << "static inline ls_bool ls_np_operand(int64_t id, const double **p, int64_t *n) {\n";
+    o_ << "  ls_np *v = ls_get_np(id);\n";
+    o_ << "  if (!v || !v->data) return 0;\n";
+    o_ << "  *p = v->data;\n";
+    o_ << "  if (*n < 0 || v->len < *n) *n = v->len;\n";
+    o_ << "  return 1;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_np_apply_f64(const double *x, const double *y, double *r, int64_t n, int op) {\n";
+    o_ << "  switch (op) {\n";
+    o_ << "  case 0:\n";
+    o_ << "    LS_OMP_SIMD\n";
+    o_ << "    LS_VEC_HINT\n";
+    o_ << "    for (int64_t i = 0; i < n; ++i) r[i] = x[i] + y[i];\n";
+    o_ << "    break;\n";
+    o_ << "  case 1:\n";
+    o_ << "    LS_OMP_SIMD\n";
+    o_ << "    LS_VEC_HINT\n";
+    o_ << "    for (int64_t i = 0; i < n; ++i) r[i] = x[i] - y[i];\n";
+    o_ << "    break;\n";
+    o_ << "  case 2:\n";
+    o_ << "    LS_OMP_SIMD\n";
+    o_ << "    LS_VEC_HINT\n";
+    o_ << "    for (int64_t i = 0; i < n; ++i) r[i] = x[i] * y[i];\n";
+    o_ << "    break;\n";
+    o_ << "  default:\n";
+    o_ << "    LS_OMP_SIMD\n";
+    o_ << "    LS_VEC_HINT\n";
+    o_ << "    for (int64_t i = 0; i < n; ++i) r[i] = ls_np_div_safe(x[i], y[i]);\n";
+    o_ << "    break;\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_np_apply_f32(const float *x, const float *y, float *r, int64_t n, int op) {\n";
+    o_ << "  switch (op) {\n";
+    o_ << "  case 0:\n";
+    o_ << "    LS_OMP_SIMD\n";
+    o_ << "    LS_VEC_HINT\n";
+    o_ << "    for (int64_t i = 0; i < n; ++i) r[i] = x[i] + y[i];\n";
+    o_ << "    break;\n";
+    o_ << "  case 1:\n";
+    o_ << "    LS_OMP_SIMD\n";
+    o_ << "    LS_VEC_HINT\n";
+    o_ << "    for (int64_t i = 0; i < n; ++i) r[i] = x[i] - y[i];\n";
+    o_ << "    break;\n";
+    o_ << "  case 2:\n";
+    o_ << "    LS_OMP_SIMD\n";
+    o_ << "    LS_VEC_HINT\n";
+    o_ << "    for (int64_t i = 0; i < n; ++i) r[i] = x[i] * y[i];\n";
+    o_ << "    break;\n";
+    o_ << "  default:\n";
+    o_ << "    LS_OMP_SIMD\n";
+    o_ << "    LS_VEC_HINT\n";
+    o_ << "    for (int64_t i = 0; i < n; ++i) r[i] = ls_np_div_safe_f32(x[i], y[i]);\n";
+    o_ << "    break;\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_np_apply(const ls_np *a, const ls_np *b, ls_np *o, int64_t n, int op) {\n";
+    o_ << "  if (n <= 0) return;\n";
+    o_ << "  if (a->kind == LS_ELEM_F32) ls_np_apply_f32(a->data32, b->data32, o->data32, n, op);\n";
+    o_ << "  else ls_np_apply_f64(a->data, b->data, o->data, n, op);\n";
+    o_ << "}\n";
+    o_ << "// Operands must share a dtype; equal shapes carry over to the result, anything else yields a 1-D vector.\n";
     o_ << "static inline int64_t ls_np_binary(int64_t a_id, int64_t b_id, int op) {\n";
     o_ << "  ls_np *a = ls_get_np(a_id);\n";
     o_ << "  ls_np *b = ls_get_np(b_id);\n";
-    o_ << "  if (!a || !b || !a->data || !b->data) return -1;\n";
-    o_ << "  int64_t n = a->len < b->len ? a->len : b->len;\n";
-    o_ << "  if (n < 0) return -1;\n";
-    o_ << "  const int64_t out = np_new(n);\n";
+    o_ << "  if (!a || !b || a->kind != b->kind || !ls_np_raw(a) || !ls_np_raw(b)) return -1;\n";
+    o_ << "  const int64_t n = a->len < b->len ? a->len : b->len;\n";
+    o_ << "  const ls_bool same = a->rows == b->rows && a->cols == b->cols;\n";
+    o_ << "  const int64_t out = ls_np_new_shaped(same ? a->rows : 1, same ? a->cols : n, a->kind);\n";
     o_ << "  ls_np *o = ls_get_np(out);\n";
-    o_ << "  if (out < 0 || !o || !o->data) return -1;\n";
+    o_ << "  if (out < 0 || !o || !ls_np_raw(o)) return -1;\n";
+    o_ << "  ls_np_apply(a, b, o, n, op);\n";
+    o_ << "  return out;\n";
+    o_ << "}\n";
+    o_ << "/* Writes into an existing vector of the same dtype; `out` may alias either operand. */\n";
+    o_ << "static inline ls_bool ls_np_binary_into(int64_t a_id, int64_t b_id, int64_t out_id, int op) {\n";
+    o_ << "  ls_np *a = ls_get_np(a_id);\n";
+    o_ << "  ls_np *b = ls_get_np(b_id);\n";
+    o_ << "  ls_np *o = ls_get_np(out_id);\n";
+    o_ << "  if (!a || !b || !o || a->kind != b->kind || o->kind != a->kind) return 0;\n";
+    o_ << "  const int64_t n = a->len < b->len ? a->len : b->len;\n";
+    o_ << "  if (o->len < n) return 0;\n";
+    o_ << "  ls_np_apply(a, b, o, n, op);\n";
+    o_ << "  return 1;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t np_add(int64_t a_id, int64_t b_id) { return ls_np_binary(a_id, b_id, 0); }\n";
+    o_ << "static inline int64_t np_sub(int64_t a_id, int64_t b_id) { return ls_np_binary(a_id, b_id, 1); }\n";
+    o_ << "static inline int64_t np_mul(int64_t a_id, int64_t b_id) { return ls_np_binary(a_id, b_id, 2); }\n";
+    o_ << "static inline int64_t np_div(int64_t a_id, int64_t b_id) { return ls_np_binary(a_id, b_id, 3); }\n";
+    o_ << "static inline ls_bool np_add_into(int64_t a_id, int64_t b_id, int64_t out_id) { return ls_np_binary_into(a_id, b_id, out_id, 0); }\n";
+    o_ << "static inline ls_bool np_sub_into(int64_t a_id, int64_t b_id, int64_t out_id) { return ls_np_binary_into(a_id, b_id, out_id, 1); }\n";
+    o_ << "static inline ls_bool np_mul_into(int64_t a_id, int64_t b_id, int64_t out_id) { return ls_np_binary_into(a_id, b_id, out_id, 2); }\n";
+    o_ << "static inline ls_bool np_div_into(int64_t a_id, int64_t b_id, int64_t out_id) { return ls_np_binary_into(a_id, b_id, out_id, 3); }\n";
+    o_ << "static inline void np_add_scalar(int64_t id, double v) {\n";
+    o_ << "  ls_np *a = ls_get_np(id);\n";
+    o_ << "  if (!a || !a->data) return;\n";
     o_ << "  LS_OMP_SIMD\n";
     o_ << "  LS_VEC_HINT\n";
-    o_ << "  for (int64_t i = 0; i < n; ++i) {\n";
-    o_ << "    const double x = a->data[i];\n";
-    o_ << "    const double y = b->data[i];\n";
-    o_ << "    if (op == 0) o->data[i] = x + y;\n";
-    o_ << "    else if (op == 1) o->data[i] = x - y;\n";
-    o_ << "    else if (op == 2) o->data[i] = x * y;\n";
-    o_ << "    else o->data[i] = (y != 0.0) ? (x / y) : 0.0;\n";
+    o_ << "  for (int64_t i = 0; i < a->len; ++i) a->data[i] += v;\n";
+    o_ << "}\n";
+    o_ << "static inline void np_mul_scalar(int64_t id, double v) {\n";
+    o_ << "  ls_np *a = ls_get_np(id);\n";
+    o_ << "  if (!a || !a->data) return;\n";
+    o_ << "  LS_OMP_SIMD\n";
+    o_ << "  LS_VEC_HINT\n";
+    o_ << "  for (int64_t i = 0; i < a->len; ++i) a->data[i] *= v;\n";
+    o_ << "}\n";
+    o_ << "static inline void np_clip(int64_t id, double lo, double hi) {\n";
+    o_ << "  ls_np *a = ls_get_np(id);\n";
+    o_ << "  if (!a || !a->data) return;\n";
+    o_ << "  if (lo > hi) { const double t = lo; lo = hi; hi = t; }\n";
+    o_ << "  LS_OMP_SIMD\n";
+    o_ << "  LS_VEC_HINT\n";
+    o_ << "  for (int64_t i = 0; i < a->len; ++i) {\n";
+    o_ << "    double x = a->data[i];\n";
+    o_ << "    if (x < lo) x = lo;\n";
+    o_ << "    else if (x > hi) x = hi;\n";
+    o_ << "    a->data[i] = x;\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "static inline void np_abs(int64_t id) {\n";
+    o_ << "  ls_np *a = ls_get_np(id);\n";
+    o_ << "  if (!a || !a->data) return;\n";
+    o_ << "  LS_OMP_SIMD\n";
+    o_ << "  LS_VEC_HINT\n";
+    o_ << "  for (int64_t i = 0; i < a->len; ++i) a->data[i] = fabs(a->data[i]);\n";
+    o_ << "}\n";
+    o_ << "typedef void (*ls_range_fn)(void *job, int64_t begin, int64_t end);\n";
+    o_ << "// Defined with the task pool below: runs fn over [0, n) in contiguous ranges on the worker threads.\n";
+    o_ << "static inline void ls_parallel_range(ls_range_fn fn, void *job, int64_t n, int64_t work);\n";
+    o_ << "#define LS_MAX_GFX 256\n";
+    o_ << "#define LS_GFX_TILE_ROWS 32\n";
+    o_ << "#define LS_GFX_MAX_CMDS ((int64_t)1 << 22)\n";
+    o_ << "#define LS_GFX_DAMAGE_RECTS 8\n";
+    o_ << "#if defined(LS_DICT_SSE2)\n";
+    o_ << "#define LS_PIX_SSE2 1\n";
+    o_ << "#elif defined(LS_DICT_NEON)\n";
+    o_ << "#define LS_PIX_NEON 1\n";
+    o_ << "#endif\n";
+    o_ << "enum { LS_GFX_OP_FILL = 0, LS_GFX_OP_OUTLINE, LS_GFX_OP_PIXEL, LS_GFX_OP_LINE, LS_GFX_OP_BLIT, LS_GFX_OP_TEXT };\n";
+    o_ << "struct ls_surface;\n";
+    o_ << "typedef struct {\n";
+    o_ << "  int op;\n";
+    o_ << "  uint32_t color;\n";
+    o_ << "  int64_t x0;\n";
+    o_ << "  int64_t y0;\n";
+    o_ << "  int64_t x1;\n";
+    o_ << "  int64_t y1;\n";
+    o_ << "  struct ls_surface *src;\n";
+    o_ << "  char *text;\n";
+    o_ << "  int64_t *marks;\n";
+    o_ << "} ls_gfx_cmd;\n";
+    o_ << "typedef struct {\n";
+    o_ << "  int64_t x0;\n";
+    o_ << "  int64_t y0;\n";
+    o_ << "  int64_t x1;\n";
+    o_ << "  int64_t y1;\n";
+    o_ << "} ls_rect;\n";
+    o_ << "// Pixels are 64-byte aligned 0x00RRGGBB words: the same layout as a 32-bit BI_RGB DIB, so game_present\n";
+    o_ << "// hands the buffer to GDI as is. While batching, draw calls are recorded and rasterized on flush in\n";
+    o_ << "// LS_GFX_TILE_ROWS-row tiles across the task pool, each tile replaying the commands clipped to its rows.\n";
+    o_ << "typedef struct ls_surface {\n";
+    o_ << "  uint32_t *pix;\n";
+    o_ << "  int64_t w;\n";
+    o_ << "  int64_t h;\n";
+    o_ << "  ls_gfx_cmd *cmds;\n";
+    o_ << "  int64_t ncmds;\n";
+    o_ << "  int64_t cmd_cap;\n";
+    o_ << "  int64_t src_refs;\n";
+    o_ << "  ls_bool batching;\n";
+    o_ << "  struct ls_surface *batch_next;\n";
+    o_ << "  ls_bool track_damage;\n";
+    o_ << "  int ndamage;\n";
+    o_ << "  ls_rect damage[LS_GFX_DAMAGE_RECTS];\n";
+    o_ << "} ls_surface;\n";
+    o_ << "static ls_surface *ls_surface_batched = NULL;\n";
+    o_ << "static inline uint8_t ls_color_u8(int64_t v) {\n";
+    o_ << "  if (v <= 0) return 0;\n";
+    o_ << "  if (v >= 255) return 255;\n";
+    o_ << "  return (uint8_t)v;\n";
+    o_ << "}\n";
+    o_ << "static inline uint32_t ls_pix_rgb(int64_t r, int64_t g, int64_t b) {\n";
+    o_ << "  return ((uint32_t)ls_color_u8(r) << 16) | ((uint32_t)ls_color_u8(g) << 8) | (uint32_t)ls_color_u8(b);\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_pix_fill_span(uint32_t *dst, uint32_t c, int64_t n) {\n";
+    o_ << "#if defined(LS_PIX_SSE2) || defined(LS_PIX_NEON)\n";
+    o_ << "  while (n > 0 && ((uintptr_t)dst & 15u) != 0) {\n";
+    o_ << "    *dst++ = c;\n";
+    o_ << "    --n;\n";
+    o_ << "  }\n";
+    o_ << "#if defined(LS_PIX_SSE2)\n";
+    o_ << "  const __m128i v = _mm_set1_epi32((int)c);\n";
+    o_ << "  for (; n >= 16; n -= 16, dst += 16) {\n";
+    o_ << "    _mm_store_si128((__m128i *)(void *)dst, v);\n";
+    o_ << "    _mm_store_si128((__m128i *)(void *)(dst + 4), v);\n";
+    o_ << "    _mm_store_si128((__m128i *)(void *)(dst + 8), v);\n";
+    o_ << "    _mm_store_si128((__m128i *)(void *)(dst + 12), v);\n";
+    o_ << "  }\n";
+    o_ << "  for (; n >= 4; n -= 4, dst += 4) _mm_store_si128((__m128i *)(void *)dst, v);\n";
+    o_ << "#else\n";
+    o_ << "  const uint32x4_t v = vdupq_n_u32(c);\n";
+    o_ << "  for (; n >= 16; n -= 16, dst += 16) {\n";
+    o_ << "    vst1q_u32(dst, v);\n";
+    o_ << "    vst1q_u32(dst + 4, v);\n";
+    o_ << "    vst1q_u32(dst + 8, v);\n";
+    o_ << "    vst1q_u32(dst + 12, v);\n";
+    o_ << "  }\n";
+    o_ << "  for (; n >= 4; n -= 4, dst += 4) vst1q_u32(dst, v);\n";
+    o_ << "#endif\n";
+    o_ << "#endif\n";
+    o_ << "  for (int64_t i = 0; i < n; ++i) dst[i] = c;\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool ls_surface_init(ls_surface *s, int64_t w, int64_t h) {\n";
+    o_ << "  memset(s, 0, sizeof(*s));\n";
+    o_ << "  const size_t area = (size_t)w * (size_t)h;\n";
+    o_ << "  if (area == 0 || area > (((size_t)-1) / 4)) return 0;\n";
+    o_ << "  s->pix = (uint32_t *)ls_elem_realloc(NULL, 0, area * 4u);\n";
+    o_ << "  if (!s->pix) return 0;\n";
+    o_ << "  s->w = w;\n";
+    o_ << "  s->h = h;\n";
+    o_ << "  return 1;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t ls_rect_area(const ls_rect *r) { return (r->x1 - r->x0) * (r->y1 - r->y0); }\n";
+    o_ << "static inline ls_rect ls_rect_union(const ls_rect *a, const ls_rect *b) {\n";
+    o_ << "  ls_rect u = *a;\n";
+    o_ << "  if (b->x0 < u.x0) u.x0 = b->x0;\n";
+    o_ << "  if (b->y0 < u.y0) u.y0 = b->y0;\n";
+    o_ << "  if (b->x1 > u.x1) u.x1 = b->x1;\n";
+    o_ << "  if (b->y1 > u.y1) u.y1 = b->y1;\n";
+    o_ << "  return u;\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool ls_rect_overlaps(const ls_rect *a, const ls_rect *b) {\n";
+    o_ << "  return a->x0 < b->x1 && b->x0 < a->x1 && a->y0 < b->y1 && b->y0 < a->y1;\n";
+    o_ << "}\n";
+    o_ << "/* Damage is kept as at most LS_GFX_DAMAGE_RECTS disjoint rects: overlapping rects merge, and a full list merges\n";
+    o_ << "   the new rect into whichever existing one grows least. */\n";
+    o_ << "static inline void ls_surface_damage(ls_surface *s, int64_t x0, int64_t y0, int64_t x1, int64_t y1) {\n";
+    o_ << "  if (!s->track_damage) return;\n";
+    o_ << "  if (x0 < 0) x0 = 0;\n";
+    o_ << "  if (y0 < 0) y0 = 0;\n";
+    o_ << "  if (x1 > s->w) x1 = s->w;\n";
+    o_ << "  if (y1 > s->h) y1 = s->h;\n";
+    o_ << "  if (x0 >= x1 || y0 >= y1) return;\n";
+    o_ << "  ls_rect r = {x0, y0, x1, y1};\n";
+    o_ << "  for (int i = 0; i < s->ndamage;) {\n";
+    o_ << "    const ls_rect *d = &s->damage[i];\n";
+    o_ << "    if (d->x0 <= r.x0 && d->y0 <= r.y0 && d->x1 >= r.x1 && d->y1 >= r.y1) return;\n";
+    o_ << "    if (ls_rect_overlaps(d, &r)) {\n";
+    o_ << "      r = ls_rect_union(d, &r);\n";
+    o_ << "      s->damage[i] = s->damage[--s->ndamage];\n";
+    o_ << "      i = 0;\n";
+    o_ << "      continue;\n";
+    o_ << "    }\n";
+    o_ << "    ++i;\n";
+    o_ << "  }\n";
+    o_ << "  if (s->ndamage == LS_GFX_DAMAGE_RECTS) {\n";
+    o_ << "    int best = 0;\n";
+    o_ << "    int64_t bestGrowth = INT64_MAX;\n";
+    o_ << "    for (int i = 0; i < s->ndamage; ++i) {\n";
+    o_ << "      const ls_rect u = ls_rect_union(&s->damage[i], &r);\n";
+    o_ << "      const int64_t growth = ls_rect_area(&u) - ls_rect_area(&s->damage[i]);\n";
+    o_ << "      if (growth < bestGrowth) {\n";
+    o_ << "        bestGrowth = growth;\n";
+    o_ << "        best = i;\n";
+    o_ << "      }\n";
+    o_ << "    }\n";
+    o_ << "    r = ls_rect_union(&s->damage[best], &r);\n";
+    o_ << "    s->damage[best] = s->damage[--s->ndamage];\n";
+    o_ << "    ls_surface_damage(s, r.x0, r.y0, r.x1, r.y1);\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
+    o_ << "  s->damage[s->ndamage++] = r;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_surface_damage_all(ls_surface *s) {\n";
+    o_ << "  if (!s->track_damage) return;\n";
+    o_ << "  s->damage[0].x0 = 0;\n";
+    o_ << "  s->damage[0].y0 = 0;\n";
+    o_ << "  s->damage[0].x1 = s->w;\n";
+    o_ << "  s->damage[0].y1 = s->h;\n";
+    o_ << "  s->ndamage = 1;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_surface_damage_cmd(ls_surface *s, const ls_gfx_cmd *cmd) {\n";
+    o_ << "  switch (cmd->op) {\n";
+    o_ << "  case LS_GFX_OP_FILL:\n";
+    o_ << "  case LS_GFX_OP_OUTLINE:\n";
+    o_ << "    ls_surface_damage(s, cmd->x0, cmd->y0, cmd->x1, cmd->y1);\n";
+    o_ << "    break;\n";
+    o_ << "  case LS_GFX_OP_PIXEL:\n";
+    o_ << "    ls_surface_damage(s, cmd->x0, cmd->y0, cmd->x0 + 1, cmd->y0 + 1);\n";
+    o_ << "    break;\n";
+    o_ << "  case LS_GFX_OP_LINE: {\n";
+    o_ << "    const int64_t lx = cmd->x0 < cmd->x1 ? cmd->x0 : cmd->x1;\n";
+    o_ << "    const int64_t hx = cmd->x0 < cmd->x1 ? cmd->x1 : cmd->x0;\n";
+    o_ << "    const int64_t ly = cmd->y0 < cmd->y1 ? cmd->y0 : cmd->y1;\n";
+    o_ << "    const int64_t hy = cmd->y0 < cmd->y1 ? cmd->y1 : cmd->y0;\n";
+    o_ << "    if (hx < INT64_MAX && hy < INT64_MAX) ls_surface_damage(s, lx, ly, hx + 1, hy + 1);\n";
+    o_ << "    break;\n";
+    o_ << "  }\n";
+    o_ << "  case LS_GFX_OP_BLIT:\n";
+    o_ << "    if (cmd->x0 <= INT64_MAX - cmd->src->w && cmd->y0 <= INT64_MAX - cmd->src->h) {\n";
+    o_ << "      ls_surface_damage(s, cmd->x0, cmd->y0, cmd->x0 + cmd->src->w, cmd->y0 + cmd->src->h);\n";
+    o_ << "    }\n";
+    o_ << "    break;\n";
+    o_ << "  case LS_GFX_OP_TEXT: {\n";
+    o_ << "    int64_t cols = 0, widest = 0, lines = 1;\n";
+    o_ << "    for (const char *t = cmd->text; *t; ++t) {\n";
+    o_ << "      if (*t == '\\n') {\n";
+    o_ << "        ++lines;\n";
+    o_ << "        cols = 0;\n";
+    o_ << "        continue;\n";
+    o_ << "      }\n";
+    o_ << "      if (++cols > widest) widest = cols;\n";
+    o_ << "    }\n";
+    o_ << "    if (cmd->x0 <= INT64_MAX - widest * 6 && cmd->y0 <= INT64_MAX - lines * 8) {\n";
+    o_ << "      ls_surface_damage(s, cmd->x0, cmd->y0, cmd->x0 + widest * 6, cmd->y0 + lines * 8);\n";
+    o_ << "    }\n";
+    o_ << "    break;\n";
+    o_ << "  }\n";
+    o_ << "  default:\n";
+    o_ << "    break;\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "/* Moves the accumulated damage into `out` and returns the number of rects. */\n";
+    o_ << "static inline int ls_surface_take_damage(ls_surface *s, ls_rect *out) {\n";
+    o_ << "  const int n = s->ndamage;\n";
+    o_ << "  for (int i = 0; i < n; ++i) out[i] = s->damage[i];\n";
+    o_ << "  s->ndamage = 0;\n";
+    o_ << "  return n;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_surface_drop_cmds(ls_surface *s) {\n";
+    o_ << "  for (int64_t i = 0; i < s->ncmds; ++i) {\n";
+    o_ << "    if (s->cmds[i].src) s->cmds[i].src->src_refs -= 1;\n";
+    o_ << "    if (s->cmds[i].text) free(s->cmds[i].text);\n";
+    o_ << "    if (s->cmds[i].marks) free(s->cmds[i].marks);\n";
+    o_ << "  }\n";
+    o_ << "  s->ncmds = 0;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_pix_fill_rect(ls_surface *s, int64_t x0, int64_t y0, int64_t x1, int64_t y1, uint32_t c,\n";
+    o_ << "                                    int64_t cy0, int64_t cy1) {\n";
+    o_ << "  if (y0 < cy0) y0 = cy0;\n";
+    o_ << "  if (y1 > cy1) y1 = cy1;\n";
+    o_ << "  for (int64_t y = y0; y < y1; ++y) ls_pix_fill_span(s->pix + (size_t)y * (size_t)s->w + (size_t)x0, c, x1 - x0);\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_pix_put(ls_surface *s, int64_t x, int64_t y, uint32_t c, int64_t cy0, int64_t cy1) {\n";
+    o_ << "  if ((uint64_t)x >= (uint64_t)s->w || y < cy0 || y >= cy1) return;\n";
+    o_ << "  s->pix[(size_t)y * (size_t)s->w + (size_t)x] = c;\n";
+    o_ << "}\n";
+    o_ << "/* Marks keep the Bresenham state (x, y, err) at the first pixel each tile receives, so every tile resumes the\n";
+    o_ << "   walk where it enters instead of replaying the line from its first endpoint. */\n";
+    o_ << "static inline void ls_pix_line_marks(ls_surface *s, ls_gfx_cmd *cmd, int64_t tiles) {\n";
+    o_ << "  int64_t *m = (int64_t *)malloc((size_t)tiles * 3u * sizeof(int64_t));\n";
+    o_ << "  if (!m) return;\n";
+    o_ << "  for (int64_t t = 0; t < tiles; ++t) m[t * 3] = INT64_MIN;\n";
+    o_ << "  int64_t x0 = cmd->x0, y0 = cmd->y0;\n";
+    o_ << "  int64_t dx = cmd->x1 - x0;\n";
+    o_ << "  if (dx < 0) dx = -dx;\n";
+    o_ << "  const int64_t sx = x0 < cmd->x1 ? 1 : -1;\n";
+    o_ << "  int64_t dy = cmd->y1 - y0;\n";
+    o_ << "  if (dy < 0) dy = -dy;\n";
+    o_ << "  const int64_t sy = y0 < cmd->y1 ? 1 : -1;\n";
+    o_ << "  int64_t err = dx - dy;\n";
+    o_ << "  int64_t last = -1;\n";
+    o_ << "  for (;;) {\n";
+    o_ << "    if ((uint64_t)y0 < (uint64_t)s->h && y0 / LS_GFX_TILE_ROWS != last) {\n";
+    o_ << "      last = y0 / LS_GFX_TILE_ROWS;\n";
+    o_ << "      m[last * 3] = x0;\n";
+    o_ << "      m[last * 3 + 1] = y0;\n";
+    o_ << "      m[last * 3 + 2] = err;\n";
+    o_ << "    }\n";
+    o_ << "    if (x0 == cmd->x1 && y0 == cmd->y1) break;\n";
+    o_ << "    if ((sy > 0 && y0 >= s->h) || (sy < 0 && y0 < 0)) break;\n";
+    o_ << "    const int64_t e2 = err * 2;\n";
+    o_ << "    if (e2 > -dy) {\n";
+    o_ << "      err -= dy;\n";
+    o_ << "      x0 += sx;\n";
+    o_ << "    }\n";
+    o_ << "    if (e2 < dx) {\n";
+    o_ << "      err += dx;\n";
+    o_ << "      y0 += sy;\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "  cmd->marks = m;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_pix_line(ls_surface *s, const ls_gfx_cmd *cmd, int64_t cy0, int64_t cy1) {\n";
+    o_ << "  int64_t x0 = cmd->x0, y0 = cmd->y0;\n";
+    o_ << "  const int64_t x1 = cmd->x1, y1 = cmd->y1;\n";
+    o_ << "  if ((y0 < cy0 && y1 < cy0) || (y0 >= cy1 && y1 >= cy1)) return;\n";
+    o_ << "  int64_t dx = x1 - x0;\n";
+    o_ << "  if (dx < 0) dx = -dx;\n";
+    o_ << "  const int64_t sx = x0 < x1 ? 1 : -1;\n";
+    o_ << "  int64_t dy = y1 - y0;\n";
+    o_ << "  if (dy < 0) dy = -dy;\n";
+    o_ << "  const int64_t sy = y0 < y1 ? 1 : -1;\n";
+    o_ << "  int64_t err = dx - dy;\n";
+    o_ << "  if (cmd->marks) {\n";
+    o_ << "    const int64_t *m = cmd->marks + (cy0 / LS_GFX_TILE_ROWS) * 3;\n";
+    o_ << "    if (m[0] == INT64_MIN) return;\n";
+    o_ << "    x0 = m[0];\n";
+    o_ << "    y0 = m[1];\n";
+    o_ << "    err = m[2];\n";
+    o_ << "  }\n";
+    o_ << "  for (;;) {\n";
+    o_ << "    ls_pix_put(s, x0, y0, cmd->color, cy0, cy1);\n";
+    o_ << "    if (x0 == x1 && y0 == y1) break;\n";
+    o_ << "    if ((sy > 0 && y0 >= cy1) || (sy < 0 && y0 < cy0)) break;\n";
+    o_ << "    const int64_t e2 = err * 2;\n";
+    o_ << "    if (e2 > -dy) {\n";
+    o_ << "      err -= dy;\n";
+    o_ << "      x0 += sx;\n";
+    o_ << "    }\n";
+    o_ << "    if (e2 < dx) {\n";
+    o_ << "      err += dx;\n";
+    o_ << "      y0 += sy;\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_pix_blit(ls_surface *dst, const ls_gfx_cmd *cmd, int64_t cy0, int64_t cy1) {\n";
+    o_ << "  const ls_surface *src = cmd->src;\n";
+    o_ << "  const int64_t dst_x = cmd->x0, dst_y = cmd->y0;\n";
+    o_ << "  int64_t sx0 = 0, sy0 = 0, sx1 = src->w, sy1 = src->h;\n";
+    o_ << "  if (dst_x < 0) sx0 = -dst_x;\n";
+    o_ << "  if (dst_y < 0) sy0 = -dst_y;\n";
+    o_ << "  if (dst_x + sx1 > dst->w) sx1 = dst->w - dst_x;\n";
+    o_ << "  if (dst_y + sy1 > dst->h) sy1 = dst->h - dst_y;\n";
+    o_ << "  if (dst_y + sy0 < cy0) sy0 = cy0 - dst_y;\n";
+    o_ << "  if (dst_y + sy1 > cy1) sy1 = cy1 - dst_y;\n";
+    o_ << "  if (sx0 >= sx1 || sy0 >= sy1) return;\n";
+    o_ << "  for (int64_t y = sy0; y < sy1; ++y) {\n";
+    o_ << "    uint32_t *dst_row = dst->pix + ((size_t)(dst_y + y) * (size_t)dst->w + (size_t)(dst_x + sx0));\n";
+    o_ << "    const uint32_t *src_row = src->pix + ((size_t)y * (size_t)src->w + (size_t)sx0);\n";
+    o_ << "    memcpy(dst_row, src_row, (size_t)(sx1 - sx0) * 4u);\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "static inline uint8_t ls_font5x7_row(unsigned char ch, int row) {\n";
+    o_ << "  if (ch >= 'a' && ch <= 'z') ch = (unsigned char)(ch - 32);\n";
+    o_ << "  switch (ch) {\n";
+    o_ << "  case 'A': { static const uint8_t r[7] = {14,17,17,31,17,17,17}; return r[row]; }\n";
+    o_ << "  case 'B': { static const uint8_t r[7] = {30,17,17,30,17,17,30}; return r[row]; }\n";
+    o_ << "  case 'C': { static const uint8_t r[7] = {14,17,16,16,16,17,14}; return r[row]; }\n";
+    o_ << "  case 'D': { static const uint8_t r[7] = {30,17,17,17,17,17,30}; return r[row]; }\n";
+    o_ << "  case 'E': { static const uint8_t r[7] = {31,16,16,30,16,16,31}; return r[row]; }\n";
+    o_ << "  case 'F': { static const uint8_t r[7] = {31,16,16,30,16,16,16}; return r[row]; }\n";
+    o_ << "  case 'G': { static const uint8_t r[7] = {14,17,16,23,17,17,14}; return r[row]; }\n";
+    o_ << "  case 'H': { static const uint8_t r[7] = {17,17,17,31,17,17,17}; return r[row]; }\n";
+    o_ << "  case 'I': { static const uint8_t r[7] = {14,4,4,4,4,4,14}; return r[row]; }\n";
+    o_ << "  case 'J': { static const uint8_t r[7] = {1,1,1,1,17,17,14}; return r[row]; }\n";
+    o_ << "  case 'K': { static const uint8_t r[7] = {17,18,20,24,20,18,17}; return r[row]; }\n";
+    o_ << "  case 'L': { static const uint8_t r[7] = {16,16,16,16,16,16,31}; return r[row]; }\n";
+    o_ << "  case 'M': { static const uint8_t r[7] = {17,27,21,21,17,17,17}; return r[row]; }\n";
+    o_ << "  case 'N': { static const uint8_t r[7] = {17,25,21,19,17,17,17}; return r[row]; }\n";
+    o_ << "  case 'O': { static const uint8_t r[7] = {14,17,17,17,17,17,14}; return r[row]; }\n";
+    o_ << "  case 'P': { static const uint8_t r[7] = {30,17,17,30,16,16,16}; return r[row]; }\n";
+    o_ << "  case 'Q': { static const uint8_t r[7] = {14,17,17,17,21,18,13}; return r[row]; }\n";
+    o_ << "  case 'R': { static const uint8_t r[7] = {30,17,17,30,20,18,17}; return r[row]; }\n";
+    o_ << "  case 'S': { static const uint8_t r[7] = {15,16,16,14,1,1,30}; return r[row]; }\n";
+    o_ << "  case 'T': { static const uint8_t r[7] = {31,4,4,4,4,4,4}; return r[row]; }\n";
+    o_ << "  case 'U': { static const uint8_t r[7] = {17,17,17,17,17,17,14}; return r[row]; }\n";
+    o_ << "  case 'V': { static const uint8_t r[7] = {17,17,17,17,17,10,4}; return r[row]; }\n";
+    o_ << "  case 'W': { static const uint8_t r[7] = {17,17,17,21,21,21,10}; return r[row]; }\n";
+    o_ << "  case 'X': { static const uint8_t r[7] = {17,17,10,4,10,17,17}; return r[row]; }\n";
+    o_ << "  case 'Y': { static const uint8_t r[7] = {17,17,10,4,4,4,4}; return r[row]; }\n";
+    o_ << "  case 'Z': { static const uint8_t r[7] = {31,1,2,4,8,16,31}; return r[row]; }\n";
+    o_ << "  case '0': { static const uint8_t r[7] = {14,17,19,21,25,17,14}; return r[row]; }\n";
+    o_ << "  case '1': { static const uint8_t r[7] = {4,12,4,4,4,4,14}; return r[row]; }\n";
+    o_ << "  case '2': { static const uint8_t r[7] = {14,17,1,2,4,8,31}; return r[row]; }\n";
+    o_ << "  case '3': { static const uint8_t r[7] = {30,1,1,14,1,1,30}; return r[row]; }\n";
+    o_ << "  case '4': { static const uint8_t r[7] = {2,6,10,18,31,2,2}; return r[row]; }\n";
+    o_ << "  case '5': { static const uint8_t r[7] = {31,16,16,30,1,1,30}; return r[row]; }\n";
+    o_ << "  case '6': { static const uint8_t r[7] = {14,16,16,30,17,17,14}; return r[row]; }\n";
+    o_ << "  case '7': { static const uint8_t r[7] = {31,1,2,4,8,8,8}; return r[row]; }\n";
+    o_ << "  case '8': { static const uint8_t r[7] = {14,17,17,14,17,17,14}; return r[row]; }\n";
+    o_ << "  case '9': { static const uint8_t r[7] = {14,17,17,15,1,1,14}; return r[row]; }\n";
+    o_ << "  case '.': return row == 6 ? 4 : 0;\n";
+    o_ << "  case ':': return (row == 2 || row == 5) ? 4 : 0;\n";
+    o_ << "  case '-': return row == 3 ? 31 : 0;\n";
+    o_ << "  case '_': return row == 6 ? 31 : 0;\n";
+    o_ << "  case '/': return row < 7 ? (uint8_t)(1u << (6 - row > 4 ? 4 : 6 - row)) : 0;\n";
+    o_ << "  case '!': return row < 5 ? 4 : (row == 6 ? 4 : 0);\n";
+    o_ << "  case '?': { static const uint8_t r[7] = {14,17,1,2,4,0,4}; return r[row]; }\n";
+    o_ << "  case ' ': return 0;\n";
+    o_ << "  default: return (row == 0 || row == 6) ? 31 : 17;\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_pix_text(ls_surface *s, const ls_gfx_cmd *cmd, int64_t cy0, int64_t cy1) {\n";
+    o_ << "  int64_t pen = cmd->x0;\n";
+    o_ << "  int64_t y = cmd->y0;\n";
+    o_ << "  for (const unsigned char *t = (const unsigned char *)cmd->text; *t; ++t, pen += 6) {\n";
+    o_ << "    if (*t == '\\n') { pen = cmd->x0; y += 8; continue; }\n";
+    o_ << "    for (int row = 0; row < 7; ++row) {\n";
+    o_ << "      const int64_t yy = y + row;\n";
+    o_ << "      if (yy < cy0 || yy >= cy1) continue;\n";
+    o_ << "      const uint8_t bits = ls_font5x7_row(*t, row);\n";
+    o_ << "      for (int col = 0; col < 5; ++col) {\n";
+    o_ << "        if ((bits & (uint8_t)(1u << (4 - col))) == 0) continue;\n";
+    o_ << "        const int64_t xx = pen + col;\n";
+    o_ << "        if ((uint64_t)xx >= (uint64_t)s->w) continue;\n";
+    o_ << "        s->pix[(size_t)yy * (size_t)s->w + (size_t)xx] = cmd->color;\n";
+    o_ << "      }\n";
+    o_ << "    }\n";
     o_ << "  }\n";
-    o_ << "  return out;\n";
     o_ << "}\n";
-    o_ << "static inline int64_t np_add(int64_t a_id, int64_t b_id) { return ls_np_binary(a_id, b_id, 0); }\n";
-    o_ << "static inline int64_t np_sub(int64_t a_id, int64_t b_id) { return ls_np_binary(a_id, b_id, 1); }\n";
-    o_ << "static inline int64_t np_mul(int64_t a_id, int64_t b_id) { return ls_np_binary(a_id, b_id, 2); }\n";
-    o_ << "static inline int64_t np_div(int64_t a_id, int64_t b_id) { return ls_np_binary(a_id, b_id, 3); }\n";
-    o_ << "static inline void np_add_scalar(int64_t id, double v) {\n";
-    o_ << "  ls_np *a = ls_get_np(id);\n";
-    o_ << "  if (!a || !a->data) return;\n";
-    o_ << "  LS_OMP_SIMD\n";
-    o_ << "  LS_VEC_HINT\n";
-    o_ << "  for (int64_t i = 0; i < a->len; ++i) a->data[i] += v;\n";
+    o_ << "/* Runs one command over rows [cy0, cy1); rectangles are clipped to the surface at record time. */\n";
+    o_ << "static inline void ls_surface_exec(ls_surface *s, const ls_gfx_cmd *cmd, int64_t cy0, int64_t cy1) {\n";
+    o_ << "  switch (cmd->op) {\n";
+    o_ << "  case LS_GFX_OP_FILL:\n";
+    o_ << "    ls_pix_fill_rect(s, cmd->x0, cmd->y0, cmd->x1, cmd->y1, cmd->color, cy0, cy1);\n";
+    o_ << "    break;\n";
+    o_ << "  case LS_GFX_OP_OUTLINE:\n";
+    o_ << "    ls_pix_fill_rect(s, cmd->x0, cmd->y0, cmd->x1, cmd->y0 + 1, cmd->color, cy0, cy1);\n";
+    o_ << "    ls_pix_fill_rect(s, cmd->x0, cmd->y1 - 1, cmd->x1, cmd->y1, cmd->color, cy0, cy1);\n";
+    o_ << "    for (int64_t yy = cmd->y0 + 1; yy + 1 < cmd->y1; ++yy) {\n";
+    o_ << "      ls_pix_put(s, cmd->x0, yy, cmd->color, cy0, cy1);\n";
+    o_ << "      ls_pix_put(s, cmd->x1 - 1, yy, cmd->color, cy0, cy1);\n";
+    o_ << "    }\n";
+    o_ << "    break;\n";
+    o_ << "  case LS_GFX_OP_PIXEL:\n";
+    o_ << "    ls_pix_put(s, cmd->x0, cmd->y0, cmd->color, cy0, cy1);\n";
+    o_ << "    break;\n";
+    o_ << "  case LS_GFX_OP_LINE:\n";
+    o_ << "    ls_pix_line(s, cmd, cy0, cy1);\n";
+    o_ << "    break;\n";
+    o_ << "  case LS_GFX_OP_BLIT:\n";
+    o_ << "    ls_pix_blit(s, cmd, cy0, cy1);\n";
+    o_ << "    break;\n";
+    o_ << "  case LS_GFX_OP_TEXT:\n";
+    o_ << "    ls_pix_text(s, cmd, cy0, cy1);\n";
+    o_ << "    break;\n";
+    o_ << "  default:\n";
+    o_ << "    break;\n";
+    o_ << "  }\n";
     o_ << "}\n";
-    o_ << "static inline void np_mul_scalar(int64_t id, double v) {\n";
-    o_ << "  ls_np *a = ls_get_np(id);\n";
-    o_ << "  if (!a || !a->data) return;\n";
-    o_ << "  LS_OMP_SIMD\n";
-    o_ << "  LS_VEC_HINT\n";
-    o_ << "  for (int64_t i = 0; i < a->len; ++i) a->data[i] *= v;\n";
+    o_ << "static void ls_surface_raster_tiles(void *job, int64_t begin, int64_t end) {\n";
+    o_ << "  ls_surface *s = (ls_surface *)job;\n";
+    o_ << "  for (int64_t t = begin; t < end; ++t) {\n";
+    o_ << "    const int64_t cy0 = t * LS_GFX_TILE_ROWS;\n";
+    o_ << "    const int64_t cy1 = cy0 + LS_GFX_TILE_ROWS < s->h ? cy0 + LS_GFX_TILE_ROWS : s->h;\n";
+    o_ << "    for (int64_t i = 0; i < s->ncmds; ++i) ls_surface_exec(s, &s->cmds[i], cy0, cy1);\n";
+    o_ << "  }\n";
     o_ << "}\n";
-    o_ << "static inline void np_clip(int64_t id, double lo, double hi) {\n";
-    o_ << "  ls_np *a = ls_get_np(id);\n";
-    o_ << "  if (!a || !a->data) return;\n";
-    o_ << "  if (lo > hi) { const double t = lo; lo = hi; hi = t; }\n";
-    o_ << "  LS_OMP_SIMD\n";
-    o_ << "  LS_VEC_HINT\n";
-    o_ << "  for (int64_t i = 0; i < a->len; ++i) {\n";
-    o_ << "    double x = a->data[i];\n";
-    o_ << "    if (x < lo) x = lo;\n";
-    o_ << "    else if (x > hi) x = hi;\n";
-    o_ << "    a->data[i] = x;\n";
+    o_ << "static inline void ls_surface_flush(ls_surface *s) {\n";
+    o_ << "  if (!s || s->ncmds == 0) return;\n";
+    o_ << "  const int64_t tiles = (s->h + LS_GFX_TILE_ROWS - 1) / LS_GFX_TILE_ROWS;\n";
+    o_ << "  for (int64_t i = 0; tiles > 1 && i < s->ncmds; ++i) {\n";
+    o_ << "    ls_gfx_cmd *cmd = &s->cmds[i];\n";
+    o_ << "    if (cmd->op == LS_GFX_OP_LINE && !cmd->marks && cmd->y0 / LS_GFX_TILE_ROWS != cmd->y1 / LS_GFX_TILE_ROWS) ls_pix_line_marks(s, cmd, tiles);\n";
+    o_ << "  }\n";
+    o_ << "  ls_parallel_range(ls_surface_raster_tiles, s, tiles, s->w * LS_GFX_TILE_ROWS + s->ncmds * 64);\n";
+    o_ << "  ls_surface_drop_cmds(s);\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_surface_flush_all(void) {\n";
+    o_ << "  for (ls_surface *s = ls_surface_batched; s; s = s->batch_next) ls_surface_flush(s);\n";
+    o_ << "}\n";
+    o_ << "/* A surface that pending blits still read from must not change underneath them. */\n";
+    o_ << "static inline void ls_surface_touch(ls_surface *s) {\n";
+    o_ << "  if (s->src_refs > 0) ls_surface_flush_all();\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_surface_set_batching(ls_surface *s, ls_bool enabled) {\n";
+    o_ << "  if (enabled == s->batching) return;\n";
+    o_ << "  if (!enabled) {\n";
+    o_ << "    ls_surface_flush(s);\n";
+    o_ << "    ls_surface **at = &ls_surface_batched;\n";
+    o_ << "    while (*at && *at != s) at = &(*at)->batch_next;\n";
+    o_ << "    if (*at) *at = s->batch_next;\n";
+    o_ << "    s->batch_next = NULL;\n";
+    o_ << "  } else {\n";
+    o_ << "    s->batch_next = ls_surface_batched;\n";
+    o_ << "    ls_surface_batched = s;\n";
+    o_ << "  }\n";
+    o_ << "  s->batching = enabled;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_surface_release(ls_surface *s) {\n";
+    o_ << "  ls_surface_touch(s);\n";
+    o_ << "  ls_surface_drop_cmds(s);\n";
+    o_ << "  ls_surface_set_batching(s, 0);\n";
+    o_ << "  free(s->cmds);\n";
+    o_ << "  ls_elem_free(s->pix);\n";
+    o_ << "  memset(s, 0, sizeof(*s));\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_surface_submit(ls_surface *s, ls_gfx_cmd *cmd) {\n";
+    o_ << "  ls_surface_touch(s);\n";
+    o_ << "  if (cmd->src) ls_surface_flush(cmd->src);\n";
+    o_ << "  if (s->track_damage) ls_surface_damage_cmd(s, cmd);\n";
+    o_ << "  if (!s->batching) {\n";
+    o_ << "    ls_surface_exec(s, cmd, 0, s->h);\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
+    o_ << "  if (cmd->op == LS_GFX_OP_FILL && cmd->x0 == 0 && cmd->y0 == 0 && cmd->x1 == s->w && cmd->y1 == s->h) ls_surface_drop_cmds(s);\n";
+    o_ << "  if (s->ncmds == s->cmd_cap) {\n";
+    o_ << "    const int64_t nextCap = s->cmd_cap ? s->cmd_cap * 2 : 64;\n";
+    o_ << "    ls_gfx_cmd *next = nextCap <= LS_GFX_MAX_CMDS ? (ls_gfx_cmd *)realloc(s->cmds, (size_t)nextCap * sizeof(ls_gfx_cmd)) : NULL;\n";
+    o_ << "    if (!next) {\n";
+    o_ << "      ls_surface_flush(s);\n";
+    o_ << "      ls_surface_exec(s, cmd, 0, s->h);\n";
+    o_ << "      return;\n";
+    o_ << "    }\n";
+    o_ << "    s->cmds = next;\n";
+    o_ << "    s->cmd_cap = nextCap;\n";
     o_ << "  }\n";
+    o_ << "  if (cmd->op == LS_GFX_OP_TEXT) {\n";
+    o_ << "    cmd->text = ls_heap_dup(cmd->text);\n";
+    o_ << "    if (!cmd->text) {\n";
+    o_ << "      ls_surface_flush(s);\n";
+    o_ << "      return;\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "  if (cmd->src) cmd->src->src_refs += 1;\n";
+    o_ << "  s->cmds[s->ncmds++] = *cmd;\n";
     o_ << "}\n";
-    o_ << "static inline void np_abs(int64_t id) {\n";
-    o_ << "  ls_np *a = ls_get_np(id);\n";
-    o_ << "  if (!a || !a->data) return;\n";
-    o_ << "  LS_OMP_SIMD\n";
-    o_ << "  LS_VEC_HINT\n";
-    o_ << "  for (int64_t i = 0; i < a->len; ++i) a->data[i] = fabs(a->data[i]);\n";
+    o_ << "/* Readers see every recorded command first. */\n";
+    o_ << "static inline const ls_surface *ls_surface_sync(ls_surface *s) {\n";
+    o_ << "  ls_surface_flush(s);\n";
+    o_ << "  return s;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_surface_rect(ls_surface *s, int64_t x, int64_t y, int64_t w, int64_t h, uint32_t c, ls_bool fill) {\n";
+    o_ << "  if (w <= 0 || h <= 0) return;\n";
+    o_ << "  if (x > 9223372036854775807LL - w) return;\n";
+    o_ << "  if (y > 9223372036854775807LL - h) return;\n";
+    o_ << "  int64_t x0 = x;\n";
+    o_ << "  int64_t y0 = y;\n";
+    o_ << "  int64_t x1 = x + w;\n";
+    o_ << "  int64_t y1 = y + h;\n";
+    o_ << "  if (x1 <= 0 || y1 <= 0 || x0 >= s->w || y0 >= s->h) return;\n";
+    o_ << "  if (x0 < 0) x0 = 0;\n";
+    o_ << "  if (y0 < 0) y0 = 0;\n";
+    o_ << "  if (x1 > s->w) x1 = s->w;\n";
+    o_ << "  if (y1 > s->h) y1 = s->h;\n";
+    o_ << "  ls_gfx_cmd cmd = {fill ? LS_GFX_OP_FILL : LS_GFX_OP_OUTLINE, c, x0, y0, x1, y1, NULL, NULL, NULL};\n";
+    o_ << "  ls_surface_submit(s, &cmd);\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_surface_clear(ls_surface *s, int64_t r, int64_t g, int64_t b) {\n";
+    o_ << "  ls_gfx_cmd cmd = {LS_GFX_OP_FILL, ls_pix_rgb(r, g, b), 0, 0, s->w, s->h, NULL, NULL, NULL};\n";
+    o_ << "  ls_surface_submit(s, &cmd);\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_surface_set(ls_surface *s, int64_t x, int64_t y, int64_t r, int64_t g, int64_t b) {\n";
+    o_ << "  if ((uint64_t)x >= (uint64_t)s->w || (uint64_t)y >= (uint64_t)s->h) return;\n";
+    o_ << "  ls_gfx_cmd cmd = {LS_GFX_OP_PIXEL, ls_pix_rgb(r, g, b), x, y, x, y, NULL, NULL, NULL};\n";
+    o_ << "  ls_surface_submit(s, &cmd);\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t ls_surface_get(ls_surface *s, int64_t x, int64_t y) {\n";
+    o_ << "  if ((uint64_t)x >= (uint64_t)s->w || (uint64_t)y >= (uint64_t)s->h) return -1;\n";
+    o_ << "  return (int64_t)ls_surface_sync(s)->pix[(size_t)y * (size_t)s->w + (size_t)x];\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_surface_line(ls_surface *s, int64_t x0, int64_t y0, int64_t x1, int64_t y1, int64_t r, int64_t g, int64_t b) {\n";
+    o_ << "  ls_gfx_cmd cmd = {LS_GFX_OP_LINE, ls_pix_rgb(r, g, b), x0, y0, x1, y1, NULL, NULL, NULL};\n";
+    o_ << "  ls_surface_submit(s, &cmd);\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_surface_blit(ls_surface *dst, ls_surface *src, int64_t dst_x, int64_t dst_y) {\n";
+    o_ << "  ls_gfx_cmd cmd = {LS_GFX_OP_BLIT, 0u, dst_x, dst_y, 0, 0, src, NULL, NULL};\n";
+    o_ << "  if (dst != src) {\n";
+    o_ << "    ls_surface_submit(dst, &cmd);\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
+    o_ << "  /* Self-blits copy through a snapshot so overlapping rows read the original pixels. */\n";
+    o_ << "  ls_surface_touch(dst);\n";
+    o_ << "  ls_surface_flush(dst);\n";
+    o_ << "  ls_surface copy;\n";
+    o_ << "  if (!ls_surface_init(&copy, src->w, src->h)) return;\n";
+    o_ << "  memcpy(copy.pix, src->pix, (size_t)src->w * (size_t)src->h * 4u);\n";
+    o_ << "  cmd.src = &copy;\n";
+    o_ << "  ls_surface_damage_cmd(dst, &cmd);\n";
+    o_ << "  ls_surface_exec(dst, &cmd, 0, dst->h);\n";
+    o_ << "  ls_elem_free(copy.pix);\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_surface_text(ls_surface *s, int64_t x, int64_t y, const char *text, int64_t r, int64_t g, int64_t b) {\n";
+    o_ << "  if (!text || !text[0]) return;\n";
+    o_ << "  ls_gfx_cmd cmd = {LS_GFX_OP_TEXT, ls_pix_rgb(r, g, b), x, y, 0, 0, NULL, (char *)text, NULL};\n";
+    o_ << "  ls_surface_submit(s, &cmd);\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool ls_surface_save_ppm(ls_surface *s, const char *path) {\n";
+    o_ << "  const char *p = path ? path : \"\";\n";
+    o_ << "  if (p[0] == '\\0') return 0;\n";
+    o_ << "  ls_surface_flush(s);\n";
+    o_ << "  uint8_t *row = (uint8_t *)malloc((size_t)s->w * 3u);\n";
+    o_ << "  if (!row) return 0;\n";
+    o_ << "  FILE *f = NULL;\n";
+    o_ << "#if defined(_WIN32)\n";
+    o_ << "  if (fopen_s(&f, p, \"wb\") != 0 || !f) { free(row); return 0; }\n";
+    o_ << "#else\n";
+    o_ << "  f = fopen(p, \"wb\");\n";
+    o_ << "  if (!f) { free(row); return 0; }\n";
+    o_ << "#endif\n";
+    o_ << "  ls_bool ok = fprintf(f, \"P6\\n%lld %lld\\n255\\n\", (long long)s->w, (long long)s->h) >= 0 ? 1 : 0;\n";
+    o_ << "  for (int64_t y = 0; ok && y < s->h; ++y) {\n";
+    o_ << "    const uint32_t *src = s->pix + (size_t)y * (size_t)s->w;\n";
+    o_ << "    for (int64_t x = 0; x < s->w; ++x) {\n";
+    o_ << "      row[x * 3] = (uint8_t)(src[x] >> 16);\n";
+    o_ << "      row[x * 3 + 1] = (uint8_t)(src[x] >> 8);\n";
+    o_ << "      row[x * 3 + 2] = (uint8_t)src[x];\n";
+    o_ << "    }\n";
+    o_ << "    if (fwrite(row, 1, (size_t)s->w * 3u, f) != (size_t)s->w * 3u) ok = 0;\n";
+    o_ << "  }\n";
+    o_ << "  free(row);\n";
+    o_ << "  if (fclose(f) != 0) return 0;\n";
+    o_ << "  return ok;\n";
     o_ << "}\n";
-    o_ << "#define LS_MAX_GFX 256\n";
     o_ << "typedef struct {\n";
-    o_ << "  uint8_t *pix;\n";
-    o_ << "  int64_t w;\n";
-    o_ << "  int64_t h;\n";
+    o_ << "  ls_surface s;\n";
     o_ << "  ls_bool active;\n";
     o_ << "} ls_gfx;\n";
     o_ << "static ls_gfx ls_gfx_slots[LS_MAX_GFX];\n";
@@ -8269,11 +13530,6 @@ private:
     o_ << "  if (id < 0 || id >= LS_MAX_GFX) return;\n";
     o_ << "  if (ls_gfx_free_top < LS_MAX_GFX) ls_gfx_free_ids[ls_gfx_free_top++] = id;\n";
     o_ << "}\n";
-    o_ << "static inline uint8_t ls_color_u8(int64_t v) {\n";
-    o_ << "  if (v <= 0) return 0;\n";
-    o_ << "  if (v >= 255) return 255;\n";
-    o_ << "  return (uint8_t)v;\n";
-    o_ << "}\n";
     o_ << "static inline ls_gfx *ls_get_gfx(int64_t id) {\n";
     o_ << "  if (id < 0 || id >= ls_gfx_count) return NULL;\n";
     o_ << "  if (!ls_gfx_slots[id].active) return NULL;\n";
@@ -8281,169 +13537,65 @@ private:
     o_ << "}\n";
     o_ << "static inline int64_t gfx_new(int64_t w, int64_t h) {\n";
     o_ << "  if (w <= 0 || h <= 0 || w > 16384 || h > 16384) return -1;\n";
-    o_ << "  const size_t area = (size_t)w * (size_t)h;\n";
-    o_ << "  if (area == 0 || area > (((size_t)-1) / 3)) return -1;\n";
-    o_ << "  const size_t bytes = area * 3;\n";
-    o_ << "  uint8_t *pix = (uint8_t *)malloc(bytes);\n";
-    o_ << "  if (!pix) return -1;\n";
-    o_ << "  memset(pix, 0, bytes);\n";
     o_ << "  const int64_t id = ls_gfx_alloc_id();\n";
-    o_ << "  if (id < 0) {\n";
-    o_ << "    free(pix);\n";
+    o_ << "  if (id < 0) return -1;\n";
+    o_ << "  if (!ls_surface_init(&ls_gfx_slots[id].s, w, h)) {\n";
+    o_ << "    ls_gfx_release_id(id);\n";
     o_ << "    return -1;\n";
     o_ << "  }\n";
-    o_ << "  ls_gfx_slots[id].pix = pix;\n";
-    o_ << "  ls_gfx_slots[id].w = w;\n";
-    o_ << "  ls_gfx_slots[id].h = h;\n";
     o_ << "  ls_gfx_slots[id].active = 1;\n";
     o_ << "  return id;\n";
     o_ << "}\n";
     o_ << "static inline void gfx_free(int64_t id) {\n";
     o_ << "  ls_gfx *g = ls_get_gfx(id);\n";
     o_ << "  if (!g) return;\n";
-    o_ << "  if (g->pix) free(g->pix);\n";
-    o_ << "  g->pix = NULL;\n";
-    o_ << "  g->w = 0;\n";
-    o_ << "  g->h = 0;\n";
+    o_ << "  ls_surface_release(&g->s);\n";
     o_ << "  g->active = 0;\n";
     o_ << "  ls_gfx_release_id(id);\n";
     o_ << "}\n";
     o_ << "static inline int64_t gfx_width(int64_t id) {\n";
     o_ << "  ls_gfx *g = ls_get_gfx(id);\n";
-    o_ << "  return g ? g->w : 0;\n";
+    o_ << "  return g ? g->s.w : 0;\n";
     o_ << "}\n";
     o_ << "static inline int64_t gfx_height(int64_t id) {\n";
     o_ << "  ls_gfx *g = ls_get_gfx(id);\n";
-    o_ << "  return g ? g->h : 0;\n";
-    o_ << "}\n";
-    o_ << "static inline void ls_gfx_set_pixel_u8(ls_gfx *g, int64_t x, int64_t y, uint8_t r, uint8_t gg, uint8_t b) {\n";
-    o_ << "  if (!g || !g->pix) return;\n";
-    o_ << "  if ((uint64_t)x >= (uint64_t)g->w || (uint64_t)y >= (uint64_t)g->h) return;\n";
-    o_ << "  const size_t idx = (((size_t)y * (size_t)g->w) + (size_t)x) * 3;\n";
-    o_ << "  g->pix[idx] = r;\n";
-    o_ << "  g->pix[idx + 1] = gg;\n";
-    o_ << "  g->pix[idx + 2] = b;\n";
+    o_ << "  return g ? g->s.h : 0;\n";
     o_ << "}\n";
     o_ << "static inline void gfx_clear(int64_t id, int64_t r, int64_t gg, int64_t b) {\n";
     o_ << "  ls_gfx *g = ls_get_gfx(id);\n";
-    o_ << "  if (!g || !g->pix) return;\n";
-    o_ << "  const uint8_t r8 = ls_color_u8(r);\n";
-    o_ << "  const uint8_t g8 = ls_color_u8(gg);\n";
-    o_ << "  const uint8_t b8 = ls_color_u8(b);\n";
-    o_ << "  const size_t area = (size_t)g->w * (size_t)g->h;\n";
-    o_ << "  const size_t bytes = area * 3;\n";
-    o_ << "  if (r8 == g8 && g8 == b8) {\n";
-    o_ << "    memset(g->pix, r8, bytes);\n";
-    o_ << "    return;\n";
-    o_ << "  }\n";
-    o_ << "  uint8_t *p = g->pix;\n";
-    o_ << "  for (size_t i = 0; i < area; ++i) {\n";
-    o_ << "    p[0] = r8;\n";
-    o_ << "    p[1] = g8;\n";
-    o_ << "    p[2] = b8;\n";
-    o_ << "    p += 3;\n";
-    o_ << "  }\n";
+    o_ << "  if (g) ls_surface_clear(&g->s, r, gg, b);\n";
     o_ << "}\n";
     o_ << "static inline void gfx_set(int64_t id, int64_t x, int64_t y, int64_t r, int64_t gg, int64_t b) {\n";
     o_ << "  ls_gfx *g = ls_get_gfx(id);\n";
-    o_ << "  if (!g) return;\n";
-    o_ << "  ls_gfx_set_pixel_u8(g, x, y, ls_color_u8(r), ls_color_u8(gg), ls_color_u8(b));\n";
+    o_ << "  if (g) ls_surface_set(&g->s, x, y, r, gg, b);\n";
     o_ << "}\n";
     o_ << "static inline int64_t gfx_get(int64_t id, int64_t x, int64_t y) {\n";
     o_ << "  ls_gfx *g = ls_get_gfx(id);\n";
-    o_ << "  if (!g || !g->pix) return -1;\n";
-    o_ << "  if ((uint64_t)x >= (uint64_t)g->w || (uint64_t)y >= (uint64_t)g->h) return -1;\n";
-    o_ << "  const size_t idx = (((size_t)y * (size_t)g->w) + (size_t)x) * 3;\n";
-    o_ << "  return ((int64_t)g->pix[idx] << 16) | ((int64_t)g->pix[idx + 1] << 8) | (int64_t)g->pix[idx + 2];\n";
+    o_ << "  return g ? ls_surface_get(&g->s, x, y) : -1;\n";
     o_ << "}\n";
-    o_ << "static inline void gfx_line(int64_t id, int64_t x0, int64_t y0, int64_t x1, int64_t y1, int64_t r, int64_t gg, "
-          "int64_t b) {\n";
+    o_ << "static inline void gfx_line(int64_t id, int64_t x0, int64_t y0, int64_t x1, int64_t y1, int64_t r, int64_t gg, int64_t b) {\n";
     o_ << "  ls_gfx *g = ls_get_gfx(id);\n";
-    o_ << "  if (!g) return;\n";
-    o_ << "  const uint8_t r8 = ls_color_u8(r);\n";
-    o_ << "  const uint8_t g8 = ls_color_u8(gg);\n";
-    o_ << "  const uint8_t b8 = ls_color_u8(b);\n";
-    o_ << "  int64_t dx = x1 - x0;\n";
-    o_ << "  if (dx < 0) dx = -dx;\n";
-    o_ << "  int64_t sx = x0 < x1 ? 1 : -1;\n";
-    o_ << "  int64_t dy = y1 - y0;\n";
-    o_ << "  if (dy < 0) dy = -dy;\n";
-    o_ << "  int64_t sy = y0 < y1 ? 1 : -1;\n";
-    o_ << "  int64_t err = dx - dy;\n";
-    o_ << "  for (;;) {\n";
-    o_ << "    ls_gfx_set_pixel_u8(g, x0, y0, r8, g8, b8);\n";
-    o_ << "    if (x0 == x1 && y0 == y1) break;\n";
-    o_ << "    const int64_t e2 = err << 1;\n";
-    o_ << "    if (e2 > -dy) {\n";
-    o_ << "      err -= dy;\n";
-    o_ << "      x0 += sx;\n";
-    o_ << "    }\n";
-    o_ << "    if (e2 < dx) {\n";
-    o_ << "      err += dx;\n";
-    o_ << "      y0 += sy;\n";
-    o_ << "    }\n";
-    o_ << "  }\n";
+    o_ << "  if (g) ls_surface_line(&g->s, x0, y0, x1, y1, r, gg, b);\n";
     o_ << "}\n";
-    o_ << "static inline void gfx_rect(int64_t id, int64_t x, int64_t y, int64_t w, int64_t h, int64_t r, int64_t gg, "
-          "int64_t b, ls_bool fill) {\n";
+    o_ << "static inline void gfx_rect(int64_t id, int64_t x, int64_t y, int64_t w, int64_t h, int64_t r, int64_t gg, int64_t b, ls_bool fill) {\n";
     o_ << "  ls_gfx *g = ls_get_gfx(id);\n";
-    o_ << "  if (!g || !g->pix) return;\n";
-    o_ << "  if (w <= 0 || h <= 0) return;\n";
-    o_ << "  if (x > 9223372036854775807LL - w) return;\n";
-    o_ << "  if (y > 9223372036854775807LL - h) return;\n";
-    o_ << "  int64_t x0 = x;\n";
-    o_ << "  int64_t y0 = y;\n";
-    o_ << "  int64_t x1 = x + w;\n";
-    o_ << "  int64_t y1 = y + h;\n";
-    o_ << "  if (x1 <= 0 || y1 <= 0 || x0 >= g->w || y0 >= g->h) return;\n";
-    o_ << "  if (x0 < 0) x0 = 0;\n";
-    o_ << "  if (y0 < 0) y0 = 0;\n";
-    o_ << "  if (x1 > g->w) x1 = g->w;\n";
-    o_ << "  if (y1 > g->h) y1 = g->h;\n";
-    o_ << "  const uint8_t r8 = ls_color_u8(r);\n";
-    o_ << "  const uint8_t g8 = ls_color_u8(gg);\n";
-    o_ << "  const uint8_t b8 = ls_color_u8(b);\n";
-    o_ << "  if (fill) {\n";
-    o_ << "    for (int64_t yy = y0; yy < y1; ++yy) {\n";
-    o_ << "      uint8_t *row = g->pix + ((((size_t)yy * (size_t)g->w) + (size_t)x0) * 3);\n";
-    o_ << "      for (int64_t xx = x0; xx < x1; ++xx) {\n";
-    o_ << "        row[0] = r8;\n";
-    o_ << "        row[1] = g8;\n";
-    o_ << "        row[2] = b8;\n";
-    o_ << "        row += 3;\n";
-    o_ << "      }\n";
-    o_ << "    }\n";
-    o_ << "    return;\n";
-    o_ << "  }\n";
-    o_ << "  for (int64_t xx = x0; xx < x1; ++xx) {\n";
-    o_ << "    ls_gfx_set_pixel_u8(g, xx, y0, r8, g8, b8);\n";
-    o_ << "    ls_gfx_set_pixel_u8(g, xx, y1 - 1, r8, g8, b8);\n";
-    o_ << "  }\n";
-    o_ << "  for (int64_t yy = y0 + 1; yy + 1 < y1; ++yy) {\n";
-    o_ << "    ls_gfx_set_pixel_u8(g, x0, yy, r8, g8, b8);\n";
-    o_ << "    ls_gfx_set_pixel_u8(g, x1 - 1, yy, r8, g8, b8);\n";
-    o_ << "  }\n";
+    o_ << "  if (g) ls_surface_rect(&g->s, x, y, w, h, ls_pix_rgb(r, gg, b), fill);\n";
     o_ << "}\n";
     o_ << "static inline ls_bool gfx_save_ppm(int64_t id, const char *path) {\n";
     o_ << "  ls_gfx *g = ls_get_gfx(id);\n";
-    o_ << "  if (!g || !g->pix) return 0;\n";
-    o_ << "  const char *p = path ? path : \"\";\n";
-    o_ << "  if (p[0] == '\\0') return 0;\n";
-    o_ << "  FILE *f = NULL;\n";
-    o_ << "#if defined(_WIN32)\n";
-    o_ << "  if (fopen_s(&f, p, \"wb\") != 0 || !f) return 0;\n";
-    o_ << "#else\n";
-    o_ << "  f = fopen(p, \"wb\");\n";
-    o_ << "  if (!f) return 0;\n";
-    o_ << "#endif\n";
-    o_ << "  if (fprintf(f, \"P6\\n%lld %lld\\n255\\n\", (long long)g->w, (long long)g->h) < 0) {\n";
-    o_ << "    fclose(f);\n";
-    o_ << "    return 0;\n";
-    o_ << "  }\n";
-    o_ << "  const size_t bytes = ((size_t)g->w * (size_t)g->h) * 3;\n";
-    o_ << "  const size_t wrote = fwrite(g->pix, 1, bytes, f);\n";
-    o_ << "  if (fclose(f) != 0) return 0;\n";
-    o_ << "  return wrote == bytes ? 1 : 0;\n";
+    o_ << "  return g ? ls_surface_save_ppm(&g->s, path) : 0;\n";
+    o_ << "}\n";
+    o_ << "static inline void gfx_set_batching(int64_t id, ls_bool enabled) {\n";
+    o_ << "  ls_gfx *g = ls_get_gfx(id);\n";
+    o_ << "  if (g) ls_surface_set_batching(&g->s, enabled ? 1 : 0);\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool gfx_batching_enabled(int64_t id) {\n";
+    o_ << "  ls_gfx *g = ls_get_gfx(id);\n";
+    o_ << "  return g ? g->s.batching : 0;\n";
+    o_ << "}\n";
+    o_ << "static inline void gfx_flush(int64_t id) {\n";
+    o_ << "  ls_gfx *g = ls_get_gfx(id);\n";
+    o_ << "  if (g) ls_surface_flush(&g->s);\n";
     o_ << "}\n";
     o_ << "static inline int64_t bitmap_new(int64_t w, int64_t h) { return gfx_new(w, h); }\n";
     o_ << "static inline void bitmap_free(int64_t id) { gfx_free(id); }\n";
@@ -8487,13 +13639,11 @@ private:
     o_ << "  for (int64_t y = 0; y < bh; ++y) {\n";
     o_ << "    if (fread(row, 1, row_stride, f) != row_stride) { free(row); fclose(f); gfx_free(id); return -1; }\n";
     o_ << "    const int64_t dy = top_down ? y : (bh - 1 - y);\n";
-    o_ << "    uint8_t *dst = g->pix + ((size_t)dy * (size_t)g->w * 3u);\n";
+    o_ << "    uint32_t *dst = g->s.pix + ((size_t)dy * (size_t)g->s.w);\n";
     o_ << "    const size_t step = (size_t)bpp / 8u;\n";
     o_ << "    for (int64_t x = 0; x < (int64_t)bw; ++x) {\n";
     o_ << "      const uint8_t *src = row + ((size_t)x * step);\n";
-    o_ << "      dst[(size_t)x * 3u + 0u] = src[2];\n";
-    o_ << "      dst[(size_t)x * 3u + 1u] = src[1];\n";
-    o_ << "      dst[(size_t)x * 3u + 2u] = src[0];\n";
+    o_ << "      dst[x] = ((uint32_t)src[2] << 16) | ((uint32_t)src[1] << 8) | (uint32_t)src[0];\n";
     o_ << "    }\n";
     o_ << "  }\n";
     o_ << "  free(row);\n";
@@ -8541,13 +13691,21 @@ private:
     o_ << "  const int64_t id = gfx_new(w, h);\n";
     o_ << "  if (id < 0) { fclose(f); return -1; }\n";
     o_ << "  ls_gfx *g = ls_get_gfx(id);\n";
-    o_ << "  const size_t bytes = ((size_t)w * (size_t)h) * 3u;\n";
+    o_ << "  const size_t area = (size_t)w * (size_t)h;\n";
     o_ << "  if (binary) {\n";
-    o_ << "    if (!g || fread(g->pix, 1, bytes, f) != bytes) { fclose(f); gfx_free(id); return -1; }\n";
+    o_ << "    uint8_t *row = (uint8_t *)malloc((size_t)w * 3u);\n";
+    o_ << "    if (!g || !row) { free(row); fclose(f); gfx_free(id); return -1; }\n";
+    o_ << "    for (int64_t y = 0; y < h; ++y) {\n";
+    o_ << "      if (fread(row, 1, (size_t)w * 3u, f) != (size_t)w * 3u) { free(row); fclose(f); gfx_free(id); return -1; }\n";
+    o_ << "      uint32_t *dst = g->s.pix + (size_t)y * (size_t)w;\n";
+    o_ << "      for (int64_t x = 0; x < w; ++x) dst[x] = ((uint32_t)row[x * 3] << 16) | ((uint32_t)row[x * 3 + 1] << 8) | (uint32_t)row[x * 3 + 2];\n";
+    o_ << "    }\n";
+    o_ << "    free(row);\n";
     o_ << "  } else {\n";
-    o_ << "    for (size_t i = 0; i < bytes; ++i) {\n";
+    o_ << "    for (size_t i = 0; i < area * 3u; ++i) {\n";
     o_ << "      if (!ls_ppm_next_token(f, tok, sizeof(tok))) { fclose(f); gfx_free(id); return -1; }\n";
-    o_ << "      g->pix[i] = ls_color_u8(strtoll(tok, NULL, 10));\n";
+    o_ << "      const int shift = 16 - (int)(i % 3u) * 8;\n";
+    o_ << "      g->s.pix[i / 3u] |= (uint32_t)ls_color_u8(strtoll(tok, NULL, 10)) << shift;\n";
     o_ << "    }\n";
     o_ << "  }\n";
     o_ << "  fclose(f);\n";
@@ -8561,92 +13719,11 @@ private:
     o_ << "static inline void gfx_draw_bitmap(int64_t dst_id, int64_t src_id, int64_t dst_x, int64_t dst_y) {\n";
     o_ << "  ls_gfx *dst = ls_get_gfx(dst_id);\n";
     o_ << "  ls_gfx *src = ls_get_gfx(src_id);\n";
-    o_ << "  if (!dst || !src || !dst->pix || !src->pix) return;\n";
-    o_ << "  int64_t sx0 = 0, sy0 = 0, sx1 = src->w, sy1 = src->h;\n";
-    o_ << "  if (dst_x < 0) sx0 = -dst_x;\n";
-    o_ << "  if (dst_y < 0) sy0 = -dst_y;\n";
-    o_ << "  if (dst_x + sx1 > dst->w) sx1 = dst->w - dst_x;\n";
-    o_ << "  if (dst_y + sy1 > dst->h) sy1 = dst->h - dst_y;\n";
-    o_ << "  if (sx0 >= sx1 || sy0 >= sy1) return;\n";
-    o_ << "  for (int64_t y = sy0; y < sy1; ++y) {\n";
-    o_ << "    uint8_t *dst_row = dst->pix + ((((size_t)(dst_y + y) * (size_t)dst->w) + (size_t)(dst_x + sx0)) * 3u);\n";
-    o_ << "    const uint8_t *src_row = src->pix + ((((size_t)y * (size_t)src->w) + (size_t)sx0) * 3u);\n";
-    o_ << "    memcpy(dst_row, src_row, (size_t)(sx1 - sx0) * 3u);\n";
-    o_ << "  }\n";
-    o_ << "}\n";
-    o_ << "static inline uint8_t ls_font5x7_row(unsigned char ch, int row) {\n";
-    o_ << "  if (ch >= 'a' && ch <= 'z') ch = (unsigned char)(ch - 32);\n";
-    o_ << "  switch (ch) {\n";
-    o_ << "  case 'A': { static const uint8_t r[7] = {14,17,17,31,17,17,17}; return r[row]; }\n";
-    o_ << "  case 'B': { static const uint8_t r[7] = {30,17,17,30,17,17,30}; return r[row]; }\n";
-    o_ << "  case 'C': { static const uint8_t r[7] = {14,17,16,16,16,17,14}; return r[row]; }\n";
-    o_ << "  case 'D': { static const uint8_t r[7] = {30,17,17,17,17,17,30}; return r[row]; }\n";
-    o_ << "  case 'E': { static const uint8_t r[7] = {31,16,16,30,16,16,31}; return r[row]; }\n";
-    o_ << "  case 'F': { static const uint8_t r[7] = {31,16,16,30,16,16,16}; return r[row]; }\n";
-    o_ << "  case 'G': { static const uint8_t r[7] = {14,17,16,23,17,17,14}; return r[row]; }\n";
-    o_ << "  case 'H': { static const uint8_t r[7] = {17,17,17,31,17,17,17}; return r[row]; }\n";
-    o_ << "  case 'I': { static const uint8_t r[7] = {14,4,4,4,4,4,14}; return r[row]; }\n";
-    o_ << "  case 'J': { static const uint8_t r[7] = {1,1,1,1,17,17,14}; return r[row]; }\n";
-    o_ << "  case 'K': { static const uint8_t r[7] = {17,18,20,24,20,18,17}; return r[row]; }\n";
-    o_ << "  case 'L': { static const uint8_t r[7] = {16,16,16,16,16,16,31}; return r[row]; }\n";
-    o_ << "  case 'M': { static const uint8_t r[7] = {17,27,21,21,17,17,17}; return r[row]; }\n";
-    o_ << "  case 'N': { static const uint8_t r[7] = {17,25,21,19,17,17,17}; return r[row]; }\n";
-    o_ << "  case 'O': { static const uint8_t r[7] = {14,17,17,17,17,17,14}; return r[row]; }\n";
-    o_ << "  case 'P': { static const uint8_t r[7] = {30,17,17,30,16,16,16}; return r[row]; }\n";
-    o_ << "  case 'Q': { static const uint8_t r[7] = {14,17,17,17,21,18,13}; return r[row]; }\n";
-    o_ << "  case 'R': { static const uint8_t r[7] = {30,17,17,30,20,18,17}; return r[row]; }\n";
-    o_ << "  case 'S': { static const uint8_t r[7] = {15,16,16,14,1,1,30}; return r[row]; }\n";
-    o_ << "  case 'T': { static const uint8_t r[7] = {31,4,4,4,4,4,4}; return r[row]; }\n";
-    o_ << "  case 'U': { static const uint8_t r[7] = {17,17,17,17,17,17,14}; return r[row]; }\n";
-    o_ << "  case 'V': { static const uint8_t r[7] = {17,17,17,17,17,10,4}; return r[row]; }\n";
-    o_ << "  case 'W': { static const uint8_t r[7] = {17,17,17,21,21,21,10}; return r[row]; }\n";
-    o_ << "  case 'X': { static const uint8_t r[7] = {17,17,10,4,10,17,17}; return r[row]; }\n";
-    o_ << "  case 'Y': { static const uint8_t r[7] = {17,17,10,4,4,4,4}; return r[row]; }\n";
-    o_ << "  case 'Z': { static const uint8_t r[7] = {31,1,2,4,8,16,31}; return r[row]; }\n";
-    o_ << "  case '0': { static const uint8_t r[7] = {14,17,19,21,25,17,14}; return r[row]; }\n";
-    o_ << "  case '1': { static const uint8_t r[7] = {4,12,4,4,4,4,14}; return r[row]; }\n";
-    o_ << "  case '2': { static const uint8_t r[7] = {14,17,1,2,4,8,31}; return r[row]; }\n";
-    o_ << "  case '3': { static const uint8_t r[7] = {30,1,1,14,1,1,30}; return r[row]; }\n";
-    o_ << "  case '4': { static const uint8_t r[7] = {2,6,10,18,31,2,2}; return r[row]; }\n";
-    o_ << "  case '5': { static const uint8_t r[7] = {31,16,16,30,1,1,30}; return r[row]; }\n";
-    o_ << "  case '6': { static const uint8_t r[7] = {14,16,16,30,17,17,14}; return r[row]; }\n";
-    o_ << "  case '7': { static const uint8_t r[7] = {31,1,2,4,8,8,8}; return r[row]; }\n";
-    o_ << "  case '8': { static const uint8_t r[7] = {14,17,17,14,17,17,14}; return r[row]; }\n";
-    o_ << "  case '9': { static const uint8_t r[7] = {14,17,17,15,1,1,14}; return r[row]; }\n";
-    o_ << "  case '.': return row == 6 ? 4 : 0;\n";
-    o_ << "  case ':': return (row == 2 || row == 5) ? 4 : 0;\n";
-    o_ << "  case '-': return row == 3 ? 31 : 0;\n";
-    o_ << "  case '_': return row == 6 ? 31 : 0;\n";
-    o_ << "  case '/': return row < 7 ? (uint8_t)(1u << (6 - row > 4 ? 4 : 6 - row)) : 0;\n";
-    o_ << "  case '!': return row < 5 ? 4 : (row == 6 ? 4 : 0);\n";
-    o_ << "  case '?': { static const uint8_t r[7] = {14,17,1,2,4,0,4}; return r[row]; }\n";
-    o_ << "  case ' ': return 0;\n";
-    o_ << "  default: return (row == 0 || row == 6) ? 31 : 17;\n";
-    o_ << "  }\n";
-    o_ << "}\n";
-    o_ << "static inline void ls_draw_text_pixels(uint8_t *pix, int64_t w, int64_t h, int64_t x, int64_t y, const char *text, uint8_t r, uint8_t g, uint8_t b) {\n";
-    o_ << "  if (!pix || !text) return;\n";
-    o_ << "  int64_t pen = x;\n";
-    o_ << "  for (const unsigned char *s = (const unsigned char *)text; *s; ++s, pen += 6) {\n";
-    o_ << "    if (*s == '\\n') { pen = x; y += 8; continue; }\n";
-    o_ << "    for (int row = 0; row < 7; ++row) {\n";
-    o_ << "      const int64_t yy = y + row;\n";
-    o_ << "      if ((uint64_t)yy >= (uint64_t)h) continue;\n";
-    o_ << "      const uint8_t bits = ls_font5x7_row(*s, row);\n";
-    o_ << "      for (int col = 0; col < 5; ++col) {\n";
-    o_ << "        if ((bits & (uint8_t)(1u << (4 - col))) == 0) continue;\n";
-    o_ << "        const int64_t xx = pen + col;\n";
-    o_ << "        if ((uint64_t)xx >= (uint64_t)w) continue;\n";
-    o_ << "        const size_t idx = (((size_t)yy * (size_t)w) + (size_t)xx) * 3u;\n";
-    o_ << "        pix[idx] = r; pix[idx + 1] = g; pix[idx + 2] = b;\n";
-    o_ << "      }\n";
-    o_ << "    }\n";
-    o_ << "  }\n";
+    o_ << "  if (dst && src) ls_surface_blit(&dst->s, &src->s, dst_x, dst_y);\n";
     o_ << "}\n";
     o_ << "static inline void gfx_text(int64_t id, int64_t x, int64_t y, const char *text, int64_t r, int64_t g, int64_t b) {\n";
     o_ << "  ls_gfx *dst = ls_get_gfx(id);\n";
-    o_ << "  if (!dst || !dst->pix) return;\n";
-    o_ << "  ls_draw_text_pixels(dst->pix, dst->w, dst->h, x, y, text, ls_color_u8(r), ls_color_u8(g), ls_color_u8(b));\n";
+    o_ << "  if (dst) ls_surface_text(&dst->s, x, y, text, r, g, b);\n";
     o_ << "}\n";
     o_ << "static inline int64_t gfx_text_width(const char *text) { return text ? (int64_t)strlen(text) * 6 : 0; }\n";
     o_ << "static inline int ls_cstr_ieq(const char *a, const char *b) {\n";
@@ -8693,9 +13770,9 @@ private:
     o_ << "static inline ls_bool renderer_is_accelerated(void) { return (ls_renderer_hardware_requested && ls_renderer_backend_code != 0) ? 1 : 0; }\n";
     o_ << "#define LS_MAX_GAME 32\n";
     o_ << "typedef struct {\n";
-    o_ << "  uint8_t *pix;\n";
-    o_ << "  int64_t w;\n";
-    o_ << "  int64_t h;\n";
+    o_ << "  ls_surface s;\n";
+    o_ << "  int64_t dirty_pixels;\n";
+    o_ << "  int64_t dirty_rects;\n";
     o_ << "  ls_bool active;\n";
     o_ << "  ls_bool headless;\n";
     o_ << "  ls_bool should_close;\n";
@@ -8746,14 +13823,6 @@ private:
     o_ << "  if (!ls_games[id].active) return NULL;\n";
     o_ << "  return &ls_games[id];\n";
     o_ << "}\n";
-    o_ << "static inline void ls_game_set_pixel_u8(ls_game *g, int64_t x, int64_t y, uint8_t r, uint8_t gg, uint8_t b) {\n";
-    o_ << "  if (!g || !g->pix) return;\n";
-    o_ << "  if ((uint64_t)x >= (uint64_t)g->w || (uint64_t)y >= (uint64_t)g->h) return;\n";
-    o_ << "  const size_t idx = (((size_t)y * (size_t)g->w) + (size_t)x) * 3;\n";
-    o_ << "  g->pix[idx] = r;\n";
-    o_ << "  g->pix[idx + 1] = gg;\n";
-    o_ << "  g->pix[idx + 2] = b;\n";
-    o_ << "}\n";
     o_ << "static inline void ls_game_sleep_ms(double ms) {\n";
     o_ << "  if (!(ms > 0.0)) return;\n";
     o_ << "#if defined(_WIN32)\n";
@@ -8840,6 +13909,9 @@ private:
     o_ << "    if (g) g->should_close = 1;\n";
     o_ << "    return 0;\n";
     o_ << "  }\n";
+    o_ << "  if (msg == WM_PAINT || msg == WM_SIZE) {\n";
+    o_ << "    if (g) ls_surface_damage_all(&g->s);\n";
+    o_ << "  }\n";
     o_ << "  return DefWindowProcA(hwnd, msg, wp, lp);\n";
     o_ << "}\n";
     o_ << "static inline void ls_game_register_class(void) {\n";
@@ -8878,21 +13950,16 @@ private:
     o_ << "}\n";
     o_ << "static inline int64_t game_new(int64_t w, int64_t h, const char *title, ls_bool visible) {\n";
     o_ << "  if (w <= 0 || h <= 0 || w > 8192 || h > 8192) return -1;\n";
-    o_ << "  const size_t area = (size_t)w * (size_t)h;\n";
-    o_ << "  if (area == 0 || area > (((size_t)-1) / 3)) return -1;\n";
-    o_ << "  uint8_t *pix = (uint8_t *)malloc(area * 3);\n";
-    o_ << "  if (!pix) return -1;\n";
-    o_ << "  memset(pix, 0, area * 3);\n";
     o_ << "  const int64_t id = ls_game_alloc_id();\n";
-    o_ << "  if (id < 0) {\n";
-    o_ << "    free(pix);\n";
-    o_ << "    return -1;\n";
-    o_ << "  }\n";
+    o_ << "  if (id < 0) return -1;\n";
     o_ << "  ls_game *g = &ls_games[id];\n";
     o_ << "  memset(g, 0, sizeof(*g));\n";
-    o_ << "  g->pix = pix;\n";
-    o_ << "  g->w = w;\n";
-    o_ << "  g->h = h;\n";
+    o_ << "  if (!ls_surface_init(&g->s, w, h)) {\n";
+    o_ << "    ls_game_release_id(id);\n";
+    o_ << "    return -1;\n";
+    o_ << "  }\n";
+    o_ << "  g->s.track_damage = 1;\n";
+    o_ << "  ls_surface_damage_all(&g->s);\n";
     o_ << "  g->active = 1;\n";
     o_ << "  g->headless = visible ? 0 : 1;\n";
     o_ << "  g->target_fps = 60;\n";
@@ -8933,7 +14000,7 @@ private:
     o_ << "                             CW_USEDEFAULT, CW_USEDEFAULT, r.right - r.left, r.bottom - r.top,\n";
     o_ << "                             NULL, NULL, GetModuleHandleA(NULL), g);\n";
     o_ << "    if (!g->hwnd) {\n";
-    o_ << "      free(g->pix);\n";
+    o_ << "      ls_surface_release(&g->s);\n";
     o_ << "      memset(g, 0, sizeof(*g));\n";
     o_ << "      ls_game_release_id(id);\n";
     o_ << "      return -1;\n";
@@ -8949,7 +14016,7 @@ private:
     o_ << "    g->bmi.bmiHeader.biWidth = (LONG)w;\n";
     o_ << "    g->bmi.bmiHeader.biHeight = -(LONG)h;\n";
     o_ << "    g->bmi.bmiHeader.biPlanes = 1;\n";
-    o_ << "    g->bmi.bmiHeader.biBitCount = 24;\n";
+    o_ << "    g->bmi.bmiHeader.biBitCount = 32;\n";
     o_ << "    g->bmi.bmiHeader.biCompression = BI_RGB;\n";
     o_ << "  }\n";
     o_ << "#else\n";
@@ -8974,17 +14041,17 @@ private:
     o_ << "  }\n";
     o_ << "  g->hwnd = NULL;\n";
     o_ << "#endif\n";
-    o_ << "  if (g->pix) free(g->pix);\n";
+    o_ << "  ls_surface_release(&g->s);\n";
     o_ << "  memset(g, 0, sizeof(*g));\n";
     o_ << "  ls_game_release_id(id);\n";
     o_ << "}\n";
     o_ << "static inline int64_t game_width(int64_t id) {\n";
     o_ << "  ls_game *g = ls_get_game(id);\n";
-    o_ << "  return g ? g->w : 0;\n";
+    o_ << "  return g ? g->s.w : 0;\n";
     o_ << "}\n";
     o_ << "static inline int64_t game_height(int64_t id) {\n";
     o_ << "  ls_game *g = ls_get_game(id);\n";
-    o_ << "  return g ? g->h : 0;\n";
+    o_ << "  return g ? g->s.h : 0;\n";
     o_ << "}\n";
     o_ << "static inline void game_set_target_fps(int64_t id, int64_t fps) {\n";
     o_ << "  ls_game *g = ls_get_game(id);\n";
@@ -9011,6 +14078,7 @@ private:
     o_ << "  g->window_mode = code;\n";
     o_ << "#if defined(_WIN32)\n";
     o_ << "  if (g->headless || !g->hwnd) return 1;\n";
+    o_ << "  ls_surface_damage_all(&g->s);\n";
     o_ << "  if (code != 0) {\n";
     o_ << "    if (!g->fullscreen) {\n";
     o_ << "      g->windowed_style = (DWORD)GetWindowLongPtrA(g->hwnd, GWL_STYLE);\n";
@@ -9043,8 +14111,8 @@ private:
     o_ << "      RECT cr;\n";
     o_ << "      cr.left = 0;\n";
     o_ << "      cr.top = 0;\n";
-    o_ << "      cr.right = (LONG)g->w;\n";
-    o_ << "      cr.bottom = (LONG)g->h;\n";
+    o_ << "      cr.right = (LONG)g->s.w;\n";
+    o_ << "      cr.bottom = (LONG)g->s.h;\n";
     o_ << "      (void)AdjustWindowRectEx(&cr, g->windowed_style ? g->windowed_style : WS_OVERLAPPEDWINDOW, 0,\n";
     o_ << "                               g->windowed_ex_style);\n";
     o_ << "      ww = cr.right - cr.left;\n";
@@ -9129,9 +14197,9 @@ private:
     o_ << "        ny = ls_clamp01(ny);\n";
     o_ << "        g->mouse_norm_x = nx;\n";
     o_ << "        g->mouse_norm_y = ny;\n";
-    o_ << "        if (g->w > 1) g->mouse_x = nx * (double)(g->w - 1);\n";
+    o_ << "        if (g->s.w > 1) g->mouse_x = nx * (double)(g->s.w - 1);\n";
     o_ << "        else g->mouse_x = 0.0;\n";
-    o_ << "        if (g->h > 1) g->mouse_y = ny * (double)(g->h - 1);\n";
+    o_ << "        if (g->s.h > 1) g->mouse_y = ny * (double)(g->s.h - 1);\n";
     o_ << "        else g->mouse_y = 0.0;\n";
     o_ << "      }\n";
     o_ << "    }\n";
@@ -9188,11 +14256,25 @@ private:
     o_ << "}\n";
     o_ << "static inline void game_present(int64_t id) {\n";
     o_ << "  ls_game *g = ls_get_game(id);\n";
-    o_ << "  if (!g || g->headless || g->should_close) return;\n";
+    o_ << "  if (!g) return;\n";
+    o_ << "  ls_surface_flush(&g->s);\n";
+    o_ << "  ls_rect rects[LS_GFX_DAMAGE_RECTS];\n";
+    o_ << "  const int n = ls_surface_take_damage(&g->s, rects);\n";
+    o_ << "  g->dirty_rects = n;\n";
+    o_ << "  g->dirty_pixels = 0;\n";
+    o_ << "  for (int i = 0; i < n; ++i) g->dirty_pixels += ls_rect_area(&rects[i]);\n";
+    o_ << "  if (g->headless || g->should_close) return;\n";
     o_ << "#if defined(_WIN32)\n";
     o_ << "  if (!g->hwnd || !g->hdc) return;\n";
-    o_ << "  StretchDIBits(g->hdc, 0, 0, (int)g->w, (int)g->h, 0, 0, (int)g->w, (int)g->h,\n";
-    o_ << "               g->pix, &g->bmi, DIB_RGB_COLORS, SRCCOPY);\n";
+    o_ << "  /* Each dirty rect is sent as its own top-down DIB of whole rows starting at the rect, so the source y is always 0. */\n";
+    o_ << "  BITMAPINFO bmi = g->bmi;\n";
+    o_ << "  for (int i = 0; i < n; ++i) {\n";
+    o_ << "    const ls_rect *r = &rects[i];\n";
+    o_ << "    bmi.bmiHeader.biHeight = -(LONG)(r->y1 - r->y0);\n";
+    o_ << "    StretchDIBits(g->hdc, (int)r->x0, (int)r->y0, (int)(r->x1 - r->x0), (int)(r->y1 - r->y0), (int)r->x0, 0,\n";
+    o_ << "                  (int)(r->x1 - r->x0), (int)(r->y1 - r->y0), g->s.pix + (size_t)r->y0 * (size_t)g->s.w, &bmi,\n";
+    o_ << "                  DIB_RGB_COLORS, SRCCOPY);\n";
+    o_ << "  }\n";
     o_ << "#else\n";
     o_ << "  (void)id;\n";
     o_ << "#endif\n";
@@ -9264,164 +14346,80 @@ private:
     o_ << "}\n";
     o_ << "static inline void game_clear(int64_t id, int64_t r, int64_t gg, int64_t b) {\n";
     o_ << "  ls_game *g = ls_get_game(id);\n";
-    o_ << "  if (!g || !g->pix) return;\n";
-    o_ << "  const uint8_t r8 = ls_color_u8(r);\n";
-    o_ << "  const uint8_t g8 = ls_color_u8(gg);\n";
-    o_ << "  const uint8_t b8 = ls_color_u8(b);\n";
-    o_ << "  const size_t area = (size_t)g->w * (size_t)g->h;\n";
-    o_ << "  if (r8 == g8 && g8 == b8) {\n";
-    o_ << "    memset(g->pix, r8, area * 3);\n";
-    o_ << "    return;\n";
-    o_ << "  }\n";
-    o_ << "  uint8_t *p = g->pix;\n";
-    o_ << "  for (size_t i = 0; i < area; ++i) {\n";
-    o_ << "    p[0] = r8;\n";
-    o_ << "    p[1] = g8;\n";
-    o_ << "    p[2] = b8;\n";
-    o_ << "    p += 3;\n";
-    o_ << "  }\n";
+    o_ << "  if (g) ls_surface_clear(&g->s, r, gg, b);\n";
     o_ << "}\n";
     o_ << "static inline void game_set(int64_t id, int64_t x, int64_t y, int64_t r, int64_t gg, int64_t b) {\n";
     o_ << "  ls_game *g = ls_get_game(id);\n";
-    o_ << "  if (!g) return;\n";
-    o_ << "  ls_game_set_pixel_u8(g, x, y, ls_color_u8(r), ls_color_u8(gg), ls_color_u8(b));\n";
+    o_ << "  if (g) ls_surface_set(&g->s, x, y, r, gg, b);\n";
     o_ << "}\n";
     o_ << "static inline int64_t game_get(int64_t id, int64_t x, int64_t y) {\n";
     o_ << "  ls_game *g = ls_get_game(id);\n";
-    o_ << "  if (!g || !g->pix) return -1;\n";
-    o_ << "  if ((uint64_t)x >= (uint64_t)g->w || (uint64_t)y >= (uint64_t)g->h) return -1;\n";
-    o_ << "  const size_t idx = (((size_t)y * (size_t)g->w) + (size_t)x) * 3;\n";
-    o_ << "  return ((int64_t)g->pix[idx] << 16) | ((int64_t)g->pix[idx + 1] << 8) | (int64_t)g->pix[idx + 2];\n";
+    o_ << "  return g ? ls_surface_get(&g->s, x, y) : -1;\n";
     o_ << "}\n";
-    o_ << "static inline void game_line(int64_t id, int64_t x0, int64_t y0, int64_t x1, int64_t y1, int64_t r, int64_t gg, "
-          "int64_t b) {\n";
+    o_ << "static inline void game_line(int64_t id, int64_t x0, int64_t y0, int64_t x1, int64_t y1, int64_t r, int64_t gg, int64_t b) {\n";
     o_ << "  ls_game *g = ls_get_game(id);\n";
-    o_ << "  if (!g) return;\n";
-    o_ << "  const uint8_t r8 = ls_color_u8(r);\n";
-    o_ << "  const uint8_t g8 = ls_color_u8(gg);\n";
-    o_ << "  const uint8_t b8 = ls_color_u8(b);\n";
-    o_ << "  int64_t dx = x1 - x0;\n";
-    o_ << "  if (dx < 0) dx = -dx;\n";
-    o_ << "  int64_t sx = x0 < x1 ? 1 : -1;\n";
-    o_ << "  int64_t dy = y1 - y0;\n";
-    o_ << "  if (dy < 0) dy = -dy;\n";
-    o_ << "  int64_t sy = y0 < y1 ? 1 : -1;\n";
-    o_ << "  int64_t err = dx - dy;\n";
-    o_ << "  for (;;) {\n";
-    o_ << "    ls_game_set_pixel_u8(g, x0, y0, r8, g8, b8);\n";
-    o_ << "    if (x0 == x1 && y0 == y1) break;\n";
-    o_ << "    const int64_t e2 = err << 1;\n";
-    o_ << "    if (e2 > -dy) {\n";
-    o_ << "      err -= dy;\n";
-    o_ << "      x0 += sx;\n";
-    o_ << "    }\n";
-    o_ << "    if (e2 < dx) {\n";
-    o_ << "      err += dx;\n";
-    o_ << "      y0 += sy;\n";
-    o_ << "    }\n";
-    o_ << "  }\n";
+    o_ << "  if (g) ls_surface_line(&g->s, x0, y0, x1, y1, r, gg, b);\n";
     o_ << "}\n";
-    o_ << "static inline void game_rect(int64_t id, int64_t x, int64_t y, int64_t w, int64_t h, int64_t r, int64_t gg, "
-          "int64_t b, ls_bool fill) {\n";
+    o_ << "static inline void game_rect(int64_t id, int64_t x, int64_t y, int64_t w, int64_t h, int64_t r, int64_t gg, int64_t b, ls_bool fill) {\n";
     o_ << "  ls_game *g = ls_get_game(id);\n";
-    o_ << "  if (!g || !g->pix) return;\n";
-    o_ << "  if (w <= 0 || h <= 0) return;\n";
-    o_ << "  if (x > 9223372036854775807LL - w) return;\n";
-    o_ << "  if (y > 9223372036854775807LL - h) return;\n";
-    o_ << "  int64_t x0 = x;\n";
-    o_ << "  int64_t y0 = y;\n";
-    o_ << "  int64_t x1 = x + w;\n";
-    o_ << "  int64_t y1 = y + h;\n";
-    o_ << "  if (x1 <= 0 || y1 <= 0 || x0 >= g->w || y0 >= g->h) return;\n";
-    o_ << "  if (x0 < 0) x0 = 0;\n";
-    o_ << "  if (y0 < 0) y0 = 0;\n";
-    o_ << "  if (x1 > g->w) x1 = g->w;\n";
-    o_ << "  if (y1 > g->h) y1 = g->h;\n";
-    o_ << "  const uint8_t r8 = ls_color_u8(r);\n";
-    o_ << "  const uint8_t g8 = ls_color_u8(gg);\n";
-    o_ << "  const uint8_t b8 = ls_color_u8(b);\n";
-    o_ << "  if (fill) {\n";
-    o_ << "    for (int64_t yy = y0; yy < y1; ++yy) {\n";
-    o_ << "      uint8_t *row = g->pix + ((((size_t)yy * (size_t)g->w) + (size_t)x0) * 3);\n";
-    o_ << "      for (int64_t xx = x0; xx < x1; ++xx) {\n";
-    o_ << "        row[0] = r8;\n";
-    o_ << "        row[1] = g8;\n";
-    o_ << "        row[2] = b8;\n";
-    o_ << "        row += 3;\n";
-    o_ << "      }\n";
-    o_ << "    }\n";
-    o_ << "    return;\n";
-    o_ << "  }\n";
-    o_ << "  for (int64_t xx = x0; xx < x1; ++xx) {\n";
-    o_ << "    ls_game_set_pixel_u8(g, xx, y0, r8, g8, b8);\n";
-    o_ << "    ls_game_set_pixel_u8(g, xx, y1 - 1, r8, g8, b8);\n";
-    o_ << "  }\n";
-    o_ << "  for (int64_t yy = y0 + 1; yy + 1 < y1; ++yy) {\n";
-    o_ << "    ls_game_set_pixel_u8(g, x0, yy, r8, g8, b8);\n";
-    o_ << "    ls_game_set_pixel_u8(g, x1 - 1, yy, r8, g8, b8);\n";
-    o_ << "  }\n";
+    o_ << "  if (g) ls_surface_rect(&g->s, x, y, w, h, ls_pix_rgb(r, gg, b), fill);\n";
     o_ << "}\n";
     o_ << "static inline void game_draw_gfx(int64_t game_id, int64_t gfx_id, int64_t dst_x, int64_t dst_y) {\n";
     o_ << "  ls_game *g = ls_get_game(game_id);\n";
     o_ << "  ls_gfx *src = ls_get_gfx(gfx_id);\n";
-    o_ << "  if (!g || !src || !g->pix || !src->pix) return;\n";
-    o_ << "  int64_t sx0 = 0;\n";
-    o_ << "  int64_t sy0 = 0;\n";
-    o_ << "  int64_t sx1 = src->w;\n";
-    o_ << "  int64_t sy1 = src->h;\n";
-    o_ << "  if (dst_x < 0) sx0 = -dst_x;\n";
-    o_ << "  if (dst_y < 0) sy0 = -dst_y;\n";
-    o_ << "  if (dst_x + sx1 > g->w) sx1 = g->w - dst_x;\n";
-    o_ << "  if (dst_y + sy1 > g->h) sy1 = g->h - dst_y;\n";
-    o_ << "  if (sx0 >= sx1 || sy0 >= sy1) return;\n";
-    o_ << "  for (int64_t y = sy0; y < sy1; ++y) {\n";
-    o_ << "    uint8_t *dst_row = g->pix + ((((size_t)(dst_y + y) * (size_t)g->w) + (size_t)(dst_x + sx0)) * 3);\n";
-    o_ << "    const uint8_t *src_row = src->pix + ((((size_t)y * (size_t)src->w) + (size_t)sx0) * 3);\n";
-    o_ << "    const size_t row_bytes = (size_t)(sx1 - sx0) * 3;\n";
-    o_ << "    memcpy(dst_row, src_row, row_bytes);\n";
-    o_ << "  }\n";
+    o_ << "  if (g && src) ls_surface_blit(&g->s, &src->s, dst_x, dst_y);\n";
     o_ << "}\n";
     o_ << "static inline void game_draw_bitmap(int64_t game_id, int64_t bitmap_id, int64_t dst_x, int64_t dst_y) {\n";
     o_ << "  game_draw_gfx(game_id, bitmap_id, dst_x, dst_y);\n";
     o_ << "}\n";
     o_ << "static inline void game_text(int64_t id, int64_t x, int64_t y, const char *text, int64_t r, int64_t gg, int64_t b) {\n";
     o_ << "  ls_game *g = ls_get_game(id);\n";
-    o_ << "  if (!g || !g->pix) return;\n";
-    o_ << "  ls_draw_text_pixels(g->pix, g->w, g->h, x, y, text, ls_color_u8(r), ls_color_u8(gg), ls_color_u8(b));\n";
+    o_ << "  if (g) ls_surface_text(&g->s, x, y, text, r, gg, b);\n";
     o_ << "}\n";
     o_ << "static inline int64_t game_text_width(const char *text) { return gfx_text_width(text); }\n";
     o_ << "static inline ls_bool game_save_ppm(int64_t id, const char *path) {\n";
     o_ << "  ls_game *g = ls_get_game(id);\n";
-    o_ << "  if (!g || !g->pix) return 0;\n";
-    o_ << "  const char *p = path ? path : \"\";\n";
-    o_ << "  if (p[0] == '\\0') return 0;\n";
-    o_ << "  FILE *f = NULL;\n";
-    o_ << "#if defined(_WIN32)\n";
-    o_ << "  if (fopen_s(&f, p, \"wb\") != 0 || !f) return 0;\n";
-    o_ << "#else\n";
-    o_ << "  f = fopen(p, \"wb\");\n";
-    o_ << "  if (!f) return 0;\n";
-    o_ << "#endif\n";
-    o_ << "  if (fprintf(f, \"P6\\n%lld %lld\\n255\\n\", (long long)g->w, (long long)g->h) < 0) {\n";
-    o_ << "    fclose(f);\n";
-    o_ << "    return 0;\n";
-    o_ << "  }\n";
-    o_ << "  const size_t bytes = ((size_t)g->w * (size_t)g->h) * 3;\n";
-    o_ << "  const size_t wrote = fwrite(g->pix, 1, bytes, f);\n";
-    o_ << "  if (fclose(f) != 0) return 0;\n";
-    o_ << "  return wrote == bytes ? 1 : 0;\n";
+    o_ << "  return g ? ls_surface_save_ppm(&g->s, path) : 0;\n";
     o_ << "}\n";
+    o_ << "/* FNV-1a over the R, G, B bytes of each pixel in row order. */\n";
     o_ << "static inline int64_t game_checksum(int64_t id) {\n";
     o_ << "  ls_game *g = ls_get_game(id);\n";
-    o_ << "  if (!g || !g->pix) return 0;\n";
-    o_ << "  const size_t bytes = ((size_t)g->w * (size_t)g->h) * 3;\n";
+    o_ << "  if (!g || !g->s.pix) return 0;\n";
+    o_ << "  ls_surface_flush(&g->s);\n";
+    o_ << "  const size_t area = (size_t)g->s.w * (size_t)g->s.h;\n";
     o_ << "  uint64_t h = 1469598103934665603ULL;\n";
-    o_ << "  for (size_t i = 0; i < bytes; ++i) {\n";
-    o_ << "    h ^= (uint64_t)g->pix[i];\n";
-    o_ << "    h *= 1099511628211ULL;\n";
+    o_ << "  for (size_t i = 0; i < area; ++i) {\n";
+    o_ << "    const uint32_t p = g->s.pix[i];\n";
+    o_ << "    h = (h ^ (uint64_t)((p >> 16) & 0xFFu)) * 1099511628211ULL;\n";
+    o_ << "    h = (h ^ (uint64_t)((p >> 8) & 0xFFu)) * 1099511628211ULL;\n";
+    o_ << "    h = (h ^ (uint64_t)(p & 0xFFu)) * 1099511628211ULL;\n";
     o_ << "  }\n";
     o_ << "  return (int64_t)(h & 0x7FFFFFFFFFFFFFFFULL);\n";
     o_ << "}\n";
+    o_ << "static inline void game_set_batching(int64_t id, ls_bool enabled) {\n";
+    o_ << "  ls_game *g = ls_get_game(id);\n";
+    o_ << "  if (g) ls_surface_set_batching(&g->s, enabled ? 1 : 0);\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool game_batching_enabled(int64_t id) {\n";
+    o_ << "  ls_game *g = ls_get_game(id);\n";
+    o_ << "  return g ? g->s.batching : 0;\n";
+    o_ << "}\n";
+    o_ << "static inline void game_flush(int64_t id) {\n";
+    o_ << "  ls_game *g = ls_get_game(id);\n";
+    o_ << "  if (g) ls_surface_flush(&g->s);\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t game_dirty_pixels(int64_t id) {\n";
+    o_ << "  ls_game *g = ls_get_game(id);\n";
+    o_ << "  return g ? g->dirty_pixels : 0;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t game_dirty_rect_count(int64_t id) {\n";
+    o_ << "  ls_game *g = ls_get_game(id);\n";
+    o_ << "  return g ? g->dirty_rects : 0;\n";
+    o_ << "}\n";
+    o_ << "static inline void game_invalidate(int64_t id) {\n";
+    o_ << "  ls_game *g = ls_get_game(id);\n";
+    o_ << "  if (g) ls_surface_damage_all(&g->s);\n";
+    o_ << "}\n";
     o_ << "static inline ls_bool key_down(int64_t code);\n";
     o_ << "static inline ls_bool key_down_name(const char *name);\n";
     o_ << "static inline int64_t pg_init(int64_t w, int64_t h, const char *title, ls_bool visible) {\n";
@@ -9489,39 +14487,83 @@ private:
     o_ << "static inline void pg_surface_text(int64_t surface, int64_t x, int64_t y, const char *text, int64_t r, int64_t g, int64_t b) { gfx_text(surface, x, y, text, r, g, b); }\n";
     o_ << "static inline int64_t pg_load_bitmap(const char *path) { return bitmap_load(path); }\n";
     o_ << "static inline void pg_bitmap_free(int64_t bitmap) { bitmap_free(bitmap); }\n";
-    o_ << "#define LS_MAX_PHYS 4096\n";
+    o_ << "#ifndef LS_MAX_PHYS\n";
+    o_ << "#define LS_MAX_PHYS ((int64_t)1 << 24)\n";
+    o_ << "#endif\n";
+    o_ << "#define LS_PHYS_DOUBLE_COLUMNS(X) \\\n";
+    o_ << "  X(px) X(py) X(pz) X(vx) X(vy) X(vz) X(fx) X(fy) X(fz) X(restx) X(resty) X(restz) \\\n";
+    o_ << "  X(mass) X(inv_mass) X(damping) X(bounce) X(radius)\n";
+    o_ << "#define LS_PHYS_DECLARE_COLUMN(name) double *name;\n";
+    o_ << "// Bodies are stored as dense columns; handles map to a dense slot, and phys_free moves the last body\n";
+    o_ << "// into the freed slot so phys_step always walks [0, n) with no inactive entries.\n";
     o_ << "typedef struct {\n";
-    o_ << "  double px;\n";
-    o_ << "  double py;\n";
-    o_ << "  double pz;\n";
-    o_ << "  double vx;\n";
-    o_ << "  double vy;\n";
-    o_ << "  double vz;\n";
-    o_ << "  double fx;\n";
-    o_ << "  double fy;\n";
-    o_ << "  double fz;\n";
-    o_ << "  double restx;\n";
-    o_ << "  double resty;\n";
-    o_ << "  double restz;\n";
-    o_ << "  double mass;\n";
-    o_ << "  double inv_mass;\n";
-    o_ << "  double damping;\n";
-    o_ << "  double bounce;\n";
-    o_ << "  ls_bool soft;\n";
-    o_ << "  ls_bool active;\n";
-    o_ << "} ls_phys_obj;\n";
-    o_ << "static ls_phys_obj ls_phys_objs[LS_MAX_PHYS];\n";
-    o_ << "static int64_t ls_phys_count = 0;\n";
-    o_ << "static int64_t ls_phys_free_ids[LS_MAX_PHYS];\n";
-    o_ << "static int64_t ls_phys_free_top = 0;\n";
+    o_ << "  LS_PHYS_DOUBLE_COLUMNS(LS_PHYS_DECLARE_COLUMN)\n";
+    o_ << "  ls_bool *soft;\n";
+    o_ << "  int64_t *id;\n";
+    o_ << "  int64_t n;\n";
+    o_ << "  int64_t cap;\n";
+    o_ << "  int64_t *slot;\n";
+    o_ << "  int64_t ids;\n";
+    o_ << "  int64_t id_cap;\n";
+    o_ << "  int64_t *free_ids;\n";
+    o_ << "  int64_t free_top;\n";
+    o_ << "  int64_t contacts;\n";
+    o_ << "  int64_t *grid_head;\n";
+    o_ << "  int64_t *grid_next;\n";
+    o_ << "  int64_t *grid_body;\n";
+    o_ << "  int64_t *grid_cell;\n";
+    o_ << "  int64_t grid_cap;\n";
+    o_ << "  int64_t grid_table;\n";
+    o_ << "} ls_phys_world;\n";
+    o_ << "static ls_phys_world ls_phys;\n";
+    o_ << "static inline ls_bool ls_phys_reserve(int64_t need) {\n";
+    o_ << "  if (need <= ls_phys.cap) return 1;\n";
+    o_ << "  if (need > LS_MAX_PHYS) return 0;\n";
+    o_ << "  int64_t next = ls_phys.cap > 0 ? ls_phys.cap * 2 : 64;\n";
+    o_ << "  while (next < need) next *= 2;\n";
+    o_ << "  if (next > LS_MAX_PHYS) next = LS_MAX_PHYS;\n";
+    o_ << "  const size_t oldCap = (size_t)ls_phys.cap;\n";
+    o_ << "#define LS_PHYS_GROW_COLUMN(name) \\\n";
+    o_ << "  { \\\n";
+    o_ << "    double *grown = (double *)ls_elem_realloc(ls_phys.name, oldCap * sizeof(double), (size_t)next * sizeof(double)); \\\n";
+    o_ << "    if (!grown) return 0; \\\n";
+    o_ << "    ls_phys.name = grown; \\\n";
+    o_ << "  }\n";
+    o_ << "  LS_PHYS_DOUBLE_COLUMNS(LS_PHYS_GROW_COLUMN)\n";
+    o_ << "#undef LS_PHYS_GROW_COLUMN\n";
+    o_ << "  ls_bool *soft = (ls_bool *)ls_elem_realloc(ls_phys.soft, oldCap * sizeof(ls_bool), (size_t)next * sizeof(ls_bool));\n";
+    o_ << "  if (!soft) return 0;\n";
+    o_ << "  ls_phys.soft = soft;\n";
+    o_ << "  int64_t *id = (int64_t *)ls_elem_realloc(ls_phys.id, oldCap * sizeof(int64_t), (size_t)next * sizeof(int64_t));\n";
+    o_ << "  if (!id) return 0;\n";
+    o_ << "  ls_phys.id = id;\n";
+    o_ << "  ls_phys.cap = next;\n";
+    o_ << "  return 1;\n";
+    o_ << "}\n";
     o_ << "static inline int64_t ls_phys_alloc_id(void) {\n";
-    o_ << "  if (ls_phys_free_top > 0) return ls_phys_free_ids[--ls_phys_free_top];\n";
-    o_ << "  if (ls_phys_count >= LS_MAX_PHYS) return -1;\n";
-    o_ << "  return ls_phys_count++;\n";
+    o_ << "  if (ls_phys.free_top > 0) return ls_phys.free_ids[--ls_phys.free_top];\n";
+    o_ << "  if (ls_phys.ids >= LS_MAX_PHYS) return -1;\n";
+    o_ << "  if (ls_phys.ids >= ls_phys.id_cap) {\n";
+    o_ << "    const int64_t next = ls_phys.id_cap > 0 ? ls_phys.id_cap * 2 : 64;\n";
+    o_ << "    int64_t *slot = (int64_t *)realloc(ls_phys.slot, (size_t)next * sizeof(int64_t));\n";
+    o_ << "    if (!slot) return -1;\n";
+    o_ << "    ls_phys.slot = slot;\n";
+    o_ << "    int64_t *freeIds = (int64_t *)realloc(ls_phys.free_ids, (size_t)next * sizeof(int64_t));\n";
+    o_ << "    if (!freeIds) return -1;\n";
+    o_ << "    ls_phys.free_ids = freeIds;\n";
+    o_ << "    ls_phys.id_cap = next;\n";
+    o_ << "  }\n";
+    o_ << "  ls_phys.slot[ls_phys.ids] = -1;\n";
+    o_ << "  return ls_phys.ids++;\n";
     o_ << "}\n";
     o_ << "static inline void ls_phys_release_id(int64_t id) {\n";
-    o_ << "  if (id < 0 || id >= LS_MAX_PHYS) return;\n";
-    o_ << "  if (ls_phys_free_top < LS_MAX_PHYS) ls_phys_free_ids[ls_phys_free_top++] = id;\n";
+    o_ << "  if (id < 0 || id >= ls_phys.ids) return;\n";
+    o_ << "  ls_phys.slot[id] = -1;\n";
+    o_ << "  ls_phys.free_ids[ls_phys.free_top++] = id;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t ls_phys_slot(int64_t id) {\n";
+    o_ << "  if (id < 0 || id >= ls_phys.ids) return -1;\n";
+    o_ << "  return ls_phys.slot[id];\n";
     o_ << "}\n";
     o_ << "static int64_t ls_camera_target = -1;\n";
     o_ << "static double ls_camera_off_x = 0.0;\n";
@@ -9530,45 +14572,21 @@ private:
     o_ << "static double ls_camera_x = 0.0;\n";
     o_ << "static double ls_camera_y = 0.0;\n";
     o_ << "static double ls_camera_z = 0.0;\n";
-    o_ << "static int64_t ls_phys_ids[LS_MAX_PHYS];\n";
-    o_ << "static int64_t ls_phys_hard_idx[LS_MAX_PHYS];\n";
-    o_ << "static int64_t ls_phys_soft_idx[LS_MAX_PHYS];\n";
-    o_ << "static double ls_phys_px_soa[LS_MAX_PHYS];\n";
-    o_ << "static double ls_phys_py_soa[LS_MAX_PHYS];\n";
-    o_ << "static double ls_phys_pz_soa[LS_MAX_PHYS];\n";
-    o_ << "static double ls_phys_vx_soa[LS_MAX_PHYS];\n";
-    o_ << "static double ls_phys_vy_soa[LS_MAX_PHYS];\n";
-    o_ << "static double ls_phys_vz_soa[LS_MAX_PHYS];\n";
-    o_ << "static double ls_phys_fx_soa[LS_MAX_PHYS];\n";
-    o_ << "static double ls_phys_fy_soa[LS_MAX_PHYS];\n";
-    o_ << "static double ls_phys_fz_soa[LS_MAX_PHYS];\n";
-    o_ << "static double ls_phys_restx_soa[LS_MAX_PHYS];\n";
-    o_ << "static double ls_phys_resty_soa[LS_MAX_PHYS];\n";
-    o_ << "static double ls_phys_restz_soa[LS_MAX_PHYS];\n";
-    o_ << "static double ls_phys_inv_mass_soa[LS_MAX_PHYS];\n";
-    o_ << "static double ls_phys_damping_soa[LS_MAX_PHYS];\n";
-    o_ << "static double ls_phys_bounce_soa[LS_MAX_PHYS];\n";
-    o_ << "static ls_bool ls_phys_soft_soa[LS_MAX_PHYS];\n";
-    o_ << "static inline ls_phys_obj *ls_get_phys(int64_t id) {\n";
-    o_ << "  if (id < 0 || id >= ls_phys_count) return NULL;\n";
-    o_ << "  if (!ls_phys_objs[id].active) return NULL;\n";
-    o_ << "  return &ls_phys_objs[id];\n";
-    o_ << "}\n";
     o_ << "static inline void ls_camera_refresh(void) {\n";
-    o_ << "  ls_phys_obj *t = ls_get_phys(ls_camera_target);\n";
-    o_ << "  if (!t) return;\n";
-    o_ << "  ls_camera_x = t->px + ls_camera_off_x;\n";
-    o_ << "  ls_camera_y = t->py + ls_camera_off_y;\n";
-    o_ << "  ls_camera_z = t->pz + ls_camera_off_z;\n";
+    o_ << "  const int64_t j = ls_phys_slot(ls_camera_target);\n";
+    o_ << "  if (j < 0) return;\n";
+    o_ << "  ls_camera_x = ls_phys.px[j] + ls_camera_off_x;\n";
+    o_ << "  ls_camera_y = ls_phys.py[j] + ls_camera_off_y;\n";
+    o_ << "  ls_camera_z = ls_phys.pz[j] + ls_camera_off_z;\n";
     o_ << "}\n";
     o_ << "static inline void ls_camera_bind_default(void) {\n";
-    o_ << "  if (ls_get_phys(ls_camera_target)) {\n";
+    o_ << "  if (ls_phys_slot(ls_camera_target) >= 0) {\n";
     o_ << "    ls_camera_refresh();\n";
     o_ << "    return;\n";
     o_ << "  }\n";
     o_ << "  ls_camera_target = -1;\n";
-    o_ << "  for (int64_t i = 0; i < ls_phys_count; ++i) {\n";
-    o_ << "    if (ls_phys_objs[i].active) {\n";
+    o_ << "  for (int64_t i = 0; i < ls_phys.ids; ++i) {\n";
+    o_ << "    if (ls_phys.slot[i] >= 0) {\n";
     o_ << "      ls_camera_target = i;\n";
     o_ << "      break;\n";
     o_ << "    }\n";
@@ -9580,211 +14598,313 @@ private:
     o_ << "  if (!isfinite(mass) || mass <= 0.0) mass = 1.0;\n";
     o_ << "  const int64_t id = ls_phys_alloc_id();\n";
     o_ << "  if (id < 0) return -1;\n";
-    o_ << "  ls_phys_obj *o = &ls_phys_objs[id];\n";
-    o_ << "  o->px = x;\n";
-    o_ << "  o->py = y;\n";
-    o_ << "  o->pz = z;\n";
-    o_ << "  o->vx = 0.0;\n";
-    o_ << "  o->vy = 0.0;\n";
-    o_ << "  o->vz = 0.0;\n";
-    o_ << "  o->fx = 0.0;\n";
-    o_ << "  o->fy = 0.0;\n";
-    o_ << "  o->fz = 0.0;\n";
-    o_ << "  o->restx = x;\n";
-    o_ << "  o->resty = y;\n";
-    o_ << "  o->restz = z;\n";
-    o_ << "  o->mass = mass;\n";
-    o_ << "  o->inv_mass = 1.0 / mass;\n";
-    o_ << "  o->soft = soft ? 1 : 0;\n";
-    o_ << "  o->damping = o->soft ? 0.88 : 0.96;\n";
-    o_ << "  o->bounce = o->soft ? 0.08 : 0.32;\n";
-    o_ << "  o->active = 1;\n";
+    o_ << "  if (!ls_phys_reserve(ls_phys.n + 1)) {\n";
+    o_ << "    ls_phys_release_id(id);\n";
+    o_ << "    return -1;\n";
+    o_ << "  }\n";
+    o_ << "  const int64_t j = ls_phys.n++;\n";
+    o_ << "  ls_phys.slot[id] = j;\n";
+    o_ << "  ls_phys.id[j] = id;\n";
+    o_ << "  ls_phys.px[j] = x;\n";
+    o_ << "  ls_phys.py[j] = y;\n";
+    o_ << "  ls_phys.pz[j] = z;\n";
+    o_ << "  ls_phys.vx[j] = 0.0;\n";
+    o_ << "  ls_phys.vy[j] = 0.0;\n";
+    o_ << "  ls_phys.vz[j] = 0.0;\n";
+    o_ << "  ls_phys.fx[j] = 0.0;\n";
+    o_ << "  ls_phys.fy[j] = 0.0;\n";
+    o_ << "  ls_phys.fz[j] = 0.0;\n";
+    o_ << "  ls_phys.restx[j] = x;\n";
+    o_ << "  ls_phys.resty[j] = y;\n";
+    o_ << "  ls_phys.restz[j] = z;\n";
+    o_ << "  ls_phys.mass[j] = mass;\n";
+    o_ << "  ls_phys.inv_mass[j] = 1.0 / mass;\n";
+    o_ << "  ls_phys.soft[j] = soft ? 1 : 0;\n";
+    o_ << "  ls_phys.damping[j] = soft ? 0.88 : 0.96;\n";
+    o_ << "  ls_phys.bounce[j] = soft ? 0.08 : 0.32;\n";
+    o_ << "  ls_phys.radius[j] = 0.0;\n";
     o_ << "  if (ls_camera_target < 0) ls_camera_target = id;\n";
     o_ << "  ls_camera_refresh();\n";
     o_ << "  return id;\n";
     o_ << "}\n";
     o_ << "static inline void phys_free(int64_t id) {\n";
-    o_ << "  ls_phys_obj *o = ls_get_phys(id);\n";
-    o_ << "  if (!o) return;\n";
-    o_ << "  o->active = 0;\n";
+    o_ << "  const int64_t j = ls_phys_slot(id);\n";
+    o_ << "  if (j < 0) return;\n";
+    o_ << "  const int64_t last = --ls_phys.n;\n";
+    o_ << "  if (j != last) {\n";
+    o_ << "#define LS_PHYS_MOVE_COLUMN(name) ls_phys.name[j] = ls_phys.name[last];\n";
+    o_ << "    LS_PHYS_DOUBLE_COLUMNS(LS_PHYS_MOVE_COLUMN)\n";
+    o_ << "#undef LS_PHYS_MOVE_COLUMN\n";
+    o_ << "    ls_phys.soft[j] = ls_phys.soft[last];\n";
+    o_ << "    ls_phys.id[j] = ls_phys.id[last];\n";
+    o_ << "    ls_phys.slot[ls_phys.id[j]] = j;\n";
+    o_ << "  }\n";
     o_ << "  ls_phys_release_id(id);\n";
     o_ << "  if (ls_camera_target == id) ls_camera_target = -1;\n";
     o_ << "  ls_camera_bind_default();\n";
     o_ << "}\n";
     o_ << "static inline void phys_set_position(int64_t id, double x, double y, double z) {\n";
-    o_ << "  ls_phys_obj *o = ls_get_phys(id);\n";
-    o_ << "  if (!o) return;\n";
+    o_ << "  const int64_t j = ls_phys_slot(id);\n";
+    o_ << "  if (j < 0) return;\n";
     o_ << "  if (!isfinite(x) || !isfinite(y) || !isfinite(z)) return;\n";
-    o_ << "  o->px = x;\n";
-    o_ << "  o->py = y;\n";
-    o_ << "  o->pz = z;\n";
-    o_ << "  o->restx = x;\n";
-    o_ << "  o->resty = y;\n";
-    o_ << "  o->restz = z;\n";
+    o_ << "  ls_phys.px[j] = x;\n";
+    o_ << "  ls_phys.py[j] = y;\n";
+    o_ << "  ls_phys.pz[j] = z;\n";
+    o_ << "  ls_phys.restx[j] = x;\n";
+    o_ << "  ls_phys.resty[j] = y;\n";
+    o_ << "  ls_phys.restz[j] = z;\n";
     o_ << "  if (ls_camera_target == id) ls_camera_refresh();\n";
     o_ << "}\n";
     o_ << "static inline void phys_set_velocity(int64_t id, double vx, double vy, double vz) {\n";
-    o_ << "  ls_phys_obj *o = ls_get_phys(id);\n";
-    o_ << "  if (!o) return;\n";
+    o_ << "  const int64_t j = ls_phys_slot(id);\n";
+    o_ << "  if (j < 0) return;\n";
     o_ << "  if (!isfinite(vx) || !isfinite(vy) || !isfinite(vz)) return;\n";
-    o_ << "  o->vx = vx;\n";
-    o_ << "  o->vy = vy;\n";
-    o_ << "  o->vz = vz;\n";
+    o_ << "  ls_phys.vx[j] = vx;\n";
+    o_ << "  ls_phys.vy[j] = vy;\n";
+    o_ << "  ls_phys.vz[j] = vz;\n";
     o_ << "}\n";
     o_ << "static inline void phys_move(int64_t id, double dx, double dy, double dz) {\n";
-    o_ << "  ls_phys_obj *o = ls_get_phys(id);\n";
-    o_ << "  if (!o) return;\n";
+    o_ << "  const int64_t j = ls_phys_slot(id);\n";
+    o_ << "  if (j < 0) return;\n";
     o_ << "  if (!isfinite(dx) || !isfinite(dy) || !isfinite(dz)) return;\n";
-    o_ << "  o->px += dx;\n";
-    o_ << "  o->py += dy;\n";
-    o_ << "  o->pz += dz;\n";
-    o_ << "  o->restx += dx;\n";
-    o_ << "  o->resty += dy;\n";
-    o_ << "  o->restz += dz;\n";
+    o_ << "  ls_phys.px[j] += dx;\n";
+    o_ << "  ls_phys.py[j] += dy;\n";
+    o_ << "  ls_phys.pz[j] += dz;\n";
+    o_ << "  ls_phys.restx[j] += dx;\n";
+    o_ << "  ls_phys.resty[j] += dy;\n";
+    o_ << "  ls_phys.restz[j] += dz;\n";
     o_ << "  if (ls_camera_target == id) ls_camera_refresh();\n";
     o_ << "}\n";
     o_ << "static inline void phys_apply_force(int64_t id, double fx, double fy, double fz) {\n";
-    o_ << "  ls_phys_obj *o = ls_get_phys(id);\n";
-    o_ << "  if (!o) return;\n";
+    o_ << "  const int64_t j = ls_phys_slot(id);\n";
+    o_ << "  if (j < 0) return;\n";
     o_ << "  if (!isfinite(fx) || !isfinite(fy) || !isfinite(fz)) return;\n";
-    o_ << "  o->fx += fx;\n";
-    o_ << "  o->fy += fy;\n";
-    o_ << "  o->fz += fz;\n";
+    o_ << "  ls_phys.fx[j] += fx;\n";
+    o_ << "  ls_phys.fy[j] += fy;\n";
+    o_ << "  ls_phys.fz[j] += fz;\n";
     o_ << "}\n";
-    o_ << "static inline void phys_step(double dt) {\n";
-    o_ << "  if (!isfinite(dt) || dt <= 0.0) return;\n";
-    o_ << "  if (dt > 0.1) dt = 0.1;\n";
-    o_ << "  const double dt60 = dt * 60.0;\n";
-    o_ << "  int64_t n = 0;\n";
-    o_ << "  int64_t hard_n = 0;\n";
-    o_ << "  int64_t soft_n = 0;\n";
-    o_ << "  for (int64_t i = 0; i < ls_phys_count; ++i) {\n";
-    o_ << "    ls_phys_obj *o = &ls_phys_objs[i];\n";
-    o_ << "    if (!o->active) continue;\n";
-    o_ << "    const int64_t j = n++;\n";
-    o_ << "    ls_phys_ids[j] = i;\n";
-    o_ << "    ls_phys_px_soa[j] = o->px;\n";
-    o_ << "    ls_phys_py_soa[j] = o->py;\n";
-    o_ << "    ls_phys_pz_soa[j] = o->pz;\n";
-    o_ << "    ls_phys_vx_soa[j] = o->vx;\n";
-    o_ << "    ls_phys_vy_soa[j] = o->vy;\n";
-    o_ << "    ls_phys_vz_soa[j] = o->vz;\n";
-    o_ << "    ls_phys_fx_soa[j] = o->fx;\n";
-    o_ << "    ls_phys_fy_soa[j] = o->fy;\n";
-    o_ << "    ls_phys_fz_soa[j] = o->fz;\n";
-    o_ << "    ls_phys_restx_soa[j] = o->restx;\n";
-    o_ << "    ls_phys_resty_soa[j] = o->resty;\n";
-    o_ << "    ls_phys_restz_soa[j] = o->restz;\n";
-    o_ << "    ls_phys_inv_mass_soa[j] = o->inv_mass;\n";
-    o_ << "    ls_phys_damping_soa[j] = o->damping;\n";
-    o_ << "    ls_phys_bounce_soa[j] = o->bounce;\n";
-    o_ << "    ls_phys_soft_soa[j] = o->soft ? 1 : 0;\n";
-    o_ << "    if (o->soft) ls_phys_soft_idx[soft_n++] = j;\n";
-    o_ << "    else ls_phys_hard_idx[hard_n++] = j;\n";
-    o_ << "  }\n";
-    o_ << "  for (int64_t h = 0; h < hard_n; ++h) {\n";
-    o_ << "    const int64_t j = ls_phys_hard_idx[h];\n";
-    o_ << "    double ax = ls_phys_fx_soa[j] * ls_phys_inv_mass_soa[j];\n";
-    o_ << "    double ay = ls_phys_fy_soa[j] * ls_phys_inv_mass_soa[j] - 9.81;\n";
-    o_ << "    double az = ls_phys_fz_soa[j] * ls_phys_inv_mass_soa[j];\n";
-    o_ << "    ls_phys_vx_soa[j] += ax * dt;\n";
-    o_ << "    ls_phys_vy_soa[j] += ay * dt;\n";
-    o_ << "    ls_phys_vz_soa[j] += az * dt;\n";
-    o_ << "    double damp = 1.0 - ((1.0 - ls_phys_damping_soa[j]) * dt60);\n";
-    o_ << "    if (damp < 0.0) damp = 0.0;\n";
-    o_ << "    if (damp > 1.0) damp = 1.0;\n";
-    o_ << "    ls_phys_vx_soa[j] *= damp;\n";
-    o_ << "    ls_phys_vy_soa[j] *= damp;\n";
-    o_ << "    ls_phys_vz_soa[j] *= damp;\n";
-    o_ << "    ls_phys_px_soa[j] += ls_phys_vx_soa[j] * dt;\n";
-    o_ << "    ls_phys_py_soa[j] += ls_phys_vy_soa[j] * dt;\n";
-    o_ << "    ls_phys_pz_soa[j] += ls_phys_vz_soa[j] * dt;\n";
-    o_ << "    if (ls_phys_py_soa[j] < 0.0) {\n";
-    o_ << "      ls_phys_py_soa[j] = 0.0;\n";
-    o_ << "      if (ls_phys_vy_soa[j] < 0.0) ls_phys_vy_soa[j] = -ls_phys_vy_soa[j] * ls_phys_bounce_soa[j];\n";
-    o_ << "      ls_phys_vx_soa[j] *= 0.95;\n";
-    o_ << "      ls_phys_vz_soa[j] *= 0.95;\n";
+    o_ << "static inline void phys_set_radius(int64_t id, double r) {\n";
+    o_ << "  const int64_t j = ls_phys_slot(id);\n";
+    o_ << "  if (j < 0 || !isfinite(r)) return;\n";
+    o_ << "  ls_phys.radius[j] = r > 0.0 ? r : 0.0;\n";
+    o_ << "}\n";
+    o_ << "static inline double phys_get_radius(int64_t id) {\n";
+    o_ << "  const int64_t j = ls_phys_slot(id);\n";
+    o_ << "  return j >= 0 ? ls_phys.radius[j] : 0.0;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t phys_count(void) { return ls_phys.n; }\n";
+    o_ << "static inline int64_t phys_contact_count(void) { return ls_phys.contacts; }\n";
+    o_ << "typedef struct {\n";
+    o_ << "  double dt;\n";
+    o_ << "  double dt60;\n";
+    o_ << "} ls_phys_job;\n";
+    o_ << "static void ls_phys_integrate(void *p, int64_t begin, int64_t end) {\n";
+    o_ << "  const ls_phys_job *job = (const ls_phys_job *)p;\n";
+    o_ << "  const double dt = job->dt;\n";
+    o_ << "  const double dt60 = job->dt60;\n";
+    o_ << "  double *px = ls_phys.px;\n";
+    o_ << "  double *py = ls_phys.py;\n";
+    o_ << "  double *pz = ls_phys.pz;\n";
+    o_ << "  double *vx = ls_phys.vx;\n";
+    o_ << "  double *vy = ls_phys.vy;\n";
+    o_ << "  double *vz = ls_phys.vz;\n";
+    o_ << "  double *fx = ls_phys.fx;\n";
+    o_ << "  double *fy = ls_phys.fy;\n";
+    o_ << "  double *fz = ls_phys.fz;\n";
+    o_ << "  const double *im = ls_phys.inv_mass;\n";
+    o_ << "  const double *damping = ls_phys.damping;\n";
+    o_ << "  const double *bounce = ls_phys.bounce;\n";
+    o_ << "  const ls_bool *soft = ls_phys.soft;\n";
+    o_ << "  for (int64_t j = begin; j < end; ++j) {\n";
+    o_ << "    double ax = fx[j] * im[j];\n";
+    o_ << "    double ay = fy[j] * im[j] - 9.81;\n";
+    o_ << "    double az = fz[j] * im[j];\n";
+    o_ << "    if (soft[j]) {\n";
+    o_ << "      const double k = 22.0;\n";
+    o_ << "      const double c = 2.0;\n";
+    o_ << "      ax += (ls_phys.restx[j] - px[j]) * k - vx[j] * c;\n";
+    o_ << "      ay += (ls_phys.resty[j] - py[j]) * k - vy[j] * c;\n";
+    o_ << "      az += (ls_phys.restz[j] - pz[j]) * k - vz[j] * c;\n";
     o_ << "    }\n";
-    o_ << "    ls_phys_fx_soa[j] = 0.0;\n";
-    o_ << "    ls_phys_fy_soa[j] = 0.0;\n";
-    o_ << "    ls_phys_fz_soa[j] = 0.0;\n";
-    o_ << "  }\n";
-    o_ << "  for (int64_t h = 0; h < soft_n; ++h) {\n";
-    o_ << "    const int64_t j = ls_phys_soft_idx[h];\n";
-    o_ << "    double ax = ls_phys_fx_soa[j] * ls_phys_inv_mass_soa[j];\n";
-    o_ << "    double ay = ls_phys_fy_soa[j] * ls_phys_inv_mass_soa[j] - 9.81;\n";
-    o_ << "    double az = ls_phys_fz_soa[j] * ls_phys_inv_mass_soa[j];\n";
-    o_ << "    const double k = 22.0;\n";
-    o_ << "    const double c = 2.0;\n";
-    o_ << "    ax += (ls_phys_restx_soa[j] - ls_phys_px_soa[j]) * k - ls_phys_vx_soa[j] * c;\n";
-    o_ << "    ay += (ls_phys_resty_soa[j] - ls_phys_py_soa[j]) * k - ls_phys_vy_soa[j] * c;\n";
-    o_ << "    az += (ls_phys_restz_soa[j] - ls_phys_pz_soa[j]) * k - ls_phys_vz_soa[j] * c;\n";
-    o_ << "    ls_phys_vx_soa[j] += ax * dt;\n";
-    o_ << "    ls_phys_vy_soa[j] += ay * dt;\n";
-    o_ << "    ls_phys_vz_soa[j] += az * dt;\n";
-    o_ << "    double damp = 1.0 - ((1.0 - ls_phys_damping_soa[j]) * dt60);\n";
+    o_ << "    vx[j] += ax * dt;\n";
+    o_ << "    vy[j] += ay * dt;\n";
+    o_ << "    vz[j] += az * dt;\n";
+    o_ << "    double damp = 1.0 - ((1.0 - damping[j]) * dt60);\n";
     o_ << "    if (damp < 0.0) damp = 0.0;\n";
     o_ << "    if (damp > 1.0) damp = 1.0;\n";
-    o_ << "    ls_phys_vx_soa[j] *= damp;\n";
-    o_ << "    ls_phys_vy_soa[j] *= damp;\n";
-    o_ << "    ls_phys_vz_soa[j] *= damp;\n";
-    o_ << "    ls_phys_px_soa[j] += ls_phys_vx_soa[j] * dt;\n";
-    o_ << "    ls_phys_py_soa[j] += ls_phys_vy_soa[j] * dt;\n";
-    o_ << "    ls_phys_pz_soa[j] += ls_phys_vz_soa[j] * dt;\n";
-    o_ << "    if (ls_phys_py_soa[j] < 0.0) {\n";
-    o_ << "      ls_phys_py_soa[j] = 0.0;\n";
-    o_ << "      if (ls_phys_vy_soa[j] < 0.0) ls_phys_vy_soa[j] = -ls_phys_vy_soa[j] * ls_phys_bounce_soa[j];\n";
-    o_ << "      ls_phys_vx_soa[j] *= 0.95;\n";
-    o_ << "      ls_phys_vz_soa[j] *= 0.95;\n";
+    o_ << "    vx[j] *= damp;\n";
+    o_ << "    vy[j] *= damp;\n";
+    o_ << "    vz[j] *= damp;\n";
+    o_ << "    px[j] += vx[j] * dt;\n";
+    o_ << "    py[j] += vy[j] * dt;\n";
+    o_ << "    pz[j] += vz[j] * dt;\n";
+    o_ << "    if (py[j] < 0.0) {\n";
+    o_ << "      py[j] = 0.0;\n";
+    o_ << "      if (vy[j] < 0.0) vy[j] = -vy[j] * bounce[j];\n";
+    o_ << "      vx[j] *= 0.95;\n";
+    o_ << "      vz[j] *= 0.95;\n";
+    o_ << "    }\n";
+    o_ << "    fx[j] = 0.0;\n";
+    o_ << "    fy[j] = 0.0;\n";
+    o_ << "    fz[j] = 0.0;\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t ls_phys_cell_coord(double v, double inv) {\n";
+    o_ << "  double c = floor(v * inv);\n";
+    o_ << "  if (!(c > -1e15)) c = -1e15;\n";
+    o_ << "  if (c > 1e15) c = 1e15;\n";
+    o_ << "  return (int64_t)c;\n";
+    o_ << "}\n";
+    o_ << "static inline uint64_t ls_phys_cell_hash(int64_t x, int64_t y, int64_t z) {\n";
+    o_ << "  return ((uint64_t)x * 73856093ULL) ^ ((uint64_t)y * 19349663ULL) ^ ((uint64_t)z * 83492791ULL);\n";
+    o_ << "}\n";
+    o_ << "/* Sphere-sphere contact: push the pair apart along the normal by inverse mass, then apply a restitution impulse. */\n";
+    o_ << "static inline void ls_phys_resolve_pair(int64_t a, int64_t b) {\n";
+    o_ << "  double dx = ls_phys.px[b] - ls_phys.px[a];\n";
+    o_ << "  double dy = ls_phys.py[b] - ls_phys.py[a];\n";
+    o_ << "  double dz = ls_phys.pz[b] - ls_phys.pz[a];\n";
+    o_ << "  const double reach = ls_phys.radius[a] + ls_phys.radius[b];\n";
+    o_ << "  const double d2 = dx * dx + dy * dy + dz * dz;\n";
+    o_ << "  if (d2 >= reach * reach) return;\n";
+    o_ << "  const double dist = sqrt(d2);\n";
+    o_ << "  if (dist > 1e-12) {\n";
+    o_ << "    dx /= dist;\n";
+    o_ << "    dy /= dist;\n";
+    o_ << "    dz /= dist;\n";
+    o_ << "  } else {\n";
+    o_ << "    dx = 0.0;\n";
+    o_ << "    dy = 1.0;\n";
+    o_ << "    dz = 0.0;\n";
+    o_ << "  }\n";
+    o_ << "  const double ima = ls_phys.inv_mass[a];\n";
+    o_ << "  const double imb = ls_phys.inv_mass[b];\n";
+    o_ << "  const double total = ima + imb;\n";
+    o_ << "  const double push = (reach - dist) / total;\n";
+    o_ << "  ls_phys.px[a] -= dx * push * ima;\n";
+    o_ << "  ls_phys.py[a] -= dy * push * ima;\n";
+    o_ << "  ls_phys.pz[a] -= dz * push * ima;\n";
+    o_ << "  ls_phys.px[b] += dx * push * imb;\n";
+    o_ << "  ls_phys.py[b] += dy * push * imb;\n";
+    o_ << "  ls_phys.pz[b] += dz * push * imb;\n";
+    o_ << "  const double rel = (ls_phys.vx[b] - ls_phys.vx[a]) * dx + (ls_phys.vy[b] - ls_phys.vy[a]) * dy + (ls_phys.vz[b] - ls_phys.vz[a]) * dz;\n";
+    o_ << "  if (rel < 0.0) {\n";
+    o_ << "    const double e = ls_phys.bounce[a] < ls_phys.bounce[b] ? ls_phys.bounce[a] : ls_phys.bounce[b];\n";
+    o_ << "    const double impulse = -(1.0 + e) * rel / total;\n";
+    o_ << "    ls_phys.vx[a] -= dx * impulse * ima;\n";
+    o_ << "    ls_phys.vy[a] -= dy * impulse * ima;\n";
+    o_ << "    ls_phys.vz[a] -= dz * impulse * ima;\n";
+    o_ << "    ls_phys.vx[b] += dx * impulse * imb;\n";
+    o_ << "    ls_phys.vy[b] += dy * impulse * imb;\n";
+    o_ << "    ls_phys.vz[b] += dz * impulse * imb;\n";
+    o_ << "  }\n";
+    o_ << "  ++ls_phys.contacts;\n";
+    o_ << "}\n";
+    o_ << "/* Uniform-grid broadphase over bodies with a radius: cells are one largest diameter wide, so every\n";
+    o_ << "   overlapping pair shares a cell or sits in one of the 26 neighbours. */\n";
+    o_ << "static inline void ls_phys_collide(void) {\n";
+    o_ << "  ls_phys.contacts = 0;\n";
+    o_ << "  int64_t count = 0;\n";
+    o_ << "  double maxR = 0.0;\n";
+    o_ << "  for (int64_t j = 0; j < ls_phys.n; ++j) {\n";
+    o_ << "    if (ls_phys.radius[j] <= 0.0) continue;\n";
+    o_ << "    ++count;\n";
+    o_ << "    if (ls_phys.radius[j] > maxR) maxR = ls_phys.radius[j];\n";
+    o_ << "  }\n";
+    o_ << "  if (count < 2) return;\n";
+    o_ << "  if (count > ls_phys.grid_cap) {\n";
+    o_ << "    int64_t next = ls_phys.grid_cap > 0 ? ls_phys.grid_cap : 64;\n";
+    o_ << "    while (next < count) next *= 2;\n";
+    o_ << "    int64_t *nextBody = (int64_t *)realloc(ls_phys.grid_body, (size_t)next * sizeof(int64_t));\n";
+    o_ << "    if (!nextBody) return;\n";
+    o_ << "    ls_phys.grid_body = nextBody;\n";
+    o_ << "    int64_t *nextLink = (int64_t *)realloc(ls_phys.grid_next, (size_t)next * sizeof(int64_t));\n";
+    o_ << "    if (!nextLink) return;\n";
+    o_ << "    ls_phys.grid_next = nextLink;\n";
+    o_ << "    int64_t *nextCell = (int64_t *)realloc(ls_phys.grid_cell, (size_t)next * 3u * sizeof(int64_t));\n";
+    o_ << "    if (!nextCell) return;\n";
+    o_ << "    ls_phys.grid_cell = nextCell;\n";
+    o_ << "    int64_t *nextHead = (int64_t *)realloc(ls_phys.grid_head, (size_t)next * 2u * sizeof(int64_t));\n";
+    o_ << "    if (!nextHead) return;\n";
+    o_ << "    ls_phys.grid_head = nextHead;\n";
+    o_ << "    ls_phys.grid_cap = next;\n";
+    o_ << "  }\n";
+    o_ << "  int64_t table = 1;\n";
+    o_ << "  while (table < count * 2) table <<= 1;\n";
+    o_ << "  const uint64_t mask = (uint64_t)table - 1u;\n";
+    o_ << "  for (int64_t h = 0; h < table; ++h) ls_phys.grid_head[h] = -1;\n";
+    o_ << "  const double inv = 1.0 / (maxR * 2.0);\n";
+    o_ << "  int64_t c = 0;\n";
+    o_ << "  for (int64_t j = 0; j < ls_phys.n; ++j) {\n";
+    o_ << "    if (ls_phys.radius[j] <= 0.0) continue;\n";
+    o_ << "    int64_t *cell = ls_phys.grid_cell + c * 3;\n";
+    o_ << "    cell[0] = ls_phys_cell_coord(ls_phys.px[j], inv);\n";
+    o_ << "    cell[1] = ls_phys_cell_coord(ls_phys.py[j], inv);\n";
+    o_ << "    cell[2] = ls_phys_cell_coord(ls_phys.pz[j], inv);\n";
+    o_ << "    ls_phys.grid_body[c] = j;\n";
+    o_ << "    ++c;\n";
+    o_ << "  }\n";
+    o_ << "  for (int64_t i = count - 1; i >= 0; --i) {\n";
+    o_ << "    const int64_t *cell = ls_phys.grid_cell + i * 3;\n";
+    o_ << "    const uint64_t h = ls_phys_cell_hash(cell[0], cell[1], cell[2]) & mask;\n";
+    o_ << "    ls_phys.grid_next[i] = ls_phys.grid_head[h];\n";
+    o_ << "    ls_phys.grid_head[h] = i;\n";
+    o_ << "  }\n";
+    o_ << "  for (int64_t i = 0; i < count; ++i) {\n";
+    o_ << "    const int64_t *cell = ls_phys.grid_cell + i * 3;\n";
+    o_ << "    for (int64_t dz = -1; dz <= 1; ++dz) {\n";
+    o_ << "      for (int64_t dy = -1; dy <= 1; ++dy) {\n";
+    o_ << "        for (int64_t dx = -1; dx <= 1; ++dx) {\n";
+    o_ << "          const int64_t x = cell[0] + dx;\n";
+    o_ << "          const int64_t y = cell[1] + dy;\n";
+    o_ << "          const int64_t z = cell[2] + dz;\n";
+    o_ << "          for (int64_t k = ls_phys.grid_head[ls_phys_cell_hash(x, y, z) & mask]; k >= 0; k = ls_phys.grid_next[k]) {\n";
+    o_ << "            const int64_t *other = ls_phys.grid_cell + k * 3;\n";
+    o_ << "            if (k <= i || other[0] != x || other[1] != y || other[2] != z) continue;\n";
+    o_ << "            ls_phys_resolve_pair(ls_phys.grid_body[i], ls_phys.grid_body[k]);\n";
+    o_ << "          }\n";
+    o_ << "        }\n";
+    o_ << "      }\n";
     o_ << "    }\n";
-    o_ << "    ls_phys_fx_soa[j] = 0.0;\n";
-    o_ << "    ls_phys_fy_soa[j] = 0.0;\n";
-    o_ << "    ls_phys_fz_soa[j] = 0.0;\n";
-    o_ << "  }\n";
-    o_ << "  for (int64_t j = 0; j < n; ++j) {\n";
-    o_ << "    ls_phys_obj *o = &ls_phys_objs[ls_phys_ids[j]];\n";
-    o_ << "    o->px = ls_phys_px_soa[j];\n";
-    o_ << "    o->py = ls_phys_py_soa[j];\n";
-    o_ << "    o->pz = ls_phys_pz_soa[j];\n";
-    o_ << "    o->vx = ls_phys_vx_soa[j];\n";
-    o_ << "    o->vy = ls_phys_vy_soa[j];\n";
-    o_ << "    o->vz = ls_phys_vz_soa[j];\n";
-    o_ << "    o->fx = 0.0;\n";
-    o_ << "    o->fy = 0.0;\n";
-    o_ << "    o->fz = 0.0;\n";
     o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "static inline void phys_step(double dt) {\n";
+    o_ << "  if (!isfinite(dt) || dt <= 0.0) return;\n";
+    o_ << "  if (dt > 0.1) dt = 0.1;\n";
+    o_ << "  ls_phys_job job = {dt, dt * 60.0};\n";
+    o_ << "  ls_parallel_range(ls_phys_integrate, &job, ls_phys.n, 64);\n";
+    o_ << "  ls_phys_collide();\n";
     o_ << "  ls_camera_bind_default();\n";
     o_ << "}\n";
     o_ << "static inline double phys_get_x(int64_t id) {\n";
-    o_ << "  ls_phys_obj *o = ls_get_phys(id);\n";
-    o_ << "  return o ? o->px : 0.0;\n";
+    o_ << "  const int64_t j = ls_phys_slot(id);\n";
+    o_ << "  return j >= 0 ? ls_phys.px[j] : 0.0;\n";
     o_ << "}\n";
     o_ << "static inline double phys_get_y(int64_t id) {\n";
-    o_ << "  ls_phys_obj *o = ls_get_phys(id);\n";
-    o_ << "  return o ? o->py : 0.0;\n";
+    o_ << "  const int64_t j = ls_phys_slot(id);\n";
+    o_ << "  return j >= 0 ? ls_phys.py[j] : 0.0;\n";
     o_ << "}\n";
     o_ << "static inline double phys_get_z(int64_t id) {\n";
-    o_ << "  ls_phys_obj *o = ls_get_phys(id);\n";
-    o_ << "  return o ? o->pz : 0.0;\n";
+    o_ << "  const int64_t j = ls_phys_slot(id);\n";
+    o_ << "  return j >= 0 ? ls_phys.pz[j] : 0.0;\n";
     o_ << "}\n";
     o_ << "static inline double phys_get_vx(int64_t id) {\n";
-    o_ << "  ls_phys_obj *o = ls_get_phys(id);\n";
-    o_ << "  return o ? o->vx : 0.0;\n";
+    o_ << "  const int64_t j = ls_phys_slot(id);\n";
+    o_ << "  return j >= 0 ? ls_phys.vx[j] : 0.0;\n";
     o_ << "}\n";
     o_ << "static inline double phys_get_vy(int64_t id) {\n";
-    o_ << "  ls_phys_obj *o = ls_get_phys(id);\n";
-    o_ << "  return o ? o->vy : 0.0;\n";
+    o_ << "  const int64_t j = ls_phys_slot(id);\n";
+    o_ << "  return j >= 0 ? ls_phys.vy[j] : 0.0;\n";
     o_ << "}\n";
     o_ << "static inline double phys_get_vz(int64_t id) {\n";
-    o_ << "  ls_phys_obj *o = ls_get_phys(id);\n";
-    o_ << "  return o ? o->vz : 0.0;\n";
+    o_ << "  const int64_t j = ls_phys_slot(id);\n";
+    o_ << "  return j >= 0 ? ls_phys.vz[j] : 0.0;\n";
     o_ << "}\n";
     o_ << "static inline ls_bool phys_is_soft(int64_t id) {\n";
-    o_ << "  ls_phys_obj *o = ls_get_phys(id);\n";
-    o_ << "  return o ? o->soft : 0;\n";
+    o_ << "  const int64_t j = ls_phys_slot(id);\n";
+    o_ << "  return j >= 0 ? ls_phys.soft[j] : 0;\n";
     o_ << "}\n";
     o_ << "static inline void camera_bind(int64_t id) {\n";
-    o_ << "  if (ls_get_phys(id)) {\n";
+    o_ << "  if (ls_phys_slot(id) >= 0) {\n";
     o_ << "    ls_camera_target = id;\n";
     o_ << "    ls_camera_refresh();\n";
     o_ << "    return;\n";
@@ -9865,9 +14985,31 @@ private:
     o_ << "static inline int64_t input_i64_prompt(const char *prompt) { return parse_i64(input_prompt(prompt)); }\n";
     o_ << "static inline double input_f64(void) { return parse_f64(input()); }\n";
     o_ << "static inline double input_f64_prompt(const char *prompt) { return parse_f64(input_prompt(prompt)); }\n";
+    emitAtomicRuntime();
+    if (needsSimdRuntime_) emitSimdRuntime();
+    if (needsFileRuntime_) emitFileRuntime();
     if (needsHttpRuntime_) {
       o_ << "#define LS_HTTP_MAX_SERVERS 64\n";
-      o_ << "#define LS_HTTP_MAX_CLIENTS 256\n";
+      o_ << "#ifndef LS_HTTP_MAX_CLIENTS\n";
+      o_ << "#define LS_HTTP_MAX_CLIENTS 1024\n";
+      o_ << "#endif\n";
+      o_ << "#ifndef LS_HTTP_LOOP_CLIENTS\n";
+      o_ << "#define LS_HTTP_LOOP_CLIENTS 4096\n";
+      o_ << "#endif\n";
+      o_ << "#define LS_HTTP_MAX_LOOPS 64\n";
+      o_ << "#define LS_HTTP_MAX_PATCHES 16\n";
+      o_ << "#define LS_HTTP_ID_SHIFT 24\n";
+      o_ << "#define LS_HTTP_MAX_HEADER 65536\n";
+      o_ << "#define LS_HTTP_MAX_REQUEST 1048576\n";
+      o_ << "#define LS_HTTP_EV_READ 1u\n";
+      o_ << "#define LS_HTTP_EV_WRITE 2u\n";
+      o_ << "#if defined(__linux__)\n";
+      o_ << "#include <sys/epoll.h>\n";
+      o_ << "#include <sys/sendfile.h>\n";
+      o_ << "#define LS_HTTP_USE_EPOLL 1\n";
+      o_ << "#elif !defined(_WIN32)\n";
+      o_ << "#include <poll.h>\n";
+      o_ << "#endif\n";
       o_ << "#if defined(_WIN32)\n";
       o_ << "typedef SOCKET ls_http_socket;\n";
       o_ << "static ls_bool ls_http_wsa_ready = 0;\n";
@@ -9883,6 +15025,16 @@ private:
       o_ << "static inline void ls_http_close_socket(ls_http_socket s) {\n";
       o_ << "  if (s != INVALID_SOCKET) (void)closesocket(s);\n";
       o_ << "}\n";
+      o_ << "static inline ls_bool ls_http_set_nonblocking(ls_http_socket s, ls_bool on) {\n";
+      o_ << "  u_long mode = on ? 1UL : 0UL;\n";
+      o_ << "  return ioctlsocket(s, FIONBIO, &mode) == 0 ? 1 : 0;\n";
+      o_ << "}\n";
+      o_ << "static inline ls_bool ls_http_would_block(void) {\n";
+      o_ << "  const int err = WSAGetLastError();\n";
+      o_ << "  return (err == WSAEWOULDBLOCK || err == WSAEINTR) ? 1 : 0;\n";
+      o_ << "}\n";
+      o_ << "typedef WSAPOLLFD ls_http_pollfd;\n";
+      o_ << "#define ls_http_poll(fds, n, timeout) WSAPoll((fds), (ULONG)(n), (timeout))\n";
       o_ << "#else\n";
       o_ << "typedef int ls_http_socket;\n";
       o_ << "static inline ls_bool ls_http_init(void) { return 1; }\n";
@@ -9891,51 +15043,222 @@ private:
       o_ << "static inline void ls_http_close_socket(ls_http_socket s) {\n";
       o_ << "  if (s >= 0) (void)close(s);\n";
       o_ << "}\n";
+      o_ << "static inline ls_bool ls_http_set_nonblocking(ls_http_socket s, ls_bool on) {\n";
+      o_ << "  const int flags = fcntl(s, F_GETFL, 0);\n";
+      o_ << "  if (flags < 0) return 0;\n";
+      o_ << "  return fcntl(s, F_SETFL, on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK)) == 0 ? 1 : 0;\n";
+      o_ << "}\n";
+      o_ << "static inline ls_bool ls_http_would_block(void) {\n";
+      o_ << "  return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 1 : 0;\n";
+      o_ << "}\n";
+      o_ << "#if !defined(LS_HTTP_USE_EPOLL)\n";
+      o_ << "typedef struct pollfd ls_http_pollfd;\n";
+      o_ << "#define ls_http_poll(fds, n, timeout) poll((fds), (nfds_t)(n), (timeout))\n";
+      o_ << "#endif\n";
       o_ << "#endif\n";
+      o_ << "static inline int64_t task_worker_count(void);\n";
       o_ << "typedef struct {\n";
       o_ << "  ls_http_socket sock;\n";
       o_ << "  ls_bool active;\n";
-      o_ << "} ls_http_server_slot;\n";
+      o_ << "  ls_bool evented;\n";
+      o_ << "  ls_bool registered;\n";
+      o_ << "  ls_bool busy;\n";
+      o_ << "  ls_bool queued;\n";
+      o_ << "  ls_bool keep_alive;\n";
+      o_ << "  ls_bool closing;\n";
+      o_ << "  ls_bool peer_closed;\n";
+      o_ << "  ls_bool view_ready;\n";
+      o_ << "  char saved;\n";
+      o_ << "  unsigned ev_mask;\n";
+      o_ << "  char *in;\n";
+      o_ << "  size_t in_len;\n";
+      o_ << "  size_t in_cap;\n";
+      o_ << "  size_t in_scan;\n";
+      o_ << "  size_t head_len;\n";
+      o_ << "  size_t req_len;\n";
+      o_ << "  size_t path_off;\n";
+      o_ << "  size_t query_off;\n";
+      o_ << "  int patch_count;\n";
+      o_ << "  size_t patch_pos[LS_HTTP_MAX_PATCHES];\n";
+      o_ << "  char patch_byte[LS_HTTP_MAX_PATCHES];\n";
+      o_ << "  char *out;\n";
+      o_ << "  size_t out_len;\n";
+      o_ << "  size_t out_off;\n";
+      o_ << "  size_t out_cap;\n";
+      o_ << "  FILE *file;\n";
+      o_ << "  uint64_t file_off;\n";
+      o_ << "  uint64_t file_left;\n";
+      o_ << "} ls_http_client_slot;\n";
+      o_ << "typedef struct {\n";
+      o_ << "  ls_http_client_slot *slots;\n";
+      o_ << "  int64_t cap;\n";
+      o_ << "  int64_t next;\n";
+      o_ << "  int64_t *free_ids;\n";
+      o_ << "  int64_t free_top;\n";
+      o_ << "} ls_http_client_table;\n";
+      o_ << "/* One event loop: a listener, its readiness backend, and the clients it accepted.\n";
+      o_ << "   Only the thread polling the loop touches it, so none of this is locked. */\n";
+      o_ << "typedef struct {\n";
+      o_ << "  ls_http_socket sock;\n";
+      o_ << "  ls_bool owns_sock;\n";
+      o_ << "  ls_bool started;\n";
+      o_ << "  int ev_fd;\n";
+      o_ << "  int64_t tag;\n";
+      o_ << "  ls_http_client_table clients;\n";
+      o_ << "  int64_t *ready;\n";
+      o_ << "  int64_t ready_head;\n";
+      o_ << "  int64_t ready_len;\n";
+      o_ << "#if !defined(LS_HTTP_USE_EPOLL)\n";
+      o_ << "  ls_http_pollfd *poll_fds;\n";
+      o_ << "  int64_t *poll_ids;\n";
+      o_ << "#endif\n";
+      o_ << "} ls_http_loop;\n";
       o_ << "typedef struct {\n";
       o_ << "  ls_http_socket sock;\n";
       o_ << "  ls_bool active;\n";
-      o_ << "} ls_http_client_slot;\n";
+      o_ << "  ls_http_loop *loops;\n";
+      o_ << "  int64_t loop_count;\n";
+      o_ << "  volatile int64_t loop_claim;\n";
+      o_ << "  ls_bool pinned;\n";
+      o_ << "  int64_t generation;\n";
+      o_ << "} ls_http_server_slot;\n";
+      o_ << "typedef struct {\n";
+      o_ << "  int64_t generation;\n";
+      o_ << "  int64_t loop;\n";
+      o_ << "} ls_http_loop_binding;\n";
       o_ << "static ls_http_server_slot ls_http_servers[LS_HTTP_MAX_SERVERS];\n";
       o_ << "static ls_http_client_slot ls_http_clients[LS_HTTP_MAX_CLIENTS];\n";
       o_ << "static int64_t ls_http_server_next = 0;\n";
-      o_ << "static int64_t ls_http_client_next = 0;\n";
       o_ << "static int64_t ls_http_server_free_ids[LS_HTTP_MAX_SERVERS];\n";
       o_ << "static int64_t ls_http_client_free_ids[LS_HTTP_MAX_CLIENTS];\n";
       o_ << "static int64_t ls_http_server_free_top = 0;\n";
-      o_ << "static int64_t ls_http_client_free_top = 0;\n";
+      o_ << "static int64_t ls_http_server_generation = 0;\n";
+      o_ << "static ls_http_client_table ls_http_shared_clients = {ls_http_clients, LS_HTTP_MAX_CLIENTS, 0, ls_http_client_free_ids, 0};\n";
+      o_ << "static volatile int64_t ls_http_table_lock = 0;\n";
+      o_ << "static LS_THREAD_LOCAL ls_http_loop_binding ls_http_bound_loops[LS_HTTP_MAX_SERVERS];\n";
       o_ << "static inline ls_http_server_slot *ls_http_get_server(int64_t id) {\n";
       o_ << "  if (id < 0 || id >= LS_HTTP_MAX_SERVERS) return NULL;\n";
       o_ << "  if (!ls_http_servers[id].active) return NULL;\n";
       o_ << "  return &ls_http_servers[id];\n";
       o_ << "}\n";
-      o_ << "static inline ls_http_client_slot *ls_http_get_client(int64_t id) {\n";
-      o_ << "  if (id < 0 || id >= LS_HTTP_MAX_CLIENTS) return NULL;\n";
-      o_ << "  if (!ls_http_clients[id].active) return NULL;\n";
-      o_ << "  return &ls_http_clients[id];\n";
+      o_ << "/* Client ids carry their table in the high bits: 0 is the shared blocking/connect table,\n";
+      o_ << "   otherwise (1 + server * LS_HTTP_MAX_LOOPS + loop) names an event loop's own table. */\n";
+      o_ << "static inline ls_http_client_slot *ls_http_find_client(int64_t id, ls_http_loop **loop_out) {\n";
+      o_ << "  if (id < 0) return NULL;\n";
+      o_ << "  const int64_t tag = id >> LS_HTTP_ID_SHIFT;\n";
+      o_ << "  const int64_t local = id & ((1LL << LS_HTTP_ID_SHIFT) - 1);\n";
+      o_ << "  ls_http_client_table *table = &ls_http_shared_clients;\n";
+      o_ << "  ls_http_loop *loop = NULL;\n";
+      o_ << "  if (tag > 0) {\n";
+      o_ << "    ls_http_server_slot *srv = ls_http_get_server((tag - 1) / LS_HTTP_MAX_LOOPS);\n";
+      o_ << "    const int64_t index = (tag - 1) % LS_HTTP_MAX_LOOPS;\n";
+      o_ << "    if (!srv || !srv->loops || index >= srv->loop_count) return NULL;\n";
+      o_ << "    loop = &srv->loops[index];\n";
+      o_ << "    table = &loop->clients;\n";
+      o_ << "  }\n";
+      o_ << "  if (local >= table->next) return NULL;\n";
+      o_ << "  ls_http_client_slot *c = &table->slots[local];\n";
+      o_ << "  if (!c->active) return NULL;\n";
+      o_ << "  if (loop_out) *loop_out = loop;\n";
+      o_ << "  return c;\n";
+      o_ << "}\n";
+      o_ << "static inline ls_http_client_slot *ls_http_get_client(int64_t id) { return ls_http_find_client(id, NULL); }\n";
+      o_ << "static inline int64_t ls_http_table_alloc(ls_http_client_table *t, ls_http_socket sock) {\n";
+      o_ << "  int64_t id = -1;\n";
+      o_ << "  if (t->free_top > 0) id = t->free_ids[--t->free_top];\n";
+      o_ << "  else if (t->next < t->cap) id = t->next++;\n";
+      o_ << "  if (id < 0) return -1;\n";
+      o_ << "  ls_http_client_slot *c = &t->slots[id];\n";
+      o_ << "  c->active = 1;\n";
+      o_ << "  c->sock = sock;\n";
+      o_ << "  c->evented = 0;\n";
+      o_ << "  c->registered = 0;\n";
+      o_ << "  c->busy = 0;\n";
+      o_ << "  c->queued = 0;\n";
+      o_ << "  c->keep_alive = 0;\n";
+      o_ << "  c->closing = 0;\n";
+      o_ << "  c->peer_closed = 0;\n";
+      o_ << "  c->view_ready = 0;\n";
+      o_ << "  c->ev_mask = 0;\n";
+      o_ << "  c->in_len = 0;\n";
+      o_ << "  c->in_scan = 0;\n";
+      o_ << "  c->head_len = 0;\n";
+      o_ << "  c->req_len = 0;\n";
+      o_ << "  c->patch_count = 0;\n";
+      o_ << "  c->out_len = 0;\n";
+      o_ << "  c->out_off = 0;\n";
+      o_ << "  c->file = NULL;\n";
+      o_ << "  c->file_left = 0;\n";
+      o_ << "  return id;\n";
+      o_ << "}\n";
+      o_ << "static void ls_http_table_release(ls_http_client_table *t, int64_t local) {\n";
+      o_ << "  ls_http_client_slot *c = &t->slots[local];\n";
+      o_ << "  ls_http_close_socket(c->sock);\n";
+      o_ << "  c->sock = ls_http_bad_socket();\n";
+      o_ << "  c->active = 0;\n";
+      o_ << "  c->evented = 0;\n";
+      o_ << "  c->registered = 0;\n";
+      o_ << "  if (c->file) fclose(c->file);\n";
+      o_ << "  c->file = NULL;\n";
+      o_ << "  c->file_left = 0;\n";
+      o_ << "  if (c->in_cap > 65536) {\n";
+      o_ << "    free(c->in);\n";
+      o_ << "    c->in = NULL;\n";
+      o_ << "    c->in_cap = 0;\n";
+      o_ << "  }\n";
+      o_ << "  if (c->out_cap > 65536) {\n";
+      o_ << "    free(c->out);\n";
+      o_ << "    c->out = NULL;\n";
+      o_ << "    c->out_cap = 0;\n";
+      o_ << "  }\n";
+      o_ << "  if (t->free_top < t->cap) t->free_ids[t->free_top++] = local;\n";
+      o_ << "}\n";
+      o_ << "static void ls_http_table_destroy(ls_http_client_table *t) {\n";
+      o_ << "  for (int64_t i = 0; i < t->next; ++i) {\n";
+      o_ << "    if (t->slots[i].active) ls_http_close_socket(t->slots[i].sock);\n";
+      o_ << "    if (t->slots[i].file) fclose(t->slots[i].file);\n";
+      o_ << "    free(t->slots[i].in);\n";
+      o_ << "    free(t->slots[i].out);\n";
+      o_ << "  }\n";
+      o_ << "  free(t->slots);\n";
+      o_ << "  free(t->free_ids);\n";
+      o_ << "  memset(t, 0, sizeof(*t));\n";
       o_ << "}\n";
       o_ << "static inline int64_t ls_http_alloc_server(ls_http_socket sock) {\n";
+      o_ << "  ls_task_spin_lock(&ls_http_table_lock);\n";
       o_ << "  int64_t id = -1;\n";
       o_ << "  if (ls_http_server_free_top > 0) id = ls_http_server_free_ids[--ls_http_server_free_top];\n";
       o_ << "  else if (ls_http_server_next < LS_HTTP_MAX_SERVERS) id = ls_http_server_next++;\n";
-      o_ << "  if (id < 0) return -1;\n";
-      o_ << "  ls_http_servers[id].active = 1;\n";
-      o_ << "  ls_http_servers[id].sock = sock;\n";
+      o_ << "  if (id >= 0) {\n";
+      o_ << "    ls_http_server_slot *srv = &ls_http_servers[id];\n";
+      o_ << "    srv->sock = sock;\n";
+      o_ << "    srv->loops = NULL;\n";
+      o_ << "    srv->loop_count = 0;\n";
+      o_ << "    srv->loop_claim = 0;\n";
+      o_ << "    srv->pinned = 0;\n";
+      o_ << "    srv->generation = ++ls_http_server_generation;\n";
+      o_ << "    srv->active = 1;\n";
+      o_ << "  }\n";
+      o_ << "  ls_task_spin_unlock(&ls_http_table_lock);\n";
       o_ << "  return id;\n";
       o_ << "}\n";
+      o_ << "static inline void ls_http_free_server(int64_t id) {\n";
+      o_ << "  ls_task_spin_lock(&ls_http_table_lock);\n";
+      o_ << "  ls_http_servers[id].active = 0;\n";
+      o_ << "  if (ls_http_server_free_top < LS_HTTP_MAX_SERVERS) ls_http_server_free_ids[ls_http_server_free_top++] = id;\n";
+      o_ << "  ls_task_spin_unlock(&ls_http_table_lock);\n";
+      o_ << "}\n";
       o_ << "static inline int64_t ls_http_alloc_client(ls_http_socket sock) {\n";
-      o_ << "  int64_t id = -1;\n";
-      o_ << "  if (ls_http_client_free_top > 0) id = ls_http_client_free_ids[--ls_http_client_free_top];\n";
-      o_ << "  else if (ls_http_client_next < LS_HTTP_MAX_CLIENTS) id = ls_http_client_next++;\n";
-      o_ << "  if (id < 0) return -1;\n";
-      o_ << "  ls_http_clients[id].active = 1;\n";
-      o_ << "  ls_http_clients[id].sock = sock;\n";
+      o_ << "  ls_task_spin_lock(&ls_http_table_lock);\n";
+      o_ << "  const int64_t id = ls_http_table_alloc(&ls_http_shared_clients, sock);\n";
+      o_ << "  ls_task_spin_unlock(&ls_http_table_lock);\n";
       o_ << "  return id;\n";
       o_ << "}\n";
+      o_ << "static void ls_http_release_client(int64_t id) {\n";
+      o_ << "  ls_task_spin_lock(&ls_http_table_lock);\n";
+      o_ << "  ls_http_table_release(&ls_http_shared_clients, id);\n";
+      o_ << "  ls_task_spin_unlock(&ls_http_table_lock);\n";
+      o_ << "}\n";
       o_ << "static inline void ls_http_set_nodelay(ls_http_socket sock) {\n";
       o_ << "#if defined(TCP_NODELAY)\n";
       o_ << "  int one = 1;\n";
@@ -9972,6 +15295,57 @@ private:
       o_ << "  }\n";
       o_ << "  return 1;\n";
       o_ << "}\n";
+      o_ << "/* Sends two buffers with one sendmsg/WSASend call; returns the bytes sent or -1. */\n";
+      o_ << "static inline int64_t ls_http_send_vec(ls_http_socket sock, const char *a, size_t a_len, const char *b, size_t b_len) {\n";
+      o_ << "  if (a_len > 1073741824u) a_len = 1073741824u;\n";
+      o_ << "  if (b_len > 1073741824u) b_len = 1073741824u;\n";
+      o_ << "#if defined(_WIN32)\n";
+      o_ << "  WSABUF bufs[2];\n";
+      o_ << "  bufs[0].buf = (CHAR *)a;\n";
+      o_ << "  bufs[0].len = (ULONG)a_len;\n";
+      o_ << "  bufs[1].buf = (CHAR *)b;\n";
+      o_ << "  bufs[1].len = (ULONG)b_len;\n";
+      o_ << "  DWORD sent = 0;\n";
+      o_ << "  if (WSASend(sock, bufs, b_len ? 2u : 1u, &sent, 0, NULL, NULL) != 0) return -1;\n";
+      o_ << "  return (int64_t)sent;\n";
+      o_ << "#else\n";
+      o_ << "  struct iovec iov[2];\n";
+      o_ << "  iov[0].iov_base = (void *)a;\n";
+      o_ << "  iov[0].iov_len = a_len;\n";
+      o_ << "  iov[1].iov_base = (void *)b;\n";
+      o_ << "  iov[1].iov_len = b_len;\n";
+      o_ << "  struct msghdr msg;\n";
+      o_ << "  memset(&msg, 0, sizeof(msg));\n";
+      o_ << "  msg.msg_iov = iov;\n";
+      o_ << "  msg.msg_iovlen = b_len ? 2 : 1;\n";
+      o_ << "  const ssize_t n = sendmsg(sock, &msg, LS_HTTP_SEND_FLAGS);\n";
+      o_ << "  return n < 0 ? -1 : (int64_t)n;\n";
+      o_ << "#endif\n";
+      o_ << "}\n";
+      o_ << "static inline void ls_http_vec_advance(const char **a, size_t *a_len, const char **b, size_t *b_len, size_t n) {\n";
+      o_ << "  if (n < *a_len) {\n";
+      o_ << "    *a += n;\n";
+      o_ << "    *a_len -= n;\n";
+      o_ << "    return;\n";
+      o_ << "  }\n";
+      o_ << "  n -= *a_len;\n";
+      o_ << "  *a = *b + n;\n";
+      o_ << "  *a_len = *b_len - n;\n";
+      o_ << "  *b_len = 0;\n";
+      o_ << "}\n";
+      o_ << "static inline ls_bool ls_http_send_pair(ls_http_socket sock, const char *a, size_t a_len, const char *b, size_t b_len) {\n";
+      o_ << "  while (a_len + b_len > 0) {\n";
+      o_ << "    if (a_len == 0) {\n";
+      o_ << "      a = b;\n";
+      o_ << "      a_len = b_len;\n";
+      o_ << "      b_len = 0;\n";
+      o_ << "    }\n";
+      o_ << "    const int64_t sent = ls_http_send_vec(sock, a, a_len, b, b_len);\n";
+      o_ << "    if (sent <= 0) return 0;\n";
+      o_ << "    ls_http_vec_advance(&a, &a_len, &b, &b_len, (size_t)sent);\n";
+      o_ << "  }\n";
+      o_ << "  return 1;\n";
+      o_ << "}\n";
       o_ << "static LS_THREAD_LOCAL char ls_http_recv_once_buf[16385];\n";
       o_ << "static inline const char *ls_http_recv_once(ls_http_socket sock) {\n";
       o_ << "  char *buf = ls_http_recv_once_buf;\n";
@@ -10006,58 +15380,701 @@ private:
       o_ << "      if (need > 1048576) break;\n";
       o_ << "      if (!ls_http_recv_reserve(need)) break;\n";
       o_ << "    }\n";
-      o_ << "    const int chunk = (int)(ls_http_recv_cap - len - 1);\n";
-      o_ << "    if (chunk <= 0) break;\n";
-      o_ << "    const int n = (int)recv(sock, ls_http_recv_heap + len, chunk, 0);\n";
-      o_ << "    if (n <= 0) break;\n";
-      o_ << "    len += (size_t)n;\n";
+      o_ << "    const int chunk = (int)(ls_http_recv_cap - len - 1);\n";
+      o_ << "    if (chunk <= 0) break;\n";
+      o_ << "    const int n = (int)recv(sock, ls_http_recv_heap + len, chunk, 0);\n";
+      o_ << "    if (n <= 0) break;\n";
+      o_ << "    len += (size_t)n;\n";
+      o_ << "  }\n";
+      o_ << "  ls_http_recv_heap[len] = '\\0';\n";
+      o_ << "  return ls_http_recv_heap;\n";
+      o_ << "}\n";
+      o_ << "static inline const char *ls_http_reason_text(int64_t status) {\n";
+      o_ << "  switch (status) {\n";
+      o_ << "  case 200: return \"OK\";\n";
+      o_ << "  case 201: return \"Created\";\n";
+      o_ << "  case 204: return \"No Content\";\n";
+      o_ << "  case 400: return \"Bad Request\";\n";
+      o_ << "  case 401: return \"Unauthorized\";\n";
+      o_ << "  case 403: return \"Forbidden\";\n";
+      o_ << "  case 404: return \"Not Found\";\n";
+      o_ << "  case 409: return \"Conflict\";\n";
+      o_ << "  case 500: return \"Internal Server Error\";\n";
+      o_ << "  default: return \"OK\";\n";
+      o_ << "  }\n";
+      o_ << "}\n";
+      o_ << "static inline ls_bool ls_http_buf_reserve(char **buf, size_t *cap, size_t need) {\n";
+      o_ << "  if (need <= *cap && *buf) return 1;\n";
+      o_ << "  size_t next_cap = *cap ? *cap : 4096;\n";
+      o_ << "  while (next_cap < need) next_cap <<= 1;\n";
+      o_ << "  char *next = (char *)realloc(*buf, next_cap);\n";
+      o_ << "  if (!next) return 0;\n";
+      o_ << "  *buf = next;\n";
+      o_ << "  *cap = next_cap;\n";
+      o_ << "  return 1;\n";
+      o_ << "}\n";
+      o_ << "static inline int ls_http_lower_ascii(int ch) { return (ch >= 'A' && ch <= 'Z') ? ch + 32 : ch; }\n";
+      o_ << "static const char *ls_http_header_value(const char *head, size_t head_len, const char *name, size_t *value_len) {\n";
+      o_ << "  const size_t name_len = strlen(name);\n";
+      o_ << "  const char *end = head + head_len;\n";
+      o_ << "  const char *line = (const char *)memchr(head, '\\n', head_len);\n";
+      o_ << "  while (line && line + 1 < end) {\n";
+      o_ << "    line += 1;\n";
+      o_ << "    const char *eol = (const char *)memchr(line, '\\n', (size_t)(end - line));\n";
+      o_ << "    if (!eol) eol = end;\n";
+      o_ << "    if ((size_t)(eol - line) > name_len && line[name_len] == ':') {\n";
+      o_ << "      size_t i = 0;\n";
+      o_ << "      while (i < name_len && ls_http_lower_ascii((unsigned char)line[i]) == ls_http_lower_ascii((unsigned char)name[i])) ++i;\n";
+      o_ << "      if (i == name_len) {\n";
+      o_ << "        const char *v = line + name_len + 1;\n";
+      o_ << "        const char *ve = eol;\n";
+      o_ << "        while (v < ve && (*v == ' ' || *v == '\\t')) ++v;\n";
+      o_ << "        while (ve > v && (ve[-1] == '\\r' || ve[-1] == ' ' || ve[-1] == '\\t' || ve[-1] == '\\0')) --ve;\n";
+      o_ << "        *value_len = (size_t)(ve - v);\n";
+      o_ << "        return v;\n";
+      o_ << "      }\n";
+      o_ << "    }\n";
+      o_ << "    line = eol;\n";
+      o_ << "  }\n";
+      o_ << "  *value_len = 0;\n";
+      o_ << "  return NULL;\n";
+      o_ << "}\n";
+      o_ << "static ls_bool ls_http_token_in(const char *v, size_t len, const char *token) {\n";
+      o_ << "  const size_t tl = strlen(token);\n";
+      o_ << "  for (size_t i = 0; i + tl <= len; ++i) {\n";
+      o_ << "    size_t j = 0;\n";
+      o_ << "    while (j < tl && ls_http_lower_ascii((unsigned char)v[i + j]) == token[j]) ++j;\n";
+      o_ << "    if (j == tl) return 1;\n";
+      o_ << "  }\n";
+      o_ << "  return 0;\n";
+      o_ << "}\n";
+      o_ << "/* Returns 1 when a complete request sits at the front of c->in, 0 when more bytes are needed,\n";
+      o_ << "   -1 when the request is malformed or too large. */\n";
+      o_ << "static int ls_http_ev_parse(ls_http_client_slot *c) {\n";
+      o_ << "  if (c->req_len) return 1;\n";
+      o_ << "  size_t i = c->in_scan;\n";
+      o_ << "  size_t head_len = 0;\n";
+      o_ << "  while (i < c->in_len) {\n";
+      o_ << "    const char *nl = (const char *)memchr(c->in + i, '\\n', c->in_len - i);\n";
+      o_ << "    if (!nl) {\n";
+      o_ << "      i = c->in_len;\n";
+      o_ << "      break;\n";
+      o_ << "    }\n";
+      o_ << "    const size_t p = (size_t)(nl - c->in);\n";
+      o_ << "    if (p >= 3 && c->in[p - 1] == '\\r' && c->in[p - 2] == '\\n' && c->in[p - 3] == '\\r') {\n";
+      o_ << "      head_len = p + 1;\n";
+      o_ << "      break;\n";
+      o_ << "    }\n";
+      o_ << "    i = p + 1;\n";
+      o_ << "  }\n";
+      o_ << "  if (!head_len) {\n";
+      o_ << "    c->in_scan = i;\n";
+      o_ << "    return c->in_len > LS_HTTP_MAX_HEADER ? -1 : 0;\n";
+      o_ << "  }\n";
+      o_ << "  size_t v_len = 0;\n";
+      o_ << "  size_t body_len = 0;\n";
+      o_ << "  const char *v = ls_http_header_value(c->in, head_len, \"content-length\", &v_len);\n";
+      o_ << "  if (v) {\n";
+      o_ << "    if (v_len == 0 || v_len > 10) return -1;\n";
+      o_ << "    for (size_t k = 0; k < v_len; ++k) {\n";
+      o_ << "      if (v[k] < '0' || v[k] > '9') return -1;\n";
+      o_ << "      body_len = body_len * 10u + (size_t)(v[k] - '0');\n";
+      o_ << "    }\n";
+      o_ << "  }\n";
+      o_ << "  if (head_len + body_len > LS_HTTP_MAX_REQUEST) return -1;\n";
+      o_ << "  if (c->in_len < head_len + body_len) return 0;\n";
+      o_ << "  c->head_len = head_len;\n";
+      o_ << "  c->req_len = head_len + body_len;\n";
+      o_ << "  const char *eol = (const char *)memchr(c->in, '\\r', head_len);\n";
+      o_ << "  const ls_bool http10 = (eol && eol - c->in >= 8 && memcmp(eol - 8, \"HTTP/1.0\", 8) == 0) ? 1 : 0;\n";
+      o_ << "  v = ls_http_header_value(c->in, head_len, \"connection\", &v_len);\n";
+      o_ << "  if (http10) c->keep_alive = (v && ls_http_token_in(v, v_len, \"keep-alive\")) ? 1 : 0;\n";
+      o_ << "  else c->keep_alive = (v && ls_http_token_in(v, v_len, \"close\")) ? 0 : 1;\n";
+      o_ << "  return 1;\n";
+      o_ << "}\n";
+      o_ << "/* Reads one whole request into a blocking client's buffer; event-loop clients already hold theirs. */\n";
+      o_ << "static ls_bool ls_http_load_request(ls_http_client_slot *c) {\n";
+      o_ << "  if (c->evented || c->busy) return c->busy;\n";
+      o_ << "  while (1) {\n";
+      o_ << "    const int parsed = ls_http_ev_parse(c);\n";
+      o_ << "    if (parsed > 0) break;\n";
+      o_ << "    if (parsed < 0) return 0;\n";
+      o_ << "    if (c->in_len + 4096 + 1 > c->in_cap && !ls_http_buf_reserve(&c->in, &c->in_cap, c->in_len + 4096 + 1)) return 0;\n";
+      o_ << "    const int n = (int)recv(c->sock, c->in + c->in_len, (int)(c->in_cap - c->in_len - 1), 0);\n";
+      o_ << "    if (n <= 0) return 0;\n";
+      o_ << "    c->in_len += (size_t)n;\n";
+      o_ << "  }\n";
+      o_ << "  c->busy = 1;\n";
+      o_ << "  c->saved = c->in[c->req_len];\n";
+      o_ << "  c->in[c->req_len] = '\\0';\n";
+      o_ << "  return 1;\n";
+      o_ << "}\n";
+      o_ << "static inline ls_bool ls_http_patch(ls_http_client_slot *c, size_t pos) {\n";
+      o_ << "  if (c->in[pos] == '\\0') return 1;\n";
+      o_ << "  if (c->patch_count >= LS_HTTP_MAX_PATCHES) return 0;\n";
+      o_ << "  c->patch_pos[c->patch_count] = pos;\n";
+      o_ << "  c->patch_byte[c->patch_count] = c->in[pos];\n";
+      o_ << "  c->patch_count += 1;\n";
+      o_ << "  c->in[pos] = '\\0';\n";
+      o_ << "  return 1;\n";
+      o_ << "}\n";
+      o_ << "/* Puts back the bytes the request accessors overwrote so http_server_read sees the raw request. */\n";
+      o_ << "static inline void ls_http_unpatch(ls_http_client_slot *c) {\n";
+      o_ << "  while (c->patch_count > 0) {\n";
+      o_ << "    c->patch_count -= 1;\n";
+      o_ << "    c->in[c->patch_pos[c->patch_count]] = c->patch_byte[c->patch_count];\n";
+      o_ << "  }\n";
+      o_ << "  c->view_ready = 0;\n";
+      o_ << "}\n";
+      o_ << "/* Splits the request line in place: method, path and query become NUL-terminated\n";
+      o_ << "   slices of the receive buffer, valid until the response or http_server_read. */\n";
+      o_ << "static ls_http_client_slot *ls_http_request_view(int64_t client_id) {\n";
+      o_ << "  ls_http_client_slot *c = ls_http_get_client(client_id);\n";
+      o_ << "  if (!c || !ls_http_load_request(c)) return NULL;\n";
+      o_ << "  if (c->view_ready) return c;\n";
+      o_ << "  const char *eol = (const char *)memchr(c->in, '\\r', c->head_len);\n";
+      o_ << "  const size_t line_len = eol ? (size_t)(eol - c->in) : 0;\n";
+      o_ << "  const char *sp = (const char *)memchr(c->in, ' ', line_len);\n";
+      o_ << "  c->path_off = 0;\n";
+      o_ << "  c->query_off = 0;\n";
+      o_ << "  if (sp) {\n";
+      o_ << "    const size_t path = (size_t)(sp - c->in) + 1;\n";
+      o_ << "    const char *tail = (const char *)memchr(c->in + path, ' ', line_len - path);\n";
+      o_ << "    const size_t path_end = tail ? (size_t)(tail - c->in) : line_len;\n";
+      o_ << "    const char *q = (const char *)memchr(c->in + path, '?', path_end - path);\n";
+      o_ << "    (void)ls_http_patch(c, path - 1);\n";
+      o_ << "    if (q) {\n";
+      o_ << "      c->query_off = (size_t)(q - c->in) + 1;\n";
+      o_ << "      (void)ls_http_patch(c, c->query_off - 1);\n";
+      o_ << "    }\n";
+      o_ << "    (void)ls_http_patch(c, path_end);\n";
+      o_ << "    c->path_off = path;\n";
+      o_ << "  }\n";
+      o_ << "  c->view_ready = 1;\n";
+      o_ << "  return c;\n";
+      o_ << "}\n";
+      o_ << "static inline void ls_http_file_done(ls_http_client_slot *c) {\n";
+      o_ << "  if (c->file) fclose(c->file);\n";
+      o_ << "  c->file = NULL;\n";
+      o_ << "  c->file_left = 0;\n";
+      o_ << "}\n";
+      o_ << "/* Moves the next piece of a file response toward the socket: sendfile on Linux, otherwise\n";
+      o_ << "   a chunk read into the output buffer. Returns 1 on progress, 0 when the socket is full, -1 on error. */\n";
+      o_ << "static int ls_http_file_pump(ls_http_client_slot *c) {\n";
+      o_ << "#if defined(__linux__)\n";
+      o_ << "  off_t off = (off_t)c->file_off;\n";
+      o_ << "  const size_t chunk = c->file_left > 1048576u ? 1048576u : (size_t)c->file_left;\n";
+      o_ << "  const ssize_t n = sendfile(c->sock, fileno(c->file), &off, chunk);\n";
+      o_ << "  if (n > 0) {\n";
+      o_ << "    c->file_off = (uint64_t)off;\n";
+      o_ << "    c->file_left -= (uint64_t)n;\n";
+      o_ << "    if (c->file_left == 0) ls_http_file_done(c);\n";
+      o_ << "    return 1;\n";
+      o_ << "  }\n";
+      o_ << "  if (n < 0 && ls_http_would_block()) return 0;\n";
+      o_ << "  ls_http_file_done(c);\n";
+      o_ << "  return -1;\n";
+      o_ << "#else\n";
+      o_ << "  const size_t chunk = c->file_left > 65536u ? 65536u : (size_t)c->file_left;\n";
+      o_ << "  if (!ls_http_buf_reserve(&c->out, &c->out_cap, chunk)) {\n";
+      o_ << "    ls_http_file_done(c);\n";
+      o_ << "    return -1;\n";
+      o_ << "  }\n";
+      o_ << "  const size_t got = fread(c->out, 1, chunk, c->file);\n";
+      o_ << "  if (got == 0) {\n";
+      o_ << "    ls_http_file_done(c);\n";
+      o_ << "    return -1;\n";
+      o_ << "  }\n";
+      o_ << "  c->out_off = 0;\n";
+      o_ << "  c->out_len = got;\n";
+      o_ << "  c->file_left -= (uint64_t)got;\n";
+      o_ << "  if (c->file_left == 0) ls_http_file_done(c);\n";
+      o_ << "  return 1;\n";
+      o_ << "#endif\n";
+      o_ << "}\n";
+      o_ << "static inline ls_bool ls_http_out_pending(const ls_http_client_slot *c) {\n";
+      o_ << "  return (c->out_off < c->out_len || c->file_left > 0) ? 1 : 0;\n";
+      o_ << "}\n";
+      o_ << "/* Writes everything still queued on a client with blocking sends. */\n";
+      o_ << "static ls_bool ls_http_drain_blocking(ls_http_client_slot *c) {\n";
+      o_ << "  ls_bool ok = 1;\n";
+      o_ << "  while (ok && ls_http_out_pending(c)) {\n";
+      o_ << "    if (c->out_off < c->out_len) ok = ls_http_send_all(c->sock, c->out + c->out_off, c->out_len - c->out_off);\n";
+      o_ << "    c->out_off = 0;\n";
+      o_ << "    c->out_len = 0;\n";
+      o_ << "    if (ok && c->file_left > 0 && ls_http_file_pump(c) < 0) ok = 0;\n";
+      o_ << "  }\n";
+      o_ << "  if (!ok) ls_http_file_done(c);\n";
+      o_ << "  return ok;\n";
+      o_ << "}\n";
+      o_ << "/* A client socket stays registered from accept to close and only its interest changes. An empty mask (a request\n";
+      o_ << "   handed to the program) parks it with EPOLLONESHOT, so a hangup meanwhile is reported once, not on every wait. */\n";
+      o_ << "static void ls_http_ev_set(ls_http_loop *loop, int64_t local, ls_http_client_slot *c, unsigned mask) {\n";
+      o_ << "#if defined(LS_HTTP_USE_EPOLL)\n";
+      o_ << "  if (!c->registered || mask != c->ev_mask) {\n";
+      o_ << "    struct epoll_event ev;\n";
+      o_ << "    memset(&ev, 0, sizeof(ev));\n";
+      o_ << "    ev.events = mask == 0 ? (uint32_t)EPOLLONESHOT\n";
+      o_ << "                          : (((mask & LS_HTTP_EV_READ) ? EPOLLIN : 0u) | ((mask & LS_HTTP_EV_WRITE) ? EPOLLOUT : 0u));\n";
+      o_ << "    ev.data.u64 = (uint64_t)local;\n";
+      o_ << "    (void)epoll_ctl(loop->ev_fd, c->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->sock, &ev);\n";
+      o_ << "    c->registered = 1;\n";
+      o_ << "  }\n";
+      o_ << "#else\n";
+      o_ << "  (void)loop;\n";
+      o_ << "  (void)local;\n";
+      o_ << "#endif\n";
+      o_ << "  c->ev_mask = mask;\n";
+      o_ << "}\n";
+      o_ << "static void ls_http_ev_drop(ls_http_loop *loop, int64_t local, ls_http_client_slot *c) {\n";
+      o_ << "  if (c->queued) {\n";
+      o_ << "    int64_t kept = 0;\n";
+      o_ << "    for (int64_t i = 0; i < loop->ready_len; ++i) {\n";
+      o_ << "      const int64_t v = loop->ready[(loop->ready_head + i) % loop->clients.cap];\n";
+      o_ << "      if (v != local) loop->ready[(loop->ready_head + kept++) % loop->clients.cap] = v;\n";
+      o_ << "    }\n";
+      o_ << "    loop->ready_len = kept;\n";
+      o_ << "    c->queued = 0;\n";
+      o_ << "  }\n";
+      o_ << "  /* Closing the socket also removes it from the epoll set. */\n";
+      o_ << "  c->ev_mask = 0;\n";
+      o_ << "  ls_http_table_release(&loop->clients, local);\n";
+      o_ << "}\n";
+      o_ << "static void ls_http_ev_enqueue(ls_http_loop *loop, int64_t local, ls_http_client_slot *c) {\n";
+      o_ << "  loop->ready[(loop->ready_head + loop->ready_len) % loop->clients.cap] = local;\n";
+      o_ << "  loop->ready_len += 1;\n";
+      o_ << "  c->queued = 1;\n";
+      o_ << "  ls_http_ev_set(loop, local, c, ls_http_out_pending(c) ? LS_HTTP_EV_WRITE : 0u);\n";
+      o_ << "}\n";
+      o_ << "/* Sends queued output, then any pending file body, without blocking. Returns 0 on a hard socket error. */\n";
+      o_ << "static ls_bool ls_http_ev_flush(ls_http_client_slot *c) {\n";
+      o_ << "  while (1) {\n";
+      o_ << "    while (c->out_off < c->out_len) {\n";
+      o_ << "      const size_t left = c->out_len - c->out_off;\n";
+      o_ << "      const int chunk = (left > 2147483647u) ? 2147483647 : (int)left;\n";
+      o_ << "      const int sent = ls_http_send_chunk(c->sock, c->out + c->out_off, chunk);\n";
+      o_ << "      if (sent > 0) {\n";
+      o_ << "        c->out_off += (size_t)sent;\n";
+      o_ << "        continue;\n";
+      o_ << "      }\n";
+      o_ << "      if (sent < 0 && ls_http_would_block()) return 1;\n";
+      o_ << "      return 0;\n";
+      o_ << "    }\n";
+      o_ << "    c->out_off = 0;\n";
+      o_ << "    c->out_len = 0;\n";
+      o_ << "    if (c->file_left == 0) return 1;\n";
+      o_ << "    const int pumped = ls_http_file_pump(c);\n";
+      o_ << "    if (pumped <= 0) return pumped == 0 ? 1 : 0;\n";
+      o_ << "  }\n";
+      o_ << "}\n";
+      o_ << "/* Re-arms a connection after its response was queued or flushed. */\n";
+      o_ << "static void ls_http_ev_rearm(ls_http_loop *loop, int64_t local, ls_http_client_slot *c) {\n";
+      o_ << "  const ls_bool pending = ls_http_out_pending(c);\n";
+      o_ << "  if (c->busy || c->queued) return;\n";
+      o_ << "  if (c->file_left > 0) {\n";
+      o_ << "    /* the next pipelined response must wait until the file body is on the wire */\n";
+      o_ << "    ls_http_ev_set(loop, local, c, LS_HTTP_EV_WRITE);\n";
+      o_ << "    return;\n";
+      o_ << "  }\n";
+      o_ << "  if (!c->closing) {\n";
+      o_ << "    const int parsed = ls_http_ev_parse(c);\n";
+      o_ << "    if (parsed > 0) {\n";
+      o_ << "      ls_http_ev_enqueue(loop, local, c);\n";
+      o_ << "      return;\n";
+      o_ << "    }\n";
+      o_ << "    if (parsed < 0 || c->peer_closed) c->closing = 1;\n";
+      o_ << "  }\n";
+      o_ << "  if (c->closing && !pending) {\n";
+      o_ << "    ls_http_ev_drop(loop, local, c);\n";
+      o_ << "    return;\n";
+      o_ << "  }\n";
+      o_ << "  ls_http_ev_set(loop, local, c, (pending ? LS_HTTP_EV_WRITE : 0u) | (c->closing ? 0u : LS_HTTP_EV_READ));\n";
+      o_ << "}\n";
+      o_ << "static void ls_http_ev_on_read(ls_http_loop *loop, int64_t local, ls_http_client_slot *c) {\n";
+      o_ << "  size_t budget = 65536;\n";
+      o_ << "  while (budget > 0) {\n";
+      o_ << "    if (c->in_len + 4096 + 1 > c->in_cap && !ls_http_buf_reserve(&c->in, &c->in_cap, c->in_len + 4096 + 1)) {\n";
+      o_ << "      ls_http_ev_drop(loop, local, c);\n";
+      o_ << "      return;\n";
+      o_ << "    }\n";
+      o_ << "    const int chunk = (int)(c->in_cap - c->in_len - 1);\n";
+      o_ << "    const int n = (int)recv(c->sock, c->in + c->in_len, chunk, 0);\n";
+      o_ << "    if (n > 0) {\n";
+      o_ << "      c->in_len += (size_t)n;\n";
+      o_ << "      budget = (size_t)n >= budget ? 0 : budget - (size_t)n;\n";
+      o_ << "      continue;\n";
+      o_ << "    }\n";
+      o_ << "    if (n < 0 && ls_http_would_block()) break;\n";
+      o_ << "    c->peer_closed = 1;\n";
+      o_ << "    break;\n";
+      o_ << "  }\n";
+      o_ << "  ls_http_ev_rearm(loop, local, c);\n";
+      o_ << "}\n";
+      o_ << "static void ls_http_ev_on_write(ls_http_loop *loop, int64_t local, ls_http_client_slot *c) {\n";
+      o_ << "  if (!ls_http_ev_flush(c)) {\n";
+      o_ << "    if (!c->busy) {\n";
+      o_ << "      ls_http_ev_drop(loop, local, c);\n";
+      o_ << "      return;\n";
+      o_ << "    }\n";
+      o_ << "    /* the script still owns this request; drop output and close after it responds */\n";
+      o_ << "    c->out_off = 0;\n";
+      o_ << "    c->out_len = 0;\n";
+      o_ << "    ls_http_file_done(c);\n";
+      o_ << "    c->closing = 1;\n";
+      o_ << "  }\n";
+      o_ << "  if (c->busy || c->queued) {\n";
+      o_ << "    ls_http_ev_set(loop, local, c, ls_http_out_pending(c) ? LS_HTTP_EV_WRITE : 0u);\n";
+      o_ << "    return;\n";
+      o_ << "  }\n";
+      o_ << "  ls_http_ev_rearm(loop, local, c);\n";
+      o_ << "}\n";
+      o_ << "static void ls_http_ev_accept(ls_http_loop *loop) {\n";
+      o_ << "  while (1) {\n";
+      o_ << "    ls_http_socket s = accept(loop->sock, NULL, NULL);\n";
+      o_ << "    if (ls_http_is_bad_socket(s)) return;\n";
+      o_ << "    if (!ls_http_set_nonblocking(s, 1)) {\n";
+      o_ << "      ls_http_close_socket(s);\n";
+      o_ << "      continue;\n";
+      o_ << "    }\n";
+      o_ << "    ls_http_set_nodelay(s);\n";
+      o_ << "    const int64_t local = ls_http_table_alloc(&loop->clients, s);\n";
+      o_ << "    if (local < 0) {\n";
+      o_ << "      ls_http_close_socket(s);\n";
+      o_ << "      return;\n";
+      o_ << "    }\n";
+      o_ << "    ls_http_client_slot *c = &loop->clients.slots[local];\n";
+      o_ << "    c->evented = 1;\n";
+      o_ << "    ls_http_ev_set(loop, local, c, LS_HTTP_EV_READ);\n";
+      o_ << "  }\n";
+      o_ << "}\n";
+      o_ << "static void ls_http_ev_dispatch(ls_http_loop *loop, int64_t local, ls_bool readable, ls_bool writable) {\n";
+      o_ << "  if (local < 0) {\n";
+      o_ << "    ls_http_ev_accept(loop);\n";
+      o_ << "    return;\n";
+      o_ << "  }\n";
+      o_ << "  if (local >= loop->clients.next) return;\n";
+      o_ << "  ls_http_client_slot *c = &loop->clients.slots[local];\n";
+      o_ << "  if (!c->active || !c->evented) return;\n";
+      o_ << "  if (writable && ls_http_out_pending(c)) {\n";
+      o_ << "    ls_http_ev_on_write(loop, local, c);\n";
+      o_ << "    if (!c->active) return;\n";
+      o_ << "  }\n";
+      o_ << "  if (readable && (c->ev_mask & LS_HTTP_EV_READ)) ls_http_ev_on_read(loop, local, c);\n";
+      o_ << "}\n";
+      o_ << "static ls_bool ls_http_loop_start(ls_http_loop *loop) {\n";
+      o_ << "  if (loop->started) return 1;\n";
+      o_ << "  if (!ls_http_set_nonblocking(loop->sock, 1)) return 0;\n";
+      o_ << "  const int64_t cap = LS_HTTP_LOOP_CLIENTS;\n";
+      o_ << "  loop->clients.slots = (ls_http_client_slot *)calloc((size_t)cap, sizeof(ls_http_client_slot));\n";
+      o_ << "  loop->clients.free_ids = (int64_t *)malloc(sizeof(int64_t) * (size_t)cap);\n";
+      o_ << "  loop->ready = (int64_t *)malloc(sizeof(int64_t) * (size_t)cap);\n";
+      o_ << "  loop->clients.cap = cap;\n";
+      o_ << "  loop->clients.next = 0;\n";
+      o_ << "  loop->clients.free_top = 0;\n";
+      o_ << "  loop->ready_head = 0;\n";
+      o_ << "  loop->ready_len = 0;\n";
+      o_ << "  ls_bool ok = (loop->clients.slots && loop->clients.free_ids && loop->ready) ? 1 : 0;\n";
+      o_ << "#if defined(LS_HTTP_USE_EPOLL)\n";
+      o_ << "  if (ok) {\n";
+      o_ << "    loop->ev_fd = epoll_create1(EPOLL_CLOEXEC);\n";
+      o_ << "    struct epoll_event ev;\n";
+      o_ << "    memset(&ev, 0, sizeof(ev));\n";
+      o_ << "    ev.events = EPOLLIN;\n";
+      o_ << "#if defined(EPOLLEXCLUSIVE)\n";
+      o_ << "    if (!loop->owns_sock) ev.events |= EPOLLEXCLUSIVE;\n";
+      o_ << "#endif\n";
+      o_ << "    ev.data.u64 = (uint64_t)(int64_t)-1;\n";
+      o_ << "    ok = (loop->ev_fd >= 0 && epoll_ctl(loop->ev_fd, EPOLL_CTL_ADD, loop->sock, &ev) == 0) ? 1 : 0;\n";
+      o_ << "  }\n";
+      o_ << "#else\n";
+      o_ << "  if (ok) {\n";
+      o_ << "    loop->poll_fds = (ls_http_pollfd *)malloc(sizeof(ls_http_pollfd) * (size_t)(cap + 1));\n";
+      o_ << "    loop->poll_ids = (int64_t *)malloc(sizeof(int64_t) * (size_t)(cap + 1));\n";
+      o_ << "    ok = (loop->poll_fds && loop->poll_ids) ? 1 : 0;\n";
+      o_ << "  }\n";
+      o_ << "#endif\n";
+      o_ << "  loop->started = 1;\n";
+      o_ << "  return ok;\n";
+      o_ << "}\n";
+      o_ << "static int ls_http_loop_wait(ls_http_loop *loop, int timeout_ms) {\n";
+      o_ << "#if defined(LS_HTTP_USE_EPOLL)\n";
+      o_ << "  struct epoll_event events[128];\n";
+      o_ << "  const int n = epoll_wait(loop->ev_fd, events, 128, timeout_ms);\n";
+      o_ << "  for (int i = 0; i < n; ++i) {\n";
+      o_ << "    const uint32_t e = events[i].events;\n";
+      o_ << "    ls_http_ev_dispatch(loop, (int64_t)events[i].data.u64, (e & (EPOLLIN | EPOLLHUP | EPOLLERR)) ? 1 : 0,\n";
+      o_ << "                        (e & (EPOLLOUT | EPOLLERR)) ? 1 : 0);\n";
+      o_ << "  }\n";
+      o_ << "  return n;\n";
+      o_ << "#else\n";
+      o_ << "  int64_t count = 1;\n";
+      o_ << "  loop->poll_fds[0].fd = loop->sock;\n";
+      o_ << "  loop->poll_fds[0].events = POLLIN;\n";
+      o_ << "  loop->poll_fds[0].revents = 0;\n";
+      o_ << "  loop->poll_ids[0] = -1;\n";
+      o_ << "  for (int64_t local = 0; local < loop->clients.next; ++local) {\n";
+      o_ << "    const ls_http_client_slot *c = &loop->clients.slots[local];\n";
+      o_ << "    if (!c->active || c->ev_mask == 0) continue;\n";
+      o_ << "    loop->poll_fds[count].fd = c->sock;\n";
+      o_ << "    loop->poll_fds[count].events = (short)(((c->ev_mask & LS_HTTP_EV_READ) ? POLLIN : 0) | ((c->ev_mask & LS_HTTP_EV_WRITE) ? POLLOUT : 0));\n";
+      o_ << "    loop->poll_fds[count].revents = 0;\n";
+      o_ << "    loop->poll_ids[count] = local;\n";
+      o_ << "    ++count;\n";
+      o_ << "  }\n";
+      o_ << "  const int n = ls_http_poll(loop->poll_fds, count, timeout_ms);\n";
+      o_ << "  if (n <= 0) return n;\n";
+      o_ << "  for (int64_t i = 0; i < count; ++i) {\n";
+      o_ << "    const short re = loop->poll_fds[i].revents;\n";
+      o_ << "    if (!re) continue;\n";
+      o_ << "    ls_http_ev_dispatch(loop, loop->poll_ids[i], (re & (POLLIN | POLLHUP | POLLERR)) ? 1 : 0,\n";
+      o_ << "                        (re & (POLLOUT | POLLERR)) ? 1 : 0);\n";
+      o_ << "  }\n";
+      o_ << "  return n;\n";
+      o_ << "#endif\n";
+      o_ << "}\n";
+      o_ << "static void ls_http_loop_destroy(ls_http_loop *loop) {\n";
+      o_ << "  if (loop->started) {\n";
+      o_ << "    ls_http_table_destroy(&loop->clients);\n";
+      o_ << "#if defined(LS_HTTP_USE_EPOLL)\n";
+      o_ << "    if (loop->ev_fd >= 0) (void)close(loop->ev_fd);\n";
+      o_ << "#else\n";
+      o_ << "    free(loop->poll_fds);\n";
+      o_ << "    free(loop->poll_ids);\n";
+      o_ << "#endif\n";
+      o_ << "    free(loop->ready);\n";
+      o_ << "  }\n";
+      o_ << "  if (loop->owns_sock) ls_http_close_socket(loop->sock);\n";
+      o_ << "  memset(loop, 0, sizeof(*loop));\n";
+      o_ << "}\n";
+      o_ << "static ls_bool ls_http_loops_create(ls_http_server_slot *srv, int64_t server_id, int64_t count) {\n";
+      o_ << "  srv->loops = (ls_http_loop *)calloc((size_t)count, sizeof(ls_http_loop));\n";
+      o_ << "  if (!srv->loops) return 0;\n";
+      o_ << "  for (int64_t i = 0; i < count; ++i) {\n";
+      o_ << "    srv->loops[i].sock = srv->sock;\n";
+      o_ << "    srv->loops[i].ev_fd = -1;\n";
+      o_ << "    srv->loops[i].tag = 1 + server_id * LS_HTTP_MAX_LOOPS + i;\n";
+      o_ << "  }\n";
+      o_ << "  srv->loop_count = count;\n";
+      o_ << "  return 1;\n";
+      o_ << "}\n";
+      o_ << "/* Picks the event loop owned by the calling thread. Each thread that polls a\n";
+      o_ << "   multi-worker server is bound to its own loop the first time it polls; threads\n";
+      o_ << "   beyond the worker count get no loop. */\n";
+      o_ << "static ls_http_loop *ls_http_claim_loop(ls_http_server_slot *srv, int64_t server_id) {\n";
+      o_ << "  if (!srv->loops && !ls_http_loops_create(srv, server_id, 1)) return NULL;\n";
+      o_ << "  if (!srv->pinned) return &srv->loops[0];\n";
+      o_ << "  ls_http_loop_binding *b = &ls_http_bound_loops[server_id];\n";
+      o_ << "  if (b->generation != srv->generation) {\n";
+      o_ << "    const int64_t slot = LS_ATOMIC_ADD(&srv->loop_claim, 1);\n";
+      o_ << "    b->generation = srv->generation;\n";
+      o_ << "    b->loop = slot < srv->loop_count ? slot + 1 : 0;\n";
+      o_ << "  }\n";
+      o_ << "  if (b->loop <= 0) return NULL;\n";
+      o_ << "  return &srv->loops[b->loop - 1];\n";
+      o_ << "}\n";
+      o_ << "static inline int64_t http_server_poll(int64_t server_id, int64_t timeout_ms) {\n";
+      o_ << "  ls_http_server_slot *srv = ls_http_get_server(server_id);\n";
+      o_ << "  if (!srv) return -1;\n";
+      o_ << "  ls_http_loop *loop = ls_http_claim_loop(srv, server_id);\n";
+      o_ << "  if (!loop || !ls_http_loop_start(loop)) return -1;\n";
+      o_ << "  const int wait_ms = timeout_ms < 0 ? -1 : (timeout_ms > 2147483647LL ? 2147483647 : (int)timeout_ms);\n";
+      o_ << "  ls_bool waited = 0;\n";
+      o_ << "  while (1) {\n";
+      o_ << "    while (loop->ready_len > 0) {\n";
+      o_ << "      const int64_t local = loop->ready[loop->ready_head];\n";
+      o_ << "      loop->ready_head = (loop->ready_head + 1) % loop->clients.cap;\n";
+      o_ << "      loop->ready_len -= 1;\n";
+      o_ << "      ls_http_client_slot *c = &loop->clients.slots[local];\n";
+      o_ << "      if (!c->active || !c->queued) continue;\n";
+      o_ << "      c->queued = 0;\n";
+      o_ << "      c->busy = 1;\n";
+      o_ << "      c->saved = c->in[c->req_len];\n";
+      o_ << "      c->in[c->req_len] = '\\0';\n";
+      o_ << "      c->view_ready = 0;\n";
+      o_ << "      return (loop->tag << LS_HTTP_ID_SHIFT) | local;\n";
+      o_ << "    }\n";
+      o_ << "    if (waited && wait_ms >= 0) return -1;\n";
+      o_ << "    if (ls_http_loop_wait(loop, wait_ms) < 0 && (wait_ms >= 0 || !ls_http_would_block())) return -1;\n";
+      o_ << "    waited = 1;\n";
+      o_ << "  }\n";
+      o_ << "}\n";
+      o_ << "/* Drops the current request from the front of the receive buffer, keeping pipelined bytes. */\n";
+      o_ << "static void ls_http_consume_request(ls_http_client_slot *c) {\n";
+      o_ << "  c->patch_count = 0;\n";
+      o_ << "  c->view_ready = 0;\n";
+      o_ << "  c->in[c->req_len] = c->saved;\n";
+      o_ << "  memmove(c->in, c->in + c->req_len, c->in_len - c->req_len);\n";
+      o_ << "  c->in_len -= c->req_len;\n";
+      o_ << "  c->head_len = 0;\n";
+      o_ << "  c->req_len = 0;\n";
+      o_ << "  c->in_scan = 0;\n";
+      o_ << "  c->busy = 0;\n";
+      o_ << "}\n";
+      o_ << "/* Sends head and body with one vectored call when nothing is queued ahead of them;\n";
+      o_ << "   whatever the socket does not take is copied into the output buffer. */\n";
+      o_ << "static void ls_http_ev_queue_pair(ls_http_client_slot *c, const char *a, size_t a_len, const char *b, size_t b_len) {\n";
+      o_ << "  if (!ls_http_out_pending(c)) {\n";
+      o_ << "    c->out_off = 0;\n";
+      o_ << "    c->out_len = 0;\n";
+      o_ << "    const int64_t sent = ls_http_send_vec(c->sock, a, a_len, b, b_len);\n";
+      o_ << "    if (sent < 0 && !ls_http_would_block()) {\n";
+      o_ << "      c->closing = 1;\n";
+      o_ << "      return;\n";
+      o_ << "    }\n";
+      o_ << "    if (sent > 0) ls_http_vec_advance(&a, &a_len, &b, &b_len, (size_t)sent);\n";
+      o_ << "  }\n";
+      o_ << "  if (a_len + b_len == 0) return;\n";
+      o_ << "  if (c->file_left > 0 || !ls_http_buf_reserve(&c->out, &c->out_cap, c->out_len + a_len + b_len)) {\n";
+      o_ << "    c->closing = 1;\n";
+      o_ << "    return;\n";
+      o_ << "  }\n";
+      o_ << "  memcpy(c->out + c->out_len, a, a_len);\n";
+      o_ << "  memcpy(c->out + c->out_len + a_len, b, b_len);\n";
+      o_ << "  c->out_len += a_len + b_len;\n";
+      o_ << "}\n";
+      o_ << "static void ls_http_ev_finish(ls_http_loop *loop, int64_t local, ls_http_client_slot *c) {\n";
+      o_ << "  ls_http_consume_request(c);\n";
+      o_ << "  if (!c->keep_alive) c->closing = 1;\n";
+      o_ << "  if (!ls_http_ev_flush(c)) {\n";
+      o_ << "    ls_http_ev_drop(loop, local, c);\n";
+      o_ << "    return;\n";
+      o_ << "  }\n";
+      o_ << "  ls_http_ev_rearm(loop, local, c);\n";
+      o_ << "}\n";
+      o_ << "static inline int ls_http_head_text(char *head, size_t cap, int64_t status, const char *type, uint64_t len, ls_bool keep_alive) {\n";
+      o_ << "  return (int)snprintf(head, cap,\n";
+      o_ << "      \"HTTP/1.1 %lld %s\\r\\n\"\n";
+      o_ << "      \"Content-Type: %s\\r\\n\"\n";
+      o_ << "      \"Content-Length: %llu\\r\\n\"\n";
+      o_ << "      \"Connection: %s\\r\\n\\r\\n\",\n";
+      o_ << "      (long long)status, ls_http_reason_text(status), type, (unsigned long long)len,\n";
+      o_ << "      keep_alive ? \"keep-alive\" : \"close\");\n";
+      o_ << "}\n";
+      o_ << "static const char *ls_http_mime_type(const char *path) {\n";
+      o_ << "  static const char *const table[][2] = {\n";
+      o_ << "      {\"html\", \"text/html; charset=utf-8\"}, {\"htm\", \"text/html; charset=utf-8\"},\n";
+      o_ << "      {\"css\", \"text/css; charset=utf-8\"}, {\"js\", \"text/javascript; charset=utf-8\"},\n";
+      o_ << "      {\"json\", \"application/json\"}, {\"txt\", \"text/plain; charset=utf-8\"},\n";
+      o_ << "      {\"svg\", \"image/svg+xml\"}, {\"png\", \"image/png\"}, {\"jpg\", \"image/jpeg\"},\n";
+      o_ << "      {\"jpeg\", \"image/jpeg\"}, {\"gif\", \"image/gif\"}, {\"ico\", \"image/x-icon\"},\n";
+      o_ << "      {\"wasm\", \"application/wasm\"},\n";
+      o_ << "  };\n";
+      o_ << "  const char *dot = strrchr(path, '.');\n";
+      o_ << "  if (dot && !strchr(dot, '/') && !strchr(dot, '\\\\')) {\n";
+      o_ << "    for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); ++i) {\n";
+      o_ << "      const char *ext = table[i][0];\n";
+      o_ << "      size_t k = 0;\n";
+      o_ << "      while (ext[k] && ls_http_lower_ascii((unsigned char)dot[1 + k]) == ext[k]) ++k;\n";
+      o_ << "      if (!ext[k] && !dot[1 + k]) return table[i][1];\n";
+      o_ << "    }\n";
       o_ << "  }\n";
-      o_ << "  ls_http_recv_heap[len] = '\\0';\n";
-      o_ << "  return ls_http_recv_heap;\n";
+      o_ << "  return \"application/octet-stream\";\n";
       o_ << "}\n";
-      o_ << "static inline const char *ls_http_reason_text(int64_t status) {\n";
-      o_ << "  switch (status) {\n";
-      o_ << "  case 200: return \"OK\";\n";
-      o_ << "  case 201: return \"Created\";\n";
-      o_ << "  case 204: return \"No Content\";\n";
-      o_ << "  case 400: return \"Bad Request\";\n";
-      o_ << "  case 401: return \"Unauthorized\";\n";
-      o_ << "  case 403: return \"Forbidden\";\n";
-      o_ << "  case 404: return \"Not Found\";\n";
-      o_ << "  case 409: return \"Conflict\";\n";
-      o_ << "  case 500: return \"Internal Server Error\";\n";
-      o_ << "  default: return \"OK\";\n";
+      o_ << "static FILE *ls_http_open_regular(const char *path, uint64_t *size) {\n";
+      o_ << "  FILE *fp = fopen(path, \"rb\");\n";
+      o_ << "  if (!fp) return NULL;\n";
+      o_ << "#if defined(_WIN32)\n";
+      o_ << "  if (_fseeki64(fp, 0, SEEK_END) != 0) {\n";
+      o_ << "    fclose(fp);\n";
+      o_ << "    return NULL;\n";
+      o_ << "  }\n";
+      o_ << "  const int64_t n = _ftelli64(fp);\n";
+      o_ << "  if (n < 0 || _fseeki64(fp, 0, SEEK_SET) != 0) {\n";
+      o_ << "    fclose(fp);\n";
+      o_ << "    return NULL;\n";
       o_ << "  }\n";
+      o_ << "  *size = (uint64_t)n;\n";
+      o_ << "#else\n";
+      o_ << "  struct stat st;\n";
+      o_ << "  if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode)) {\n";
+      o_ << "    fclose(fp);\n";
+      o_ << "    return NULL;\n";
+      o_ << "  }\n";
+      o_ << "  *size = (uint64_t)st.st_size;\n";
+      o_ << "#endif\n";
+      o_ << "  return fp;\n";
       o_ << "}\n";
-      o_ << "static inline int64_t http_server_listen(int64_t port) {\n";
-      o_ << "  if (port < 1 || port > 65535) return -1;\n";
-      o_ << "  if (!ls_http_init()) return -1;\n";
+      o_ << "static ls_http_socket ls_http_open_listener(int64_t port, ls_bool reuse_port) {\n";
       o_ << "  ls_http_socket s = socket(AF_INET, SOCK_STREAM, 0);\n";
-      o_ << "  if (ls_http_is_bad_socket(s)) return -1;\n";
+      o_ << "  if (ls_http_is_bad_socket(s)) return s;\n";
       o_ << "  int reuse = 1;\n";
       o_ << "#if defined(_WIN32)\n";
       o_ << "  (void)setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, (int)sizeof(reuse));\n";
+      o_ << "  (void)reuse_port;\n";
       o_ << "#else\n";
       o_ << "  (void)setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &reuse, (int)sizeof(reuse));\n";
+      o_ << "#if defined(SO_REUSEPORT)\n";
+      o_ << "  if (reuse_port) (void)setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &reuse, (int)sizeof(reuse));\n";
+      o_ << "#else\n";
+      o_ << "  (void)reuse_port;\n";
+      o_ << "#endif\n";
       o_ << "#endif\n";
       o_ << "  struct sockaddr_in addr;\n";
       o_ << "  memset(&addr, 0, sizeof(addr));\n";
       o_ << "  addr.sin_family = AF_INET;\n";
       o_ << "  addr.sin_addr.s_addr = htonl(INADDR_ANY);\n";
       o_ << "  addr.sin_port = htons((uint16_t)port);\n";
-      o_ << "  if (bind(s, (const struct sockaddr *)&addr, (int)sizeof(addr)) != 0) {\n";
+      o_ << "  if (bind(s, (const struct sockaddr *)&addr, (int)sizeof(addr)) != 0 || listen(s, 512) != 0) {\n";
       o_ << "    ls_http_close_socket(s);\n";
-      o_ << "    return -1;\n";
+      o_ << "    return ls_http_bad_socket();\n";
       o_ << "  }\n";
-      o_ << "  if (listen(s, 64) != 0) {\n";
+      o_ << "  return s;\n";
+      o_ << "}\n";
+      o_ << "static inline int64_t http_server_listen(int64_t port) {\n";
+      o_ << "  if (port < 1 || port > 65535) return -1;\n";
+      o_ << "  if (!ls_http_init()) return -1;\n";
+      o_ << "  ls_http_socket s = ls_http_open_listener(port, 0);\n";
+      o_ << "  if (ls_http_is_bad_socket(s)) return -1;\n";
+      o_ << "  const int64_t id = ls_http_alloc_server(s);\n";
+      o_ << "  if (id < 0) {\n";
       o_ << "    ls_http_close_socket(s);\n";
       o_ << "    return -1;\n";
       o_ << "  }\n";
+      o_ << "  return id;\n";
+      o_ << "}\n";
+      o_ << "static void ls_http_close_loops(ls_http_server_slot *srv) {\n";
+      o_ << "  if (!srv->loops) return;\n";
+      o_ << "  for (int64_t i = 0; i < srv->loop_count; ++i) ls_http_loop_destroy(&srv->loops[i]);\n";
+      o_ << "  free(srv->loops);\n";
+      o_ << "  srv->loops = NULL;\n";
+      o_ << "  srv->loop_count = 0;\n";
+      o_ << "}\n";
+      o_ << "/* Opens a server with one event loop per worker. On Linux every loop gets its own\n";
+      o_ << "   SO_REUSEPORT listener so the kernel spreads connections; elsewhere the loops share\n";
+      o_ << "   one listener and race on non-blocking accept. */\n";
+      o_ << "static inline int64_t http_server_listen_multi(int64_t port, int64_t workers) {\n";
+      o_ << "  if (port < 1 || port > 65535) return -1;\n";
+      o_ << "  if (!ls_http_init()) return -1;\n";
+      o_ << "  if (workers <= 0 || workers > task_worker_count()) workers = task_worker_count();\n";
+      o_ << "  if (workers < 1) workers = 1;\n";
+      o_ << "  if (workers > LS_HTTP_MAX_LOOPS) workers = LS_HTTP_MAX_LOOPS;\n";
+      o_ << "#if defined(__linux__) && defined(SO_REUSEPORT)\n";
+      o_ << "  const ls_bool per_loop = workers > 1 ? 1 : 0;\n";
+      o_ << "#else\n";
+      o_ << "  const ls_bool per_loop = 0;\n";
+      o_ << "#endif\n";
+      o_ << "  ls_http_socket s = ls_http_open_listener(port, per_loop);\n";
+      o_ << "  if (ls_http_is_bad_socket(s)) return -1;\n";
       o_ << "  const int64_t id = ls_http_alloc_server(s);\n";
       o_ << "  if (id < 0) {\n";
       o_ << "    ls_http_close_socket(s);\n";
       o_ << "    return -1;\n";
       o_ << "  }\n";
+      o_ << "  ls_http_server_slot *srv = &ls_http_servers[id];\n";
+      o_ << "  srv->pinned = 1;\n";
+      o_ << "  ls_bool ok = ls_http_loops_create(srv, id, workers);\n";
+      o_ << "  for (int64_t i = 1; ok && per_loop && i < workers; ++i) {\n";
+      o_ << "    ls_http_loop *loop = &srv->loops[i];\n";
+      o_ << "    loop->sock = ls_http_open_listener(port, 1);\n";
+      o_ << "    loop->owns_sock = ls_http_is_bad_socket(loop->sock) ? 0 : 1;\n";
+      o_ << "    if (!loop->owns_sock) ok = 0;\n";
+      o_ << "  }\n";
+      o_ << "  if (!ok) {\n";
+      o_ << "    ls_http_close_loops(srv);\n";
+      o_ << "    ls_http_close_socket(s);\n";
+      o_ << "    ls_http_free_server(id);\n";
+      o_ << "    return -1;\n";
+      o_ << "  }\n";
       o_ << "  return id;\n";
       o_ << "}\n";
       o_ << "static inline int64_t http_server_accept(int64_t server_id) {\n";
@@ -10076,34 +16093,110 @@ private:
       o_ << "static inline const char *http_server_read(int64_t client_id) {\n";
       o_ << "  ls_http_client_slot *c = ls_http_get_client(client_id);\n";
       o_ << "  if (!c) return \"\";\n";
+      o_ << "  if (c->evented || c->busy) {\n";
+      o_ << "    if (!c->busy) return \"\";\n";
+      o_ << "    ls_http_unpatch(c);\n";
+      o_ << "    return c->in;\n";
+      o_ << "  }\n";
       o_ << "  return ls_http_recv_once(c->sock);\n";
       o_ << "}\n";
+      o_ << "static inline const char *http_request_method(int64_t client_id) {\n";
+      o_ << "  ls_http_client_slot *c = ls_http_request_view(client_id);\n";
+      o_ << "  return (c && c->path_off) ? c->in : \"\";\n";
+      o_ << "}\n";
+      o_ << "static inline const char *http_request_path(int64_t client_id) {\n";
+      o_ << "  ls_http_client_slot *c = ls_http_request_view(client_id);\n";
+      o_ << "  return (c && c->path_off) ? c->in + c->path_off : \"\";\n";
+      o_ << "}\n";
+      o_ << "static inline const char *http_request_query(int64_t client_id) {\n";
+      o_ << "  ls_http_client_slot *c = ls_http_request_view(client_id);\n";
+      o_ << "  return (c && c->query_off) ? c->in + c->query_off : \"\";\n";
+      o_ << "}\n";
+      o_ << "static inline const char *http_request_header(int64_t client_id, const char *name) {\n";
+      o_ << "  ls_http_client_slot *c = ls_http_request_view(client_id);\n";
+      o_ << "  if (!c || !name) return \"\";\n";
+      o_ << "  size_t len = 0;\n";
+      o_ << "  const char *v = ls_http_header_value(c->in, c->head_len, name, &len);\n";
+      o_ << "  if (!v) return \"\";\n";
+      o_ << "  if (ls_http_patch(c, (size_t)(v - c->in) + len)) return v;\n";
+      o_ << "  char *copy = ls_scratch_take(len + 1);\n";
+      o_ << "  if (!copy) return \"\";\n";
+      o_ << "  memcpy(copy, v, len);\n";
+      o_ << "  copy[len] = '\\0';\n";
+      o_ << "  return copy;\n";
+      o_ << "}\n";
+      o_ << "static inline const char *http_request_body(int64_t client_id) {\n";
+      o_ << "  ls_http_client_slot *c = ls_http_request_view(client_id);\n";
+      o_ << "  return c ? c->in + c->head_len : \"\";\n";
+      o_ << "}\n";
       o_ << "static inline void http_server_respond_text(int64_t client_id, int64_t status, const char *body) {\n";
-      o_ << "  ls_http_client_slot *c = ls_http_get_client(client_id);\n";
+      o_ << "  ls_http_loop *loop = NULL;\n";
+      o_ << "  ls_http_client_slot *c = ls_http_find_client(client_id, &loop);\n";
       o_ << "  if (!c) return;\n";
       o_ << "  const char *msg = body ? body : \"\";\n";
-      o_ << "  const char *reason = ls_http_reason_text(status);\n";
       o_ << "  const size_t body_len = strlen(msg);\n";
       o_ << "  char head[256];\n";
-      o_ << "  const int head_len = (int)snprintf(head, sizeof(head),\n";
-      o_ << "      \"HTTP/1.1 %lld %s\\r\\n\"\n";
-      o_ << "      \"Content-Type: text/plain; charset=utf-8\\r\\n\"\n";
-      o_ << "      \"Content-Length: %llu\\r\\n\"\n";
-      o_ << "      \"Connection: close\\r\\n\\r\\n\",\n";
-      o_ << "      (long long)status, reason, (unsigned long long)body_len);\n";
+      o_ << "  const int head_len = ls_http_head_text(head, sizeof(head), status, \"text/plain; charset=utf-8\", body_len, loop ? c->keep_alive : 0);\n";
+      o_ << "  if (loop) {\n";
+      o_ << "    if (!c->busy) return;\n";
+      o_ << "    if (head_len <= 0) c->closing = 1;\n";
+      o_ << "    else ls_http_ev_queue_pair(c, head, (size_t)head_len, msg, body_len);\n";
+      o_ << "    ls_http_ev_finish(loop, client_id & ((1LL << LS_HTTP_ID_SHIFT) - 1), c);\n";
+      o_ << "    return;\n";
+      o_ << "  }\n";
+      o_ << "  if (c->busy) ls_http_consume_request(c);\n";
       o_ << "  if (head_len <= 0) return;\n";
-      o_ << "  if (!ls_http_send_all(c->sock, head, (size_t)head_len)) return;\n";
-      o_ << "  (void)ls_http_send_all(c->sock, msg, body_len);\n";
+      o_ << "  (void)ls_http_send_pair(c->sock, head, (size_t)head_len, msg, body_len);\n";
       o_ << "}\n";
+      o_ << "/* Streams a file as the response body (sendfile on Linux). Returns false when the\n";
+      o_ << "   path is not a readable regular file, leaving the request open for another response. */\n";
+      o_ << "static inline ls_bool http_server_respond_file(int64_t client_id, int64_t status, const char *path) {\n";
+      o_ << "  ls_http_loop *loop = NULL;\n";
+      o_ << "  ls_http_client_slot *c = ls_http_find_client(client_id, &loop);\n";
+      o_ << "  if (!c || !path || (loop && !c->busy)) return 0;\n";
+      o_ << "  uint64_t size = 0;\n";
+      o_ << "  FILE *fp = ls_http_open_regular(path, &size);\n";
+      o_ << "  if (!fp) return 0;\n";
+      o_ << "  char head[256];\n";
+      o_ << "  const int head_len = ls_http_head_text(head, sizeof(head), status, ls_http_mime_type(path), size, loop ? c->keep_alive : 0);\n";
+      o_ << "  if (head_len <= 0) {\n";
+      o_ << "    fclose(fp);\n";
+      o_ << "    return 0;\n";
+      o_ << "  }\n";
+      o_ << "  if (loop) {\n";
+      o_ << "    ls_http_ev_queue_pair(c, head, (size_t)head_len, \"\", 0);\n";
+      o_ << "    if (c->closing) {\n";
+      o_ << "      fclose(fp);\n";
+      o_ << "    } else {\n";
+      o_ << "      c->file = fp;\n";
+      o_ << "      c->file_off = 0;\n";
+      o_ << "      c->file_left = size;\n";
+      o_ << "      if (size == 0) ls_http_file_done(c);\n";
+      o_ << "    }\n";
+      o_ << "    ls_http_ev_finish(loop, client_id & ((1LL << LS_HTTP_ID_SHIFT) - 1), c);\n";
+      o_ << "    return 1;\n";
+      o_ << "  }\n";
+      o_ << "  if (c->busy) ls_http_consume_request(c);\n";
+      o_ << "  c->file = fp;\n";
+      o_ << "  c->file_off = 0;\n";
+      o_ << "  c->file_left = size;\n";
+      o_ << "  if (ls_http_send_all(c->sock, head, (size_t)head_len)) (void)ls_http_drain_blocking(c);\n";
+      o_ << "  ls_http_file_done(c);\n";
+      o_ << "  return 1;\n";
+      o_ << "}\n";
+      o_ << "static inline int64_t http_server_workers(int64_t server_id) {\n";
+      o_ << "  ls_http_server_slot *srv = ls_http_get_server(server_id);\n";
+      o_ << "  if (!srv) return 0;\n";
+      o_ << "  return srv->loop_count > 0 ? srv->loop_count : 1;\n";
+      o_ << "}\n";
+      o_ << "/* Closes every loop's clients and listeners; call it once the worker tasks have returned. */\n";
       o_ << "static inline void http_server_close(int64_t server_id) {\n";
       o_ << "  ls_http_server_slot *srv = ls_http_get_server(server_id);\n";
       o_ << "  if (!srv) return;\n";
+      o_ << "  ls_http_close_loops(srv);\n";
       o_ << "  ls_http_close_socket(srv->sock);\n";
       o_ << "  srv->sock = ls_http_bad_socket();\n";
-      o_ << "  srv->active = 0;\n";
-      o_ << "  if (server_id >= 0 && server_id < LS_HTTP_MAX_SERVERS && ls_http_server_free_top < LS_HTTP_MAX_SERVERS) {\n";
-      o_ << "    ls_http_server_free_ids[ls_http_server_free_top++] = server_id;\n";
-      o_ << "  }\n";
+      o_ << "  ls_http_free_server(server_id);\n";
       o_ << "}\n";
       o_ << "static inline int64_t http_client_connect(const char *host, int64_t port) {\n";
       o_ << "  if (port < 1 || port > 65535) return -1;\n";
@@ -10144,14 +16237,15 @@ private:
       o_ << "  return ls_http_recv_to_close(c->sock);\n";
       o_ << "}\n";
       o_ << "static inline void http_client_close(int64_t client_id) {\n";
-      o_ << "  ls_http_client_slot *c = ls_http_get_client(client_id);\n";
+      o_ << "  ls_http_loop *loop = NULL;\n";
+      o_ << "  ls_http_client_slot *c = ls_http_find_client(client_id, &loop);\n";
       o_ << "  if (!c) return;\n";
-      o_ << "  ls_http_close_socket(c->sock);\n";
-      o_ << "  c->sock = ls_http_bad_socket();\n";
-      o_ << "  c->active = 0;\n";
-      o_ << "  if (client_id >= 0 && client_id < LS_HTTP_MAX_CLIENTS && ls_http_client_free_top < LS_HTTP_MAX_CLIENTS) {\n";
-      o_ << "    ls_http_client_free_ids[ls_http_client_free_top++] = client_id;\n";
+      o_ << "  if (loop) {\n";
+      o_ << "    if (ls_http_out_pending(c) && ls_http_set_nonblocking(c->sock, 0)) (void)ls_http_drain_blocking(c);\n";
+      o_ << "    ls_http_ev_drop(loop, client_id & ((1LL << LS_HTTP_ID_SHIFT) - 1), c);\n";
+      o_ << "    return;\n";
       o_ << "  }\n";
+      o_ << "  ls_http_release_client(client_id);\n";
       o_ << "}\n";
     }
     o_ << "static inline int32_t to_i32(int64_t v) { return (int32_t)v; }\n";
@@ -10213,8 +16307,17 @@ private:
     o_ << "static inline ls_bool ls_str_eq(const char *a, const char *b) {\n";
     o_ << "  if (a == b) return 1;\n";
     o_ << "  if (!a || !b) return 0;\n";
+    o_ << "  const ls_str_hdr *ha = ls_str_header(a);\n";
+    o_ << "  const ls_str_hdr *hb = ha ? ls_str_header(b) : NULL;\n";
+    o_ << "  if (hb) return ha->len == hb->len && memcmp(a, b, ha->len) == 0;\n";
     o_ << "  return strcmp(a, b) == 0;\n";
     o_ << "}\n";
+    o_ << "static inline ls_bool ls_str_eq_lit(const char *a, const char *lit, size_t n) {\n";
+    o_ << "  if (!a) return 0;\n";
+    o_ << "  const ls_str_hdr *h = ls_str_header(a);\n";
+    o_ << "  if (h) return h->len == n && memcmp(a, lit, n) == 0;\n";
+    o_ << "  return strncmp(a, lit, n) == 0 && a[n] == '\\0';\n";
+    o_ << "}\n";
     o_ << "static inline ls_bool ls_str_neq(const char *a, const char *b) { return !ls_str_eq(a, b); }\n";
     o_ << "static inline int64_t max_i64(int64_t a, int64_t b) { return a > b ? a : b; }\n";
     o_ << "static inline int64_t min_i64(int64_t a, int64_t b) { return a < b ? a : b; }\n";
@@ -10269,14 +16372,15 @@ private:
     o_ << "  return b;\n";
     o_ << "}\n";
     o_ << "static inline const char *formatOutput_f64(double v) {\n";
-    o_ << "  static LS_THREAD_LOCAL char b[64];\n";
-    o_ << "  (void)snprintf(b, sizeof(b), \"%.17g\", v);\n";
+    o_ << "  static LS_THREAD_LOCAL char b[32];\n";
+    o_ << "  b[ls_f64_to_dec(v, b)] = '\\0';\n";
     o_ << "  return b;\n";
     o_ << "}\n";
     o_ << "static inline const char *formatOutput_bool(ls_bool v) { return v ? \"true\" : \"false\"; }\n";
     o_ << "static inline const char *formatOutput_str(const char *v) { return v ? v : \"\"; }\n";
     o_ << "static inline void ls_su_emit_debug(const char *msg) {\n";
     o_ << "  if (!msg) return;\n";
+    o_ << "  ls_out_flush();\n";
     o_ << "  FILE *out = ls_su_debug_to_stderr ? stderr : stdout;\n";
     o_ << "  fputs(msg, out);\n";
     o_ << "  fflush(out);\n";
@@ -10305,9 +16409,8 @@ private:
     o_ << "}\n";
     o_ << "static inline void ls_su_trace_stmt(const char *fn, int64_t line, const char *kind) {\n";
     o_ << "  if (!ls_su_enabled || !ls_su_trace) return;\n";
-    o_ << "  char *buf = ls_scratch_take(192);\n";
-    o_ << "  if (!buf) return;\n";
-    o_ << "  (void)snprintf(buf, 192, \"[trace] %s:%lld %s\\n\", fn ? fn : \"<fn>\", (long long)line, kind ? kind : \"stmt\");\n";
+    o_ << "  char buf[192];\n";
+    o_ << "  (void)snprintf(buf, sizeof(buf), \"[trace] %s:%lld %s\\n\", fn ? fn : \"<fn>\", (long long)line, kind ? kind : \"stmt\");\n";
     o_ << "  ls_su_emit_debug(buf);\n";
     o_ << "}\n";
     o_ << "static inline void ls_su_trace_on(void) {\n";
@@ -10349,9 +16452,8 @@ private:
     o_ << "}\n";
     o_ << "static inline void ls_su_debug_hook(const char *tag) {\n";
     o_ << "  if (!ls_su_enabled) { ls_su_emit_debug(\"[superuser] Not privileged\\n\"); return; }\n";
-    o_ << "  char *buf = ls_scratch_take(192);\n";
-    o_ << "  if (!buf) return;\n";
-    o_ << "  (void)snprintf(buf, 192, \"[superuser-hook] %s\\n\", tag ? tag : \"<null>\");\n";
+    o_ << "  char buf[192];\n";
+    o_ << "  (void)snprintf(buf, sizeof(buf), \"[superuser-hook] %s\\n\", tag ? tag : \"<null>\");\n";
     o_ << "  ls_su_emit_debug(buf);\n";
     o_ << "}\n";
     o_ << "static int64_t ls_task_worker_override = 0;\n";
@@ -10391,111 +16493,923 @@ private:
     o_ << "}\n";
     o_ << "static inline ls_bool task_hyperthreading_enabled(void) { return ls_task_use_hyperthreading ? 1 : 0; }\n";
     o_ << "typedef void (*ls_task_fn)(void);\n";
-    o_ << "#define LS_MAX_TASKS 1024\n";
+    o_ << "typedef union {\n";
+    o_ << "  int64_t i;\n";
+    o_ << "  double f;\n";
+    o_ << "  const char *s;\n";
+    o_ << "} ls_task_value;\n";
+    o_ << "typedef void (*ls_task_thunk)(ls_task_value *args, ls_task_value *result);\n";
+    o_ << "#define LS_MAX_TASKS 65536\n";
+    o_ << "#define LS_TASK_MAX_WORKERS 256\n";
+    o_ << "#define LS_TASK_DEQUE_CAP 4096\n";
+    o_ << "#define LS_TASK_INJECT_CAP 8192\n";
+    o_ << "#define LS_TASK_STATE_FREE 0\n";
+    o_ << "#define LS_TASK_STATE_PENDING 1\n";
+    o_ << "#define LS_TASK_STATE_DONE 2\n";
+    o_ << "#define LS_TASK_STATE_CLAIMED 3\n";
+    o_ << "#define LS_TASK_INLINE_ARGS 8\n";
     o_ << "typedef struct {\n";
-    o_ << "#if defined(_WIN32)\n";
-    o_ << "  HANDLE handle;\n";
-    o_ << "#else\n";
-    o_ << "  pthread_t handle;\n";
-    o_ << "#endif\n";
-    o_ << "  ls_bool active;\n";
+    o_ << "  ls_task_fn fn;\n";
+    o_ << "  ls_task_thunk thunk;\n";
+    o_ << "  ls_task_value args[LS_TASK_INLINE_ARGS];\n";
+    o_ << "  ls_task_value result;\n";
+    o_ << "  uint32_t arg_str_mask;\n";
+    o_ << "  ls_bool result_owned;\n";
+    o_ << "  ls_bool waits;\n";
+    o_ << "  volatile int64_t chan_blocked;\n";
+    o_ << "  volatile int64_t detached;\n";
+    o_ << "  volatile int64_t state;\n";
     o_ << "} ls_task_slot;\n";
-    o_ << "typedef struct { ls_task_fn fn; } ls_task_payload;\n";
+    o_ << "typedef struct {\n";
+    o_ << "  volatile int64_t top;\n";
+    o_ << "  volatile int64_t bottom;\n";
+    o_ << "  volatile int64_t items[LS_TASK_DEQUE_CAP];\n";
+    o_ << "} ls_task_deque;\n";
+    o_ << "typedef struct {\n";
+    o_ << "  volatile int64_t seq;\n";
+    o_ << "  int64_t id;\n";
+    o_ << "} ls_task_cell;\n";
     o_ << "static ls_task_slot ls_tasks[LS_MAX_TASKS];\n";
     o_ << "static int64_t ls_task_count = 0;\n";
     o_ << "static int64_t ls_task_free_ids[LS_MAX_TASKS];\n";
     o_ << "static int64_t ls_task_free_top = 0;\n";
-    o_ << "static int64_t ls_task_live_ids[LS_MAX_TASKS];\n";
-    o_ << "static int64_t ls_task_live_pos[LS_MAX_TASKS];\n";
-    o_ << "static int64_t ls_task_live_count = 0;\n";
+    o_ << "static volatile int64_t ls_task_slot_lock = 0;\n";
+    o_ << "static volatile int64_t ls_task_pending = 0;\n";
+    o_ << "static ls_task_deque *ls_task_deques[LS_TASK_MAX_WORKERS];\n";
+    o_ << "static volatile int64_t ls_task_pool_size = 0;\n";
+    o_ << "static volatile int64_t ls_task_pool_lock = 0;\n";
+    o_ << "static ls_task_cell ls_task_inject[LS_TASK_INJECT_CAP];\n";
+    o_ << "static volatile int64_t ls_task_inject_head = 0;\n";
+    o_ << "static volatile int64_t ls_task_inject_tail = 0;\n";
+    o_ << "static volatile int64_t ls_task_inject_ready = 0;\n";
+    o_ << "static LS_THREAD_LOCAL int64_t ls_task_self = -1;\n";
+    o_ << "/* Tasks that cannot finish until some other task does: every task a thread has suspended to run another one\n";
+    o_ << "   inline, plus tasks waiting in await_all. Each thread adds its own share (ls_task_stalled_here). */\n";
+    o_ << "static volatile int64_t ls_task_stalled = 0;\n";
+    o_ << "static LS_THREAD_LOCAL int64_t ls_task_depth = 0;\n";
+    o_ << "static LS_THREAD_LOCAL int64_t ls_task_stalled_here = 0;\n";
+    o_ << "static LS_THREAD_LOCAL int64_t ls_task_current = -1;\n";
+    o_ << "static volatile int64_t ls_task_blocked_workers = 0;\n";
+    o_ << "typedef struct {\n";
+    o_ << "  volatile int64_t epoch;\n";
+    o_ << "  volatile int64_t waiters;\n";
+    o_ << "#if defined(_WIN32)\n";
+    o_ << "  SRWLOCK lock;\n";
+    o_ << "  CONDITION_VARIABLE cv;\n";
+    o_ << "#else\n";
+    o_ << "  pthread_mutex_t lock;\n";
+    o_ << "  pthread_cond_t cv;\n";
+    o_ << "#endif\n";
+    o_ << "} ls_task_parker;\n";
+    o_ << "#if defined(_WIN32)\n";
+    o_ << "#define LS_TASK_PARKER_INIT {0, 0, SRWLOCK_INIT, CONDITION_VARIABLE_INIT}\n";
+    o_ << "#else\n";
+    o_ << "#define LS_TASK_PARKER_INIT {0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER}\n";
+    o_ << "#endif\n";
+    o_ << "static ls_task_parker ls_task_work_parker = LS_TASK_PARKER_INIT;\n";
+    o_ << "static ls_task_parker ls_task_done_parker = LS_TASK_PARKER_INIT;\n";
+    o_ << "/* Parking uses an epoch so a wake between the failed search and the wait is never lost. */\n";
+    o_ << "static inline void ls_task_wake(ls_task_parker *pk, ls_bool all) {\n";
+    o_ << "  (void)LS_ATOMIC_ADD(&pk->epoch, 1);\n";
+    o_ << "  if (LS_ATOMIC_LOAD(&pk->waiters) <= 0) return;\n";
+    o_ << "#if defined(_WIN32)\n";
+    o_ << "  AcquireSRWLockExclusive(&pk->lock);\n";
+    o_ << "  if (all) WakeAllConditionVariable(&pk->cv);\n";
+    o_ << "  else WakeConditionVariable(&pk->cv);\n";
+    o_ << "  ReleaseSRWLockExclusive(&pk->lock);\n";
+    o_ << "#else\n";
+    o_ << "  (void)pthread_mutex_lock(&pk->lock);\n";
+    o_ << "  if (all) (void)pthread_cond_broadcast(&pk->cv);\n";
+    o_ << "  else (void)pthread_cond_signal(&pk->cv);\n";
+    o_ << "  (void)pthread_mutex_unlock(&pk->lock);\n";
+    o_ << "#endif\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_task_park(ls_task_parker *pk, int64_t epoch) {\n";
+    o_ << "#if defined(_WIN32)\n";
+    o_ << "  AcquireSRWLockExclusive(&pk->lock);\n";
+    o_ << "  (void)LS_ATOMIC_ADD(&pk->waiters, 1);\n";
+    o_ << "  while (LS_ATOMIC_LOAD(&pk->epoch) == epoch) SleepConditionVariableSRW(&pk->cv, &pk->lock, INFINITE, 0);\n";
+    o_ << "  (void)LS_ATOMIC_ADD(&pk->waiters, -1);\n";
+    o_ << "  ReleaseSRWLockExclusive(&pk->lock);\n";
+    o_ << "#else\n";
+    o_ << "  (void)pthread_mutex_lock(&pk->lock);\n";
+    o_ << "  (void)LS_ATOMIC_ADD(&pk->waiters, 1);\n";
+    o_ << "  while (LS_ATOMIC_LOAD(&pk->epoch) == epoch) (void)pthread_cond_wait(&pk->cv, &pk->lock);\n";
+    o_ << "  (void)LS_ATOMIC_ADD(&pk->waiters, -1);\n";
+    o_ << "  (void)pthread_mutex_unlock(&pk->lock);\n";
+    o_ << "#endif\n";
+    o_ << "}\n";
     o_ << "static inline int64_t ls_task_alloc_id(void) {\n";
-    o_ << "  if (ls_task_free_top > 0) return ls_task_free_ids[--ls_task_free_top];\n";
-    o_ << "  if (ls_task_count >= LS_MAX_TASKS) return -1;\n";
-    o_ << "  return ls_task_count++;\n";
+    o_ << "  int64_t id = -1;\n";
+    o_ << "  ls_task_spin_lock(&ls_task_slot_lock);\n";
+    o_ << "  if (ls_task_free_top > 0) id = ls_task_free_ids[--ls_task_free_top];\n";
+    o_ << "  else if (ls_task_count < LS_MAX_TASKS) id = ls_task_count++;\n";
+    o_ << "  ls_task_spin_unlock(&ls_task_slot_lock);\n";
+    o_ << "  return id;\n";
     o_ << "}\n";
     o_ << "static inline void ls_task_release_id(int64_t id) {\n";
     o_ << "  if (id < 0 || id >= LS_MAX_TASKS) return;\n";
+    o_ << "  ls_task_spin_lock(&ls_task_slot_lock);\n";
     o_ << "  if (ls_task_free_top < LS_MAX_TASKS) ls_task_free_ids[ls_task_free_top++] = id;\n";
+    o_ << "  ls_task_spin_unlock(&ls_task_slot_lock);\n";
+    o_ << "}\n";
+    o_ << "/* Chase-Lev deque: the owning worker pushes/pops at the bottom, thieves take from the top. */\n";
+    o_ << "static inline ls_bool ls_task_deque_push(ls_task_deque *d, int64_t id) {\n";
+    o_ << "  const int64_t b = LS_ATOMIC_LOAD(&d->bottom);\n";
+    o_ << "  const int64_t t = LS_ATOMIC_LOAD(&d->top);\n";
+    o_ << "  if (b - t >= LS_TASK_DEQUE_CAP) return 0;\n";
+    o_ << "  LS_ATOMIC_STORE(&d->items[b & (LS_TASK_DEQUE_CAP - 1)], id);\n";
+    o_ << "  LS_ATOMIC_STORE(&d->bottom, b + 1);\n";
+    o_ << "  return 1;\n";
     o_ << "}\n";
-    o_ << "static inline void ls_task_mark_live(int64_t id) {\n";
-    o_ << "  if (id < 0 || id >= LS_MAX_TASKS) return;\n";
-    o_ << "  if (ls_task_live_count >= LS_MAX_TASKS) return;\n";
-    o_ << "  ls_task_live_pos[id] = ls_task_live_count;\n";
-    o_ << "  ls_task_live_ids[ls_task_live_count++] = id;\n";
+    o_ << "static inline int64_t ls_task_deque_pop(ls_task_deque *d) {\n";
+    o_ << "  const int64_t b = LS_ATOMIC_LOAD(&d->bottom) - 1;\n";
+    o_ << "  LS_ATOMIC_STORE(&d->bottom, b);\n";
+    o_ << "  LS_ATOMIC_FENCE();\n";
+    o_ << "  const int64_t t = LS_ATOMIC_LOAD(&d->top);\n";
+    o_ << "  if (t > b) {\n";
+    o_ << "    LS_ATOMIC_STORE(&d->bottom, b + 1);\n";
+    o_ << "    return -1;\n";
+    o_ << "  }\n";
+    o_ << "  int64_t id = LS_ATOMIC_LOAD(&d->items[b & (LS_TASK_DEQUE_CAP - 1)]);\n";
+    o_ << "  if (t == b) {\n";
+    o_ << "    if (!LS_ATOMIC_CAS(&d->top, t, t + 1)) id = -1;\n";
+    o_ << "    LS_ATOMIC_STORE(&d->bottom, b + 1);\n";
+    o_ << "  }\n";
+    o_ << "  return id;\n";
     o_ << "}\n";
-    o_ << "static inline void ls_task_mark_dead(int64_t id) {\n";
-    o_ << "  if (id < 0 || id >= LS_MAX_TASKS) return;\n";
-    o_ << "  const int64_t pos = ls_task_live_pos[id];\n";
-    o_ << "  if (pos < 0 || pos >= ls_task_live_count) return;\n";
-    o_ << "  const int64_t last = ls_task_live_ids[ls_task_live_count - 1];\n";
-    o_ << "  ls_task_live_ids[pos] = last;\n";
-    o_ << "  ls_task_live_pos[last] = pos;\n";
-    o_ << "  ls_task_live_pos[id] = -1;\n";
-    o_ << "  --ls_task_live_count;\n";
+    o_ << "static inline int64_t ls_task_deque_steal(ls_task_deque *d) {\n";
+    o_ << "  const int64_t t = LS_ATOMIC_LOAD(&d->top);\n";
+    o_ << "  LS_ATOMIC_FENCE();\n";
+    o_ << "  const int64_t b = LS_ATOMIC_LOAD(&d->bottom);\n";
+    o_ << "  if (t >= b) return -1;\n";
+    o_ << "  const int64_t id = LS_ATOMIC_LOAD(&d->items[t & (LS_TASK_DEQUE_CAP - 1)]);\n";
+    o_ << "  if (!LS_ATOMIC_CAS(&d->top, t, t + 1)) return -1;\n";
+    o_ << "  return id;\n";
+    o_ << "}\n";
+    o_ << "/* Bounded MPMC queue for spawns issued outside the pool (main thread, OpenMP threads). */\n";
+    o_ << "static inline ls_bool ls_task_inject_push(int64_t id) {\n";
+    o_ << "  int64_t pos = LS_ATOMIC_LOAD(&ls_task_inject_tail);\n";
+    o_ << "  for (;;) {\n";
+    o_ << "    ls_task_cell *cell = &ls_task_inject[pos & (LS_TASK_INJECT_CAP - 1)];\n";
+    o_ << "    const int64_t dif = LS_ATOMIC_LOAD(&cell->seq) - pos;\n";
+    o_ << "    if (dif == 0) {\n";
+    o_ << "      if (LS_ATOMIC_CAS(&ls_task_inject_tail, pos, pos + 1)) {\n";
+    o_ << "        cell->id = id;\n";
+    o_ << "        LS_ATOMIC_STORE(&cell->seq, pos + 1);\n";
+    o_ << "        return 1;\n";
+    o_ << "      }\n";
+    o_ << "      pos = LS_ATOMIC_LOAD(&ls_task_inject_tail);\n";
+    o_ << "    } else if (dif < 0) {\n";
+    o_ << "      return 0;\n";
+    o_ << "    } else {\n";
+    o_ << "      pos = LS_ATOMIC_LOAD(&ls_task_inject_tail);\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t ls_task_inject_pop(void) {\n";
+    o_ << "  int64_t pos = LS_ATOMIC_LOAD(&ls_task_inject_head);\n";
+    o_ << "  for (;;) {\n";
+    o_ << "    ls_task_cell *cell = &ls_task_inject[pos & (LS_TASK_INJECT_CAP - 1)];\n";
+    o_ << "    const int64_t dif = LS_ATOMIC_LOAD(&cell->seq) - (pos + 1);\n";
+    o_ << "    if (dif == 0) {\n";
+    o_ << "      if (LS_ATOMIC_CAS(&ls_task_inject_head, pos, pos + 1)) {\n";
+    o_ << "        const int64_t id = cell->id;\n";
+    o_ << "        LS_ATOMIC_STORE(&cell->seq, pos + LS_TASK_INJECT_CAP);\n";
+    o_ << "        return id;\n";
+    o_ << "      }\n";
+    o_ << "      pos = LS_ATOMIC_LOAD(&ls_task_inject_head);\n";
+    o_ << "    } else if (dif < 0) {\n";
+    o_ << "      return -1;\n";
+    o_ << "    } else {\n";
+    o_ << "      pos = LS_ATOMIC_LOAD(&ls_task_inject_head);\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_task_free_args(ls_task_slot *t) {\n";
+    o_ << "  for (int i = 0; t->arg_str_mask != 0u && i < LS_TASK_INLINE_ARGS; ++i) {\n";
+    o_ << "    if ((t->arg_str_mask & (1u << i)) && t->args[i].s) free((void *)t->args[i].s);\n";
+    o_ << "  }\n";
+    o_ << "  t->arg_str_mask = 0u;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_task_set_stalled(int64_t n) {\n";
+    o_ << "  if (n == ls_task_stalled_here) return;\n";
+    o_ << "  (void)LS_ATOMIC_ADD(&ls_task_stalled, n - ls_task_stalled_here);\n";
+    o_ << "  ls_task_stalled_here = n;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_task_unclaim(int64_t task_id) {\n";
+    o_ << "  ls_task_slot *t = &ls_tasks[task_id];\n";
+    o_ << "  if (t->result_owned && t->result.s) free((void *)t->result.s);\n";
+    o_ << "  t->result.i = 0;\n";
+    o_ << "  t->result_owned = 0;\n";
+    o_ << "  LS_ATOMIC_STORE(&t->state, LS_TASK_STATE_FREE);\n";
+    o_ << "  ls_task_release_id(task_id);\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_task_run(int64_t id) {\n";
+    o_ << "  ls_task_slot *t = &ls_tasks[id];\n";
+    o_ << "  const int64_t stalled = ls_task_stalled_here;\n";
+    o_ << "  const int64_t outer = ls_task_current;\n";
+    o_ << "  ls_task_set_stalled(ls_task_depth);\n";
+    o_ << "  ++ls_task_depth;\n";
+    o_ << "  ls_task_current = id;\n";
+    o_ << "  if (t->thunk) t->thunk(t->args, &t->result);\n";
+    o_ << "  else if (t->fn) t->fn();\n";
+    o_ << "  ls_task_current = outer;\n";
+    o_ << "  --ls_task_depth;\n";
+    o_ << "  ls_task_set_stalled(stalled);\n";
+    o_ << "  ls_task_free_args(t);\n";
+    o_ << "  LS_ATOMIC_STORE(&t->state, LS_TASK_STATE_DONE);\n";
+    o_ << "  if (LS_ATOMIC_LOAD(&t->detached) && LS_ATOMIC_CAS(&t->state, LS_TASK_STATE_DONE, LS_TASK_STATE_CLAIMED)) ls_task_unclaim(id);\n";
+    o_ << "  (void)LS_ATOMIC_ADD(&ls_task_pending, -1);\n";
+    o_ << "  ls_task_wake(&ls_task_done_parker, 1);\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t ls_task_find(int64_t self) {\n";
+    o_ << "  int64_t id = -1;\n";
+    o_ << "  if (self >= 0) {\n";
+    o_ << "    id = ls_task_deque_pop(ls_task_deques[self]);\n";
+    o_ << "    if (id >= 0) return id;\n";
+    o_ << "  }\n";
+    o_ << "  id = ls_task_inject_pop();\n";
+    o_ << "  if (id >= 0) return id;\n";
+    o_ << "  const int64_t n = LS_ATOMIC_LOAD(&ls_task_pool_size);\n";
+    o_ << "  const int64_t start = self >= 0 ? self + 1 : 0;\n";
+    o_ << "  for (int64_t i = 0; i < n; ++i) {\n";
+    o_ << "    const int64_t victim = (start + i) % n;\n";
+    o_ << "    if (victim == self) continue;\n";
+    o_ << "    id = ls_task_deque_steal(ls_task_deques[victim]);\n";
+    o_ << "    if (id >= 0) return id;\n";
+    o_ << "  }\n";
+    o_ << "  return -1;\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_task_worker_loop(int64_t self) {\n";
+    o_ << "  ls_task_self = self;\n";
+    o_ << "  for (;;) {\n";
+    o_ << "    const int64_t epoch = LS_ATOMIC_LOAD(&ls_task_work_parker.epoch);\n";
+    o_ << "    int64_t id = ls_task_find(self);\n";
+    o_ << "    for (int spin = 0; id < 0 && spin < 64; ++spin) {\n";
+    o_ << "      ls_task_cpu_yield();\n";
+    o_ << "      id = ls_task_find(self);\n";
+    o_ << "    }\n";
+    o_ << "    if (id >= 0) {\n";
+    o_ << "      ls_task_run(id);\n";
+    o_ << "      continue;\n";
+    o_ << "    }\n";
+    o_ << "    ls_task_park(&ls_task_work_parker, epoch);\n";
+    o_ << "  }\n";
     o_ << "}\n";
     o_ << "#if defined(_WIN32)\n";
     o_ << "static DWORD WINAPI ls_task_entry(LPVOID arg) {\n";
-    o_ << "  ls_task_payload *payload = (ls_task_payload *)arg;\n";
-    o_ << "  ls_task_fn fn = payload ? payload->fn : NULL;\n";
-    o_ << "  if (payload) free(payload);\n";
-    o_ << "  if (fn) fn();\n";
+    o_ << "  ls_task_worker_loop((int64_t)(intptr_t)arg);\n";
     o_ << "  return 0;\n";
     o_ << "}\n";
     o_ << "#else\n";
     o_ << "static void *ls_task_entry(void *arg) {\n";
-    o_ << "  ls_task_payload *payload = (ls_task_payload *)arg;\n";
-    o_ << "  ls_task_fn fn = payload ? payload->fn : NULL;\n";
-    o_ << "  if (payload) free(payload);\n";
-    o_ << "  if (fn) fn();\n";
+    o_ << "  ls_task_worker_loop((int64_t)(intptr_t)arg);\n";
     o_ << "  return NULL;\n";
     o_ << "}\n";
     o_ << "#endif\n";
-    o_ << "static inline int64_t ls_spawn(ls_task_fn fn) {\n";
+    o_ << "/* Starts pool workers up to `want`; the pool only grows, workers live until exit. */\n";
+    o_ << "static inline void ls_task_pool_grow(int64_t want) {\n";
+    o_ << "  if (want > LS_TASK_MAX_WORKERS) want = LS_TASK_MAX_WORKERS;\n";
+    o_ << "  if (LS_ATOMIC_LOAD(&ls_task_pool_size) >= want) return;\n";
+    o_ << "  ls_task_spin_lock(&ls_task_pool_lock);\n";
+    o_ << "  if (!LS_ATOMIC_LOAD(&ls_task_inject_ready)) {\n";
+    o_ << "    for (int64_t i = 0; i < LS_TASK_INJECT_CAP; ++i) ls_task_inject[i].seq = i;\n";
+    o_ << "    LS_ATOMIC_STORE(&ls_task_inject_ready, 1);\n";
+    o_ << "  }\n";
+    o_ << "  int64_t n = LS_ATOMIC_LOAD(&ls_task_pool_size);\n";
+    o_ << "  while (n < want) {\n";
+    o_ << "    ls_task_deque *d = (ls_task_deque *)calloc(1, sizeof(ls_task_deque));\n";
+    o_ << "    if (!d) break;\n";
+    o_ << "    ls_task_deques[n] = d;\n";
+    o_ << "#if defined(_WIN32)\n";
+    o_ << "    HANDLE handle = CreateThread(NULL, 0, ls_task_entry, (LPVOID)(intptr_t)n, 0, NULL);\n";
+    o_ << "    if (handle == NULL) {\n";
+    o_ << "      free(d);\n";
+    o_ << "      ls_task_deques[n] = NULL;\n";
+    o_ << "      break;\n";
+    o_ << "    }\n";
+    o_ << "    CloseHandle(handle);\n";
+    o_ << "#else\n";
+    o_ << "    pthread_t handle;\n";
+    o_ << "    if (pthread_create(&handle, NULL, ls_task_entry, (void *)(intptr_t)n) != 0) {\n";
+    o_ << "      free(d);\n";
+    o_ << "      ls_task_deques[n] = NULL;\n";
+    o_ << "      break;\n";
+    o_ << "    }\n";
+    o_ << "    (void)pthread_detach(handle);\n";
+    o_ << "#endif\n";
+    o_ << "    ++n;\n";
+    o_ << "    LS_ATOMIC_STORE(&ls_task_pool_size, n);\n";
+    o_ << "  }\n";
+    o_ << "  ls_task_spin_unlock(&ls_task_pool_lock);\n";
+    o_ << "}\n";
+    o_ << "static inline void ls_task_pool_ensure(void) {\n";
+    o_ << "  const int64_t want = task_worker_count();\n";
+    o_ << "  ls_task_pool_grow(want < 1 ? 1 : want);\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t ls_task_submit(int64_t id) {\n";
+    o_ << "  LS_ATOMIC_STORE(&ls_tasks[id].state, LS_TASK_STATE_PENDING);\n";
+    o_ << "  (void)LS_ATOMIC_ADD(&ls_task_pending, 1);\n";
+    o_ << "  const int64_t self = ls_task_self;\n";
+    o_ << "  ls_bool queued = 0;\n";
+    o_ << "  if (LS_ATOMIC_LOAD(&ls_task_pool_size) > 0) {\n";
+    o_ << "    queued = self >= 0 ? ls_task_deque_push(ls_task_deques[self], id) : ls_task_inject_push(id);\n";
+    o_ << "  }\n";
+    o_ << "  if (!queued) {\n";
+    o_ << "    ls_task_run(id);\n";
+    o_ << "    return id;\n";
+    o_ << "  }\n";
+    o_ << "  ls_task_wake(&ls_task_work_parker, 0);\n";
+    o_ << "  return id;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t ls_spawn(ls_task_fn fn, ls_bool waits) {\n";
     o_ << "  if (!fn) return -1;\n";
-    o_ << "  ls_task_payload *payload = (ls_task_payload *)malloc(sizeof(ls_task_payload));\n";
-    o_ << "  if (!payload) return -1;\n";
-    o_ << "  payload->fn = fn;\n";
+    o_ << "  ls_out_flush();\n";
+    o_ << "  ls_task_pool_ensure();\n";
     o_ << "  const int64_t id = ls_task_alloc_id();\n";
+    o_ << "  if (id < 0) return -1;\n";
+    o_ << "  ls_task_slot *t = &ls_tasks[id];\n";
+    o_ << "  t->fn = fn;\n";
+    o_ << "  t->thunk = NULL;\n";
+    o_ << "  t->arg_str_mask = 0u;\n";
+    o_ << "  t->result.i = 0;\n";
+    o_ << "  t->result_owned = 0;\n";
+    o_ << "  t->waits = waits;\n";
+    o_ << "  t->chan_blocked = 0;\n";
+    o_ << "  t->detached = 0;\n";
+    o_ << "  return ls_task_submit(id);\n";
+    o_ << "}\n";
+    o_ << "/* Arguments are copied into the slot; entries flagged in `str_mask` are heap copies owned by the task. */\n";
+    o_ << "static inline int64_t ls_spawn_thunk(ls_task_thunk thunk, const ls_task_value *args, int64_t argc, uint32_t str_mask,\n";
+    o_ << "                                     ls_bool result_owned, ls_bool waits) {\n";
+    o_ << "  ls_out_flush();\n";
+    o_ << "  int64_t id = -1;\n";
+    o_ << "  if (thunk && argc >= 0 && argc <= LS_TASK_INLINE_ARGS) {\n";
+    o_ << "    ls_task_pool_ensure();\n";
+    o_ << "    id = ls_task_alloc_id();\n";
+    o_ << "  }\n";
     o_ << "  if (id < 0) {\n";
-    o_ << "    free(payload);\n";
+    o_ << "    for (int64_t i = 0; args && i < argc && i < LS_TASK_INLINE_ARGS; ++i) {\n";
+    o_ << "      if ((str_mask & (1u << i)) && args[i].s) free((void *)args[i].s);\n";
+    o_ << "    }\n";
     o_ << "    return -1;\n";
     o_ << "  }\n";
-    o_ << "#if defined(_WIN32)\n";
-    o_ << "  HANDLE handle = CreateThread(NULL, 0, ls_task_entry, payload, 0, NULL);\n";
-    o_ << "  if (handle == NULL) {\n";
-    o_ << "    free(payload);\n";
-    o_ << "    ls_task_release_id(id);\n";
-    o_ << "    return -1;\n";
+    o_ << "  ls_task_slot *t = &ls_tasks[id];\n";
+    o_ << "  t->fn = NULL;\n";
+    o_ << "  t->thunk = thunk;\n";
+    o_ << "  if (args && argc > 0) memcpy(t->args, args, (size_t)argc * sizeof(ls_task_value));\n";
+    o_ << "  t->arg_str_mask = str_mask;\n";
+    o_ << "  t->result.i = 0;\n";
+    o_ << "  t->result_owned = result_owned ? 1 : 0;\n";
+    o_ << "  t->waits = waits;\n";
+    o_ << "  t->chan_blocked = 0;\n";
+    o_ << "  t->detached = 0;\n";
+    o_ << "  return ls_task_submit(id);\n";
+    o_ << "}\n";
+    o_ << "/* Parks a thread that waits on another task. Once channels exist tasks can wait on each other, so when every pool\n";
+    o_ << "   worker is parked one more worker is started for the queued tasks that can unblock them. */\n";
+    o_ << "static inline void ls_task_block(ls_task_parker *pk, int64_t epoch) {\n";
+    o_ << "  const ls_bool worker = ls_task_self >= 0 ? 1 : 0;\n";
+    o_ << "  const int64_t blocked = worker ? LS_ATOMIC_ADD(&ls_task_blocked_workers, 1) + 1 : LS_ATOMIC_LOAD(&ls_task_blocked_workers);\n";
+    o_ << "  const int64_t pool = LS_ATOMIC_LOAD(&ls_task_pool_size);\n";
+    o_ << "  if (pool > 0 && blocked >= pool && LS_ATOMIC_LOAD(&ls_task_pending) > 0) ls_task_pool_grow(pool + 1);\n";
+    o_ << "  ls_task_park(pk, epoch);\n";
+    o_ << "  if (worker) (void)LS_ATOMIC_ADD(&ls_task_blocked_workers, -1);\n";
+    o_ << "}\n";
+    o_ << "/* Waiting threads run queued work inline. A spawn flagged `waits` (it may block on a channel or another task) goes\n";
+    o_ << "   back to the shared queue for a pool worker instead: run on top of the waiter, it could wait for something only\n";
+    o_ << "   the suspended waiter would provide. A thread whose awaited task is blocked on a channel parks, which also\n";
+    o_ << "   lets the pool grow for the task that will unblock it. */\n";
+    o_ << "static inline void ls_task_help_once(int64_t task_id) {\n";
+    o_ << "  const int64_t epoch = LS_ATOMIC_LOAD(&ls_task_done_parker.epoch);\n";
+    o_ << "  if (task_id >= 0 ? LS_ATOMIC_LOAD(&ls_tasks[task_id].state) != LS_TASK_STATE_PENDING : LS_ATOMIC_LOAD(&ls_task_pending) <= 0) return;\n";
+    o_ << "  if (task_id >= 0 && LS_ATOMIC_LOAD(&ls_tasks[task_id].chan_blocked)) {\n";
+    o_ << "    ls_task_block(&ls_task_done_parker, epoch);\n";
+    o_ << "    return;\n";
     o_ << "  }\n";
-    o_ << "  ls_tasks[id].handle = handle;\n";
-    o_ << "#else\n";
-    o_ << "  if (pthread_create(&ls_tasks[id].handle, NULL, ls_task_entry, payload) != 0) {\n";
-    o_ << "    free(payload);\n";
-    o_ << "    ls_task_release_id(id);\n";
-    o_ << "    return -1;\n";
+    o_ << "  const int64_t id = ls_task_find(ls_task_self);\n";
+    o_ << "  if (id >= 0 && (!ls_tasks[id].waits || !ls_task_inject_push(id))) {\n";
+    o_ << "    ls_task_run(id);\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
+    o_ << "  if (id >= 0) {\n";
+    o_ << "    ls_task_wake(&ls_task_work_parker, 0);\n";
+    o_ << "    ls_task_block(&ls_task_done_parker, epoch);\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
+    o_ << "  ls_task_park(&ls_task_done_parker, epoch);\n";
+    o_ << "}\n";
+    o_ << "/* Runs queued work on the calling thread until `task_id` completes, then takes exclusive ownership of its slot. */\n";
+    o_ << "static inline ls_bool ls_task_claim(int64_t task_id) {\n";
+    o_ << "  if (task_id < 0 || task_id >= LS_MAX_TASKS) return 0;\n";
+    o_ << "  while (LS_ATOMIC_LOAD(&ls_tasks[task_id].state) == LS_TASK_STATE_PENDING) ls_task_help_once(task_id);\n";
+    o_ << "  return LS_ATOMIC_CAS(&ls_tasks[task_id].state, LS_TASK_STATE_DONE, LS_TASK_STATE_CLAIMED) ? 1 : 0;\n";
+    o_ << "}\n";
+    o_ << "/* A spawn whose handle is discarded frees its slot once it finishes, since nothing can claim it. Whichever of this\n";
+    o_ << "   and the finishing task sees the other's store first frees it. */\n";
+    o_ << "static inline void ls_task_detach(int64_t task_id) {\n";
+    o_ << "  if (task_id < 0 || task_id >= LS_MAX_TASKS) return;\n";
+    o_ << "  LS_ATOMIC_STORE(&ls_tasks[task_id].detached, 1);\n";
+    o_ << "  if (LS_ATOMIC_CAS(&ls_tasks[task_id].state, LS_TASK_STATE_DONE, LS_TASK_STATE_CLAIMED)) ls_task_unclaim(task_id);\n";
+    o_ << "}\n";
+    o_ << "static inline void await(int64_t task_id) {\n";
+    o_ << "  if (ls_task_claim(task_id)) ls_task_unclaim(task_id);\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t await_i64(int64_t task_id) {\n";
+    o_ << "  if (!ls_task_claim(task_id)) return 0;\n";
+    o_ << "  const int64_t v = ls_tasks[task_id].result.i;\n";
+    o_ << "  ls_task_unclaim(task_id);\n";
+    o_ << "  return v;\n";
+    o_ << "}\n";
+    o_ << "static inline double await_f64(int64_t task_id) {\n";
+    o_ << "  if (!ls_task_claim(task_id)) return 0.0;\n";
+    o_ << "  const double v = ls_tasks[task_id].result.f;\n";
+    o_ << "  ls_task_unclaim(task_id);\n";
+    o_ << "  return v;\n";
+    o_ << "}\n";
+    o_ << "static inline const char *await_str(int64_t task_id) {\n";
+    o_ << "  if (!ls_task_claim(task_id)) return \"\";\n";
+    o_ << "  const char *v = ls_scratch_dup(ls_tasks[task_id].result.s);\n";
+    o_ << "  ls_task_unclaim(task_id);\n";
+    o_ << "  return v;\n";
+    o_ << "}\n";
+    o_ << "/* Waits for completion only: a finished task's slot and result stay with its handle until it is awaited. Inside a\n";
+    o_ << "   task, await_all does not wait for its own task, for the tasks suspended beneath it, or for other tasks that are\n";
+    o_ << "   themselves in await_all: none of them can finish first. */\n";
+    o_ << "static inline void await_all(void) {\n";
+    o_ << "  if (ls_task_depth > 0) {\n";
+    o_ << "    const int64_t stalled = ls_task_stalled_here;\n";
+    o_ << "    ls_task_set_stalled(ls_task_depth);\n";
+    o_ << "    ls_task_wake(&ls_task_done_parker, 1);\n";
+    o_ << "    while (LS_ATOMIC_LOAD(&ls_task_pending) - LS_ATOMIC_LOAD(&ls_task_stalled) > 0) ls_task_help_once(-1);\n";
+    o_ << "    ls_task_set_stalled(stalled);\n";
+    o_ << "  } else {\n";
+    o_ << "    while (LS_ATOMIC_LOAD(&ls_task_pending) > 0) ls_task_help_once(-1);\n";
     o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "// Channels are bounded MPMC rings of i64 (Vyukov: one sequence number per cell, so a send or receive is one CAS\n";
+    o_ << "// on the fast path). A full or empty channel spins briefly, then parks on the channel's epoch parker.\n";
+    o_ << "#ifndef LS_MAX_CHANS\n";
+    o_ << "#define LS_MAX_CHANS 1024\n";
+    o_ << "#endif\n";
+    o_ << "#ifndef LS_MAX_ATOMICS\n";
+    o_ << "#define LS_MAX_ATOMICS 4096\n";
     o_ << "#endif\n";
-    o_ << "  ls_tasks[id].active = 1;\n";
-    o_ << "  ls_task_mark_live(id);\n";
+    o_ << "#define LS_CHAN_SPIN 64\n";
+    o_ << "typedef struct {\n";
+    o_ << "  volatile int64_t seq;\n";
+    o_ << "  int64_t value;\n";
+    o_ << "} ls_chan_cell;\n";
+    o_ << "typedef struct {\n";
+    o_ << "  volatile int64_t head;\n";
+    o_ << "  char pad_head[56];\n";
+    o_ << "  volatile int64_t tail;\n";
+    o_ << "  char pad_tail[56];\n";
+    o_ << "  ls_chan_cell *cells;\n";
+    o_ << "  int64_t mask;\n";
+    o_ << "  volatile int64_t closed;\n";
+    o_ << "  ls_task_parker not_empty;\n";
+    o_ << "  ls_task_parker not_full;\n";
+    o_ << "} ls_chan;\n";
+    o_ << "static ls_chan *volatile ls_chans[LS_MAX_CHANS];\n";
+    o_ << "static volatile int64_t ls_chan_lock = 0;\n";
+    o_ << "static LS_THREAD_LOCAL int64_t ls_chan_last = 0;\n";
+    o_ << "static inline ls_chan *ls_get_chan(int64_t id) {\n";
+    o_ << "  if (id < 0 || id >= LS_MAX_CHANS) return NULL;\n";
+    o_ << "  return ls_chans[id];\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t chan_new(int64_t capacity) {\n";
+    o_ << "  int64_t cap = 2;\n";
+    o_ << "  while (cap < capacity && cap < ((int64_t)1 << 40)) cap <<= 1;\n";
+    o_ << "  ls_chan *c = (ls_chan *)calloc(1, sizeof(ls_chan));\n";
+    o_ << "  ls_chan_cell *cells = c ? (ls_chan_cell *)calloc((size_t)cap, sizeof(ls_chan_cell)) : NULL;\n";
+    o_ << "  if (!cells) {\n";
+    o_ << "    free(c);\n";
+    o_ << "    return -1;\n";
+    o_ << "  }\n";
+    o_ << "  for (int64_t i = 0; i < cap; ++i) cells[i].seq = i;\n";
+    o_ << "  c->cells = cells;\n";
+    o_ << "  c->mask = cap - 1;\n";
+    o_ << "  const ls_task_parker init = LS_TASK_PARKER_INIT;\n";
+    o_ << "  c->not_empty = init;\n";
+    o_ << "  c->not_full = init;\n";
+    o_ << "  int64_t id = -1;\n";
+    o_ << "  ls_task_spin_lock(&ls_chan_lock);\n";
+    o_ << "  for (int64_t i = 0; i < LS_MAX_CHANS; ++i) {\n";
+    o_ << "    if (!ls_chans[i]) {\n";
+    o_ << "      id = i;\n";
+    o_ << "      break;\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "  if (id >= 0) {\n";
+    o_ << "    LS_ATOMIC_FENCE();\n";
+    o_ << "    ls_chans[id] = c;\n";
+    o_ << "  }\n";
+    o_ << "  ls_task_spin_unlock(&ls_chan_lock);\n";
+    o_ << "  if (id < 0) {\n";
+    o_ << "    free(cells);\n";
+    o_ << "    free(c);\n";
+    o_ << "  }\n";
     o_ << "  return id;\n";
     o_ << "}\n";
-    o_ << "static inline void await(int64_t task_id) {\n";
-    o_ << "  if (task_id < 0 || task_id >= LS_MAX_TASKS) return;\n";
-    o_ << "  if (!ls_tasks[task_id].active) return;\n";
-    o_ << "#if defined(_WIN32)\n";
-    o_ << "  WaitForSingleObject(ls_tasks[task_id].handle, INFINITE);\n";
-    o_ << "  CloseHandle(ls_tasks[task_id].handle);\n";
-    o_ << "#else\n";
-    o_ << "  (void)pthread_join(ls_tasks[task_id].handle, NULL);\n";
-    o_ << "#endif\n";
-    o_ << "  ls_task_mark_dead(task_id);\n";
-    o_ << "  ls_tasks[task_id].active = 0;\n";
-    o_ << "  ls_task_release_id(task_id);\n";
+    o_ << "static inline ls_bool ls_chan_push(ls_chan *c, int64_t v) {\n";
+    o_ << "  int64_t pos = LS_ATOMIC_LOAD(&c->tail);\n";
+    o_ << "  for (;;) {\n";
+    o_ << "    ls_chan_cell *cell = &c->cells[pos & c->mask];\n";
+    o_ << "    const int64_t dif = LS_ATOMIC_LOAD(&cell->seq) - pos;\n";
+    o_ << "    if (dif == 0) {\n";
+    o_ << "      if (LS_ATOMIC_CAS(&c->tail, pos, pos + 1)) {\n";
+    o_ << "        cell->value = v;\n";
+    o_ << "        LS_ATOMIC_STORE(&cell->seq, pos + 1);\n";
+    o_ << "        return 1;\n";
+    o_ << "      }\n";
+    o_ << "      pos = LS_ATOMIC_LOAD(&c->tail);\n";
+    o_ << "    } else if (dif < 0) {\n";
+    o_ << "      return 0;\n";
+    o_ << "    } else {\n";
+    o_ << "      pos = LS_ATOMIC_LOAD(&c->tail);\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool ls_chan_pop(ls_chan *c, int64_t *out) {\n";
+    o_ << "  int64_t pos = LS_ATOMIC_LOAD(&c->head);\n";
+    o_ << "  for (;;) {\n";
+    o_ << "    ls_chan_cell *cell = &c->cells[pos & c->mask];\n";
+    o_ << "    const int64_t dif = LS_ATOMIC_LOAD(&cell->seq) - (pos + 1);\n";
+    o_ << "    if (dif == 0) {\n";
+    o_ << "      if (LS_ATOMIC_CAS(&c->head, pos, pos + 1)) {\n";
+    o_ << "        *out = cell->value;\n";
+    o_ << "        LS_ATOMIC_STORE(&cell->seq, pos + c->mask + 1);\n";
+    o_ << "        return 1;\n";
+    o_ << "      }\n";
+    o_ << "      pos = LS_ATOMIC_LOAD(&c->head);\n";
+    o_ << "    } else if (dif < 0) {\n";
+    o_ << "      return 0;\n";
+    o_ << "    } else {\n";
+    o_ << "      pos = LS_ATOMIC_LOAD(&c->head);\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "/* One backoff step for a blocked send/receive: spin, then park until the channel's epoch moves. */\n";
+    o_ << "static inline void ls_chan_backoff(ls_task_parker *pk, int64_t epoch, int spin) {\n";
+    o_ << "  if (spin < LS_CHAN_SPIN) {\n";
+    o_ << "    ls_task_cpu_yield();\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
+    o_ << "  const int64_t self = ls_task_current;\n";
+    o_ << "  if (self >= 0) LS_ATOMIC_STORE(&ls_tasks[self].chan_blocked, 1);\n";
+    o_ << "  ls_task_block(pk, epoch);\n";
+    o_ << "  if (self >= 0) LS_ATOMIC_STORE(&ls_tasks[self].chan_blocked, 0);\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool chan_try_send(int64_t id, int64_t value) {\n";
+    o_ << "  ls_chan *c = ls_get_chan(id);\n";
+    o_ << "  if (!c || LS_ATOMIC_LOAD(&c->closed) || !ls_chan_push(c, value)) return 0;\n";
+    o_ << "  ls_task_wake(&c->not_empty, 0);\n";
+    o_ << "  return 1;\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool chan_send(int64_t id, int64_t value) {\n";
+    o_ << "  ls_chan *c = ls_get_chan(id);\n";
+    o_ << "  if (!c) return 0;\n";
+    o_ << "  for (int spin = 0;; ++spin) {\n";
+    o_ << "    const int64_t epoch = LS_ATOMIC_LOAD(&c->not_full.epoch);\n";
+    o_ << "    if (LS_ATOMIC_LOAD(&c->closed)) return 0;\n";
+    o_ << "    if (ls_chan_push(c, value)) {\n";
+    o_ << "      ls_task_wake(&c->not_empty, 0);\n";
+    o_ << "      return 1;\n";
+    o_ << "    }\n";
+    o_ << "    ls_chan_backoff(&c->not_full, epoch, spin);\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool chan_try_recv(int64_t id) {\n";
+    o_ << "  ls_chan *c = ls_get_chan(id);\n";
+    o_ << "  int64_t v = 0;\n";
+    o_ << "  if (!c || !ls_chan_pop(c, &v)) return 0;\n";
+    o_ << "  ls_chan_last = v;\n";
+    o_ << "  ls_task_wake(&c->not_full, 0);\n";
+    o_ << "  return 1;\n";
+    o_ << "}\n";
+    o_ << "/* Blocks until a value arrives (true) or the channel is closed and drained (false). */\n";
+    o_ << "static inline ls_bool chan_next(int64_t id) {\n";
+    o_ << "  ls_chan *c = ls_get_chan(id);\n";
+    o_ << "  if (!c) return 0;\n";
+    o_ << "  for (int spin = 0;; ++spin) {\n";
+    o_ << "    const int64_t epoch = LS_ATOMIC_LOAD(&c->not_empty.epoch);\n";
+    o_ << "    const ls_bool closed = LS_ATOMIC_LOAD(&c->closed) ? 1 : 0;\n";
+    o_ << "    int64_t v = 0;\n";
+    o_ << "    if (ls_chan_pop(c, &v)) {\n";
+    o_ << "      ls_chan_last = v;\n";
+    o_ << "      ls_task_wake(&c->not_full, 0);\n";
+    o_ << "      return 1;\n";
+    o_ << "    }\n";
+    o_ << "    if (closed) return 0;\n";
+    o_ << "    ls_chan_backoff(&c->not_empty, epoch, spin);\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t chan_recv(int64_t id) { return chan_next(id) ? ls_chan_last : 0; }\n";
+    o_ << "static inline int64_t chan_value(void) { return ls_chan_last; }\n";
+    o_ << "static inline void chan_close(int64_t id) {\n";
+    o_ << "  ls_chan *c = ls_get_chan(id);\n";
+    o_ << "  if (!c) return;\n";
+    o_ << "  LS_ATOMIC_STORE(&c->closed, 1);\n";
+    o_ << "  ls_task_wake(&c->not_empty, 1);\n";
+    o_ << "  ls_task_wake(&c->not_full, 1);\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool chan_closed(int64_t id) {\n";
+    o_ << "  ls_chan *c = ls_get_chan(id);\n";
+    o_ << "  return (!c || LS_ATOMIC_LOAD(&c->closed)) ? 1 : 0;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t chan_len(int64_t id) {\n";
+    o_ << "  ls_chan *c = ls_get_chan(id);\n";
+    o_ << "  if (!c) return 0;\n";
+    o_ << "  const int64_t n = LS_ATOMIC_LOAD(&c->tail) - LS_ATOMIC_LOAD(&c->head);\n";
+    o_ << "  return n < 0 ? 0 : (n > c->mask + 1 ? c->mask + 1 : n);\n";
+    o_ << "}\n";
+    o_ << "static inline void chan_free(int64_t id) {\n";
+    o_ << "  ls_task_spin_lock(&ls_chan_lock);\n";
+    o_ << "  ls_chan *c = ls_get_chan(id);\n";
+    o_ << "  if (c) ls_chans[id] = NULL;\n";
+    o_ << "  ls_task_spin_unlock(&ls_chan_lock);\n";
+    o_ << "  if (!c) return;\n";
+    o_ << "#if !defined(_WIN32)\n";
+    o_ << "  (void)pthread_mutex_destroy(&c->not_empty.lock);\n";
+    o_ << "  (void)pthread_cond_destroy(&c->not_empty.cv);\n";
+    o_ << "  (void)pthread_mutex_destroy(&c->not_full.lock);\n";
+    o_ << "  (void)pthread_cond_destroy(&c->not_full.cv);\n";
+    o_ << "#endif\n";
+    o_ << "  free(c->cells);\n";
+    o_ << "  free(c);\n";
+    o_ << "}\n";
+    o_ << "// Atomic cells are padded to a cache line each so counters bumped from different threads do not share a line.\n";
+    o_ << "typedef struct {\n";
+    o_ << "  volatile int64_t v;\n";
+    o_ << "  char pad[56];\n";
+    o_ << "} ls_atomic_cell;\n";
+    o_ << "static ls_atomic_cell ls_atomics[LS_MAX_ATOMICS];\n";
+    o_ << "static volatile int64_t ls_atomic_used[LS_MAX_ATOMICS];\n";
+    o_ << "static inline volatile int64_t *ls_get_atomic(int64_t id) {\n";
+    o_ << "  if (id < 0 || id >= LS_MAX_ATOMICS || !LS_ATOMIC_LOAD(&ls_atomic_used[id])) return NULL;\n";
+    o_ << "  return &ls_atomics[id].v;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t atomic_new(int64_t initial) {\n";
+    o_ << "  for (int64_t i = 0; i < LS_MAX_ATOMICS; ++i) {\n";
+    o_ << "    if (LS_ATOMIC_LOAD(&ls_atomic_used[i]) == 0 && LS_ATOMIC_CAS(&ls_atomic_used[i], 0, 1)) {\n";
+    o_ << "      LS_ATOMIC_STORE(&ls_atomics[i].v, initial);\n";
+    o_ << "      return i;\n";
+    o_ << "    }\n";
+    o_ << "  }\n";
+    o_ << "  return -1;\n";
+    o_ << "}\n";
+    o_ << "static inline void atomic_free(int64_t id) {\n";
+    o_ << "  if (ls_get_atomic(id)) LS_ATOMIC_STORE(&ls_atomic_used[id], 0);\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t atomic_get(int64_t id) {\n";
+    o_ << "  volatile int64_t *p = ls_get_atomic(id);\n";
+    o_ << "  return p ? LS_ATOMIC_LOAD(p) : 0;\n";
+    o_ << "}\n";
+    o_ << "static inline void atomic_set(int64_t id, int64_t value) {\n";
+    o_ << "  volatile int64_t *p = ls_get_atomic(id);\n";
+    o_ << "  if (p) LS_ATOMIC_STORE(p, value);\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t atomic_add(int64_t id, int64_t delta) {\n";
+    o_ << "  volatile int64_t *p = ls_get_atomic(id);\n";
+    o_ << "  return p ? LS_ATOMIC_ADD(p, delta) : 0;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t atomic_exchange(int64_t id, int64_t value) {\n";
+    o_ << "  volatile int64_t *p = ls_get_atomic(id);\n";
+    o_ << "  if (!p) return 0;\n";
+    o_ << "  int64_t old = LS_ATOMIC_LOAD(p);\n";
+    o_ << "  while (!LS_ATOMIC_CAS(p, old, value)) old = LS_ATOMIC_LOAD(p);\n";
+    o_ << "  return old;\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool atomic_cas(int64_t id, int64_t expected, int64_t desired) {\n";
+    o_ << "  volatile int64_t *p = ls_get_atomic(id);\n";
+    o_ << "  return (p && LS_ATOMIC_CAS(p, expected, desired)) ? 1 : 0;\n";
+    o_ << "}\n";
+    o_ << "// Range-parallel loops (np matrix kernels, phys_step) split their outer dimension into contiguous ranges on\n";
+    o_ << "// the task pool; the calling thread takes the first range and helps drain the queue while it waits.\n";
+    o_ << "#define LS_RANGE_MAX_CHUNKS 64\n";
+    o_ << "#define LS_RANGE_MIN_WORK ((int64_t)1 << 17)\n";
+    o_ << "static void ls_range_thunk(ls_task_value *a, ls_task_value *r) {\n";
+    o_ << "  (void)r;\n";
+    o_ << "  const ls_range_fn fn = (ls_range_fn)(intptr_t)a[0].i;\n";
+    o_ << "  fn((void *)(intptr_t)a[1].i, a[2].i, a[3].i);\n";
+    o_ << "}\n";
+    o_ << "/* `work` is the cost of one unit of [0, n); ranges smaller than LS_RANGE_MIN_WORK stay on this thread. */\n";
+    o_ << "static inline void ls_parallel_range(ls_range_fn fn, void *job, int64_t n, int64_t work) {\n";
+    o_ << "  if (n <= 0) return;\n";
+    o_ << "  int64_t chunks = task_worker_count();\n";
+    o_ << "  if (chunks > LS_RANGE_MAX_CHUNKS) chunks = LS_RANGE_MAX_CHUNKS;\n";
+    o_ << "  if (work < 1) work = 1;\n";
+    o_ << "  const int64_t byWork = n * work / LS_RANGE_MIN_WORK;\n";
+    o_ << "  if (chunks > byWork) chunks = byWork;\n";
+    o_ << "  if (chunks > n) chunks = n;\n";
+    o_ << "  if (chunks <= 1) {\n";
+    o_ << "    fn(job, 0, n);\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
+    o_ << "  const int64_t per = (n + chunks - 1) / chunks;\n";
+    o_ << "  int64_t ids[LS_RANGE_MAX_CHUNKS];\n";
+    o_ << "  for (int64_t c = 1; c < chunks; ++c) {\n";
+    o_ << "    const int64_t begin = c * per;\n";
+    o_ << "    const int64_t end = begin + per < n ? begin + per : n;\n";
+    o_ << "    ids[c] = -1;\n";
+    o_ << "    if (begin >= end) continue;\n";
+    o_ << "    ls_task_value args[4];\n";
+    o_ << "    args[0].i = (int64_t)(intptr_t)fn;\n";
+    o_ << "    args[1].i = (int64_t)(intptr_t)job;\n";
+    o_ << "    args[2].i = begin;\n";
+    o_ << "    args[3].i = end;\n";
+    o_ << "    ids[c] = ls_spawn_thunk(ls_range_thunk, args, 4, 0u, 0, 0);\n";
+    o_ << "    if (ids[c] < 0) fn(job, begin, end);\n";
+    o_ << "  }\n";
+    o_ << "  fn(job, 0, per);\n";
+    o_ << "  for (int64_t c = 1; c < chunks; ++c) {\n";
+    o_ << "    if (ids[c] >= 0) await(ids[c]);\n";
+    o_ << "  }\n";
+    o_ << "}\n";
+    o_ << "#define LS_NP_BLOCK_K 128\n";
+    o_ << "#define LS_NP_BLOCK_N 256\n";
+    o_ << "#define LS_NP_TILE 32\n";
+    static const char *const npKernelTypes[2][2] = {{"double", "f64"}, {"float", "f32"}};
+    for (const auto &kt : npKernelTypes) {
+      const std::string t = kt[0];
+      const std::string sfx = kt[1];
+      o_ << "typedef struct {\n";
+      o_ << "  const " << t << " *a;\n";
+      o_ << "  const " << t << " *b;\n";
+      o_ << "  " << t << " *c;\n";
+      o_ << "  int64_t m;\n";
+      o_ << "  int64_t k;\n";
+      o_ << "  int64_t n;\n";
+      o_ << "} ls_np_job_" << sfx << ";\n";
+      o_ << "/* Rows [r0, r1) of C = A * B, blocked over k and n so each B panel stays in cache across four rows of A. */\n";
+      o_ << "static void ls_np_matmul_rows_" << sfx << "(void *p, int64_t r0, int64_t r1) {\n";
+      o_ << "  const ls_np_job_" << sfx << " *j = (const ls_np_job_" << sfx << " *)p;\n";
+      o_ << "  const int64_t k = j->k;\n";
+      o_ << "  const int64_t n = j->n;\n";
+      o_ << "  memset(j->c + r0 * n, 0, (size_t)((r1 - r0) * n) * sizeof(" << t << "));\n";
+      o_ << "  for (int64_t jb = 0; jb < n; jb += LS_NP_BLOCK_N) {\n";
+      o_ << "    const int64_t je = jb + LS_NP_BLOCK_N < n ? jb + LS_NP_BLOCK_N : n;\n";
+      o_ << "    for (int64_t kb = 0; kb < k; kb += LS_NP_BLOCK_K) {\n";
+      o_ << "      const int64_t ke = kb + LS_NP_BLOCK_K < k ? kb + LS_NP_BLOCK_K : k;\n";
+      o_ << "      int64_t i = r0;\n";
+      o_ << "      for (; i + 4 <= r1; i += 4) {\n";
+      o_ << "        const " << t << " *a0 = j->a + i * k;\n";
+      o_ << "        " << t << " *c0 = j->c + i * n;\n";
+      o_ << "        " << t << " *c1 = c0 + n;\n";
+      o_ << "        " << t << " *c2 = c1 + n;\n";
+      o_ << "        " << t << " *c3 = c2 + n;\n";
+      o_ << "        for (int64_t q = kb; q < ke; ++q) {\n";
+      o_ << "          const " << t << " s0 = a0[q];\n";
+      o_ << "          const " << t << " s1 = a0[k + q];\n";
+      o_ << "          const " << t << " s2 = a0[2 * k + q];\n";
+      o_ << "          const " << t << " s3 = a0[3 * k + q];\n";
+      o_ << "          const " << t << " *bq = j->b + q * n;\n";
+      o_ << "          LS_OMP_SIMD\n";
+      o_ << "          LS_VEC_HINT\n";
+      o_ << "          for (int64_t x = jb; x < je; ++x) {\n";
+      o_ << "            const " << t << " bx = bq[x];\n";
+      o_ << "            c0[x] += s0 * bx;\n";
+      o_ << "            c1[x] += s1 * bx;\n";
+      o_ << "            c2[x] += s2 * bx;\n";
+      o_ << "            c3[x] += s3 * bx;\n";
+      o_ << "          }\n";
+      o_ << "        }\n";
+      o_ << "      }\n";
+      o_ << "      for (; i < r1; ++i) {\n";
+      o_ << "        const " << t << " *ai = j->a + i * k;\n";
+      o_ << "        " << t << " *ci = j->c + i * n;\n";
+      o_ << "        for (int64_t q = kb; q < ke; ++q) {\n";
+      o_ << "          const " << t << " s = ai[q];\n";
+      o_ << "          const " << t << " *bq = j->b + q * n;\n";
+      o_ << "          LS_OMP_SIMD\n";
+      o_ << "          LS_VEC_HINT\n";
+      o_ << "          for (int64_t x = jb; x < je; ++x) ci[x] += s * bq[x];\n";
+      o_ << "        }\n";
+      o_ << "      }\n";
+      o_ << "    }\n";
+      o_ << "  }\n";
+      o_ << "}\n";
+      o_ << "/* Row tiles [t0, t1) of an m x n matrix, copied tile by tile so both sides stay cache-resident. */\n";
+      o_ << "static void ls_np_transpose_tiles_" << sfx << "(void *p, int64_t t0, int64_t t1) {\n";
+      o_ << "  const ls_np_job_" << sfx << " *j = (const ls_np_job_" << sfx << " *)p;\n";
+      o_ << "  const int64_t m = j->m;\n";
+      o_ << "  const int64_t n = j->n;\n";
+      o_ << "  for (int64_t ib = t0 * LS_NP_TILE; ib < t1 * LS_NP_TILE && ib < m; ib += LS_NP_TILE) {\n";
+      o_ << "    const int64_t ie = ib + LS_NP_TILE < m ? ib + LS_NP_TILE : m;\n";
+      o_ << "    for (int64_t jb = 0; jb < n; jb += LS_NP_TILE) {\n";
+      o_ << "      const int64_t je = jb + LS_NP_TILE < n ? jb + LS_NP_TILE : n;\n";
+      o_ << "      for (int64_t i = ib; i < ie; ++i) {\n";
+      o_ << "        for (int64_t x = jb; x < je; ++x) j->c[x * m + i] = j->a[i * n + x];\n";
+      o_ << "      }\n";
+      o_ << "    }\n";
+      o_ << "  }\n";
+      o_ << "}\n";
+      o_ << "static void ls_np_row_sums_" << sfx << "(void *p, int64_t r0, int64_t r1) {\n";
+      o_ << "  const ls_np_job_" << sfx << " *j = (const ls_np_job_" << sfx << " *)p;\n";
+      o_ << "  const int64_t n = j->n;\n";
+      o_ << "  for (int64_t i = r0; i < r1; ++i) {\n";
+      o_ << "    const " << t << " *ai = j->a + i * n;\n";
+      o_ << "    double sum = 0.0;\n";
+      o_ << "    LS_OMP_SIMD_REDUCTION_PLUS(sum)\n";
+      o_ << "    LS_VEC_HINT\n";
+      o_ << "    for (int64_t x = 0; x < n; ++x) sum += (double)ai[x];\n";
+      o_ << "    j->c[i] = (" << t << ")sum;\n";
+      o_ << "  }\n";
+      o_ << "}\n";
+      o_ << "static void ls_np_col_sums_" << sfx << "(void *p, int64_t c0, int64_t c1) {\n";
+      o_ << "  const ls_np_job_" << sfx << " *j = (const ls_np_job_" << sfx << " *)p;\n";
+      o_ << "  const int64_t n = j->n;\n";
+      o_ << "  " << t << " *out = j->c;\n";
+      o_ << "  for (int64_t x = c0; x < c1; ++x) out[x] = 0;\n";
+      o_ << "  for (int64_t i = 0; i < j->m; ++i) {\n";
+      o_ << "    const " << t << " *ai = j->a + i * n;\n";
+      o_ << "    LS_OMP_SIMD\n";
+      o_ << "    LS_VEC_HINT\n";
+      o_ << "    for (int64_t x = c0; x < c1; ++x) out[x] += ai[x];\n";
+      o_ << "  }\n";
+      o_ << "}\n";
+    }
+    o_ << "static inline void ls_np_run_matrix(int op, const ls_np *a, const ls_np *b, ls_np *o) {\n";
+    o_ << "  if (o->len <= 0) return;\n";
+    o_ << "  if (a->len <= 0) {\n";
+    o_ << "    memset(ls_np_raw(o), 0, (size_t)o->len * ls_np_elem_size(o->kind));\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
+    o_ << "  const int64_t m = a->rows;\n";
+    o_ << "  const int64_t k = a->cols;\n";
+    o_ << "  const int64_t n = op == 0 ? b->cols : a->cols;\n";
+    o_ << "  if (a->kind == LS_ELEM_F32) {\n";
+    o_ << "    ls_np_job_f32 j = {a->data32, b ? b->data32 : NULL, o->data32, m, k, n};\n";
+    o_ << "    if (op == 0) ls_parallel_range(ls_np_matmul_rows_f32, &j, m, k * n);\n";
+    o_ << "    else if (op == 1) ls_parallel_range(ls_np_transpose_tiles_f32, &j, (m + LS_NP_TILE - 1) / LS_NP_TILE, LS_NP_TILE * n);\n";
+    o_ << "    else if (op == 2) ls_parallel_range(ls_np_col_sums_f32, &j, n, m);\n";
+    o_ << "    else ls_parallel_range(ls_np_row_sums_f32, &j, m, n);\n";
+    o_ << "    return;\n";
+    o_ << "  }\n";
+    o_ << "  ls_np_job_f64 j = {a->data, b ? b->data : NULL, o->data, m, k, n};\n";
+    o_ << "  if (op == 0) ls_parallel_range(ls_np_matmul_rows_f64, &j, m, k * n);\n";
+    o_ << "  else if (op == 1) ls_parallel_range(ls_np_transpose_tiles_f64, &j, (m + LS_NP_TILE - 1) / LS_NP_TILE, LS_NP_TILE * n);\n";
+    o_ << "  else if (op == 2) ls_parallel_range(ls_np_col_sums_f64, &j, n, m);\n";
+    o_ << "  else ls_parallel_range(ls_np_row_sums_f64, &j, m, n);\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool np_matmul_into(int64_t a_id, int64_t b_id, int64_t out_id) {\n";
+    o_ << "  ls_np *a = ls_get_np(a_id);\n";
+    o_ << "  ls_np *b = ls_get_np(b_id);\n";
+    o_ << "  ls_np *o = ls_get_np(out_id);\n";
+    o_ << "  if (!a || !b || !o || o == a || o == b || a->kind != b->kind || o->kind != a->kind) return 0;\n";
+    o_ << "  if (a->cols != b->rows || o->len != a->rows * b->cols) return 0;\n";
+    o_ << "  o->rows = a->rows;\n";
+    o_ << "  o->cols = b->cols;\n";
+    o_ << "  ls_np_run_matrix(0, a, b, o);\n";
+    o_ << "  return 1;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t np_matmul(int64_t a_id, int64_t b_id) {\n";
+    o_ << "  ls_np *a = ls_get_np(a_id);\n";
+    o_ << "  ls_np *b = ls_get_np(b_id);\n";
+    o_ << "  if (!a || !b || a->kind != b->kind || a->cols != b->rows) return -1;\n";
+    o_ << "  const int64_t out = ls_np_new_shaped(a->rows, b->cols, a->kind);\n";
+    o_ << "  if (out < 0) return -1;\n";
+    o_ << "  ls_np_run_matrix(0, a, b, ls_get_np(out));\n";
+    o_ << "  return out;\n";
+    o_ << "}\n";
+    o_ << "static inline ls_bool np_transpose_into(int64_t a_id, int64_t out_id) {\n";
+    o_ << "  ls_np *a = ls_get_np(a_id);\n";
+    o_ << "  ls_np *o = ls_get_np(out_id);\n";
+    o_ << "  if (!a || !o || o == a || o->kind != a->kind || o->len != a->len) return 0;\n";
+    o_ << "  o->rows = a->cols;\n";
+    o_ << "  o->cols = a->rows;\n";
+    o_ << "  ls_np_run_matrix(1, a, NULL, o);\n";
+    o_ << "  return 1;\n";
+    o_ << "}\n";
+    o_ << "static inline int64_t np_transpose(int64_t a_id) {\n";
+    o_ << "  ls_np *a = ls_get_np(a_id);\n";
+    o_ << "  if (!a) return -1;\n";
+    o_ << "  const int64_t out = ls_np_new_shaped(a->cols, a->rows, a->kind);\n";
+    o_ << "  if (out < 0) return -1;\n";
+    o_ << "  ls_np_run_matrix(1, a, NULL, ls_get_np(out));\n";
+    o_ << "  return out;\n";
+    o_ << "}\n";
+    o_ << "/* Axis 0 sums each column and axis 1 sums each row; either way the result is a 1-D vector. */\n";
+    o_ << "static inline ls_bool np_sum_axis_into(int64_t a_id, int64_t axis, int64_t out_id) {\n";
+    o_ << "  ls_np *a = ls_get_np(a_id);\n";
+    o_ << "  ls_np *o = ls_get_np(out_id);\n";
+    o_ << "  if (!a || !o || o == a || o->kind != a->kind || (axis != 0 && axis != 1)) return 0;\n";
+    o_ << "  const int64_t n = axis == 0 ? a->cols : a->rows;\n";
+    o_ << "  if (o->len != n) return 0;\n";
+    o_ << "  o->rows = 1;\n";
+    o_ << "  o->cols = n;\n";
+    o_ << "  ls_np_run_matrix(axis == 0 ? 2 : 3, a, NULL, o);\n";
+    o_ << "  return 1;\n";
     o_ << "}\n";
-    o_ << "static inline void await_all(void) {\n";
-    o_ << "  while (ls_task_live_count > 0) {\n";
-    o_ << "    await(ls_task_live_ids[ls_task_live_count - 1]);\n";
-    o_ << "  }\n";
+    o_ << "static inline int64_t np_sum_axis(int64_t a_id, int64_t axis) {\n";
+    o_ << "  ls_np *a = ls_get_np(a_id);\n";
+    o_ << "  if (!a || (axis != 0 && axis != 1)) return -1;\n";
+    o_ << "  const int64_t out = ls_np_new_shaped(1, axis == 0 ? a->cols : a->rows, a->kind);\n";
+    o_ << "  if (out < 0) return -1;\n";
+    o_ << "  ls_np_run_matrix(axis == 0 ? 2 : 3, a, NULL, ls_get_np(out));\n";
+    o_ << "  return out;\n";
     o_ << "}\n";
     o_ << "static inline int64_t ls_pow_i64(int64_t base, int64_t exp) {\n";
     o_ << "  if (exp < 0) return 0;\n";
@@ -10544,6 +17458,7 @@ private:
       if (!n.overrideFn.empty()) {
         return cFnName(n.overrideFn) + "(" + e(*n.x) + ")";
       }
+      if (x.typed && isVec(x.inf)) return "ls_" + typeName(x.inf) + "_neg(" + e(*n.x) + ")";
       return "(" + uop(n.op) + e(*n.x) + ")";
     }
     case EK::Binary: {
@@ -10551,9 +17466,26 @@ private:
       if (!n.overrideFn.empty()) {
         return cFnName(n.overrideFn) + "(" + e(*n.l) + ", " + e(*n.r) + ")";
       }
+      if (x.typed && isVec(x.inf)) {
+        const std::string vt = typeName(x.inf);
+        auto operand = [&](const Expr &side) {
+          if (side.typed && isVec(side.inf)) return e(side);
+          return vt + "_splat(" + e(side) + ")";
+        };
+        const char *op = n.op == BK::Add ? "add" : n.op == BK::Sub ? "sub" : n.op == BK::Mul ? "mul" : "div";
+        return "ls_" + vt + "_" + op + "(" + operand(*n.l) + ", " + operand(*n.r) + ")";
+      }
       if (n.op == BK::Pow) return "ls_pow(" + e(*n.l) + ", " + e(*n.r) + ")";
       if ((n.op == BK::Eq || n.op == BK::Neq) && n.l->typed && n.r->typed && n.l->inf == Type::Str &&
           n.r->inf == Type::Str) {
+        const Expr *lit = n.r->k == EK::Str ? n.r.get() : (n.l->k == EK::Str ? n.l.get() : nullptr);
+        const Expr *other = lit == n.r.get() ? n.l.get() : n.r.get();
+        if (lit && other->k != EK::Str && static_cast<const EString &>(*lit).v.find('\0') == std::string::npos) {
+          const std::string &text = static_cast<const EString &>(*lit).v;
+          const std::string call =
+              "ls_str_eq_lit(" + e(*other) + ", " + cStrLit(text) + ", " + std::to_string(text.size()) + "u)";
+          return n.op == BK::Eq ? call : "(!" + call + ")";
+        }
         if (n.op == BK::Eq) return "ls_str_eq(" + e(*n.l) + ", " + e(*n.r) + ")";
         return "ls_str_neq(" + e(*n.l) + ", " + e(*n.r) + ")";
       }
@@ -10610,6 +17542,12 @@ private:
         }
         return "ls_generic_min(" + e(*n.a[0]) + ", " + e(*n.a[1]) + ")";
       }
+      if (fnName == "black_box") {
+        if (n.a.size() != 1 || !x.typed) {
+          throw CompileError(x.s, "internal black_box emit error");
+        }
+        return std::string("ls_black_box_") + blackBoxSuffix(x.inf) + "(" + e(*n.a[0]) + ")";
+      }
       if (fnName == "abs") {
         if (n.a.size() != 1) {
           throw CompileError(x.s, "internal abs emit arity error");
@@ -10677,11 +17615,44 @@ private:
         return "ls_su_debug_hook(" + e(*n.a[0]) + ")";
       }
       if (fnName == "spawn") {
-        if (n.a.size() != 1 || n.a[0]->k != EK::Call) {
+        if (n.a.empty() || n.a.size() > 2 || n.a[0]->k != EK::Call) {
           throw CompileError(x.s, "internal spawn emit error");
         }
         auto &target = static_cast<const ECall &>(*n.a[0]);
-        return "ls_spawn(" + cFnName(canonicalSuperuserCallName(target.f)) + ")";
+        const std::string layout = spawnLayout(n);
+        const char *waits = waitingFns_.count(canonicalSuperuserCallName(target.f)) ? "1" : "0";
+        if (layout == "v:") return "ls_spawn(" + cFnName(canonicalSuperuserCallName(target.f)) + ", " + waits + ")";
+        if (layout.size() != target.a.size() + 2) throw CompileError(x.s, "internal spawn layout error");
+        std::ostringstream args;
+        uint32_t strMask = 0;
+        if (target.a.empty()) {
+          args << "NULL";
+        } else {
+          args << "(ls_task_value[" << target.a.size() << "]){";
+          for (std::size_t i = 0; i < target.a.size(); ++i) {
+            if (i) args << ", ";
+            const char code = layout[i + 2];
+            if (code == 's') {
+              strMask |= (1u << i);
+              args << "{.s = ls_heap_dup(" << e(*target.a[i]) << ")}";
+            } else if (code == 'f' || code == 'g') {
+              args << "{.f = (double)(" << e(*target.a[i]) << ")}";
+            } else {
+              args << "{.i = (int64_t)(" << e(*target.a[i]) << ")}";
+            }
+          }
+          args << "}";
+        }
+        return "ls_spawn_thunk(" + spawnThunkName(target, layout) + ", " + args.str() + ", " +
+               std::to_string(target.a.size()) + ", " + std::to_string(strMask) + "u, " +
+               (layout[0] == 's' ? "1" : "0") + ", " + waits + ")";
+      }
+      if (npFusionEnabled()) {
+        if (const char kind = npFuseKind(n)) return npFusedCall(n, kind);
+      }
+      if ((fnName == "await_i64" || fnName == "await_f64") && n.a.size() == 1 && x.typed &&
+          (x.inf == Type::Bool || x.inf == Type::I32 || x.inf == Type::F32)) {
+        return "((" + cType(x.inf) + ")" + fnName + "(" + e(*n.a[0]) + "))";
       }
       if (ultraMinimalRuntime_ && (fnName == "print_str" || fnName == "println_str") && n.a.size() == 1 &&
           n.a[0]->k == EK::Str) {
@@ -10716,6 +17687,163 @@ private:
     o_ << ")";
   }
 
+  static std::string spawnLayout(const ECall &spawnCall) {
+    if (spawnCall.a.size() == 2 && spawnCall.a[1]->k == EK::Str) return static_cast<const EString &>(*spawnCall.a[1]).v;
+    return "v:";
+  }
+  std::string spawnThunkName(const ECall &target, const std::string &layout) const {
+    std::string name = "ls_task_thunk_" + cFnName(canonicalSuperuserCallName(target.f)) + "_";
+    for (char ch : layout) name.push_back(ch == ':' ? '_' : ch);
+    return name;
+  }
+  bool npFusionEnabled() const { return !minimalRuntime_ && !ultraMinimalRuntime_; }
+  static std::string npKernelName(char kind, const std::string &shape) {
+    switch (kind) {
+    case 's': return "ls_np_fuse_sum_" + shape;
+    case 'm': return "ls_np_fuse_mean_" + shape;
+    case 'g': return "ls_np_fuse_get_" + shape;
+    default: return "ls_np_fuse_" + shape;
+    }
+  }
+  static std::string npKernelBody(const std::string &shape, std::size_t &at, std::size_t &leaf) {
+    const char op = shape[at++];
+    if (op == 'x') return "x" + std::to_string(leaf++) + "[i]";
+    const std::string l = npKernelBody(shape, at, leaf);
+    const std::string r = npKernelBody(shape, at, leaf);
+    if (op == 'd') return "ls_np_div_safe(" + l + ", " + r + ")";
+    return "(" + l + (op == 'a' ? " + " : (op == 's' ? " - " : " * ")) + r + ")";
+  }
+  // Pairwise ls_np_binary chain for operands the fused loop cannot bind (e.g. f32 vectors), freeing each
+  // intermediate as soon as it is consumed, so the result matches the unfused calls.
+  static std::string npKernelFallback(const std::string &shape, std::size_t &at, std::size_t &leaf, std::size_t &tmp,
+                                      std::ostringstream &o) {
+    const char op = shape[at++];
+    if (op == 'x') return "h" + std::to_string(leaf++);
+    const std::string l = npKernelFallback(shape, at, leaf, tmp, o);
+    const std::string r = npKernelFallback(shape, at, leaf, tmp, o);
+    const std::string t = "t" + std::to_string(tmp++);
+    const int code = op == 'a' ? 0 : (op == 's' ? 1 : (op == 'm' ? 2 : 3));
+    o << "    const int64_t " << t << " = ls_np_binary(" << l << ", " << r << ", " << code << ");\n";
+    if (l[0] == 't') o << "    np_free(" << l << ");\n";
+    if (r[0] == 't') o << "    np_free(" << r << ");\n";
+    return t;
+  }
+  std::string npFusedCall(const ECall &n, char kind) const {
+    std::string shape;
+    std::vector<const Expr *> leaves;
+    npFuseShape(kind == 'v' ? static_cast<const Expr &>(n) : *n.a[0], shape, leaves);
+    std::string out = npKernelName(kind, shape) + "(";
+    for (std::size_t i = 0; i < leaves.size(); ++i) {
+      if (i) out += ", ";
+      out += e(*leaves[i]);
+    }
+    if (kind == 'g') out += ", " + e(*n.a[1]);
+    return out + ")";
+  }
+  // One kernel per (flavour, shape): operands are bound once and the whole tree is evaluated in a
+  // single SIMD loop, so chained np arithmetic makes one pass and no intermediate vectors.
+  void emitNpKernels() {
+    if (!npFusionEnabled()) return;
+    std::vector<const ECall *> roots;
+    for (const Fn &f : p_.f) {
+      if (!f.ex) collectNpFusionsBlock(f.b, roots);
+    }
+    std::unordered_set<std::string> emitted;
+    for (const ECall *root : roots) {
+      const char kind = npFuseKind(*root);
+      std::string shape;
+      std::vector<const Expr *> leaves;
+      npFuseShape(kind == 'v' ? static_cast<const Expr &>(*root) : *root->a[0], shape, leaves);
+      const std::string name = npKernelName(kind, shape);
+      if (!emitted.insert(name).second) continue;
+      std::size_t at = 0, leaf = 0;
+      const std::string body = npKernelBody(shape, at, leaf);
+      o_ << "static " << (kind == 'v' ? "int64_t " : "double ") << name << "(";
+      for (std::size_t i = 0; i < leaves.size(); ++i) o_ << (i ? ", " : "") << "int64_t h" << i;
+      if (kind == 'g') o_ << ", int64_t idx";
+      o_ << ") {\n";
+      o_ << "  int64_t n = -1;\n";
+      for (std::size_t i = 0; i < leaves.size(); ++i) o_ << "  const double *x" << i << " = NULL;\n";
+      o_ << "  if (";
+      for (std::size_t i = 0; i < leaves.size(); ++i)
+        o_ << (i ? " || " : "") << "!ls_np_operand(h" << i << ", &x" << i << ", &n)";
+      o_ << ") {\n";
+      std::size_t fallbackAt = 0, fallbackLeaf = 0, fallbackTmp = 0;
+      std::ostringstream fallback;
+      const std::string res = npKernelFallback(shape, fallbackAt, fallbackLeaf, fallbackTmp, fallback);
+      o_ << fallback.str();
+      if (kind == 'v') {
+        o_ << "    return " << res << ";\n";
+      } else {
+        const char *reduce = kind == 's' ? "np_sum(" : (kind == 'm' ? "np_mean(" : "np_get(");
+        o_ << "    const double v = " << reduce << res << (kind == 'g' ? ", idx" : "") << ");\n";
+        o_ << "    np_free(" << res << ");\n";
+        o_ << "    return v;\n";
+      }
+      o_ << "  }\n";
+      if (kind == 'v') {
+        o_ << "  const int64_t out = np_new(n);\n";
+        o_ << "  ls_np *o = ls_get_np(out);\n";
+        o_ << "  if (out < 0 || !o || !o->data) return -1;\n";
+        o_ << "  double *r = o->data;\n";
+        o_ << "  LS_OMP_SIMD\n";
+        o_ << "  LS_VEC_HINT\n";
+        o_ << "  for (int64_t i = 0; i < n; ++i) r[i] = " << body << ";\n";
+        o_ << "  return out;\n";
+      } else if (kind == 'g') {
+        o_ << "  if (idx < 0 || idx >= n) return 0.0;\n";
+        o_ << "  const int64_t i = idx;\n";
+        o_ << "  return " << body << ";\n";
+      } else {
+        o_ << "  double sum = 0.0;\n";
+        o_ << "  LS_OMP_SIMD_REDUCTION_PLUS(sum)\n";
+        o_ << "  LS_VEC_HINT\n";
+        o_ << "  for (int64_t i = 0; i < n; ++i) sum += " << body << ";\n";
+        o_ << (kind == 'm' ? "  return n > 0 ? sum / (double)n : 0.0;\n" : "  return sum;\n");
+      }
+      o_ << "}\n";
+    }
+    if (!emitted.empty()) o_ << '\n';
+  }
+  // One trampoline per (target, layout): unpacks captured args and stores the result inline in the task slot.
+  void emitTaskThunks() {
+    std::vector<const ECall *> spawns;
+    collectSpawnCallsProgram(p_, spawns);
+    std::unordered_set<std::string> emitted;
+    for (const ECall *sp : spawns) {
+      const std::string layout = spawnLayout(*sp);
+      if (layout == "v:" || layout.size() < 2 || sp->a.empty() || sp->a[0]->k != EK::Call) continue;
+      const auto &target = static_cast<const ECall &>(*sp->a[0]);
+      const std::string name = spawnThunkName(target, layout);
+      if (!emitted.insert(name).second) continue;
+      std::ostringstream call;
+      call << cFnName(canonicalSuperuserCallName(target.f)) << "(";
+      for (std::size_t i = 2; i < layout.size(); ++i) {
+        if (i > 2) call << ", ";
+        const std::string slot = "a[" + std::to_string(i - 2) + "]";
+        switch (layout[i]) {
+        case 'n': call << "(int32_t)" << slot << ".i"; break;
+        case 'b': call << "(ls_bool)" << slot << ".i"; break;
+        case 'g': call << "(float)" << slot << ".f"; break;
+        case 'f': call << slot << ".f"; break;
+        case 's': call << slot << ".s"; break;
+        default: call << slot << ".i"; break;
+        }
+      }
+      call << ")";
+      o_ << "static void " << name << "(ls_task_value *a, ls_task_value *r) {\n";
+      if (layout.size() == 2) o_ << "  (void)a;\n";
+      switch (layout[0]) {
+      case 'v': o_ << "  (void)r;\n  " << call.str() << ";\n"; break;
+      case 'f':
+      case 'g': o_ << "  r->f = (double)" << call.str() << ";\n"; break;
+      case 's': o_ << "  r->s = ls_heap_dup(" << call.str() << ");\n"; break;
+      default: o_ << "  r->i = (int64_t)" << call.str() << ";\n"; break;
+      }
+      o_ << "}\n";
+    }
+    if (!emitted.empty()) o_ << '\n';
+  }
   void proto(const Fn &f) {
     if (f.ex) {
       o_ << "extern ";
@@ -10733,7 +17861,30 @@ private:
     o_ << ";\n";
   }
 
+  static std::string parForThreshold(const SFor &n) {
+    return n.minIters >= 0 ? std::to_string(n.minIters) + "LL" : "LS_PAR_MIN_ITERS";
+  }
+  static std::string parForPragma(const SFor &n, const std::string &itersName) {
+    const std::string threshold = parForThreshold(n);
+    if (n.reductions.empty() && n.schedule.empty() && n.grain == 0) {
+      return "LS_PAR_FOR_IF(" + itersName + " >= " + threshold + ")";
+    }
+    std::string out = "LS_PAR_FOR_CLAUSES(schedule(" + (n.schedule.empty() ? std::string("static") : n.schedule);
+    if (n.grain > 0) out += ", " + std::to_string(n.grain);
+    out += ")";
+    for (const ParReduction &r : n.reductions) {
+      const std::string op = r.op == "and" ? "&&" : (r.op == "or" ? "||" : r.op);
+      out += " reduction(" + op + ":" + r.var + ")";
+    }
+    out += " if(" + itersName + " >= " + threshold + "))";
+    return out;
+  }
+
   void stmt(const Stmt &s, int k) {
+    if (profFrame_ && parallelBodyDepth_ == 0 && profLineMarker(s)) {
+      ind(o_, k);
+      o_ << "__ls_prof_frame.line = " << static_cast<unsigned long long>(s.s.line) << ";\n";
+    }
     if (superuserMode_) {
       ind(o_, k);
       o_ << "ls_su_guard_step();\n";
@@ -10760,6 +17911,7 @@ private:
         o_ << e(*n.v);
       }
       o_ << ";\n";
+      if (n.inf == Type::Str && !cleanupScopes_.empty()) cleanupScopes_.back().strVars.push_back(n.n);
       if (n.isOwned && !n.ownedFreeFn.empty()) {
         registerOwned(n.n, n.ownedFreeFn);
       }
@@ -10770,7 +17922,13 @@ private:
       ind(o_, k);
       o_ << n.n << " = ";
       if (n.v->typed && n.v->inf == Type::Str) {
-        o_ << "ls_str_hold(" << e(*n.v) << ")";
+        const std::optional<std::string> varRegion = strVarRegion(n.n);
+        if (varRegion && *varRegion == innermostRegion(cleanupScopes_.size())) {
+          o_ << "ls_str_hold(" << e(*n.v) << ")";
+        } else {
+          o_ << "ls_str_hold_in(" << (varRegion && !varRegion->empty() ? "&" + *varRegion : "NULL") << ", " << e(*n.v)
+             << ")";
+        }
       } else {
         o_ << e(*n.v);
       }
@@ -10778,20 +17936,42 @@ private:
       return;
     }
     case SK::Expr: {
+      const Expr &x = *static_cast<const SExpr &>(s).e;
       ind(o_, k);
-      o_ << e(*static_cast<const SExpr &>(s).e) << ";\n";
+      if (x.k == EK::Call && canonicalSuperuserCallName(static_cast<const ECall &>(x).f) == "spawn") {
+        o_ << "ls_task_detach(" << e(x) << ");\n";
+        return;
+      }
+      o_ << e(x) << ";\n";
       return;
     }
     case SK::Ret: {
       auto &n = static_cast<const SRet &>(s);
-      emitCleanupForReturn(k);
-      ind(o_, k);
-      if (!n.has || !n.v)
+      if (!n.has || !n.v) {
+        emitCleanupForReturn(k);
+        ind(o_, k);
         o_ << "return;\n";
-      else if (activeFnRet_ == Type::Str)
-        o_ << "return ls_str_hold(" << e(*n.v) << ");\n";
-      else
-        o_ << "return " << e(*n.v) << ";\n";
+        return;
+      }
+      std::string value = e(*n.v);
+      if (activeFnRet_ == Type::Str) {
+        const std::string fnRegion = cleanupScopes_.empty() ? "" : cleanupScopes_.front().region;
+        value = fnRegion.empty() ? "ls_str_hold(" + value + ")" : "ls_str_return(&" + fnRegion + ", " + value + ")";
+      }
+      if (!hasPendingCleanup()) {
+        ind(o_, k);
+        o_ << "return " << value << ";\n";
+        return;
+      }
+      ind(o_, k);
+      o_ << "{\n";
+      ind(o_, k + 1);
+      o_ << cType(activeFnRet_) << (activeFnRet_ == Type::Str ? "" : " ") << "__ls_ret = " << value << ";\n";
+      emitCleanupForReturn(k + 1);
+      ind(o_, k + 1);
+      o_ << "return __ls_ret;\n";
+      ind(o_, k);
+      o_ << "}\n";
       return;
     }
     case SK::If: {
@@ -10819,9 +17999,26 @@ private:
     }
     case SK::While: {
       auto &n = static_cast<const SWhile &>(s);
+      if (!stringRegions_ || !exprAllocatesStr(*n.c)) {
+        ind(o_, k);
+        o_ << "while (" << e(*n.c) << ") {\n";
+        emitLoopBody(n.b, k + 1);
+        ind(o_, k);
+        o_ << "}\n";
+        return;
+      }
+      // The condition allocates too, so it is evaluated inside the iteration's region.
       ind(o_, k);
-      o_ << "while (" << e(*n.c) << ") {\n";
+      o_ << "while (1) {\n";
       pushCleanupScope(true);
+      openStringRegion(k + 1);
+      ind(o_, k + 1);
+      o_ << "if (!(" << e(*n.c) << ")) {\n";
+      emitCurrentScopeCleanup(k + 2);
+      ind(o_, k + 2);
+      o_ << "break;\n";
+      ind(o_, k + 1);
+      o_ << "}\n";
       for (const SP &x : n.b) stmt(*x, k + 1);
       emitCurrentScopeCleanup(k + 1);
       popCleanupScope();
@@ -10848,24 +18045,33 @@ private:
         ind(o_, k + 1);
         o_ << "const int64_t " << parIterName << " = ls_trip_count_runtime(" << startName << ", " << stopName << ", "
            << stepName << ");\n";
+        if (!ultraMinimalRuntime_) {
+          // Worker threads write their prints straight through, so earlier buffered output has to go out first.
+          ind(o_, k + 1);
+          o_ << "if (" << parIterName << " >= " << parForThreshold(n) << ") ls_out_flush();\n";
+        }
         ind(o_, k + 1);
         o_ << "if (" << stepName << " > 0) {\n";
         ind(o_, k + 2);
-        o_ << "LS_PAR_FOR_IF(" << parIterName << " >= LS_PAR_MIN_ITERS)\n";
+        o_ << parForPragma(n, parIterName) << "\n";
         ind(o_, k + 2);
         o_ << "for (int64_t " << n.n << " = " << startName << "; " << n.n << " < " << stopName << "; " << n.n
            << " += " << stepName << ") {\n";
-        for (const SP &x : n.b) stmt(*x, k + 3);
+        ++parallelBodyDepth_;
+        emitLoopBody(n.b, k + 3);
+        --parallelBodyDepth_;
         ind(o_, k + 2);
         o_ << "}\n";
         ind(o_, k + 1);
         o_ << "} else if (" << stepName << " < 0) {\n";
         ind(o_, k + 2);
-        o_ << "LS_PAR_FOR_IF(" << parIterName << " >= LS_PAR_MIN_ITERS)\n";
+        o_ << parForPragma(n, parIterName) << "\n";
         ind(o_, k + 2);
         o_ << "for (int64_t " << n.n << " = " << startName << "; " << n.n << " > " << stopName << "; " << n.n
            << " += " << stepName << ") {\n";
-        for (const SP &x : n.b) stmt(*x, k + 3);
+        ++parallelBodyDepth_;
+        emitLoopBody(n.b, k + 3);
+        --parallelBodyDepth_;
         ind(o_, k + 2);
         o_ << "}\n";
         ind(o_, k + 1);
@@ -11114,7 +18320,7 @@ private:
               o_ << n.n << " += " << stepName;
             }
             o_ << ") {\n";
-            for (const SP &x : n.b) stmt(*x, k + 3);
+            emitLoopBody(n.b, k + 3);
             ind(o_, k + 2);
             o_ << "}\n";
           }
@@ -11220,7 +18426,7 @@ private:
               o_ << n.n << " += " << stepName;
             }
             o_ << ") {\n";
-            for (const SP &x : n.b) stmt(*x, k + 3);
+            emitLoopBody(n.b, k + 3);
             ind(o_, k + 2);
             o_ << "}\n";
           }
@@ -11258,17 +18464,42 @@ private:
       return;
     }
     case SK::Break:
+      emitCleanupForLoopTransfer(k);
       ind(o_, k);
       o_ << "break;\n";
       return;
     case SK::Continue:
+      emitCleanupForLoopTransfer(k);
       ind(o_, k);
       o_ << "continue;\n";
       return;
     }
   }
 
+  void cachedFn(const Fn &f) {
+    if (!captureFnC_) {
+      fn(f);
+      return;
+    }
+    auto hit = reuseFnC_.find(f.n);
+    if (hit != reuseFnC_.end()) {
+      o_ << hit->second;
+      fnC_[f.n] = std::move(hit->second);
+      ++fnReused_;
+      return;
+    }
+    std::ostringstream body;
+    o_.swap(body);
+    fn(f);
+    o_.swap(body);
+    std::string text = body.str();
+    o_ << text;
+    fnC_[f.n] = std::move(text);
+  }
+
   void fn(const Fn &f) {
+    // Serials restart per function so a definition's text depends only on the function itself.
+    loopSerial_ = 0;
     const int fnId = loopSerial_++;
     const std::string prevStateSpeedVar = stateSpeedVar_;
     const std::string prevActiveFnName = activeFnName_;
@@ -11278,6 +18509,11 @@ private:
     activeFnName_ = f.n;
     activeFnRet_ = f.ret;
     const bool forceInlineEntry = ultraMinimalRuntime_ && entry_ && (&f == entry_);
+    if (hints_.hot.count(f.n)) {
+      o_ << "LS_HOT ";
+    } else if (hints_.cold.count(f.n)) {
+      o_ << "LS_COLD ";
+    }
     if (forceInlineEntry) {
       o_ << "static LS_ALWAYS_INLINE ";
     } else if (inl_.count(f.n) || f.inl) {
@@ -11285,15 +18521,28 @@ private:
     }
     sig(f);
     o_ << " {\n";
+    const bool prevProfFrame = profFrame_;
+    profFrame_ = profiledFn(f);
     if (hasStateSpeed) {
       o_ << "  const int64_t " << stateSpeedVar_ << " = clock_us();\n";
     }
     pushCleanupScope();
+    if (profFrame_) {
+      // Registered first so it is popped last, after every other cleanup on each return path.
+      o_ << "  ls_prof_frame __ls_prof_frame;\n";
+      o_ << "  ls_prof_enter(&__ls_prof_frame, &" << profFnVar(f) << ");\n";
+      registerOwned("&__ls_prof_frame", "ls_prof_leave");
+    }
+    for (const Param &param : f.p) {
+      if (param.t == Type::Str) cleanupScopes_.back().strVars.push_back(param.n);
+    }
+    if (blockAllocatesStr(f.b)) openStringRegion(1);
     for (const SP &s : f.b) stmt(*s, 1);
     emitCurrentScopeCleanup(1);
     popCleanupScope();
     if (f.ret == Type::Void) o_ << "  return;\n";
     o_ << "}\n\n";
+    profFrame_ = prevProfFrame;
     stateSpeedVar_ = prevStateSpeedVar;
     activeFnName_ = prevActiveFnName;
     activeFnRet_ = prevActiveFnRet;
@@ -11320,6 +18569,8 @@ private:
       return;
     }
     o_ << "int main(void) {\n";
+    o_ << "  ls_out_init();\n";
+    if (profile_) o_ << "  ls_prof_start();\n";
     for (const std::string &flagFn : activeCliFlagCalls_) {
       o_ << "  " << flagFn << "();\n";
     }
@@ -11441,66 +18692,828 @@ static std::optional<std::string> jsonExtractStringField(const std::string &json
       raw.push_back(c);
       continue;
     }
-    esc = false;
-    raw.push_back(c);
+    esc = false;
+    raw.push_back(c);
+  }
+  return std::nullopt;
+}
+// Distinguishes lsc builds that share a version number, so a cache written by one compiler build is never
+// consumed by another.
+static constexpr const char *kCompilerBuildStamp = __DATE__ " " __TIME__;
+static std::string computeSourceStateHash(const std::vector<std::filesystem::path> &inputs) {
+  uint64_t h = 1469598103934665603ULL;
+  for (const auto &p : inputs) {
+    h = fnv1a64(p.string(), h);
+    h = fnv1a64(readFile(p), h);
+  }
+  return hex64(h);
+}
+static std::string computeBuildConfigHash(const std::vector<std::filesystem::path> &inputs, const std::string &cc,
+                                          const std::string &backend, bool maxSpeed, int passes,
+                                          const std::string &target, const std::filesystem::path &sysroot,
+                                          const std::string &linker) {
+  uint64_t h = 1469598103934665603ULL;
+  h = fnv1a64("LineScript-compile-cache-v1", h);
+  h = fnv1a64(kCompilerBuildStamp, h);
+  h = fnv1a64(computeSourceStateHash(inputs), h);
+  h = fnv1a64(cc, h);
+  h = fnv1a64(backend, h);
+  h = fnv1a64(maxSpeed ? "1" : "0", h);
+  h = fnv1a64(std::to_string(passes), h);
+  h = fnv1a64(target, h);
+  h = fnv1a64(sysroot.string(), h);
+  h = fnv1a64(linker, h);
+  return hex64(h);
+}
+// Binary encoding of the typed AST, shared by typed IR bundles and the module cache. A packed buffer is an
+// 8-byte magic, a string table (varint count, then varint length + bytes per entry) and the node stream:
+// LEB128 varints for integers and enums, zigzag for signed values, one byte per flag, and string-table
+// indices for names and literals. Large payloads (emitted C) go inline as length-prefixed blobs so the reader
+// can hand out views into a memory-mapped file.
+static void putVarint(std::string &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<char>(static_cast<unsigned char>(v | 0x80)));
+    v >>= 7;
+  }
+  out.push_back(static_cast<char>(static_cast<unsigned char>(v)));
+}
+class AstWriter {
+public:
+  void u(uint64_t v) { putVarint(out_, v); }
+  void i(int64_t v) { u((static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63)); }
+  void b(bool v) { out_.push_back(v ? '\1' : '\0'); }
+  void str(const std::string &s) {
+    auto it = index_.find(s);
+    if (it == index_.end()) {
+      it = index_.emplace(s, static_cast<uint64_t>(strings_.size())).first;
+      strings_.push_back(s);
+    }
+    u(it->second);
+  }
+  void blob(const std::string &s) {
+    u(s.size());
+    out_ += s;
+  }
+  void span(const Span &s) {
+    u(s.line);
+    u(s.col);
+  }
+  void expr(const Expr *e) {
+    if (!e) {
+      u(0);
+      return;
+    }
+    u(static_cast<uint64_t>(e->k) + 1);
+    span(e->s);
+    u(static_cast<uint64_t>(e->inf));
+    b(e->typed);
+    switch (e->k) {
+    case EK::Int: i(static_cast<const EInt &>(*e).v); break;
+    case EK::Float: {
+      uint64_t bits = 0;
+      const double v = static_cast<const EFloat &>(*e).v;
+      std::memcpy(&bits, &v, sizeof(bits));
+      u(bits);
+      break;
+    }
+    case EK::Bool: b(static_cast<const EBool &>(*e).v); break;
+    case EK::Str: str(static_cast<const EString &>(*e).v); break;
+    case EK::Var: str(static_cast<const EVar &>(*e).n); break;
+    case EK::Unary: {
+      const auto &n = static_cast<const EUnary &>(*e);
+      u(static_cast<uint64_t>(n.op));
+      expr(n.x.get());
+      str(n.overrideFn);
+      break;
+    }
+    case EK::Binary: {
+      const auto &n = static_cast<const EBinary &>(*e);
+      u(static_cast<uint64_t>(n.op));
+      expr(n.l.get());
+      expr(n.r.get());
+      str(n.overrideFn);
+      break;
+    }
+    case EK::Call: {
+      const auto &n = static_cast<const ECall &>(*e);
+      str(n.f);
+      u(n.a.size());
+      for (const EP &a : n.a) expr(a.get());
+      break;
+    }
+    }
+  }
+  void block(const std::vector<SP> &b) {
+    u(b.size());
+    for (const SP &s : b) stmt(*s);
+  }
+  void stmt(const Stmt &s) {
+    u(static_cast<uint64_t>(s.k));
+    span(s.s);
+    switch (s.k) {
+    case SK::Let: {
+      const auto &n = static_cast<const SLet &>(s);
+      str(n.n);
+      b(n.decl.has_value());
+      u(static_cast<uint64_t>(n.decl.value_or(Type::Void)));
+      b(n.isConst);
+      b(n.isOwned);
+      str(n.ownedFreeFn);
+      u(static_cast<uint64_t>(n.inf));
+      b(n.typed);
+      expr(n.v.get());
+      break;
+    }
+    case SK::Assign: {
+      const auto &n = static_cast<const SAssign &>(s);
+      str(n.n);
+      expr(n.v.get());
+      break;
+    }
+    case SK::Expr: expr(static_cast<const SExpr &>(s).e.get()); break;
+    case SK::Ret: {
+      const auto &n = static_cast<const SRet &>(s);
+      b(n.has);
+      expr(n.v.get());
+      break;
+    }
+    case SK::If: {
+      const auto &n = static_cast<const SIf &>(s);
+      expr(n.c.get());
+      block(n.t);
+      block(n.e);
+      break;
+    }
+    case SK::While: {
+      const auto &n = static_cast<const SWhile &>(s);
+      expr(n.c.get());
+      block(n.b);
+      break;
+    }
+    case SK::For: {
+      const auto &n = static_cast<const SFor &>(s);
+      str(n.n);
+      expr(n.start.get());
+      expr(n.stop.get());
+      expr(n.step.get());
+      b(n.parallel);
+      u(n.reductions.size());
+      for (const ParReduction &r : n.reductions) {
+        str(r.op);
+        str(r.var);
+      }
+      str(n.schedule);
+      i(n.grain);
+      i(n.minIters);
+      block(n.b);
+      break;
+    }
+    case SK::FormatBlock: {
+      const auto &n = static_cast<const SFormatBlock &>(s);
+      expr(n.endArg.get());
+      block(n.b);
+      break;
+    }
+    case SK::Break:
+    case SK::Continue:
+      break;
+    }
+  }
+  void fn(const Fn &f) {
+    str(f.n);
+    str(f.sourceName);
+    b(f.isCliFlag);
+    str(f.cliFlagName);
+    b(f.isOperatorOverride);
+    b(f.operatorKind.has_value());
+    u(static_cast<uint64_t>(f.operatorKind.value_or(BK::Add)));
+    b(f.unaryOperatorKind.has_value());
+    u(static_cast<uint64_t>(f.unaryOperatorKind.value_or(UK::Neg)));
+    b(f.isClassMethod);
+    str(f.classOwner);
+    b(f.methodStatic);
+    b(f.methodVirtual);
+    b(f.methodOverride);
+    b(f.methodFinal);
+    b(f.ex);
+    b(f.inl);
+    u(f.p.size());
+    for (const Param &p : f.p) {
+      str(p.n);
+      u(static_cast<uint64_t>(p.t));
+    }
+    u(static_cast<uint64_t>(f.ret));
+    u(f.throws.size());
+    for (const std::string &t : f.throws) str(t);
+    block(f.b);
+    span(f.s);
+  }
+  void program(const Program &p) {
+    u(p.f.size());
+    for (const Fn &f : p.f) fn(f);
+    block(p.top);
+  }
+  std::string pack(const char (&magic)[9]) const {
+    std::string out(magic, 8);
+    putVarint(out, strings_.size());
+    for (const std::string &s : strings_) {
+      putVarint(out, s.size());
+      out += s;
+    }
+    out += out_;
+    return out;
+  }
+
+private:
+  std::string out_;
+  std::vector<std::string> strings_;
+  std::unordered_map<std::string, uint64_t> index_;
+};
+
+// Reads what AstWriter wrote. Any malformed or truncated input turns ok() false; callers treat that as a
+// cache miss.
+// Reads what AstWriter packed, in place: the buffer (typically a MappedFile) must outlive the reader. Any
+// malformed or truncated input turns ok() false; callers treat that as a cache miss or a corrupt bundle.
+class AstReader {
+public:
+  AstReader(const char *data, std::size_t size, const char (&magic)[9]) : p_(data), end_(data + size) {
+    if (size < 8 || std::memcmp(data, magic, 8) != 0) {
+      fail();
+      return;
+    }
+    p_ += 8;
+    const uint64_t n = u();
+    if (n > static_cast<uint64_t>(end_ - p_)) fail();
+    for (uint64_t j = 0; ok_ && j < n; ++j) strings_.push_back(blob());
+  }
+  bool ok() const { return ok_; }
+  bool atEnd() const { return p_ == end_; }
+  uint64_t u() {
+    uint64_t v = 0;
+    for (int shift = 0; ok_ && shift < 64; shift += 7) {
+      if (p_ == end_) break;
+      const auto byte = static_cast<unsigned char>(*p_++);
+      v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) return v;
+    }
+    return fail();
+  }
+  int64_t i() {
+    const uint64_t z = u();
+    return static_cast<int64_t>((z >> 1) ^ (~(z & 1) + 1));
+  }
+  bool b() {
+    if (!ok_ || p_ == end_ || static_cast<unsigned char>(*p_) > 1) return fail() != 0;
+    return *p_++ != 0;
+  }
+  std::string str() {
+    const uint64_t idx = u();
+    if (!ok_ || idx >= strings_.size()) {
+      fail();
+      return std::string();
+    }
+    return std::string(strings_[static_cast<std::size_t>(idx)]);
+  }
+  std::string_view blob() {
+    const uint64_t n = u();
+    if (!ok_ || n > static_cast<uint64_t>(end_ - p_)) {
+      fail();
+      return std::string_view();
+    }
+    std::string_view v(p_, static_cast<std::size_t>(n));
+    p_ += n;
+    return v;
+  }
+  template <typename E> E en(uint64_t count) {
+    const uint64_t v = u();
+    if (v >= count) fail();
+    return ok_ ? static_cast<E>(v) : static_cast<E>(0);
+  }
+  Type type() { return en<Type>(static_cast<uint64_t>(Type::Void) + 1); }
+  Span span() {
+    Span s;
+    s.line = static_cast<std::size_t>(u());
+    s.col = static_cast<std::size_t>(u());
+    return s;
+  }
+  EP expr() {
+    const uint64_t tag = u();
+    if (!ok_ || tag == 0) return nullptr;
+    if (tag > static_cast<uint64_t>(EK::Call) + 1) {
+      fail();
+      return nullptr;
+    }
+    const EK k = static_cast<EK>(tag - 1);
+    const Span s = span();
+    const Type inf = type();
+    const bool typed = b();
+    EP out;
+    switch (k) {
+    case EK::Int: out = std::make_unique<EInt>(i(), s); break;
+    case EK::Float: {
+      const uint64_t bits = u();
+      double v = 0.0;
+      std::memcpy(&v, &bits, sizeof(v));
+      out = std::make_unique<EFloat>(v, s);
+      break;
+    }
+    case EK::Bool: out = std::make_unique<EBool>(b(), s); break;
+    case EK::Str: out = std::make_unique<EString>(str(), s); break;
+    case EK::Var: out = std::make_unique<EVar>(str(), s); break;
+    case EK::Unary: {
+      const UK op = en<UK>(static_cast<uint64_t>(UK::Not) + 1);
+      EP x = expr();
+      std::string overrideFn = str();
+      out = std::make_unique<EUnary>(op, std::move(x), s, std::move(overrideFn));
+      break;
+    }
+    case EK::Binary: {
+      const BK op = en<BK>(static_cast<uint64_t>(BK::Or) + 1);
+      EP l = expr();
+      EP r = expr();
+      std::string overrideFn = str();
+      out = std::make_unique<EBinary>(op, std::move(l), std::move(r), s, std::move(overrideFn));
+      break;
+    }
+    case EK::Call: {
+      std::string f = str();
+      std::vector<EP> a;
+      const uint64_t n = u();
+      for (uint64_t j = 0; ok_ && j < n; ++j) a.push_back(expr());
+      out = std::make_unique<ECall>(std::move(f), std::move(a), s);
+      break;
+    }
+    }
+    if (!ok_) return nullptr;
+    out->inf = inf;
+    out->typed = typed;
+    return out;
+  }
+  std::vector<SP> block() {
+    std::vector<SP> b;
+    const uint64_t n = u();
+    for (uint64_t j = 0; ok_ && j < n; ++j) {
+      SP s = stmt();
+      if (s) b.push_back(std::move(s));
+    }
+    return b;
+  }
+  SP stmt() {
+    const SK k = en<SK>(static_cast<uint64_t>(SK::Continue) + 1);
+    const Span s = span();
+    if (!ok_) return nullptr;
+    switch (k) {
+    case SK::Let: {
+      std::string n = str();
+      const bool hasDecl = b();
+      const Type decl = type();
+      const bool isConst = b();
+      const bool isOwned = b();
+      std::string ownedFreeFn = str();
+      const Type inf = type();
+      const bool typed = b();
+      EP v = expr();
+      auto out = std::make_unique<SLet>(std::move(n), hasDecl ? std::optional<Type>(decl) : std::nullopt, isConst,
+                                        isOwned, std::move(v), s);
+      out->ownedFreeFn = std::move(ownedFreeFn);
+      out->inf = inf;
+      out->typed = typed;
+      return out;
+    }
+    case SK::Assign: {
+      std::string n = str();
+      EP v = expr();
+      return std::make_unique<SAssign>(std::move(n), std::move(v), s);
+    }
+    case SK::Expr: return std::make_unique<SExpr>(expr(), s);
+    case SK::Ret: {
+      const bool has = b();
+      return std::make_unique<SRet>(has, expr(), s);
+    }
+    case SK::If: {
+      EP c = expr();
+      std::vector<SP> t = block();
+      std::vector<SP> e = block();
+      return std::make_unique<SIf>(std::move(c), std::move(t), std::move(e), s);
+    }
+    case SK::While: {
+      EP c = expr();
+      return std::make_unique<SWhile>(std::move(c), block(), s);
+    }
+    case SK::For: {
+      std::string n = str();
+      EP start = expr();
+      EP stop = expr();
+      EP step = expr();
+      const bool parallel = b();
+      std::vector<ParReduction> reductions;
+      const uint64_t nr = u();
+      for (uint64_t j = 0; ok_ && j < nr; ++j) {
+        ParReduction r;
+        r.op = str();
+        r.var = str();
+        reductions.push_back(std::move(r));
+      }
+      std::string schedule = str();
+      const int64_t grain = i();
+      const int64_t minIters = i();
+      auto out = std::make_unique<SFor>(std::move(n), std::move(start), std::move(stop), std::move(step), parallel,
+                                        std::vector<SP>{}, s);
+      out->reductions = std::move(reductions);
+      out->schedule = std::move(schedule);
+      out->grain = grain;
+      out->minIters = minIters;
+      out->b = block();
+      return out;
+    }
+    case SK::FormatBlock: {
+      EP endArg = expr();
+      return std::make_unique<SFormatBlock>(std::move(endArg), block(), s);
+    }
+    case SK::Break: return std::make_unique<SBreak>(s);
+    case SK::Continue: return std::make_unique<SContinue>(s);
+    }
+    return nullptr;
+  }
+  Fn fn() {
+    Fn f;
+    f.n = str();
+    f.sourceName = str();
+    f.isCliFlag = b();
+    f.cliFlagName = str();
+    f.isOperatorOverride = b();
+    const bool hasOp = b();
+    const BK op = en<BK>(static_cast<uint64_t>(BK::Or) + 1);
+    if (hasOp) f.operatorKind = op;
+    const bool hasUnary = b();
+    const UK unary = en<UK>(static_cast<uint64_t>(UK::Not) + 1);
+    if (hasUnary) f.unaryOperatorKind = unary;
+    f.isClassMethod = b();
+    f.classOwner = str();
+    f.methodStatic = b();
+    f.methodVirtual = b();
+    f.methodOverride = b();
+    f.methodFinal = b();
+    f.ex = b();
+    f.inl = b();
+    const uint64_t np = u();
+    for (uint64_t j = 0; ok_ && j < np; ++j) {
+      Param p;
+      p.n = str();
+      p.t = type();
+      f.p.push_back(std::move(p));
+    }
+    f.ret = type();
+    const uint64_t nt = u();
+    for (uint64_t j = 0; ok_ && j < nt; ++j) f.throws.push_back(str());
+    f.b = block();
+    f.s = span();
+    return f;
+  }
+  bool program(Program &p) {
+    const uint64_t nf = u();
+    if (nf > static_cast<uint64_t>(end_ - p_)) return fail() != 0;
+    for (uint64_t j = 0; ok_ && j < nf; ++j) p.f.push_back(fn());
+    p.top = block();
+    return ok_;
+  }
+
+private:
+  const char *p_;
+  const char *end_;
+  std::vector<std::string_view> strings_;
+  bool ok_ = true;
+  uint64_t fail() {
+    ok_ = false;
+    return 0;
+  }
+};
+
+static constexpr char kAstMagic[9] = "LSAST002";
+static constexpr char kModuleCacheMagic[9] = "LSMOD003";
+static constexpr char kTypedIrMagic[9] = "LSTIR002";
+
+// Read-only view of a whole file. It is memory-mapped where the platform allows, so bundles and cache records
+// are decoded in place instead of being copied into a string first.
+class MappedFile {
+public:
+  explicit MappedFile(const std::filesystem::path &p) {
+#if defined(_WIN32)
+    file_ = CreateFileW(p.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER size{};
+    if (file_ != INVALID_HANDLE_VALUE && GetFileSizeEx(file_, &size) && size.QuadPart > 0) {
+      map_ = CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      if (map_) data_ = static_cast<const char *>(MapViewOfFile(map_, FILE_MAP_READ, 0, 0, 0));
+      if (data_) size_ = static_cast<std::size_t>(size.QuadPart);
+    }
+#else
+    const int fd = ::open(p.c_str(), O_RDONLY);
+    struct stat st {};
+    if (fd >= 0 && ::fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *m = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+      if (m != MAP_FAILED) {
+        data_ = static_cast<const char *>(m);
+        size_ = static_cast<std::size_t>(st.st_size);
+      }
+    }
+    if (fd >= 0) ::close(fd);
+#endif
+    if (!data_) {
+      fallback_ = readFile(p);
+      data_ = fallback_.data();
+      size_ = fallback_.size();
+    }
+  }
+  ~MappedFile() {
+    if (!fallback_.empty() || !data_ || size_ == 0) {
+#if defined(_WIN32)
+      if (map_) CloseHandle(map_);
+      if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+#endif
+      return;
+    }
+#if defined(_WIN32)
+    UnmapViewOfFile(data_);
+    CloseHandle(map_);
+    CloseHandle(file_);
+#else
+    ::munmap(const_cast<char *>(data_), size_);
+#endif
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  const char *data() const { return data_; }
+  std::size_t size() const { return size_; }
+
+private:
+  const char *data_ = nullptr;
+  std::size_t size_ = 0;
+  std::string fallback_;
+#if defined(_WIN32)
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE map_ = nullptr;
+#endif
+};
+
+static std::string encodeProgramAst(const Program &p) {
+  AstWriter w;
+  w.program(p);
+  return w.pack(kAstMagic);
+}
+static bool decodeProgramAst(std::string_view data, Program &p) {
+  AstReader r(data.data(), data.size(), kAstMagic);
+  return r.ok() && r.program(p) && r.atEnd();
+}
+static std::string functionAstHash(const Fn &f, const std::string &emitMode) {
+  AstWriter w;
+  w.str(kCompilerBuildStamp);
+  w.str(emitMode);
+  w.fn(f);
+  return hex64(fnv1a64(w.pack(kAstMagic)));
+}
+
+// A function signature as a type-check key sees it. A body checked against the same signatures of everything
+// it calls checks the same way, so `lsc --serve` and the module cache key type-check results by these.
+static std::string checkedSignature(const std::string &name, const std::string &alias, const std::vector<Param> &params,
+                                    Type ret, const std::vector<std::string> &throws) {
+  std::string sig = name + "/" + alias + "(";
+  for (const Param &prm : params) sig += typeName(prm.t) + ",";
+  sig += ")" + typeName(ret);
+  for (const std::string &t : throws) sig += "!" + t;
+  return sig + ";";
+}
+// Signatures by every name a call could resolve through: the definition name and its source alias.
+class SignatureIndex {
+public:
+  void add(const std::string &name, const std::string &alias, const std::string &sig, bool operatorOverride) {
+    byName_[name] += sig;
+    if (alias != name) byName_[alias] += sig;
+    if (operatorOverride) operators_ += sig;
+  }
+  // Operator overrides can apply to any expression, so every key includes all of them.
+  std::string depsKey(const std::vector<std::string> &calls, bool superuserMode) const {
+    std::string deps = operators_ + (superuserMode ? "s" : "-");
+    for (const std::string &c : calls) {
+      auto it = byName_.find(c);
+      if (it != byName_.end()) deps += it->second;
+    }
+    return hex64(fnv1a64(deps));
   }
-  return std::nullopt;
+
+private:
+  std::unordered_map<std::string, std::string> byName_;
+  std::string operators_;
+};
+
+// Per-module incremental cache. Each input module keeps the AST it parsed to (keyed by its path and bytes),
+// its functions as type-checked (keyed by that and the signatures of everything they call), and the emitted C
+// of the functions it defines (keyed by the function's optimized, type-checked AST). A multi-file build only
+// re-lexes and re-parses the modules that changed, only re-checks the modules that changed or call a
+// signature that did, and only re-emits the functions whose AST changed. A function's optimized AST already
+// folds in everything other modules contribute to it: the callee signatures it was type-checked against and
+// the bodies the optimizer inlined into it. The merged top-level script is always re-checked.
+struct CachedFunctionC {
+  std::string name;
+  std::string key;
+  std::string c;
+};
+struct ModuleSignature {
+  std::string name;
+  std::string alias;
+  std::string sig;
+  bool operatorOverride = false;
+};
+struct ModuleCacheRecord {
+  std::string sourceKey;
+  std::string ast;
+  // The module's top-level statements alone, so a module reused as type-checked need not decode `ast`.
+  std::string top;
+  // What the module's type-check result depends on, available before any module is decoded.
+  bool usesSuperuser = false;
+  std::vector<ModuleSignature> sigs;
+  std::vector<std::string> calls;
+  // The module's functions as type-checked, and the warnings checking them raised.
+  std::string typedKey;
+  std::string typed;
+  std::vector<std::string> warnings;
+  std::vector<CachedFunctionC> fns;
+};
+// Same layout as encodeProgramAst, for functions that live in a larger program.
+static std::string encodeProgramAst(const std::vector<const Fn *> &fns, const std::vector<SP> &top) {
+  AstWriter w;
+  w.u(fns.size());
+  for (const Fn *f : fns) w.fn(*f);
+  w.block(top);
+  return w.pack(kAstMagic);
 }
-static std::string computeSourceStateHash(const std::vector<std::filesystem::path> &inputs) {
-  uint64_t h = 1469598103934665603ULL;
-  for (const auto &p : inputs) {
-    h = fnv1a64(p.string(), h);
-    h = fnv1a64(readFile(p), h);
-  }
-  return hex64(h);
+// Records what keys the type-check result of a freshly parsed module.
+static void summarizeModule(const Program &part, ModuleCacheRecord &rec) {
+  ProgramUsage u;
+  rec.sigs.clear();
+  for (const Fn &f : part.f) {
+    const std::string alias = f.sourceName.empty() ? f.n : f.sourceName;
+    rec.sigs.push_back(ModuleSignature{f.n, alias, checkedSignature(f.n, alias, f.p, f.ret, f.throws),
+                                       f.isOperatorOverride});
+    if (!f.ex) collectUsageBlock(f.b, u);
+  }
+  rec.calls.assign(u.calls.begin(), u.calls.end());
+  std::sort(rec.calls.begin(), rec.calls.end());
+  collectUsageBlock(part.top, u);
+  rec.usesSuperuser = u.called("superuser");
+  rec.top = part.top.empty() ? std::string() : encodeProgramAst({}, part.top);
 }
-static std::string computeBuildConfigHash(const std::vector<std::filesystem::path> &inputs, const std::string &cc,
-                                          const std::string &backend, bool maxSpeed, int passes,
-                                          const std::string &target, const std::filesystem::path &sysroot,
-                                          const std::string &linker) {
-  uint64_t h = 1469598103934665603ULL;
-  h = fnv1a64("LineScript-compile-cache-v1", h);
-  h = fnv1a64(computeSourceStateHash(inputs), h);
-  h = fnv1a64(cc, h);
-  h = fnv1a64(backend, h);
-  h = fnv1a64(maxSpeed ? "1" : "0", h);
-  h = fnv1a64(std::to_string(passes), h);
-  h = fnv1a64(target, h);
-  h = fnv1a64(sysroot.string(), h);
-  h = fnv1a64(linker, h);
+static std::string moduleSourceKey(const std::filesystem::path &input, const std::string &src) {
+  uint64_t h = fnv1a64("linescript-module-cache-v3");
+  h = fnv1a64(kCompilerBuildStamp, h);
+  h = fnv1a64(input.string(), h);
+  h = fnv1a64(src, h);
   return hex64(h);
 }
-static void writeTypedIrBundle(const std::filesystem::path &outPath, const std::string &cCode,
-                               const std::string &sourceStateHash, const std::string &buildConfigHash) {
-  std::ostringstream o;
-  o << "{\n";
-  o << "  \"format\": \"linescript-typed-ir-v1\",\n";
-  o << "  \"source_hash\": \"" << jsonEscape(sourceStateHash) << "\",\n";
-  o << "  \"config_hash\": \"" << jsonEscape(buildConfigHash) << "\",\n";
-  o << "  \"c_code\": \"" << jsonEscape(cCode) << "\"\n";
-  o << "}\n";
-  writeFile(outPath, o.str());
+static std::filesystem::path moduleCachePath(const std::filesystem::path &cacheDir, const std::filesystem::path &input) {
+  std::error_code ec;
+  std::filesystem::path abs = std::filesystem::absolute(input, ec);
+  if (ec) abs = input;
+  return cacheDir / "modules" / (hex64(fnv1a64(abs.lexically_normal().string())) + ".module");
 }
-static std::string readTypedIrBundle(const std::filesystem::path &inPath, std::string *sourceStateHashOut = nullptr,
-                                     std::string *buildConfigHashOut = nullptr) {
-  std::string json = readFile(inPath);
-  auto fmt = jsonExtractStringField(json, "format");
-  if (!fmt.has_value() || *fmt != "linescript-typed-ir-v1") {
-    throw std::runtime_error("unsupported typed IR format in " + inPath.string());
-  }
-  auto cCode = jsonExtractStringField(json, "c_code");
-  if (!cCode.has_value()) {
-    throw std::runtime_error("typed IR is missing c_code field: " + inPath.string());
+static bool readModuleCache(const std::filesystem::path &path, ModuleCacheRecord &rec) {
+  std::error_code ec;
+  if (!std::filesystem::exists(path, ec)) return false;
+  try {
+    MappedFile m(path);
+    AstReader r(m.data(), m.size(), kModuleCacheMagic);
+    rec.sourceKey = r.str();
+    rec.ast = std::string(r.blob());
+    rec.top = std::string(r.blob());
+    rec.usesSuperuser = r.b();
+    const uint64_t ns = r.u();
+    for (uint64_t j = 0; r.ok() && j < ns; ++j) {
+      ModuleSignature sig;
+      sig.name = r.str();
+      sig.alias = r.str();
+      sig.sig = r.str();
+      sig.operatorOverride = r.b();
+      rec.sigs.push_back(std::move(sig));
+    }
+    const uint64_t nc = r.u();
+    for (uint64_t j = 0; r.ok() && j < nc; ++j) rec.calls.push_back(r.str());
+    rec.typedKey = r.str();
+    rec.typed = std::string(r.blob());
+    const uint64_t nw = r.u();
+    for (uint64_t j = 0; r.ok() && j < nw; ++j) rec.warnings.push_back(r.str());
+    const uint64_t n = r.u();
+    for (uint64_t j = 0; r.ok() && j < n; ++j) {
+      CachedFunctionC f;
+      f.name = r.str();
+      f.key = r.str();
+      f.c = std::string(r.blob());
+      rec.fns.push_back(std::move(f));
+    }
+    return r.ok() && r.atEnd();
+  } catch (const std::exception &) {
+    return false;
   }
-  if (sourceStateHashOut) {
-    auto sh = jsonExtractStringField(json, "source_hash");
-    *sourceStateHashOut = sh.value_or("");
+}
+// Cache entries are written to a temporary name and renamed, so a concurrent build never reads half a file.
+static void writeFileAtomically(const std::filesystem::path &path, const std::string &data) {
+  std::filesystem::path tmp = path;
+  tmp += ".tmp" + std::to_string(static_cast<unsigned long long>(
+                      std::chrono::steady_clock::now().time_since_epoch().count()));
+  try {
+    writeFile(tmp, data);
+    std::filesystem::rename(tmp, path);
+  } catch (const std::exception &) {
+    std::error_code ec;
+    std::filesystem::remove(tmp, ec);
   }
-  if (buildConfigHashOut) {
-    auto ch = jsonExtractStringField(json, "config_hash");
-    *buildConfigHashOut = ch.value_or("");
+}
+static void writeModuleCache(const std::filesystem::path &path, const ModuleCacheRecord &rec) {
+  AstWriter w;
+  w.str(rec.sourceKey);
+  w.blob(rec.ast);
+  w.blob(rec.top);
+  w.b(rec.usesSuperuser);
+  w.u(rec.sigs.size());
+  for (const ModuleSignature &sig : rec.sigs) {
+    w.str(sig.name);
+    w.str(sig.alias);
+    w.str(sig.sig);
+    w.b(sig.operatorOverride);
+  }
+  w.u(rec.calls.size());
+  for (const std::string &c : rec.calls) w.str(c);
+  w.str(rec.typedKey);
+  w.blob(rec.typed);
+  w.u(rec.warnings.size());
+  for (const std::string &m : rec.warnings) w.str(m);
+  w.u(rec.fns.size());
+  for (const CachedFunctionC &f : rec.fns) {
+    w.str(f.name);
+    w.str(f.key);
+    w.blob(f.c);
+  }
+  writeFileAtomically(path, w.pack(kModuleCacheMagic));
+}
+
+// Typed IR bundle: the type-checked program before optimization, plus the C it was emitted to and the
+// settings that C depends on. A consumer with the same emit settings reuses the C; any other consumer
+// re-optimizes and re-emits from the program without parsing or type checking.
+struct TypedIrBundle {
+  std::string sourceHash;
+  std::string configHash;
+  std::string emitConfig;
+  std::string buildDeps;
+  std::string cCode;
+  bool hasProgram = false;
+  Program program;
+};
+// Starts a bundle body; `p` is the type-checked program, or null for a bundle that only carries C.
+static AstWriter typedIrProgram(const Program *p) {
+  AstWriter w;
+  w.b(p != nullptr);
+  if (p) w.program(*p);
+  return w;
+}
+static void writeTypedIrBundle(const std::filesystem::path &outPath, AstWriter body, const std::string &cCode,
+                               const std::string &sourceStateHash, const std::string &buildConfigHash,
+                               const std::string &buildDeps, const std::string &emitConfig) {
+  body.str(sourceStateHash);
+  body.str(buildConfigHash);
+  body.str(buildDeps);
+  body.str(emitConfig);
+  body.blob(cCode);
+  writeFileAtomically(outPath, body.pack(kTypedIrMagic));
+  if (!std::filesystem::exists(outPath)) throw std::runtime_error("failed to write: " + outPath.string());
+}
+static TypedIrBundle readTypedIrBundle(const std::filesystem::path &inPath) {
+  MappedFile m(inPath);
+  TypedIrBundle out;
+  if (m.size() > 0 && m.data()[0] == '{') {
+    // linescript-typed-ir-v1: JSON carrying only the emitted C.
+    const std::string json(m.data(), m.size());
+    auto fmt = jsonExtractStringField(json, "format");
+    if (!fmt.has_value() || *fmt != "linescript-typed-ir-v1") {
+      throw std::runtime_error("unsupported typed IR format in " + inPath.string());
+    }
+    auto cCode = jsonExtractStringField(json, "c_code");
+    if (!cCode.has_value()) throw std::runtime_error("typed IR is missing c_code field: " + inPath.string());
+    out.cCode = std::move(*cCode);
+    out.sourceHash = jsonExtractStringField(json, "source_hash").value_or("");
+    out.configHash = jsonExtractStringField(json, "config_hash").value_or("");
+    out.buildDeps = jsonExtractStringField(json, "build_deps").value_or("");
+    return out;
   }
-  return *cCode;
+  AstReader r(m.data(), m.size(), kTypedIrMagic);
+  if (!r.ok()) throw std::runtime_error("unsupported typed IR format in " + inPath.string());
+  out.hasProgram = r.b();
+  if (out.hasProgram) r.program(out.program);
+  out.sourceHash = r.str();
+  out.configHash = r.str();
+  out.buildDeps = r.str();
+  out.emitConfig = r.str();
+  out.cCode = std::string(r.blob());
+  if (!r.ok() || !r.atEnd()) throw std::runtime_error("corrupt typed IR bundle: " + inPath.string());
+  return out;
 }
 
 static bool gSuperuserVerbose = false;
@@ -11524,6 +19537,62 @@ static void superuserLogV(int level, const std::string &msg) {
   OutputDebugStringA(line.c_str());
 #endif
 }
+// One row of the `<profile>.functions` table a `--profile` build writes at exit.
+struct ProfileFunctionRow {
+  std::string name;
+  int64_t calls = 0;
+  int64_t inclusiveNs = -1;
+  int64_t selfSamples = 0;
+  int64_t totalSamples = 0;
+};
+static constexpr const char *kDefaultProfileOut = "linescript-profile.folded";
+
+static std::vector<ProfileFunctionRow> readProfileFunctions(const std::filesystem::path &path, int64_t &samples) {
+  std::istringstream in(readFile(path));
+  std::string line;
+  if (!std::getline(in, line) || line.rfind("# linescript-profile-v1", 0) != 0) {
+    throw std::runtime_error("not a LineScript profile function table: " + path.string());
+  }
+  samples = 0;
+  const std::size_t at = line.find(" samples=");
+  if (at != std::string::npos) samples = std::strtoll(line.c_str() + at + 9, nullptr, 10);
+  std::vector<ProfileFunctionRow> rows;
+  std::getline(in, line);  // column header
+  while (std::getline(in, line)) {
+    std::vector<std::string> cols;
+    std::size_t b = 0;
+    for (std::size_t e; (e = line.find('\t', b)) != std::string::npos; b = e + 1) cols.push_back(line.substr(b, e - b));
+    cols.push_back(line.substr(b));
+    if (cols.size() < 6) continue;
+    ProfileFunctionRow r;
+    r.name = cols[0];
+    r.calls = std::strtoll(cols[2].c_str(), nullptr, 10);
+    r.inclusiveNs = std::strtoll(cols[3].c_str(), nullptr, 10);
+    r.selfSamples = std::strtoll(cols[4].c_str(), nullptr, 10);
+    r.totalSamples = std::strtoll(cols[5].c_str(), nullptr, 10);
+    rows.push_back(std::move(r));
+  }
+  return rows;
+}
+
+// Hot: at least 2% of all samples land in the function itself. Cold: instrumented but never called.
+// Functions the profile does not list (new, or inlined when it was taken) get neither.
+static ProfileHints loadProfileHints(const std::filesystem::path &path) {
+  std::filesystem::path table = path;
+  if (table.extension() != ".functions") table += ".functions";
+  if (!std::filesystem::exists(table)) throw std::runtime_error("--profile-use file not found: " + table.string());
+  int64_t samples = 0;
+  ProfileHints hints;
+  for (const ProfileFunctionRow &r : readProfileFunctions(table, samples)) {
+    if (r.calls == 0) {
+      hints.cold.insert(r.name);
+    } else if (samples > 0 && r.selfSamples * 50 >= samples) {
+      hints.hot.insert(r.name);
+    }
+  }
+  return hints;
+}
+
 struct Opt {
   std::vector<std::filesystem::path> inputs;
   std::filesystem::path out;
@@ -11536,6 +19605,7 @@ struct Opt {
   bool run = false;
   bool check = false;
   bool repl = false;
+  bool serve = false;
   bool superuserSession = false;
   int superuserVerbosity = 3;
   bool keepC = false;
@@ -11548,6 +19618,16 @@ struct Opt {
   std::filesystem::path boltUseFdata;
   std::filesystem::path emitTypedIrPath;
   std::filesystem::path consumeTypedIrPath;
+  bool timePasses = false;
+  std::filesystem::path timePassesJsonPath;
+  bool bench = false;
+  std::filesystem::path benchJsonPath;
+  int64_t benchTimeMs = -1;
+  int64_t benchWarmupMs = -1;
+  int64_t benchSamples = -1;
+  bool profile = false;
+  std::filesystem::path profileOutPath;
+  std::filesystem::path profileUsePath;
   int passes = 12;
   bool infoOnly = false;
   std::vector<std::string> infoMessages;
@@ -11624,23 +19704,35 @@ static void usage() {
   std::cerr << "  --run           build and run native binary\n";
   std::cerr << "  --repl          interactive LineScript shell\n";
   std::cerr << "  --shell         alias for --repl\n";
+  std::cerr << "  --serve         check daemon for editors: JSON-RPC 2.0 over stdin/stdout, one message per line\n";
   std::cerr << "  --cc <name>     C compiler command (default: clang)\n";
   std::cerr << "  --backend <x>   backend: auto|c|asm (default: auto)\n";
   std::cerr << "  --target <triple> cross-compile target triple (clang/lld path)\n";
   std::cerr << "  --sysroot <path> sysroot for cross-compilation\n";
   std::cerr << "  --linker <name> linker override (for example lld)\n";
-  std::cerr << "  --passes <n>    greedy optimization passes (default: 12)\n";
+  std::cerr << "  --passes <n>    optimizer worklist rounds (default: 12)\n";
   std::cerr << "  --incremental   enable incremental compile cache (default on)\n";
   std::cerr << "  --cache-dir <path> incremental cache directory (default .linescript/cache)\n";
   std::cerr << "  --no-cache      disable incremental cache for this invocation\n";
-  std::cerr << "  --emit-typed-ir <file.json> write typed IR JSON bundle for this compile\n";
-  std::cerr << "  --consume-typed-ir <file.json> build from typed IR JSON (skip frontend parse/type-check)\n";
+  std::cerr << "  --emit-typed-ir <file> write a binary typed IR bundle (typed AST + emitted C) for this compile\n";
+  std::cerr << "  --consume-typed-ir <file> build from a typed IR bundle (skips parse/type-check; re-optimizes when\n"
+               "                     --passes or session flags differ from the producing compile)\n";
   std::cerr << "  -O4             primary max-speed profile (preferred)\n";
   std::cerr << "  --max-speed     compatibility alias for -O4\n";
   std::cerr << "  --pgo-generate  build instrumented binary for profile capture (max-speed pipeline)\n";
   std::cerr << "  --pgo-use <dir> use collected PGO profiles from <dir> (max-speed pipeline)\n";
+  std::cerr << "  --profile       instrument for the sampling profiler; the program writes collapsed stacks at exit\n";
+  std::cerr << "  --profile-out <file> where a --profile build writes its stacks (default: linescript-profile.folded)\n";
+  std::cerr << "  --profile-use <file> mark hot/cold functions from a --profile run's table for the optimizer\n";
   std::cerr << "  --bolt-use <fdata> apply BOLT profile data file when llvm-bolt is available\n";
   std::cerr << "  --keep-c        keep generated C when --build\n";
+  std::cerr << "  --time-passes   report time and peak memory per compile phase and optimizer pass on stderr\n";
+  std::cerr << "  --time-passes-json <file> write the --time-passes report as JSON\n";
+  std::cerr << "  --bench         build and run, then print the program's bench block results as JSON\n";
+  std::cerr << "  --bench-json <file> write the --bench report to <file> instead of stdout\n";
+  std::cerr << "  --bench-time <ms> target measuring time per bench block (default: 1000)\n";
+  std::cerr << "  --bench-warmup <ms> warmup time per bench block before calibration (default: 100)\n";
+  std::cerr << "  --bench-samples <n> samples per bench block (default: 50, at most 1000)\n";
   std::cerr << "  --LineScript    print LineScript version\n";
   std::cerr << "  --super-speed   reserved tuning flag\n";
   std::cerr << "  --max-sped      reserved tuning alias\n";
@@ -11729,6 +19821,8 @@ static Opt parseOpt(int argc, char **argv) {
       std::exit(0);
     } else if (a == "--repl" || a == "--shell") {
       o.repl = true;
+    } else if (a == "--serve") {
+      o.serve = true;
     } else if (a == "--su-session") {
       o.superuserSession = true;
     } else if (a == "--su-verbosity") {
@@ -11763,6 +19857,36 @@ static Opt parseOpt(int argc, char **argv) {
       o.build = true;
     } else if (a == "--keep-c") {
       o.keepC = true;
+    } else if (a == "--time-passes") {
+      o.timePasses = true;
+    } else if (a == "--time-passes-json") {
+      if (i + 1 >= argc) throw std::runtime_error("missing value for --time-passes-json");
+      o.timePassesJsonPath = argv[++i];
+      o.timePasses = true;
+    } else if (a == "--profile") {
+      o.profile = true;
+    } else if (a == "--profile-out") {
+      if (i + 1 >= argc) throw std::runtime_error("missing value for --profile-out");
+      o.profileOutPath = argv[++i];
+      o.profile = true;
+    } else if (a == "--profile-use") {
+      if (i + 1 >= argc) throw std::runtime_error("missing value for --profile-use");
+      o.profileUsePath = argv[++i];
+    } else if (a == "--bench") {
+      o.bench = true;
+      o.run = true;
+      o.build = true;
+    } else if (a == "--bench-json") {
+      if (i + 1 >= argc) throw std::runtime_error("missing value for --bench-json");
+      o.benchJsonPath = argv[++i];
+      o.bench = true;
+      o.run = true;
+      o.build = true;
+    } else if (a == "--bench-time" || a == "--bench-warmup" || a == "--bench-samples") {
+      if (i + 1 >= argc) throw std::runtime_error("missing value for " + a);
+      const int64_t v = std::stoll(argv[++i]);
+      if (v < 0 || (a == "--bench-samples" && v == 0)) throw std::runtime_error(a + " must be > 0");
+      (a == "--bench-time" ? o.benchTimeMs : (a == "--bench-warmup" ? o.benchWarmupMs : o.benchSamples)) = v;
     } else if (a == "-O4" || a == "--max-speed") {
       o.maxSpeed = true;
       if (o.passes < 32) o.passes = 32;
@@ -11863,6 +19987,10 @@ static Opt parseOpt(int argc, char **argv) {
   if (o.repl && (o.check || o.build || o.run)) {
     throw std::runtime_error("--repl/--shell cannot be combined with --check/--build/--run");
   }
+  if (o.serve && (o.repl || o.check || o.build || o.run || !o.inputs.empty())) {
+    throw std::runtime_error("--serve takes no input files and cannot be combined with --check/--build/--run/--repl");
+  }
+  if (o.serve) return o;
   if (o.repl && o.superuserSession) {
     throw std::runtime_error("--su-session is internal and cannot be combined with --repl/--shell");
   }
@@ -11901,6 +20029,12 @@ static Opt parseOpt(int argc, char **argv) {
   if (!o.consumeTypedIrPath.empty()) {
     validatePathForShell(o.consumeTypedIrPath, "consume typed ir path");
   }
+  if (!o.timePassesJsonPath.empty()) {
+    validatePathForShell(o.timePassesJsonPath, "time passes report path");
+  }
+  if (!o.benchJsonPath.empty()) {
+    validatePathForShell(o.benchJsonPath, "bench report path");
+  }
   if (!o.consumeTypedIrPath.empty() && !o.build && !o.run) {
     throw std::runtime_error("--consume-typed-ir requires --build or --run");
   }
@@ -12027,7 +20161,7 @@ static bool applyBoltProfileIfAvailable(const std::filesystem::path &bin, const
     cmd << qCmd(tool) << " " << q(bin) << " -o " << q(bolted) << " -data=" << q(fdata)
         << " -reorder-blocks=ext-tsp -reorder-functions=hfsort+ -split-functions=3 -split-all-cold -icf=1";
     if (superuserMode) superuserLogV(3, "exec (bolt): " + cmd.str());
-    const int rc = std::system(cmd.str().c_str());
+    const int rc = timedSystem(cmd.str(), "bolt");
     if (rc == 0 && std::filesystem::exists(bolted)) {
       std::error_code ec;
       std::filesystem::remove(bin, ec);
@@ -12157,75 +20291,863 @@ static std::string replRewritePrintAsPrintln(const std::string &snippet) {
       } else if (c == '"') {
         inStr = false;
       }
-      ++i;
-      continue;
+      ++i;
+      continue;
+    }
+    if (c == '/' && i + 1 < n && snippet[i + 1] == '/') {
+      while (i < n) {
+        out.push_back(snippet[i]);
+        if (snippet[i] == '\n') {
+          ++i;
+          break;
+        }
+        ++i;
+      }
+      continue;
+    }
+    if (c == '"') {
+      out.push_back(c);
+      inStr = true;
+      ++i;
+      continue;
+    }
+    if (replIsIdentStart(c)) {
+      std::size_t j = i + 1;
+      while (j < n && replIsIdentChar(snippet[j])) ++j;
+      const std::string tok = snippet.substr(i, j - i);
+      if (tok == "print") {
+        std::size_t k = j;
+        while (k < n && (snippet[k] == ' ' || snippet[k] == '\t' || snippet[k] == '\r')) ++k;
+        if (k < n && snippet[k] == '(') {
+          out += "println";
+          i = j;
+          continue;
+        }
+      }
+      out += tok;
+      i = j;
+      continue;
+    }
+    out.push_back(c);
+    ++i;
+  }
+  return out;
+}
+
+static std::string replUserName() {
+#if defined(_WIN32)
+  char *buf = nullptr;
+  std::size_t n = 0;
+  if (_dupenv_s(&buf, &n, "USERNAME") == 0 && buf != nullptr && *buf != '\0') {
+    std::string name(buf);
+    std::free(buf);
+    return name;
+  }
+  if (buf != nullptr) std::free(buf);
+  buf = nullptr;
+  n = 0;
+  if (_dupenv_s(&buf, &n, "USER") == 0 && buf != nullptr && *buf != '\0') {
+    std::string name(buf);
+    std::free(buf);
+    return name;
+  }
+  if (buf != nullptr) std::free(buf);
+#else
+  const char *name = std::getenv("USERNAME");
+  if (name != nullptr && *name != '\0') return std::string(name);
+  name = std::getenv("USER");
+  if (name != nullptr && *name != '\0') return std::string(name);
+#endif
+  return "user";
+}
+
+// In-process evaluation for --shell. Each snippet is parsed, then type-checked together with the session's function
+// definitions and one `declare` per live variable; only the snippet's own statements are then walked over the typed
+// AST, so variables keep their values in this process from line to line. Values follow the emitted C: integer
+// arithmetic wraps, f32 results are rounded to float, and integer division by zero or INT_MIN / -1 is a runtime
+// error. Anything the walker does not model (runtime handles, I/O, tasks, format blocks, deep recursion, long loops)
+// raises Fallback before any output is released, and the shell re-runs the snippet through the compiled path.
+class ReplInterpreter {
+public:
+  enum class Result { Ok, Failed, Fallback };
+
+  void reset() {
+    defs_.clear();
+    globals_.clear();
+  }
+  const std::string &fallbackReason() const { return fallbackReason_; }
+
+  // The session as source: its definitions, then every live variable declared with its current value.
+  std::string snapshotSource() const {
+    std::string out;
+    for (const std::string &d : defs_) {
+      out += d;
+      if (out.empty() || out.back() != '\n') out.push_back('\n');
+    }
+    for (const Slot &g : globals_) {
+      out += "declare ";
+      if (g.isConst) out += "const ";
+      out += g.n + ": " + typeName(g.v.t) + " = " + literalOf(g.v) + "\n";
+    }
+    return out;
+  }
+
+  Result run(const std::string &src) {
+    fallbackReason_.clear();
+    std::string stage = "parse";
+    try {
+      Program part = parseSource(src);
+      const std::optional<std::string> defText = definitionLines(src, part);
+      if (!defText) return fallback("definitions share lines with statements");
+      Program p = parseSource(snapshotSource());
+      const std::size_t skip = p.top.size();
+      for (auto &f : part.f) p.f.push_back(std::move(f));
+      for (auto &s : part.top) p.top.push_back(std::move(s));
+      const bool runs = skip < p.top.size();
+      if (!p.top.empty()) {
+        Fn script;
+        script.n = kScriptEntryName;
+        script.ret = Type::Void;
+        script.s = p.top.front()->s;
+        script.b = std::move(p.top);
+        p.top.clear();
+        p.f.push_back(std::move(script));
+      }
+      stage = "type-check";
+      TypeCheck tc(p, false);
+      tc.run();
+      std::unordered_set<std::string> seenWarnings;
+      for (const auto &w : tc.warnings()) {
+        if (seenWarnings.insert(w).second) std::cerr << w << '\n';
+      }
+      if (runs && !execute(p, skip)) return Result::Fallback;
+      if (!defText->empty()) defs_.push_back(*defText);
+      return Result::Ok;
+    } catch (const CompileError &e) {
+      std::cerr << "LineScript error (" << stage << "): " << e.what() << '\n';
+    } catch (const RuntimeFault &e) {
+      std::cout << out_ << std::flush;
+      std::cerr << "LineScript runtime error: " << CompileError(e.s, e.m).what() << '\n';
+    }
+    return Result::Failed;
+  }
+
+private:
+  struct Value {
+    Type t = Type::Void;
+    int64_t i = 0;
+    double f = 0.0;
+    std::string s;
+  };
+  struct Slot {
+    std::string n;
+    Value v;
+    bool isConst = false;
+  };
+  struct Unsupported {
+    std::string why;
+  };
+  struct RuntimeFault {
+    Span s;
+    std::string m;
+  };
+  enum class Flow { Next, Break, Continue, Return };
+  enum class Builtin {
+    Print, Println, PrintI64, PrintF64, PrintBool, PrintStr, PrintlnI64, PrintlnF64, PrintlnBool, PrintlnStr,
+    Format, Flush, Max, Min, Abs, Clamp, MaxI64, MinI64, AbsI64, ClampI64, MaxF64, MinF64, AbsF64, ClampF64, Gcd, Lcm,
+    Pi, Tau, DegToRad, RadToDeg, Sqrt, Sin, Cos, Tan, Asin, Acos, Atan, Atan2, Exp, Log, Log10, Floor, Ceil, Round,
+    Pow, ToI32, ToF32, ToI64, ToF64, BoolToI64, I64ToBool, ParseI64, ParseF64, Len, IsEmpty, Contains,
+    StartsWith, EndsWith, Find, Replace, Trim, Lower, Upper, Substring, Repeat, Reverse, ByteAt, Ord, Chr
+  };
+  // A snippet that runs longer than this (statements plus calls) is handed to the compiled path instead.
+  static constexpr uint64_t kStepBudget = 20000000;
+  // Each interpreted call level costs under 2KB of native stack; this keeps the deepest walk well inside 1MB.
+  static constexpr int kMaxCallDepth = 256;
+
+  std::vector<std::string> defs_;
+  std::vector<Slot> globals_;
+  std::string fallbackReason_;
+  std::unordered_map<std::string, const Fn *> fns_;
+  std::vector<Slot> vars_;
+  std::size_t frameBase_ = 0;
+  int depth_ = 0;
+  uint64_t steps_ = 0;
+  std::string out_;
+  Value ret_;
+
+  Result fallback(const std::string &why) {
+    fallbackReason_ = why;
+    return Result::Fallback;
+  }
+
+  static Program parseSource(const std::string &src) {
+    Lexer lx(src);
+    Parser ps(lx.run());
+    return ps.run();
+  }
+
+  // The lines of `src` that hold its function definitions. A line is owned by the last item starting at or before
+  // it; nullopt when that split does not re-parse to the same definitions (a definition sharing a line with a
+  // statement, or a class whose header line precedes its first method).
+  static std::optional<std::string> definitionLines(const std::string &src, const Program &part) {
+    if (part.f.empty()) return std::string();
+    if (part.top.empty()) return src;
+    std::vector<std::pair<std::size_t, bool>> starts;
+    for (const Fn &f : part.f) starts.push_back({f.s.line, true});
+    for (const SP &s : part.top) starts.push_back({s->s.line, false});
+    std::sort(starts.begin(), starts.end());
+    for (std::size_t i = 1; i < starts.size(); ++i) {
+      if (starts[i].first == starts[i - 1].first && starts[i].second != starts[i - 1].second) return std::nullopt;
+    }
+    std::string out;
+    std::size_t line = 1;
+    std::size_t at = 0;
+    bool owned = false;
+    std::size_t pos = 0;
+    while (pos < src.size()) {
+      std::size_t end = src.find('\n', pos);
+      end = end == std::string::npos ? src.size() : end + 1;
+      while (at < starts.size() && starts[at].first <= line) owned = starts[at++].second;
+      if (owned) out.append(src, pos, end - pos);
+      pos = end;
+      ++line;
+    }
+    try {
+      const Program check = parseSource(out);
+      if (check.top.empty() && check.f.size() == part.f.size()) return out;
+    } catch (const CompileError &) {
+    }
+    return std::nullopt;
+  }
+
+  static std::string literalOf(const Value &v) {
+    switch (v.t) {
+    case Type::I32: return "to_i32(" + std::to_string(v.i) + ")";
+    case Type::I64:
+      if (v.i == std::numeric_limits<int64_t>::min()) return "(-9223372036854775807 - 1)";
+      return std::to_string(v.i);
+    case Type::F32: return "to_f32(" + floatLiteral(v.f) + ")";
+    case Type::F64: return floatLiteral(v.f);
+    case Type::Bool: return v.i ? "true" : "false";
+    case Type::Str: {
+      std::string out = "\"";
+      for (char c : v.s) {
+        if (c == '\0') break;
+        switch (c) {
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        case '\\': out += "\\\\"; break;
+        case '"': out += "\\\""; break;
+        default: out.push_back(c); break;
+        }
+      }
+      return out + "\"";
+    }
+    case Type::Void:
+    case Type::F32x4:
+    case Type::F32x8:
+    case Type::F64x4:
+    case Type::I64x4: break; // vector builtins are Unsupported, so no Value ever holds one
+    }
+    return "0";
+  }
+  // Float literals have no exponent form, so values far from 1 (and inf/nan) go through parse_f64.
+  static std::string floatLiteral(double d) {
+    char b[64];
+    (void)std::snprintf(b, sizeof(b), "%.17g", d);
+    const std::string text(b);
+    if (!std::isfinite(d) || text.find_first_of("en") != std::string::npos) return "parse_f64(\"" + text + "\")";
+    return text.find('.') == std::string::npos ? text + ".0" : text;
+  }
+
+  static Value intValue(Type t, int64_t i) {
+    Value v;
+    v.t = t;
+    v.i = i;
+    return v;
+  }
+  static Value realValue(Type t, double f) {
+    Value v;
+    v.t = t;
+    v.f = t == Type::F32 ? static_cast<double>(static_cast<float>(f)) : f;
+    return v;
+  }
+  static Value boolValue(bool b) { return intValue(Type::Bool, b ? 1 : 0); }
+  static Value strValue(std::string s) {
+    Value v;
+    v.t = Type::Str;
+    v.s = std::move(s);
+    return v;
+  }
+  static int64_t wrap32(int64_t i) { return static_cast<int32_t>(static_cast<uint32_t>(static_cast<uint64_t>(i))); }
+  // Out-of-range float to integer conversions give INT_MIN, as cvttsd2si does.
+  static int64_t floatToI64(double f) {
+    if (!(f > -9223372036854775808.0 && f < 9223372036854775808.0)) return std::numeric_limits<int64_t>::min();
+    return static_cast<int64_t>(f);
+  }
+  static int64_t floatToI32(double f) {
+    if (!(f > -2147483649.0 && f < 2147483648.0)) return std::numeric_limits<int32_t>::min();
+    return static_cast<int32_t>(f);
+  }
+  static Value cast(Value v, Type to) {
+    if (v.t == to || v.t == Type::Str || to == Type::Str || to == Type::Void) return v;
+    const bool fromFloat = isFloat(v.t);
+    switch (to) {
+    case Type::I64: v.i = fromFloat ? floatToI64(v.f) : v.i; break;
+    case Type::I32: v.i = fromFloat ? floatToI32(v.f) : wrap32(v.i); break;
+    case Type::F64: v.f = fromFloat ? v.f : static_cast<double>(v.i); break;
+    case Type::F32:
+      v.f = fromFloat ? static_cast<double>(static_cast<float>(v.f)) : static_cast<double>(static_cast<float>(v.i));
+      break;
+    case Type::Bool: v.i = fromFloat ? (v.f != 0.0) : (v.i != 0); break;
+    default: break;
+    }
+    v.t = to;
+    return v;
+  }
+  static Value zeroOf(Type t) {
+    if (t == Type::Str) return strValue("");
+    if (isFloat(t)) return realValue(t, 0.0);
+    return intValue(t, 0);
+  }
+  static Type arithType(Type a, Type b) {
+    if (isFloat(a) || isFloat(b)) return (a == Type::F64 || b == Type::F64) ? Type::F64 : Type::F32;
+    return (a == Type::I64 || b == Type::I64) ? Type::I64 : Type::I32;
+  }
+  static double asDouble(const Value &v) { return isFloat(v.t) ? v.f : static_cast<double>(v.i); }
+  static int64_t asI64(const Value &v) { return cast(v, Type::I64).i; }
+  static std::string asCStr(const Value &v) {
+    const std::size_t nul = v.s.find('\0');
+    return nul == std::string::npos ? v.s : v.s.substr(0, nul);
+  }
+  static std::string formatValue(const Value &v) {
+    switch (v.t) {
+    case Type::F32:
+    case Type::F64: return formatShortestF64(v.f);
+    case Type::Bool: return v.i ? "true" : "false";
+    case Type::Str: return asCStr(v);
+    default: return std::to_string(v.i);
+    }
+  }
+
+  void step() {
+    if (++steps_ > kStepBudget) throw Unsupported{"long-running snippet"};
+  }
+
+  bool execute(const Program &p, std::size_t skip) {
+    fns_.clear();
+    const Fn *script = nullptr;
+    for (const Fn &f : p.f) {
+      fns_[f.n] = &f;
+      if (f.n == kScriptEntryName) script = &f;
+    }
+    vars_ = globals_;
+    frameBase_ = 0;
+    depth_ = 0;
+    steps_ = 0;
+    out_.clear();
+    try {
+      for (std::size_t i = skip; script && i < script->b.size(); ++i) {
+        if (exec(*script->b[i]) == Flow::Return) break;
+      }
+    } catch (const Unsupported &u) {
+      fallbackReason_ = u.why;
+      return false;
+    }
+    std::cout << out_ << std::flush;
+    globals_ = std::move(vars_);
+    vars_.clear();
+    return true;
+  }
+
+  Slot *lookup(const std::string &name) {
+    for (std::size_t i = vars_.size(); i > frameBase_; --i) {
+      if (vars_[i - 1].n == name) return &vars_[i - 1];
+    }
+    return nullptr;
+  }
+
+  Flow block(const std::vector<SP> &b) {
+    const std::size_t mark = vars_.size();
+    Flow flow = Flow::Next;
+    for (const SP &s : b) {
+      flow = exec(*s);
+      if (flow != Flow::Next) break;
+    }
+    vars_.resize(mark);
+    return flow;
+  }
+
+  Flow exec(const Stmt &s) {
+    step();
+    switch (s.k) {
+    case SK::Let: {
+      auto &n = static_cast<const SLet &>(s);
+      if (n.isOwned) throw Unsupported{"owned declarations"};
+      Value v = cast(eval(*n.v), n.inf);
+      vars_.push_back(Slot{n.n, std::move(v), n.isConst});
+      return Flow::Next;
+    }
+    case SK::Assign: {
+      auto &n = static_cast<const SAssign &>(s);
+      Value v = eval(*n.v);
+      Slot *slot = lookup(n.n);
+      if (!slot) throw Unsupported{"assignment to '" + n.n + "'"};
+      slot->v = cast(std::move(v), slot->v.t);
+      return Flow::Next;
+    }
+    case SK::Expr: eval(*static_cast<const SExpr &>(s).e); return Flow::Next;
+    case SK::Ret: {
+      auto &n = static_cast<const SRet &>(s);
+      ret_ = n.has && n.v ? eval(*n.v) : Value{};
+      return Flow::Return;
+    }
+    case SK::If: {
+      auto &n = static_cast<const SIf &>(s);
+      return block(eval(*n.c).i ? n.t : n.e);
+    }
+    case SK::While: {
+      auto &n = static_cast<const SWhile &>(s);
+      while (eval(*n.c).i) {
+        const Flow flow = block(n.b);
+        if (flow == Flow::Break) break;
+        if (flow == Flow::Return) return flow;
+      }
+      return Flow::Next;
+    }
+    case SK::For: {
+      // Parallel loops run sequentially: their bodies may only write reductions, whose result does not depend on order
+      // for integers.
+      auto &n = static_cast<const SFor &>(s);
+      const int64_t start = asI64(eval(*n.start));
+      const int64_t stop = asI64(eval(*n.stop));
+      const int64_t stride = asI64(eval(*n.step));
+      if (stride == 0) return Flow::Next;
+      const std::size_t mark = vars_.size();
+      vars_.push_back(Slot{n.n, intValue(Type::I64, start), false});
+      Flow result = Flow::Next;
+      while (true) {
+        const int64_t i = vars_[mark].v.i;
+        if (stride > 0 ? i >= stop : i <= stop) break;
+        const Flow flow = block(n.b);
+        if (flow == Flow::Break) break;
+        if (flow == Flow::Return) {
+          result = flow;
+          break;
+        }
+        step();
+        const int64_t cur = vars_[mark].v.i;
+        if ((stride > 0 && cur > std::numeric_limits<int64_t>::max() - stride) ||
+            (stride < 0 && cur < std::numeric_limits<int64_t>::min() - stride)) {
+          break;
+        }
+        vars_[mark].v.i = cur + stride;
+      }
+      vars_.resize(mark);
+      return result;
+    }
+    case SK::FormatBlock: throw Unsupported{"format blocks"};
+    case SK::Break: return Flow::Break;
+    case SK::Continue: return Flow::Continue;
+    }
+    return Flow::Next;
+  }
+
+  Value eval(const Expr &e) {
+    switch (e.k) {
+    case EK::Int: return intValue(Type::I64, static_cast<const EInt &>(e).v);
+    case EK::Float: return realValue(Type::F64, static_cast<const EFloat &>(e).v);
+    case EK::Bool: return boolValue(static_cast<const EBool &>(e).v);
+    case EK::Str: return strValue(static_cast<const EString &>(e).v);
+    case EK::Var: {
+      auto &n = static_cast<const EVar &>(e);
+      const Slot *slot = lookup(n.n);
+      if (!slot) throw Unsupported{"variable '" + n.n + "'"};
+      return slot->v;
+    }
+    case EK::Unary: {
+      auto &n = static_cast<const EUnary &>(e);
+      if (!n.overrideFn.empty()) {
+        std::vector<Value> args;
+        args.push_back(eval(*n.x));
+        return callNamed(n.overrideFn, std::move(args));
+      }
+      Value x = eval(*n.x);
+      if (n.op == UK::Not) return intValue(Type::I32, !x.i);
+      if (isFloat(x.t)) return realValue(x.t, -x.f);
+      const int64_t neg = static_cast<int64_t>(0ULL - static_cast<uint64_t>(x.i));
+      return intValue(x.t, x.t == Type::I32 ? wrap32(neg) : neg);
+    }
+    case EK::Binary: return binary(static_cast<const EBinary &>(e));
+    case EK::Call: return call(static_cast<const ECall &>(e));
+    }
+    return Value{};
+  }
+
+  Value binary(const EBinary &n) {
+    if (!n.overrideFn.empty()) {
+      std::vector<Value> args;
+      args.push_back(eval(*n.l));
+      args.push_back(eval(*n.r));
+      return callNamed(n.overrideFn, std::move(args));
+    }
+    // C comparisons and logical operators yield int, which prints as a number; only the string helpers return
+    // ls_bool, except `!=` against a literal, which is emitted as a negated ls_str_eq_lit.
+    auto truth = [](bool b) { return intValue(Type::I32, b ? 1 : 0); };
+    if (n.op == BK::And) return truth(eval(*n.l).i && eval(*n.r).i);
+    if (n.op == BK::Or) return truth(eval(*n.l).i || eval(*n.r).i);
+    Value a = eval(*n.l);
+    Value b = eval(*n.r);
+    switch (n.op) {
+    case BK::Eq:
+    case BK::Neq:
+    case BK::Lt:
+    case BK::Lte:
+    case BK::Gt:
+    case BK::Gte: {
+      if (a.t == Type::Str && b.t == Type::Str) {
+        const bool same = asCStr(a) == asCStr(b);
+        if (n.op == BK::Eq) return boolValue(same);
+        const bool againstLiteral = (n.l->k == EK::Str) != (n.r->k == EK::Str);
+        return againstLiteral ? truth(!same) : boolValue(!same);
+      }
+      int c = 0;
+      const Type t = arithType(a.t, b.t);
+      a = cast(std::move(a), t);
+      b = cast(std::move(b), t);
+      if (isFloat(t)) {
+        if (a.f != a.f || b.f != b.f) return truth(n.op == BK::Neq);
+        c = a.f < b.f ? -1 : (a.f > b.f ? 1 : 0);
+      } else {
+        c = a.i < b.i ? -1 : (a.i > b.i ? 1 : 0);
+      }
+      switch (n.op) {
+      case BK::Eq: return truth(c == 0);
+      case BK::Neq: return truth(c != 0);
+      case BK::Lt: return truth(c < 0);
+      case BK::Lte: return truth(c <= 0);
+      case BK::Gt: return truth(c > 0);
+      default: return truth(c >= 0);
+      }
     }
-    if (c == '/' && i + 1 < n && snippet[i + 1] == '/') {
-      while (i < n) {
-        out.push_back(snippet[i]);
-        if (snippet[i] == '\n') {
-          ++i;
-          break;
-        }
-        ++i;
+    case BK::Pow: {
+      if (isFloat(a.t) || isFloat(b.t)) return realValue(Type::F64, std::pow(asDouble(a), asDouble(b)));
+      uint64_t base = static_cast<uint64_t>(a.i);
+      int64_t exp = b.i;
+      uint64_t out = 1;
+      if (exp < 0) return intValue(Type::I64, 0);
+      while (exp > 0) {
+        if (exp & 1) out *= base;
+        exp >>= 1;
+        if (exp > 0) base *= base;
       }
-      continue;
+      return intValue(Type::I64, static_cast<int64_t>(out));
     }
-    if (c == '"') {
-      out.push_back(c);
-      inStr = true;
-      ++i;
-      continue;
+    default: break;
     }
-    if (replIsIdentStart(c)) {
-      std::size_t j = i + 1;
-      while (j < n && replIsIdentChar(snippet[j])) ++j;
-      const std::string tok = snippet.substr(i, j - i);
-      if (tok == "print") {
-        std::size_t k = j;
-        while (k < n && (snippet[k] == ' ' || snippet[k] == '\t' || snippet[k] == '\r')) ++k;
-        if (k < n && snippet[k] == '(') {
-          out += "println";
-          i = j;
-          continue;
-        }
+    const Type t = arithType(a.t, b.t);
+    a = cast(std::move(a), t);
+    b = cast(std::move(b), t);
+    if (isFloat(t)) {
+      switch (n.op) {
+      case BK::Add: return realValue(t, a.f + b.f);
+      case BK::Sub: return realValue(t, a.f - b.f);
+      case BK::Mul: return realValue(t, a.f * b.f);
+      case BK::Div: return realValue(t, a.f / b.f);
+      default: return realValue(t, std::fmod(a.f, b.f));
       }
-      out += tok;
-      i = j;
-      continue;
     }
-    out.push_back(c);
-    ++i;
+    const uint64_t ua = static_cast<uint64_t>(a.i);
+    const uint64_t ub = static_cast<uint64_t>(b.i);
+    int64_t r = 0;
+    switch (n.op) {
+    case BK::Add: r = static_cast<int64_t>(ua + ub); break;
+    case BK::Sub: r = static_cast<int64_t>(ua - ub); break;
+    case BK::Mul: r = static_cast<int64_t>(ua * ub); break;
+    default: {
+      if (b.i == 0) throw RuntimeFault{n.s, n.op == BK::Div ? "integer division by zero" : "integer modulo by zero"};
+      const int64_t lowest =
+          t == Type::I32 ? std::numeric_limits<int32_t>::min() : std::numeric_limits<int64_t>::min();
+      if (a.i == lowest && b.i == -1) throw RuntimeFault{n.s, "integer overflow in division"};
+      r = n.op == BK::Div ? a.i / b.i : a.i % b.i;
+      break;
+    }
+    }
+    return intValue(t, t == Type::I32 ? wrap32(r) : r);
   }
-  return out;
-}
 
-static std::string replUserName() {
-#if defined(_WIN32)
-  char *buf = nullptr;
-  std::size_t n = 0;
-  if (_dupenv_s(&buf, &n, "USERNAME") == 0 && buf != nullptr && *buf != '\0') {
-    std::string name(buf);
-    std::free(buf);
-    return name;
+  Value callNamed(const std::string &name, std::vector<Value> args) {
+    auto it = fns_.find(name);
+    if (it == fns_.end() || it->second->ex) throw Unsupported{"calls '" + name + "'"};
+    const Fn &f = *it->second;
+    if (f.p.size() != args.size()) throw Unsupported{"calls '" + name + "'"};
+    if (++depth_ > kMaxCallDepth) throw Unsupported{"deep recursion"};
+    step();
+    const std::size_t savedBase = frameBase_;
+    const std::size_t base = vars_.size();
+    for (std::size_t i = 0; i < args.size(); ++i) vars_.push_back(Slot{f.p[i].n, cast(std::move(args[i]), f.p[i].t), false});
+    frameBase_ = base;
+    Value out = block(f.b) == Flow::Return ? std::move(ret_) : zeroOf(f.ret);
+    vars_.resize(base);
+    frameBase_ = savedBase;
+    --depth_;
+    return f.ret == Type::Void ? Value{} : cast(std::move(out), f.ret);
   }
-  if (buf != nullptr) std::free(buf);
-  buf = nullptr;
-  n = 0;
-  if (_dupenv_s(&buf, &n, "USER") == 0 && buf != nullptr && *buf != '\0') {
-    std::string name(buf);
-    std::free(buf);
-    return name;
+
+  static const std::unordered_map<std::string, Builtin> &builtins() {
+    static const std::unordered_map<std::string, Builtin> kBuiltins = {
+        {"print", Builtin::Print},           {"println", Builtin::Println},
+        {"print_i64", Builtin::PrintI64},    {"print_f64", Builtin::PrintF64},
+        {"print_bool", Builtin::PrintBool},  {"print_str", Builtin::PrintStr},
+        {"println_i64", Builtin::PrintlnI64}, {"println_f64", Builtin::PrintlnF64},
+        {"println_bool", Builtin::PrintlnBool}, {"println_str", Builtin::PrintlnStr},
+        {"formatOutput", Builtin::Format},   {"FormatOutput", Builtin::Format},
+        {"flush", Builtin::Flush},
+        {"max", Builtin::Max},               {"min", Builtin::Min},
+        {"abs", Builtin::Abs},               {"clamp", Builtin::Clamp},
+        {"max_i64", Builtin::MaxI64},        {"min_i64", Builtin::MinI64},
+        {"abs_i64", Builtin::AbsI64},        {"clamp_i64", Builtin::ClampI64},
+        {"max_f64", Builtin::MaxF64},        {"min_f64", Builtin::MinF64},
+        {"abs_f64", Builtin::AbsF64},        {"clamp_f64", Builtin::ClampF64},
+        {"gcd", Builtin::Gcd},               {"lcm", Builtin::Lcm},
+        {"pi", Builtin::Pi},                 {"tau", Builtin::Tau},
+        {"deg_to_rad", Builtin::DegToRad},   {"rad_to_deg", Builtin::RadToDeg},
+        {"sqrt", Builtin::Sqrt},             {"sin", Builtin::Sin},
+        {"cos", Builtin::Cos},               {"tan", Builtin::Tan},
+        {"asin", Builtin::Asin},             {"acos", Builtin::Acos},
+        {"atan", Builtin::Atan},             {"atan2", Builtin::Atan2},
+        {"exp", Builtin::Exp},               {"log", Builtin::Log},
+        {"log10", Builtin::Log10},           {"floor", Builtin::Floor},
+        {"ceil", Builtin::Ceil},             {"round", Builtin::Round},
+        {"pow", Builtin::Pow},               {"to_i32", Builtin::ToI32},
+        {"to_f32", Builtin::ToF32},          {"to_i64", Builtin::ToI64},
+        {"to_f64", Builtin::ToF64},          {"bool_to_i64", Builtin::BoolToI64},
+        {"i64_to_bool", Builtin::I64ToBool}, {"parse_i64", Builtin::ParseI64},
+        {"parse_f64", Builtin::ParseF64},    {"len", Builtin::Len},
+        {"bytes_len", Builtin::Len},         {"is_empty", Builtin::IsEmpty},
+        {"includes", Builtin::Contains},     {"contains", Builtin::Contains},
+        {"starts_with", Builtin::StartsWith}, {"ends_with", Builtin::EndsWith},
+        {"find", Builtin::Find},             {"replace", Builtin::Replace},
+        {"trim", Builtin::Trim},             {"lower", Builtin::Lower},
+        {"upper", Builtin::Upper},           {"substring", Builtin::Substring},
+        {"repeat", Builtin::Repeat},         {"reverse", Builtin::Reverse},
+        {"byte_at", Builtin::ByteAt},        {"ord", Builtin::Ord},
+        {"chr", Builtin::Chr},
+    };
+    return kBuiltins;
   }
-  if (buf != nullptr) std::free(buf);
+
+  static uint64_t absU64(int64_t v) { return v < 0 ? 0ULL - static_cast<uint64_t>(v) : static_cast<uint64_t>(v); }
+  static int64_t gcdI64(int64_t a, int64_t b) {
+    uint64_t ua = absU64(a);
+    uint64_t ub = absU64(b);
+    while (ub != 0) {
+      const uint64_t t = ua % ub;
+      ua = ub;
+      ub = t;
+    }
+    return ua > static_cast<uint64_t>(std::numeric_limits<int64_t>::max()) ? std::numeric_limits<int64_t>::max()
+                                                                            : static_cast<int64_t>(ua);
+  }
+
+  Value call(const ECall &n) {
+    std::vector<Value> args;
+    args.reserve(n.a.size());
+    for (const EP &a : n.a) args.push_back(eval(*a));
+    if (fns_.count(n.f)) return callNamed(n.f, std::move(args));
+    auto it = builtins().find(n.f);
+    if (it == builtins().end()) throw Unsupported{"calls '" + n.f + "'"};
+    return builtin(it->second, args);
+  }
+
+  Value builtin(Builtin op, const std::vector<Value> &args) {
+    auto f64 = [&](std::size_t i) { return asDouble(args[i]); };
+    auto i64 = [&](std::size_t i) { return asI64(args[i]); };
+    auto str = [&](std::size_t i) { return asCStr(args[i]); };
+    auto real = [](double d) { return realValue(Type::F64, d); };
+    auto whole = [](int64_t i) { return intValue(Type::I64, i); };
+    auto anyFloat = [&]() {
+      for (const Value &v : args) {
+        if (isFloat(v.t)) return true;
+      }
+      return false;
+    };
+    switch (op) {
+    case Builtin::Print: out_ += formatValue(args[0]); return Value{};
+    case Builtin::Println: out_ += formatValue(args[0]) + "\n"; return Value{};
+    case Builtin::PrintI64: out_ += std::to_string(i64(0)); return Value{};
+    case Builtin::PrintF64: out_ += formatValue(real(f64(0))); return Value{};
+    case Builtin::PrintBool: out_ += args[0].i ? "true" : "false"; return Value{};
+    case Builtin::PrintStr: out_ += str(0); return Value{};
+    case Builtin::PrintlnI64: out_ += std::to_string(i64(0)) + "\n"; return Value{};
+    case Builtin::PrintlnF64: out_ += formatValue(real(f64(0))) + "\n"; return Value{};
+    case Builtin::PrintlnBool: out_ += args[0].i ? "true\n" : "false\n"; return Value{};
+    case Builtin::PrintlnStr: out_ += str(0) + "\n"; return Value{};
+    case Builtin::Format: return strValue(formatValue(args[0]));
+    case Builtin::Flush: return Value{};
+    case Builtin::Max: return anyFloat() ? real(std::fmax(f64(0), f64(1))) : whole(std::max(i64(0), i64(1)));
+    case Builtin::Min: return anyFloat() ? real(std::fmin(f64(0), f64(1))) : whole(std::min(i64(0), i64(1)));
+    case Builtin::Abs:
+      return anyFloat() ? real(std::fabs(f64(0))) : whole(static_cast<int64_t>(absU64(i64(0))));
+    case Builtin::Clamp:
+      if (anyFloat()) {
+        const double x = f64(0), lo = f64(1), hi = f64(2);
+        return real(x < lo ? lo : (x > hi ? hi : x));
+      } else {
+        const int64_t x = i64(0), lo = i64(1), hi = i64(2);
+        return whole(x < lo ? lo : (x > hi ? hi : x));
+      }
+    case Builtin::MaxI64: return whole(std::max(i64(0), i64(1)));
+    case Builtin::MinI64: return whole(std::min(i64(0), i64(1)));
+    case Builtin::AbsI64: return whole(static_cast<int64_t>(absU64(i64(0))));
+    case Builtin::ClampI64: {
+      const int64_t x = i64(0), lo = i64(1), hi = i64(2);
+      return whole(x < lo ? lo : (x > hi ? hi : x));
+    }
+    case Builtin::MaxF64: return real(std::fmax(f64(0), f64(1)));
+    case Builtin::MinF64: return real(std::fmin(f64(0), f64(1)));
+    case Builtin::AbsF64: return real(std::fabs(f64(0)));
+    case Builtin::ClampF64: {
+      const double x = f64(0), lo = f64(1), hi = f64(2);
+      return real(x < lo ? lo : (x > hi ? hi : x));
+    }
+    case Builtin::Gcd: return whole(gcdI64(i64(0), i64(1)));
+    case Builtin::Lcm: {
+#if LS_HOST_NO_INT128
+      throw Unsupported{"calls 'lcm'"};
 #else
-  const char *name = std::getenv("USERNAME");
-  if (name != nullptr && *name != '\0') return std::string(name);
-  name = std::getenv("USER");
-  if (name != nullptr && *name != '\0') return std::string(name);
+      const int64_t a = i64(0), b = i64(1);
+      if (a == 0 || b == 0) return whole(0);
+      const int64_t g = gcdI64(a, b);
+      __int128 m = (static_cast<__int128>(a) / g) * b;
+      if (m < 0) m = -m;
+      return whole(m > std::numeric_limits<int64_t>::max() ? std::numeric_limits<int64_t>::max()
+                                                          : static_cast<int64_t>(m));
 #endif
-  return "user";
-}
+    }
+    case Builtin::Pi: return real(3.14159265358979323846264338327950288);
+    case Builtin::Tau: return real(6.28318530717958647692528676655900576);
+    case Builtin::DegToRad: return real(f64(0) * (3.14159265358979323846264338327950288 / 180.0));
+    case Builtin::RadToDeg: return real(f64(0) * (180.0 / 3.14159265358979323846264338327950288));
+    case Builtin::Sqrt: return real(std::sqrt(f64(0)));
+    case Builtin::Sin: return real(std::sin(f64(0)));
+    case Builtin::Cos: return real(std::cos(f64(0)));
+    case Builtin::Tan: return real(std::tan(f64(0)));
+    case Builtin::Asin: return real(std::asin(f64(0)));
+    case Builtin::Acos: return real(std::acos(f64(0)));
+    case Builtin::Atan: return real(std::atan(f64(0)));
+    case Builtin::Atan2: return real(std::atan2(f64(0), f64(1)));
+    case Builtin::Exp: return real(std::exp(f64(0)));
+    case Builtin::Log: return real(std::log(f64(0)));
+    case Builtin::Log10: return real(std::log10(f64(0)));
+    case Builtin::Floor: return real(std::floor(f64(0)));
+    case Builtin::Ceil: return real(std::ceil(f64(0)));
+    case Builtin::Round: return real(std::round(f64(0)));
+    case Builtin::Pow: return real(std::pow(f64(0), f64(1)));
+    case Builtin::ToI32: return cast(whole(i64(0)), Type::I32);
+    case Builtin::ToF32: return realValue(Type::F32, f64(0));
+    case Builtin::ToI64: return whole(floatToI64(f64(0)));
+    case Builtin::ToF64: return real(static_cast<double>(i64(0)));
+    case Builtin::BoolToI64: return whole(args[0].i ? 1 : 0);
+    case Builtin::I64ToBool: return boolValue(i64(0) != 0);
+    case Builtin::ParseI64: {
+      const std::string s = str(0);
+      std::size_t p = 0;
+      while (p < s.size() && std::isspace(static_cast<unsigned char>(s[p]))) ++p;
+      bool neg = false;
+      if (p < s.size() && (s[p] == '-' || s[p] == '+')) neg = s[p++] == '-';
+      const uint64_t limit = neg ? 9223372036854775808ULL : 9223372036854775807ULL;
+      uint64_t out = 0;
+      for (; p < s.size() && s[p] >= '0' && s[p] <= '9'; ++p) {
+        const uint64_t d = static_cast<uint64_t>(s[p] - '0');
+        if (out > (limit - d) / 10) {
+          return whole(neg ? std::numeric_limits<int64_t>::min() : std::numeric_limits<int64_t>::max());
+        }
+        out = out * 10 + d;
+      }
+      return whole(neg ? static_cast<int64_t>(0ULL - out) : static_cast<int64_t>(out));
+    }
+    case Builtin::ParseF64: return real(std::strtod(str(0).c_str(), nullptr));
+    case Builtin::Len: return whole(static_cast<int64_t>(args[0].s.size()));
+    case Builtin::IsEmpty: return boolValue(args[0].s.empty());
+    case Builtin::Contains: return boolValue(str(0).find(str(1)) != std::string::npos);
+    case Builtin::StartsWith: return boolValue(str(0).compare(0, str(1).size(), str(1)) == 0);
+    case Builtin::EndsWith: {
+      const std::string s = str(0), suffix = str(1);
+      return boolValue(suffix.size() <= s.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0);
+    }
+    case Builtin::Find: {
+      const std::size_t at = str(0).find(str(1));
+      return whole(at == std::string::npos ? -1 : static_cast<int64_t>(at));
+    }
+    case Builtin::Replace: {
+      const std::string s = str(0), from = str(1), to = str(2);
+      if (from.empty()) return strValue(s);
+      std::string out;
+      std::size_t pos = 0;
+      for (std::size_t at = s.find(from); at != std::string::npos; at = s.find(from, pos)) {
+        out.append(s, pos, at - pos);
+        out += to;
+        pos = at + from.size();
+      }
+      out.append(s, pos, std::string::npos);
+      return strValue(std::move(out));
+    }
+    case Builtin::Trim: {
+      const std::string &s = args[0].s;
+      std::size_t b = 0, e = s.size();
+      while (b < e && std::isspace(static_cast<unsigned char>(s[b]))) ++b;
+      while (e > b && std::isspace(static_cast<unsigned char>(s[e - 1]))) --e;
+      return strValue(s.substr(b, e - b));
+    }
+    case Builtin::Lower:
+    case Builtin::Upper: {
+      std::string s = args[0].s;
+      for (char &c : s) {
+        const unsigned char u = static_cast<unsigned char>(c);
+        c = static_cast<char>(op == Builtin::Lower ? std::tolower(u) : std::toupper(u));
+      }
+      return strValue(std::move(s));
+    }
+    case Builtin::Substring: {
+      const std::string &s = args[0].s;
+      const int64_t size = static_cast<int64_t>(s.size());
+      int64_t start = i64(1), count = i64(2);
+      start = std::min(std::max<int64_t>(start, 0), size);
+      count = std::min(std::max<int64_t>(count, 0), size - start);
+      return strValue(s.substr(static_cast<std::size_t>(start), static_cast<std::size_t>(count)));
+    }
+    case Builtin::Repeat: {
+      const std::string &s = args[0].s;
+      const int64_t times = i64(1);
+      if (times <= 0 || s.empty()) return strValue("");
+      if (static_cast<uint64_t>(times) > (64ULL << 20) / s.size()) throw Unsupported{"calls 'repeat'"};
+      std::string out;
+      out.reserve(s.size() * static_cast<std::size_t>(times));
+      for (int64_t i = 0; i < times; ++i) out += s;
+      return strValue(std::move(out));
+    }
+    case Builtin::Reverse: return strValue(std::string(args[0].s.rbegin(), args[0].s.rend()));
+    case Builtin::ByteAt: {
+      const std::string &s = args[0].s;
+      const int64_t idx = i64(1);
+      if (idx < 0 || idx >= static_cast<int64_t>(s.size())) return whole(-1);
+      return whole(static_cast<unsigned char>(s[static_cast<std::size_t>(idx)]));
+    }
+    case Builtin::Ord: {
+      const std::string s = str(0);
+      return whole(s.empty() ? -1 : static_cast<unsigned char>(s[0]));
+    }
+    case Builtin::Chr: {
+      const int64_t code = i64(0);
+      if (code < 0 || code > 255) return strValue("");
+      return strValue(std::string(1, static_cast<char>(code)));
+    }
+    }
+    return Value{};
+  }
+};
 
 static int runRepl(const Opt &o, const std::string &argv0) {
   std::string prelude;
@@ -12246,6 +21168,11 @@ static int runRepl(const Opt &o, const std::string &argv0) {
   replBin += ".exe";
 #endif
 
+  // Snippets run in-process until one needs the compiled path; from then on every snippet is compiled with the
+  // session replayed from `persisted` (seeded with a snapshot of the live state) until :reset.
+  ReplInterpreter live;
+  bool compiled = false;
+  bool preludeCompiled = true;
   std::vector<std::string> persisted;
   std::string pending;
   int depth = 0;
@@ -12257,6 +21184,14 @@ static int runRepl(const Opt &o, const std::string &argv0) {
   std::cout << "Type :help for commands, :exit to quit.\n";
   std::cout.flush();
 
+  auto startSession = [&]() {
+    live.reset();
+    persisted.clear();
+    preludeCompiled = true;
+    compiled = !prelude.empty() && (replContainsSuperuser(prelude) || live.run(prelude) != ReplInterpreter::Result::Ok);
+  };
+  startSession();
+
   auto renderPrompt = [&]() {
     if (depth > 0) return std::string("... ");
     const std::string who = superuserSession ? "superuser" : baseUser;
@@ -12286,7 +21221,7 @@ static int runRepl(const Opt &o, const std::string &argv0) {
         continue;
       }
       if (t == ":reset") {
-        persisted.clear();
+        startSession();
         pending.clear();
         depth = 0;
         superuserSession = false;
@@ -12318,80 +21253,714 @@ static int runRepl(const Opt &o, const std::string &argv0) {
         if (!superuserSession) {
           std::cerr << "Not privileged: enable superuser() first\n";
         } else {
-          superuserVerbosity = requestedVerbosity;
-          std::cerr << "[superuser][repl] verbosity set to " << superuserVerbosity << "\n";
+          superuserVerbosity = requestedVerbosity;
+          std::cerr << "[superuser][repl] verbosity set to " << superuserVerbosity << "\n";
+        }
+        continue;
+      }
+    }
+
+    pending += line;
+    pending.push_back('\n');
+    depth += replBlockDeltaLine(line);
+    if (depth > 0) continue;
+    if (depth < 0) {
+      std::cerr << "REPL warning: unmatched 'end' or '}'\n";
+      pending.clear();
+      depth = 0;
+      continue;
+    }
+
+    const std::string snippet = trimCopy(pending);
+    pending.clear();
+    if (snippet.empty()) continue;
+    if (replIsSuperuserToggleCommand(snippet)) {
+      superuserSession = !superuserSession;
+      if (superuserSession) {
+        superuserVerbosity = 3;
+        std::cerr << "Warning: superuser() enabled. LineScript error safety guards are disabled; input will be "
+                     "attempted even if it is bad, malformed, or otherwise invalid.\n";
+        std::cerr << "[superuser][repl] session enabled\n";
+      } else {
+        std::cerr << "[superuser][repl] session disabled; back to normal user\n";
+      }
+      continue;
+    }
+    const bool hasSuperuser = replContainsSuperuser(snippet);
+    const std::string replSnippet = replRewritePrintAsPrintln(snippet);
+    if (!compiled) {
+      if (!superuserSession && !hasSuperuser) {
+        const ReplInterpreter::Result r = live.run(replSnippet);
+        if (r == ReplInterpreter::Result::Ok) continue;
+        if (r == ReplInterpreter::Result::Failed) {
+          std::cerr << "REPL: command failed; session state unchanged.\n";
+          continue;
+        }
+      }
+      const std::string why = superuserSession || hasSuperuser ? "superuser session" : live.fallbackReason();
+      std::cerr << "REPL: switching to compiled evaluation (" << why << "); :reset returns to in-process evaluation.\n";
+      persisted.assign(1, live.snapshotSource());
+      preludeCompiled = false;
+      compiled = true;
+    }
+
+    std::ostringstream src;
+    src << ".format()\n";
+    if (preludeCompiled) src << prelude;
+    for (const std::string &s : persisted) {
+      src << s;
+      if (s.empty() || s.back() != '\n') src << '\n';
+    }
+    src << replSnippet << '\n';
+    writeFile(replSrc, src.str());
+
+    std::ostringstream cmd;
+    cmd << qCmd(argv0) << " " << q(replSrc) << " --run --cc " << qCmd(o.cc) << " --backend " << o.backend
+        << " --passes " << o.passes << " -o " << q(replBin);
+    if (o.maxSpeed) cmd << " -O4";
+    if (superuserSession) cmd << " --su-session --su-verbosity " << superuserVerbosity;
+
+    if (superuserSession && superuserVerbosity >= 5) {
+      std::cerr << "[superuser][repl] snippet:\n" << replSnippet << "\n";
+    }
+    if (superuserSession && superuserVerbosity >= 4) {
+      std::cerr << "[superuser][repl] command: " << cmd.str() << "\n";
+    }
+
+    const int rc = std::system(cmd.str().c_str());
+    if (rc == 0) {
+      if (!hasSuperuser && replShouldPersist(snippet)) {
+        persisted.push_back(snippet);
+      }
+      if (hasSuperuser) superuserSession = true;
+    } else {
+      std::cerr << "REPL: command failed; session state unchanged.\n";
+    }
+  }
+
+  std::error_code ec;
+  std::filesystem::remove(replSrc, ec);
+  std::filesystem::remove(replBin, ec);
+  return 0;
+}
+
+// JSON value and parser for the --serve protocol (one JSON-RPC 2.0 message per line).
+struct JsonValue {
+  enum class Kind { Null, Bool, Number, String, Array, Object };
+  Kind kind = Kind::Null;
+  bool b = false;
+  double num = 0.0;
+  std::string str;
+  std::vector<JsonValue> arr;
+  std::vector<std::pair<std::string, JsonValue>> obj;
+  const JsonValue *get(const std::string &key) const {
+    if (kind != Kind::Object) return nullptr;
+    for (const auto &kv : obj) {
+      if (kv.first == key) return &kv.second;
+    }
+    return nullptr;
+  }
+  std::string stringOr(const std::string &key, const std::string &fallback) const {
+    const JsonValue *v = get(key);
+    return v && v->kind == Kind::String ? v->str : fallback;
+  }
+};
+class JsonParser {
+public:
+  explicit JsonParser(const std::string &text) : s_(text) {}
+  JsonValue parse() {
+    JsonValue v = value(0);
+    ws();
+    if (i_ != s_.size()) fail("trailing characters");
+    return v;
+  }
+
+private:
+  const std::string &s_;
+  std::size_t i_ = 0;
+
+  [[noreturn]] void fail(const std::string &m) const {
+    throw std::runtime_error("invalid JSON at offset " + std::to_string(i_) + ": " + m);
+  }
+  void ws() {
+    while (i_ < s_.size() && (s_[i_] == ' ' || s_[i_] == '\t' || s_[i_] == '\n' || s_[i_] == '\r')) ++i_;
+  }
+  bool lit(const char *word) {
+    const std::size_t n = std::strlen(word);
+    if (s_.compare(i_, n, word) != 0) return false;
+    i_ += n;
+    return true;
+  }
+  static void putUtf8(std::string &out, uint32_t cp) {
+    if (cp < 0x80) {
+      out.push_back(static_cast<char>(cp));
+    } else if (cp < 0x800) {
+      out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+      out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+      out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+      out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else {
+      out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+      out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+  }
+  uint32_t hex4() {
+    if (i_ + 4 > s_.size()) fail("truncated \\u escape");
+    uint32_t v = 0;
+    for (int k = 0; k < 4; ++k) {
+      const char c = s_[i_++];
+      v <<= 4;
+      if (c >= '0' && c <= '9') {
+        v |= static_cast<uint32_t>(c - '0');
+      } else if (c >= 'a' && c <= 'f') {
+        v |= static_cast<uint32_t>(c - 'a' + 10);
+      } else if (c >= 'A' && c <= 'F') {
+        v |= static_cast<uint32_t>(c - 'A' + 10);
+      } else {
+        fail("bad \\u escape");
+      }
+    }
+    return v;
+  }
+  std::string string() {
+    ++i_;
+    std::string out;
+    while (true) {
+      if (i_ >= s_.size()) fail("unterminated string");
+      const char c = s_[i_++];
+      if (c == '"') return out;
+      if (c != '\\') {
+        out.push_back(c);
+        continue;
+      }
+      if (i_ >= s_.size()) fail("unterminated string");
+      const char e = s_[i_++];
+      switch (e) {
+      case '"': out.push_back('"'); break;
+      case '\\': out.push_back('\\'); break;
+      case '/': out.push_back('/'); break;
+      case 'b': out.push_back('\b'); break;
+      case 'f': out.push_back('\f'); break;
+      case 'n': out.push_back('\n'); break;
+      case 'r': out.push_back('\r'); break;
+      case 't': out.push_back('\t'); break;
+      case 'u': {
+        uint32_t cp = hex4();
+        if (cp >= 0xD800 && cp < 0xDC00 && s_.compare(i_, 2, "\\u") == 0) {
+          i_ += 2;
+          const uint32_t lo = hex4();
+          cp = (lo >= 0xDC00 && lo < 0xE000) ? 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00) : 0xFFFD;
+        }
+        putUtf8(out, cp);
+        break;
+      }
+      default: fail("bad escape");
+      }
+    }
+  }
+  JsonValue value(int depth) {
+    if (depth > 64) fail("nesting too deep");
+    ws();
+    if (i_ >= s_.size()) fail("unexpected end");
+    JsonValue v;
+    const char c = s_[i_];
+    if (c == '{') {
+      v.kind = JsonValue::Kind::Object;
+      ++i_;
+      ws();
+      if (i_ < s_.size() && s_[i_] == '}') {
+        ++i_;
+        return v;
+      }
+      while (true) {
+        ws();
+        if (i_ >= s_.size() || s_[i_] != '"') fail("expected object key");
+        std::string key = string();
+        ws();
+        if (i_ >= s_.size() || s_[i_] != ':') fail("expected ':'");
+        ++i_;
+        v.obj.emplace_back(std::move(key), value(depth + 1));
+        ws();
+        if (i_ < s_.size() && s_[i_] == ',') {
+          ++i_;
+          continue;
+        }
+        if (i_ < s_.size() && s_[i_] == '}') {
+          ++i_;
+          return v;
+        }
+        fail("expected ',' or '}'");
+      }
+    }
+    if (c == '[') {
+      v.kind = JsonValue::Kind::Array;
+      ++i_;
+      ws();
+      if (i_ < s_.size() && s_[i_] == ']') {
+        ++i_;
+        return v;
+      }
+      while (true) {
+        v.arr.push_back(value(depth + 1));
+        ws();
+        if (i_ < s_.size() && s_[i_] == ',') {
+          ++i_;
+          continue;
+        }
+        if (i_ < s_.size() && s_[i_] == ']') {
+          ++i_;
+          return v;
+        }
+        fail("expected ',' or ']'");
+      }
+    }
+    if (c == '"') {
+      v.kind = JsonValue::Kind::String;
+      v.str = string();
+      return v;
+    }
+    if (lit("true")) {
+      v.kind = JsonValue::Kind::Bool;
+      v.b = true;
+      return v;
+    }
+    if (lit("false")) {
+      v.kind = JsonValue::Kind::Bool;
+      return v;
+    }
+    if (lit("null")) return v;
+    const std::size_t start = i_;
+    while (i_ < s_.size() && (std::isdigit(static_cast<unsigned char>(s_[i_])) || s_[i_] == '-' || s_[i_] == '+' ||
+                              s_[i_] == '.' || s_[i_] == 'e' || s_[i_] == 'E')) {
+      ++i_;
+    }
+    if (start == i_) fail("unexpected character");
+    v.kind = JsonValue::Kind::Number;
+    v.num = std::strtod(s_.substr(start, i_ - start).c_str(), nullptr);
+    return v;
+  }
+};
+// Request ids are echoed back verbatim; only scalar ids are meaningful in JSON-RPC.
+static std::string jsonScalarText(const JsonValue &v) {
+  switch (v.kind) {
+  case JsonValue::Kind::Bool: return v.b ? "true" : "false";
+  case JsonValue::Kind::Number: {
+    std::ostringstream o;
+    o << std::setprecision(17) << v.num;
+    return o.str();
+  }
+  case JsonValue::Kind::String: return "\"" + jsonEscape(v.str) + "\"";
+  case JsonValue::Kind::Null:
+  case JsonValue::Kind::Array:
+  case JsonValue::Kind::Object: break;
+  }
+  return "null";
+}
+
+// `lsc --serve`: a long-running check daemon for editors. Requests and responses are JSON-RPC 2.0 objects, one
+// per line on stdin/stdout:
+//   initialize                      -> server name/version
+//   didOpen / didChange {file,text} -> keep `text` as the file's contents (unsaved buffers); as a request,
+//                                      also re-check every known project containing `file`
+//   didClose {file}                 -> drop the buffer and read the file from disk again
+//   check {files:[...]}             -> {files, ok, diagnostics:[{file,line,col,severity,message}], stats}
+//   shutdown / exit
+// Each file's parsed AST is kept under the hash of its text, so only edited files are lexed and parsed again.
+// Each function's type-check result is kept under its AST plus the signatures of the functions it calls, so a
+// body edit re-checks that function only, and a signature edit re-checks its callers. Diagnostics match
+// `lsc --check` up to type checking; the optimizer and the post-optimization re-check are not run.
+class CheckServer {
+public:
+  int run(std::istream &in, std::ostream &out) {
+    std::string line;
+    while (!exit_ && std::getline(in, line)) {
+      if (!line.empty() && line.back() == '\r') line.pop_back();
+      if (line.find_first_not_of(" \t") == std::string::npos) continue;
+      std::string reply;
+      try {
+        reply = handle(JsonParser(line).parse());
+      } catch (const std::exception &e) {
+        reply = errorReply("null", -32700, e.what());
+      }
+      if (!reply.empty()) out << reply << '\n' << std::flush;
+    }
+    return 0;
+  }
+
+private:
+  // What a check needs from a function without decoding its file: the signature (for TypeCheck::collect), the
+  // key of its AST, and the names it calls.
+  struct FnSummary {
+    std::string name;
+    std::string alias;
+    bool ex = false;
+    bool operatorOverride = false;
+    std::vector<Param> params;
+    Type ret = Type::Void;
+    std::vector<std::string> throws;
+    Span s;
+    std::string astKey;
+    std::vector<std::string> calls;
+  };
+  struct FileState {
+    std::string textKey;
+    std::string ast;
+    std::string parseError;
+    std::vector<FnSummary> fns;
+    std::string topKey;
+    std::vector<std::string> topCalls;
+    bool usesSuperuser = false;
+  };
+  struct FnCheck {
+    std::string key;
+    std::vector<std::string> warnings;
+  };
+  struct Project {
+    std::vector<std::string> files;
+    std::unordered_map<std::string, FnCheck> fns;
+  };
+  struct Diagnostic {
+    std::string file;
+    std::size_t line = 1;
+    std::size_t col = 1;
+    std::string severity;
+    std::string message;
+  };
+
+  std::unordered_map<std::string, std::string> overlays_;
+  std::unordered_map<std::string, FileState> files_;
+  std::vector<Project> projects_;
+  bool exit_ = false;
+
+  static std::string pathKey(const std::string &file) {
+    std::error_code ec;
+    std::filesystem::path abs = std::filesystem::absolute(file, ec);
+    if (ec) abs = file;
+    return abs.lexically_normal().string();
+  }
+  static std::string reply(const std::string &id, const std::string &result) {
+    return "{\"jsonrpc\":\"2.0\",\"id\":" + id + ",\"result\":" + result + "}";
+  }
+  static std::string errorReply(const std::string &id, int code, const std::string &message) {
+    return "{\"jsonrpc\":\"2.0\",\"id\":" + id + ",\"error\":{\"code\":" + std::to_string(code) +
+           ",\"message\":\"" + jsonEscape(message) + "\"}}";
+  }
+  // Splits "line N, col M: message" as produced by CompileError and TypeCheck warnings.
+  static Diagnostic diagnosticFrom(const std::string &file, const std::string &text, const std::string &severity) {
+    Diagnostic d{file, 1, 1, severity, text};
+    unsigned long line = 0;
+    unsigned long col = 0;
+    int used = 0;
+    if (std::sscanf(text.c_str(), "line %lu, col %lu: %n", &line, &col, &used) == 2 && used > 0) {
+      d.line = line;
+      d.col = col;
+      d.message = text.substr(static_cast<std::size_t>(used));
+      if (d.message.rfind("warning: ", 0) == 0) d.message = d.message.substr(9);
+    }
+    return d;
+  }
+  static std::vector<std::string> sortedCalls(const ProgramUsage &u) {
+    std::vector<std::string> out(u.calls.begin(), u.calls.end());
+    std::sort(out.begin(), out.end());
+    return out;
+  }
+
+  std::string handle(const JsonValue &req) {
+    const JsonValue *idv = req.get("id");
+    const bool isRequest = idv && idv->kind != JsonValue::Kind::Null;
+    const std::string id = isRequest ? jsonScalarText(*idv) : "null";
+    const std::string method = req.stringOr("method", "");
+    static const JsonValue kNoParams;
+    const JsonValue *paramsPtr = req.get("params");
+    const JsonValue &params = paramsPtr ? *paramsPtr : kNoParams;
+    try {
+      if (method == "initialize") {
+        return reply(id, "{\"serverInfo\":{\"name\":\"lsc\",\"version\":\"" + lineScriptVersionDisplay() +
+                             "\"},\"capabilities\":{\"check\":true,\"didChange\":true}}");
+      }
+      if (method == "shutdown") return isRequest ? reply(id, "null") : "";
+      if (method == "exit") {
+        exit_ = true;
+        return "";
+      }
+      if (method == "didOpen" || method == "didChange" || method == "didClose") {
+        const std::string file = params.stringOr("file", "");
+        if (file.empty()) throw std::runtime_error("missing params.file");
+        const std::string key = pathKey(file);
+        if (method == "didClose") {
+          overlays_.erase(key);
+        } else {
+          const JsonValue *text = params.get("text");
+          if (!text || text->kind != JsonValue::Kind::String) throw std::runtime_error("missing params.text");
+          overlays_[key] = text->str;
         }
-        continue;
+        if (!isRequest) return "";
+        std::string out = "{\"projects\":[";
+        bool first = true;
+        for (Project &proj : projects_) {
+          bool contains = false;
+          for (const std::string &f : proj.files) contains = contains || pathKey(f) == key;
+          if (!contains) continue;
+          if (!first) out += ",";
+          first = false;
+          out += check(proj);
+        }
+        return reply(id, out + "]}");
       }
+      if (method == "check") {
+        const JsonValue *files = params.get("files");
+        if (!files || files->kind != JsonValue::Kind::Array || files->arr.empty()) {
+          throw std::runtime_error("params.files must be a non-empty array");
+        }
+        std::vector<std::string> list;
+        for (const JsonValue &f : files->arr) {
+          if (f.kind != JsonValue::Kind::String || f.str.empty()) throw std::runtime_error("bad entry in params.files");
+          list.push_back(f.str);
+        }
+        Project *proj = nullptr;
+        for (Project &candidate : projects_) {
+          if (candidate.files == list) proj = &candidate;
+        }
+        if (!proj) {
+          projects_.push_back(Project{list, {}});
+          proj = &projects_.back();
+        }
+        const std::string result = check(*proj);
+        return isRequest ? reply(id, result) : "";
+      }
+      return isRequest ? errorReply(id, -32601, "method not found: " + method) : "";
+    } catch (const std::exception &e) {
+      return isRequest ? errorReply(id, -32602, e.what()) : "";
     }
+  }
 
-    pending += line;
-    pending.push_back('\n');
-    depth += replBlockDeltaLine(line);
-    if (depth > 0) continue;
-    if (depth < 0) {
-      std::cerr << "REPL warning: unmatched 'end' or '}'\n";
-      pending.clear();
-      depth = 0;
-      continue;
-    }
-
-    const std::string snippet = trimCopy(pending);
-    pending.clear();
-    if (snippet.empty()) continue;
-    if (replIsSuperuserToggleCommand(snippet)) {
-      superuserSession = !superuserSession;
-      if (superuserSession) {
-        superuserVerbosity = 3;
-        std::cerr << "Warning: superuser() enabled. LineScript error safety guards are disabled; input will be "
-                     "attempted even if it is bad, malformed, or otherwise invalid.\n";
-        std::cerr << "[superuser][repl] session enabled\n";
-      } else {
-        std::cerr << "[superuser][repl] session disabled; back to normal user\n";
+  // Returns the file's parse result, lexing and parsing only when its text changed since the last check.
+  const FileState &parsed(const std::string &file, bool &reused) {
+    const std::string key = pathKey(file);
+    auto ov = overlays_.find(key);
+    std::string text;
+    std::string readError;
+    if (ov != overlays_.end()) {
+      text = ov->second;
+    } else {
+      try {
+        text = readFile(file);
+      } catch (const std::exception &e) {
+        readError = e.what();
       }
-      continue;
     }
-    const bool hasSuperuser = replContainsSuperuser(snippet);
-    const std::string replSnippet = replRewritePrintAsPrintln(snippet);
-
-    std::ostringstream src;
-    src << ".format()\n";
-    src << prelude;
-    for (const std::string &s : persisted) {
-      src << s;
-      if (s.empty() || s.back() != '\n') src << '\n';
+    const std::string textKey = readError.empty() ? hex64(fnv1a64(text)) : "!" + readError;
+    FileState &st = files_[key];
+    reused = st.textKey == textKey;
+    if (reused) return st;
+    st = FileState{};
+    st.textKey = textKey;
+    st.parseError = readError;
+    if (!readError.empty()) return st;
+    try {
+      Lexer lx(text);
+      Parser ps(lx.run());
+      Program part = ps.run();
+      st.ast = encodeProgramAst(part);
+      for (const Fn &f : part.f) {
+        ProgramUsage u;
+        collectUsageBlock(f.b, u);
+        st.usesSuperuser = st.usesSuperuser || u.called("superuser");
+        st.fns.push_back(FnSummary{f.n, f.sourceName.empty() ? f.n : f.sourceName, f.ex, f.isOperatorOverride, f.p,
+                                   f.ret, f.throws, f.s, functionAstHash(f, ""), sortedCalls(u)});
+      }
+      if (!part.top.empty()) {
+        AstWriter w;
+        w.block(part.top);
+        st.topKey = hex64(fnv1a64(w.pack(kAstMagic)));
+        ProgramUsage u;
+        collectUsageBlock(part.top, u);
+        st.usesSuperuser = st.usesSuperuser || u.called("superuser");
+        st.topCalls = sortedCalls(u);
+      }
+    } catch (const std::exception &e) {
+      st = FileState{textKey, "", e.what(), {}, "", {}, false};
     }
-    src << replSnippet << '\n';
-    writeFile(replSrc, src.str());
+    return st;
+  }
 
-    std::ostringstream cmd;
-    cmd << qCmd(argv0) << " " << q(replSrc) << " --run --cc " << qCmd(o.cc) << " --backend " << o.backend
-        << " --passes " << o.passes << " -o " << q(replBin);
-    if (o.maxSpeed) cmd << " -O4";
-    if (superuserSession) cmd << " --su-session --su-verbosity " << superuserVerbosity;
+  std::string check(Project &proj) {
+    const auto t0 = std::chrono::steady_clock::now();
+    std::vector<Diagnostic> diags;
+    std::size_t filesParsed = 0;
+    std::size_t filesReused = 0;
+    std::size_t fnsChecked = 0;
+    std::size_t fnsReused = 0;
+    std::vector<const FileState *> states;
+    for (const std::string &file : proj.files) {
+      bool reused = false;
+      const FileState &st = parsed(file, reused);
+      ++(reused ? filesReused : filesParsed);
+      if (!st.parseError.empty()) diags.push_back(diagnosticFrom(file, st.parseError, "error"));
+      states.push_back(&st);
+    }
+    if (diags.empty()) checkTypes(proj, states, diags, fnsChecked, fnsReused);
+    bool ok = true;
+    std::string out = "{\"files\":[";
+    for (std::size_t i = 0; i < proj.files.size(); ++i) {
+      out += (i ? ",\"" : "\"") + jsonEscape(proj.files[i]) + "\"";
+    }
+    out += "],\"diagnostics\":[";
+    for (std::size_t i = 0; i < diags.size(); ++i) {
+      const Diagnostic &d = diags[i];
+      ok = ok && d.severity != "error";
+      out += (i ? "," : "");
+      out += "{\"file\":\"" + jsonEscape(d.file) + "\",\"line\":" + std::to_string(d.line) +
+             ",\"col\":" + std::to_string(d.col) + ",\"severity\":\"" + d.severity + "\",\"message\":\"" +
+             jsonEscape(d.message) + "\"}";
+    }
+    std::ostringstream stats;
+    stats << std::fixed << std::setprecision(3) << "{\"filesParsed\":" << filesParsed
+          << ",\"filesReused\":" << filesReused << ",\"functionsChecked\":" << fnsChecked
+          << ",\"functionsReused\":" << fnsReused << ",\"ms\":" << msSince(t0) << "}";
+    out += "],\"ok\":" + std::string(ok ? "true" : "false") + ",\"stats\":" + stats.str() + "}";
+    return out;
+  }
 
-    if (superuserSession && superuserVerbosity >= 5) {
-      std::cerr << "[superuser][repl] snippet:\n" << replSnippet << "\n";
+  // Type-checks the project the way `lsc --check` does (all signatures, then bodies in program order, stopping
+  // at the first error), skipping bodies whose key matches the last check. A function's key is its AST, the
+  // session mode, and the signatures of every function it could resolve to (by name or source alias) plus all
+  // operator overrides. Files with nothing to re-check contribute signature-only stubs and are not decoded.
+  void checkTypes(Project &proj, const std::vector<const FileState *> &states, std::vector<Diagnostic> &diags,
+                  std::size_t &fnsChecked, std::size_t &fnsReused) {
+    bool superuserMode = false;
+    SignatureIndex sigs;
+    for (const FileState *st : states) {
+      superuserMode = superuserMode || st->usesSuperuser;
+      for (const FnSummary &f : st->fns) {
+        sigs.add(f.name, f.alias, checkedSignature(f.name, f.alias, f.params, f.ret, f.throws), f.operatorOverride);
+      }
     }
-    if (superuserSession && superuserVerbosity >= 4) {
-      std::cerr << "[superuser][repl] command: " << cmd.str() << "\n";
+    auto keyOf = [&](const std::string &astKey, const std::vector<std::string> &calls) {
+      return astKey + sigs.depsKey(calls, superuserMode);
+    };
+    // Which bodies need checking, and therefore which files need decoding.
+    std::unordered_map<std::string, std::string> keys;
+    std::vector<char> decode(states.size(), 0);
+    std::string scriptAst;
+    std::vector<std::string> scriptCalls;
+    for (std::size_t fi = 0; fi < states.size(); ++fi) {
+      for (const FnSummary &f : states[fi]->fns) {
+        if (f.ex) continue;
+        const std::string key = keyOf(f.astKey, f.calls);
+        auto hit = proj.fns.find(f.name);
+        if (hit == proj.fns.end() || hit->second.key != key) decode[fi] = 1;
+        keys[f.name] = key;
+      }
+      if (!states[fi]->topKey.empty()) {
+        scriptAst += states[fi]->topKey;
+        scriptCalls.insert(scriptCalls.end(), states[fi]->topCalls.begin(), states[fi]->topCalls.end());
+      }
+    }
+    if (!scriptAst.empty()) {
+      std::sort(scriptCalls.begin(), scriptCalls.end());
+      scriptCalls.erase(std::unique(scriptCalls.begin(), scriptCalls.end()), scriptCalls.end());
+      const std::string key = keyOf(hex64(fnv1a64(scriptAst)), scriptCalls);
+      auto hit = proj.fns.find(kScriptEntryName);
+      if (hit == proj.fns.end() || hit->second.key != key) {
+        for (std::size_t fi = 0; fi < states.size(); ++fi) {
+          if (!states[fi]->topKey.empty()) decode[fi] = 1;
+        }
+      }
+      keys[kScriptEntryName] = key;
     }
 
-    const int rc = std::system(cmd.str().c_str());
-    if (rc == 0) {
-      if (!hasSuperuser && replShouldPersist(snippet)) {
-        persisted.push_back(snippet);
+    Program p;
+    std::vector<std::size_t> fnFile;
+    std::optional<std::size_t> scriptFile;
+    for (std::size_t fi = 0; fi < states.size(); ++fi) {
+      if (decode[fi]) {
+        Program part;
+        if (!decodeProgramAst(states[fi]->ast, part)) {
+          diags.push_back(Diagnostic{proj.files[fi], 1, 1, "error", "cached AST could not be decoded"});
+          return;
+        }
+        for (auto &f : part.f) {
+          p.f.push_back(std::move(f));
+          fnFile.push_back(fi);
+        }
+        for (auto &stmt : part.top) p.top.push_back(std::move(stmt));
+      } else {
+        for (const FnSummary &f : states[fi]->fns) {
+          Fn stub;
+          stub.n = f.name;
+          stub.sourceName = f.alias == f.name ? "" : f.alias;
+          stub.ex = f.ex;
+          stub.p = f.params;
+          stub.ret = f.ret;
+          stub.throws = f.throws;
+          stub.s = f.s;
+          p.f.push_back(std::move(stub));
+          fnFile.push_back(fi);
+        }
       }
-      if (hasSuperuser) superuserSession = true;
-    } else {
-      std::cerr << "REPL: command failed; session state unchanged.\n";
+      if (!states[fi]->topKey.empty() && !scriptFile) scriptFile = fi;
+    }
+    const bool scriptDecoded = !p.top.empty();
+    if (!scriptAst.empty()) {
+      Fn script;
+      script.n = kScriptEntryName;
+      script.ret = Type::Void;
+      if (scriptDecoded) script.s = p.top.front()->s;
+      script.b = std::move(p.top);
+      p.top.clear();
+      p.f.push_back(std::move(script));
+      fnFile.push_back(scriptFile.value_or(0));
+    }
+
+    TypeCheck tc(p, superuserMode);
+    std::vector<std::pair<std::size_t, std::string>> warnings;
+    std::size_t current = p.f.size();
+    try {
+      tc.collectSignatures();
+      for (std::size_t i = 0; i < p.f.size(); ++i) {
+        Fn &f = p.f[i];
+        if (f.ex) continue;
+        const std::string &key = keys[f.n];
+        FnCheck &cached = proj.fns[f.n];
+        const bool stub = f.n == kScriptEntryName ? !scriptDecoded : !decode[fnFile[i]];
+        if (stub || cached.key == key) {
+          ++fnsReused;
+          for (const std::string &w : cached.warnings) warnings.emplace_back(fnFile[i], w);
+          continue;
+        }
+        cached = FnCheck{};
+        const std::size_t before = tc.warnings().size();
+        current = i;
+        tc.checkFunction(f);
+        current = p.f.size();
+        ++fnsChecked;
+        cached.key = key;
+        cached.warnings.assign(tc.warnings().begin() + static_cast<std::ptrdiff_t>(before), tc.warnings().end());
+        for (const std::string &w : cached.warnings) warnings.emplace_back(fnFile[i], w);
+      }
+    } catch (const std::exception &e) {
+      // Signature errors have no owning function and are reported against the first file.
+      const std::size_t fi = current < p.f.size() ? fnFile[current] : 0;
+      diags.push_back(diagnosticFrom(proj.files[fi], e.what(), "error"));
+    }
+    for (auto it = proj.fns.begin(); it != proj.fns.end();) {
+      it = keys.count(it->first) ? std::next(it) : proj.fns.erase(it);
+    }
+    std::unordered_set<std::string> seen;
+    for (const auto &w : warnings) {
+      if (seen.insert(std::to_string(w.first) + ":" + w.second).second) diags.push_back(diagnosticFrom(proj.files[w.first], w.second, "warning"));
     }
   }
+};
 
-  std::error_code ec;
-  std::filesystem::remove(replSrc, ec);
-  std::filesystem::remove(replBin, ec);
-  return 0;
+static int runServe() {
+  CheckServer server;
+  return server.run(std::cin, std::cout);
 }
 
 static void inferDepsFromCCode(const std::string &cCode, bool &hasParallelFor, bool &hasWinGraphicsDep, bool &hasWinNetDep,
@@ -12405,11 +21974,301 @@ static void inferDepsFromCCode(const std::string &cCode, bool &hasParallelFor, b
   hasParallelFor = hasAny({"#define LS_PAR_FOR", "omp parallel for"});
   hasWinGraphicsDep = hasAny({"GetAsyncKeyState", "CreateWindowA", "game_new(", "pg_init("});
   hasWinNetDep = hasAny({"WSAStartup", "http_server_listen(", "http_client_connect("});
-  hasPosixThreadDep = hasAny({"pthread_create", "pthread_join"});
+  hasPosixThreadDep = hasAny({"pthread_create", "pthread_join", "pthread_cond_wait"});
   ultraMinimalRuntime = hasAny({"ls_stdout_handle", "LS_THREAD_LOCAL"});
   hasInteractiveInput = hasAny({"input_prompt(", "input_i64_prompt(", "input_f64_prompt("});
 }
 
+struct BuildCandidate {
+  std::string backend;
+  std::string compiler;
+  std::string flags;
+};
+
+// Identifies the executable a compiler command resolves to (path, size and mtime), so a toolchain upgrade
+// invalidates cached probe results even when the command name stays the same.
+static std::string toolIdentity(const std::string &cmd) {
+  const std::string name = stripOuterQuotes(cmd);
+  std::vector<std::filesystem::path> candidates;
+  if (name.find('/') != std::string::npos || name.find('\\') != std::string::npos) {
+    candidates.emplace_back(name);
+  } else if (const char *pathEnv = std::getenv("PATH")) {
+#if defined(_WIN32)
+    const char sep = ';';
+#else
+    const char sep = ':';
+#endif
+    std::string dirs = pathEnv;
+    std::size_t start = 0;
+    while (start <= dirs.size()) {
+      std::size_t end = dirs.find(sep, start);
+      if (end == std::string::npos) end = dirs.size();
+      if (end > start) {
+        const std::filesystem::path dir = dirs.substr(start, end - start);
+        candidates.push_back(dir / name);
+#if defined(_WIN32)
+        candidates.push_back(dir / (name + ".exe"));
+#endif
+      }
+      start = end + 1;
+    }
+  }
+  for (const auto &c : candidates) {
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(c, ec)) continue;
+    const auto size = std::filesystem::file_size(c, ec);
+    const auto stamp = std::filesystem::last_write_time(c, ec).time_since_epoch().count();
+    return c.string() + "|" + std::to_string(size) + "|" + std::to_string(static_cast<long long>(stamp));
+  }
+  return name;
+}
+static std::optional<BuildCandidate> readToolchainProbeCache(const std::filesystem::path &path) {
+  std::error_code ec;
+  if (!std::filesystem::exists(path, ec)) return std::nullopt;
+  std::ifstream in(path, std::ios::binary);
+  BuildCandidate c;
+  std::string format;
+  if (!std::getline(in, format) || format != "linescript-toolchain-probe-v1") return std::nullopt;
+  if (!std::getline(in, c.backend) || !std::getline(in, c.compiler) || !std::getline(in, c.flags)) return std::nullopt;
+  return c;
+}
+static void writeToolchainProbeCache(const std::filesystem::path &path, const BuildCandidate &c) {
+  // Written to a temporary name and renamed so concurrent builds sharing a cache never read a partial entry.
+  std::filesystem::path tmp = path;
+  tmp += ".tmp" + std::to_string(static_cast<unsigned long long>(
+                      std::chrono::steady_clock::now().time_since_epoch().count()));
+  try {
+    writeFile(tmp, "linescript-toolchain-probe-v1\n" + c.backend + "\n" + c.compiler + "\n" + c.flags + "\n");
+    std::filesystem::rename(tmp, path);
+  } catch (const std::exception &) {
+    std::error_code ec;
+    std::filesystem::remove(tmp, ec);
+  }
+}
+
+// Build dependency flags as recorded in typed IR bundles, one '0'/'1' per flag in finish() parameter order.
+// Scanning the C for runtime symbols over-reports (the task pool and OpenMP macros are always emitted),
+// which would change the probed flag sets between a fresh build and a cached one.
+static std::string encodeBuildDeps(bool hasParallelFor, bool hasWinGraphicsDep, bool hasWinNetDep, bool hasPosixThreadDep,
+                                   bool ultraMinimalRuntime, bool hasInteractiveInput) {
+  std::string out;
+  for (bool b : {hasParallelFor, hasWinGraphicsDep, hasWinNetDep, hasPosixThreadDep, ultraMinimalRuntime, hasInteractiveInput}) {
+    out.push_back(b ? '1' : '0');
+  }
+  return out;
+}
+static bool decodeBuildDeps(const std::string &deps, bool &hasParallelFor, bool &hasWinGraphicsDep, bool &hasWinNetDep,
+                            bool &hasPosixThreadDep, bool &ultraMinimalRuntime, bool &hasInteractiveInput) {
+  if (deps.size() != 6 || deps.find_first_not_of("01") != std::string::npos) return false;
+  hasParallelFor = deps[0] == '1';
+  hasWinGraphicsDep = deps[1] == '1';
+  hasWinNetDep = deps[2] == '1';
+  hasPosixThreadDep = deps[3] == '1';
+  ultraMinimalRuntime = deps[4] == '1';
+  hasInteractiveInput = deps[5] == '1';
+  return true;
+}
+
+// Prints the --time-passes report when the guard goes out of scope, so every exit from the compile is covered.
+class TimePassesReport {
+public:
+  TimePassesReport(bool enabled, std::filesystem::path jsonPath) : jsonPath_(std::move(jsonPath)) {
+    gCompileStats.enabled = enabled;
+    gCompileStats.start = std::chrono::steady_clock::now();
+  }
+  ~TimePassesReport() {
+    if (!gCompileStats.enabled) return;
+    try {
+      const double totalMs = msSince(gCompileStats.start);
+      if (jsonPath_.empty()) {
+        printText(totalMs);
+      } else {
+        writeFile(jsonPath_, json(totalMs));
+      }
+    } catch (const std::exception &e) {
+      std::cerr << "Warning: --time-passes report failed: " << e.what() << '\n';
+    }
+  }
+  TimePassesReport(const TimePassesReport &) = delete;
+  TimePassesReport &operator=(const TimePassesReport &) = delete;
+
+private:
+  struct ChildTotal {
+    std::string kind;
+    double ms = 0.0;
+    uint64_t count = 0;
+  };
+  static std::vector<ChildTotal> childTotals() {
+    std::vector<ChildTotal> out;
+    std::lock_guard<std::mutex> lock(gCompileStats.childMu);
+    for (const ChildProcessStat &c : gCompileStats.children) {
+      auto it = std::find_if(out.begin(), out.end(), [&](const ChildTotal &t) { return t.kind == c.kind; });
+      if (it == out.end()) {
+        out.push_back(ChildTotal{c.kind, 0.0, 0});
+        it = out.end() - 1;
+      }
+      it->ms += c.ms;
+      ++it->count;
+    }
+    return out;
+  }
+  static void printText(double totalMs) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(2);
+    out << "=== LineScript compile time report ===\n";
+    out << "  " << std::left << std::setw(16) << "phase" << std::right << std::setw(12) << "wall ms" << std::setw(8)
+        << "calls" << std::setw(14) << "peak RSS KiB" << std::setw(14) << "growth KiB" << '\n';
+    for (const PhaseStat &ph : gCompileStats.phases) {
+      out << "  " << std::left << std::setw(16) << ph.name << std::right << std::setw(12) << ph.ms << std::setw(8)
+          << ph.calls << std::setw(14) << ph.peakRssKb << std::setw(14) << ph.rssGrowthKb << '\n';
+    }
+    for (const OptPassStat &ps : gCompileStats.optPasses) {
+      out << "  optimizer pass " << ps.pass << ": " << ps.ms << " ms, " << ps.functions << " function(s), "
+          << ps.rewrites << " rewrite(s)" << (ps.changed ? "" : ", fixed point") << '\n';
+    }
+    if (!gCompileStats.optPipeline.empty()) {
+      out << "  optimizer pipeline:";
+      for (const OptPipelineStat &st : gCompileStats.optPipeline) {
+        out << ' ' << st.name << '=' << st.ms << "ms/" << st.changed << '/' << st.runs;
+      }
+      out << " (ms/changed/runs)\n";
+    }
+    bool anyTransform = false;
+    for (std::size_t t = 0; t < gCompileStats.transforms.size(); ++t) {
+      if (gCompileStats.transforms[t] == 0) continue;
+      if (!anyTransform) out << "  transforms fired:";
+      anyTransform = true;
+      out << ' ' << optTransformName(static_cast<OptTransform>(t)) << '=' << gCompileStats.transforms[t];
+    }
+    if (anyTransform) out << '\n';
+    // Concurrent toolchain probes overlap, so child time can exceed the backend phase's wall time.
+    for (const ChildTotal &c : childTotals()) {
+      out << "  child processes (" << c.kind << "): " << c.count << ", " << c.ms << " ms\n";
+    }
+    out << "  total: " << totalMs << " ms, peak RSS " << processPeakRssKb() << " KiB\n";
+    std::cerr << out.str() << std::flush;
+  }
+  static std::string json(double totalMs) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3);
+    out << "{\"format\":\"linescript-time-passes-v1\",\"total_ms\":" << totalMs
+        << ",\"peak_rss_kb\":" << processPeakRssKb() << ",\"phases\":[";
+    for (std::size_t i = 0; i < gCompileStats.phases.size(); ++i) {
+      const PhaseStat &ph = gCompileStats.phases[i];
+      out << (i ? "," : "") << "{\"name\":\"" << jsonEscape(ph.name) << "\",\"ms\":" << ph.ms
+          << ",\"calls\":" << ph.calls << ",\"peak_rss_kb\":" << ph.peakRssKb
+          << ",\"rss_growth_kb\":" << ph.rssGrowthKb << "}";
+    }
+    out << "],\"optimizer_passes\":[";
+    for (std::size_t i = 0; i < gCompileStats.optPasses.size(); ++i) {
+      const OptPassStat &ps = gCompileStats.optPasses[i];
+      out << (i ? "," : "") << "{\"pass\":" << ps.pass << ",\"ms\":" << ps.ms
+          << ",\"changed\":" << (ps.changed ? "true" : "false") << ",\"rewrites\":" << ps.rewrites
+          << ",\"functions\":" << ps.functions << "}";
+    }
+    out << "],\"optimizer_pipeline\":[";
+    for (std::size_t i = 0; i < gCompileStats.optPipeline.size(); ++i) {
+      const OptPipelineStat &st = gCompileStats.optPipeline[i];
+      out << (i ? "," : "") << "{\"name\":\"" << st.name << "\",\"ms\":" << st.ms << ",\"runs\":" << st.runs
+          << ",\"changed\":" << st.changed << "}";
+    }
+    out << "],\"transforms\":{";
+    for (std::size_t t = 0; t < gCompileStats.transforms.size(); ++t) {
+      out << (t ? "," : "") << "\"" << optTransformName(static_cast<OptTransform>(t))
+          << "\":" << gCompileStats.transforms[t];
+    }
+    out << "},\"child_processes\":[";
+    const std::vector<ChildTotal> children = childTotals();
+    for (std::size_t i = 0; i < children.size(); ++i) {
+      out << (i ? "," : "") << "{\"kind\":\"" << jsonEscape(children[i].kind) << "\",\"count\":"
+          << children[i].count << ",\"ms\":" << children[i].ms << "}";
+    }
+    out << "]}\n";
+    return out.str();
+  }
+
+  std::filesystem::path jsonPath_;
+};
+
+static void setChildEnv(const char *name, const std::string &value) {
+#if defined(_WIN32)
+  _putenv_s(name, value.c_str());
+#else
+  setenv(name, value.c_str(), 1);
+#endif
+}
+
+// --bench: runs the built program with its bench blocks reporting JSON lines into a side file, then wraps
+// them with what produced the binary so runs can be compared across compiler versions and build settings.
+static int runBench(const Opt &o, const std::filesystem::path &bin, const std::filesystem::path &source,
+                    const std::string &backend, const std::string &flags) {
+  std::filesystem::path lines = bin;
+  lines += ".bench.jsonl";
+  std::error_code ec;
+  std::filesystem::remove(lines, ec);
+  setChildEnv("LS_BENCH_JSON", lines.string());
+  if (o.benchTimeMs >= 0) setChildEnv("LS_BENCH_TIME_MS", std::to_string(o.benchTimeMs));
+  if (o.benchWarmupMs >= 0) setChildEnv("LS_BENCH_WARMUP_MS", std::to_string(o.benchWarmupMs));
+  if (o.benchSamples >= 0) setChildEnv("LS_BENCH_SAMPLES", std::to_string(o.benchSamples));
+  const int rc = timedSystem(q(bin), "run");
+  std::string results;
+  if (std::filesystem::exists(lines, ec)) {
+    std::istringstream in(readFile(lines));
+    std::string line;
+    while (std::getline(in, line)) {
+      // A program that dies mid-write leaves a truncated last line; keep only complete records.
+      if (line.size() < 2 || line.front() != '{' || line.back() != '}') continue;
+      if (!results.empty()) results += ",";
+      results += line;
+    }
+    std::filesystem::remove(lines, ec);
+  }
+  const char *pgo = o.pgoGenerate ? "generate" : (!o.pgoUseDir.empty() ? "use" : "none");
+  std::ostringstream out;
+  out << "{\"format\":\"linescript-bench-v1\",\"compiler\":\"" << jsonEscape(lineScriptVersionDisplay())
+      << "\",\"source\":\"" << jsonEscape(source.string()) << "\",\"cc\":\"" << jsonEscape(o.cc)
+      << "\",\"backend\":\"" << jsonEscape(backend) << "\",\"native_flags\":\"" << jsonEscape(flags)
+      << "\",\"max_speed\":" << (o.maxSpeed ? "true" : "false") << ",\"passes\":" << o.passes
+      << ",\"pgo\":\"" << pgo << "\",\"exit_code\":" << rc << ",\"benches\":[" << results << "]}\n";
+  if (o.benchJsonPath.empty()) {
+    std::cout << out.str() << std::flush;
+  } else {
+    writeFile(o.benchJsonPath, out.str());
+  }
+  return rc;
+}
+
+// After `--profile --run`: where the stacks went and the functions with the most samples.
+static void printProfileSummary(const Opt &o) {
+  const std::filesystem::path folded = o.profileOutPath.empty() ? std::filesystem::path(kDefaultProfileOut) : o.profileOutPath;
+  std::filesystem::path table = folded;
+  table += ".functions";
+  std::error_code ec;
+  if (!std::filesystem::exists(table, ec)) {
+    std::cout << "Profile: no data written (" << table.string() << " missing)\n";
+    return;
+  }
+  int64_t samples = 0;
+  std::vector<ProfileFunctionRow> rows = readProfileFunctions(table, samples);
+  std::stable_sort(rows.begin(), rows.end(), [](const ProfileFunctionRow &a, const ProfileFunctionRow &b) {
+    return a.selfSamples != b.selfSamples ? a.selfSamples > b.selfSamples : a.calls > b.calls;
+  });
+  std::cout << "Profile: " << samples << " sample(s) -> " << folded.string() << " (collapsed stacks), "
+            << table.string() << '\n';
+  auto pct = [&](int64_t n) {
+    std::ostringstream s;
+    s << std::fixed << std::setprecision(1) << (samples > 0 ? 100.0 * static_cast<double>(n) / samples : 0.0) << '%';
+    return s.str();
+  };
+  for (std::size_t i = 0; i < rows.size() && i < 5; ++i) {
+    const ProfileFunctionRow &r = rows[i];
+    std::cout << "  " << r.name << ": " << pct(r.selfSamples) << " self, " << pct(r.totalSamples) << " total, "
+              << r.calls << " call(s)";
+    if (r.inclusiveNs >= 0) std::cout << ", " << std::fixed << std::setprecision(3) << r.inclusiveNs / 1e6 << " ms";
+    std::cout << '\n';
+  }
+}
+
 static int finish(const Opt &o, const std::string &cCode, bool cleanOutputMode, bool hasParallelFor,
                   bool hasWinGraphicsDep, bool hasWinNetDep, bool hasPosixThreadDep, bool ultraMinimalRuntime,
                   bool hasInteractiveInput, bool superuserMode, bool superuserIrDump) {
@@ -12422,6 +22281,7 @@ static int finish(const Opt &o, const std::string &cCode, bool cleanOutputMode,
   (void)hasWinNetDep;
   (void)hasWinGraphicsDep;
 #endif
+  PhaseTimer buildPhase("backend");
   const std::filesystem::path primaryIn =
       !o.inputs.empty() ? o.inputs.front()
                         : (!o.consumeTypedIrPath.empty() ? o.consumeTypedIrPath : std::filesystem::path("typed_ir_input.lsc"));
@@ -12638,71 +22498,174 @@ static int finish(const Opt &o, const std::string &cCode, bool cleanOutputMode,
   linkSuffix = posixLinkFlags;
 #endif
 
-  int rc = 1;
   std::string usedFlags;
   std::string usedBackend = "c";
   auto execBuildCmd = [&](const std::string &cmd) -> int {
-    if (superuserMode) return std::system(cmd.c_str());
+    if (superuserMode) return timedSystem(cmd, "cc");
 #if defined(_WIN32)
-    return std::system((cmd + " >nul 2>nul").c_str());
+    return timedSystem(cmd + " >nul 2>nul", "cc");
 #else
-    return std::system((cmd + " >/dev/null 2>/dev/null").c_str());
+    return timedSystem(cmd + " >/dev/null 2>/dev/null", "cc");
 #endif
   };
-  std::vector<std::string> cppFallbackCommands = {"clang++", "g++"};
+  // Candidates in preference order: per flag set, the ASM path and its C++ fallbacks (when enabled), then the C path.
+  std::vector<BuildCandidate> candidates;
+  const std::vector<std::string> cppFallbackCommands = {"clang++", "g++"};
   for (const std::string &flags : flagSets) {
     const std::string activeFlags = trimCopy(flags + pgoFlags + crossFlags);
     if (tryAsmBackend) {
-      const std::string asmFlags = flagsForAsmEmit(activeFlags);
-      const std::string asmLinkFlags = flagsForAsmLink(activeFlags);
-      if (superuserMode) {
-        superuserLogV(3, "trying ASM emit flags: " + asmFlags);
+      candidates.push_back({"asm", o.cc, activeFlags});
+      for (const std::string &cppCmdName : cppFallbackCommands) {
+        candidates.push_back({"cpp-fallback", cppCmdName, activeFlags});
+      }
+    }
+    candidates.push_back({"c", o.cc, activeFlags});
+  }
+  // `singleStep` builds an ASM candidate with one driver invocation instead of emit-then-link; the driver
+  // still assembles the same Intel-syntax output, it just skips writing and re-reading the .s file.
+  auto runCandidate = [&](const BuildCandidate &cand, const std::filesystem::path &out, const std::filesystem::path &asmOut,
+                          bool singleStep) -> int {
+    if (cand.backend == "asm") {
+      const std::string asmFlags = flagsForAsmEmit(cand.flags);
+      const std::string asmLinkFlags = flagsForAsmLink(cand.flags);
+      if (singleStep) {
+        std::ostringstream one;
+        one << qCmd(cand.compiler) << " " << asmFlags << " -fno-lto -masm=intel " << asmLinkFlags << " " << q(c)
+            << " -o " << q(out) << linkSuffix;
+        if (superuserMode) superuserLogV(4, "exec (asm cached): " + one.str());
+        return execBuildCmd(one.str());
       }
+      if (superuserMode) superuserLogV(3, "trying ASM emit flags: " + asmFlags);
       std::ostringstream asmEmit;
-      asmEmit << qCmd(o.cc) << " " << asmFlags << " -fno-lto -S -masm=intel " << q(c) << " -o " << q(asmTmp);
+      asmEmit << qCmd(cand.compiler) << " " << asmFlags << " -fno-lto -S -masm=intel " << q(c) << " -o " << q(asmOut);
       if (superuserMode) superuserLogV(4, "exec (asm emit): " + asmEmit.str());
-      rc = execBuildCmd(asmEmit.str());
-      if (rc == 0) {
-        if (superuserMode) superuserLogV(3, "ASM emit succeeded; linking ASM backend");
-        std::ostringstream asmLink;
-        asmLink << qCmd(o.cc) << " " << asmLinkFlags << " " << q(asmTmp) << " -o " << q(bin) << linkSuffix;
-        if (superuserMode) superuserLogV(4, "exec (asm link): " + asmLink.str());
-        rc = execBuildCmd(asmLink.str());
-        if (rc == 0) {
-          usedFlags = activeFlags;
-          usedBackend = "asm";
-          if (superuserMode) superuserLogV(2, "ASM backend selected");
-          break;
+      int rc = execBuildCmd(asmEmit.str());
+      if (rc != 0) return rc;
+      if (superuserMode) superuserLogV(3, "ASM emit succeeded; linking ASM backend");
+      std::ostringstream asmLink;
+      asmLink << qCmd(cand.compiler) << " " << asmLinkFlags << " " << q(asmOut) << " -o " << q(out) << linkSuffix;
+      if (superuserMode) superuserLogV(4, "exec (asm link): " + asmLink.str());
+      rc = execBuildCmd(asmLink.str());
+      std::error_code ec;
+      if (asmOut != asmTmp) std::filesystem::remove(asmOut, ec);
+      return rc;
+    }
+    std::ostringstream cmd;
+    cmd << qCmd(cand.compiler) << " " << cand.flags << " " << q(c) << " -o " << q(out) << linkSuffix;
+    if (superuserMode) {
+      if (cand.backend == "c") {
+        superuserLogV(3, "trying C backend flags: " + cand.flags);
+      } else {
+        superuserLogV(2, "ASM path failed; trying C++ fallback compiler: " + cand.compiler);
+      }
+      superuserLogV(4, std::string(cand.backend == "c" ? "exec (c backend): " : "exec (cpp fallback): ") + cmd.str());
+    }
+    return execBuildCmd(cmd.str());
+  };
+  auto selectCandidate = [&](const BuildCandidate &cand) {
+    usedFlags = cand.flags;
+    usedBackend = cand.backend;
+    if (superuserMode) {
+      if (cand.backend == "asm") {
+        superuserLogV(2, "ASM backend selected");
+      } else if (cand.backend == "c") {
+        superuserLogV(2, "C backend selected");
+      } else {
+        superuserLogV(2, "C++ fallback backend selected: " + cand.compiler);
+      }
+    }
+  };
+
+  // Which candidate links depends only on the toolchain and the candidate list, not on the program, so the
+  // winner is remembered per toolchain in the cache directory and tried alone next time.
+  std::filesystem::path probeCachePath;
+  if (!o.noCache && !o.cacheDir.empty()) {
+    uint64_t h = fnv1a64("LineScript-toolchain-probe-v1");
+    h = fnv1a64(lineScriptVersionDisplay(), h);
+    h = fnv1a64(toolIdentity(o.cc), h);
+    h = fnv1a64(backendNorm, h);
+    h = fnv1a64(linkSuffix, h);
+    for (const BuildCandidate &cand : candidates) {
+      h = fnv1a64(cand.backend + "\n" + cand.compiler + "\n" + cand.flags + "\n", h);
+    }
+    probeCachePath = o.cacheDir / ("toolchain_" + hex64(h) + ".probe");
+  }
+  bool built = false;
+  bool probeCacheHit = false;
+  if (!probeCachePath.empty()) {
+    if (auto cached = readToolchainProbeCache(probeCachePath)) {
+      const bool known = std::any_of(candidates.begin(), candidates.end(), [&](const BuildCandidate &cand) {
+        return cand.backend == cached->backend && cand.compiler == cached->compiler && cand.flags == cached->flags;
+      });
+      if (known) {
+        if (superuserMode) superuserLogV(2, "toolchain probe cache hit: " + probeCachePath.string());
+        if (runCandidate(*cached, bin, asmTmp, true) == 0) {
+          selectCandidate(*cached);
+          built = true;
+          probeCacheHit = true;
+        } else {
+          if (superuserMode) superuserLogV(2, "cached toolchain selection failed; probing again");
+          std::error_code ec;
+          std::filesystem::remove(probeCachePath, ec);
         }
       }
-      for (const std::string &cppCmdName : cppFallbackCommands) {
-        if (superuserMode) superuserLogV(2, "ASM path failed; trying C++ fallback compiler: " + cppCmdName);
-        std::ostringstream cppCmd;
-        cppCmd << qCmd(cppCmdName) << " " << activeFlags << " " << q(c) << " -o " << q(bin) << linkSuffix;
-        if (superuserMode) superuserLogV(4, "exec (cpp fallback): " + cppCmd.str());
-        rc = execBuildCmd(cppCmd.str());
-        if (rc == 0) {
-          usedFlags = activeFlags;
-          usedBackend = "cpp-fallback";
-          if (superuserMode) superuserLogV(2, "C++ fallback backend selected: " + cppCmdName);
-          break;
+    }
+  }
+
+  if (!built && !candidates.empty()) {
+    const std::size_t n = candidates.size();
+    // Probes run concurrently on multi-core hosts; superuser logging and PGO builds stay serial so log order is
+    // stable and profile data keeps the output binary's name.
+    std::size_t jobs = std::thread::hardware_concurrency();
+    if (jobs > 4) jobs = 4;
+    if (jobs > n) jobs = n;
+    if (superuserMode || !pgoFlags.empty()) jobs = 1;
+    auto probeOut = [&](std::size_t i) -> std::filesystem::path {
+      if (jobs <= 1 || i == 0) return bin;
+      std::filesystem::path out = bin.parent_path() / (bin.stem().string() + ".probe" + std::to_string(i));
+      out += bin.extension();
+      return out;
+    };
+    auto probeAsm = [&](std::size_t i) -> std::filesystem::path {
+      if (jobs <= 1 || i == 0) return asmTmp;
+      std::filesystem::path out = bin;
+      out += ".tmp" + std::to_string(i) + ".s";
+      return out;
+    };
+    std::atomic<std::size_t> next{0};
+    std::atomic<std::size_t> best{n};
+    auto worker = [&]() {
+      for (;;) {
+        const std::size_t i = next.fetch_add(1);
+        if (i >= n || i > best.load()) return;
+        if (runCandidate(candidates[i], probeOut(i), probeAsm(i), false) != 0) continue;
+        std::size_t cur = best.load();
+        while (i < cur && !best.compare_exchange_weak(cur, i)) {
         }
       }
-      if (rc == 0) break;
+    };
+    std::vector<std::thread> pool;
+    try {
+      for (std::size_t t = 1; t < jobs; ++t) pool.emplace_back(worker);
+    } catch (const std::system_error &) {
+      // Runtimes without thread support fall back to probing on this thread.
+    }
+    worker();
+    for (std::thread &t : pool) t.join();
+    const std::size_t winner = best.load();
+    for (std::size_t i = 1; i < n && jobs > 1; ++i) {
+      if (i == winner) continue;
+      std::error_code ec;
+      std::filesystem::remove(probeOut(i), ec);
     }
-    std::ostringstream cmd;
-    cmd << qCmd(o.cc) << " " << activeFlags << " " << q(c) << " -o " << q(bin) << linkSuffix;
-    if (superuserMode) superuserLogV(3, "trying C backend flags: " + activeFlags);
-    if (superuserMode) superuserLogV(4, "exec (c backend): " + cmd.str());
-    rc = execBuildCmd(cmd.str());
-    if (rc == 0) {
-      usedFlags = activeFlags;
-      usedBackend = "c";
-      if (superuserMode) superuserLogV(2, "C backend selected");
-      break;
+    if (winner < n) {
+      if (probeOut(winner) != bin) std::filesystem::rename(probeOut(winner), bin);
+      selectCandidate(candidates[winner]);
+      built = true;
+      if (!probeCachePath.empty()) writeToolchainProbeCache(probeCachePath, candidates[winner]);
     }
   }
-  if (rc != 0) {
+  if (!built) {
     if (backendNorm == "asm") {
       throw std::runtime_error("ASM backend failed and fallback compilers were unavailable");
     }
@@ -12723,6 +22686,7 @@ static int finish(const Opt &o, const std::string &cCode, bool cleanOutputMode,
     (void)applyBoltProfileIfAvailable(bin, o.boltUseFdata, cleanOutputMode, superuserMode);
   }
   if (!cleanOutputMode) {
+    if (probeCacheHit) std::cout << "Toolchain probe: cached\n";
     std::cout << "Backend: " << usedBackend << '\n';
     std::cout << "Native flags: " << usedFlags << '\n';
     std::cout << "Built binary: " << bin << '\n';
@@ -12731,9 +22695,13 @@ static int finish(const Opt &o, const std::string &cCode, bool cleanOutputMode,
   if (superuserMode) {
     superuserLogV(1, "build completed with backend=" + usedBackend);
   }
+  buildPhase.stop();
   if (o.run) {
+    PhaseTimer runPhase("run");
     if (superuserMode) superuserLogV(1, "running binary: " + bin.string());
-    const int runRc = std::system(q(bin).c_str());
+    if (o.bench) return runBench(o, bin, primaryIn, usedBackend, usedFlags);
+    const int runRc = timedSystem(q(bin), "run");
+    if (o.profile && !cleanOutputMode) printProfileSummary(o);
     if (runRc != 0) return runRc;
   }
   return 0;
@@ -12751,12 +22719,14 @@ int main(int argc, char **argv) {
     if (o.repl) {
       return ls::runRepl(o, (argc > 0 && argv[0] != nullptr) ? argv[0] : "lsc");
     }
+    if (o.serve) return ls::runServe();
+    ls::TimePassesReport timePassesReport(o.timePasses, o.timePassesJsonPath);
     std::string incrementalConfigHash;
     std::filesystem::path incrementalTypedIrPath;
     if (o.incremental && !o.noCache && !o.inputs.empty() && o.cliFlags.empty() && o.cliCustomTokens.empty()) {
       incrementalConfigHash = ls::computeBuildConfigHash(o.inputs, o.cc, o.backend, o.maxSpeed, o.passes, o.target,
                                                          o.sysroot, o.linker);
-      incrementalTypedIrPath = o.cacheDir / (incrementalConfigHash + ".typed_ir.json");
+      incrementalTypedIrPath = o.cacheDir / (incrementalConfigHash + ".typed_ir");
     }
     if (o.consumeTypedIrPath.empty() && !incrementalTypedIrPath.empty() && !o.check && std::filesystem::exists(incrementalTypedIrPath)) {
       o.consumeTypedIrPath = incrementalTypedIrPath;
@@ -12764,25 +22734,50 @@ int main(int argc, char **argv) {
         std::cout << "Using cached typed IR: " << o.consumeTypedIrPath.string() << '\n';
       }
     }
+    // Everything besides the typed program that decides the emitted C; a bundle's C is reused only on a match.
+    std::string emitConfig;
+    {
+      uint64_t h = ls::fnv1a64("linescript-typed-ir-emit-v1");
+      h = ls::fnv1a64(ls::kCompilerBuildStamp, h);
+      h = ls::fnv1a64(std::to_string(o.passes) + (o.superuserSession ? "s" : "-"), h);
+      for (const std::string &flag : o.cliFlags) h = ls::fnv1a64(flag + "\n", h);
+      for (const auto &tok : o.cliCustomTokens) h = ls::fnv1a64(tok + "\n", h);
+      emitConfig = ls::hex64(h);
+    }
+    ls::Program p;
+    bool programFromIr = false;
     if (!o.consumeTypedIrPath.empty()) {
-      bool hasParallelFor = false;
-      bool hasWinGraphicsDep = false;
-      bool hasWinNetDep = false;
-      bool hasPosixThreadDep = false;
-      bool ultraMinimalRuntime = false;
-      bool hasInteractiveInput = false;
-      const std::string cOut = ls::readTypedIrBundle(o.consumeTypedIrPath);
-      ls::inferDepsFromCCode(cOut, hasParallelFor, hasWinGraphicsDep, hasWinNetDep, hasPosixThreadDep,
-                             ultraMinimalRuntime, hasInteractiveInput);
-      if (!o.emitTypedIrPath.empty()) {
-        const std::string emptyHash;
-        ls::writeTypedIrBundle(o.emitTypedIrPath, cOut, emptyHash, incrementalConfigHash);
-      }
-      return ls::finish(o, cOut, false, hasParallelFor, hasWinGraphicsDep, hasWinNetDep, hasPosixThreadDep,
-                        ultraMinimalRuntime, hasInteractiveInput, o.superuserSession, false);
+      stage = "typed-ir";
+      ls::PhaseTimer readPhase("typed-ir-read");
+      ls::TypedIrBundle bundle = ls::readTypedIrBundle(o.consumeTypedIrPath);
+      readPhase.stop();
+      if (!bundle.hasProgram || bundle.emitConfig == emitConfig) {
+        bool hasParallelFor = false;
+        bool hasWinGraphicsDep = false;
+        bool hasWinNetDep = false;
+        bool hasPosixThreadDep = false;
+        bool ultraMinimalRuntime = false;
+        bool hasInteractiveInput = false;
+        if (!ls::decodeBuildDeps(bundle.buildDeps, hasParallelFor, hasWinGraphicsDep, hasWinNetDep, hasPosixThreadDep,
+                                 ultraMinimalRuntime, hasInteractiveInput)) {
+          ls::inferDepsFromCCode(bundle.cCode, hasParallelFor, hasWinGraphicsDep, hasWinNetDep, hasPosixThreadDep,
+                                 ultraMinimalRuntime, hasInteractiveInput);
+        }
+        if (!o.emitTypedIrPath.empty()) {
+          ls::writeTypedIrBundle(o.emitTypedIrPath, ls::typedIrProgram(bundle.hasProgram ? &bundle.program : nullptr),
+                                 bundle.cCode, bundle.sourceHash, incrementalConfigHash,
+                                 ls::encodeBuildDeps(hasParallelFor, hasWinGraphicsDep, hasWinNetDep,
+                                                     hasPosixThreadDep, ultraMinimalRuntime, hasInteractiveInput),
+                                 bundle.emitConfig);
+        }
+        return ls::finish(o, bundle.cCode, false, hasParallelFor, hasWinGraphicsDep, hasWinNetDep, hasPosixThreadDep,
+                          ultraMinimalRuntime, hasInteractiveInput, o.superuserSession, false);
+      }
+      // Different passes or session flags: rebuild from the typed program, skipping parse and type check.
+      p = std::move(bundle.program);
+      programFromIr = true;
     }
     ls::setSuperuserLogging(o.superuserSession, false, o.superuserVerbosity);
-    ls::Program p;
     bool preparseSuperuserMode = o.superuserSession;
     auto lineCountOf = [](const std::string &src) -> std::size_t {
       if (src.empty()) return 0;
@@ -12815,45 +22810,151 @@ int main(int argc, char **argv) {
       if (text.size() > maxLen) out << "...";
       return out.str();
     };
-    for (const auto &input : o.inputs) {
+    const bool moduleCacheEnabled =
+        o.incremental && !o.noCache && o.cliFlags.empty() && o.cliCustomTokens.empty();
+    std::vector<ls::ModuleCacheRecord> moduleCache(o.inputs.size());
+    std::vector<char> moduleParsed(o.inputs.size(), 1);
+    std::vector<char> moduleTyped(o.inputs.size(), 0);
+    std::vector<std::string> moduleSources(o.inputs.size());
+    std::vector<ls::Program> moduleParts(o.inputs.size());
+    std::unordered_map<std::string, std::size_t> fnModule;
+    std::size_t modulesReused = 0;
+    std::size_t modulesTyped = 0;
+    auto parseModule = [&](std::size_t mi) {
+      const auto &input = o.inputs[mi];
+      const std::string &src = moduleSources[mi];
       stage = "parse";
       currentFile = input.string();
-      std::string src = ls::readFile(input);
-      if (!preparseSuperuserMode && ls::lowerCopy(src).find("superuser(") != std::string::npos) {
-        preparseSuperuserMode = true;
-        ls::setSuperuserLogging(true, false, o.superuserVerbosity);
-        ls::superuserLogV(1, "superuser hint detected in source; enabling early diagnostics");
-      }
       if (preparseSuperuserMode) {
         ls::superuserLogV(2, "stage: lex begin: " + input.string());
         ls::superuserLogV(4, "source stats: bytes=" + std::to_string(src.size()) +
                                  ", lines=" + std::to_string(lineCountOf(src)));
       }
+      ls::PhaseTimer lexPhase("lex");
       ls::Lexer lx(src);
       std::vector<ls::Token> toks = lx.run();
+      lexPhase.stop();
       if (preparseSuperuserMode) {
         ls::superuserLogV(3, "lexed tokens=" + std::to_string(toks.size()) + " for " + input.string());
         if (o.superuserVerbosity >= 5) {
           for (std::size_t ti = 0; ti < toks.size(); ++ti) {
             const auto &tok = toks[ti];
             std::ostringstream msg;
-            msg << "tok[" << ti << "] " << ls::tokenKindName(tok.kind) << " \"" << tokenTextForLog(tok.text) << "\" @"
+            msg << "tok[" << ti << "] " << ls::tokenKindName(tok.kind) << " \"" << tokenTextForLog(tok.text()) << "\" @"
                 << tok.span.line << ":" << tok.span.col;
             ls::superuserLogV(5, msg.str());
           }
         }
         ls::superuserLogV(2, "stage: parse file begin: " + input.string());
       }
+      ls::PhaseTimer parsePhase("parse");
       ls::Parser ps(std::move(toks));
-      ls::Program part = ps.run();
+      ls::Program &part = moduleParts[mi];
+      part = ps.run();
+      parsePhase.stop();
       if (preparseSuperuserMode) {
         ls::superuserLogV(3, "parsed file summary: functions=" + std::to_string(part.f.size()) +
                                  ", top-level statements=" + std::to_string(part.top.size()));
         ls::superuserLogV(2, "stage: parse file complete: " + input.string());
       }
+      if (moduleCacheEnabled) {
+        ls::ModuleCacheRecord &cached = moduleCache[mi];
+        cached.ast = ls::encodeProgramAst(part);
+        ls::summarizeModule(part, cached);
+      }
+    };
+    for (std::size_t mi = 0; !programFromIr && mi < o.inputs.size(); ++mi) {
+      const auto &input = o.inputs[mi];
+      stage = "parse";
+      currentFile = input.string();
+      ls::PhaseTimer readPhase("read");
+      moduleSources[mi] = ls::readFile(input);
+      readPhase.stop();
+      const std::string &src = moduleSources[mi];
+      if (!preparseSuperuserMode && ls::lowerCopy(src).find("superuser(") != std::string::npos) {
+        preparseSuperuserMode = true;
+        ls::setSuperuserLogging(true, false, o.superuserVerbosity);
+        ls::superuserLogV(1, "superuser hint detected in source; enabling early diagnostics");
+      }
+      if (moduleCacheEnabled) {
+        ls::PhaseTimer cachePhase("module-cache");
+        ls::ModuleCacheRecord &cached = moduleCache[mi];
+        const std::string sourceKey = ls::moduleSourceKey(input, src);
+        // An edited module is re-parsed, but its functions' C stays: each definition is checked by its own key.
+        // An unchanged one is decoded once every module's signatures are known, as type-checked if it can be.
+        if (!ls::readModuleCache(ls::moduleCachePath(o.cacheDir, input), cached)) {
+          cached = ls::ModuleCacheRecord{};
+        } else if (cached.sourceKey == sourceKey) {
+          moduleParsed[mi] = 0;
+          continue;
+        }
+        std::vector<ls::CachedFunctionC> fns = std::move(cached.fns);
+        cached = ls::ModuleCacheRecord{};
+        cached.sourceKey = sourceKey;
+        cached.fns = std::move(fns);
+      }
+      parseModule(mi);
+    }
+    if (moduleCacheEnabled && !programFromIr) {
+      ls::PhaseTimer cachePhase("module-cache");
+      bool usesSuperuser = o.superuserSession;
+      ls::SignatureIndex sigs;
+      for (const ls::ModuleCacheRecord &rec : moduleCache) {
+        usesSuperuser = usesSuperuser || rec.usesSuperuser;
+        for (const ls::ModuleSignature &sig : rec.sigs) sigs.add(sig.name, sig.alias, sig.sig, sig.operatorOverride);
+      }
+      for (std::size_t mi = 0; mi < o.inputs.size(); ++mi) {
+        ls::ModuleCacheRecord &cached = moduleCache[mi];
+        const std::string typedKey = cached.sourceKey + sigs.depsKey(cached.calls, usesSuperuser);
+        if (!moduleParsed[mi]) {
+          ls::Program &part = moduleParts[mi];
+          ls::Program top;
+          if (cached.typedKey == typedKey && !cached.typed.empty() && ls::decodeProgramAst(cached.typed, part) &&
+              (cached.top.empty() || ls::decodeProgramAst(cached.top, top))) {
+            for (auto &stmt : top.top) part.top.push_back(std::move(stmt));
+            moduleTyped[mi] = 1;
+            ++modulesTyped;
+          } else {
+            part = ls::Program{};
+            if (!ls::decodeProgramAst(cached.ast, part)) moduleParsed[mi] = 1;
+          }
+          if (moduleParsed[mi]) {
+            std::vector<ls::CachedFunctionC> fns = std::move(cached.fns);
+            const std::string sourceKey = cached.sourceKey;
+            cached = ls::ModuleCacheRecord{};
+            cached.sourceKey = sourceKey;
+            cached.fns = std::move(fns);
+            parseModule(mi);
+          }
+        }
+        if (!moduleParsed[mi]) {
+          ++modulesReused;
+          if (preparseSuperuserMode) {
+            ls::superuserLogV(2, std::string(moduleTyped[mi] ? "module cache hit (type-checked): "
+                                                             : "module cache hit: ") +
+                                     o.inputs[mi].string());
+          }
+        }
+        if (!moduleTyped[mi]) {
+          cached.typedKey = typedKey;
+          cached.typed.clear();
+          cached.warnings.clear();
+        }
+      }
+    }
+    for (std::size_t mi = 0; !programFromIr && mi < o.inputs.size(); ++mi) {
+      ls::Program &part = moduleParts[mi];
+      for (const auto &fn : part.f) fnModule[fn.n] = mi;
       for (auto &fn : part.f) p.f.push_back(std::move(fn));
       for (auto &stmt : part.top) p.top.push_back(std::move(stmt));
     }
+    moduleParts.clear();
+    moduleSources.clear();
+    // Functions not owned by one module (the merged top-level script) are cached with the first input.
+    auto moduleOf = [&](const std::string &fnName) -> std::size_t {
+      auto it = fnModule.find(fnName);
+      return it == fnModule.end() ? 0 : it->second;
+    };
     std::vector<std::string> activeCliFlags;
     if (!o.cliFlags.empty()) {
       const auto defs = ls::cliFlagDefinitions(p);
@@ -12874,7 +22975,7 @@ int main(int argc, char **argv) {
         }
       }
     }
-    if (!p.top.empty()) {
+    if (!programFromIr && !p.top.empty()) {
       ls::Fn script;
       script.n = ls::kScriptEntryName;
       script.ret = ls::Type::Void;
@@ -12883,9 +22984,10 @@ int main(int argc, char **argv) {
       p.top.clear();
       p.f.push_back(std::move(script));
     }
-    const bool superuserCallDetected = ls::hasCallNamedProgram(p, "superuser");
+    const ls::ProgramUsage parsedUsage = ls::collectProgramUsage(p);
+    const bool superuserCallDetected = parsedUsage.called("superuser");
     const bool superuserMode = superuserCallDetected || o.superuserSession;
-    const bool cleanOutputModeEarly = ls::hasFormatMarkerProgram(p);
+    const bool cleanOutputModeEarly = parsedUsage.called(".format");
     ls::setSuperuserLogging(superuserMode, cleanOutputModeEarly, o.superuserVerbosity);
     if (superuserCallDetected) {
       std::cerr << "Warning: superuser() enabled. LineScript error safety guards are disabled; input will be "
@@ -12928,14 +23030,61 @@ int main(int argc, char **argv) {
       ls::superuserLogV(2, "stage: parse complete");
     }
 
-    stage = "type-check";
-    if (superuserMode) ls::superuserLogV(2, "stage: type-check begin");
     currentFile.clear();
-    ls::TypeCheck tc(p, superuserMode);
-    tc.run();
-    if (superuserMode) {
-      for (const auto &w : tc.warnings()) ls::superuserLogV(1, "type-check warning: " + w);
-      ls::superuserLogV(2, "stage: type-check complete");
+    std::vector<std::string> typeCheckWarnings;
+    if (!programFromIr) {
+      stage = "type-check";
+      if (superuserMode) ls::superuserLogV(2, "stage: type-check begin");
+      ls::PhaseTimer typeCheckPhase("type-check");
+      ls::TypeCheck tc(p, superuserMode);
+      if (!moduleCacheEnabled) {
+        tc.run();
+        typeCheckWarnings = tc.warnings();
+      } else {
+        // run(), except that modules reused as type-checked keep their bodies and replay their warnings.
+        tc.collectSignatures();
+        std::vector<char> replayed(o.inputs.size(), 0);
+        for (ls::Fn &f : p.f) {
+          if (f.ex) continue;
+          const bool script = f.n == ls::kScriptEntryName;
+          const std::size_t mi = moduleOf(f.n);
+          if (!script && moduleTyped[mi]) {
+            if (!replayed[mi]) {
+              replayed[mi] = 1;
+              typeCheckWarnings.insert(typeCheckWarnings.end(), moduleCache[mi].warnings.begin(),
+                                       moduleCache[mi].warnings.end());
+            }
+            continue;
+          }
+          const std::size_t before = tc.warnings().size();
+          tc.checkFunction(f);
+          for (std::size_t k = before; k < tc.warnings().size(); ++k) {
+            typeCheckWarnings.push_back(tc.warnings()[k]);
+            if (!script) moduleCache[mi].warnings.push_back(tc.warnings()[k]);
+          }
+        }
+        std::vector<std::vector<const ls::Fn *>> checked(o.inputs.size());
+        for (const ls::Fn &f : p.f) {
+          if (f.n != ls::kScriptEntryName && !moduleTyped[moduleOf(f.n)]) checked[moduleOf(f.n)].push_back(&f);
+        }
+        for (std::size_t mi = 0; mi < o.inputs.size(); ++mi) {
+          if (!moduleTyped[mi]) moduleCache[mi].typed = ls::encodeProgramAst(checked[mi], {});
+        }
+      }
+      typeCheckPhase.stop();
+      if (superuserMode) {
+        for (const auto &w : typeCheckWarnings) ls::superuserLogV(1, "type-check warning: " + w);
+        ls::superuserLogV(2, "stage: type-check complete");
+      }
+    } else if (superuserMode) {
+      ls::superuserLogV(2, "stage: type-check skipped (typed IR input)");
+    }
+    // Bundles carry the program as type-checked but not yet optimized, so a consumer can re-optimize.
+    ls::AstWriter typedIr;
+    const bool wantTypedIr = !o.emitTypedIrPath.empty() || (!incrementalTypedIrPath.empty() && !o.check);
+    if (wantTypedIr) {
+      ls::PhaseTimer snapshotPhase("typed-ir-snapshot");
+      typedIr = ls::typedIrProgram(&p);
     }
 
     stage = "optimize";
@@ -12943,14 +23092,28 @@ int main(int argc, char **argv) {
       ls::superuserLogV(2, "stage: optimize begin");
       ls::superuserLogV(2, "optimizer passes=" + std::to_string(o.passes));
     }
-    ls::optimize(p, o.passes);
+    ls::ProfileHints profileHints;
+    if (!o.profileUsePath.empty()) {
+      profileHints = ls::loadProfileHints(o.profileUsePath);
+      if (!cleanOutputModeEarly) {
+        std::cout << "Profile hints: " << profileHints.hot.size() << " hot, " << profileHints.cold.size()
+                  << " cold function(s)\n";
+      }
+    }
+    {
+      ls::PhaseTimer optimizePhase("optimize");
+      ls::optimize(p, o.passes, o.profileUsePath.empty() ? nullptr : &profileHints);
+    }
     stage = "re-type-check";
     if (superuserMode) ls::superuserLogV(2, "stage: re-type-check begin");
+    ls::PhaseTimer retypePhase("re-type-check");
     ls::TypeCheck tc2(p, superuserMode);
+    tc2.setOptimizedInput();
     tc2.run();
+    retypePhase.stop();
     {
       std::unordered_set<std::string> seenWarnings;
-      for (const auto &w : tc.warnings()) {
+      for (const auto &w : typeCheckWarnings) {
         if (seenWarnings.insert(w).second) std::cerr << w << '\n';
       }
       for (const auto &w : tc2.warnings()) {
@@ -12968,41 +23131,101 @@ int main(int argc, char **argv) {
 
     stage = "emit/build";
     if (superuserMode) ls::superuserLogV(2, "stage: emit/build begin");
-    ls::EmitC ec(p, ls::inlineSet(p), superuserMode, o.superuserSession, activeCliFlags, o.cliCustomTokens);
+    ls::PhaseTimer emitPhase("emit");
+    const std::unordered_set<std::string> inlined = ls::inlineSet(p);
+    ls::EmitC ec(p, inlined, superuserMode, o.superuserSession, activeCliFlags, o.cliCustomTokens);
+    if (o.profile) {
+      ec.enableProfiling((o.profileOutPath.empty() ? std::filesystem::path(ls::kDefaultProfileOut) : o.profileOutPath)
+                             .string());
+    }
+    ec.setProfileHints(profileHints);
     if ((o.build || o.run) && !ec.hasEntry()) {
       throw std::runtime_error(ec.entryError());
     }
+    std::unordered_map<std::string, std::string> fnKeys;
+    if (moduleCacheEnabled && !o.inputs.empty() && !ec.ultraMinimalRuntime()) {
+      const std::string mode = ec.emitModeKey();
+      std::unordered_map<std::string, const ls::CachedFunctionC *> prior;
+      for (std::size_t mi = 0; mi < moduleCache.size(); ++mi) {
+        for (const auto &fc : moduleCache[mi].fns) {
+          if (moduleOf(fc.name) == mi) prior[fc.name] = &fc;
+        }
+      }
+      std::unordered_map<std::string, std::string> reuse;
+      for (const ls::Fn &f : p.f) {
+        if (f.ex) continue;
+        const char hint = profileHints.hot.count(f.n) ? 'h' : (profileHints.cold.count(f.n) ? 'c' : '-');
+        const std::string key = ls::functionAstHash(f, mode + (inlined.count(f.n) ? "i" : "-") + hint);
+        fnKeys[f.n] = key;
+        auto hit = prior.find(f.n);
+        if (hit != prior.end() && hit->second->key == key) reuse[f.n] = hit->second->c;
+      }
+      ec.reuseFunctionC(std::move(reuse));
+    }
     const bool cleanOutputMode = cleanOutputModeEarly;
     ls::setSuperuserLogging(superuserMode, cleanOutputMode, o.superuserVerbosity);
     if (superuserMode) {
       ls::superuserLogV(3,
                         std::string("debug stream=") + (cleanOutputMode ? "stderr/debug-window (.format mode)" : "terminal"));
     }
-    const bool hasParallelFor = ls::hasParallelForProgram(p);
-    const bool hasWinGraphicsDep = ls::hasWinGraphicsDepProgram(p);
-    const bool hasWinNetDep = ls::hasCallNamedProgram(p, "http_server_listen") ||
-                              ls::hasCallNamedProgram(p, "http_server_accept") ||
-                              ls::hasCallNamedProgram(p, "http_server_read") ||
-                              ls::hasCallNamedProgram(p, "http_server_respond_text") ||
-                              ls::hasCallNamedProgram(p, "http_server_close") ||
-                              ls::hasCallNamedProgram(p, "http_client_connect") ||
-                              ls::hasCallNamedProgram(p, "http_client_send") ||
-                              ls::hasCallNamedProgram(p, "http_client_read") ||
-                              ls::hasCallNamedProgram(p, "http_client_close");
-    const bool hasPosixThreadDep = ls::hasCallNamedProgram(p, "spawn") || ls::hasCallNamedProgram(p, "await") ||
-                                   ls::hasCallNamedProgram(p, "await_all");
+    const ls::ProgramUsage &usage = ec.usage();
+    const bool hasParallelFor = usage.hasParallelFor;
+    const bool hasWinGraphicsDep = ls::usesWinGraphicsRuntime(usage);
+    const bool hasWinNetDep = ls::usesHttpRuntime(usage);
+    const bool hasPosixThreadDep = usage.calledAny({"spawn", "await", "await_all"}) || usage.calledPrefix("chan_");
     const bool ultraMinimalRuntime = ec.ultraMinimalRuntime();
-    const bool hasInteractiveInput = ls::hasCallNamedProgram(p, "input") || ls::hasCallNamedProgram(p, "input_i64") ||
-                                     ls::hasCallNamedProgram(p, "input_f64");
+    const bool hasInteractiveInput = usage.calledAny({"input", "input_i64", "input_f64"});
     if (superuserMode) ls::superuserLogV(2, "emitting C backend source");
     const std::string cOut = ec.run();
+    emitPhase.stop();
+    ls::PhaseTimer cacheWritePhase("cache-write");
+    if (superuserMode) {
+      ls::superuserLogV(3, "runtime definitions kept: " + std::to_string(ec.runtimeDefinitionsKept()) + " of " +
+                               std::to_string(ec.runtimeDefinitionsTotal()));
+    }
+    if (moduleCacheEnabled) {
+      std::vector<std::vector<ls::CachedFunctionC>> moduleFns(o.inputs.size());
+      for (const ls::Fn &f : p.f) {
+        auto key = fnKeys.find(f.n);
+        auto text = ec.functionC().find(f.n);
+        if (key == fnKeys.end() || text == ec.functionC().end()) continue;
+        moduleFns[moduleOf(f.n)].push_back(ls::CachedFunctionC{f.n, key->second, text->second});
+      }
+      for (std::size_t mi = 0; mi < o.inputs.size(); ++mi) {
+        ls::ModuleCacheRecord &record = moduleCache[mi];
+        bool changed = moduleParsed[mi] != 0 || !moduleTyped[mi] || record.fns.size() != moduleFns[mi].size();
+        for (std::size_t k = 0; !changed && k < moduleFns[mi].size(); ++k) {
+          changed = record.fns[k].name != moduleFns[mi][k].name || record.fns[k].key != moduleFns[mi][k].key;
+        }
+        if (!changed) continue;
+        record.fns = std::move(moduleFns[mi]);
+        ls::writeModuleCache(ls::moduleCachePath(o.cacheDir, o.inputs[mi]), record);
+      }
+      if (superuserMode) {
+        ls::superuserLogV(3, "module cache: reused " + std::to_string(modulesReused) + " of " +
+                                 std::to_string(o.inputs.size()) + " module AST(s) (" +
+                                 std::to_string(modulesTyped) + " type-checked), " +
+                                 std::to_string(ec.functionsReused()) + " of " + std::to_string(fnKeys.size()) +
+                                 " function definition(s)");
+      }
+      if (!cleanOutputMode && modulesReused > 0) {
+        std::cout << "Module cache: reused " << modulesReused << " of " << o.inputs.size() << " module(s) ("
+                  << modulesTyped << " type-checked), "
+                  << ec.functionsReused() << " of " << fnKeys.size() << " function(s)\n";
+      }
+    }
     const std::string sourceStateHash = o.inputs.empty() ? std::string() : ls::computeSourceStateHash(o.inputs);
+    const std::string buildDeps = ls::encodeBuildDeps(hasParallelFor, hasWinGraphicsDep, hasWinNetDep, hasPosixThreadDep,
+                                                      ultraMinimalRuntime, hasInteractiveInput);
     if (!o.emitTypedIrPath.empty()) {
-      ls::writeTypedIrBundle(o.emitTypedIrPath, cOut, sourceStateHash, incrementalConfigHash);
+      ls::writeTypedIrBundle(o.emitTypedIrPath, typedIr, cOut, sourceStateHash, incrementalConfigHash, buildDeps,
+                             emitConfig);
     }
     if (!incrementalTypedIrPath.empty() && !o.check) {
-      ls::writeTypedIrBundle(incrementalTypedIrPath, cOut, sourceStateHash, incrementalConfigHash);
+      ls::writeTypedIrBundle(incrementalTypedIrPath, std::move(typedIr), cOut, sourceStateHash, incrementalConfigHash,
+                             buildDeps, emitConfig);
     }
+    cacheWritePhase.stop();
     return ls::finish(o, cOut, cleanOutputMode, hasParallelFor, hasWinGraphicsDep, hasWinNetDep, hasPosixThreadDep,
                       ultraMinimalRuntime, hasInteractiveInput, superuserMode, ec.superuserIrDumpRequested());
   } catch (const ls::CompileError &e) {
@@ -0,0 +1,110 @@
+param(
+  [string]$FrontendCompiler = "clang++",
+  [int]$Rounds = 5,
+  [switch]$SkipBuild
+)
+
+$ErrorActionPreference = "Stop"
+if ($null -ne (Get-Variable -Name PSNativeCommandUseErrorActionPreference -ErrorAction SilentlyContinue)) {
+  $PSNativeCommandUseErrorActionPreference = $false
+}
+
+if ($Rounds -lt 1) {
+  throw "-Rounds expects a positive integer"
+}
+
+$root = Split-Path -Parent $PSScriptRoot
+Set-Location $root
+
+function Build-Frontend {
+  param([string]$Preferred)
+  $compilerSrc = Join-Path $root "src\\lsc.cpp"
+  $compilerExe = Join-Path $root "lsc.exe"
+  if (-not (Test-Path $compilerSrc)) {
+    if (Test-Path $compilerExe) {
+      Write-Host "Using existing frontend binary: lsc.exe"
+      return
+    }
+    throw "Missing both src\\lsc.cpp and lsc.exe."
+  }
+  foreach ($cxx in @($Preferred, "clang++", "g++")) {
+    if ([string]::IsNullOrWhiteSpace($cxx)) { continue }
+    try {
+      & $cxx -std=c++20 -O3 -Wall -Wextra -pedantic $compilerSrc -o $compilerExe 2>&1 | Out-Null
+      if ($LASTEXITCODE -eq 0) {
+        Write-Host "Frontend build OK with $cxx"
+        return
+      }
+    } catch {
+      # try next compiler
+    }
+  }
+  throw "Failed to build lsc.exe. Install clang++ or g++."
+}
+
+function Get-PhaseMs {
+  param($Report, [string]$Phase)
+  foreach ($p in $Report.phases) {
+    if ($p.name -eq $Phase) { return [double]$p.ms }
+  }
+  return 0.0
+}
+
+if (-not $SkipBuild) {
+  Build-Frontend -Preferred $FrontendCompiler
+} elseif (-not (Test-Path (Join-Path $root "lsc.exe"))) {
+  throw "-SkipBuild given but lsc.exe is missing."
+}
+
+$artifactDir = Join-Path $root "tests\\artifacts_frontend_bench"
+if (Test-Path $artifactDir) { Remove-Item -Recurse -Force $artifactDir }
+New-Item -ItemType Directory -Path $artifactDir | Out-Null
+$report = Join-Path $artifactDir "time-passes.json"
+
+$corpus = @(
+  Get-ChildItem -Path (Join-Path $root "tests\\cases\\runtime"), (Join-Path $root "tests\\stress") -Filter "*.lsc" -File |
+    Sort-Object FullName
+)
+$lines = 0
+foreach ($f in $corpus) { $lines += @(Get-Content -LiteralPath $f.FullName).Count }
+
+$lex = 0.0
+$parse = 0.0
+$check = 0.0
+$skipped = New-Object System.Collections.Generic.List[string]
+
+for ($r = 1; $r -le $Rounds; $r++) {
+  foreach ($f in $corpus) {
+    if (Test-Path $report) { Remove-Item -Force $report }
+    $prev = $ErrorActionPreference
+    $ErrorActionPreference = "Continue"
+    try {
+      & .\lsc.exe $f.FullName --check --no-cache --time-passes-json $report 2>&1 | Out-Null
+    } finally {
+      $ErrorActionPreference = $prev
+    }
+    if ($LASTEXITCODE -ne 0 -or -not (Test-Path $report)) {
+      if ($r -eq 1) { $skipped.Add($f.FullName) }
+      continue
+    }
+    $json = Get-Content -Raw -LiteralPath $report | ConvertFrom-Json
+    $lex += Get-PhaseMs -Report $json -Phase "lex"
+    $parse += Get-PhaseMs -Report $json -Phase "parse"
+    $check += Get-PhaseMs -Report $json -Phase "type-check"
+  }
+}
+
+Remove-Item -Recurse -Force $artifactDir
+
+foreach ($s in $skipped) {
+  Write-Host "[frontend-bench] skipped (check failed): $s"
+}
+
+$fe = $lex + $parse + $check
+Write-Host ("[frontend-bench] corpus: {0} files, {1} lines, {2} rounds" -f $corpus.Count, $lines, $Rounds)
+Write-Host ("[frontend-bench] lex        {0,10:N3} ms" -f ($lex / $Rounds))
+Write-Host ("[frontend-bench] parse      {0,10:N3} ms" -f ($parse / $Rounds))
+Write-Host ("[frontend-bench] type-check {0,10:N3} ms" -f ($check / $Rounds))
+if ($fe -gt 0) {
+  Write-Host ("[frontend-bench] throughput {0,10:N0} lines/s" -f ($lines * $Rounds / ($fe / 1000.0)))
+}
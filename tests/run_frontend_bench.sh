@@ -0,0 +1,135 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+frontend_compiler="clang++"
+rounds=5
+skip_build=0
+
+while [[ $# -gt 0 ]]; do
+  case "$1" in
+    --frontend-compiler)
+      frontend_compiler="$2"
+      shift 2
+      ;;
+    --rounds)
+      rounds="$2"
+      shift 2
+      ;;
+    --skip-build)
+      skip_build=1
+      shift
+      ;;
+    *)
+      echo "Unknown option: $1" >&2
+      echo "Usage: ./tests/run_frontend_bench.sh [--frontend-compiler clang++] [--rounds 5] [--skip-build]" >&2
+      exit 1
+      ;;
+  esac
+done
+
+if ! [[ "$rounds" =~ ^[1-9][0-9]*$ ]]; then
+  echo "--rounds expects a positive integer" >&2
+  exit 1
+fi
+
+root="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+cd "$root"
+
+compiler_bin="$root/lsc"
+if [[ -f "$root/lsc.exe" && ! -f "$root/lsc" ]]; then
+  compiler_bin="$root/lsc.exe"
+fi
+
+build_frontend() {
+  local preferred="$1"
+  local src="$root/src/lsc.cpp"
+  if [[ ! -f "$src" ]]; then
+    if [[ -f "$compiler_bin" ]]; then
+      echo "Using existing frontend binary: $(basename "$compiler_bin")"
+      return
+    fi
+    echo "Missing both src/lsc.cpp and compiler binary." >&2
+    exit 1
+  fi
+
+  local candidates=()
+  [[ -n "$preferred" ]] && candidates+=("$preferred")
+  candidates+=("clang++" "g++")
+  for cxx in "${candidates[@]}"; do
+    if [[ -z "$cxx" ]]; then
+      continue
+    fi
+    if "$cxx" -std=c++20 -O3 -Wall -Wextra -pedantic "$src" -o "$compiler_bin" >/dev/null 2>&1; then
+      echo "Frontend build OK with $cxx"
+      return
+    fi
+  done
+
+  echo "Failed to build compiler. Install clang++ or g++." >&2
+  exit 1
+}
+
+# Pulls one phase's milliseconds out of a linescript-time-passes-v1 report.
+phase_ms() {
+  local json="$1"
+  local phase="$2"
+  printf '%s' "$json" | grep -o "\"name\":\"$phase\",\"ms\":[0-9.]*" | head -n 1 | sed 's/.*"ms"://'
+}
+
+if [[ $skip_build -eq 0 ]]; then
+  build_frontend "$frontend_compiler"
+elif [[ ! -f "$compiler_bin" ]]; then
+  echo "--skip-build given but no compiler binary at $compiler_bin" >&2
+  exit 1
+fi
+
+artifact_dir="$root/tests/artifacts_frontend_bench"
+rm -rf "$artifact_dir"
+mkdir -p "$artifact_dir"
+report="$artifact_dir/time-passes.json"
+
+corpus=()
+while IFS= read -r f; do
+  corpus+=("$f")
+done < <(find tests/cases/runtime tests/stress -maxdepth 1 -name '*.lsc' | LC_ALL=C sort)
+
+lines=0
+for f in "${corpus[@]}"; do
+  n=$(wc -l <"$f")
+  lines=$((lines + n))
+done
+
+lex_total=0
+parse_total=0
+check_total=0
+skipped=()
+
+for ((r = 1; r <= rounds; r++)); do
+  for f in "${corpus[@]}"; do
+    rm -f "$report"
+    if ! "$compiler_bin" "$f" --check --no-cache --time-passes-json "$report" >/dev/null 2>&1 || [[ ! -f "$report" ]]; then
+      [[ $r -eq 1 ]] && skipped+=("$f")
+      continue
+    fi
+    json="$(cat "$report")"
+    lex_total=$(awk -v a="$lex_total" -v b="$(phase_ms "$json" lex)" 'BEGIN { printf "%.3f", a + b }')
+    parse_total=$(awk -v a="$parse_total" -v b="$(phase_ms "$json" parse)" 'BEGIN { printf "%.3f", a + b }')
+    check_total=$(awk -v a="$check_total" -v b="$(phase_ms "$json" type-check)" 'BEGIN { printf "%.3f", a + b }')
+  done
+done
+
+rm -rf "$artifact_dir"
+
+for f in "${skipped[@]}"; do
+  echo "[frontend-bench] skipped (check failed): $f"
+done
+
+awk -v files="${#corpus[@]}" -v lines="$lines" -v rounds="$rounds" \
+  -v lex="$lex_total" -v parse="$parse_total" -v check="$check_total" 'BEGIN {
+  fe = lex + parse + check
+  printf "[frontend-bench] corpus: %d files, %d lines, %d rounds\n", files, lines, rounds
+  printf "[frontend-bench] lex        %10.3f ms\n", lex / rounds
+  printf "[frontend-bench] parse      %10.3f ms\n", parse / rounds
+  printf "[frontend-bench] type-check %10.3f ms\n", check / rounds
+  if (fe > 0) printf "[frontend-bench] throughput %10.0f lines/s\n", lines * rounds / (fe / 1000.0)
+}'
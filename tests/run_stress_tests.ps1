@@ -90,6 +90,21 @@ $tests = @(
     Source = "tests\\stress\\stress_collections_pipeline.lsc"
     Expected = "199990000"
   },
+  [PSCustomObject]@{
+    Name = "stress_dict_churn"
+    Source = "tests\\stress\\stress_dict_churn.lsc"
+    Expected = "79999800000`n1000"
+  },
+  [PSCustomObject]@{
+    Name = "stress_physics_bodies"
+    Source = "tests\\stress\\stress_physics_bodies.lsc"
+    Expected = "13333`n1595`n871689"
+  },
+  [PSCustomObject]@{
+    Name = "stress_game_batched_render"
+    Source = "tests\\stress\\stress_game_batched_render.lsc"
+    Expected = "2081069`n200"
+  },
   [PSCustomObject]@{
     Name = "stress_memory_reuse"
     Source = "tests\\stress\\stress_memory_reuse.lsc"
@@ -168,7 +183,7 @@ $tests = @(
   [PSCustomObject]@{
     Name = "physics_capacity_walk"
     Source = "tests\\stress\\physics_capacity_walk.lsc"
-    Expected = "8386561"
+    Expected = "8390658"
   }
 )
 
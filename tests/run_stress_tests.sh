@@ -127,6 +127,9 @@ tests=(
   "stress_mod_pipeline|tests/stress/stress_mod_pipeline.lsc|232800000"
   "stress_parallel_independent|tests/stress/stress_parallel_independent.lsc|55999974000000"
   "stress_collections_pipeline|tests/stress/stress_collections_pipeline.lsc|199990000"
+  "stress_dict_churn|tests/stress/stress_dict_churn.lsc|79999800000\\n1000"
+  "stress_physics_bodies|tests/stress/stress_physics_bodies.lsc|13333\\n1595\\n871689"
+  "stress_game_batched_render|tests/stress/stress_game_batched_render.lsc|2081069\\n200"
   "stress_memory_reuse|tests/stress/stress_memory_reuse.lsc|0\\n1056000"
   "stress_task_spawn_reuse|tests/stress/stress_task_spawn_reuse.lsc|0\\n6400"
   "stress_http_burst_roundtrip|tests/stress/stress_http_burst_roundtrip.lsc|160"
@@ -142,7 +145,7 @@ tests=(
   "game_capacity_alloc|tests/stress/game_capacity_alloc.lsc|32\\n-1"
   "game_render_pipeline|tests/stress/game_render_pipeline.lsc|124302463\\n240\\nfalse"
   "vectorization_probe|tests/stress/vectorization_probe.lsc|499999500000"
-  "physics_capacity_walk|tests/stress/physics_capacity_walk.lsc|8386561"
+  "physics_capacity_walk|tests/stress/physics_capacity_walk.lsc|8390658"
 )
 
 failures=()
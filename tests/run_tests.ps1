@@ -166,9 +166,25 @@ $runtimeTests = @(
   [PSCustomObject]@{ Name = "input_stability"; Sources = @("tests\\cases\\runtime\\input_stability.lsc"); Input = "alpha`nbeta`n"; Expected = "alpha`nbeta" },
   [PSCustomObject]@{ Name = "input_numeric"; Sources = @("tests\\cases\\runtime\\input_numeric.lsc"); Input = "10`n2.25`n7`n0.75`n"; Expected = "17`n300" },
   [PSCustomObject]@{ Name = "format_with_input"; Sources = @("tests\\cases\\runtime\\format_with_input.lsc"); Input = "Neo`n"; Expected = "Neo" },
+  [PSCustomObject]@{ Name = "output_buffer_format"; Sources = @("tests\\cases\\runtime\\output_buffer_format.lsc"); Input = "Neo`n"; Expected = "0.1`n0.3333333333333333`n2.5e-07`n1e+22`n-0`n100`n-9223372036854775808`n0.3`nab`n40`n5`nname? Neo" },
+  [PSCustomObject]@{ Name = "optimizer_pipeline"; Sources = @("tests\\cases\\runtime\\optimizer_pipeline.lsc"); Expected = "2999000`n504503`n9`nbump`nbump`n8`n20`n48`n288`n-27`n18`n14`n14`n2470`n2" },
   [PSCustomObject]@{ Name = "http_server_client_roundtrip"; Sources = @("tests\\cases\\runtime\\http_server_client_roundtrip.lsc"); Expected = "true`ntrue" },
+  [PSCustomObject]@{ Name = "http_event_keepalive"; Sources = @("tests\\cases\\runtime\\http_event_keepalive.lsc"); Expected = "true`ntrue`ntrue`n3" },
+  [PSCustomObject]@{ Name = "http_multi_worker"; Sources = @("tests\\cases\\runtime\\http_multi_worker.lsc"); Expected = "2`n8`n8`n0" },
+  [PSCustomObject]@{ Name = "http_request_view"; Sources = @("tests\\cases\\runtime\\http_request_view.lsc"); Expected = "true`ntrue`ntrue`ntrue`n4`ntrue`n1" },
+  [PSCustomObject]@{ Name = "file_mmap_records"; Sources = @("tests\\cases\\runtime\\file_mmap_records.lsc"); Expected = "true`n48006`n5000`n500`n243`nlast;x`n5001`n500`nrow;B;ok`n6`n3`nrow`n10`n1`nA`n12`n2`nok`n5001`n500`n-1`n-1" },
   [PSCustomObject]@{ Name = "state_speed"; Sources = @("tests\\cases\\runtime\\state_speed.lsc"); ExpectedRegex = "^49995000`nspeed_us=[0-9]+$" },
   [PSCustomObject]@{ Name = "free_console_call"; Sources = @("tests\\cases\\runtime\\free_console_call.lsc"); Expected = "" },
+  [PSCustomObject]@{ Name = "string_arena_regions"; Sources = @("tests\\cases\\runtime\\string_arena_regions.lsc"); Expected = "2001`nbbbb`ntrue`ntrue`nB0`nXXXXXXXX`nlllllllllllllllllllllllllllllllleaf`nABCDEFG" },
+  [PSCustomObject]@{ Name = "string_length_views"; Sources = @("tests\\cases\\runtime\\string_length_views.lsc"); Expected = "WORLD`n5`ntrue`npad`ntrue`nbababababab`n11`nNESCRIPT`n1`nagain`nfalse" },
+  [PSCustomObject]@{ Name = "typed_containers"; Sources = @("tests\\cases\\runtime\\typed_containers.lsc"); Expected = "14850`n30`n4`n3.75`n2`n2`n0`n4498500`n3000" },
+  [PSCustomObject]@{ Name = "typed_array_untracked_handle"; Sources = @("tests\\cases\\runtime\\typed_array_untracked_handle.lsc"); Expected = "7`n7,8,-3`n3`ntrue`n-3`n9`n2.5 0.25`n2.75`n40`n42" },
+  [PSCustomObject]@{ Name = "np_fused_expressions"; Sources = @("tests\\cases\\runtime\\np_fused_expressions.lsc"); Expected = "4`n5`n13`n2.5`n0`n0`n5`n4`n0" },
+  [PSCustomObject]@{ Name = "np_matrix_kernels"; Sources = @("tests\\cases\\runtime\\np_matrix_kernels.lsc"); Expected = "2`n2`n20`n41`n3`n6`n3`n9`n15`ntrue`n56`nfalse`ntrue`nfalse`ntrue`n12`n64`n1`n-1`n128`n144`ntrue`n1025`n1`n-4550`n6.5`n6.5`n1" },
+  [PSCustomObject]@{ Name = "physics_soa_broadphase"; Sources = @("tests\\cases\\runtime\\physics_soa_broadphase.lsc"); Expected = "5000`n5000`n49951`n2500`n4999`nfalse`n0`n1`n1`n1`n1`n1`n0`n50`n200" },
+  [PSCustomObject]@{ Name = "dead_store_if_branch"; Sources = @("tests\\cases\\runtime\\dead_store_if_branch.lsc"); Expected = "2`n5`n9`n7" },
+  [PSCustomObject]@{ Name = "gfx_batched_raster"; Sources = @("tests\\cases\\runtime\\gfx_batched_raster.lsc"); Expected = "false`ntrue`n6`n1`n1`n1`nfalse" },
+  [PSCustomObject]@{ Name = "game_dirty_present"; Sources = @("tests\\cases\\runtime\\game_dirty_present.lsc"); Expected = "64000`n1`n0`n201`n2`n672`n4`n1`n1`n3`n64000`n1" },
   [PSCustomObject]@{ Name = "replace_and_string_stability"; Sources = @("tests\\cases\\runtime\\replace_and_string_stability.lsc"); Expected = "aa`nbaxx`ncdef" },
   [PSCustomObject]@{ Name = "common_numeric_utils"; Sources = @("tests\\cases\\runtime\\common_numeric_utils.lsc"); Expected = "3`n7`n6`n36" },
   [PSCustomObject]@{ Name = "manual_memory_control"; Sources = @("tests\\cases\\runtime\\manual_memory_control.lsc"); Expected = "123`n2.5`n123`n0" },
@@ -179,7 +195,15 @@ $runtimeTests = @(
   [PSCustomObject]@{ Name = "format_block"; Sources = @("tests\\cases\\runtime\\format_block.lsc"); Expected = "A1`nB!" },
   [PSCustomObject]@{ Name = "custom_flag_script_noarg"; Sources = @("tests\\cases\\runtime\\custom_flag_script.lsc"); Expected = "script-ok" },
   [PSCustomObject]@{ Name = "spawn_await"; Sources = @("tests\\cases\\runtime\\spawn_await.lsc"); Expected = "worker`n1`n1" },
+  [PSCustomObject]@{ Name = "spawn_futures"; Sources = @("tests\\cases\\runtime\\spawn_futures.lsc"); Expected = "144`n2.5`nREADY`n25`n328350" },
+  [PSCustomObject]@{ Name = "spawn_pool_nested"; Sources = @("tests\\cases\\runtime\\spawn_pool_nested.lsc"); Expected = "0`n64`n1" },
+  [PSCustomObject]@{ Name = "await_all_in_task"; Sources = @("tests\\cases\\runtime\\await_all_in_task.lsc"); Expected = "12`n20`n384" },
+  [PSCustomObject]@{ Name = "await_after_await_all"; Sources = @("tests\\cases\\runtime\\await_after_await_all.lsc"); Expected = "9`n25`n49`n3000" },
+  [PSCustomObject]@{ Name = "chan_atomic_pipeline"; Sources = @("tests\\cases\\runtime\\chan_atomic_pipeline.lsc"); Expected = "10000`n10000`n49995000`n4`n4`ntrue`n0`nfalse`n10`n20`ntrue`n0`ntrue`n6667`n6667`nfalse`ntrue`n8`n10" },
+  [PSCustomObject]@{ Name = "chan_await_helping"; Sources = @("tests\\cases\\runtime\\chan_await_helping.lsc"); Expected = "2646700`n5050`n104160" },
+  [PSCustomObject]@{ Name = "simd_vectors"; Sources = @("tests\\cases\\runtime\\simd_vectors.lsc"); Expected = "[1.5, 2.5, 3.5, 4.5]`n[1.5, 3.5, 5.5, 7.5]`n[-1, -2, -3, -4]`n10`n4`n1`n14`n[0, -2, 3, -4.5]`n[1.5, 0, 10, 10]`n[1.5, 2, 3, 4.5]`n[-4.5, 3, -2, 1.5]`n3`n[9, -2, 3, -4.5]`n[3, -4, 16, 1]`n[2, 3, 4, 5]`n[4, 6, 8, 10]`n[8, 9, 0, 0]`n6`n-1`n[25, 55, 85, 115]`n280`n5`n[2.5, 5, 7.5, 10]`n[1, -1, 2, 7]`n204`n[8, 7, 6, 5, 4, 3, 2, 1]`n240`n[1, 2, 3, 4]`n[0, 0, 0, 0]" },
   [PSCustomObject]@{ Name = "parallel_for_basic"; Sources = @("tests\\cases\\runtime\\parallel_for_basic.lsc"); Expected = "1" },
+  [PSCustomObject]@{ Name = "parallel_for_reduce"; Sources = @("tests\\cases\\runtime\\parallel_for_reduce.lsc"); Expected = "19999900000`n99999.5`n7`nfalse`ntrue`n34" },
   [PSCustomObject]@{ Name = "small_loop_unroll"; Sources = @("tests\\cases\\runtime\\small_loop_unroll.lsc"); Expected = "56" },
   [PSCustomObject]@{ Name = "for_step_runtime_zero"; Sources = @("tests\\cases\\runtime\\for_step_runtime_zero.lsc"); Expected = "0" },
   [PSCustomObject]@{ Name = "multi_module"; Sources = @("tests\\cases\\runtime\\module_math.lsc", "tests\\cases\\runtime\\module_main.lsc"); Expected = "55" },
@@ -206,14 +230,22 @@ $compileFailTests = @(
   [PSCustomObject]@{ Name = "class_static_instance_call"; Source = "tests\\cases\\compile_fail\\class_static_instance_call.lsc"; Contains = "must be called via class name" },
   [PSCustomObject]@{ Name = "class_private_field_access"; Source = "tests\\cases\\compile_fail\\class_private_field_access.lsc"; Contains = "field 'secret' is not accessible in this context" },
   [PSCustomObject]@{ Name = "bad_call_arity"; Source = "tests\\cases\\compile_fail\\bad_call_arity.lsc"; Contains = "function 'sqrt' expects 1 args" },
+  [PSCustomObject]@{ Name = "bench_return"; Source = "tests\\cases\\compile_fail\\bench_return.lsc"; Contains = "'return' inside a bench block" },
   [PSCustomObject]@{ Name = "http_bad_arity"; Source = "tests\\cases\\compile_fail\\http_bad_arity.lsc"; Contains = "function 'http_server_listen' expects 1 args" },
   [PSCustomObject]@{ Name = "string_arithmetic"; Source = "tests\\cases\\compile_fail\\string_arithmetic.lsc"; Contains = "arithmetic requires numeric" },
   [PSCustomObject]@{ Name = "len_wrong_type"; Source = "tests\\cases\\compile_fail\\len_wrong_type.lsc"; Contains = "arg 1 cannot convert 'i64' to 'str'" },
   [PSCustomObject]@{ Name = "parallel_for_break"; Source = "tests\\cases\\compile_fail\\parallel_for_break.lsc"; Contains = "parallel for does not support break/continue" },
   [PSCustomObject]@{ Name = "parallel_for_outer_assign"; Source = "tests\\cases\\compile_fail\\parallel_for_outer_assign.lsc"; Contains = "parallel for cannot assign to outer variables" },
+  [PSCustomObject]@{ Name = "parallel_reduce_type_mismatch"; Source = "tests\\cases\\compile_fail\\parallel_reduce_type_mismatch.lsc"; Contains = "reduce(+: label) requires a numeric variable" },
+  [PSCustomObject]@{ Name = "parallel_reduce_bad_update"; Source = "tests\\cases\\compile_fail\\parallel_reduce_bad_update.lsc"; Contains = "reduce(+: total) target can only be updated as 'total = total + e'" },
+  [PSCustomObject]@{ Name = "parallel_reduce_wrong_operator"; Source = "tests\\cases\\compile_fail\\parallel_reduce_wrong_operator.lsc"; Contains = "reduce(max: m) target can only be updated as 'm = max(m, e)'" },
+  [PSCustomObject]@{ Name = "parallel_reduce_target_read"; Source = "tests\\cases\\compile_fail\\parallel_reduce_target_read.lsc"; Contains = "reduce(+: total) target can only be updated as 'total = total + e' and not otherwise read" },
+  [PSCustomObject]@{ Name = "simd_type_mismatch"; Source = "tests\\cases\\compile_fail\\simd_type_mismatch.lsc"; Contains = "cannot mix 'f32x4' and 'f64x4' in vector arithmetic" },
+  [PSCustomObject]@{ Name = "loop_clause_requires_parallel"; Source = "tests\\cases\\compile_fail\\loop_clause_requires_parallel.lsc"; Contains = "'reduce(...)' requires 'parallel for'" },
   [PSCustomObject]@{ Name = "format_block_bad_end_type"; Source = "tests\\cases\\compile_fail\\format_block_bad_end_type.lsc"; Contains = "formatOutput block end argument must be str" },
-  [PSCustomObject]@{ Name = "spawn_with_args"; Source = "tests\\cases\\compile_fail\\spawn_with_args.lsc"; Contains = "spawn target must not take arguments" },
-  [PSCustomObject]@{ Name = "spawn_non_void"; Source = "tests\\cases\\compile_fail\\spawn_non_void.lsc"; Contains = "spawn target must return void" },
+  [PSCustomObject]@{ Name = "spawn_arg_type_mismatch"; Source = "tests\\cases\\compile_fail\\spawn_arg_type_mismatch.lsc"; Contains = "arg 1 cannot convert 'str' to 'i64'" },
+  [PSCustomObject]@{ Name = "await_result_type_mismatch"; Source = "tests\\cases\\compile_fail\\await_result_type_mismatch.lsc"; Contains = "cannot convert 'i64' to 'str'" },
+  [PSCustomObject]@{ Name = "typed_container_type_mismatch"; Source = "tests\\cases\\compile_fail\\typed_container_type_mismatch.lsc"; Contains = "'array_get_f64' used on an array of 'i64'" },
   [PSCustomObject]@{ Name = "state_speed_bad_arity"; Source = "tests\\cases\\compile_fail\\state_speed_bad_arity.lsc"; Contains = "function '.stateSpeed' expects 0 args" },
   [PSCustomObject]@{ Name = "free_console_bad_arity"; Source = "tests\\cases\\compile_fail\\free_console_bad_arity.lsc"; Contains = "function '.freeConsole' expects 0 args" },
   [PSCustomObject]@{ Name = "format_bad_arity"; Source = "tests\\cases\\compile_fail\\format_bad_arity.lsc"; Contains = "function '.format' expects 0 args" },
@@ -359,6 +391,72 @@ $cliInfoTests = @(
     Args = @("tests\\cases\\runtime\\custom_flag_script.lsc", "--run", "--cc", $BackendCompiler, "-o",
       (Join-Path $artifactDir "flag_bad_warning.exe"), "---bad")
     Contains = "Warning: bad flag '---bad' ignored"
+  },
+  [PSCustomObject]@{
+    Name = "toolchain_probe_store"
+    Args = @("tests\\cases\\runtime\\arithmetic_sum.lsc", "--build", "--cc", $BackendCompiler, "--cache-dir",
+      (Join-Path $artifactDir "toolchain_probe_cache"), "-o", (Join-Path $artifactDir "toolchain_probe.exe"))
+    Contains = "Built binary"
+  },
+  [PSCustomObject]@{
+    Name = "toolchain_probe_cached"
+    Args = @("tests\\cases\\runtime\\arithmetic_sum.lsc", "--build", "--cc", $BackendCompiler, "--cache-dir",
+      (Join-Path $artifactDir "toolchain_probe_cache"), "-o", (Join-Path $artifactDir "toolchain_probe.exe"))
+    Contains = "Toolchain probe: cached"
+  },
+  [PSCustomObject]@{
+    Name = "module_cache_store"
+    Args = @("tests\\cases\\runtime\\module_math.lsc", "tests\\cases\\runtime\\module_main.lsc", "--cache-dir",
+      (Join-Path $artifactDir "module_cache"), "-o", (Join-Path $artifactDir "module_cache.c"))
+    Contains = "Emitted C"
+  },
+  [PSCustomObject]@{
+    Name = "module_cache_reuse"
+    Args = @("tests\\cases\\runtime\\module_math.lsc", "tests\\cases\\runtime\\module_main.lsc", "--passes", "3",
+      "--cache-dir", (Join-Path $artifactDir "module_cache"), "-o", (Join-Path $artifactDir "module_cache.c"))
+    Contains = "Module cache: reused 2 of 2 module(s)"
+  },
+  [PSCustomObject]@{
+    Name = "module_cache_typed_reuse"
+    Args = @("tests\\cases\\runtime\\module_math.lsc", "tests\\cases\\runtime\\module_main.lsc", "--passes", "2",
+      "--cache-dir", (Join-Path $artifactDir "module_cache"), "-o", (Join-Path $artifactDir "module_cache.c"))
+    Contains = "reused 2 of 2 module(s) (2 type-checked)"
+  },
+  [PSCustomObject]@{
+    Name = "typed_ir_emit"
+    Args = @("tests\\cases\\runtime\\arithmetic_sum.lsc", "--build", "--no-cache", "--cc", $BackendCompiler,
+      "--emit-typed-ir", (Join-Path $artifactDir "typed_ir.lsir"), "-o", (Join-Path $artifactDir "typed_ir_emit.exe"))
+    Contains = "Built binary"
+  },
+  [PSCustomObject]@{
+    Name = "typed_ir_consume_reoptimize"
+    Args = @("--consume-typed-ir", (Join-Path $artifactDir "typed_ir.lsir"), "--run", "--passes", "3", "--cc",
+      $BackendCompiler, "-o", (Join-Path $artifactDir "typed_ir_consume.exe"))
+    Contains = "55"
+  },
+  [PSCustomObject]@{
+    Name = "time_passes_report"
+    Args = @("tests\\cases\\runtime\\arithmetic_sum.lsc", "--check", "--time-passes")
+    Contains = "optimizer pass 1:"
+  },
+  [PSCustomObject]@{
+    Name = "profile_collapsed_stacks"
+    Args = @("tests\\cases\\runtime\\profile_hot_paths.lsc", "--profile", "--profile-out",
+      (Join-Path $artifactDir "profile_hot_paths.folded"), "--run", "--cc", $BackendCompiler, "-o",
+      (Join-Path $artifactDir "profile_hot_paths.exe"))
+    Contains = "never_called: 0.0% self, 0.0% total, 0 call(s)"
+  },
+  [PSCustomObject]@{
+    Name = "profile_use_hints"
+    Args = @("tests\\cases\\runtime\\profile_hot_paths.lsc", "--profile-use",
+      "tests\\cases\\runtime\\profile_hot_paths.functions", "--check")
+    Contains = "Profile hints: 1 hot, 1 cold function(s)"
+  },
+  [PSCustomObject]@{
+    Name = "bench_json_report"
+    Args = @("tests\\cases\\runtime\\bench_blocks.lsc", "--bench", "--bench-time", "0", "--bench-warmup", "0",
+      "--bench-samples", "3", "--cc", $BackendCompiler, "-o", (Join-Path $artifactDir "bench_blocks.exe"))
+    Contains = '"name":"sum_to","samples":3,"iterations_per_sample":1,"iterations":3,"warmup_iterations":1'
   }
 )
 
@@ -405,6 +503,39 @@ $replTests = @(
     Name = "repl_builtin_not_confused_by_var_name"
     Input = "declare print = 9`nprint(""call-ok"")`n:exit`n"
     Contains = "call-ok"
+  },
+  [PSCustomObject]@{
+    Name = "repl_state_persists_in_process"
+    Input = "declare x = 500`nx = x + 1`nprintln(x)`n:exit`n"
+    Contains = "501"
+  },
+  [PSCustomObject]@{
+    Name = "repl_function_defined_then_called"
+    Input = "twice(n: i64) -> i64 do`n  return n * 2`nend`nprintln(twice(21))`n:exit`n"
+    Contains = "42"
+  },
+  [PSCustomObject]@{
+    Name = "repl_runtime_fault_keeps_state"
+    Input = "declare x = 7`ndeclare z = 0`nx = x / z`nprintln(x + 100)`n:exit`n"
+    Contains = "107"
+  }
+)
+
+$serveTests = @(
+  [PSCustomObject]@{
+    Name = "serve_check_ok"
+    Input = "{`"jsonrpc`":`"2.0`",`"id`":1,`"method`":`"check`",`"params`":{`"files`":[`"tests/cases/runtime/module_math.lsc`",`"tests/cases/runtime/module_main.lsc`"]}}`n"
+    Contains = "`"ok`":true"
+  },
+  [PSCustomObject]@{
+    Name = "serve_did_change_rechecks_caller"
+    Input = "{`"jsonrpc`":`"2.0`",`"id`":1,`"method`":`"check`",`"params`":{`"files`":[`"tests/cases/runtime/module_math.lsc`",`"tests/cases/runtime/module_main.lsc`"]}}`n{`"jsonrpc`":`"2.0`",`"id`":2,`"method`":`"didChange`",`"params`":{`"file`":`"tests/cases/runtime/module_math.lsc`",`"text`":`"sum_sq(n: i64, m: i64) -> i64 do\n  return n + m\nend\n`"}}`n"
+    Contains = "function 'sum_sq' expects 2 args"
+  },
+  [PSCustomObject]@{
+    Name = "serve_unknown_method"
+    Input = "{`"jsonrpc`":`"2.0`",`"id`":1,`"method`":`"nope`"}`n"
+    Contains = "method not found: nope"
   }
 )
 
@@ -570,6 +701,27 @@ foreach ($t in $replTests) {
   $passed += 1
 }
 
+foreach ($t in $serveTests) {
+  $total += 1
+  $prev = $ErrorActionPreference
+  $ErrorActionPreference = "Continue"
+  try {
+    $out = $t.Input | & .\lsc.exe --serve 2>&1 | Out-String
+    $rc = $LASTEXITCODE
+  } finally {
+    $ErrorActionPreference = $prev
+  }
+  if ($rc -ne 0) {
+    $failures.Add("[serve:$($t.Name)] expected zero exit code`nactual:`n$out")
+    continue
+  }
+  if (-not (Contains-Normalized -Haystack $out -Needle $t.Contains)) {
+    $failures.Add("[serve:$($t.Name)] expected message containing: $($t.Contains)`nactual:`n$out")
+    continue
+  }
+  $passed += 1
+}
+
 Write-Host ""
 Write-Host "Test summary: $passed / $total passed"
 if ($failures.Count -gt 0) {
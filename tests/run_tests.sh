@@ -168,7 +168,29 @@ runtime_tests=(
   "manual_memory_control|tests/cases/runtime/manual_memory_control.lsc|123\\n2.5\\n123\\n0||0"
   "for_step_runtime_zero|tests/cases/runtime/for_step_runtime_zero.lsc|0||0"
   "spawn_await|tests/cases/runtime/spawn_await.lsc|worker\\n1\\n1||0"
+  "spawn_futures|tests/cases/runtime/spawn_futures.lsc|144\\n2.5\\nREADY\\n25\\n328350||0"
+  "parallel_for_reduce|tests/cases/runtime/parallel_for_reduce.lsc|19999900000\\n99999.5\\n7\\nfalse\\ntrue\\n34||0"
+  "spawn_pool_nested|tests/cases/runtime/spawn_pool_nested.lsc|0\\n64\\n1||0"
+  "await_all_in_task|tests/cases/runtime/await_all_in_task.lsc|12\\n20\\n384||0"
+  "await_after_await_all|tests/cases/runtime/await_after_await_all.lsc|9\\n25\\n49\\n3000||0"
+  "chan_atomic_pipeline|tests/cases/runtime/chan_atomic_pipeline.lsc|10000\\n10000\\n49995000\\n4\\n4\\ntrue\\n0\\nfalse\\n10\\n20\\ntrue\\n0\\ntrue\\n6667\\n6667\\nfalse\\ntrue\\n8\\n10||0"
+  "chan_await_helping|tests/cases/runtime/chan_await_helping.lsc|2646700\\n5050\\n104160||0"
+  "simd_vectors|tests/cases/runtime/simd_vectors.lsc|[1.5, 2.5, 3.5, 4.5]\\n[1.5, 3.5, 5.5, 7.5]\\n[-1, -2, -3, -4]\\n10\\n4\\n1\\n14\\n[0, -2, 3, -4.5]\\n[1.5, 0, 10, 10]\\n[1.5, 2, 3, 4.5]\\n[-4.5, 3, -2, 1.5]\\n3\\n[9, -2, 3, -4.5]\\n[3, -4, 16, 1]\\n[2, 3, 4, 5]\\n[4, 6, 8, 10]\\n[8, 9, 0, 0]\\n6\\n-1\\n[25, 55, 85, 115]\\n280\\n5\\n[2.5, 5, 7.5, 10]\\n[1, -1, 2, 7]\\n204\\n[8, 7, 6, 5, 4, 3, 2, 1]\\n240\\n[1, 2, 3, 4]\\n[0, 0, 0, 0]||0"
   "http_server_client_roundtrip|tests/cases/runtime/http_server_client_roundtrip.lsc|true\\ntrue||0"
+  "http_event_keepalive|tests/cases/runtime/http_event_keepalive.lsc|true\\ntrue\\ntrue\\n3||0"
+  "http_multi_worker|tests/cases/runtime/http_multi_worker.lsc|2\\n8\\n8\\n0||0"
+  "http_request_view|tests/cases/runtime/http_request_view.lsc|true\\ntrue\\ntrue\\ntrue\\n4\\ntrue\\n1||0"
+  "file_mmap_records|tests/cases/runtime/file_mmap_records.lsc|true\\n48006\\n5000\\n500\\n243\\nlast;x\\n5001\\n500\\nrow;B;ok\\n6\\n3\\nrow\\n10\\n1\\nA\\n12\\n2\\nok\\n5001\\n500\\n-1\\n-1||0"
+  "string_arena_regions|tests/cases/runtime/string_arena_regions.lsc|2001\\nbbbb\\ntrue\\ntrue\\nB0\\nXXXXXXXX\\nlllllllllllllllllllllllllllllllleaf\\nABCDEFG||0"
+  "string_length_views|tests/cases/runtime/string_length_views.lsc|WORLD\\n5\\ntrue\\npad\\ntrue\\nbababababab\\n11\\nNESCRIPT\\n1\\nagain\\nfalse||0"
+  "typed_containers|tests/cases/runtime/typed_containers.lsc|14850\\n30\\n4\\n3.75\\n2\\n2\\n0\\n4498500\\n3000||0"
+  "typed_array_untracked_handle|tests/cases/runtime/typed_array_untracked_handle.lsc|7\\n7,8,-3\\n3\\ntrue\\n-3\\n9\\n2.5 0.25\\n2.75\\n40\\n42||0"
+  "np_fused_expressions|tests/cases/runtime/np_fused_expressions.lsc|4\\n5\\n13\\n2.5\\n0\\n0\\n5\\n4\\n0||0"
+  "np_matrix_kernels|tests/cases/runtime/np_matrix_kernels.lsc|2\\n2\\n20\\n41\\n3\\n6\\n3\\n9\\n15\\ntrue\\n56\\nfalse\\ntrue\\nfalse\\ntrue\\n12\\n64\\n1\\n-1\\n128\\n144\\ntrue\\n1025\\n1\\n-4550\\n6.5\\n6.5\\n1||0"
+  "physics_soa_broadphase|tests/cases/runtime/physics_soa_broadphase.lsc|5000\\n5000\\n49951\\n2500\\n4999\\nfalse\\n0\\n1\\n1\\n1\\n1\\n1\\n0\\n50\\n200||0"
+  "dead_store_if_branch|tests/cases/runtime/dead_store_if_branch.lsc|2\\n5\\n9\\n7||0"
+  "gfx_batched_raster|tests/cases/runtime/gfx_batched_raster.lsc|false\\ntrue\\n6\\n1\\n1\\n1\\nfalse||0"
+  "game_dirty_present|tests/cases/runtime/game_dirty_present.lsc|64000\\n1\\n0\\n201\\n2\\n672\\n4\\n1\\n1\\n3\\n64000\\n1||0"
   "game_headless_basic|tests/cases/runtime/game_headless_basic.lsc|1\\n16\\n16\\n10\\n65280\\n255\\n16777215\\n2446448900070348069\\n1\\nfalse||0"
   "bitmap_text_renderer|tests/cases/runtime/bitmap_text_renderer.lsc|4\\n3\\n660510\\ntrue\\n4\\n660510\\n660510\\n12\\n660510\\n12\\nsoftware\\ntrue\\ntrue\\nvulkan\\nfalse||0"
   "renderer_backend_targets|tests/cases/runtime/renderer_backend_targets.lsc|true\\ntrue\\ntrue\\ntrue\\ntrue\\ntrue\\ntrue\\ntrue\\ndirectx11\\ntrue\\ndirectx12\\ntrue\\nfalse\\ndirectx12||0"
@@ -177,6 +199,8 @@ runtime_tests=(
   "game_scroll_mouse_inputs|tests/cases/runtime/game_scroll_mouse_inputs.lsc|0\\n0\\nfalse\\nfalse\\nfalse\\nfalse\\n0\\n0||0"
   "input_numeric|tests/cases/runtime/input_numeric.lsc|17\\n300|10\\n2.25\\n7\\n0.75\\n|0"
   "format_with_input|tests/cases/runtime/format_with_input.lsc|Neo|Neo\\n|0"
+  "output_buffer_format|tests/cases/runtime/output_buffer_format.lsc|0.1\\n0.3333333333333333\\n2.5e-07\\n1e+22\\n-0\\n100\\n-9223372036854775808\\n0.3\\nab\\n40\\n5\\nname? Neo|Neo\\n|0"
+  "optimizer_pipeline|tests/cases/runtime/optimizer_pipeline.lsc|2999000\\n504503\\n9\\nbump\\nbump\\n8\\n20\\n48\\n288\\n-27\\n18\\n14\\n14\\n2470\\n2||0"
   "custom_flag_script_noarg|tests/cases/runtime/custom_flag_script.lsc|script-ok||0"
   "state_speed|tests/cases/runtime/state_speed.lsc|^49995000\\nspeed_us=[0-9]+$||1"
   "multi_module|tests/cases/runtime/module_math.lsc,tests/cases/runtime/module_main.lsc|55||0"
@@ -188,18 +212,28 @@ runtime_tests=(
 compile_fail_tests=(
   "const_no_init|tests/cases/compile_fail/const_no_init.lsc|declare const requires an initializer"
   "mod_zero_const|tests/cases/compile_fail/mod_zero_const.lsc|modulo by zero"
+  "spawn_arg_type_mismatch|tests/cases/compile_fail/spawn_arg_type_mismatch.lsc|arg 1 cannot convert 'str' to 'i64'"
+  "await_result_type_mismatch|tests/cases/compile_fail/await_result_type_mismatch.lsc|cannot convert 'i64' to 'str'"
+  "typed_container_type_mismatch|tests/cases/compile_fail/typed_container_type_mismatch.lsc|'array_get_f64' used on an array of 'i64'"
   "class_unknown_field|tests/cases/compile_fail/class_unknown_field.lsc|has no field"
   "class_bad_override|tests/cases/compile_fail/class_bad_override.lsc|has no base method to override"
   "class_override_final|tests/cases/compile_fail/class_override_final.lsc|cannot override final base method"
   "class_static_instance_call|tests/cases/compile_fail/class_static_instance_call.lsc|must be called via class name"
   "class_private_field_access|tests/cases/compile_fail/class_private_field_access.lsc|field 'secret' is not accessible in this context"
   "bad_call_arity|tests/cases/compile_fail/bad_call_arity.lsc|function 'sqrt' expects 1 args"
+  "bench_return|tests/cases/compile_fail/bench_return.lsc|'return' inside a bench block"
   "game_fullscreen_bad_types|tests/cases/compile_fail/game_fullscreen_bad_types.lsc|arg 1 cannot convert 'str' to 'i64'"
   "http_bad_arity|tests/cases/compile_fail/http_bad_arity.lsc|function 'http_server_listen' expects 1 args"
   "game_scroll_bad_types|tests/cases/compile_fail/game_scroll_bad_types.lsc|arg 1 cannot convert 'str' to 'i64'"
   "game_mouse_down_bad_types|tests/cases/compile_fail/game_mouse_down_bad_types.lsc|arg 2 cannot convert 'str' to 'i64'"
   "multicore_window_bad_types|tests/cases/compile_fail/multicore_window_bad_types.lsc|arg 1 cannot convert 'str' to 'i64'"
   "parallel_for_break|tests/cases/compile_fail/parallel_for_break.lsc|parallel for does not support break/continue"
+  "parallel_reduce_type_mismatch|tests/cases/compile_fail/parallel_reduce_type_mismatch.lsc|reduce(+: label) requires a numeric variable"
+  "parallel_reduce_bad_update|tests/cases/compile_fail/parallel_reduce_bad_update.lsc|reduce(+: total) target can only be updated as 'total = total + e'"
+  "parallel_reduce_wrong_operator|tests/cases/compile_fail/parallel_reduce_wrong_operator.lsc|reduce(max: m) target can only be updated as 'm = max(m, e)'"
+  "parallel_reduce_target_read|tests/cases/compile_fail/parallel_reduce_target_read.lsc|reduce(+: total) target can only be updated as 'total = total + e' and not otherwise read"
+  "simd_type_mismatch|tests/cases/compile_fail/simd_type_mismatch.lsc|cannot mix 'f32x4' and 'f64x4' in vector arithmetic"
+  "loop_clause_requires_parallel|tests/cases/compile_fail/loop_clause_requires_parallel.lsc|'reduce(...)' requires 'parallel for'"
   "not_non_bool|tests/cases/compile_fail/not_non_bool.lsc|unary '!' requires bool"
   "operator_override_bad_arity|tests/cases/compile_fail/operator_override_bad_arity.lsc|expects exactly 2 parameters"
   "operator_method_bad_arity|tests/cases/compile_fail/operator_method_bad_arity.lsc|expects exactly 1 parameter"
@@ -240,6 +274,17 @@ cli_info_tests=(
   "flag_linescript_version|--LineScript|LineScript version 1.5.1c (Velocity update)"
   "flag_undefined_warning|tests/cases/runtime/custom_flag_script.lsc --run --cc $backend_compiler -o $artifact_dir/flag_undefined_warning${exe_suffix} --ghost|Warning: undefined flag '--ghost'"
   "flag_bad_warning|tests/cases/runtime/custom_flag_script.lsc --run --cc $backend_compiler -o $artifact_dir/flag_bad_warning${exe_suffix} ---bad|Warning: bad flag '---bad' ignored"
+  "toolchain_probe_store|tests/cases/runtime/arithmetic_sum.lsc --build --cc $backend_compiler --cache-dir $artifact_dir/toolchain_probe_cache -o $artifact_dir/toolchain_probe${exe_suffix}|Built binary"
+  "toolchain_probe_cached|tests/cases/runtime/arithmetic_sum.lsc --build --cc $backend_compiler --cache-dir $artifact_dir/toolchain_probe_cache -o $artifact_dir/toolchain_probe${exe_suffix}|Toolchain probe: cached"
+  "module_cache_store|tests/cases/runtime/module_math.lsc tests/cases/runtime/module_main.lsc --cache-dir $artifact_dir/module_cache -o $artifact_dir/module_cache.c|Emitted C"
+  "module_cache_reuse|tests/cases/runtime/module_math.lsc tests/cases/runtime/module_main.lsc --passes 3 --cache-dir $artifact_dir/module_cache -o $artifact_dir/module_cache.c|Module cache: reused 2 of 2 module(s)"
+  "module_cache_typed_reuse|tests/cases/runtime/module_math.lsc tests/cases/runtime/module_main.lsc --passes 2 --cache-dir $artifact_dir/module_cache -o $artifact_dir/module_cache.c|reused 2 of 2 module(s) (2 type-checked)"
+  "typed_ir_emit|tests/cases/runtime/arithmetic_sum.lsc --build --no-cache --cc $backend_compiler --emit-typed-ir $artifact_dir/typed_ir.lsir -o $artifact_dir/typed_ir_emit${exe_suffix}|Built binary"
+  "typed_ir_consume_reoptimize|--consume-typed-ir $artifact_dir/typed_ir.lsir --run --passes 3 --cc $backend_compiler -o $artifact_dir/typed_ir_consume${exe_suffix}|55"
+  "time_passes_report|tests/cases/runtime/arithmetic_sum.lsc --check --time-passes|optimizer pass 1:"
+  "profile_collapsed_stacks|tests/cases/runtime/profile_hot_paths.lsc --profile --profile-out $artifact_dir/profile_hot_paths.folded --run --cc $backend_compiler -o $artifact_dir/profile_hot_paths${exe_suffix}|never_called: 0.0% self, 0.0% total, 0 call(s)"
+  "profile_use_hints|tests/cases/runtime/profile_hot_paths.lsc --profile-use tests/cases/runtime/profile_hot_paths.functions --check|Profile hints: 1 hot, 1 cold function(s)"
+  "bench_json_report|tests/cases/runtime/bench_blocks.lsc --bench --bench-time 0 --bench-warmup 0 --bench-samples 3 --cc $backend_compiler -o $artifact_dir/bench_blocks${exe_suffix}|\"name\":\"sum_to\",\"samples\":3,\"iterations_per_sample\":1,\"iterations\":3,\"warmup_iterations\":1"
 )
 
 cli_hardening_tests=(
@@ -254,6 +299,15 @@ repl_tests=(
   "repl_superuser_verbosity_alias|superuser()\\nsuperuser.verbosity.5\\n:exit\\n|verbosity set to 5"
   "repl_print_after_superuser_toggle|superuser()\\nsuperuser()\\nprint(\"shell-print-still-works\")\\n:exit\\n|shell-print-still-works"
   "repl_builtin_not_confused_by_var_name|declare print = 9\\nprint(\"call-ok\")\\n:exit\\n|call-ok"
+  "repl_state_persists_in_process|declare x = 500\\nx = x + 1\\nprintln(x)\\n:exit\\n|501"
+  "repl_function_defined_then_called|twice(n: i64) -> i64 do\\n  return n * 2\\nend\\nprintln(twice(21))\\n:exit\\n|42"
+  "repl_runtime_fault_keeps_state|declare x = 7\\ndeclare z = 0\\nx = x / z\\nprintln(x + 100)\\n:exit\\n|107"
+)
+
+serve_tests=(
+  "serve_check_ok|{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"check\",\"params\":{\"files\":[\"tests/cases/runtime/module_math.lsc\",\"tests/cases/runtime/module_main.lsc\"]}}\n|\"ok\":true"
+  "serve_did_change_rechecks_caller|{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"check\",\"params\":{\"files\":[\"tests/cases/runtime/module_math.lsc\",\"tests/cases/runtime/module_main.lsc\"]}}\n{\"jsonrpc\":\"2.0\",\"id\":2,\"method\":\"didChange\",\"params\":{\"file\":\"tests/cases/runtime/module_math.lsc\",\"text\":\"sum_sq(n: i64, m: i64) -> i64 do\\\\n  return n + m\\\\nend\\\\n\"}}\n|function 'sum_sq' expects 2 args"
+  "serve_unknown_method|{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"nope\"}\n|method not found: nope"
 )
 
 failures=()
@@ -472,6 +526,25 @@ for t in "${repl_tests[@]}"; do
   passed=$((passed + 1))
 done
 
+for t in "${serve_tests[@]}"; do
+  IFS='|' read -r name input_esc contains <<<"$t"
+  input_data=$(printf '%b' "$input_esc")
+  total=$((total + 1))
+  set +e
+  out=$(printf '%s' "$input_data" | "$compiler_bin" --serve 2>&1)
+  rc=$?
+  set -e
+  if [[ $rc -ne 0 ]]; then
+    failures+=("[serve:$name] expected zero exit code\nactual:\n$out")
+    continue
+  fi
+  if ! contains_normalized "$out" "$contains"; then
+    failures+=("[serve:$name] expected message containing: $contains\nactual:\n$out")
+    continue
+  fi
+  passed=$((passed + 1))
+done
+
 echo
 echo "Test summary: $passed / $total passed"
 if [[ ${#failures[@]} -gt 0 ]]; then
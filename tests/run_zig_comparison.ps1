@@ -380,6 +380,9 @@ function Invoke-GauntletCaseTimed {
     "concurrency" {
       $runRes = Invoke-ProcessTimed -Command $Command -Arguments $Arguments -InputText "1337`n4`n40000`n8`n"
     }
+    "matrix" {
+      $runRes = Invoke-ProcessTimed -Command $Command -Arguments $Arguments -InputText "1337`n0`n384`n4`n"
+    }
     "http" {
       $port = Get-FreeTcpPort
       $runRes = Invoke-HttpServerTimed -Command $Command -Arguments $Arguments -Port $port -Requests 8
@@ -1,28 +1,61 @@
-"use strict";
-
-const FULL_BUILTIN_NAMES = Object.freeze([
-  '.format',
-  '.formatOutput',
-  '.freeConsole',
-  '.stateSpeed',
-  'abs',
-  'abs_f64',
-  'abs_i64',
-  'acos',
-  'array_free',
-  'array_get',
-  'array_includes',
-  'array_join',
-  'array_len',
-  'array_new',
-  'array_pop',
-  'array_push',
-  'array_set',
-  'asin',
+"use strict";
+
+const FULL_BUILTIN_NAMES = Object.freeze([
+  '.format',
+  '.formatOutput',
+  '.freeConsole',
+  '.stateSpeed',
+  'abs',
+  'abs_f64',
+  'abs_i64',
+  'acos',
+  'array_free',
+  'array_get',
+  'array_get_f64',
+  'array_get_i64',
+  'array_includes',
+  'array_join',
+  'array_len',
+  'array_new',
+  'array_new_f64',
+  'array_new_i64',
+  'array_pop',
+  'array_pop_f64',
+  'array_pop_i64',
+  'array_push',
+  'array_push_f64',
+  'array_push_i64',
+  'array_set',
+  'array_set_f64',
+  'array_set_i64',
+  'array_sum_f64',
+  'array_sum_i64',
+  'asin',
   'atan',
   'atan2',
+  'atomic_add',
+  'atomic_cas',
+  'atomic_exchange',
+  'atomic_free',
+  'atomic_get',
+  'atomic_new',
+  'atomic_set',
   'await',
   'await_all',
+  'await_f64',
+  'await_i64',
+  'await_str',
+  'chan_close',
+  'chan_closed',
+  'chan_free',
+  'chan_len',
+  'chan_new',
+  'chan_next',
+  'chan_recv',
+  'chan_send',
+  'chan_try_recv',
+  'chan_try_send',
+  'chan_value',
   'task_hardware_threads',
   'task_hyperthreading_enabled',
   'task_set_hyperthreading',
@@ -36,72 +69,184 @@ const FULL_BUILTIN_NAMES = Object.freeze([
   'bitmap_save_ppm',
   'bitmap_set',
   'bitmap_width',
+  'black_box',
   'bool_to_i64',
-  'byte_at',
-  'bytes_len',
-  'camera_bind',
-  'camera_get_x',
-  'camera_get_y',
-  'camera_get_z',
-  'camera_set_offset',
-  'camera_target',
-  'ceil',
-  'chr',
-  'clamp',
-  'clamp_f64',
-  'clamp_i64',
-  'cli_has',
-  'cli_token',
-  'cli_token_count',
-  'cli_value',
-  'clock_ms',
-  'clock_us',
-  'contains',
-  'cos',
-  'deg_to_rad',
-  'dict_free',
-  'dict_get',
-  'dict_has',
-  'dict_len',
-  'dict_new',
-  'dict_remove',
-  'dict_set',
-  'ends_with',
-  'exp',
-  'find',
-  'floor',
-  'FormatOutput',
-  'FreeConsole',
-  'game_begin',
-  'game_checksum',
-  'game_clear',
+  'byte_at',
+  'bytes_len',
+  'camera_bind',
+  'camera_get_x',
+  'camera_get_y',
+  'camera_get_z',
+  'camera_set_offset',
+  'camera_target',
+  'ceil',
+  'chr',
+  'clamp',
+  'clamp_f64',
+  'clamp_i64',
+  'cli_has',
+  'cli_token',
+  'cli_token_count',
+  'cli_value',
+  'clock_ms',
+  'clock_us',
+  'contains',
+  'cos',
+  'deg_to_rad',
+  'dict_add_f64',
+  'dict_add_i64',
+  'dict_free',
+  'dict_get',
+  'dict_get_f64',
+  'dict_get_i64',
+  'dict_has',
+  'dict_len',
+  'dict_new',
+  'dict_new_f64',
+  'dict_new_i64',
+  'dict_remove',
+  'dict_set',
+  'dict_set_f64',
+  'dict_set_i64',
+  'ends_with',
+  'exp',
+  'f32x4',
+  'f32x4_abs',
+  'f32x4_eq',
+  'f32x4_fma',
+  'f32x4_from_f64x4',
+  'f32x4_from_i64x4',
+  'f32x4_ge',
+  'f32x4_gt',
+  'f32x4_hmax',
+  'f32x4_hmin',
+  'f32x4_lane',
+  'f32x4_le',
+  'f32x4_load_mem',
+  'f32x4_load_np',
+  'f32x4_lt',
+  'f32x4_max',
+  'f32x4_min',
+  'f32x4_ne',
+  'f32x4_select',
+  'f32x4_shuffle',
+  'f32x4_splat',
+  'f32x4_sqrt',
+  'f32x4_store_mem',
+  'f32x4_store_np',
+  'f32x4_sum',
+  'f32x4_with_lane',
+  'f32x8',
+  'f32x8_abs',
+  'f32x8_eq',
+  'f32x8_fma',
+  'f32x8_ge',
+  'f32x8_gt',
+  'f32x8_hmax',
+  'f32x8_hmin',
+  'f32x8_lane',
+  'f32x8_le',
+  'f32x8_load_mem',
+  'f32x8_load_np',
+  'f32x8_lt',
+  'f32x8_max',
+  'f32x8_min',
+  'f32x8_ne',
+  'f32x8_select',
+  'f32x8_shuffle',
+  'f32x8_splat',
+  'f32x8_sqrt',
+  'f32x8_store_mem',
+  'f32x8_store_np',
+  'f32x8_sum',
+  'f32x8_with_lane',
+  'f64x4',
+  'f64x4_abs',
+  'f64x4_eq',
+  'f64x4_fma',
+  'f64x4_from_f32x4',
+  'f64x4_from_i64x4',
+  'f64x4_ge',
+  'f64x4_gt',
+  'f64x4_hmax',
+  'f64x4_hmin',
+  'f64x4_lane',
+  'f64x4_le',
+  'f64x4_load_mem',
+  'f64x4_load_np',
+  'f64x4_lt',
+  'f64x4_max',
+  'f64x4_min',
+  'f64x4_ne',
+  'f64x4_select',
+  'f64x4_shuffle',
+  'f64x4_splat',
+  'f64x4_sqrt',
+  'f64x4_store_mem',
+  'f64x4_store_np',
+  'f64x4_sum',
+  'f64x4_with_lane',
+  'file_cursor',
+  'file_cursor_contains',
+  'file_cursor_delim',
+  'file_cursor_free',
+  'file_cursor_len',
+  'file_cursor_next',
+  'file_cursor_offset',
+  'file_cursor_text',
+  'file_map',
+  'file_map_chunk',
+  'file_map_count',
+  'file_map_find',
+  'file_map_size',
+  'file_map_text',
+  'file_unmap',
+  'file_write',
+  'file_write_line',
+  'file_writer_close',
+  'file_writer_flush',
+  'file_writer_open',
+  'find',
+  'floor',
+  'flush',
+  'FormatOutput',
+  'FreeConsole',
+  'game_batching_enabled',
+  'game_begin',
+  'game_checksum',
+  'game_clear',
   'game_delta',
+  'game_dirty_pixels',
+  'game_dirty_rect_count',
   'game_draw_bitmap',
   'game_draw_gfx',
   'game_end',
-  'game_frame',
-  'game_free',
+  'game_flush',
+  'game_frame',
+  'game_free',
   'game_get',
   'game_height',
   'game_is_fullscreen',
   'game_interpolated_delta',
   'game_interpolation_alpha',
   'game_interpolation_enabled',
+  'game_invalidate',
   'game_line',
-  'game_mouse_down',
-  'game_mouse_down_name',
-  'game_mouse_norm_x',
-  'game_mouse_norm_y',
-  'game_mouse_x',
-  'game_mouse_y',
-  'game_new',
-  'game_poll',
-  'game_present',
-  'game_rect',
-  'game_save_ppm',
-  'game_scroll_x',
-  'game_scroll_y',
+  'game_mouse_down',
+  'game_mouse_down_name',
+  'game_mouse_norm_x',
+  'game_mouse_norm_y',
+  'game_mouse_x',
+  'game_mouse_y',
+  'game_new',
+  'game_poll',
+  'game_present',
+  'game_rect',
+  'game_save_ppm',
+  'game_scroll_x',
+  'game_scroll_y',
   'game_set',
+  'game_set_batching',
   'game_set_fixed_dt',
   'game_set_fullscreen',
   'game_set_fullscreen_mode',
@@ -116,9 +261,11 @@ const FULL_BUILTIN_NAMES = Object.freeze([
   'game_text_width',
   'game_window_mode',
   'game_width',
-  'gcd',
-  'gfx_clear',
-  'gfx_free',
+  'gcd',
+  'gfx_batching_enabled',
+  'gfx_clear',
+  'gfx_flush',
+  'gfx_free',
   'gfx_get',
   'gfx_height',
   'gfx_draw_bitmap',
@@ -127,104 +274,154 @@ const FULL_BUILTIN_NAMES = Object.freeze([
   'gfx_rect',
   'gfx_save_ppm',
   'gfx_set',
+  'gfx_set_batching',
   'gfx_text',
   'gfx_text_width',
   'gfx_width',
-  'http_client_close',
-  'http_client_connect',
-  'http_client_read',
-  'http_client_send',
-  'http_server_accept',
-  'http_server_close',
-  'http_server_listen',
-  'http_server_read',
-  'http_server_respond_text',
-  'i64_to_bool',
-  'includes',
-  'input',
-  'input_f64',
-  'input_i64',
-  'is_empty',
-  'key_down',
-  'key_down_name',
-  'lcm',
-  'len',
-  'log',
-  'log10',
-  'lower',
-  'map_free',
-  'map_get',
-  'map_has',
-  'map_len',
-  'map_new',
-  'map_remove',
-  'map_set',
-  'max',
-  'max_f64',
-  'max_i64',
-  'mem_alloc',
-  'mem_copy',
-  'mem_free',
-  'mem_read_f64',
-  'mem_read_i64',
-  'mem_realloc',
-  'mem_set',
-  'mem_write_f64',
-  'mem_write_i64',
-  'min',
-  'min_f64',
-  'min_i64',
-  'np_abs',
-  'np_add',
-  'np_add_scalar',
-  'np_clip',
-  'np_copy',
-  'np_div',
-  'np_dot',
-  'np_fill',
-  'np_free',
-  'np_from_range',
-  'np_get',
-  'np_len',
-  'np_linspace',
-  'np_max',
-  'np_mean',
-  'np_min',
-  'np_mul',
-  'np_mul_scalar',
-  'np_new',
-  'np_set',
-  'np_sub',
-  'np_sum',
-  'object_free',
-  'object_get',
-  'object_has',
-  'object_len',
-  'object_new',
-  'object_remove',
-  'object_set',
-  'option_free',
-  'option_is_none',
-  'option_is_some',
-  'option_none',
-  'option_some',
-  'option_unwrap',
-  'option_unwrap_or',
-  'ord',
-  'parse_f64',
-  'parse_i64',
-  'pg_begin',
-  'pg_blit',
-  'pg_checksum',
-  'pg_clear',
-  'pg_delta',
+  'http_client_close',
+  'http_client_connect',
+  'http_client_read',
+  'http_client_send',
+  'http_request_body',
+  'http_request_header',
+  'http_request_method',
+  'http_request_path',
+  'http_request_query',
+  'http_server_accept',
+  'http_server_close',
+  'http_server_listen',
+  'http_server_listen_multi',
+  'http_server_poll',
+  'http_server_read',
+  'http_server_respond_file',
+  'http_server_respond_text',
+  'http_server_workers',
+  'i64_to_bool',
+  'i64x4',
+  'i64x4_abs',
+  'i64x4_eq',
+  'i64x4_from_f32x4',
+  'i64x4_from_f64x4',
+  'i64x4_ge',
+  'i64x4_gt',
+  'i64x4_hmax',
+  'i64x4_hmin',
+  'i64x4_lane',
+  'i64x4_le',
+  'i64x4_load_mem',
+  'i64x4_lt',
+  'i64x4_max',
+  'i64x4_min',
+  'i64x4_ne',
+  'i64x4_select',
+  'i64x4_shuffle',
+  'i64x4_splat',
+  'i64x4_store_mem',
+  'i64x4_sum',
+  'i64x4_with_lane',
+  'includes',
+  'input',
+  'input_f64',
+  'input_i64',
+  'is_empty',
+  'key_down',
+  'key_down_name',
+  'lcm',
+  'len',
+  'log',
+  'log10',
+  'lower',
+  'map_free',
+  'map_get',
+  'map_has',
+  'map_len',
+  'map_new',
+  'map_remove',
+  'map_set',
+  'max',
+  'max_f64',
+  'max_i64',
+  'mem_alloc',
+  'mem_copy',
+  'mem_free',
+  'mem_read_f64',
+  'mem_read_i64',
+  'mem_realloc',
+  'mem_set',
+  'mem_write_f64',
+  'mem_write_i64',
+  'min',
+  'min_f64',
+  'min_i64',
+  'np_abs',
+  'np_add',
+  'np_add_into',
+  'np_add_scalar',
+  'np_clip',
+  'np_cols',
+  'np_copy',
+  'np_div',
+  'np_div_into',
+  'np_dot',
+  'np_fill',
+  'np_free',
+  'np_from_range',
+  'np_get',
+  'np_len',
+  'np_linspace',
+  'np_mat_get',
+  'np_mat_new',
+  'np_mat_new_f32',
+  'np_mat_set',
+  'np_matmul',
+  'np_matmul_into',
+  'np_max',
+  'np_mean',
+  'np_min',
+  'np_mul',
+  'np_mul_into',
+  'np_mul_scalar',
+  'np_new',
+  'np_new_f32',
+  'np_reshape',
+  'np_rows',
+  'np_set',
+  'np_sub',
+  'np_sub_into',
+  'np_sum',
+  'np_sum_axis',
+  'np_sum_axis_into',
+  'np_transpose',
+  'np_transpose_into',
+  'object_free',
+  'object_get',
+  'object_has',
+  'object_len',
+  'object_new',
+  'object_remove',
+  'object_set',
+  'option_free',
+  'option_is_none',
+  'option_is_some',
+  'option_none',
+  'option_some',
+  'option_unwrap',
+  'option_unwrap_or',
+  'ord',
+  'parse_f64',
+  'parse_i64',
+  'pg_begin',
+  'pg_blit',
+  'pg_checksum',
+  'pg_clear',
+  'pg_delta',
   'pg_draw_line',
   'pg_draw_bitmap',
   'pg_draw_pixel',
   'pg_draw_rect',
   'pg_draw_text',
   'pg_end',
-  'pg_frame',
+  'pg_frame',
   'pg_get_pixel',
   'pg_init',
   'pg_interpolated_delta',
@@ -236,14 +433,14 @@ const FULL_BUILTIN_NAMES = Object.freeze([
   'pg_bitmap_free',
   'pg_load_bitmap',
   'pg_mouse_down',
-  'pg_mouse_down_name',
-  'pg_mouse_norm_x',
-  'pg_mouse_norm_y',
-  'pg_mouse_x',
-  'pg_mouse_y',
-  'pg_quit',
-  'pg_save_ppm',
-  'pg_scroll_x',
+  'pg_mouse_down_name',
+  'pg_mouse_norm_x',
+  'pg_mouse_norm_y',
+  'pg_mouse_x',
+  'pg_mouse_y',
+  'pg_quit',
+  'pg_save_ppm',
+  'pg_scroll_x',
   'pg_scroll_y',
   'pg_set_fixed_dt',
   'pg_set_fullscreen',
@@ -265,33 +462,45 @@ const FULL_BUILTIN_NAMES = Object.freeze([
   'pg_surface_save_ppm',
   'pg_surface_set',
   'pg_surface_text',
-  'phys_apply_force',
-  'phys_free',
-  'phys_get_vx',
-  'phys_get_vy',
-  'phys_get_vz',
-  'phys_get_x',
-  'phys_get_y',
-  'phys_get_z',
-  'phys_is_soft',
-  'phys_move',
-  'phys_new',
-  'phys_set_position',
-  'phys_set_velocity',
-  'phys_step',
-  'pi',
-  'pow',
-  'print',
-  'print_bool',
-  'print_f64',
-  'print_i64',
-  'print_str',
-  'println',
-  'println_bool',
-  'println_f64',
-  'println_i64',
-  'println_str',
-  'rad_to_deg',
+  'phys_apply_force',
+  'phys_contact_count',
+  'phys_count',
+  'phys_free',
+  'phys_get_radius',
+  'phys_get_vx',
+  'phys_get_vy',
+  'phys_get_vz',
+  'phys_get_x',
+  'phys_get_y',
+  'phys_get_z',
+  'phys_is_soft',
+  'phys_move',
+  'phys_new',
+  'phys_set_position',
+  'phys_set_radius',
+  'phys_set_velocity',
+  'phys_step',
+  'pi',
+  'pow',
+  'print',
+  'print_bool',
+  'print_f32x4',
+  'print_f32x8',
+  'print_f64',
+  'print_f64x4',
+  'print_i64',
+  'print_i64x4',
+  'print_str',
+  'println',
+  'println_bool',
+  'println_f32x4',
+  'println_f32x8',
+  'println_f64',
+  'println_f64x4',
+  'println_i64',
+  'println_i64x4',
+  'println_str',
+  'rad_to_deg',
   'repeat',
   'replace',
   'renderer_backend',
@@ -302,41 +511,64 @@ const FULL_BUILTIN_NAMES = Object.freeze([
   'renderer_set_hardware_acceleration',
   'renderer_supports',
   'result_err',
-  'result_error_message',
-  'result_error_type',
-  'result_free',
-  'result_is_err',
-  'result_is_ok',
-  'result_ok',
-  'result_unwrap_or',
-  'result_value',
-  'reverse',
-  'round',
-  'sin',
-  'spawn',
-  'sqrt',
-  'starts_with',
-  'stateSpeed',
-  'su.capabilities',
-  'su.compiler.inspect',
-  'su.debug.hook',
-  'su.ir.dump',
-  'su.limit.set',
-  'su.memory.inspect',
-  'su.trace.off',
-  'su.trace.on',
-  'substring',
-  'superuser',
-  'tan',
-  'tau',
-  'to_f32',
-  'to_f64',
-  'to_i32',
-  'to_i64',
-  'trim',
-  'upper',
-]);
-
-module.exports = {
-  FULL_BUILTIN_NAMES
-};
+  'result_error_message',
+  'result_error_type',
+  'result_free',
+  'result_is_err',
+  'result_is_ok',
+  'result_ok',
+  'result_unwrap_or',
+  'result_value',
+  'reverse',
+  'round',
+  'simd_abs',
+  'simd_eq',
+  'simd_fma',
+  'simd_ge',
+  'simd_gt',
+  'simd_hmax',
+  'simd_hmin',
+  'simd_lane',
+  'simd_le',
+  'simd_lt',
+  'simd_max',
+  'simd_min',
+  'simd_ne',
+  'simd_select',
+  'simd_shuffle',
+  'simd_sqrt',
+  'simd_store_mem',
+  'simd_store_np',
+  'simd_sum',
+  'simd_with_lane',
+  'sin',
+  'spawn',
+  'sqrt',
+  'starts_with',
+  'stateSpeed',
+  'su.capabilities',
+  'su.compiler.inspect',
+  'su.debug.hook',
+  'su.ir.dump',
+  'su.limit.set',
+  'su.memory.inspect',
+  'su.trace.off',
+  'su.trace.on',
+  'substring',
+  'superuser',
+  'tan',
+  'tau',
+  'to_f32',
+  'to_f32x4',
+  'to_f64',
+  'to_f64x4',
+  'to_i32',
+  'to_i64',
+  'to_i64x4',
+  'trim',
+  'upper',
+]);
+
+module.exports = {
+  FULL_BUILTIN_NAMES
+};
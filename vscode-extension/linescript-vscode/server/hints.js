@@ -55,7 +55,11 @@ const TYPE_NAMES = new Set([
   "f64",
   "bool",
   "str",
-  "void"
+  "void",
+  "f32x4",
+  "f32x8",
+  "f64x4",
+  "i64x4"
 ]);
 
 const CORE_BUILTINS = new Set([
@@ -226,6 +230,9 @@ const BUILTIN_ARITY = new Map([
   ["spawn", { min: 1, max: 1 }],
   ["await", { min: 1, max: 1 }],
   ["await_all", { min: 0, max: 0 }],
+  ["await_i64", { min: 1, max: 1 }],
+  ["await_f64", { min: 1, max: 1 }],
+  ["await_str", { min: 1, max: 1 }],
   ["task_hardware_threads", { min: 0, max: 0 }],
   ["task_set_worker_count", { min: 1, max: 1 }],
   ["task_worker_count", { min: 0, max: 0 }],
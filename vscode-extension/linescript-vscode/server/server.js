@@ -1,9 +1,10 @@
 "use strict";
 
-const { execFile } = require("child_process");
+const { execFile, spawn } = require("child_process");
 const fs = require("fs");
 const os = require("os");
 const path = require("path");
+const readline = require("readline");
 const {
   createConnection,
   ProposedFeatures,
@@ -35,6 +36,7 @@ const defaultSettings = {
   validationDelayMaxMs: 3500,
   checkTimeoutMs: 8000,
   extraCheckArgs: [],
+  useCheckServer: true,
   hintsEnabled: true,
   styleHintsEnabled: false,
   maxHintsPerFile: 120
@@ -44,6 +46,8 @@ let hasConfigurationCapability = false;
 const documentSettings = new Map();
 const validationTimers = new Map();
 const validationGenerations = new Map();
+const checkServers = new Map();
+const checkServerUnsupported = new Set();
 
 const keywordDocs = new Map([
   ["declare", "Declare a variable. Example: declare x: i64 = 10"],
@@ -98,8 +102,17 @@ const builtinSignatures = [
   "su.debug.hook(tag: str) -> void",
   "http_server_listen(port: i64) -> i64",
   "http_server_accept(server: i64) -> i64",
+  "http_server_poll(server: i64, timeout_ms: i64) -> i64",
+  "http_server_listen_multi(port: i64, workers: i64) -> i64",
+  "http_server_workers(server: i64) -> i64",
   "http_server_read(client: i64) -> str",
   "http_server_respond_text(client: i64, status: i64, body: str) -> void",
+  "http_server_respond_file(client: i64, status: i64, path: str) -> bool",
+  "http_request_method(client: i64) -> str",
+  "http_request_path(client: i64) -> str",
+  "http_request_query(client: i64) -> str",
+  "http_request_header(client: i64, name: str) -> str",
+  "http_request_body(client: i64) -> str",
   "http_client_connect(host: str, port: i64) -> i64",
   "http_client_send(client: i64, data: str) -> void",
   "http_client_read(client: i64) -> str",
@@ -111,9 +124,29 @@ const builtinSignatures = [
   "array_push(arr: i64, value: str) -> void",
   "array_get(arr: i64, idx: i64) -> str",
   "array_set(arr: i64, idx: i64, value: str) -> void",
+  "array_new_i64() -> i64",
+  "array_push_i64(arr: i64, value: i64) -> void",
+  "array_get_i64(arr: i64, idx: i64) -> i64",
+  "array_set_i64(arr: i64, idx: i64, value: i64) -> void",
+  "array_pop_i64(arr: i64) -> i64",
+  "array_sum_i64(arr: i64) -> i64",
+  "array_new_f64() -> i64",
+  "array_push_f64(arr: i64, value: f64) -> void",
+  "array_get_f64(arr: i64, idx: i64) -> f64",
+  "array_set_f64(arr: i64, idx: i64, value: f64) -> void",
+  "array_pop_f64(arr: i64) -> f64",
+  "array_sum_f64(arr: i64) -> f64",
   "dict_new() -> i64",
   "dict_set(d: i64, key: str, value: str) -> void",
   "dict_get(d: i64, key: str) -> str",
+  "dict_new_i64() -> i64",
+  "dict_set_i64(d: i64, key: str, value: i64) -> void",
+  "dict_get_i64(d: i64, key: str) -> i64",
+  "dict_add_i64(d: i64, key: str, delta: i64) -> i64",
+  "dict_new_f64() -> i64",
+  "dict_set_f64(d: i64, key: str, value: f64) -> void",
+  "dict_get_f64(d: i64, key: str) -> f64",
+  "dict_add_f64(d: i64, key: str, delta: f64) -> f64",
   "option_some(value: str) -> i64",
   "option_none() -> i64",
   "result_ok(value: str) -> i64",
@@ -193,6 +226,11 @@ const builtinSignatures = [
   "np_new(n: i64) -> i64",
   "np_sum(v: i64) -> f64",
   "np_dot(a: i64, b: i64) -> f64",
+  "np_mat_new(rows: i64, cols: i64) -> i64",
+  "np_matmul(a: i64, b: i64) -> i64",
+  "np_matmul_into(a: i64, b: i64, out: i64) -> bool",
+  "np_transpose(a: i64) -> i64",
+  "np_sum_axis(a: i64, axis: i64) -> i64",
   "parse_i64(s: str) -> i64",
   "parse_f64(s: str) -> f64",
   "to_i32(x: i64) -> i32",
@@ -393,6 +431,13 @@ connection.onDidChangeConfiguration((change) => {
 
 documents.onDidClose((event) => {
   documentSettings.delete(event.document.uri);
+  if (event.document.uri.startsWith("file:")) {
+    try {
+      closeCheckServerDocument(URI.parse(event.document.uri).fsPath);
+    } catch (_err) {
+      // Nothing to release for an unparsable URI.
+    }
+  }
   validationTimers.forEach((timer, key) => {
     if (key === event.document.uri) {
       clearTimeout(timer);
@@ -1011,6 +1056,117 @@ function runCompilerCheck(lscPath, args, timeoutMs) {
   });
 }
 
+// One `lsc --serve` process per compiler path. It keeps every parsed module and each function's check result,
+// so a check after an edit only re-parses the edited buffer and re-checks the functions it affects.
+function getCheckServer(lscPath) {
+  const existing = checkServers.get(lscPath);
+  if (existing) return existing;
+  let child;
+  try {
+    child = spawn(lscPath, ["--serve"], { stdio: ["pipe", "pipe", "ignore"] });
+  } catch (_err) {
+    checkServerUnsupported.add(lscPath);
+    return null;
+  }
+  const server = { child, nextId: 1, pending: new Map(), answered: false };
+  const fail = () => {
+    if (checkServers.get(lscPath) === server) checkServers.delete(lscPath);
+    // A compiler that exits before answering anything predates --serve; stop trying it.
+    if (!server.answered) checkServerUnsupported.add(lscPath);
+    for (const entry of server.pending.values()) {
+      clearTimeout(entry.timer);
+      entry.resolve(null);
+    }
+    server.pending.clear();
+  };
+  child.on("error", fail);
+  child.on("exit", fail);
+  child.stdin.on("error", fail);
+  readline.createInterface({ input: child.stdout }).on("line", (line) => {
+    let msg;
+    try {
+      msg = JSON.parse(line);
+    } catch (_err) {
+      return;
+    }
+    const entry = msg && server.pending.get(msg.id);
+    if (!entry) return;
+    server.answered = true;
+    server.pending.delete(msg.id);
+    clearTimeout(entry.timer);
+    entry.resolve(msg.error ? null : msg.result);
+  });
+  checkServers.set(lscPath, server);
+  return server;
+}
+
+function sendCheckServer(server, method, params, timeoutMs) {
+  const msg = { jsonrpc: "2.0", method, params };
+  if (timeoutMs === undefined) {
+    server.child.stdin.write(JSON.stringify(msg) + "\n");
+    return Promise.resolve(null);
+  }
+  msg.id = server.nextId++;
+  return new Promise((resolve) => {
+    const timer = setTimeout(() => {
+      server.pending.delete(msg.id);
+      // A wedged server is restarted on the next check.
+      server.child.kill();
+      resolve(null);
+    }, timeoutMs);
+    server.pending.set(msg.id, { resolve, timer });
+    server.child.stdin.write(JSON.stringify(msg) + "\n");
+  });
+}
+
+function closeCheckServerDocument(filePath) {
+  for (const server of checkServers.values()) {
+    sendCheckServer(server, "didClose", { file: filePath });
+  }
+}
+
+// Checks the editor buffer (not the file on disk) through `lsc --serve`. Returns null when the server is not
+// usable, in which case the caller falls back to spawning `lsc --check`.
+async function runServerCheck(lscPath, filePath, text, files, timeoutMs) {
+  if (checkServerUnsupported.has(lscPath)) return null;
+  const server = getCheckServer(lscPath);
+  if (!server) return null;
+  sendCheckServer(server, "didChange", { file: filePath, text });
+  const result = await sendCheckServer(server, "check", { files }, timeoutMs);
+  if (!result || !Array.isArray(result.diagnostics)) return null;
+  const lines = text.split(/\r?\n/);
+  const self = path.resolve(filePath);
+  const diagnostics = [];
+  for (const d of result.diagnostics) {
+    const severity = d.severity === "warning" ? DiagnosticSeverity.Warning : DiagnosticSeverity.Error;
+    if (path.resolve(String(d.file || "")) !== self) {
+      diagnostics.push({
+        severity,
+        source: "lsc",
+        message: `${path.basename(String(d.file || ""))}:${d.line}:${d.col}: ${d.message}`,
+        range: {
+          start: { line: 0, character: 0 },
+          end: { line: 0, character: 1 }
+        }
+      });
+      continue;
+    }
+    const line = Math.max(0, Number(d.line) - 1);
+    const col = Math.max(0, Number(d.col) - 1);
+    const narrowed = narrowCompilerRange(String(d.message), line < lines.length ? lines[line] : "", col);
+    diagnostics.push({
+      severity,
+      source: "lsc",
+      message: String(d.message),
+      range: {
+        start: { line, character: narrowed.start },
+        end: { line, character: narrowed.end }
+      }
+    });
+  }
+  return diagnostics;
+}
+
 function normalizeHeuristicDiagnostics(diagnostics) {
   const out = [];
   for (const d of diagnostics || []) {
@@ -1064,11 +1220,20 @@ async function validateTextDocument(document, forceCompiler) {
         }
       }
 
-      const check = await runCompilerCheck(lscPath, args, Number(merged.checkTimeoutMs) || 8000);
-      const compilerDiagnostics = parseCompilerDiagnostics(check.output, document);
+      const timeoutMs = Number(merged.checkTimeoutMs) || 8000;
+      // The check server only understands extra module paths; any other extra option needs a real `--check`.
+      const extraFiles = args.slice(2).filter((a) => !a.startsWith("-") && /\.(lsc|ls)$/i.test(a));
+      const serverUsable = merged.useCheckServer !== false &&
+        args.slice(2).every((a) => a === "--max-speed" || a === "--cc" || a === merged.backendCompiler.trim() ||
+          extraFiles.includes(a));
+      const served = serverUsable
+        ? await runServerCheck(lscPath, filePath, document.getText(), [filePath, ...extraFiles], timeoutMs)
+        : null;
+      const check = served ? null : await runCompilerCheck(lscPath, args, timeoutMs);
+      const compilerDiagnostics = served || parseCompilerDiagnostics(check.output, document);
       diagnostics.push(...compilerDiagnostics);
 
-      if (!check.ok && compilerDiagnostics.length === 0) {
+      if (check && !check.ok && compilerDiagnostics.length === 0) {
         const msg = (check.output || "LineScript check failed.").split(/\r?\n/).find((x) => x && x.trim()) ||
           "LineScript check failed.";
         diagnostics.push({
@@ -1114,5 +1279,10 @@ function escapeRegex(s) {
 const FUNC_PREFIX_RE =
   "(?:(?:public|protected|private|static|virtual|override|final|inline|extern|fn|func)\\s+)*";
 
+connection.onShutdown(() => {
+  for (const server of checkServers.values()) server.child.kill();
+  checkServers.clear();
+});
+
 documents.listen(connection);
 connection.listen();